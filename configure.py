@@ -198,7 +198,7 @@ class Bootstrap:
 
 
 parser = OptionParser()
-profilers = ['gmon', 'pprof']
+profilers = ['gmon', 'pprof', 'perf']
 parser.add_option('--bootstrap', action='store_true',
                   help='bootstrap a ninja binary from nothing')
 parser.add_option('--verbose', action='store_true',
@@ -216,6 +216,9 @@ parser.add_option('--debug', action='store_true',
 parser.add_option('--profile', metavar='TYPE',
                   choices=profilers,
                   help='enable profiling (' + '/'.join(profilers) + ')',)
+parser.add_option('--usdt', action='store_true',
+                  help='add USDT probes for perf, bpftrace and SystemTap '
+                  '(needs sys/sdt.h)')
 parser.add_option('--with-gtest', metavar='PATH', help='ignored')
 parser.add_option('--with-python', metavar='EXE',
                   help='use EXE as the Python interpreter',
@@ -357,7 +360,8 @@ else:
         pass
     if platform.is_mingw():
         cflags += ['-D_WIN32_WINNT=0x0601', '-D__USE_MINGW_ANSI_STDIO=1']
-    ldflags = ['-L$builddir']
+    cflags.append('-pthread')
+    ldflags = ['-L$builddir', '-pthread']
     if platform.uses_usr_local():
         cflags.append('-I/usr/local/include')
         ldflags.append('-L/usr/local/lib')
@@ -385,6 +389,11 @@ else:
     elif options.profile == 'pprof':
         cflags.append('-fno-omit-frame-pointer')
         libs.extend(['-Wl,--no-as-needed', '-lprofiler'])
+    elif options.profile == 'perf':
+        # Frame pointers give sampling profilers call stacks cheaply.
+        cflags.append('-fno-omit-frame-pointer')
+    if options.usdt:
+        cflags.append('-DNINJA_HAVE_USDT')
 
 if platform.supports_ppoll() and not options.force_pselect:
     cflags.append('-DUSE_PPOLL')
@@ -493,11 +502,15 @@ n.comment('Core source files all build into ninja library.')
 cxxvariables = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja.pdb')]
-for name in ['build',
+for name in ['action_cache',
+             'affinity',
+             'build',
              'build_log',
              'clean',
              'clparser',
+             'critical_path',
              'debug_flags',
+             'depfile_cache',
              'depfile_parser',
              'deps_log',
              'disk_interface',
@@ -505,17 +518,30 @@ for name in ['build',
              'dyndep_parser',
              'edit_distance',
              'eval_env',
+             'failure_log',
+             'frontend',
              'graph',
              'graphviz',
+             'hash_log',
+             'jobserver',
              'lexer',
              'line_printer',
+             'log_recompaction',
+             'log_writer',
+             'manifest_cache',
              'manifest_parser',
+             'memory_stats',
              'metrics',
              'parser',
+             'pressure',
+             'regen_stamp',
+             'result_queue',
+             'scan_summary',
              'state',
              'string_piece_util',
              'util',
-             'version']:
+             'version',
+             'worker']:
     objs += cxx(name, variables=cxxvariables)
 if platform.is_windows():
     for name in ['subprocess-win32',
@@ -527,6 +553,7 @@ if platform.is_windows():
         objs += cxx('minidump-win32', variables=cxxvariables)
     objs += cc('getopt')
 else:
+    objs += cxx('server')
     objs += cxx('subprocess-posix')
 if platform.is_aix():
     objs += cc('getopt')
@@ -565,28 +592,48 @@ objs = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja_test.pdb')]
 
-for name in ['build_log_test',
+for name in ['action_cache_test',
+             'affinity_test',
+             'build_log_test',
              'build_test',
              'clean_test',
              'clparser_test',
+             'critical_path_test',
              'depfile_parser_test',
              'deps_log_test',
              'dyndep_parser_test',
              'disk_interface_test',
              'edit_distance_test',
+             'failure_log_test',
+             'frontend_test',
              'graph_test',
+             'graphviz_test',
+             'hash_log_test',
+             'hash_map_test',
+             'jobserver_test',
              'lexer_test',
+             'log_writer_test',
+             'manifest_cache_test',
              'manifest_parser_test',
+             'memory_stats_test',
              'ninja_test',
+             'pressure_test',
+             'regen_stamp_test',
+             'result_queue_test',
+             'scan_summary_test',
+             'small_vector_test',
              'state_test',
              'string_piece_util_test',
              'subprocess_test',
              'test',
-             'util_test']:
+             'util_test',
+             'worker_test']:
     objs += cxx(name, variables=cxxvariables)
 if platform.is_windows():
     for name in ['includes_normalize_test', 'msvc_helper_test']:
         objs += cxx(name, variables=cxxvariables)
+else:
+    objs += cxx('server_test', variables=cxxvariables)
 
 ninja_test = n.build(binary('ninja_test'), 'link', objs, implicit=ninja_lib,
                      variables=[('libs', libs)])
@@ -597,11 +644,14 @@ all_targets += ninja_test
 n.comment('Ancillary executables.')
 
 for name in ['build_log_perftest',
+             'build_sim_bench',
              'canon_perftest',
              'depfile_parser_perftest',
+             'graph_perftest',
              'hash_collision_bench',
              'manifest_parser_perftest',
-             'clparser_perftest']:
+             'clparser_perftest',
+             'subprocess_perftest']:
   if platform.is_msvc():
     cxxvariables = [('pdb', name + '.pdb')]
   objs = cxx(name, variables=cxxvariables)
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+
+# Copyright 2011 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Time whole ninja runs over generated builds of a few sizes.
+
+For each size this writes a build in the shape write_fake_manifests.py
+makes: compiles whose headers come from depfiles through the deps log,
+archived into libraries and linked.  The commands only write their depfile
+and touch their output, so what is timed is ninja itself.  Then it times:
+
+  full_build    the first build, from nothing
+  cold_start    a no-op build without .ninja_manifest, so the manifest is
+                parsed again
+  noop          a no-op build
+  touch_header  a build after touching one header a few hundred compiles
+                see through their depfiles
+  log_heavy     a build after touching the header every compile includes,
+                so every command is run and logged again
+
+and prints the results as JSON, which CI can keep to catch regressions.
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+SCENARIOS = ['full_build', 'cold_start', 'noop', 'touch_header', 'log_heavy']
+
+# Sources archived into each library.
+SOURCES_PER_LIB = 1000
+# Headers each compile includes, besides config.h.
+HEADERS_PER_SOURCE = 8
+
+
+def header_path(i):
+    return 'src/include/dir%d/header%d.h' % (i % 64, i)
+
+
+def write_build(root, sources):
+    """Write build.ninja and the inputs for |sources| compiles into |root|.
+    Returns the number of build edges."""
+    rng = random.Random(sources)
+    headers = max(100, sources // 100)
+    paths = ['src/config.h'] + [header_path(i) for i in range(headers)]
+    for path in paths:
+        path = os.path.join(root, path)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        open(path, 'w').close()
+
+    libs = (sources + SOURCES_PER_LIB - 1) // SOURCES_PER_LIB
+    with open(os.path.join(root, 'build.ninja'), 'w') as f:
+        f.write('rule cc\n'
+                '  command = echo "$out: $in $hdrs" > $out.d && touch $out\n'
+                '  depfile = $out.d\n'
+                '  deps = gcc\n'
+                '  description = CC $out\n'
+                'rule ar\n'
+                '  command = touch $out\n'
+                '  description = AR $out\n'
+                'rule link\n'
+                '  command = touch $out\n'
+                '  description = LINK $out\n\n')
+        for lib in range(libs):
+            objs = []
+            for i in range(lib * SOURCES_PER_LIB,
+                           min(sources, (lib + 1) * SOURCES_PER_LIB)):
+                src = 'src/dir%d/file%d.cc' % (i % 97, i)
+                path = os.path.join(root, src)
+                if i < 97:
+                    os.makedirs(os.path.dirname(path), exist_ok=True)
+                open(path, 'w').close()
+                obj = 'obj/dir%d/file%d.o' % (i % 97, i)
+                hdrs = ['src/config.h'] + [
+                    header_path(rng.randrange(headers))
+                    for _ in range(HEADERS_PER_SOURCE)]
+                f.write('build %s: cc %s\n  hdrs = %s\n' %
+                        (obj, src, ' '.join(hdrs)))
+                objs.append(obj)
+            f.write('build lib/lib%d.a: ar %s\n' % (lib, ' '.join(objs)))
+        f.write('build app: link %s\n' %
+                ' '.join('lib/lib%d.a' % lib for lib in range(libs)))
+        f.write('default app\n')
+    return sources + libs + 1
+
+
+def touch(path):
+    # Make sure the new mtime is past that of anything built before it,
+    # even where the file system only keeps whole seconds.
+    time.sleep(1)
+    os.utime(path, None)
+
+
+def run_ninja(ninja, root, jobs):
+    start = time.time()
+    p = subprocess.run([ninja, '-C', root, '-j', str(jobs)],
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    ms = (time.time() - start) * 1000
+    if p.returncode != 0:
+        sys.stderr.write(p.stdout.decode(errors='replace'))
+        raise RuntimeError('ninja failed in %s' % root)
+    return ms
+
+
+def bench(ninja, root, edges, scenarios, repeat, jobs):
+    """Run |scenarios| in the built tree at |root|, yielding a result for
+    each."""
+    def result(scenario, runs):
+        runs = sorted(runs)
+        sys.stderr.write('  %-12s min %8.1fms  median %8.1fms\n' %
+                         (scenario, runs[0], runs[len(runs) // 2]))
+        return {'edges': edges, 'scenario': scenario,
+                'runs_ms': [round(ms, 1) for ms in runs],
+                'min_ms': round(runs[0], 1),
+                'median_ms': round(runs[len(runs) // 2], 1)}
+
+    # Everything below needs the first build to have happened.
+    full = run_ninja(ninja, root, jobs)
+    if 'full_build' in scenarios:
+        yield result('full_build', [full])
+    if 'cold_start' in scenarios:
+        runs = []
+        for _ in range(repeat):
+            manifest_cache = os.path.join(root, '.ninja_manifest')
+            if os.path.exists(manifest_cache):
+                os.unlink(manifest_cache)
+            runs.append(run_ninja(ninja, root, jobs))
+        yield result('cold_start', runs)
+    if 'noop' in scenarios:
+        run_ninja(ninja, root, jobs)  # Warm the caches.
+        yield result('noop', [run_ninja(ninja, root, jobs)
+                              for _ in range(repeat)])
+    if 'touch_header' in scenarios:
+        runs = []
+        for _ in range(repeat):
+            touch(os.path.join(root, header_path(0)))
+            runs.append(run_ninja(ninja, root, jobs))
+        yield result('touch_header', runs)
+    if 'log_heavy' in scenarios:
+        touch(os.path.join(root, 'src/config.h'))
+        yield result('log_heavy', [run_ninja(ninja, root, jobs)])
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Time ninja over generated builds; print JSON results.')
+    parser.add_argument('--ninja', default='./ninja',
+                        help='ninja binary to time (default: ./ninja)')
+    parser.add_argument('--sizes', default='10000,100000,1000000',
+                        help='comma-separated numbers of compiles '
+                        '(default: 10000,100000,1000000)')
+    parser.add_argument('--scenarios', default=','.join(SCENARIOS),
+                        help='comma-separated subset of ' +
+                        ', '.join(SCENARIOS))
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='runs per scenario (default: 5)')
+    parser.add_argument('-j', '--jobs', type=int, default=os.cpu_count(),
+                        help='parallelism of the builds')
+    parser.add_argument('--dir', help='where to write the builds '
+                        '(default: a temporary directory, removed after)')
+    parser.add_argument('-o', '--output', help='write the JSON here '
+                        'instead of to stdout')
+    args = parser.parse_args()
+
+    ninja = os.path.abspath(args.ninja)
+    scenarios = args.scenarios.split(',')
+    for scenario in scenarios:
+        if scenario not in SCENARIOS:
+            parser.error('unknown scenario %r' % scenario)
+    version = subprocess.check_output([ninja, '--version']).decode().strip()
+
+    base = args.dir or tempfile.mkdtemp(prefix='ninja_bench')
+    results = []
+    try:
+        for size in [int(s) for s in args.sizes.split(',')]:
+            root = os.path.join(base, str(size))
+            if os.path.exists(root):
+                shutil.rmtree(root)
+            os.makedirs(root)
+            sys.stderr.write('%d sources: writing build\n' % size)
+            edges = write_build(root, size)
+            results.extend(bench(ninja, root, edges, scenarios,
+                                 args.repeat, args.jobs))
+    finally:
+        if not args.dir:
+            shutil.rmtree(base)
+
+    report = {
+        'ninja_version': version,
+        'platform': platform.platform(),
+        'cpus': os.cpu_count(),
+        'jobs': args.jobs,
+        'results': results,
+    }
+    text = json.dumps(report, indent=2) + '\n'
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,329 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "action_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>  // FICLONE
+#endif
+#endif
+
+#include "build_log.h"
+#include "graph.h"
+#include "metrics.h"
+
+namespace {
+
+const char kEntrySignature[] = "# ninjacache v1\n";
+
+string HexHash(uint64_t hash) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, hash);
+  return buf;
+}
+
+bool PathLess(const Node* a, const Node* b) {
+  return a->path() < b->path();
+}
+
+/// Copy the file |from| to |to|, which must not exist, sharing its blocks
+/// where the file system can.
+bool CopyFileContents(const string& from, const string& to, string* err) {
+#ifdef _WIN32
+  if (!CopyFileA(from.c_str(), to.c_str(), TRUE)) {
+    *err = GetLastErrorString();
+    return false;
+  }
+  return true;
+#else
+  int in = open(from.c_str(), O_RDONLY);
+  if (in < 0) {
+    *err = from + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(in, &st) < 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+    *err = from + ": not a regular file";
+    close(in);
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+  if (out < 0) {
+    *err = to + ": " + strerror(errno);
+    close(in);
+    return false;
+  }
+  bool ok = false;
+#ifdef FICLONE
+  ok = ioctl(out, FICLONE, in) == 0;
+#endif
+  if (!ok) {
+    char buf[64 << 10];
+    ssize_t len;
+    ok = true;
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0) {
+      if (len < 0) {
+        ok = errno == EINTR;
+        continue;
+      }
+      ok = write(out, buf, len) == len;
+    }
+    if (!ok)
+      *err = to + ": " + strerror(errno);
+  }
+  close(in);
+  if (close(out) < 0 && ok) {
+    *err = to + ": " + strerror(errno);
+    ok = false;
+  }
+  if (!ok)
+    unlink(to.c_str());
+  return ok;
+#endif
+}
+
+/// List the names of the entries of the directory |dir|, leaving out the
+/// temporary ones, which have a dot in them.
+void ListDir(const string& dir, vector<string>* names) {
+#ifdef _WIN32
+  WIN32_FIND_DATAA ffd;
+  HANDLE find_handle = FindFirstFileA((dir + "\\*").c_str(), &ffd);
+  if (find_handle == INVALID_HANDLE_VALUE)
+    return;
+  do {
+    if (!strchr(ffd.cFileName, '.'))
+      names->push_back(ffd.cFileName);
+  } while (FindNextFileA(find_handle, &ffd));
+  FindClose(find_handle);
+#else
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (struct dirent* entry = readdir(d)) {
+    if (!strchr(entry->d_name, '.'))
+      names->push_back(entry->d_name);
+  }
+  closedir(d);
+#endif
+}
+
+}  // anonymous namespace
+
+ActionCache::ActionCache(const string& dir, HashLog* hashes)
+    : dir_(dir), hashes_(hashes ? hashes : &local_hashes_) {}
+
+bool ActionCache::IsCacheable(const Edge* edge) {
+  if (edge->is_phony() || edge->use_console() ||
+      !edge->GetBindingBool(kVarCache) || edge->GetBindingBool(kVarGenerator))
+    return false;
+  // Without deps, the headers found in the depfile aren't known when the
+  // command finishes.
+  return edge->GetBinding(kVarDepfile).empty() ||
+      !edge->GetBinding(kVarDeps).empty();
+}
+
+string ActionCache::KeyDir(const Edge* edge) {
+  // The command is keyed by the hash the build log records for it, which
+  // the dirty scan has usually computed already.
+  uint64_t command_hash = edge->CommandHash();
+  string key((const char*)&command_hash, sizeof(command_hash));
+  size_t explicit_count =
+      edge->inputs_.size() - edge->implicit_deps_ - edge->order_only_deps_;
+  for (size_t i = 0; i < explicit_count; ++i) {
+    uint64_t hash;
+    if (!hashes_->GetFileHash(edge->inputs_[i]->path(), &hash))
+      return "";
+    key += edge->inputs_[i]->path();
+    key.push_back('\0');
+    key.append((const char*)&hash, sizeof(hash));
+  }
+  string hex = HexHash(BuildLog::LogEntry::HashCommand(key));
+  return dir_ + "/" + hex.substr(0, 2) + "/" + hex.substr(2);
+}
+
+bool ActionCache::Restore(const Edge* edge, string* output) {
+  METRIC_RECORD("action cache restore");
+  string key_dir = KeyDir(edge);
+  if (key_dir.empty())
+    return false;
+
+  vector<string> entries;
+  ListDir(key_dir, &entries);
+  for (vector<string>::iterator e = entries.begin(); e != entries.end(); ++e) {
+    string entry_dir = key_dir + "/" + *e;
+    string contents, err;
+    if (disk_.ReadFile(entry_dir + "/entry", &contents, &err) !=
+        FileReader::Okay)
+      continue;
+    if (contents.compare(0, sizeof(kEntrySignature) - 1,
+                         kEntrySignature) != 0)
+      continue;
+
+    // The entry matches if it has as many outputs as the edge, and each
+    // input it lists still has the hash it had.
+    bool match = true;
+    size_t output_count = 0;
+    size_t pos = sizeof(kEntrySignature) - 1;
+    while (match && pos < contents.size()) {
+      size_t end = contents.find('\n', pos);
+      if (end == string::npos)
+        end = contents.size();
+      string line = contents.substr(pos, end - pos);
+      pos = end + 1;
+      if (line.compare(0, 8, "outputs ") == 0) {
+        output_count = strtoul(line.c_str() + 8, NULL, 10);
+      } else if (line.compare(0, 6, "input ") == 0 && line.size() > 23) {
+        uint64_t hash;
+        match = hashes_->GetFileHash(line.substr(23), &hash) &&
+            HexHash(hash) == line.substr(6, 16);
+      } else {
+        match = false;
+      }
+    }
+    if (!match || output_count != edge->outputs_.size())
+      continue;
+
+    string depfile = edge->GetUnescapedDepfile();
+    string depfile_contents;
+    if (disk_.ReadFile(entry_dir + "/stdout", output, &err) !=
+        FileReader::Okay ||
+        (!depfile.empty() &&
+         disk_.ReadFile(entry_dir + "/depfile", &depfile_contents, &err) !=
+         FileReader::Okay)) {
+      Warning("action cache entry %s: %s", entry_dir.c_str(), err.c_str());
+      return false;
+    }
+    for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+      const string& path = edge->outputs_[i]->path();
+      char name[16];
+      snprintf(name, sizeof(name), "/%d", (int)i);
+      if (disk_.RemoveFile(path) < 0 ||
+          !CopyFileContents(entry_dir + name, path, &err)) {
+        Warning("restoring %s from the action cache: %s", path.c_str(),
+                err.c_str());
+        return false;
+      }
+    }
+    if (!depfile.empty() &&
+        (!disk_.MakeDirs(depfile) ||
+         !disk_.WriteFile(depfile, depfile_contents))) {
+      Warning("restoring %s from the action cache", depfile.c_str());
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool ActionCache::Store(const Edge* edge, const string& output,
+                        const string& depfile_contents,
+                        const vector<Node*>& deps, string* err) {
+  METRIC_RECORD("action cache store");
+  string key_dir = KeyDir(edge);
+  if (key_dir.empty())
+    return true;
+
+  // The entry lists the inputs besides the explicit ones, which are part
+  // of the key.
+  size_t explicit_count =
+      edge->inputs_.size() - edge->implicit_deps_ - edge->order_only_deps_;
+  vector<Node*> inputs(edge->inputs_.begin() + explicit_count,
+                       edge->inputs_.end() - edge->order_only_deps_);
+  inputs.insert(inputs.end(), deps.begin(), deps.end());
+  sort(inputs.begin(), inputs.end(), PathLess);
+  inputs.erase(unique(inputs.begin(), inputs.end()), inputs.end());
+
+  char count[32];
+  snprintf(count, sizeof(count), "outputs %d\n", (int)edge->outputs_.size());
+  string contents = string(kEntrySignature) + count;
+  for (vector<Node*>::iterator i = inputs.begin(); i != inputs.end(); ++i) {
+    uint64_t hash;
+    if (!hashes_->GetFileHash((*i)->path(), &hash))
+      return true;
+    contents += "input " + HexHash(hash) + " " + (*i)->path() + "\n";
+  }
+
+  string entry_dir =
+      key_dir + "/" + HexHash(BuildLog::LogEntry::HashCommand(contents));
+  string err_unused;
+  if (disk_.Stat(entry_dir, &err_unused) > 0)
+    return true;
+
+  // Fill a temporary directory and move it into place, so that other
+  // builds sharing the cache never see a partial entry.
+#ifdef _WIN32
+  int pid = GetCurrentProcessId();
+#else
+  int pid = getpid();
+#endif
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp%d", pid);
+  string temp_dir = entry_dir + suffix;
+  bool has_depfile = !edge->GetUnescapedDepfile().empty();
+  bool ok = disk_.MakeDirs(temp_dir + "/entry") &&
+      disk_.WriteFile(temp_dir + "/stdout", output) &&
+      (!has_depfile ||
+       disk_.WriteFile(temp_dir + "/depfile", depfile_contents));
+  if (!ok)
+    *err = "can't write " + temp_dir;
+  size_t copied = 0;
+  for (; ok && copied < edge->outputs_.size(); ++copied) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", (int)copied);
+    ok = CopyFileContents(edge->outputs_[copied]->path(), temp_dir + name,
+                          err);
+  }
+  if (ok && !disk_.WriteFile(temp_dir + "/entry", contents)) {
+    *err = "can't write " + temp_dir + "/entry";
+    ok = false;
+  }
+  if (ok && rename(temp_dir.c_str(), entry_dir.c_str()) == 0)
+    return true;
+  int rename_errno = errno;
+
+  // Another build may have stored the same entry meanwhile.
+  bool stored = disk_.Stat(entry_dir, &err_unused) > 0;
+  for (size_t i = 0; i < copied; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", (int)i);
+    unlink((temp_dir + name).c_str());
+  }
+  unlink((temp_dir + "/entry").c_str());
+  unlink((temp_dir + "/stdout").c_str());
+  unlink((temp_dir + "/depfile").c_str());
+#ifdef _WIN32
+  RemoveDirectoryA(temp_dir.c_str());
+#else
+  rmdir(temp_dir.c_str());
+#endif
+  if (ok && !stored)
+    *err = temp_dir + ": " + strerror(rename_errno);
+  return stored;
+}
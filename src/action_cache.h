@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ACTION_CACHE_H_
+#define NINJA_ACTION_CACHE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+#include "hash_log.h"
+
+struct Edge;
+struct Node;
+
+/// A directory of the outputs of earlier runs of the edges with cache set,
+/// which ninja restores instead of running the command again.
+///
+/// Entries are found by the hash of the command and the contents of the
+/// explicit inputs.  Each one lists the other inputs the command read,
+/// including those found through its deps, with the hashes they had; it
+/// only matches when all of them still have those contents.  There can be
+/// several entries for the same key, one for each version of the headers.
+///
+/// An entry holds copies of the outputs, the depfile and the output of the
+/// command, before ninja filtered it, so that finishing a restored edge
+/// works just as it does after running the command.  Files are copied by
+/// reflink where the file system can, so that they share their blocks.
+struct ActionCache {
+  /// Use the cache in |dir|, hashing files with |hashes|, or a private
+  /// HashLog if that's NULL.
+  ActionCache(const string& dir, HashLog* hashes);
+
+  /// Whether |edge| may be restored from the cache and stored in it.
+  static bool IsCacheable(const Edge* edge);
+
+  /// Restore the outputs of |edge| from a matching entry, if there is
+  /// one, and fill in |output| with what the command printed.  Returns
+  /// false if there's none, or it couldn't be restored.
+  bool Restore(const Edge* edge, string* output);
+
+  /// Store the outputs of |edge| after running its command, which printed
+  /// |output|, wrote |depfile_contents| to the depfile, if the edge has
+  /// one, and read |deps| along with the edge's inputs.  Returns false if
+  /// they couldn't all be stored, in which case nothing is.
+  bool Store(const Edge* edge, const string& output,
+             const string& depfile_contents, const vector<Node*>& deps,
+             string* err);
+
+ private:
+  /// The directory of the entries for the command and explicit inputs of
+  /// |edge|, or "" if an input can't be read.
+  string KeyDir(const Edge* edge);
+
+  string dir_;
+  HashLog* hashes_;
+  HashLog local_hashes_;
+  RealDiskInterface disk_;
+};
+
+#endif  // NINJA_ACTION_CACHE_H_
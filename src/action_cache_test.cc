@@ -0,0 +1,136 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "action_cache.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct ActionCacheTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-ActionCacheTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  string Contents(const string& path) {
+    string contents, err;
+    disk_.ReadFile(path, &contents, &err);
+    return contents;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(ActionCacheTest, IsCacheable) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cached\n"
+"  command = cc $in\n"
+"  cache = 1\n"
+"rule depfile\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"  cache = 1\n"
+"rule deps\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"  cache = 1\n"
+"build a: cached in\n"
+"build b: cat in\n"
+"build c: depfile in\n"
+"build d: deps in\n"
+"build e: phony in\n"));
+  EXPECT_TRUE(ActionCache::IsCacheable(GetNode("a")->in_edge()));
+  EXPECT_FALSE(ActionCache::IsCacheable(GetNode("b")->in_edge()));
+  EXPECT_FALSE(ActionCache::IsCacheable(GetNode("c")->in_edge()));
+  EXPECT_TRUE(ActionCache::IsCacheable(GetNode("d")->in_edge()));
+  EXPECT_FALSE(ActionCache::IsCacheable(GetNode("e")->in_edge()));
+}
+
+TEST_F(ActionCacheTest, StoreAndRestore) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in > $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"  cache = 1\n"
+"build out: cc in | imp\n"));
+  ASSERT_TRUE(disk_.WriteFile("in", "in"));
+  ASSERT_TRUE(disk_.WriteFile("imp", "imp"));
+  ASSERT_TRUE(disk_.WriteFile("in.h", "header"));
+  ASSERT_TRUE(disk_.WriteFile("out", "result"));
+  Edge* edge = GetNode("out")->in_edge();
+  vector<Node*> deps;
+  deps.push_back(GetNode("in.h"));
+
+  ActionCache cache("cache", NULL);
+  string err;
+  ASSERT_TRUE(cache.Store(edge, "printed", "out: in in.h\n", deps, &err));
+  EXPECT_EQ("", err);
+
+  disk_.RemoveFile("out");
+  string output;
+  ASSERT_TRUE(cache.Restore(edge, &output));
+  EXPECT_EQ("printed", output);
+  EXPECT_EQ("result", Contents("out"));
+  EXPECT_EQ("out: in in.h\n", Contents("out.d"));
+
+  // A changed implicit input or header misses, until it's changed back.
+  ASSERT_TRUE(disk_.WriteFile("imp", "changed"));
+  EXPECT_FALSE(cache.Restore(edge, &output));
+  ASSERT_TRUE(disk_.WriteFile("imp", "imp"));
+  ASSERT_TRUE(disk_.WriteFile("in.h", "changed"));
+  EXPECT_FALSE(cache.Restore(edge, &output));
+  ASSERT_TRUE(disk_.WriteFile("in.h", "header"));
+  EXPECT_TRUE(cache.Restore(edge, &output));
+
+  // So does a changed explicit input.
+  ASSERT_TRUE(disk_.WriteFile("in", "changed"));
+  EXPECT_FALSE(cache.Restore(edge, &output));
+}
+
+TEST_F(ActionCacheTest, SeveralEntries) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in > $out\n"
+"  cache = 1\n"
+"build out: cc in | imp\n"));
+  ASSERT_TRUE(disk_.WriteFile("in", "in"));
+  Edge* edge = GetNode("out")->in_edge();
+
+  ActionCache cache("cache", NULL);
+  string err;
+  ASSERT_TRUE(disk_.WriteFile("imp", "one"));
+  ASSERT_TRUE(disk_.WriteFile("out", "result one"));
+  ASSERT_TRUE(cache.Store(edge, "", "", vector<Node*>(), &err));
+  ASSERT_TRUE(disk_.WriteFile("imp", "two"));
+  ASSERT_TRUE(disk_.WriteFile("out", "result two"));
+  ASSERT_TRUE(cache.Store(edge, "", "", vector<Node*>(), &err));
+
+  string output;
+  ASSERT_TRUE(disk_.WriteFile("imp", "one"));
+  ASSERT_TRUE(cache.Restore(edge, &output));
+  EXPECT_EQ("result one", Contents("out"));
+  ASSERT_TRUE(disk_.WriteFile("imp", "two"));
+  ASSERT_TRUE(cache.Restore(edge, &output));
+  EXPECT_EQ("result two", Contents("out"));
+}
+
+}  // anonymous namespace
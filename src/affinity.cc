@@ -0,0 +1,210 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// For sched_getaffinity() and the CPU_* macros.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "affinity.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#endif
+#include <stdlib.h>
+
+#include "util.h"
+
+bool ParseCpuList(const string& list, vector<int>* cpus) {
+  const char* p = list.c_str();
+  while (*p && *p != '\n') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0)
+      return false;
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first)
+        return false;
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; ++cpu)
+      cpus->push_back((int)cpu);
+    if (*p == ',')
+      ++p;
+    else if (*p && *p != '\n')
+      return false;
+  }
+  return true;
+}
+
+#ifdef __linux__
+
+namespace {
+
+bool GetThreadCpus(vector<int>* cpus) {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) < 0)
+    return false;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set))
+      cpus->push_back(cpu);
+  }
+  return true;
+}
+
+bool SetThreadCpus(const vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (vector<int>::const_iterator cpu = cpus.begin(); cpu != cpus.end();
+       ++cpu) {
+    if (*cpu < CPU_SETSIZE)
+      CPU_SET(*cpu, &set);
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+}  // anonymous namespace
+
+ScopedAffinity::ScopedAffinity(const AffinitySlot* slot) : pinned_(false) {
+  if (!slot || slot->cpus.empty() || !GetThreadCpus(&saved_))
+    return;
+  pinned_ = SetThreadCpus(slot->cpus);
+}
+
+ScopedAffinity::~ScopedAffinity() {
+  if (pinned_)
+    SetThreadCpus(saved_);
+}
+
+bool AffinitySlots::Init(Mode mode, string* err) {
+  vector<int> cpus;
+  if (!GetThreadCpus(&cpus)) {
+    *err = string("sched_getaffinity: ") + strerror(errno);
+    return false;
+  }
+
+  // Without NUMA, or without sysfs, all the CPUs are on node 0.
+  vector<int> cpu_nodes;
+  if (DIR* dir = opendir("/sys/devices/system/node")) {
+    while (dirent* entry = readdir(dir)) {
+      int node;
+      char extra;
+      if (sscanf(entry->d_name, "node%d%c", &node, &extra) != 1)
+        continue;
+      string list, read_err;
+      vector<int> node_cpus;
+      if (ReadFile(string("/sys/devices/system/node/") + entry->d_name +
+                       "/cpulist", &list, &read_err) < 0 ||
+          !ParseCpuList(list, &node_cpus))
+        continue;
+      for (vector<int>::iterator cpu = node_cpus.begin();
+           cpu != node_cpus.end(); ++cpu) {
+        if ((size_t)*cpu >= cpu_nodes.size())
+          cpu_nodes.resize(*cpu + 1);
+        cpu_nodes[*cpu] = node;
+      }
+    }
+    closedir(dir);
+  }
+
+  vector<int> nodes;
+  for (vector<int>::iterator cpu = cpus.begin(); cpu != cpus.end(); ++cpu)
+    nodes.push_back((size_t)*cpu < cpu_nodes.size() ? cpu_nodes[*cpu] : 0);
+  Assign(mode, cpus, nodes);
+  return true;
+}
+
+#else  // !__linux__
+
+ScopedAffinity::ScopedAffinity(const AffinitySlot* slot) : pinned_(false) {}
+
+ScopedAffinity::~ScopedAffinity() {}
+
+bool AffinitySlots::Init(Mode mode, string* err) {
+  *err = "not supported on this platform";
+  return false;
+}
+
+#endif  // __linux__
+
+void AffinitySlots::Assign(Mode mode, const vector<int>& cpus,
+                           const vector<int>& nodes) {
+  slots_.clear();
+  group_nodes_.clear();
+  slots_.resize(cpus.size());
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    AffinitySlot* slot = &slots_[i];
+    slot->number = (int)i;
+    slot->node = nodes[i];
+    if (mode == CPU) {
+      slot->cpus.push_back(cpus[i]);
+      continue;
+    }
+    for (size_t j = 0; j < cpus.size(); ++j) {
+      if (nodes[j] == nodes[i])
+        slot->cpus.push_back(cpus[j]);
+    }
+  }
+}
+
+AffinitySlot* AffinitySlots::Acquire(const void* group) {
+  map<int, int> free_by_node;
+  for (vector<AffinitySlot>::iterator s = slots_.begin(); s != slots_.end();
+       ++s) {
+    if (!s->busy)
+      ++free_by_node[s->node];
+  }
+  if (free_by_node.empty())
+    return NULL;
+
+  int node = -1;
+  map<const void*, int>::iterator last = group_nodes_.end();
+  if (group) {
+    last = group_nodes_.find(group);
+    if (last != group_nodes_.end() && free_by_node.count(last->second))
+      node = last->second;
+  }
+  if (node < 0) {
+    int most = 0;
+    for (map<int, int>::iterator n = free_by_node.begin();
+         n != free_by_node.end(); ++n) {
+      if (n->second > most) {
+        most = n->second;
+        node = n->first;
+      }
+    }
+  }
+
+  for (vector<AffinitySlot>::iterator s = slots_.begin(); s != slots_.end();
+       ++s) {
+    if (!s->busy && s->node == node) {
+      s->busy = true;
+      if (group)
+        group_nodes_[group] = node;
+      return &*s;
+    }
+  }
+  return NULL;  // Not reached.
+}
+
+void AffinitySlots::Release(AffinitySlot* slot) {
+  slot->busy = false;
+}
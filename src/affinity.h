@@ -0,0 +1,86 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_AFFINITY_H_
+#define NINJA_AFFINITY_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+/// Parse a Linux CPU list like "0-3,8,10-11", as in
+/// /sys/devices/system/node/node0/cpulist, into |cpus|.  Returns false if
+/// it isn't one.
+bool ParseCpuList(const string& list, vector<int>* cpus);
+
+/// A numbered place for a running command: the CPUs it is pinned to, and
+/// the NUMA node they are on.  The command sees the number as $NINJA_SLOT.
+struct AffinitySlot {
+  AffinitySlot() : number(0), node(0), busy(false) {}
+  int number;
+  int node;
+  /// Empty if the command isn't pinned.
+  vector<int> cpus;
+  bool busy;
+};
+
+/// Pins the calling thread to the CPUs of a slot for as long as it lives,
+/// so that the processes it spawns meanwhile start out on them, and keep
+/// them.  Does nothing for a slot without CPUs, or where the OS can't pin.
+struct ScopedAffinity {
+  explicit ScopedAffinity(const AffinitySlot* slot);
+  ~ScopedAffinity();
+
+ private:
+  /// The CPUs the thread ran on before, if it was pinned.
+  vector<int> saved_;
+  bool pinned_;
+};
+
+/// One slot for each CPU ninja may run on, which running commands take
+/// and give back.  A slot pins its command to its CPU, or to all the CPUs
+/// of its NUMA node, so that the command doesn't lose its caches moving
+/// between them.  Commands of a group, like a pool, go to the node the
+/// last one went to while it has a free slot; others go to the node with
+/// the most free slots.
+struct AffinitySlots {
+  enum Mode {
+    /// Pin each command to one CPU.
+    CPU,
+    /// Pin each command to the CPUs of one node.
+    NODE
+  };
+
+  /// Make the slots for the CPUs this process may run on.  Returns false
+  /// if the OS can't say which those are, or can't pin.
+  bool Init(Mode mode, string* err);
+
+  /// Make a slot for each of |cpus|, which are on |nodes|.
+  void Assign(Mode mode, const vector<int>& cpus, const vector<int>& nodes);
+
+  /// Take a free slot for a command of |group|, which may be NULL for no
+  /// group.  Returns NULL if all are busy.
+  AffinitySlot* Acquire(const void* group);
+  void Release(AffinitySlot* slot);
+
+  size_t size() const { return slots_.size(); }
+
+ private:
+  vector<AffinitySlot> slots_;
+  /// The node the last command of each group went to.
+  map<const void*, int> group_nodes_;
+};
+
+#endif  // NINJA_AFFINITY_H_
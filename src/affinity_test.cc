@@ -0,0 +1,103 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "affinity.h"
+
+#include "test.h"
+
+namespace {
+
+TEST(AffinityTest, ParseCpuList) {
+  vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  ASSERT_EQ(7u, cpus.size());
+  EXPECT_EQ(0, cpus[0]);
+  EXPECT_EQ(3, cpus[3]);
+  EXPECT_EQ(8, cpus[4]);
+  EXPECT_EQ(11, cpus[6]);
+
+  cpus.clear();
+  EXPECT_TRUE(ParseCpuList("\n", &cpus));
+  EXPECT_TRUE(cpus.empty());
+
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("0,x", &cpus));
+}
+
+/// Four CPUs on two nodes.
+struct AffinitySlotsTest : public testing::Test {
+  void Assign(AffinitySlots::Mode mode) {
+    vector<int> cpus, nodes;
+    for (int i = 0; i < 4; ++i) {
+      cpus.push_back(i * 2);
+      nodes.push_back(i / 2);
+    }
+    slots_.Assign(mode, cpus, nodes);
+  }
+
+  AffinitySlots slots_;
+};
+
+TEST_F(AffinitySlotsTest, Cpu) {
+  Assign(AffinitySlots::CPU);
+  ASSERT_EQ(4u, slots_.size());
+
+  // Commands without a group spread over the nodes.
+  AffinitySlot* a = slots_.Acquire(NULL);
+  AffinitySlot* b = slots_.Acquire(NULL);
+  ASSERT_TRUE(a && b);
+  EXPECT_NE(a->node, b->node);
+  ASSERT_EQ(1u, a->cpus.size());
+  ASSERT_EQ(1u, b->cpus.size());
+  EXPECT_NE(a->cpus[0], b->cpus[0]);
+  EXPECT_NE(a->number, b->number);
+
+  EXPECT_TRUE(slots_.Acquire(NULL));
+  EXPECT_TRUE(slots_.Acquire(NULL));
+  EXPECT_FALSE(slots_.Acquire(NULL));
+
+  slots_.Release(b);
+  EXPECT_EQ(b, slots_.Acquire(NULL));
+}
+
+TEST_F(AffinitySlotsTest, Node) {
+  Assign(AffinitySlots::NODE);
+  AffinitySlot* a = slots_.Acquire(NULL);
+  ASSERT_TRUE(a);
+  ASSERT_EQ(2u, a->cpus.size());
+  EXPECT_EQ(a->node * 4, a->cpus[0]);
+  EXPECT_EQ(a->node * 4 + 2, a->cpus[1]);
+}
+
+TEST_F(AffinitySlotsTest, Group) {
+  Assign(AffinitySlots::CPU);
+  int group;
+
+  // The group's commands follow its first one while its node has room.
+  AffinitySlot* a = slots_.Acquire(&group);
+  AffinitySlot* b = slots_.Acquire(&group);
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ(a->node, b->node);
+
+  // Then they go elsewhere, and follow that.
+  AffinitySlot* c = slots_.Acquire(&group);
+  ASSERT_TRUE(c);
+  EXPECT_NE(a->node, c->node);
+  slots_.Release(a);
+  AffinitySlot* d = slots_.Acquire(&group);
+  ASSERT_TRUE(d);
+  EXPECT_EQ(c->node, d->node);
+}
+
+}  // anonymous namespace
@@ -0,0 +1,181 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include "string_piece.h"
+
+/// Storage for many objects of type T, handed out from large blocks so
+/// that objects made one after the other sit next to each other, and
+/// freed all at once when the arena is.  Objects are built in place:
+///   T* t = new (arena.Allocate()) T(...);
+/// and the arena runs their destructors in Clear().  Every slot handed out
+/// must have had an object constructed in it by then.
+template <typename T, size_t kBlockSize = 1024>
+struct ObjectArena {
+  ObjectArena() : used_(kBlockSize) {}
+  ~ObjectArena() { Clear(); }
+
+  /// Room for one more T.
+  void* Allocate() {
+    if (used_ == kBlockSize) {
+      blocks_.push_back(static_cast<T*>(malloc(sizeof(T) * kBlockSize)));
+      if (!blocks_.back())
+        abort();
+      used_ = 0;
+    }
+    return blocks_.back() + used_++;
+  }
+
+  /// Destroy all the objects and free the blocks.
+  void Clear() {
+    for (size_t b = 0; b < blocks_.size(); ++b) {
+      size_t count = b + 1 == blocks_.size() ? used_ : kBlockSize;
+      for (size_t i = 0; i < count; ++i)
+        blocks_[b][i].~T();
+      free(blocks_[b]);
+    }
+    blocks_.clear();
+    used_ = kBlockSize;
+  }
+
+  /// The blocks, in the order their slots were handed out.
+  const vector<T*>& blocks() const { return blocks_; }
+
+ private:
+  vector<T*> blocks_;
+  size_t used_;  ///< Slots handed out from the last block.
+
+  ObjectArena(const ObjectArena&);
+  void operator=(const ObjectArena&);
+};
+
+/// Numbers the objects of an ObjectArena densely, in the order they were
+/// made, so that what a walk over them needs to remember of each can be
+/// kept in a vector rather than a set.  A number is found by a binary
+/// search of the arena's blocks, which is looked over again when an
+/// object turns up from a block made since.
+template <typename T, size_t kBlockSize = 1024>
+struct ObjectNumbering {
+  explicit ObjectNumbering(const ObjectArena<T, kBlockSize>& arena)
+      : arena_(arena) {}
+
+  /// The number of |object|, which must be one of the arena's.
+  size_t Number(const T* object) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(object);
+    size_t number;
+    if (!Find(address, &number)) {
+      Update();
+      if (!Find(address, &number))
+        abort();
+    }
+    return number;
+  }
+
+ private:
+  bool Find(uintptr_t address, size_t* number) const {
+    Starts::const_iterator i = upper_bound(
+        starts_.begin(), starts_.end(), make_pair(address, (size_t)-1));
+    if (i == starts_.begin())
+      return false;
+    --i;
+    size_t offset = (address - i->first) / sizeof(T);
+    if (offset >= kBlockSize)
+      return false;
+    *number = i->second * kBlockSize + offset;
+    return true;
+  }
+
+  void Update() {
+    starts_.clear();
+    for (size_t b = 0; b < arena_.blocks().size(); ++b) {
+      starts_.push_back(
+          make_pair(reinterpret_cast<uintptr_t>(arena_.blocks()[b]), b));
+    }
+    sort(starts_.begin(), starts_.end());
+  }
+
+  /// The address each block starts at, and its index, by address.
+  typedef vector<pair<uintptr_t, size_t> > Starts;
+  Starts starts_;
+  const ObjectArena<T, kBlockSize>& arena_;
+};
+
+/// Storage for copies of many strings, packed into large blocks and freed
+/// all at once when the arena is.  The copies never move.
+struct StringArena {
+  StringArena() : used_(kBlockSize), bytes_(0) {}
+  ~StringArena() { Clear(); }
+
+  /// Copy |str| into the arena.
+  StringPiece Copy(StringPiece str) {
+    if (str.empty())
+      return StringPiece();
+    char* copy;
+    if (str.len_ > kBlockSize / 4) {
+      // Big strings get blocks of their own, behind the one being filled.
+      copy = static_cast<char*>(malloc(str.len_));
+      if (!copy)
+        abort();
+      blocks_.insert(blocks_.end() - (blocks_.empty() ? 0 : 1), copy);
+      bytes_ += str.len_;
+    } else {
+      if (kBlockSize - used_ < str.len_) {
+        blocks_.push_back(static_cast<char*>(malloc(kBlockSize)));
+        if (!blocks_.back())
+          abort();
+        used_ = 0;
+        bytes_ += kBlockSize;
+      }
+      copy = blocks_.back() + used_;
+      used_ += str.len_;
+    }
+    memcpy(copy, str.str_, str.len_);
+    return StringPiece(copy, str.len_);
+  }
+
+  /// Free all the copies.
+  void Clear() {
+    for (size_t b = 0; b < blocks_.size(); ++b)
+      free(blocks_[b]);
+    blocks_.clear();
+    used_ = kBlockSize;
+    bytes_ = 0;
+  }
+
+  /// The size of all the blocks.
+  size_t bytes() const { return bytes_; }
+
+ private:
+  static const size_t kBlockSize = 64 * 1024;
+
+  vector<char*> blocks_;
+  size_t used_;  ///< Bytes handed out from the last block.
+  size_t bytes_;
+
+  StringArena(const StringArena&);
+  void operator=(const StringArena&);
+};
+
+#endif  // NINJA_ARENA_H_
@@ -29,10 +29,12 @@ except ImportError:
     import BaseHTTPServer as httpserver
     import SocketServer as socketserver
 import argparse
+import json
 import os
 import socket
 import subprocess
 import sys
+import threading
 import webbrowser
 if sys.version_info >= (3, 2):
     from html import escape
@@ -59,50 +61,18 @@ Node = namedtuple('Node', ['inputs', 'rule', 'target', 'outputs'])
 # This means there's no single view that shows you all inputs and outputs
 # of an edge.  But I think it's less confusing than alternatives.
 
-def match_strip(line, prefix):
-    if not line.startswith(prefix):
-        return (False, line)
-    return (True, line[len(prefix):])
-
 def html_escape(text):
     return escape(text, quote=True)
 
-def parse(text):
-    lines = iter(text.split('\n'))
-
-    target = None
-    rule = None
+def parse(query):
     inputs = []
-    outputs = []
-
-    try:
-        target = next(lines)[:-1]  # strip trailing colon
-
-        line = next(lines)
-        (match, rule) = match_strip(line, '  input: ')
-        if match:
-            (match, line) = match_strip(next(lines), '    ')
-            while match:
-                type = None
-                (match, line) = match_strip(line, '| ')
-                if match:
-                    type = 'implicit'
-                (match, line) = match_strip(line, '|| ')
-                if match:
-                    type = 'order-only'
-                inputs.append((line, type))
-                (match, line) = match_strip(next(lines), '    ')
-
-        match, _ = match_strip(line, '  outputs:')
-        if match:
-            (match, line) = match_strip(next(lines), '    ')
-            while match:
-                outputs.append(line)
-                (match, line) = match_strip(next(lines), '    ')
-    except StopIteration:
-        pass
-
-    return Node(inputs, rule, target, outputs)
+    rule = None
+    if 'input' in query:
+        rule = query['input']['rule']
+        for type, key in ((None, 'explicit'), ('implicit', 'implicit'),
+                          ('order-only', 'order_only')):
+            inputs += [(path, type) for path in query['input'][key]]
+    return Node(inputs, rule, query['target'], query['outputs'])
 
 def create_page(body):
     return '''<!DOCTYPE html>
@@ -158,11 +128,33 @@ def generate_html(node):
 
     return '\n'.join(document)
 
-def ninja_dump(target):
-    cmd = [args.ninja_command, '-f', args.f, '-t', 'query', target]
-    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
-                            universal_newlines=True)
-    return proc.communicate() + (proc.returncode,)
+class Query(object):
+    """A ninja answering queries on its stdin for as long as we run, so that
+    the build files are only loaded once."""
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.proc = None
+
+    def __call__(self, target):
+        """Returns the JSON of -t query for target, or raises an OSError."""
+        with self.lock:
+            if self.proc is None or self.proc.poll() is not None:
+                cmd = [args.ninja_command, '-f', args.f, '-t', 'query', '-']
+                self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE,
+                                             stdout=subprocess.PIPE,
+                                             universal_newlines=True)
+            try:
+                self.proc.stdin.write(target + '\n')
+                self.proc.stdin.flush()
+                line = self.proc.stdout.readline()
+            except (IOError, OSError):
+                line = ''
+            if not line:
+                self.proc = None
+                raise OSError('ninja -t query exited')
+            return json.loads(line)
+
+ninja_query = Query()
 
 class RequestHandler(httpserver.BaseHTTPRequestHandler):
     def do_GET(self):
@@ -181,12 +173,15 @@ class RequestHandler(httpserver.BaseHTTPRequestHandler):
             return
         target = target[1:]
 
-        ninja_output, ninja_error, exit_code = ninja_dump(target)
-        if exit_code == 0:
-            page_body = generate_html(parse(ninja_output.strip()))
+        try:
+            query = ninja_query(target)
+        except OSError as e:
+            query = {'error': str(e)}
+        if 'error' not in query:
+            page_body = generate_html(parse(query))
         else:
             # Relay ninja's error message.
-            page_body = '<h1><tt>%s</tt></h1>' % html_escape(ninja_error)
+            page_body = '<h1><tt>%s</tt></h1>' % html_escape(query['error'])
 
         self.send_response(200)
         self.end_headers()
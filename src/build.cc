@@ -16,9 +16,14 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
 
 #ifdef _WIN32
 #include <fcntl.h>
@@ -29,19 +34,33 @@
 #include <sys/termios.h>
 #endif
 
+#include "action_cache.h"
+#include "affinity.h"
 #include "build_log.h"
 #include "clparser.h"
 #include "debug_flags.h"
 #include "depfile_parser.h"
 #include "deps_log.h"
 #include "disk_interface.h"
+#include "failure_log.h"
 #include "graph.h"
+#include "hash.h"
+#include "hash_log.h"
+#include "jobserver.h"
+#include "metrics.h"
+#include "pressure.h"
+#include "probes.h"
 #include "state.h"
 #include "subprocess.h"
 #include "util.h"
 
 namespace {
 
+/// The most bytes Builder::PrefetchInputs() keeps read ahead for edges that
+/// haven't started, so that a wide build doesn't push out of the page cache
+/// what it has just read for the edges that run next.
+const int64_t kPrefetchBytes = 256 << 20;
+
 /// A CommandRunner that doesn't actually run the commands.
 struct DryRunCommandRunner : public CommandRunner {
   virtual ~DryRunCommandRunner() {}
@@ -74,13 +93,22 @@ bool DryRunCommandRunner::WaitForCommand(Result* result) {
    return true;
 }
 
+/// Append the rest of the command output in |spill| to |output|.
+void AppendSpill(FILE* spill, string* output) {
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), spill)) > 0)
+    output->append(buf, len);
+}
+
 }  // namespace
 
 BuildStatus::BuildStatus(const BuildConfig& config)
-    : config_(config),
+    : config_(config), refresh_millis_(50), last_status_millis_(0),
+      pending_status_edge_(NULL), pending_status_(kEdgeStarted),
       start_time_millis_(GetTimeMillis()),
       started_edges_(0), finished_edges_(0), total_edges_(0),
-      progress_status_format_(NULL),
+      frontend_(config.frontend_fd), progress_status_format_(NULL),
       overall_rate_(), current_rate_(config.parallelism) {
 
   // Don't do anything fancy in verbose mode.
@@ -90,20 +118,38 @@ BuildStatus::BuildStatus(const BuildConfig& config)
   progress_status_format_ = getenv("NINJA_STATUS");
   if (!progress_status_format_)
     progress_status_format_ = "[%f/%t] ";
+
+  if (const char* refresh = getenv("NINJA_STATUS_REFRESH_MILLIS")) {
+    char* end;
+    long value = strtol(refresh, &end, 10);
+    if (*end == '\0' && end != refresh && value >= 0)
+      refresh_millis_ = value;
+  }
 }
 
 void BuildStatus::PlanHasTotalEdges(int total) {
   total_edges_ = total;
+  if (config_.frontend_fd >= 0)
+    frontend_.TotalEdges(total);
 }
 
-void BuildStatus::BuildEdgeStarted(const Edge* edge) {
+void BuildStatus::BuildEdgeStarted(const Edge* edge, int count) {
   assert(running_edges_.find(edge) == running_edges_.end());
   int start_time = (int)(GetTimeMillis() - start_time_millis_);
   running_edges_.insert(make_pair(edge, start_time));
-  ++started_edges_;
+  started_edges_ += count;
+  if (g_tracer) {
+    traced_edges_[edge] =
+        make_pair(g_tracer->AcquireJobLane(), GetTimeMicros());
+  }
+
+  if (config_.frontend_fd >= 0) {
+    frontend_.EdgeStarted(edge, start_time);
+    return;
+  }
 
   if (edge->use_console() || printer_.is_smart_terminal())
-    PrintStatus(edge, kEdgeStarted);
+    PrintStatus(edge, kEdgeStarted, edge->use_console());
 
   if (edge->use_console())
     printer_.SetConsoleLocked(true);
@@ -112,30 +158,54 @@ void BuildStatus::BuildEdgeStarted(const Edge* edge) {
 void BuildStatus::BuildEdgeFinished(Edge* edge,
                                     bool success,
                                     const string& output,
+                                    FILE* output_spill,
                                     int* start_time,
-                                    int* end_time) {
+                                    int* end_time,
+                                    int count) {
   int64_t now = GetTimeMillis();
 
-  ++finished_edges_;
+  finished_edges_ += count;
 
   RunningEdgeMap::iterator i = running_edges_.find(edge);
   *start_time = i->second;
   *end_time = (int)(now - start_time_millis_);
   running_edges_.erase(i);
 
+  if (g_tracer) {
+    TracedEdgeMap::iterator traced = traced_edges_.find(edge);
+    g_tracer->Slice(edge->outputs_[0]->path(), edge->rule().name().c_str(),
+                    traced->second.first, traced->second.second,
+                    GetTimeMicros());
+    g_tracer->ReleaseJobLane(traced->second.first);
+    traced_edges_.erase(traced);
+  }
+
+  if (config_.frontend_fd >= 0) {
+    if (output_spill) {
+      string all_output = output;
+      AppendSpill(output_spill, &all_output);
+      frontend_.EdgeFinished(edge, *end_time, success, all_output);
+    } else {
+      frontend_.EdgeFinished(edge, *end_time, success, output);
+    }
+    return;
+  }
+
   if (edge->use_console())
     printer_.SetConsoleLocked(false);
 
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
+  // The status line of a command with output stays above the output.
   if (!edge->use_console())
-    PrintStatus(edge, kEdgeFinished);
+    PrintStatus(edge, kEdgeFinished,
+                !success || !output.empty() || output_spill);
 
   // Print the command that is spewing before printing its output.
   if (!success) {
     string outputs;
-    for (vector<Node*>::const_iterator o = edge->outputs_.begin();
+    for (Node* const* o = edge->outputs_.begin();
          o != edge->outputs_.end(); ++o)
       outputs += (*o)->path() + " ";
 
@@ -147,30 +217,13 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
     printer_.PrintOnNewLine(edge->EvaluateCommand() + "\n");
   }
 
-  if (!output.empty()) {
-    // ninja sets stdout and stderr of subprocesses to a pipe, to be able to
-    // check if the output is empty. Some compilers, e.g. clang, check
-    // isatty(stderr) to decide if they should print colored output.
-    // To make it possible to use colored output with ninja, subprocesses should
-    // be run with a flag that forces them to always print color escape codes.
-    // To make sure these escape codes don't show up in a file if ninja's output
-    // is piped to a file, ninja strips ansi escape codes again if it's not
-    // writing to a |smart_terminal_|.
-    // (Launching subprocesses in pseudo ttys doesn't work because there are
-    // only a few hundred available on some systems, and ninja can launch
-    // thousands of parallel compile commands.)
-    string final_output;
-    if (!printer_.supports_color())
-      final_output = StripAnsiEscapeCodes(output);
-    else
-      final_output = output;
-
+  if (!output.empty() || output_spill) {
 #ifdef _WIN32
     // Fix extra CR being added on Windows, writing out CR CR LF (#773)
     _setmode(_fileno(stdout), _O_BINARY);  // Begin Windows extra CR fix
 #endif
 
-    printer_.PrintOnNewLine(final_output);
+    PrintCommandOutput(output, output_spill);
 
 #ifdef _WIN32
     _setmode(_fileno(stdout), _O_TEXT);  // End Windows extra CR fix
@@ -178,6 +231,42 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
   }
 }
 
+void BuildStatus::PrintCommandOutput(const string& output, FILE* spill) {
+  // ninja sets stdout and stderr of subprocesses to a pipe, to be able to
+  // check if the output is empty. Some compilers, e.g. clang, check
+  // isatty(stderr) to decide if they should print colored output.
+  // To make it possible to use colored output with ninja, subprocesses should
+  // be run with a flag that forces them to always print color escape codes.
+  // To make sure these escape codes don't show up in a file if ninja's output
+  // is piped to a file, ninja strips ansi escape codes again if it's not
+  // writing to a |smart_terminal_|.
+  // (Launching subprocesses in pseudo ttys doesn't work because there are
+  // only a few hundred available on some systems, and ninja can launch
+  // thousands of parallel compile commands.)
+  bool strip = !printer_.supports_color();
+  if (!spill) {
+    printer_.PrintOnNewLine(strip ? StripAnsiEscapeCodes(output) : output);
+    return;
+  }
+
+  // Print the spilled output a piece at a time, cut after a newline so
+  // that no escape code is split.
+  string text = output;
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), spill)) > 0) {
+    text.append(buf, len);
+    size_t end = text.rfind('\n');
+    if (end == string::npos)
+      continue;
+    string piece = text.substr(0, end + 1);
+    printer_.PrintOnNewLine(strip ? StripAnsiEscapeCodes(piece) : piece);
+    text.erase(0, end + 1);
+  }
+  if (!text.empty())
+    printer_.PrintOnNewLine(strip ? StripAnsiEscapeCodes(text) : text);
+}
+
 void BuildStatus::BuildLoadDyndeps() {
   // The DependencyScan calls EXPLAIN() to print lines explaining why
   // it considers a portion of the graph to be out of date.  Normally
@@ -188,7 +277,7 @@ void BuildStatus::BuildLoadDyndeps() {
   // line.  Start a new line so that the first explanation does not
   // append to the status line.  After the explanations are done a
   // new build status line will appear.
-  if (g_explaining)
+  if (g_explaining && config_.frontend_fd < 0)
     printer_.PrintOnNewLine("");
 }
 
@@ -198,10 +287,39 @@ void BuildStatus::BuildStarted() {
 }
 
 void BuildStatus::BuildFinished() {
+  if (config_.frontend_fd >= 0) {
+    frontend_.BuildFinished();
+    return;
+  }
   printer_.SetConsoleLocked(false);
+  printer_.ReplayOutput(string::npos);
+  if (pending_status_edge_)
+    PrintStatus(pending_status_edge_, pending_status_, true);
   printer_.PrintOnNewLine("");
 }
 
+int BuildStatus::MillisUntilRefresh() const {
+  // Output held back by a console command goes out a chunk at a time.
+  if (printer_.is_replaying())
+    return 0;
+  if (!pending_status_edge_ || printer_.is_console_locked())
+    return -1;
+  // Only a smart terminal holds status lines back for the refresh rate.
+  if (!printer_.is_smart_terminal())
+    return 0;
+  int64_t due = last_status_millis_ + refresh_millis_ - GetTimeMillis();
+  return due > 0 ? (int)due : 0;
+}
+
+void BuildStatus::Refresh() {
+  if (printer_.is_replaying()) {
+    printer_.ReplayOutput();
+    return;
+  }
+  if (pending_status_edge_ && MillisUntilRefresh() == 0)
+    PrintStatus(pending_status_edge_, pending_status_, true);
+}
+
 string BuildStatus::FormatProgressStatus(
     const char* progress_status_format, EdgeStatus status) const {
   string out;
@@ -290,15 +408,31 @@ string BuildStatus::FormatProgressStatus(
   return out;
 }
 
-void BuildStatus::PrintStatus(const Edge* edge, EdgeStatus status) {
+void BuildStatus::PrintStatus(const Edge* edge, EdgeStatus status,
+                              bool force) {
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
   bool force_full_command = config_.verbosity == BuildConfig::VERBOSE;
 
-  string to_print = edge->GetBinding("description");
+  // Redrawing the status line for every edge can take longer than running
+  // the edges, so on a smart terminal redraws are spaced out; the last
+  // status is drawn when it's due.  While a console command holds the
+  // terminal, only the last one would show, so none is drawn until then.
+  int64_t now = GetTimeMillis();
+  bool buffering = printer_.is_console_locked() || printer_.is_replaying();
+  if (!force && (buffering || (printer_.is_smart_terminal() &&
+                               now - last_status_millis_ < refresh_millis_))) {
+    pending_status_edge_ = edge;
+    pending_status_ = status;
+    return;
+  }
+  pending_status_edge_ = NULL;
+  last_status_millis_ = now;
+
+  string to_print = edge->GetBinding(kVarDescription);
   if (to_print.empty() || force_full_command)
-    to_print = edge->GetBinding("command");
+    to_print = edge->GetBinding(kVarCommand);
 
   to_print = FormatProgressStatus(progress_status_format_, status) + to_print;
 
@@ -310,16 +444,24 @@ Plan::Plan(Builder* builder)
   : builder_(builder)
   , command_edges_(0)
   , wanted_edges_(0)
+  , running_memory_(0)
 {}
 
 void Plan::Reset() {
   command_edges_ = 0;
   wanted_edges_ = 0;
+  running_memory_ = 0;
   ready_.clear();
+  shares_.clear();
   want_.clear();
+  pending_inputs_.clear();
+  share_of_.clear();
+  plan_edges_.clear();
 }
 
 bool Plan::AddTarget(const Node* node, string* err) {
+  if (builder_ && builder_->config_.target_share != BuildConfig::SHARE_NONE)
+    shares_.push_back(Share());
   return AddSubTarget(node, NULL, err, NULL);
 }
 
@@ -327,7 +469,9 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
                         set<Edge*>* dyndep_walk) {
   Edge* edge = node->in_edge();
   if (!edge) {  // Leaf node.
-    if (node->dirty()) {
+    // A missing dependency found by the deps loader just leaves its
+    // dependents dirty.
+    if (node->dirty() && !node->found_by_dep_loader()) {
       string referenced;
       if (dependent)
         referenced = ", needed by '" + dependent->path() + "',";
@@ -340,11 +484,21 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
   if (edge->outputs_ready())
     return false;  // Don't need to do anything.
 
-  // If an entry in want_ does not already exist for edge, create an entry which
-  // maps to kWantNothing, indicating that we do not want to build this entry itself.
-  pair<map<Edge*, Want>::iterator, bool> want_ins =
-    want_.insert(make_pair(edge, kWantNothing));
-  Want& want = want_ins.first->second;
+  // If the edge is not in the plan yet, add it as kWantNothing, indicating
+  // that we do not want to build this edge itself.
+  Want& want = MutableWant(edge);
+  bool newly_planned = want == kNotInPlan;
+  if (newly_planned) {
+    want = kWantNothing;
+    plan_edges_.push_back(edge);
+    CountPendingInputs(edge);
+    // Edges found through dyndep belong to the target that needs them.
+    Edge* dependent_edge = dependent ? dependent->in_edge() : NULL;
+    if (dependent_edge && GetWant(dependent_edge) != kNotInPlan)
+      share_of_[edge->id()] = share_of_[dependent_edge->id()];
+    else if (!shares_.empty())
+      share_of_[edge->id()] = (int)shares_.size() - 1;
+  }
 
   if (dyndep_walk && want == kWantToFinish)
     return false;  // Don't need to do anything with already-scheduled edge.
@@ -354,17 +508,23 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
   if (node->dirty() && want == kWantNothing) {
     want = kWantToStart;
     EdgeWanted(edge);
-    if (!dyndep_walk && edge->AllInputsReady())
-      ScheduleWork(want_ins.first);
   }
 
-  if (dyndep_walk)
+  if (dyndep_walk) {
     dyndep_walk->insert(edge);
+    // Edges discovered through dyndep were not seen by ComputeCriticalPath.
+    // They are at least as urgent as the edge that needs them.
+    Edge* dependent_edge = dependent ? dependent->in_edge() : NULL;
+    if (dependent_edge && edge->critical_path_weight() <
+                          dependent_edge->critical_path_weight()) {
+      edge->set_critical_path_weight(dependent_edge->critical_path_weight());
+    }
+  }
 
-  if (!want_ins.second)
+  if (!newly_planned)
     return true;  // We've already processed the inputs.
 
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
+  for (Node** i = edge->inputs_.begin();
        i != edge->inputs_.end(); ++i) {
     if (!AddSubTarget(*i, node, err, dyndep_walk) && !err->empty())
       return false;
@@ -373,6 +533,16 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
   return true;
 }
 
+void Plan::CountPendingInputs(const Edge* edge) {
+  int pending = 0;
+  for (Node* const* i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
+      ++pending;
+  }
+  pending_inputs_[edge->id()] = pending;
+}
+
 void Plan::EdgeWanted(const Edge* edge) {
   ++wanted_edges_;
   if (!edge->is_phony())
@@ -380,44 +550,263 @@ void Plan::EdgeWanted(const Edge* edge) {
 }
 
 Edge* Plan::FindWork() {
-  if (ready_.empty())
+  EdgePriorityQueue* queue = shares_.empty() ? &ready_ : PickShare();
+  if (!queue || queue->empty())
     return NULL;
-  set<Edge*>::iterator e = ready_.begin();
-  Edge* edge = *e;
-  ready_.erase(e);
+  Edge* edge = queue->top();
+  // Hold the edge back while it would take the running edges over -m,
+  // unless nothing else is running.
+  int64_t max_memory = builder_ ? builder_->config_.max_memory : 0;
+  if (max_memory > 0 && running_memory_ > 0 &&
+      running_memory_ + edge->memory() > max_memory)
+    return NULL;
+  queue->pop();
+  running_memory_ += edge->memory();
+  if (!shares_.empty())
+    ++shares_[share_of_[edge->id()]].running;
   return edge;
 }
 
-void Plan::ScheduleWork(map<Edge*, Want>::iterator want_e) {
-  if (want_e->second == kWantToFinish) {
+void Plan::FindBatch(const Edge* edge, vector<Edge*>* batch) {
+  size_t begin = batch->size();
+  size_t count = edge->batch_ - 1;
+  ready_.TakeBatch(edge, count, batch);
+  for (vector<Share>::iterator s = shares_.begin(); s != shares_.end(); ++s)
+    s->ready.TakeBatch(edge, count - (batch->size() - begin), batch);
+  // Their memory counts against -m, but doesn't hold them back.
+  for (size_t i = begin; i < batch->size(); ++i) {
+    Edge* member = (*batch)[i];
+    running_memory_ += member->memory();
+    if (!shares_.empty())
+      ++shares_[share_of_[member->id()]].running;
+  }
+}
+
+EdgePriorityQueue* Plan::PickShare() {
+  for (; !ready_.empty(); ready_.pop()) {
+    Edge* edge = ready_.top();
+    shares_[share_of_[edge->id()]].ready.push(edge);
+  }
+  bool fair = builder_->config_.target_share == BuildConfig::SHARE_FAIR;
+  Share* best = NULL;
+  for (vector<Share>::iterator s = shares_.begin(); s != shares_.end(); ++s) {
+    if (s->ready.empty())
+      continue;
+    if (!fair)
+      return &s->ready;
+    if (!best || s->running < best->running)
+      best = &*s;
+  }
+  return best ? &best->ready : NULL;
+}
+
+void Plan::PeekReady(size_t count, vector<Edge*>* edges) const {
+  size_t begin = edges->size();
+  ready_.Peek(count, edges);
+  if (shares_.empty())
+    return;
+  for (vector<Share>::const_iterator s = shares_.begin(); s != shares_.end();
+       ++s) {
+    s->ready.Peek(count, edges);
+  }
+  sort(edges->begin() + begin, edges->end(), EdgePriorityLess());
+  reverse(edges->begin() + begin, edges->end());
+  if (edges->size() - begin > count)
+    edges->resize(begin + count);
+}
+
+void Plan::PrepareQueue(BuildLog* build_log, const FailureLog* failures) {
+  ComputeCriticalPath(build_log, failures);
+  ScheduleInitialEdges();
+}
+
+void Plan::ComputeCriticalPath(BuildLog* build_log,
+                               const FailureLog* failures) {
+  METRIC_RECORD_PHASE("compute critical path");
+
+  // Drop edges that have left the plan, or are listed twice.
+  vector<bool> visited(want_.size(), false);
+  size_t kept = 0;
+  for (size_t i = 0; i < plan_edges_.size(); ++i) {
+    Edge* edge = plan_edges_[i];
+    if (GetWant(edge) == kNotInPlan || visited[edge->id()])
+      continue;
+    visited[edge->id()] = true;
+    plan_edges_[kept++] = edge;
+  }
+  plan_edges_.resize(kept);
+
+  // Sort the edges of the plan so that every edge comes after the edges
+  // producing its inputs.
+  vector<Edge*> sorted;
+  vector<pair<Edge*, size_t> > stack;
+  visited.assign(want_.size(), false);
+  for (size_t i = 0; i < plan_edges_.size(); ++i) {
+    Edge* root = plan_edges_[i];
+    if (visited[root->id()])
+      continue;
+    visited[root->id()] = true;
+    stack.push_back(make_pair(root, 0));
+    while (!stack.empty()) {
+      Edge* edge = stack.back().first;
+      size_t input = stack.back().second;
+      if (input == edge->inputs_.size()) {
+        sorted.push_back(edge);
+        stack.pop_back();
+        continue;
+      }
+      ++stack.back().second;
+      Edge* producer = edge->inputs_[input]->in_edge();
+      if (!producer || GetWant(producer) == kNotInPlan ||
+          visited[producer->id()])
+        continue;
+      visited[producer->id()] = true;
+      stack.push_back(make_pair(producer, 0));
+    }
+  }
+
+  // Estimate how long each edge will take, and how much memory it will
+  // need, from its previous run.  Edges that will not run cost nothing, and
+  // commands without a log entry are assumed to take as long and as much
+  // as an average command.  Edges already handed out keep their memory, as
+  // pools account for it.
+  vector<int64_t> durations(sorted.size(), -1);
+  int64_t total_duration = 0;
+  int64_t total_memory = 0;
+  int known_durations = 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    Edge* edge = sorted[i];
+    if (GetWant(edge) == kWantNothing || edge->is_phony()) {
+      durations[i] = 0;
+      continue;
+    }
+    BuildLog::LogEntry* entry = build_log ?
+        build_log->LookupByOutput(edge->outputs_[0]->path()) : NULL;
+    if (!entry)
+      continue;
+    // Even an instantaneous command adds a step to the chain.
+    durations[i] = max(entry->end_time - entry->start_time, 1);
+    total_duration += durations[i];
+    total_memory += entry->usage.max_rss;
+    ++known_durations;
+    if (!edge->memory_declared_ && GetWant(edge) == kWantToStart)
+      edge->memory_ = entry->usage.max_rss;
+  }
+  int64_t estimate = known_durations ? total_duration / known_durations : 1;
+  int64_t memory_estimate =
+      known_durations ? total_memory / known_durations : 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    Edge* edge = sorted[i];
+    if (durations[i] < 0 && !edge->memory_declared_ &&
+        GetWant(edge) == kWantToStart)
+      edge->memory_ = memory_estimate;
+  }
+
+  // Walk from the targets back towards the leaves, so that every edge is
+  // visited after all of its dependents in the plan.  At that point its
+  // weight holds the heaviest path of its dependents, and its priority the
+  // highest of theirs.
+  // An edge that failed last time comes before any other, as whether it
+  // still fails is what the build is most likely waited on for.
+  bool any_failed = failures && failures->size() > 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    if (GetWant(sorted[i]) != kWantToFinish) {
+      sorted[i]->set_critical_path_weight(0);
+      sorted[i]->plan_priority_ = sorted[i]->priority_;
+      if (any_failed && GetWant(sorted[i]) == kWantToStart &&
+          failures->Failed(sorted[i]))
+        sorted[i]->plan_priority_ = INT_MAX;
+    }
+  }
+  for (size_t i = sorted.size(); i-- > 0; ) {
+    Edge* edge = sorted[i];
+    // Edges already handed out keep their weight; pools may be holding
+    // them in an ordered queue.
+    if (GetWant(edge) == kWantToFinish)
+      continue;
+    int64_t weight = edge->critical_path_weight() +
+        (durations[i] < 0 ? estimate : durations[i]);
+    edge->set_critical_path_weight(weight);
+    for (Node** in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      Edge* producer = (*in)->in_edge();
+      if (!producer || GetWant(producer) == kNotInPlan)
+        continue;
+      if (producer->critical_path_weight() < weight)
+        producer->set_critical_path_weight(weight);
+      if (producer->plan_priority_ < edge->plan_priority_)
+        producer->plan_priority_ = edge->plan_priority_;
+    }
+  }
+}
+
+void Plan::ScheduleInitialEdges() {
+  // Edges delayed by a pool are only released once all of them are known,
+  // so that the pool hands out its heaviest edges first rather than the
+  // first ones found in the plan.
+  set<Pool*> pools;
+  for (vector<Edge*>::iterator it = plan_edges_.begin();
+       it != plan_edges_.end(); ++it) {
+    Edge* edge = *it;
+    if (GetWant(edge) != kWantToStart || pending_inputs_[edge->id()] > 0)
+      continue;
+    Pool* pool = edge->pool();
+    if (pool->ShouldDelayEdge()) {
+      want_[edge->id()] = kWantToFinish;
+      pool->DelayEdge(edge);
+      pools.insert(pool);
+    } else {
+      ScheduleWork(edge);
+    }
+  }
+  for (set<Pool*>::iterator p = pools.begin(); p != pools.end(); ++p)
+    (*p)->RetrieveReadyEdges(&ready_);
+}
+
+void Plan::ScheduleWork(Edge* edge) {
+  Want& want = want_[edge->id()];
+  if (want == kWantToFinish) {
     // This edge has already been scheduled.  We can get here again if an edge
     // and one of its dependencies share an order-only input, or if a node
     // duplicates an out edge (see https://github.com/ninja-build/ninja/pull/519).
     // Avoid scheduling the work again.
     return;
   }
-  assert(want_e->second == kWantToStart);
-  want_e->second = kWantToFinish;
+  assert(want == kWantToStart);
+  want = kWantToFinish;
 
-  Edge* edge = want_e->first;
   Pool* pool = edge->pool();
   if (pool->ShouldDelayEdge()) {
     pool->DelayEdge(edge);
     pool->RetrieveReadyEdges(&ready_);
   } else {
     pool->EdgeScheduled(*edge);
-    ready_.insert(edge);
+    ready_.push(edge);
   }
 }
 
+void Plan::EdgeStarted(Edge* edge) {
+  Want& want = MutableWant(edge);
+  assert(want == kWantToStart && pending_inputs_[edge->id()] == 0);
+  want = kWantToFinish;
+  edge->pool()->EdgeScheduled(*edge);
+  running_memory_ += edge->memory();
+  if (!shares_.empty())
+    ++shares_[share_of_[edge->id()]].running;
+}
+
 bool Plan::EdgeFinished(Edge* edge, EdgeResult result, string* err) {
-  map<Edge*, Want>::iterator e = want_.find(edge);
-  assert(e != want_.end());
-  bool directly_wanted = e->second != kWantNothing;
+  Want want = GetWant(edge);
+  assert(want != kNotInPlan);
+  bool directly_wanted = want != kWantNothing;
 
   // See if this job frees up any delayed jobs.
-  if (directly_wanted)
+  if (directly_wanted) {
     edge->pool()->EdgeFinished(*edge);
+    running_memory_ -= edge->memory();
+    if (!shares_.empty())
+      --shares_[share_of_[edge->id()]].running;
+  }
   edge->pool()->RetrieveReadyEdges(&ready_);
 
   // The rest of this function only applies to successful commands.
@@ -426,11 +815,22 @@ bool Plan::EdgeFinished(Edge* edge, EdgeResult result, string* err) {
 
   if (directly_wanted)
     --wanted_edges_;
-  want_.erase(e);
-  edge->outputs_ready_ = true;
+  want_[edge->id()] = kNotInPlan;
+  edge->set_outputs_ready(true);
+
+  // The dependents in the plan have one input fewer to wait for for each
+  // time they list one of our outputs.
+  for (Node** o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    for (Edge* const* oe = (*o)->out_edges().begin();
+         oe != (*o)->out_edges().end(); ++oe) {
+      if (GetWant(*oe) != kNotInPlan)
+        --pending_inputs_[(*oe)->id()];
+    }
+  }
 
   // Check off any nodes we were waiting for with this edge.
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
+  for (Node** o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
     if (!NodeFinished(*o, err))
       return false;
@@ -448,24 +848,23 @@ bool Plan::NodeFinished(Node* node, string* err) {
   }
 
   // See if we we want any edges from this node.
-  for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
+  for (Edge* const* oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
+    if (GetWant(*oe) == kNotInPlan)
       continue;
 
     // See if the edge is now ready.
-    if (!EdgeMaybeReady(want_e, err))
+    if (!EdgeMaybeReady(*oe, err))
       return false;
   }
   return true;
 }
 
-bool Plan::EdgeMaybeReady(map<Edge*, Want>::iterator want_e, string* err) {
-  Edge* edge = want_e->first;
-  if (edge->AllInputsReady()) {
-    if (want_e->second != kWantNothing) {
-      ScheduleWork(want_e);
+bool Plan::EdgeMaybeReady(Edge* edge, string* err) {
+  if (pending_inputs_[edge->id()] == 0) {
+    assert(edge->AllInputsReady());
+    if (GetWant(edge) != kWantNothing) {
+      ScheduleWork(edge);
     } else {
       // We do not need to build this edge, but we might need to build one of
       // its dependents.
@@ -479,11 +878,11 @@ bool Plan::EdgeMaybeReady(map<Edge*, Want>::iterator want_e, string* err) {
 bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
   node->set_dirty(false);
 
-  for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
+  for (Edge* const* oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
     // Don't process edges that we don't actually want.
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end() || want_e->second == kWantNothing)
+    Want want = GetWant(*oe);
+    if (want == kNotInPlan || want == kWantNothing)
       continue;
 
     // Don't attempt to clean an edge if it failed to load deps.
@@ -492,9 +891,8 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
 
     // If all non-order-only inputs for this edge are now clean,
     // we might have changed the dirty state of the outputs.
-    vector<Node*>::iterator
-        begin = (*oe)->inputs_.begin(),
-        end = (*oe)->inputs_.end() - (*oe)->order_only_deps_;
+    Node** begin = (*oe)->inputs_.begin();
+    Node** end = (*oe)->inputs_.end() - (*oe)->order_only_deps_;
 #if __cplusplus < 201703L
 #define MEM_FN mem_fun
 #else
@@ -503,7 +901,7 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
     if (find_if(begin, end, MEM_FN(&Node::dirty)) == end) {
       // Recompute most_recent_input.
       Node* most_recent_input = NULL;
-      for (vector<Node*>::iterator i = begin; i != end; ++i) {
+      for (Node** i = begin; i != end; ++i) {
         if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime())
           most_recent_input = *i;
       }
@@ -517,13 +915,13 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
         return false;
       }
       if (!outputs_dirty) {
-        for (vector<Node*>::iterator o = (*oe)->outputs_.begin();
+        for (Node** o = (*oe)->outputs_.begin();
              o != (*oe)->outputs_.end(); ++o) {
           if (!CleanNode(scan, *o, err))
             return false;
         }
 
-        want_e->second = kWantNothing;
+        want_[(*oe)->id()] = kWantNothing;
         --wanted_edges_;
         if (!(*oe)->is_phony())
           --command_edges_;
@@ -554,11 +952,9 @@ bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
     if (edge->outputs_ready())
       continue;
 
-    map<Edge*, Want>::iterator want_e = want_.find(edge);
-
     // If the edge has not been encountered before then nothing already in the
     // plan depends on it so we do not need to consider the edge yet either.
-    if (want_e == want_.end())
+    if (GetWant(edge) == kNotInPlan)
       continue;
 
     // This edge is already in the plan so queue it for the walk.
@@ -570,7 +966,8 @@ bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
   for (std::vector<DyndepFile::const_iterator>::iterator
        oei = dyndep_roots.begin(); oei != dyndep_roots.end(); ++oei) {
     DyndepFile::const_iterator oe = *oei;
-    for (vector<Node*>::const_iterator i = oe->second.implicit_inputs_.begin();
+    for (vector<Node*>::const_iterator i =
+             oe->second.implicit_inputs_.begin();
          i != oe->second.implicit_inputs_.end(); ++i) {
       if (!AddSubTarget(*i, oe->first->outputs_[0], err, &dyndep_walk) &&
           !err->empty())
@@ -580,21 +977,19 @@ bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
 
   // Add out edges from this node that are in the plan (just as
   // Plan::NodeFinished would have without taking the dyndep code path).
-  for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
+  for (Edge* const* oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
+    if (GetWant(*oe) == kNotInPlan)
       continue;
-    dyndep_walk.insert(want_e->first);
+    dyndep_walk.insert(*oe);
   }
 
   // See if any encountered edges are now ready.
   for (set<Edge*>::iterator wi = dyndep_walk.begin();
        wi != dyndep_walk.end(); ++wi) {
-    map<Edge*, Want>::iterator want_e = want_.find(*wi);
-    if (want_e == want_.end())
+    if (GetWant(*wi) == kNotInPlan)
       continue;
-    if (!EdgeMaybeReady(want_e, err))
+    if (!EdgeMaybeReady(*wi, err))
       return false;
   }
 
@@ -605,12 +1000,12 @@ bool Plan::RefreshDyndepDependents(DependencyScan* scan, const Node* node,
                                    string* err) {
   // Collect the transitive closure of dependents and mark their edges
   // as not yet visited by RecomputeDirty.
-  set<Node*> dependents;
+  vector<Node*> dependents;
   UnmarkDependents(node, &dependents);
 
   // Update the dirty state of all dependents and check if their edges
   // have become wanted.
-  for (set<Node*>::iterator i = dependents.begin();
+  for (vector<Node*>::iterator i = dependents.begin();
        i != dependents.end(); ++i) {
     Node* n = *i;
 
@@ -625,60 +1020,122 @@ bool Plan::RefreshDyndepDependents(DependencyScan* scan, const Node* node,
     // information an output is now known to be dirty, so we want the edge.
     Edge* edge = n->in_edge();
     assert(edge && !edge->outputs_ready());
-    map<Edge*, Want>::iterator want_e = want_.find(edge);
-    assert(want_e != want_.end());
-    if (want_e->second == kWantNothing) {
-      want_e->second = kWantToStart;
+    Want& want = want_[edge->id()];
+    assert(want != kNotInPlan);
+    if (want == kWantNothing) {
+      want = kWantToStart;
       EdgeWanted(edge);
     }
   }
+
+  // Loading dyndep and deps information may have given the dependents new
+  // inputs, and RecomputeDirty may have found some of them to be ready.
+  for (vector<Node*>::iterator i = dependents.begin();
+       i != dependents.end(); ++i) {
+    Edge* edge = (*i)->in_edge();
+    if (GetWant(edge) != kNotInPlan)
+      CountPendingInputs(edge);
+  }
   return true;
 }
 
-void Plan::UnmarkDependents(const Node* node, set<Node*>* dependents) {
-  for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
+void Plan::UnmarkDependents(const Node* node, vector<Node*>* dependents) {
+  for (Edge* const* oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
     Edge* edge = *oe;
 
-    map<Edge*, Want>::iterator want_e = want_.find(edge);
-    if (want_e == want_.end())
+    if (GetWant(edge) == kNotInPlan)
       continue;
 
-    if (edge->mark_ != Edge::VisitNone) {
-      edge->mark_ = Edge::VisitNone;
-      for (vector<Node*>::iterator o = edge->outputs_.begin();
+    // Each edge is unmarked once, so each output is collected once.
+    if (edge->mark() != Edge::VisitNone) {
+      edge->set_mark(Edge::VisitNone);
+      for (Node** o = edge->outputs_.begin();
            o != edge->outputs_.end(); ++o) {
-        if (dependents->insert(*o).second)
-          UnmarkDependents(*o, dependents);
+        dependents->push_back(*o);
+        UnmarkDependents(*o, dependents);
       }
     }
   }
 }
 
 void Plan::Dump() const {
-  printf("pending: %d\n", (int)want_.size());
-  for (map<Edge*, Want>::const_iterator e = want_.begin(); e != want_.end(); ++e) {
-    if (e->second != kWantNothing)
+  int pending = 0;
+  for (size_t i = 0; i < want_.size(); ++i) {
+    if (want_[i] != kNotInPlan)
+      ++pending;
+  }
+  printf("pending: %d\n", pending);
+  for (vector<Edge*>::const_iterator e = plan_edges_.begin();
+       e != plan_edges_.end(); ++e) {
+    Want want = GetWant(*e);
+    if (want == kNotInPlan)
+      continue;
+    if (want != kWantNothing)
       printf("want ");
-    e->first->Dump();
+    (*e)->Dump();
+  }
+  size_t ready = ready_.size();
+  for (vector<Share>::const_iterator s = shares_.begin(); s != shares_.end();
+       ++s) {
+    ready += s->ready.size();
   }
-  printf("ready: %d\n", (int)ready_.size());
+  printf("ready: %d\n", (int)ready);
 }
 
 struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
+  explicit RealCommandRunner(const BuildConfig& config);
   virtual ~RealCommandRunner() {}
   virtual bool CanRunMore() const;
   virtual bool StartCommand(Edge* edge);
   virtual bool WaitForCommand(Result* result);
+  virtual bool WaitForActivity(int timeout_millis);
+  virtual bool HasFinishedCommand();
   virtual vector<Edge*> GetActiveEdges();
   virtual void Abort();
 
+  /// Give back the jobserver tokens the running commands don't need.
+  void ReleaseTokens();
+  /// Whether the pressure on the system allows more than |running| jobs.
+  bool UnderPressureLimit(size_t running) const;
+  /// Whether the command of |edge| runs through the remote launcher.
+  bool IsRemote(const Edge* edge) const;
+
   const BuildConfig& config_;
   SubprocessSet subprocs_;
   map<const Subprocess*, Edge*> subproc_to_edge_;
+  /// With BuildConfig::affinity, the slots the commands are pinned to,
+  /// and the slots of the running commands that have one.
+  AffinitySlots affinity_;
+  map<const Subprocess*, AffinitySlot*> subproc_to_slot_;
+  /// Each command but the first runs on a token from here, if connected.
+  mutable Jobserver jobserver_;
+  /// Used with a BuildConfig::max_pressure.
+  mutable AdaptiveParallelism adaptive_;
 };
 
+RealCommandRunner::RealCommandRunner(const BuildConfig& config)
+    : config_(config),
+      adaptive_(config.parallelism, config.max_pressure / 100) {
+  if (!jobserver_.Connect() && config_.jobserver) {
+    string err;
+    if (!config_.jobserver_fifo.empty()) {
+      if (!jobserver_.Share(config_.jobserver_fifo, config_.parallelism,
+                            &err))
+        Warning("not sharing a jobserver: %s", err.c_str());
+    } else if (!jobserver_.Create(config_.parallelism, &err)) {
+      Warning("not running a jobserver: %s", err.c_str());
+    }
+  }
+  if (config_.affinity != BuildConfig::AFFINITY_NONE) {
+    string err;
+    if (!affinity_.Init(config_.affinity == BuildConfig::AFFINITY_CPU
+                            ? AffinitySlots::CPU : AffinitySlots::NODE,
+                        &err))
+      Warning("not pinning commands: %s", err.c_str());
+  }
+}
+
 vector<Edge*> RealCommandRunner::GetActiveEdges() {
   vector<Edge*> edges;
   for (map<const Subprocess*, Edge*>::iterator e = subproc_to_edge_.begin();
@@ -689,27 +1146,89 @@ vector<Edge*> RealCommandRunner::GetActiveEdges() {
 
 void RealCommandRunner::Abort() {
   subprocs_.Clear();
+  for (map<const Subprocess*, AffinitySlot*>::iterator s =
+           subproc_to_slot_.begin(); s != subproc_to_slot_.end(); ++s)
+    affinity_.Release(s->second);
+  subproc_to_slot_.clear();
+  ReleaseTokens();
+}
+
+void RealCommandRunner::ReleaseTokens() {
+  size_t subproc_number =
+      subprocs_.running_.size() + subprocs_.finished_.size();
+  while (jobserver_.token_count() > 0 &&
+         jobserver_.token_count() >= subproc_number)
+    jobserver_.Release();
+}
+
+bool RealCommandRunner::UnderPressureLimit(size_t running) const {
+  adaptive_.Sample(running);
+  return (int)running < adaptive_.limit();
 }
 
 bool RealCommandRunner::CanRunMore() const {
   size_t subproc_number =
       subprocs_.running_.size() + subprocs_.finished_.size();
-  return (int)subproc_number < config_.parallelism
-    && ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f)
-        || GetLoadAverage() < config_.max_load_average);
+  // Remote commands don't load this machine, so with a remote launcher
+  // only their number counts.
+  bool remote = !config_.remote_launcher.empty();
+  int limit = remote && config_.remote_parallelism > 0 ?
+      config_.remote_parallelism : config_.parallelism;
+  return (int)subproc_number < limit
+    && (remote || (subprocs_.running_.empty() ||
+                   config_.max_load_average <= 0.0f)
+        || GetLoadAverage() < config_.max_load_average)
+    && (remote || config_.max_pressure <= 0.0 ||
+        UnderPressureLimit(subproc_number))
+    && (!jobserver_.is_connected() ||
+        subproc_number < 1 + jobserver_.token_count() ||
+        jobserver_.Acquire());
+}
+
+bool RealCommandRunner::IsRemote(const Edge* edge) const {
+  return !config_.remote_launcher.empty() && !edge->pool()->local() &&
+      !edge->use_console() && edge->GetBinding(kVarWorker).empty() &&
+      !edge->GetBindingBool(kVarGenerator);
 }
 
 bool RealCommandRunner::StartCommand(Edge* edge) {
   string command = edge->EvaluateCommand();
-  Subprocess* subproc = subprocs_.Add(command, edge->use_console());
-  if (!subproc)
+  string worker = edge->GetBinding(kVarWorker);
+  Subprocess* subproc;
+  AffinitySlot* slot = NULL;
+  if (IsRemote(edge)) {
+    string remote = config_.remote_launcher + " ";
+#ifdef _WIN32
+    GetWin32EscapedString(command, &remote);
+#else
+    GetShellEscapedString(command, &remote);
+#endif
+    subproc = subprocs_.Add(remote, false, false);
+  } else if (!worker.empty() && !edge->use_console()) {
+    subproc = subprocs_.AddWorkRequest(worker, command);
+  } else {
+    // Commands of the same pool, which are likely related, prefer the same
+    // node.  A command beyond the slots runs unpinned.
+    Pool* pool = edge->pool();
+    slot = affinity_.Acquire(pool == &State::kDefaultPool ? NULL : pool);
+    subproc = subprocs_.Add(command, edge->use_console(),
+                            edge->GetBindingBool(kVarShell), slot);
+  }
+  if (!subproc) {
+    if (slot)
+      affinity_.Release(slot);
     return false;
+  }
   subproc_to_edge_.insert(make_pair(subproc, edge));
+  if (slot)
+    subproc_to_slot_.insert(make_pair(subproc, slot));
 
   return true;
 }
 
 bool RealCommandRunner::WaitForCommand(Result* result) {
+  // Don't sit on tokens while waiting.
+  ReleaseTokens();
   Subprocess* subproc;
   while ((subproc = subprocs_.NextFinished()) == NULL) {
     bool interrupted = subprocs_.DoWork();
@@ -719,56 +1238,465 @@ bool RealCommandRunner::WaitForCommand(Result* result) {
 
   result->status = subproc->Finish();
   result->output = subproc->GetOutput();
+  result->output_spill = subproc->TakeOutputSpill();
+  result->usage = subproc->GetUsage();
 
   map<const Subprocess*, Edge*>::iterator e = subproc_to_edge_.find(subproc);
   result->edge = e->second;
   subproc_to_edge_.erase(e);
+  map<const Subprocess*, AffinitySlot*>::iterator s =
+      subproc_to_slot_.find(subproc);
+  if (s != subproc_to_slot_.end()) {
+    affinity_.Release(s->second);
+    subproc_to_slot_.erase(s);
+  }
 
   delete subproc;
+  ReleaseTokens();
   return true;
 }
 
+bool RealCommandRunner::WaitForActivity(int timeout_millis) {
+  if (!subprocs_.finished_.empty())
+    return true;
+  return !subprocs_.DoWork(timeout_millis);
+}
+
+bool RealCommandRunner::HasFinishedCommand() {
+  // An interruption is left for WaitForCommand() to report.
+  if (subprocs_.finished_.empty())
+    subprocs_.DoWork(0);
+  return !subprocs_.finished_.empty();
+}
+
+/// A command that finished, on its way through Builder::FinishCommand().
+/// Reading its deps, in between taking what that needs from the edge and
+/// adding the nodes to the state, touches neither, so it can happen on one
+/// of the DepsWorkers.
+struct Builder::FinishedCommand {
+  explicit FinishedCommand(const CommandRunner::Result& result)
+      : result(result), keep_raw(false), deps_read(false) {}
+  ~FinishedCommand() {
+    if (result.output_spill)
+      fclose(result.output_spill);
+  }
+
+  /// Whether ReadDeps() has any files to read.
+  bool ReadsFiles() const {
+    return deps_type == "gcc" || (keep_raw && !depfile.empty());
+  }
+
+  /// Read the depfile, or the includes msvc printed, and what the action
+  /// cache keeps.
+  void ReadDeps(DiskInterface* disk_interface,
+                const DepfileParserOptions& options);
+
+  CommandRunner::Result result;
+
+  // Taken from the edge by Builder::PrepareFinish().
+  string deps_type;
+  string deps_prefix;
+  string depfile;
+  /// Whether to keep what the command printed and its depfile for the
+  /// action cache, as reading the deps may filter the one and delete the
+  /// other.
+  bool keep_raw;
+
+  string raw_output;
+  string raw_depfile;
+
+  /// Whether the deps were read; if not, |deps_err| says why.
+  bool deps_read;
+  string deps_err;
+  /// The contents of a "gcc" depfile, which |depfile_parser| points into.
+  string depfile_contents;
+  DepfileParser depfile_parser;
+  /// The headers "msvc" showed.
+  vector<string> includes;
+};
+
+void Builder::FinishedCommand::ReadDeps(DiskInterface* disk_interface,
+                                        const DepfileParserOptions& options) {
+  if (keep_raw) {
+    raw_output = result.output;
+    string read_err;
+    if (!depfile.empty() &&
+        disk_interface->ReadFile(depfile, &raw_depfile, &read_err) !=
+        DiskInterface::Okay)
+      keep_raw = false;
+  }
+
+  deps_read = true;
+  if (deps_type == "msvc") {
+    // The includes are filtered out of all of the output.
+    if (result.output_spill) {
+      AppendSpill(result.output_spill, &result.output);
+      fclose(result.output_spill);
+      result.output_spill = NULL;
+    }
+    CLParser parser;
+    string output;
+    if (!parser.Parse(result.output, deps_prefix, &output, &deps_err)) {
+      deps_read = false;
+      return;
+    }
+    result.output = output;
+    includes.swap(parser.includes_);
+  } else if (deps_type == "gcc") {
+    if (depfile.empty()) {
+      deps_err = "edge with deps=gcc but no depfile makes no sense";
+      deps_read = false;
+      return;
+    }
+
+    // Read depfile content.  Treat a missing depfile as empty.
+    if (keep_raw) {
+      depfile_contents = raw_depfile;
+    } else {
+      switch (disk_interface->ReadFile(depfile, &depfile_contents,
+                                       &deps_err)) {
+      case DiskInterface::Okay:
+        break;
+      case DiskInterface::NotFound:
+        deps_err.clear();
+        break;
+      case DiskInterface::OtherError:
+        deps_read = false;
+        return;
+      }
+    }
+    if (depfile_contents.empty())
+      return;
+
+    depfile_parser = DepfileParser(options);
+    if (!depfile_parser.ParseCanonical(&depfile_contents, &deps_err))
+      deps_read = false;
+  }
+}
+
+/// Runs FinishedCommand::ReadDeps() for the Builder on a few threads, and
+/// hands the commands back in the order they are done.
+struct Builder::DepsWorkers {
+  DepsWorkers(int threads, DiskInterface* disk_interface,
+              const DepfileParserOptions& options);
+  ~DepsWorkers();
+
+  void Add(FinishedCommand* finished);
+
+  /// A command whose deps have been read, or NULL if none is done yet and
+  /// not |wait|, or there are none.
+  FinishedCommand* Take(bool wait);
+
+  /// The number of commands added and not yet taken.
+  size_t pending() const { return pending_; }
+
+ private:
+  void Run();
+
+  DiskInterface* disk_interface_;
+  const DepfileParserOptions& options_;
+  size_t pending_;
+
+  /// Guards the members below.
+  mutex mutex_;
+  condition_variable todo_ready_;
+  condition_variable done_ready_;
+  deque<FinishedCommand*> todo_;
+  deque<FinishedCommand*> done_;
+  bool stopping_;
+  vector<thread> threads_;
+};
+
+Builder::DepsWorkers::DepsWorkers(int threads, DiskInterface* disk_interface,
+                                  const DepfileParserOptions& options)
+    : disk_interface_(disk_interface), options_(options), pending_(0),
+      stopping_(false) {
+  for (int i = 0; i < threads; ++i)
+    threads_.push_back(thread(&DepsWorkers::Run, this));
+}
+
+Builder::DepsWorkers::~DepsWorkers() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  todo_ready_.notify_all();
+  for (vector<thread>::iterator t = threads_.begin(); t != threads_.end(); ++t)
+    t->join();
+  for (deque<FinishedCommand*>::iterator f = todo_.begin(); f != todo_.end();
+       ++f)
+    delete *f;
+  for (deque<FinishedCommand*>::iterator f = done_.begin(); f != done_.end();
+       ++f)
+    delete *f;
+}
+
+void Builder::DepsWorkers::Add(FinishedCommand* finished) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    todo_.push_back(finished);
+  }
+  ++pending_;
+  todo_ready_.notify_one();
+}
+
+Builder::FinishedCommand* Builder::DepsWorkers::Take(bool wait) {
+  if (!pending_)
+    return NULL;
+  unique_lock<mutex> lock(mutex_);
+  if (wait) {
+    while (done_.empty())
+      done_ready_.wait(lock);
+  } else if (done_.empty()) {
+    return NULL;
+  }
+  FinishedCommand* finished = done_.front();
+  done_.pop_front();
+  --pending_;
+  return finished;
+}
+
+void Builder::DepsWorkers::Run() {
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    while (todo_.empty() && !stopping_)
+      todo_ready_.wait(lock);
+    if (stopping_)
+      return;
+    FinishedCommand* finished = todo_.front();
+    todo_.pop_front();
+
+    lock.unlock();
+    finished->ReadDeps(disk_interface_, options_);
+    lock.lock();
+
+    done_.push_back(finished);
+    done_ready_.notify_one();
+  }
+}
+
+namespace {
+
+/// Write |content| to the response file at |path|, unless it holds that
+/// already, as after a failed command, or link it to |source|, a response
+/// file that should hold the same, if not "".
+bool WriteRspfile(DiskInterface* disk_interface, const string& path,
+                  const string& content, const string& source) {
+  string old_content, err;
+  if (disk_interface->ReadFile(path, &old_content, &err) == FileReader::Okay) {
+    if (old_content == content)
+      return true;
+    // It may be a link to another response file; don't write through it.
+    disk_interface->RemoveFile(path);
+  }
+  if (!source.empty() && disk_interface->LinkFile(source, path)) {
+    METRIC_COUNT("rspfiles linked", 1);
+    return true;
+  }
+  return disk_interface->WriteFile(path, content);
+}
+
+}  // anonymous namespace
+
+/// Creates the directories of the outputs of edges and writes their
+/// response files, on a thread of its own, and hands the edges back in the
+/// order they came in.  So an edge that needs a directory an earlier edge
+/// is still creating is only handed back once that is done.
+struct Builder::IOWorker {
+  struct Task {
+    explicit Task(Edge* edge) : edge(edge), ok(true) {}
+
+    Edge* edge;
+    /// The outputs whose directories are to be created.
+    vector<string> outputs;
+    string rspfile;
+    string rspfile_content;
+    /// A response file to link |rspfile| to, or "".
+    string rspfile_source;
+    /// Whether the files are in place.
+    bool ok;
+  };
+
+  explicit IOWorker(DiskInterface* disk_interface);
+  ~IOWorker();
+
+  void Add(Task* task);
+
+  /// A task that is done, or NULL if none is done yet and not |wait|, or
+  /// there are none.
+  Task* Take(bool wait);
+
+  /// The number of tasks added and not yet taken.
+  size_t pending() const { return pending_; }
+
+ private:
+  void Run();
+
+  DiskInterface* disk_interface_;
+  size_t pending_;
+
+  /// Guards the members below.
+  mutex mutex_;
+  condition_variable todo_ready_;
+  condition_variable done_ready_;
+  deque<Task*> todo_;
+  deque<Task*> done_;
+  bool stopping_;
+  thread thread_;
+};
+
+Builder::IOWorker::IOWorker(DiskInterface* disk_interface)
+    : disk_interface_(disk_interface), pending_(0), stopping_(false),
+      thread_(&IOWorker::Run, this) {}
+
+Builder::IOWorker::~IOWorker() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  todo_ready_.notify_all();
+  thread_.join();
+  for (deque<Task*>::iterator t = todo_.begin(); t != todo_.end(); ++t)
+    delete *t;
+  for (deque<Task*>::iterator t = done_.begin(); t != done_.end(); ++t)
+    delete *t;
+}
+
+void Builder::IOWorker::Add(Task* task) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    todo_.push_back(task);
+  }
+  ++pending_;
+  todo_ready_.notify_one();
+}
+
+Builder::IOWorker::Task* Builder::IOWorker::Take(bool wait) {
+  if (!pending_)
+    return NULL;
+  unique_lock<mutex> lock(mutex_);
+  if (wait) {
+    while (done_.empty())
+      done_ready_.wait(lock);
+  } else if (done_.empty()) {
+    return NULL;
+  }
+  Task* task = done_.front();
+  done_.pop_front();
+  --pending_;
+  return task;
+}
+
+void Builder::IOWorker::Run() {
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    while (todo_.empty() && !stopping_)
+      todo_ready_.wait(lock);
+    if (stopping_)
+      return;
+    Task* task = todo_.front();
+    todo_.pop_front();
+
+    lock.unlock();
+    for (vector<string>::iterator o = task->outputs.begin();
+         o != task->outputs.end() && task->ok; ++o) {
+      task->ok = disk_interface_->MakeDirs(*o);
+    }
+    if (task->ok && !task->rspfile.empty())
+      task->ok = WriteRspfile(disk_interface_, task->rspfile,
+                              task->rspfile_content, task->rspfile_source);
+    lock.lock();
+
+    done_.push_back(task);
+    done_ready_.notify_one();
+  }
+}
+
 Builder::Builder(State* state, const BuildConfig& config,
                  BuildLog* build_log, DepsLog* deps_log,
-                 DiskInterface* disk_interface)
+                 DiskInterface* disk_interface, HashLog* hash_log,
+                 DyndepCache* dyndep_cache, DepfileCache* depfile_cache)
     : state_(state), config_(config),
       plan_(this), disk_interface_(disk_interface),
       scan_(state, build_log, deps_log, disk_interface,
-            &config_.depfile_parser_options) {
+            &config_.depfile_parser_options, hash_log, dyndep_cache,
+            depfile_cache),
+      action_cache_(NULL), deps_workers_(NULL), io_worker_(NULL),
+      prefetched_bytes_(0), failure_log_(NULL) {
   status_ = new BuildStatus(config);
+  if (!config.cache_dir.empty() && !config.dry_run)
+    action_cache_ = new ActionCache(config.cache_dir, hash_log);
 }
 
 Builder::~Builder() {
   Cleanup();
+  delete action_cache_;
+  for (map<Edge*, vector<Edge*> >::iterator b = batches_.begin();
+       b != batches_.end(); ++b) {
+    delete b->first->env_;
+    delete b->first;
+  }
 }
 
 void Builder::Cleanup() {
+  // Drop the commands whose deps are being read; they won't be recorded.
+  delete deps_workers_;
+  deps_workers_ = NULL;
+  // The edges being prepared haven't run; there's nothing to clean up.
+  delete io_worker_;
+  io_worker_ = NULL;
+  prepared_.clear();
+  started_early_.clear();
+
   if (command_runner_.get()) {
     vector<Edge*> active_edges = command_runner_->GetActiveEdges();
     command_runner_->Abort();
 
+    // Stat and remove the outputs of all the commands at once, rather than
+    // one by one; with hundreds of commands running, the latency of each
+    // call adds up to seconds before the prompt comes back.
+    vector<Node*> outputs;
+    vector<string> paths;
+    vector<string> depfiles;
+    vector<bool> has_depfile;
     for (vector<Edge*>::iterator e = active_edges.begin();
          e != active_edges.end(); ++e) {
       string depfile = (*e)->GetUnescapedDepfile();
-      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+      if (!depfile.empty())
+        depfiles.push_back(depfile);
+      for (Node** o = (*e)->outputs_.begin();
            o != (*e)->outputs_.end(); ++o) {
-        // Only delete this output if it was actually modified.  This is
-        // important for things like the generator where we don't want to
-        // delete the manifest file if we can avoid it.  But if the rule
-        // uses a depfile, always delete.  (Consider the case where we
-        // need to rebuild an output because of a modified header file
-        // mentioned in a depfile, and the command touches its depfile
-        // but is interrupted before it touches its output file.)
+        disk_interface_->InvalidateStatCache((*o)->path());
+        outputs.push_back(*o);
+        paths.push_back((*o)->path());
+        has_depfile.push_back(!depfile.empty());
+      }
+    }
+    vector<TimeStamp> mtimes;
+    disk_interface_->StatBatch(paths, &mtimes);
+
+    vector<string> removals;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      // Only delete this output if it was actually modified.  This is
+      // important for things like the generator where we don't want to
+      // delete the manifest file if we can avoid it.  But if the rule
+      // uses a depfile, always delete.  (Consider the case where we
+      // need to rebuild an output because of a modified header file
+      // mentioned in a depfile, and the command touches its depfile
+      // but is interrupted before it touches its output file.)
+      if (mtimes[i] == -1) {
+        // Log and ignore Stat() errors.  StatBatch() doesn't describe
+        // them; Stat() again for the message.
         string err;
-        TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), &err);
-        if (new_mtime == -1)  // Log and ignore Stat() errors.
-          Error("%s", err.c_str());
-        if (!depfile.empty() || (*o)->mtime() != new_mtime)
-          disk_interface_->RemoveFile((*o)->path());
+        disk_interface_->Stat(paths[i], &err);
+        Error("%s", err.c_str());
       }
-      if (!depfile.empty())
-        disk_interface_->RemoveFile(depfile);
+      if (has_depfile[i] || outputs[i]->mtime() != mtimes[i])
+        removals.push_back(paths[i]);
     }
+    removals.insert(removals.end(), depfiles.begin(), depfiles.end());
+    vector<int> results;
+    disk_interface_->RemoveFileBatch(removals, &results);
   }
 }
 
@@ -784,7 +1712,12 @@ Node* Builder::AddTarget(const string& name, string* err) {
 }
 
 bool Builder::AddTarget(Node* node, string* err) {
-  if (!scan_.RecomputeDirty(node, err))
+  METRIC_RECORD_PHASE("dirty scan");
+  if (config_.start_during_scan)
+    scan_.set_observer(this);
+  bool scanned = scan_.RecomputeDirty(node, err);
+  scan_.set_observer(NULL);
+  if (!scanned)
     return false;
 
   if (Edge* in_edge = node->in_edge()) {
@@ -802,32 +1735,109 @@ bool Builder::AlreadyUpToDate() const {
   return !plan_.more_to_do();
 }
 
+void Builder::EdgeReady(Edge* edge) {
+  // Leave edges in pools, which hand out their edges in order, and those
+  // that might not fit the memory budget to the plan, as well as those it
+  // could batch.  So too those missing an input; adding their target fails.
+  if (edge->pool() != &State::kDefaultPool || config_.max_memory > 0 ||
+      edge->batch_ > 1)
+    return;
+  // While any edge that failed last time may be still to come, leave the
+  // others for the plan to order after it.
+  if (failure_log_ && failure_log_->size() > 0 &&
+      !failure_log_->Failed(edge))
+    return;
+  for (Node** i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    if (!(*i)->in_edge() && !(*i)->exists())
+      return;
+  }
+
+  CreateCommandRunner();
+  if (!command_runner_->CanRunMore())
+    return;
+  // If it doesn't start now, Build() tries again, and reports the error.
+  string err;
+  if (PrepareEdge(edge, &err))
+    started_early_.push_back(edge);
+}
+
+void Builder::CreateCommandRunner() {
+  if (command_runner_.get())
+    return;
+  if (config_.dry_run)
+    command_runner_.reset(new DryRunCommandRunner);
+  else
+    command_runner_.reset(new RealCommandRunner(config_));
+}
+
 bool Builder::Build(string* err) {
   assert(!AlreadyUpToDate());
 
+  // The edges started during the scan are running already.
+  for (vector<Edge*>::iterator e = started_early_.begin();
+       e != started_early_.end(); ++e) {
+    plan_.EdgeStarted(*e);
+  }
+  plan_.PrepareQueue(scan_.build_log(), failure_log_);
+
   status_->PlanHasTotalEdges(plan_.command_edge_count());
-  int pending_commands = 0;
+  int pending_commands = (int)started_early_.size();
   int failures_allowed = config_.failures_allowed;
 
   // Set up the command runner if we haven't done so already.
-  if (!command_runner_.get()) {
-    if (config_.dry_run)
-      command_runner_.reset(new DryRunCommandRunner);
-    else
-      command_runner_.reset(new RealCommandRunner(config_));
+  CreateCommandRunner();
+
+  // Read the deps of finished commands on other threads, if asked to.
+  // Parsing them records metrics, and METRIC_RECORD isn't thread-safe.
+  if (config_.deps_threads > 0 && !config_.dry_run && !g_metrics &&
+      !deps_workers_) {
+    deps_workers_ = new DepsWorkers(config_.deps_threads, disk_interface_,
+                                    config_.depfile_parser_options);
   }
 
+  // Prepare the files of edges on another thread, if asked to.  Which
+  // directories exist may have changed since the last build.
+  dirs_.clear();
+  dir_names_.clear();
+  rspfiles_.clear();
+  rspfile_hashes_.clear();
+  if (config_.io_thread && !config_.dry_run && !io_worker_)
+    io_worker_ = new IOWorker(disk_interface_);
+  prefetched_edges_.clear();
+  prefetched_nodes_.clear();
+  prefetched_bytes_ = 0;
+
   // We are about to start the build process.
   status_->BuildStarted();
+  for (vector<Edge*>::iterator e = started_early_.begin();
+       e != started_early_.end(); ++e) {
+    status_->BuildEdgeStarted(*e);
+  }
+  started_early_.clear();
 
   // This main loop runs the entire build process.
   // It is structured like this:
-  // First, we attempt to start as many commands as allowed by the
+  // First, we start the commands whose files have been prepared in the
+  // meantime, and finish any command whose deps have been read.
+  // Second, we attempt to start as many commands as allowed by the
   // command runner.
-  // Second, we attempt to wait for / reap the next finished command.
+  // Third, we attempt to wait for / reap the next finished command.
   while (plan_.more_to_do()) {
-    // See if we can start any more commands.
-    if (failures_allowed && command_runner_->CanRunMore()) {
+    if (!LaunchPrepared(false, err)) {
+      Cleanup();
+      status_->BuildFinished();
+      return false;
+    }
+    FinishedCommand* finished =
+        deps_workers_ ? deps_workers_->Take(false) : NULL;
+
+    // See if we can start any more commands.  Don't prepare many more
+    // edges than the command runner will take.
+    size_t preparing = prepared_.size() +
+        (io_worker_ ? io_worker_->pending() : 0);
+    if (!finished && failures_allowed && command_runner_->CanRunMore() &&
+        preparing < (size_t)max(config_.parallelism, 1)) {
       if (Edge* edge = plan_.FindWork()) {
         if (!StartEdge(edge, err)) {
           Cleanup();
@@ -851,24 +1861,75 @@ bool Builder::Build(string* err) {
     }
 
     // See if we can reap any finished commands.
-    if (pending_commands) {
-      CommandRunner::Result result;
-      if (!command_runner_->WaitForCommand(&result) ||
-          result.status == ExitInterrupted) {
-        Cleanup();
-        status_->BuildFinished();
-        *err = "interrupted by user";
-        return false;
+    if (!finished && pending_commands) {
+      // Have the inputs of what starts next read while we wait.
+      if (config_.prefetch_edges > 0 && !config_.dry_run)
+        PrefetchInputs();
+      if (io_worker_ && io_worker_->pending() && restored_.empty() &&
+          !command_runner_->HasFinishedCommand()) {
+        // The files being prepared will be done before long; start the
+        // command that waits for them then.
+        if (!LaunchPrepared(true, err)) {
+          Cleanup();
+          status_->BuildFinished();
+          return false;
+        }
+        continue;
+      }
+      if (deps_workers_ && deps_workers_->pending() && restored_.empty() &&
+          !command_runner_->HasFinishedCommand()) {
+        // The deps being read will be done before long; commands may not.
+        finished = deps_workers_->Take(true);
+      } else {
+        // Draw a held back status line once it's due, if no command
+        // finishes before.
+        bool interrupted = false;
+        int refresh;
+        while (!interrupted &&
+               (refresh = status_->MillisUntilRefresh()) >= 0) {
+          interrupted = !command_runner_->WaitForActivity(refresh);
+          status_->Refresh();
+          if (command_runner_->HasFinishedCommand())
+            break;
+        }
+
+        CommandRunner::Result result;
+        if (!restored_.empty()) {
+          result = restored_.front();
+          restored_.pop_front();
+        } else if (interrupted || !command_runner_->WaitForCommand(&result) ||
+                   result.status == ExitInterrupted) {
+          if (result.output_spill)
+            fclose(result.output_spill);
+          Cleanup();
+          status_->BuildFinished();
+          *err = "interrupted by user";
+          return false;
+        }
+
+        finished = new FinishedCommand(result);
+        PrepareFinish(finished);
+        if (deps_workers_ && finished->ReadsFiles()) {
+          deps_workers_->Add(finished);
+          // Carry on while the deps are read.
+          continue;
+        }
+        finished->ReadDeps(disk_interface_, config_.depfile_parser_options);
       }
+    }
 
+    if (finished) {
       --pending_commands;
-      if (!FinishCommand(&result, err)) {
+      bool ok = FinishCommand(finished, err);
+      bool success = finished->result.success();
+      delete finished;
+      if (!ok) {
         Cleanup();
         status_->BuildFinished();
         return false;
       }
 
-      if (!result.success()) {
+      if (!success) {
         if (failures_allowed)
           failures_allowed--;
       }
@@ -892,32 +1953,246 @@ bool Builder::Build(string* err) {
     return false;
   }
 
+  delete deps_workers_;
+  deps_workers_ = NULL;
+  delete io_worker_;
+  io_worker_ = NULL;
   status_->BuildFinished();
   return true;
 }
 
+bool Builder::DryRun(vector<Edge*>* edges, string* err) {
+  assert(config_.dry_run && !AlreadyUpToDate());
+  METRIC_RECORD("dry run");
+
+  // Without commands to wait for, the plan can be drained an edge at a
+  // time, each finishing before the next starts.
+  for (vector<Edge*>::iterator e = started_early_.begin();
+       e != started_early_.end(); ++e) {
+    plan_.EdgeStarted(*e);
+  }
+  plan_.PrepareQueue(scan_.build_log(), failure_log_);
+  vector<Edge*> started;
+  started.swap(started_early_);
+  for (size_t i = 0; plan_.more_to_do(); ++i) {
+    Edge* edge = i < started.size() ? started[i] : plan_.FindWork();
+    if (!edge) {
+      *err = "stuck [this is a bug]";
+      return false;
+    }
+    if (!edge->is_phony())
+      edges->push_back(edge);
+    if (!plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, err))
+      return false;
+  }
+  return true;
+}
+
 bool Builder::StartEdge(Edge* edge, string* err) {
   METRIC_RECORD("StartEdge");
   if (edge->is_phony())
     return true;
+  NINJA_PROBE2(edge__start, edge->id_, edge->outputs_[0]->path().c_str());
+
+  // Run the other ready edges the rule lets share the command with it.
+  vector<Edge*> batch(1, edge);
+  if (edge->batch_ > 1)
+    plan_.FindBatch(edge, &batch);
+  for (vector<Edge*>::iterator e = batch.begin(); e != batch.end(); ++e) {
+    map<Edge*, int64_t>::iterator prefetched = prefetched_edges_.find(*e);
+    if (prefetched != prefetched_edges_.end()) {
+      prefetched_bytes_ -= prefetched->second;
+      prefetched_edges_.erase(prefetched);
+    }
+  }
+  if (batch.size() > 1)
+    edge = NewBatch(batch);
 
-  status_->BuildEdgeStarted(edge);
+  status_->BuildEdgeStarted(edge, (int)batch.size());
+  return PrepareEdge(edge, err);
+}
 
-  // Create directories necessary for outputs.
-  // XXX: this will block; do we care?
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
+Edge* Builder::NewBatch(const vector<Edge*>& batch) {
+  METRIC_COUNT("batched edges", batch.size());
+  Edge* first = batch.front();
+  Edge* edge = new Edge;
+  edge->rule_ = first->rule_;
+  edge->pool_ = first->pool_;
+  edge->id_ = first->id_;
+  // The response file is the first edge's, rather than one named after
+  // the outputs of all.
+  edge->env_ = new BindingEnv(first->env_);
+  string rspfile = first->GetUnescapedRspfile();
+  if (!rspfile.empty())
+    edge->env_->AddBinding(kVarRspfile, rspfile);
+  // Keep each kind of input and output together, in the order of the
+  // edges, so that $in and $out list those of all of them.
+  vector<Edge*>::const_iterator e;
+  for (e = batch.begin(); e != batch.end(); ++e) {
+    edge->inputs_.insert(edge->inputs_.end(), (*e)->inputs_.begin(),
+                         (*e)->inputs_.end() - (*e)->implicit_deps_ -
+                             (*e)->order_only_deps_);
+    edge->outputs_.insert(edge->outputs_.end(), (*e)->outputs_.begin(),
+                          (*e)->outputs_.end() - (*e)->implicit_outs_);
+  }
+  for (e = batch.begin(); e != batch.end(); ++e) {
+    edge->inputs_.insert(edge->inputs_.end(),
+                         (*e)->inputs_.end() - (*e)->implicit_deps_ -
+                             (*e)->order_only_deps_,
+                         (*e)->inputs_.end() - (*e)->order_only_deps_);
+    edge->implicit_deps_ += (*e)->implicit_deps_;
+    edge->outputs_.insert(edge->outputs_.end(),
+                          (*e)->outputs_.end() - (*e)->implicit_outs_,
+                          (*e)->outputs_.end());
+    edge->implicit_outs_ += (*e)->implicit_outs_;
+  }
+  for (e = batch.begin(); e != batch.end(); ++e) {
+    edge->inputs_.insert(edge->inputs_.end(),
+                         (*e)->inputs_.end() - (*e)->order_only_deps_,
+                         (*e)->inputs_.end());
+    edge->order_only_deps_ += (*e)->order_only_deps_;
+  }
+  batches_[edge] = batch;
+  return edge;
+}
+
+void Builder::PrefetchInputs() {
+  vector<Edge*> edges;
+  plan_.PeekReady(config_.prefetch_edges, &edges);
+  for (vector<Edge*>::iterator e = edges.begin(); e != edges.end(); ++e) {
+    Edge* edge = *e;
+    if (edge->is_phony() || prefetched_edges_.count(edge))
+      continue;
+    // The scan stat()ed every input, so opening them doesn't wait for the
+    // disk; reading them is left to the system.  Order-only inputs aren't
+    // usually read.
+    int64_t bytes = 0;
+    for (Node** i = edge->inputs_.begin();
+         i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+      if (prefetched_nodes_.count(*i))
+        continue;
+      int64_t size = disk_interface_->Prefetch(
+          (*i)->path(), kPrefetchBytes - prefetched_bytes_ - bytes);
+      if (size > 0) {
+        bytes += size;
+        prefetched_nodes_.insert(*i);
+      }
+    }
+    prefetched_edges_[edge] = bytes;
+    prefetched_bytes_ += bytes;
+  }
+}
+
+bool Builder::PrepareEdge(Edge* edge, string* err) {
+  // Create directories necessary for outputs, each one once per build.
+  // With an I/O thread, the directories new to this build are created
+  // there, and an edge needing one it has yet to create waits its turn.
+  IOWorker::Task* task = io_worker_ ? new IOWorker::Task(edge) : NULL;
+  bool queue = false;
+  for (Node** o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (!disk_interface_->MakeDirs((*o)->path()))
+    string dir = DirName((*o)->path());
+    if (dir.empty())
+      continue;
+    ExternalStringHashMap<bool>::Type::iterator d = dirs_.find(dir);
+    if (d != dirs_.end()) {
+      queue = queue || !d->second;
+      continue;
+    }
+    dir_names_.push_back(dir);
+    dirs_[dir_names_.back()] = !task;
+    if (task) {
+      task->outputs.push_back((*o)->path());
+    } else if (!disk_interface_->MakeDirs((*o)->path())) {
       return false;
+    }
   }
 
   // Create response file, if needed
-  // XXX: this may also block; do we care?
   string rspfile = edge->GetUnescapedRspfile();
   if (!rspfile.empty()) {
-    string content = edge->GetBinding("rspfile_content");
-    if (!disk_interface_->WriteFile(rspfile, content))
+    string content = edge->GetBinding(kVarRspfileContent);
+    string source = AddRspfile(rspfile, content);
+    if (task) {
+      task->rspfile = rspfile;
+      task->rspfile_content.swap(content);
+      task->rspfile_source = source;
+    } else if (!WriteRspfile(disk_interface_, rspfile, content, source)) {
+      return false;
+    }
+  }
+
+  if (task && (queue || !task->outputs.empty() || !task->rspfile.empty())) {
+    io_worker_->Add(task);
+    return true;
+  }
+  delete task;
+  return LaunchEdge(edge, err);
+}
+
+string Builder::AddRspfile(const string& path, const string& content) {
+  // Edges often share the content of their response files, like the link
+  // lines of tests; linking to the first is cheaper than writing them all.
+  ForgetRspfile(path);
+  uint64_t hash = HashBytes(content.data(), content.size());
+  rspfile_hashes_[path] = hash;
+  map<uint64_t, string>::iterator r = rspfiles_.find(hash);
+  if (r != rspfiles_.end())
+    return r->second;
+  rspfiles_[hash] = path;
+  return string();
+}
+
+void Builder::ForgetRspfile(const string& path) {
+  map<string, uint64_t>::iterator h = rspfile_hashes_.find(path);
+  if (h == rspfile_hashes_.end())
+    return;
+  map<uint64_t, string>::iterator r = rspfiles_.find(h->second);
+  if (r != rspfiles_.end() && r->second == path)
+    rspfiles_.erase(r);
+  rspfile_hashes_.erase(h);
+}
+
+bool Builder::LaunchPrepared(bool wait, string* err) {
+  while (IOWorker::Task* task = io_worker_ ? io_worker_->Take(wait) : NULL) {
+    wait = false;
+    for (vector<string>::iterator o = task->outputs.begin();
+         o != task->outputs.end(); ++o) {
+      ExternalStringHashMap<bool>::Type::iterator d =
+          dirs_.find(DirName(*o));
+      assert(d != dirs_.end());
+      d->second = true;
+    }
+    Edge* edge = task->edge;
+    bool ok = task->ok;
+    delete task;
+    if (!ok)
       return false;
+    prepared_.push_back(edge);
+  }
+
+  while (!prepared_.empty() && command_runner_->CanRunMore()) {
+    Edge* edge = prepared_.front();
+    prepared_.pop_front();
+    if (!LaunchEdge(edge, err))
+      return false;
+  }
+  return true;
+}
+
+bool Builder::LaunchEdge(Edge* edge, string* err) {
+  // Take the outputs from the action cache, if it has them.  It keeps
+  // those of single edges.
+  if (action_cache_ && !batches_.count(edge) &&
+      ActionCache::IsCacheable(edge)) {
+    CommandRunner::Result result;
+    if (action_cache_->Restore(edge, &result.output)) {
+      result.edge = edge;
+      result.status = ExitSuccess;
+      result.restored = true;
+      restored_.push_back(result);
+      return true;
+    }
   }
 
   // start command computing and run it
@@ -930,50 +2205,147 @@ bool Builder::StartEdge(Edge* edge, string* err) {
 }
 
 bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
+  FinishedCommand finished(*result);
+  result->output_spill = NULL;  // |finished| has it now.
+  PrepareFinish(&finished);
+  finished.ReadDeps(disk_interface_, config_.depfile_parser_options);
+  bool ok = FinishCommand(&finished, err);
+  *result = finished.result;
+  return ok;
+}
+
+void Builder::PrepareFinish(FinishedCommand* finished) {
+  Edge* edge = finished->result.edge;
+
+  // The command may have written into the directories of its outputs.
+  for (Node** o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    disk_interface_->InvalidateStatCache((*o)->path());
+  }
+
+  finished->deps_type = edge->GetBinding(kVarDeps);
+  finished->deps_prefix = edge->GetBinding(kVarMsvcDepsPrefix);
+  finished->depfile = edge->GetUnescapedDepfile();
+  // Output too big to keep in memory is too big to cache.
+  finished->keep_raw = action_cache_ && !finished->result.restored &&
+      finished->result.success() && !finished->result.output_spill &&
+      !batches_.count(edge) && ActionCache::IsCacheable(edge);
+}
+
+bool Builder::FinishCommand(FinishedCommand* finished, string* err) {
   METRIC_RECORD("FinishCommand");
 
+  CommandRunner::Result* result = &finished->result;
   Edge* edge = result->edge;
+  NINJA_PROBE3(edge__finish, edge->id_, edge->outputs_[0]->path().c_str(),
+               (int)result->status);
 
-  // First try to extract dependencies from the result, if any.
-  // This must happen first as it filters the command output (we want
-  // to filter /showIncludes output, even on compile failure) and
+  // First add the dependencies read from the result, if any.
+  // This must happen first as reading them filters the command output (we
+  // want to filter /showIncludes output, even on compile failure) and
   // extraction itself can fail, which makes the command fail from a
   // build perspective.
   vector<Node*> deps_nodes;
-  string deps_type = edge->GetBinding("deps");
-  const string deps_prefix = edge->GetBinding("msvc_deps_prefix");
+  const string& deps_type = finished->deps_type;
   if (!deps_type.empty()) {
     string extract_err;
-    if (!ExtractDeps(result, deps_type, deps_prefix, &deps_nodes,
-                     &extract_err) &&
+    if (!AddDeps(finished, &deps_nodes, &extract_err) &&
         result->success()) {
-      if (!result->output.empty())
-        result->output.append("\n");
-      result->output.append(extract_err);
+      if (result->output_spill) {
+        fseek(result->output_spill, 0, SEEK_END);
+        fprintf(result->output_spill, "\n%s", extract_err.c_str());
+        rewind(result->output_spill);
+      } else {
+        if (!result->output.empty())
+          result->output.append("\n");
+        result->output.append(extract_err);
+      }
       result->status = ExitFailure;
     }
   }
 
+  // The edges of a batch finish with their command.
+  map<Edge*, vector<Edge*> >::iterator batch = batches_.find(edge);
+  vector<Edge*> edges;
+  if (batch != batches_.end())
+    edges.swap(batch->second);
+  else
+    edges.push_back(edge);
+
   int start_time, end_time;
   status_->BuildEdgeFinished(edge, result->success(), result->output,
-                             &start_time, &end_time);
+                             result->output_spill, &start_time, &end_time,
+                             (int)edges.size());
+  if (result->output_spill) {
+    fclose(result->output_spill);
+    result->output_spill = NULL;
+  }
+
+  for (vector<Edge*>::iterator e = edges.begin(); e != edges.end(); ++e) {
+    if (!FinishEdge(*e, finished, &deps_nodes, start_time, end_time, err))
+      return false;
+  }
+
+  // Delete any left over response file.
+  if (result->success()) {
+    string rspfile = edge->GetUnescapedRspfile();
+    if (!rspfile.empty() && !g_keep_rsp) {
+      disk_interface_->RemoveFile(rspfile);
+      ForgetRspfile(rspfile);
+    }
+  }
+
+  if (batch != batches_.end()) {
+    delete edge->env_;
+    delete edge;
+    batches_.erase(batch);
+    result->edge = edges.front();
+  }
+  return true;
+}
+
+bool Builder::FinishEdge(Edge* edge, FinishedCommand* finished,
+                         vector<Node*>* deps_nodes, int start_time,
+                         int end_time, string* err) {
+  CommandRunner::Result* result = &finished->result;
+  const string& deps_type = finished->deps_type;
+
+  if (failure_log_ && !edge->is_phony())
+    failure_log_->RecordResult(edge, result->success());
 
   // The rest of this function only applies to successful commands.
   if (!result->success()) {
     return plan_.EdgeFinished(edge, Plan::kEdgeFailed, err);
   }
 
-  // Restat the edge outputs
+  // Restat the edge outputs, keeping their mtimes for the deps log.
   TimeStamp output_mtime = 0;
-  bool restat = edge->GetBindingBool("restat");
+  vector<TimeStamp> new_mtimes;
+  bool restat = edge->GetBindingBool(kVarRestat);
+  bool restat_hash = restat && scan_.hash_log() &&
+      edge->GetBinding(kVarRestat) == "hash";
   if (!config_.dry_run) {
     bool node_cleaned = false;
 
-    for (vector<Node*>::iterator o = edge->outputs_.begin();
+    for (Node** o = edge->outputs_.begin();
          o != edge->outputs_.end(); ++o) {
       TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), err);
       if (new_mtime == -1)
         return false;
+      if (restat_hash && new_mtime > 0) {
+        // An output rewritten with the contents it had gets its old mtime
+        // back, so that neither this build nor the next sees it changed.
+        bool unchanged;
+        if (!scan_.hash_log()->RecordContents((*o)->path(), &unchanged, err))
+          return false;
+        if (unchanged && (*o)->mtime() > 0 && (*o)->mtime() != new_mtime &&
+            disk_interface_->SetMTime((*o)->path(), (*o)->mtime())) {
+          EXPLAIN("contents of %s unchanged; restoring its mtime",
+                  (*o)->path().c_str());
+          new_mtime = (*o)->mtime();
+        }
+      }
+      new_mtimes.push_back(new_mtime);
       if (new_mtime > output_mtime)
         output_mtime = new_mtime;
       if ((*o)->mtime() == new_mtime && restat) {
@@ -984,22 +2356,29 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
           return false;
         node_cleaned = true;
       }
+      // Edges using this output see it as it is now.
+      (*o)->set_mtime(new_mtime);
     }
 
     if (node_cleaned) {
       TimeStamp restat_mtime = 0;
       // If any output was cleaned, find the most recent mtime of any
-      // (existing) non-order-only input or the depfile.
-      for (vector<Node*>::iterator i = edge->inputs_.begin();
+      // (existing) non-order-only input or the depfile.  The inputs were
+      // stat()ed by the scan, or when the edges building them finished;
+      // one edited since is better left newer than what the log records.
+      for (Node** i = edge->inputs_.begin();
            i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
-        TimeStamp input_mtime = disk_interface_->Stat((*i)->path(), err);
-        if (input_mtime == -1)
-          return false;
+        TimeStamp input_mtime = (*i)->mtime();
+        if (!(*i)->status_known()) {
+          input_mtime = disk_interface_->Stat((*i)->path(), err);
+          if (input_mtime == -1)
+            return false;
+        }
         if (input_mtime > restat_mtime)
           restat_mtime = input_mtime;
       }
 
-      string depfile = edge->GetUnescapedDepfile();
+      const string& depfile = finished->depfile;
       if (restat_mtime != 0 && deps_type.empty() && !depfile.empty()) {
         TimeStamp depfile_mtime = disk_interface_->Stat(depfile, err);
         if (depfile_mtime == -1)
@@ -1019,48 +2398,52 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   if (!plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, err))
     return false;
 
-  // Delete any left over response file.
-  string rspfile = edge->GetUnescapedRspfile();
-  if (!rspfile.empty() && !g_keep_rsp)
-    disk_interface_->RemoveFile(rspfile);
-
   if (scan_.build_log()) {
     if (!scan_.build_log()->RecordCommand(edge, start_time, end_time,
-                                          output_mtime)) {
+                                          output_mtime, result->usage)) {
       *err = string("Error writing to build log: ") + strerror(errno);
       return false;
     }
   }
 
+  if (finished->keep_raw) {
+    string cache_err;
+    if (!action_cache_->Store(edge, finished->raw_output,
+                              finished->raw_depfile, *deps_nodes, &cache_err))
+      Warning("storing %s in the action cache: %s",
+              edge->outputs_[0]->path().c_str(), cache_err.c_str());
+  }
+
+  if (scan_.hash_log() && !config_.dry_run &&
+      edge->GetBindingBool(kVarHashInputs)) {
+    if (!scan_.hash_log()->RecordEdge(edge, *deps_nodes, new_mtimes, err))
+      return false;
+  }
+
   if (!deps_type.empty() && !config_.dry_run) {
     assert(edge->outputs_.size() >= 1 && "should have been rejected by parser");
-    for (std::vector<Node*>::const_iterator o = edge->outputs_.begin();
-         o != edge->outputs_.end(); ++o) {
-      TimeStamp deps_mtime = disk_interface_->Stat((*o)->path(), err);
-      if (deps_mtime == -1)
-        return false;
-      if (!scan_.deps_log()->RecordDeps(*o, deps_mtime, deps_nodes)) {
-        *err = std::string("Error writing to deps log: ") + strerror(errno);
-        return false;
-      }
+    // The outputs share one record of their deps.
+    if (!scan_.deps_log()->RecordDeps(
+            edge->outputs_.size(), edge->outputs_.begin(), &new_mtimes[0],
+            deps_nodes->size(),
+            deps_nodes->empty() ? NULL : &(*deps_nodes)[0])) {
+      *err = std::string("Error writing to deps log: ") + strerror(errno);
+      return false;
     }
   }
   return true;
 }
 
-bool Builder::ExtractDeps(CommandRunner::Result* result,
-                          const string& deps_type,
-                          const string& deps_prefix,
-                          vector<Node*>* deps_nodes,
-                          string* err) {
-  if (deps_type == "msvc") {
-    CLParser parser;
-    string output;
-    if (!parser.Parse(result->output, deps_prefix, &output, err))
-      return false;
-    result->output = output;
-    for (set<string>::iterator i = parser.includes_.begin();
-         i != parser.includes_.end(); ++i) {
+bool Builder::AddDeps(FinishedCommand* finished, vector<Node*>* deps_nodes,
+                      string* err) {
+  if (!finished->deps_read) {
+    *err = finished->deps_err;
+    return false;
+  }
+
+  if (finished->deps_type == "msvc") {
+    for (vector<string>::iterator i = finished->includes.begin();
+         i != finished->includes.end(); ++i) {
       // ~0 is assuming that with MSVC-parsed headers, it's ok to always make
       // all backslashes (as some of the slashes will certainly be backslashes
       // anyway). This could be fixed if necessary with some additional
@@ -1068,50 +2451,25 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
       deps_nodes->push_back(state_->GetNode(*i, ~0u));
     }
   } else
-  if (deps_type == "gcc") {
-    string depfile = result->edge->GetUnescapedDepfile();
-    if (depfile.empty()) {
-      *err = string("edge with deps=gcc but no depfile makes no sense");
-      return false;
-    }
-
-    // Read depfile content.  Treat a missing depfile as empty.
-    string content;
-    switch (disk_interface_->ReadFile(depfile, &content, err)) {
-    case DiskInterface::Okay:
-      break;
-    case DiskInterface::NotFound:
-      err->clear();
-      break;
-    case DiskInterface::OtherError:
-      return false;
-    }
-    if (content.empty())
+  if (finished->deps_type == "gcc") {
+    if (finished->depfile_contents.empty())
       return true;
 
-    DepfileParser deps(config_.depfile_parser_options);
-    if (!deps.Parse(&content, err))
-      return false;
-
     // XXX check depfile matches expected output.
+    const DepfileParser& deps = finished->depfile_parser;
     deps_nodes->reserve(deps.ins_.size());
-    for (vector<StringPiece>::iterator i = deps.ins_.begin();
-         i != deps.ins_.end(); ++i) {
-      uint64_t slash_bits;
-      if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits,
-                            err))
-        return false;
-      deps_nodes->push_back(state_->GetNode(*i, slash_bits));
-    }
+    for (size_t i = 0; i < deps.ins_.size(); ++i)
+      deps_nodes->push_back(state_->GetNode(deps.ins_[i],
+                                            deps.ins_slash_bits_[i]));
 
     if (!g_keep_depfile) {
-      if (disk_interface_->RemoveFile(depfile) < 0) {
+      if (disk_interface_->RemoveFile(finished->depfile) < 0) {
         *err = string("deleting depfile: ") + strerror(errno) + string("\n");
         return false;
       }
     }
   } else {
-    Fatal("unknown deps type '%s'", deps_type.c_str());
+    Fatal("unknown deps type '%s'", finished->deps_type.c_str());
   }
 
   return true;
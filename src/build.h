@@ -16,6 +16,7 @@
 #define NINJA_BUILD_H_
 
 #include <cstdio>
+#include <deque>
 #include <map>
 #include <memory>
 #include <queue>
@@ -26,15 +27,23 @@
 #include "depfile_parser.h"
 #include "graph.h"  // XXX needed for DependencyScan; should rearrange.
 #include "exit_status.h"
+#include "frontend.h"
+#include "hash_map.h"
 #include "line_printer.h"
 #include "metrics.h"
+#include "resource_usage.h"
 #include "util.h"  // int64_t
 
+struct ActionCache;
 struct BuildLog;
 struct BuildStatus;
 struct Builder;
 struct DiskInterface;
+struct DepfileCache;
+struct DyndepCache;
 struct Edge;
+struct FailureLog;
+struct HashLog;
 struct Node;
 struct State;
 
@@ -48,10 +57,31 @@ struct Plan {
   /// fill in |err| with an error message if there's a problem.
   bool AddTarget(const Node* node, string* err);
 
-  // Pop a ready edge off the queue of edges to build.
-  // Returns NULL if there's no work to do.
+  /// Compute the critical path weight of every edge in the plan and queue
+  /// the edges that are ready to run.  Call once all targets have been
+  /// added.  Edge durations, and the memory of edges that don't declare
+  /// it, are taken from |build_log|, which may be NULL.  The edges that
+  /// |failures| lists, if not NULL, and the edges they wait for, run before
+  /// any others.
+  void PrepareQueue(BuildLog* build_log, const FailureLog* failures = NULL);
+
+  // Pop a ready edge off the queue of edges to build.  Prefers the edge
+  // with the heaviest critical path, within the target picked by
+  // BuildConfig::target_share.
+  // Returns NULL if there's no work to do, or if starting the edge would
+  // exceed the memory budget of the build (see BuildConfig::max_memory).
   Edge* FindWork();
 
+  /// Take up to Edge::batch_ - 1 more ready edges that can run in one
+  /// command with |edge|, which FindWork() just returned, appending them to
+  /// |batch|.  They count as handed out, like |edge|.
+  void FindBatch(const Edge* edge, vector<Edge*>* batch);
+
+  /// Append up to |count| ready edges to |edges|, those FindWork() is to
+  /// hand out soonest first.  With a BuildConfig::target_share, the edges of
+  /// all targets are merged by priority.
+  void PeekReady(size_t count, vector<Edge*>* edges) const;
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_ > 0 && command_edges_ > 0; }
 
@@ -63,6 +93,11 @@ struct Plan {
     kEdgeSucceeded
   };
 
+  /// Record that the caller has started |edge|, which is in the plan and
+  /// has all of its inputs ready, so that it isn't handed out again.  Call
+  /// before PrepareQueue().
+  void EdgeStarted(Edge* edge);
+
   /// Mark an edge as done building (whether it succeeded or failed).
   /// If any of the edge's outputs are dyndep bindings of their dependents,
   /// this loads dynamic dependencies from the nodes' paths.
@@ -85,7 +120,7 @@ struct Plan {
                      const DyndepFile& ddf, string* err);
 private:
   bool RefreshDyndepDependents(DependencyScan* scan, const Node* node, string* err);
-  void UnmarkDependents(const Node* node, set<Node*>* dependents);
+  void UnmarkDependents(const Node* node, vector<Node*>* dependents);
   bool AddSubTarget(const Node* node, const Node* dependent, string* err,
                     set<Edge*>* dyndep_walk);
 
@@ -98,6 +133,9 @@ private:
   /// Enumerate possible steps we want for an edge.
   enum Want
   {
+    /// The edge is not part of the plan: we do not want to build it or
+    /// any of its dependents.
+    kNotInPlan,
     /// We do not want to build the edge, but we might want to build one of
     /// its dependents.
     kWantNothing,
@@ -108,21 +146,74 @@ private:
     kWantToFinish
   };
 
+  /// Look up what we want for |edge|.
+  Want GetWant(const Edge* edge) const {
+    return edge->id() < want_.size() ? want_[edge->id()] : kNotInPlan;
+  }
+
+  /// Like GetWant, but returns a modifiable entry, growing want_ as needed.
+  /// The reference is invalidated when another edge's entry is created.
+  Want& MutableWant(const Edge* edge) {
+    if (edge->id() >= want_.size()) {
+      want_.resize(edge->id() + 1, kNotInPlan);
+      pending_inputs_.resize(edge->id() + 1, 0);
+      share_of_.resize(edge->id() + 1, 0);
+    }
+    return want_[edge->id()];
+  }
+
+  /// Move the edges in ready_ to the queues of their shares, and return
+  /// the queue BuildConfig::target_share says to take the next edge from,
+  /// or NULL if none has a ready edge.
+  EdgePriorityQueue* PickShare();
+
+  /// Recount the inputs of an edge in the plan whose producing edge is not
+  /// ready yet.
+  void CountPendingInputs(const Edge* edge);
+
   void EdgeWanted(const Edge* edge);
-  bool EdgeMaybeReady(map<Edge*, Want>::iterator want_e, string* err);
+  bool EdgeMaybeReady(Edge* edge, string* err);
 
   /// Submits a ready edge as a candidate for execution.
   /// The edge may be delayed from running, for example if it's a member of a
   /// currently-full pool.
-  void ScheduleWork(map<Edge*, Want>::iterator want_e);
+  void ScheduleWork(Edge* edge);
+
+  /// Assign each edge in the plan the estimated duration of the longest
+  /// chain of commands from it to a target, and its estimated memory.
+  void ComputeCriticalPath(BuildLog* build_log, const FailureLog* failures);
+
+  /// Submit all edges of the plan whose inputs are already ready.
+  void ScheduleInitialEdges();
+
+  /// Keep track of which edges we want to build in this plan, indexed by
+  /// Edge::id().  Edges beyond the end of the vector are kNotInPlan.
+  vector<Want> want_;
 
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If it does contain an entry, the enumeration indicates what
-  /// we want for the edge.
-  map<Edge*, Want> want_;
+  /// For each edge in the plan, indexed by Edge::id(), the number of its
+  /// inputs whose producing edge is not ready yet.  An input listed twice
+  /// counts twice.  The edge is ready to run once this drops to zero.
+  vector<int> pending_inputs_;
+
+  /// Edges that have been added to the plan, in the order they were found.
+  /// May contain edges that have since left the plan.
+  vector<Edge*> plan_edges_;
+
+  EdgePriorityQueue ready_;
+
+  /// With a BuildConfig::target_share other than SHARE_NONE, one per target
+  /// passed to AddTarget(), in order: the target's ready edges, and how
+  /// many of its edges have been handed out and haven't finished.
+  struct Share {
+    Share() : running(0) {}
+    EdgePriorityQueue ready;
+    int running;
+  };
+  vector<Share> shares_;
 
-  set<Edge*> ready_;
+  /// For each edge in the plan, indexed by Edge::id(), the index in
+  /// shares_ of the first target it was found for.
+  vector<int> share_of_;
 
   Builder* builder_;
 
@@ -131,6 +222,10 @@ private:
 
   /// Total remaining number of wanted edges.
   int wanted_edges_;
+
+  /// The total estimated memory of the edges handed out by FindWork() that
+  /// haven't finished.
+  int64_t running_memory_;
 };
 
 /// CommandRunner is an interface that wraps running the build
@@ -143,14 +238,28 @@ struct CommandRunner {
 
   /// The result of waiting for a command.
   struct Result {
-    Result() : edge(NULL) {}
+    Result() : edge(NULL), output_spill(NULL), restored(false) {}
     Edge* edge;
     ExitStatus status;
     string output;
+    /// The output past |output|, if there was too much to keep in memory,
+    /// rewound to its start.  Whoever finishes the command closes it.
+    FILE* output_spill;
+    /// What the command used, if the runner knows.
+    ResourceUsage usage;
+    /// Whether the outputs came from the action cache instead.
+    bool restored;
     bool success() const { return status == ExitSuccess; }
   };
   /// Wait for a command to complete, or return false if interrupted.
   virtual bool WaitForCommand(Result* result) = 0;
+  /// Wait at most |timeout_millis| for a command to make progress, without
+  /// reaping it.  Returns false if interrupted.
+  virtual bool WaitForActivity(int timeout_millis) { return true; }
+
+  /// Whether a command has finished, so that WaitForCommand() would return
+  /// at once.  Doesn't wait; false if the runner can't tell.
+  virtual bool HasFinishedCommand() { return false; }
 
   virtual vector<Edge*> GetActiveEdges() { return vector<Edge*>(); }
   virtual void Abort() {}
@@ -158,8 +267,14 @@ struct CommandRunner {
 
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
-  BuildConfig() : verbosity(NORMAL), dry_run(false), parallelism(1),
-                  failures_allowed(1), max_load_average(-0.0f) {}
+  BuildConfig() : verbosity(NORMAL), dry_run(false),
+                  dry_run_format(DRY_RUN_STATUS), parallelism(1),
+                  failures_allowed(1), max_load_average(-0.0f),
+                  max_pressure(-0.0), max_memory(0), jobserver(false),
+                  frontend_fd(-1), remote_parallelism(0), deps_threads(0),
+                  io_thread(false), start_during_scan(false),
+                  prefetch_edges(0), target_share(SHARE_NONE),
+                  affinity(AFFINITY_NONE) {}
 
   enum Verbosity {
     NORMAL,
@@ -168,19 +283,102 @@ struct BuildConfig {
   };
   Verbosity verbosity;
   bool dry_run;
+  /// What a dry run prints of the commands it would run.  With anything
+  /// but DRY_RUN_STATUS, it goes through Builder::DryRun() rather than
+  /// Build(), and prints a line for each command and nothing else.
+  enum DryRunFormat {
+    /// The status lines a build prints.
+    DRY_RUN_STATUS,
+    /// The outputs of the commands, one per line.
+    DRY_RUN_OUTPUTS,
+    /// The commands.
+    DRY_RUN_COMMANDS,
+    /// A JSON object with the rule, outputs and command of each.
+    DRY_RUN_JSON
+  };
+  DryRunFormat dry_run_format;
   int parallelism;
   int failures_allowed;
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average;
+  /// The percentage of time the CPU or memory may be contended for, above
+  /// which fewer jobs run, and below which more do, up to |parallelism|.
+  /// A value of 0 or less means that the number of jobs doesn't adapt.
+  double max_pressure;
+  /// The estimated memory (in kilobytes, see Edge::memory()) of the running
+  /// commands above which no more are started, or 0 for no limit.
+  int64_t max_memory;
+  /// Whether to run a jobserver for the commands, if ninja isn't already
+  /// a client of one.
+  bool jobserver;
+  /// With |jobserver|, the fifo of the jobserver to share with other ninja
+  /// processes given the same one (see Jobserver::Share()), or "" for one
+  /// of our own.
+  string jobserver_fifo;
+  /// The fd to report the progress of the build to as events (see
+  /// Frontend) instead of printing it, or -1.
+  int frontend_fd;
+  /// The directory of the action cache (see ActionCache), or "" for none.
+  string cache_dir;
+  /// The command to run the commands of the edges in pools that aren't
+  /// local through, with the command line as its last argument, or "".
+  string remote_launcher;
+  /// The number of commands to run at once with a remote launcher, or 0
+  /// for as many as |parallelism|.  Those of the local pools count too,
+  /// but their depths limit them.
+  int remote_parallelism;
+  /// The number of threads that read and parse the deps of finished
+  /// commands while the build loop goes on reaping and starting others, or
+  /// 0 to read them on the build loop.  The DiskInterface's ReadFile() is
+  /// then called from those threads.
+  int deps_threads;
+  /// Whether to create the directories of outputs and write response
+  /// files on a thread of its own, so that a slow file system doesn't hold
+  /// up starting other commands; only the command that needs them waits.
+  /// The DiskInterface's MakeDir() and WriteFile() are then called from
+  /// that thread.
+  bool io_thread;
+  /// Whether to start the commands the dirty scan of Builder::AddTarget()
+  /// finds ready to run right away, as far as the command runner takes
+  /// them, instead of once the whole plan is known.
+  bool start_during_scan;
+  /// The number of ready edges, next in line to start, whose inputs to
+  /// have the system read into its page cache while commands are running,
+  /// or 0.  See Builder::PrefetchInputs().
+  int prefetch_edges;
+  /// How to split the jobs between the targets of a build, each of which
+  /// counts the edges it was the first one found to need as its own.
+  enum TargetShare {
+    /// Run the edge with the heaviest critical path, whatever its target.
+    SHARE_NONE,
+    /// Run an edge of the target with the fewest edges running.
+    SHARE_FAIR,
+    /// Run the edges of the targets in the order they were added, so that
+    /// the first target is done as early as possible.
+    SHARE_FIRST
+  };
+  TargetShare target_share;
+  /// What to pin the commands run on this machine to (see AffinitySlots).
+  /// Remote commands and work requests aren't pinned.
+  enum Affinity {
+    AFFINITY_NONE,
+    /// A CPU each.
+    AFFINITY_CPU,
+    /// The CPUs of a NUMA node each.
+    AFFINITY_NODE
+  };
+  Affinity affinity;
   DepfileParserOptions depfile_parser_options;
 };
 
 /// Builder wraps the build process: starting commands, updating status.
-struct Builder {
+struct Builder : public DirtyEdgeObserver {
   Builder(State* state, const BuildConfig& config,
           BuildLog* build_log, DepsLog* deps_log,
-          DiskInterface* disk_interface);
+          DiskInterface* disk_interface, HashLog* hash_log = NULL,
+          DyndepCache* dyndep_cache = NULL,
+          DepfileCache* depfile_cache = NULL);
   ~Builder();
 
   /// Clean up after interrupted commands by deleting output files.
@@ -199,8 +397,21 @@ struct Builder {
   /// It is an error to call this function when AlreadyUpToDate() is true.
   bool Build(string* err);
 
+  /// Run the build as a dry run, without telling the status or the logs,
+  /// and append the edges whose commands it would run to |edges| in an
+  /// order they could run in.  Each edge finishes as soon as it starts,
+  /// and the edges of a batch are taken one at a time.  Returns false on
+  /// error, like a dyndep file that can't be loaded.  It is an error to
+  /// call this function when AlreadyUpToDate() is true.
+  bool DryRun(vector<Edge*>* edges, string* err);
+
   bool StartEdge(Edge* edge, string* err);
 
+  /// Start |edge| while AddTarget() is still scanning, if
+  /// BuildConfig::start_during_scan allows and the command runner can take
+  /// it; Build() then announces it.
+  virtual void EdgeReady(Edge* edge);
+
   /// Update status ninja logs following a command termination.
   /// @return false if the build can not proceed further due to a fatal error.
   bool FinishCommand(CommandRunner::Result* result, string* err);
@@ -210,6 +421,17 @@ struct Builder {
     scan_.set_build_log(log);
   }
 
+  /// Run the edges that |failures| lists first, and record in it which
+  /// commands fail.
+  void SetFailureLog(FailureLog* failures) {
+    failure_log_ = failures;
+  }
+
+  /// Let the scan skip what didn't change according to |summary|.
+  void SetScanSummary(ScanSummary* summary) {
+    scan_.set_summary(summary);
+  }
+
   /// Load the dyndep information provided by the given node.
   bool LoadDyndeps(Node* node, string* err);
 
@@ -224,13 +446,90 @@ struct Builder {
   BuildStatus* status_;
 
  private:
-   bool ExtractDeps(CommandRunner::Result* result, const string& deps_type,
-                    const string& deps_prefix, vector<Node*>* deps_nodes,
-                    string* err);
+  struct FinishedCommand;
+  struct DepsWorkers;
+  struct IOWorker;
+
+  /// Set up |command_runner_|, unless the caller already did.
+  void CreateCommandRunner();
+  /// Start |edge| as StartEdge() does, without telling |status_|.
+  bool PrepareEdge(Edge* edge, string* err);
+
+  /// Note that the response file at |path| is to hold |content|.  Returns
+  /// the path of a response file this build already wrote with the same
+  /// content, to link to instead, or "".
+  string AddRspfile(const string& path, const string& content);
+  /// Note that the response file at |path| is gone.
+  void ForgetRspfile(const string& path);
+
+  /// Make the edge that runs the command of |batch|, the edges FindWork()
+  /// and FindBatch() returned, at once, with the inputs and outputs of all.
+  Edge* NewBatch(const vector<Edge*>& batch);
+
+  /// Start the command of |edge|, or restore its outputs from the action
+  /// cache, once its directories and response file are in place.
+  bool LaunchEdge(Edge* edge, string* err);
+  /// Take the edges the I/O thread has prepared, waiting for one if
+  /// |wait|, and launch them as far as the command runner allows.
+  bool LaunchPrepared(bool wait, string* err);
+
+  /// Take what reading the deps of the edge of |finished| needs from its
+  /// bindings, which can only be evaluated on the build loop.
+  void PrepareFinish(FinishedCommand* finished);
+  /// Add the deps read for |finished| to the state.
+  bool AddDeps(FinishedCommand* finished, vector<Node*>* deps_nodes,
+               string* err);
+  bool FinishCommand(FinishedCommand* finished, string* err);
+  /// Record that |edge|, whose command |finished| ran from |start_time| to
+  /// |end_time|, is done; |edge| may be one of a batch.
+  bool FinishEdge(Edge* edge, FinishedCommand* finished,
+                  vector<Node*>* deps_nodes, int start_time,
+                  int end_time, string* err);
+
+  /// Prefetch the inputs of the next BuildConfig::prefetch_edges ready
+  /// edges that haven't been, as far as kPrefetchBytes allows.
+  void PrefetchInputs();
 
   DiskInterface* disk_interface_;
   DependencyScan scan_;
 
+  /// The action cache, if BuildConfig::cache_dir is set.
+  ActionCache* action_cache_;
+  /// The results of the edges restored from the action cache, which don't
+  /// go through the command runner.
+  deque<CommandRunner::Result> restored_;
+  /// The edges started while AddTarget() was scanning.
+  vector<Edge*> started_early_;
+  /// The threads reading deps during Build(), if BuildConfig::deps_threads
+  /// asks for any.
+  DepsWorkers* deps_workers_;
+  /// The thread preparing the files of edges during Build(), if
+  /// BuildConfig::io_thread asks for it.
+  IOWorker* io_worker_;
+  /// The edges that are prepared but wait for the command runner to take
+  /// more commands.
+  deque<Edge*> prepared_;
+  /// The directories known to exist during Build(), or, if false, that
+  /// the I/O thread is yet to create.  The keys point into |dir_names_|.
+  ExternalStringHashMap<bool>::Type dirs_;
+  deque<string> dir_names_;
+  /// The response files written during Build() and still in place, by
+  /// the hash of their content, and the other way around.
+  map<uint64_t, string> rspfiles_;
+  map<string, uint64_t> rspfile_hashes_;
+  /// The edges whose inputs were prefetched during Build() and that
+  /// haven't started, with the bytes prefetched for them.
+  map<Edge*, int64_t> prefetched_edges_;
+  /// The inputs prefetched during Build().
+  set<Node*> prefetched_nodes_;
+  /// The sum of |prefetched_edges_|.
+  int64_t prefetched_bytes_;
+  /// Where the commands that failed are recorded, if anywhere.
+  FailureLog* failure_log_;
+  /// The edges made by NewBatch() that haven't finished, with the edges
+  /// whose command each runs.
+  map<Edge*, vector<Edge*> > batches_;
+
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
   Builder(const Builder &other);        // DO NOT IMPLEMENT
   void operator=(const Builder &other); // DO NOT IMPLEMENT
@@ -240,13 +539,23 @@ struct Builder {
 struct BuildStatus {
   explicit BuildStatus(const BuildConfig& config);
   void PlanHasTotalEdges(int total);
-  void BuildEdgeStarted(const Edge* edge);
+  /// |count| is the number of edges whose command |edge| runs, for the
+  /// edge of a batch.
+  void BuildEdgeStarted(const Edge* edge, int count = 1);
+  /// |output_spill|, if not NULL, holds the output past |output|.
   void BuildEdgeFinished(Edge* edge, bool success, const string& output,
-                         int* start_time, int* end_time);
+                         FILE* output_spill, int* start_time, int* end_time,
+                         int count = 1);
   void BuildLoadDyndeps();
   void BuildStarted();
   void BuildFinished();
 
+  /// How long until a status line held back by the refresh rate is due,
+  /// or -1 if there's none.
+  int MillisUntilRefresh() const;
+  /// Print the held back status line, if it's due.
+  void Refresh();
+
   enum EdgeStatus {
     kEdgeStarted,
     kEdgeFinished,
@@ -261,10 +570,24 @@ struct BuildStatus {
                               EdgeStatus status) const;
 
  private:
-  void PrintStatus(const Edge* edge, EdgeStatus status);
+  /// Print the status line for |edge|.  Unless |force|, that's held back
+  /// if a status line was printed less than the refresh interval ago.
+  void PrintStatus(const Edge* edge, EdgeStatus status, bool force = false);
+
+  /// Print what a command printed, streaming any of it in |spill|.
+  void PrintCommandOutput(const string& output, FILE* spill);
 
   const BuildConfig& config_;
 
+  /// The least time between status line redraws on a smart terminal, from
+  /// NINJA_STATUS_REFRESH_MILLIS.
+  int refresh_millis_;
+  /// When the status line was last printed.
+  int64_t last_status_millis_;
+  /// The status line held back, if the edge isn't NULL.
+  const Edge* pending_status_edge_;
+  EdgeStatus pending_status_;
+
   /// Time the build started.
   int64_t start_time_millis_;
 
@@ -274,6 +597,14 @@ struct BuildStatus {
   typedef map<const Edge*, int> RunningEdgeMap;
   RunningEdgeMap running_edges_;
 
+  /// With a trace, the lane and start time (in microseconds) of each
+  /// running edge.
+  typedef map<const Edge*, pair<int, int64_t> > TracedEdgeMap;
+  TracedEdgeMap traced_edges_;
+
+  /// Where the progress goes, if BuildConfig::frontend_fd is set.
+  Frontend frontend_;
+
   /// Prints progress output.
   LinePrinter printer_;
 
@@ -23,6 +23,7 @@
 #include "build_log.h"
 #include "disk_interface.h"
 
+#include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +35,8 @@
 
 #include "build.h"
 #include "graph.h"
+#include "hash.h"
+#include "log_recompaction.h"
 #include "metrics.h"
 #include "util.h"
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
@@ -46,14 +49,278 @@
 // older runs.
 // Once the number of redundant entries exceeds a threshold, we write
 // out a new file and replace the existing one with it.
+//
+// Since version 6 the log is binary.  After the signature line, it
+// is a series of records, each starting with a 4-byte header that holds the
+// record type in its upper 2 bits and the size of the rest in the others:
+//   path records contain a path, padded to 4 bytes with NUL bytes, and the
+//     one's complement of the id the path gets (to detect concurrent writes
+//     of multiple ninja processes to the log, like in the deps log);
+//   entry records contain a path id, the start and end time, the restat
+//     mtime, the command hash and, since version 7, the command's resource
+//     usage;
+//   a table record, only ever first, holds a whole log as written by
+//     recompaction: the entry and bucket counts, the entries (each with the
+//     offset and length of its output in the string table), a hash index of
+//     the outputs with linear probing, and the string table itself.
+// Loading only maps the table; entries are read from it as they're looked
+// up.  The records after it are read like the text logs used to be.
+// Everything is in native byte order and read with memcpy(), as the
+// records aren't aligned.
+//
+// Since version 8, command hashes and the table's index use HashBytes().
+// Before, they were MurmurHash64A and MurmurHash2; the command hashes of
+// such logs are converted when they're upgraded, where the command that
+// builds the output is still the one that was logged.
 
 namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 4;
-const int kCurrentVersion = 5;
+const int kCurrentVersion = 8;
+// The first version with resource usage in entries.
+const int kUsageVersion = 7;
+// The first version hashing with HashBytes().
+const int kHashBytesVersion = 8;
+// The first binary version.
+const int kFirstBinaryVersion = 6;
+
+const int kRecordTypeShift = 30;
+const unsigned kRecordSizeMask = (1u << kRecordTypeShift) - 1;
+enum RecordType {
+  kPathRecord,
+  kEntryRecord,
+  kTableRecord,
+};
+
+// The largest path or entry record, as in the deps log.
+const unsigned kMaxRecordSize = (1 << 19) - 1;
+
+// The size of the resource usage in entries.
+const unsigned kUsageSize = 5 * 4;
+// The size of an entry record, after its header, and the size it had in
+// version 6.
+const unsigned kEntrySize = 4 + 4 + 4 + 8 + 8 + kUsageSize;
+const unsigned kEntrySizeV6 = kEntrySize - kUsageSize;
+// The size of an entry in a table, now and in version 6.
+const unsigned kTableEntrySize = 4 + 4 + 4 + 4 + 8 + 8 + kUsageSize;
+const unsigned kTableEntrySizeV6 = kTableEntrySize - kUsageSize;
+// The size of the counts at the start of a table.
+const unsigned kTableHeaderSize = 4 + 4;
+
+template<typename T>
+T Read(const char* data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+template<typename T>
+bool Write(FILE* f, T value) {
+  return fwrite(&value, sizeof(value), 1, f) == 1;
+}
+
+template<typename T>
+void Append(string* out, T value) {
+  out->append((const char*)&value, sizeof(value));
+}
+
+void AppendUsage(string* out, const ResourceUsage& usage) {
+  Append(out, usage.user_time);
+  Append(out, usage.system_time);
+  Append(out, usage.max_rss);
+  Append(out, usage.read_blocks);
+  Append(out, usage.write_blocks);
+}
+
+bool WriteUsage(FILE* f, const ResourceUsage& usage) {
+  return Write(f, usage.user_time) && Write(f, usage.system_time) &&
+      Write(f, usage.max_rss) && Write(f, usage.read_blocks) &&
+      Write(f, usage.write_blocks);
+}
+
+ResourceUsage ReadUsage(const char* data) {
+  ResourceUsage usage;
+  usage.user_time = Read<unsigned>(data);
+  usage.system_time = Read<unsigned>(data + 4);
+  usage.max_rss = Read<unsigned>(data + 8);
+  usage.read_blocks = Read<unsigned>(data + 12);
+  usage.write_blocks = Read<unsigned>(data + 16);
+  return usage;
+}
+
+/// Append the record that gives |path| |id| to |out|.
+bool WritePathRecord(string* out, StringPiece path, int id) {
+  int path_size = path.size();
+  int padding = (4 - path_size % 4) % 4;  // Pad path to 4 byte boundary.
+  unsigned size = path_size + padding + 4;
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return false;
+  }
+  Append(out, size | kPathRecord << kRecordTypeShift);
+  out->append(path.str_, path_size);
+  out->append(padding, '\0');
+  Append(out, ~(unsigned)id);
+  return true;
+}
+
+/// An entry as it goes into a table.  The output is in a LogEntry or in a
+/// loaded table.
+struct TableEntry {
+  StringPiece output;
+  int start_time;
+  int end_time;
+  TimeStamp mtime;
+  uint64_t command_hash;
+  ResourceUsage usage;
+};
+
+TableEntry ToTableEntry(const BuildLog::LogEntry& entry) {
+  TableEntry table_entry = { entry.output, entry.start_time, entry.end_time,
+                             entry.mtime, entry.command_hash, entry.usage };
+  return table_entry;
+}
+
+/// Read the table entry of |size| at |data|, whose output is |output|.
+TableEntry ReadTableEntry(const char* data, unsigned size,
+                          StringPiece output) {
+  TableEntry entry = { output, Read<int>(data + 8), Read<int>(data + 12),
+                       Read<TimeStamp>(data + 16), Read<uint64_t>(data + 24),
+                       ResourceUsage() };
+  if (size >= kTableEntrySize)
+    entry.usage = ReadUsage(data + kTableEntrySizeV6);
+  return entry;
+}
+
+/// Write a log consisting of a table of |entries| to |f|.  Returns false
+/// and sets errno on error.
+bool WriteTableLog(FILE* f, const vector<TableEntry>& entries) {
+  // Lay out the index, with buckets for at least twice as many entries.
+  unsigned bucket_count = 1;
+  while (bucket_count < entries.size() * 2)
+    bucket_count *= 2;
+  vector<unsigned> buckets(bucket_count);
+  uint64_t record_size =
+      kTableHeaderSize + (uint64_t)entries.size() * kTableEntrySize +
+      (uint64_t)bucket_count * 4;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    StringPiece output = entries[i].output;
+    unsigned bucket = (unsigned)HashBytes(output.str_, output.len_) &
+        (bucket_count - 1);
+    while (buckets[bucket])
+      bucket = (bucket + 1) & (bucket_count - 1);
+    buckets[bucket] = i + 1;
+    record_size += output.len_;
+  }
+  if (record_size > kRecordSizeMask) {
+    errno = EFBIG;
+    return false;
+  }
+
+  bool ok = fprintf(f, kFileSignature, kCurrentVersion) > 0 &&
+      Write(f, (unsigned)record_size | kTableRecord << kRecordTypeShift) &&
+      Write(f, (unsigned)entries.size()) && Write(f, bucket_count);
+  unsigned string_offset = 0;
+  for (size_t i = 0; ok && i < entries.size(); ++i) {
+    const TableEntry& entry = entries[i];
+    ok = Write(f, string_offset) && Write(f, (unsigned)entry.output.len_) &&
+        Write(f, entry.start_time) && Write(f, entry.end_time) &&
+        Write(f, entry.mtime) && Write(f, entry.command_hash) &&
+        WriteUsage(f, entry.usage);
+    string_offset += entry.output.len_;
+  }
+  if (ok)
+    ok = fwrite(&buckets[0], 4, bucket_count, f) == bucket_count;
+  for (size_t i = 0; ok && i < entries.size(); ++i) {
+    StringPiece output = entries[i].output;
+    ok = output.len_ == 0 || fwrite(output.str_, output.len_, 1, f) == 1;
+  }
+  return ok;
+}
+
+/// Replace the log at |path| by a table of |entries|, through |temp_path|.
+bool ReplaceWithTableLog(const string& path, const string& temp_path,
+                         const vector<TableEntry>& entries, string* err) {
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (!WriteTableLog(f, entries)) {
+    *err = strerror(errno);
+    fclose(f);
+    return false;
+  }
+
+  fclose(f);
+  if (unlink(path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  return true;
+}
+
+/// Writes a recompacted log in the background: a table, followed by the
+/// path records of the old log so that the ids of the entries appended
+/// meanwhile stay valid.
+struct BackgroundWriter : public LogRecompaction::Writer {
+  virtual bool WriteLog(FILE* f) {
+    if (!WriteTableLog(f, entries_))
+      return false;
+    string record;
+    for (size_t id = 0; id < paths_.size(); ++id) {
+      if (!WritePathRecord(&record, paths_[id], id) ||
+          fwrite(record.data(), record.size(), 1, f) != 1)
+        return false;
+      record.clear();
+    }
+    return true;
+  }
+
+  vector<TableEntry> entries_;
+  vector<StringPiece> paths_;
+};
+
+// The hashes of logs before version 8: MurmurHash2 for the table's index
+// and its 64bit variant for commands, by Austin Appleby.
+unsigned int MurmurHash2(const void* key, size_t len) {
+  static const unsigned int seed = 0xDECAFBAD;
+  const unsigned int m = 0x5bd1e995;
+  const int r = 24;
+  unsigned int h = seed ^ len;
+  const unsigned char* data = (const unsigned char*)key;
+  while (len >= 4) {
+    unsigned int k;
+    memcpy(&k, data, sizeof k);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h *= m;
+    h ^= k;
+    data += 4;
+    len -= 4;
+  }
+  switch (len) {
+  case 3: h ^= data[2] << 16;
+          NINJA_FALLTHROUGH;
+  case 2: h ^= data[1] << 8;
+          NINJA_FALLTHROUGH;
+  case 1: h ^= data[0];
+    h *= m;
+  };
+  h ^= h >> 13;
+  h *= m;
+  h ^= h >> 15;
+  return h;
+}
 
-// 64bit MurmurHash2, by Austin Appleby
 #if defined(_MSC_VER)
 #define BIG_CONSTANT(x) (x)
 #else   // defined(_MSC_VER)
@@ -106,89 +373,140 @@ uint64_t MurmurHash64A(const void* key, size_t len) {
 
 // static
 uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
-  return MurmurHash64A(command.str_, command.len_);
+  return HashBytes(command.str_, command.len_);
 }
 
-BuildLog::LogEntry::LogEntry(const string& output)
+BuildLog::LogEntry::LogEntry(StringPiece output)
   : output(output) {}
 
-BuildLog::LogEntry::LogEntry(const string& output, uint64_t command_hash,
+BuildLog::LogEntry::LogEntry(StringPiece output, uint64_t command_hash,
   int start_time, int end_time, TimeStamp restat_mtime)
   : output(output), command_hash(command_hash),
     start_time(start_time), end_time(end_time), mtime(restat_mtime)
 {}
 
 BuildLog::BuildLog()
-  : log_file_(NULL), needs_recompaction_(false) {}
+  : needs_recompaction_(false), needs_upgrade_(false),
+    legacy_hashes_(false), table_(NULL),
+    table_entry_count_(0), table_bucket_count_(0),
+    table_entry_size_(kTableEntrySize), table_strings_(NULL),
+    table_strings_size_(0) {}
 
 BuildLog::~BuildLog() {
   Close();
+  Clear();
+}
+
+void BuildLog::Clear() {
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    delete i->second;
+  entries_.clear();
+  output_strings_.Clear();
 }
 
 bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
                             string* err) {
-  if (needs_recompaction_) {
+  // A text log is upgraded right away, so that nothing is appended to it.
+  if (needs_upgrade_) {
     if (!Recompact(path, user, err))
       return false;
+  } else if (needs_recompaction_) {
+    if (!StartRecompaction(path, user, err))
+      return false;
   }
 
-  log_file_ = fopen(path.c_str(), "ab");
-  if (!log_file_) {
+  FILE* f = fopen(path.c_str(), "ab");
+  if (!f) {
     *err = strerror(errno);
     return false;
   }
-  setvbuf(log_file_, NULL, _IOLBF, BUFSIZ);
-  SetCloseOnExec(fileno(log_file_));
+  SetCloseOnExec(fileno(f));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
-  fseek(log_file_, 0, SEEK_END);
+  fseek(f, 0, SEEK_END);
 
-  if (ftell(log_file_) == 0) {
-    if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
+  if (ftell(f) == 0) {
+    if (fprintf(f, kFileSignature, kCurrentVersion) < 0 || fflush(f) != 0) {
       *err = strerror(errno);
+      fclose(f);
       return false;
     }
   }
-
+  writer_.Open(f);
   return true;
 }
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp mtime) {
-  string command = edge->EvaluateCommand(true);
-  uint64_t command_hash = LogEntry::HashCommand(command);
-  for (vector<Node*>::iterator out = edge->outputs_.begin();
+                             TimeStamp mtime, const ResourceUsage& usage) {
+  uint64_t command_hash = edge->CommandHash();
+  // The records of all outputs go to the log together.
+  string records;
+  for (Node** out = edge->outputs_.begin();
        out != edge->outputs_.end(); ++out) {
     const string& path = (*out)->path();
-    Entries::iterator i = entries_.find(path);
-    LogEntry* log_entry;
-    if (i != entries_.end()) {
-      log_entry = i->second;
-    } else {
-      log_entry = new LogEntry(path);
+    LogEntry* log_entry = LookupByOutput(path);
+    if (!log_entry) {
+      log_entry = new LogEntry(output_strings_.Copy(path));
       entries_.insert(Entries::value_type(log_entry->output, log_entry));
     }
     log_entry->command_hash = command_hash;
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->mtime = mtime;
+    log_entry->usage = usage;
 
-    if (log_file_) {
-      if (!WriteEntry(log_file_, *log_entry))
-        return false;
-      if (fflush(log_file_) != 0) {
-          return false;
-      }
+    if (writer_.is_open() && !WriteEntry(&records, *log_entry)) {
+      int error = errno;
+      writer_.Append(records);
+      errno = error;
+      return false;
     }
   }
-  return true;
+  return !writer_.is_open() || writer_.Append(records);
 }
 
 void BuildLog::Close() {
-  if (log_file_)
-    fclose(log_file_);
-  log_file_ = NULL;
+  if (writer_.is_open() && !writer_.Close())
+    Warning("writing build log: %s", strerror(errno));
+
+  if (recompaction_.running()) {
+    string err;
+    if (!recompaction_.Finish(&err))
+      Warning("recompacting build log: %s", err.c_str());
+  }
+}
+
+bool BuildLog::StartRecompaction(const string& path, const BuildLogUser& user,
+                                 string* err) {
+  METRIC_RECORD_PHASE(".ninja_log recompact start");
+  needs_recompaction_ = false;
+
+  // Decide what to keep here, as the build may change the entries; the
+  // background thread only gets copies, and pieces of the mapped table.
+  BackgroundWriter* writer = new BackgroundWriter;
+  vector<StringPiece> dead_outputs;
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
+    if (user.IsPathDead(i->first))
+      dead_outputs.push_back(i->first);
+    else
+      writer->entries_.push_back(ToTableEntry(*i->second));
+  }
+  for (unsigned i = 0; table_ && i < table_entry_count_; ++i) {
+    StringPiece output = TableOutput(i);
+    if (!output.size() || entries_.find(output) != entries_.end() ||
+        user.IsPathDead(output))
+      continue;
+    writer->entries_.push_back(ReadTableEntry(
+        table_ + kTableHeaderSize + i * table_entry_size_, table_entry_size_,
+        output));
+  }
+  writer->paths_ = paths_;
+
+  for (size_t i = 0; i < dead_outputs.size(); ++i)
+    entries_.erase(dead_outputs[i]);
+
+  return recompaction_.Start(path, writer, err);
 }
 
 struct LineReader {
@@ -243,7 +561,192 @@ struct LineReader {
 };
 
 LoadStatus BuildLog::Load(const string& path, string* err) {
-  METRIC_RECORD(".ninja_log load");
+  METRIC_RECORD_PHASE(".ninja_log load");
+  // A recompaction may still be reading the old mapping.
+  assert(!recompaction_.running());
+  // The entries may point into the mapping that is about to be replaced.
+  Clear();
+  table_ = NULL;
+  needs_upgrade_ = false;
+  legacy_hashes_ = false;
+  path_ids_.clear();
+  paths_.clear();
+
+  int status = mapped_.Map(path, err);
+  if (status < 0) {
+    if (status == -ENOENT) {
+      err->clear();
+      return LOAD_NOT_FOUND;
+    }
+    return LOAD_ERROR;
+  }
+  for (int version = kCurrentVersion; version >= kFirstBinaryVersion;
+       --version) {
+    char signature[sizeof(kFileSignature) + 16];
+    snprintf(signature, sizeof(signature), kFileSignature, version);
+    size_t signature_size = strlen(signature);
+    if (mapped_.size() >= signature_size &&
+        memcmp(mapped_.data(), signature, signature_size) == 0) {
+      return LoadBinary(path, version, signature_size, err);
+    }
+  }
+  mapped_.Unmap();
+  return LoadText(path, err);
+}
+
+LoadStatus BuildLog::LoadBinary(const string& path, int version,
+                                size_t offset, string* err) {
+  const char* data = mapped_.data();
+  size_t size = mapped_.size();
+  bool read_failed = false;
+  unsigned entry_size = kEntrySize;
+  table_entry_size_ = kTableEntrySize;
+  // Older logs are rewritten in the current format before anything is
+  // appended.
+  if (version < kUsageVersion) {
+    entry_size = kEntrySizeV6;
+    table_entry_size_ = kTableEntrySizeV6;
+  }
+  if (version < kCurrentVersion) {
+    needs_recompaction_ = true;
+    needs_upgrade_ = true;
+  }
+  legacy_hashes_ = version < kHashBytesVersion;
+
+  // A recompacted log starts with its table.
+  if (size - offset >= 4) {
+    unsigned header = Read<unsigned>(data + offset);
+    if ((header >> kRecordTypeShift) == kTableRecord) {
+      size_t record_size = header & kRecordSizeMask;
+      const char* table = data + offset + 4;
+      if (record_size < kTableHeaderSize || record_size > size - offset - 4) {
+        read_failed = true;
+      } else {
+        unsigned entry_count = Read<unsigned>(table);
+        unsigned bucket_count = Read<unsigned>(table + 4);
+        uint64_t strings_start = kTableHeaderSize +
+            (uint64_t)entry_count * table_entry_size_ +
+            (uint64_t)bucket_count * 4;
+        if (strings_start > record_size ||
+            (bucket_count & (bucket_count - 1)) != 0) {
+          read_failed = true;
+        } else {
+          table_ = table;
+          table_entry_count_ = entry_count;
+          table_bucket_count_ = bucket_count;
+          table_strings_ = table + strings_start;
+          table_strings_size_ = record_size - strings_start;
+          offset += 4 + record_size;
+        }
+      }
+    }
+  }
+
+  int unique_entry_count = table_entry_count_;
+  int total_entry_count = table_entry_count_;
+  int appended_entry_count = 0;
+  while (!read_failed && offset < size) {
+    if (size - offset < 4) {
+      read_failed = true;
+      break;
+    }
+    unsigned header = Read<unsigned>(data + offset);
+    unsigned record_size = header & kRecordSizeMask;
+    if (record_size > kMaxRecordSize || record_size > size - offset - 4) {
+      read_failed = true;
+      break;
+    }
+    const char* buf = data + offset + 4;
+
+    switch (header >> kRecordTypeShift) {
+    case kPathRecord: {
+      if (record_size < 8 || record_size % 4 != 0) {
+        read_failed = true;
+        break;
+      }
+      int path_size = record_size - 4;
+      // There can be up to 3 bytes of padding.
+      if (buf[path_size - 1] == '\0') --path_size;
+      if (buf[path_size - 1] == '\0') --path_size;
+      if (buf[path_size - 1] == '\0') --path_size;
+      // Check that the expected index matches the actual index. This can only
+      // happen if two ninja processes write to the same log concurrently.
+      int expected_id = ~Read<unsigned>(buf + record_size - 4);
+      if (expected_id != (int)paths_.size()) {
+        read_failed = true;
+        break;
+      }
+      StringPiece output(buf, path_size);
+      path_ids_[output] = paths_.size();
+      paths_.push_back(output);
+      break;
+    }
+    case kEntryRecord: {
+      unsigned id = Read<unsigned>(buf);
+      if (record_size != entry_size || id >= paths_.size()) {
+        read_failed = true;
+        break;
+      }
+      StringPiece output = paths_[id];
+      LogEntry* entry;
+      Entries::iterator i = entries_.find(output);
+      if (i != entries_.end()) {
+        entry = i->second;
+      } else {
+        entry = new LogEntry(output);
+        entries_.insert(Entries::value_type(entry->output, entry));
+        if (FindInTable(output) < 0)
+          ++unique_entry_count;
+      }
+      ++total_entry_count;
+      ++appended_entry_count;
+
+      entry->start_time = Read<int>(buf + 4);
+      entry->end_time = Read<int>(buf + 8);
+      entry->mtime = Read<TimeStamp>(buf + 12);
+      entry->command_hash = Read<uint64_t>(buf + 20);
+      if (entry_size >= kEntrySize)
+        entry->usage = ReadUsage(buf + kEntrySizeV6);
+      break;
+    }
+    default:
+      read_failed = true;
+    }
+    if (read_failed)
+      break;
+    offset += 4 + record_size;
+  }
+
+  if (read_failed) {
+    // An error occurred while loading; try to recover by truncating the
+    // file to the last fully-read record.
+    *err = "premature end of file";
+    if (!Truncate(path, offset, err))
+      return LOAD_ERROR;
+
+    // The truncate succeeded; we'll just report the load error as a
+    // warning because the build can proceed.
+    *err += "; recovering";
+    return LOAD_SUCCESS;
+  }
+
+  // Rebuild the log if there are too many dead records, or if many entries
+  // were appended since the table was written: those are read one by one.
+  int kMinCompactionEntryCount = 100;
+  int kCompactionRatio = 3;
+  if (total_entry_count > kMinCompactionEntryCount &&
+      total_entry_count > unique_entry_count * kCompactionRatio) {
+    needs_recompaction_ = true;
+  } else if (appended_entry_count > kMinCompactionEntryCount &&
+             appended_entry_count * kCompactionRatio >
+                 (int)table_entry_count_) {
+    needs_recompaction_ = true;
+  }
+
+  return LOAD_SUCCESS;
+}
+
+LoadStatus BuildLog::LoadText(const string& path, string* err) {
   FILE* file = fopen(path.c_str(), "r");
   if (!file) {
     if (errno == ENOENT)
@@ -309,7 +812,7 @@ LoadStatus BuildLog::Load(const string& path, string* err) {
     end = (char*)memchr(start, kFieldSeparator, line_end - start);
     if (!end)
       continue;
-    string output = string(start, end - start);
+    StringPiece output(start, end - start);
 
     start = end + 1;
     end = line_end;
@@ -319,7 +822,7 @@ LoadStatus BuildLog::Load(const string& path, string* err) {
     if (i != entries_.end()) {
       entry = i->second;
     } else {
-      entry = new LogEntry(output);
+      entry = new LogEntry(output_strings_.Copy(output));
       entries_.insert(Entries::value_type(entry->output, entry));
       ++unique_entry_count;
     }
@@ -350,6 +853,9 @@ LoadStatus BuildLog::Load(const string& path, string* err) {
   int kCompactionRatio = 3;
   if (log_version < kCurrentVersion) {
     needs_recompaction_ = true;
+    needs_upgrade_ = true;
+    // Version 4 logs have the commands, which were hashed above.
+    legacy_hashes_ = log_version >= 5;
   } else if (total_entry_count > kMinCompactionEntryCount &&
              total_entry_count > unique_entry_count * kCompactionRatio) {
     needs_recompaction_ = true;
@@ -362,60 +868,156 @@ BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second;
+  int index = FindInTable(path);
+  if (index >= 0)
+    return AddTableEntry(index);
   return NULL;
 }
 
-bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
-          entry.start_time, entry.end_time, entry.mtime,
-          entry.output.c_str(), entry.command_hash) > 0;
+const BuildLog::Entries& BuildLog::entries() {
+  if (table_) {
+    for (unsigned i = 0; i < table_entry_count_; ++i) {
+      StringPiece output = TableOutput(i);
+      if (output.size() && entries_.find(output) == entries_.end())
+        AddTableEntry(i);
+    }
+    // Everything the table has is in entries_ now.  The mapping stays, as
+    // path_ids_ may point into it.
+    table_ = NULL;
+  }
+  return entries_;
 }
 
-bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
-                         string* err) {
-  METRIC_RECORD(".ninja_log recompact");
+StringPiece BuildLog::TableOutput(unsigned index) const {
+  const char* entry = table_ + kTableHeaderSize + index * table_entry_size_;
+  unsigned offset = Read<unsigned>(entry);
+  unsigned length = Read<unsigned>(entry + 4);
+  if (offset > table_strings_size_ || length > table_strings_size_ - offset)
+    return StringPiece();
+  return StringPiece(table_strings_ + offset, length);
+}
 
-  Close();
-  string temp_path = path + ".recompact";
-  FILE* f = fopen(temp_path.c_str(), "wb");
-  if (!f) {
-    *err = strerror(errno);
-    return false;
+int BuildLog::FindInTable(StringPiece path) const {
+  if (!table_ || !table_bucket_count_)
+    return -1;
+  const char* buckets =
+      table_ + kTableHeaderSize + table_entry_count_ * table_entry_size_;
+  unsigned mask = table_bucket_count_ - 1;
+  unsigned bucket = (legacy_hashes_ ? MurmurHash2(path.str_, path.len_) :
+                     (unsigned)HashBytes(path.str_, path.len_)) & mask;
+  for (unsigned probes = 0; probes < table_bucket_count_; ++probes) {
+    unsigned slot = Read<unsigned>(buckets + bucket * 4);
+    if (slot == 0 || slot > table_entry_count_)
+      return -1;
+    if (TableOutput(slot - 1) == path)
+      return slot - 1;
+    bucket = (bucket + 1) & mask;
   }
+  return -1;
+}
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
-    *err = strerror(errno);
-    fclose(f);
-    return false;
+BuildLog::LogEntry* BuildLog::AddTableEntry(int index) {
+  const char* data = table_ + kTableHeaderSize + index * table_entry_size_;
+  LogEntry* entry = new LogEntry(TableOutput(index),
+                                 Read<uint64_t>(data + 24),
+                                 Read<int>(data + 8), Read<int>(data + 12),
+                                 Read<TimeStamp>(data + 16));
+  if (table_entry_size_ >= kTableEntrySize)
+    entry->usage = ReadUsage(data + kTableEntrySizeV6);
+  entries_.insert(Entries::value_type(entry->output, entry));
+  return entry;
+}
+
+bool BuildLog::WriteEntry(string* out, const LogEntry& entry) {
+  int id;
+  ExternalStringHashMap<int>::Type::iterator i = path_ids_.find(entry.output);
+  if (i != path_ids_.end()) {
+    id = i->second;
+  } else {
+    // Write the output's path record first.
+    id = paths_.size();
+    if (!WritePathRecord(out, entry.output, id))
+      return false;
+    path_ids_.insert(make_pair(StringPiece(entry.output), id));
+    paths_.push_back(entry.output);
   }
 
+  Append(out, kEntrySize | kEntryRecord << kRecordTypeShift);
+  Append(out, id);
+  Append(out, entry.start_time);
+  Append(out, entry.end_time);
+  Append(out, entry.mtime);
+  Append(out, entry.command_hash);
+  AppendUsage(out, entry.usage);
+  return true;
+}
+
+int BuildLog::Merge(BuildLog* other, const PathRemaps& remaps) {
+  int merged = 0;
+  string records;
+  const Entries& theirs = other->entries();
+  for (Entries::const_iterator i = theirs.begin(); i != theirs.end(); ++i) {
+    const LogEntry& their_entry = *i->second;
+    string output = RemapPath(their_entry.output.AsString(), remaps);
+    LogEntry* log_entry = LookupByOutput(output);
+    if (log_entry && log_entry->mtime >= their_entry.mtime)
+      continue;
+    if (!log_entry) {
+      log_entry = new LogEntry(output_strings_.Copy(output));
+      entries_.insert(Entries::value_type(log_entry->output, log_entry));
+    }
+    log_entry->command_hash = their_entry.command_hash;
+    log_entry->start_time = their_entry.start_time;
+    log_entry->end_time = their_entry.end_time;
+    log_entry->mtime = their_entry.mtime;
+    log_entry->usage = their_entry.usage;
+    ++merged;
+    if (writer_.is_open() && !WriteEntry(&records, *log_entry))
+      return -1;
+  }
+  if (writer_.is_open() && !writer_.Append(records))
+    return -1;
+  return merged;
+}
+
+bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
+                         string* err) {
+  METRIC_RECORD_PHASE(".ninja_log recompact");
+
+  Close();
+  entries();
+  vector<TableEntry> live_entries;
   vector<StringPiece> dead_outputs;
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
     if (user.IsPathDead(i->first)) {
       dead_outputs.push_back(i->first);
       continue;
     }
-
-    if (!WriteEntry(f, *i->second)) {
-      *err = strerror(errno);
-      fclose(f);
-      return false;
+    if (legacy_hashes_) {
+      // Where the command is the one that was logged, log it with the
+      // current hash.  Otherwise it changed, and keeping the old hash
+      // still has the output rebuilt.
+      LogEntry* entry = i->second;
+      string command = user.CommandFor(entry->output);
+      if (!command.empty() &&
+          MurmurHash64A(command.data(), command.size()) ==
+              entry->command_hash) {
+        entry->command_hash = LogEntry::HashCommand(command);
+      }
     }
+    live_entries.push_back(ToTableEntry(*i->second));
   }
 
-  for (size_t i = 0; i < dead_outputs.size(); ++i)
-    entries_.erase(dead_outputs[i]);
-
-  fclose(f);
-  if (unlink(path.c_str()) < 0) {
-    *err = strerror(errno);
+  if (!ReplaceWithTableLog(path, path + ".recompact", live_entries, err))
     return false;
-  }
+  // The new log has no path records to append entries to yet.
+  path_ids_.clear();
+  paths_.clear();
+  needs_upgrade_ = false;
+  legacy_hashes_ = false;
 
-  if (rename(temp_path.c_str(), path.c_str()) < 0) {
-    *err = strerror(errno);
-    return false;
-  }
+  for (size_t i = 0; i < dead_outputs.size(); ++i)
+    entries_.erase(dead_outputs[i]);
 
   return true;
 }
@@ -424,55 +1026,48 @@ bool BuildLog::Restat(const StringPiece path,
                       const DiskInterface& disk_interface,
                       const int output_count, char** outputs,
                       std::string* const err) {
-  METRIC_RECORD(".ninja_log restat");
+  METRIC_RECORD_PHASE(".ninja_log restat");
 
   Close();
-  std::string temp_path = path.AsString() + ".restat";
-  FILE* f = fopen(temp_path.c_str(), "wb");
-  if (!f) {
-    *err = strerror(errno);
-    return false;
-  }
-
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
-    *err = strerror(errno);
-    fclose(f);
-    return false;
-  }
+  entries();
+  ExternalStringHashMap<bool>::Type wanted;
+  for (int j = 0; j < output_count; ++j)
+    wanted.insert(make_pair(StringPiece(outputs[j]), true));
+
+  // Stat the outputs as one batch, which the disk interface may spread
+  // over threads; on a network file system, stat()ing a large log one
+  // entry at a time is bound by the round trips.
+  vector<LogEntry*> restat;
+  vector<string> paths;
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
-    bool skip = output_count > 0;
-    for (int j = 0; j < output_count; ++j) {
-      if (i->second->output == outputs[j]) {
-        skip = false;
-        break;
-      }
-    }
-    if (!skip) {
-      const TimeStamp mtime = disk_interface.Stat(i->second->output, err);
-      if (mtime == -1) {
-        fclose(f);
+    if (output_count > 0 && wanted.find(i->first) == wanted.end())
+      continue;
+    restat.push_back(i->second);
+    paths.push_back(i->second->output.AsString());
+  }
+  vector<TimeStamp> mtimes;
+  disk_interface.StatBatch(paths, &mtimes);
+  for (size_t i = 0; i < restat.size(); ++i) {
+    if (mtimes[i] == -1) {
+      // StatBatch() doesn't describe errors; Stat() again for them.
+      mtimes[i] = disk_interface.Stat(paths[i], err);
+      if (mtimes[i] == -1)
         return false;
-      }
-      i->second->mtime = mtime;
-    }
-
-    if (!WriteEntry(f, *i->second)) {
-      *err = strerror(errno);
-      fclose(f);
-      return false;
     }
+    restat[i]->mtime = mtimes[i];
   }
 
-  fclose(f);
-  if (unlink(path.str_) < 0) {
-    *err = strerror(errno);
-    return false;
-  }
+  vector<TableEntry> all_entries;
+  all_entries.reserve(entries_.size());
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    all_entries.push_back(ToTableEntry(*i->second));
 
-  if (rename(temp_path.c_str(), path.str_) < 0) {
-    *err = strerror(errno);
+  std::string log_path = path.AsString();
+  if (!ReplaceWithTableLog(log_path, log_path + ".restat", all_entries, err))
     return false;
-  }
-
+  path_ids_.clear();
+  paths_.clear();
+  needs_upgrade_ = false;
+  legacy_hashes_ = false;
   return true;
 }
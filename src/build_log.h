@@ -16,11 +16,16 @@
 #define NINJA_BUILD_LOG_H_
 
 #include <string>
+#include <vector>
 #include <stdio.h>
 using namespace std;
 
+#include "arena.h"
 #include "hash_map.h"
 #include "load_status.h"
+#include "log_recompaction.h"
+#include "log_writer.h"
+#include "resource_usage.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
@@ -32,6 +37,11 @@ struct BuildLogUser {
   /// Return if a given output is no longer part of the build manifest.
   /// This is only called during recompaction and doesn't have to be fast.
   virtual bool IsPathDead(StringPiece s) const = 0;
+
+  /// The command, with the contents of its response file, that builds
+  /// |output| now, or "" if there's none.  This is only called when
+  /// upgrading a log whose commands were hashed differently.
+  virtual string CommandFor(StringPiece output) const { return string(); }
 };
 
 /// Store a log of every command ran for every build.
@@ -41,24 +51,36 @@ struct BuildLogUser {
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+///
+/// The log is a binary file (see build_log.cc for the layout).  Writing
+/// appends a record per output; recompaction rewrites the file as a table
+/// with a hash index, which Load() maps and LookupByOutput() reads
+/// entries from on demand.  Older text logs are still read, and are
+/// rewritten in the current format on the next recompaction.
 struct BuildLog {
   BuildLog();
   ~BuildLog();
 
   bool OpenForWrite(const string& path, const BuildLogUser& user, string* err);
   bool RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp mtime = 0);
+                     TimeStamp mtime = 0,
+                     const ResourceUsage& usage = ResourceUsage());
+  /// Stop writing, and finish the recompaction OpenForWrite() started.
   void Close();
 
   /// Load the on-disk log.
   LoadStatus Load(const string& path, string* err);
 
   struct LogEntry {
-    string output;
+    /// Points into the loaded log, or into the log's copies of the paths
+    /// it didn't load, so that a large log doesn't hold every path twice.
+    StringPiece output;
     uint64_t command_hash;
     int start_time;
     int end_time;
     TimeStamp mtime;
+    /// What the command used the last time it ran.
+    ResourceUsage usage;
 
     static uint64_t HashCommand(StringPiece command);
 
@@ -69,16 +91,18 @@ struct BuildLog {
           mtime == o.mtime;
     }
 
-    explicit LogEntry(const string& output);
-    LogEntry(const string& output, uint64_t command_hash,
+    explicit LogEntry(StringPiece output);
+    LogEntry(StringPiece output, uint64_t command_hash,
              int start_time, int end_time, TimeStamp restat_mtime);
   };
 
   /// Lookup a previously-run command by its output path.
   LogEntry* LookupByOutput(const string& path);
 
-  /// Serialize an entry into a log file.
-  bool WriteEntry(FILE* f, const LogEntry& entry);
+  /// Take the entries of |other| whose outputs, with |remaps| applied,
+  /// have no entry here or an older one: one whose recorded mtime is
+  /// older.  Returns the number of entries taken, or -1 on error writing.
+  int Merge(BuildLog* other, const PathRemaps& remaps);
 
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const string& path, const BuildLogUser& user, string* err);
@@ -88,12 +112,67 @@ struct BuildLog {
               int output_count, char** outputs, std::string* err);
 
   typedef ExternalStringHashMap<LogEntry*>::Type Entries;
-  const Entries& entries() const { return entries_; }
+  /// All entries in the log.  This reads every entry of a loaded table,
+  /// so it's slow; don't call it on every build.
+  const Entries& entries();
 
  private:
+  friend struct MemoryStats;
+
+  /// Forget all the entries.
+  void Clear();
+
+  /// Load a log in the binary format of |version| from mapped_, whose
+  /// records start at |offset|.
+  LoadStatus LoadBinary(const string& path, int version, size_t offset,
+                        string* err);
+  /// Load a log in one of the older text formats.
+  LoadStatus LoadText(const string& path, string* err);
+
+  /// The output of the |index|th entry of the loaded table, or an empty
+  /// piece if the table is damaged there.
+  StringPiece TableOutput(unsigned index) const;
+  /// Find |path| in the loaded table.  Returns its index, or -1.
+  int FindInTable(StringPiece path) const;
+  /// Add the |index|th entry of the loaded table to entries_.
+  LogEntry* AddTableEntry(int index);
+
+  /// Append the record of an entry, preceded by the record for its output
+  /// path if there isn't one yet, to |out|.
+  bool WriteEntry(string* out, const LogEntry& entry);
+  /// Start rewriting the log without its dead entries in the background.
+  /// Close() finishes it.
+  bool StartRecompaction(const string& path, const BuildLogUser& user,
+                         string* err);
+
   Entries entries_;
-  FILE* log_file_;
+  /// The outputs of the entries that don't point into mapped_.
+  StringArena output_strings_;
+  /// Appends to the log OpenForWrite() opened.
+  LogWriter writer_;
   bool needs_recompaction_;
+  /// Whether the loaded log is in an older format.
+  bool needs_upgrade_;
+  /// Whether the loaded log hashed with the functions before HashBytes().
+  bool legacy_hashes_;
+
+  /// The loaded log, which table_ points into.
+  MappedFile mapped_;
+  /// The recompaction started by OpenForWrite(), if any.
+  LogRecompaction recompaction_;
+  /// The table of a loaded, compacted log, or NULL.
+  const char* table_;
+  unsigned table_entry_count_;
+  unsigned table_bucket_count_;
+  /// The size of each entry in the table, which depends on its version.
+  unsigned table_entry_size_;
+  const char* table_strings_;
+  size_t table_strings_size_;
+
+  /// Maps output -> id of its path record in the log being appended to.
+  ExternalStringHashMap<int>::Type path_ids_;
+  /// Maps id -> path, for the path records in the log being appended to.
+  vector<StringPiece> paths_;
 };
 
 #endif // NINJA_BUILD_LOG_H_
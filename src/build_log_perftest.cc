@@ -12,8 +12,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifndef _WIN32
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+#endif
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "build_log.h"
 #include "graph.h"
@@ -27,6 +36,7 @@
 #endif
 
 const char kTestFilename[] = "BuildLogPerfTest-tempfile";
+const char kTextTestFilename[] = "BuildLogPerfTest-tempfile-text";
 
 struct NoDeadPaths : public BuildLogUser {
   virtual bool IsPathDead(StringPiece) const { return false; }
@@ -95,36 +105,50 @@ bool WriteTestData(string* err) {
                       /*mtime=*/0);
   }
 
-  return true;
+  // Write the same entries in the last text format, to compare with.
+  FILE* f = fopen(kTextTestFilename, "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  fprintf(f, "# ninja log v5\n");
+  for (BuildLog::Entries::const_iterator i = log.entries().begin();
+       i != log.entries().end(); ++i) {
+    const BuildLog::LogEntry& entry = *i->second;
+    fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
+            entry.start_time, entry.end_time, entry.mtime,
+            entry.output.AsString().c_str(), entry.command_hash);
+  }
+  fclose(f);
+
+  // Loads are fast once the log has been recompacted into a table.
+  return log.Recompact(kTestFilename, no_dead_paths, err);
 }
 
-int main() {
-  vector<int> times;
+/// Load |filename| a few times, looking every entry up if |lookup|,
+/// and print the times taken.
+bool TimeLoad(const char* filename, bool lookup) {
   string err;
-
-  if (!WriteTestData(&err)) {
-    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
-    return 1;
-  }
-
   {
     // Read once to warm up disk cache.
     BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
+    if (!log.Load(filename, &err)) {
       fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+      return false;
     }
   }
+  vector<int> times;
   const int kNumRepetitions = 5;
   for (int i = 0; i < kNumRepetitions; ++i) {
     int64_t start = GetTimeMillis();
     BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
+    if (!log.Load(filename, &err)) {
       fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+      return false;
     }
+    if (lookup)
+      log.entries();
     int delta = (int)(GetTimeMillis() - start);
-    printf("%dms\n", delta);
     times.push_back(delta);
   }
 
@@ -139,11 +163,24 @@ int main() {
       max = times[i];
   }
 
-  printf("min %dms  max %dms  avg %.1fms\n",
-         min, max, total / times.size());
+  printf("%s%s: min %dms  max %dms  avg %.1fms\n",
+         filename == kTextTestFilename ? "text log" : "binary log",
+         lookup ? ", all entries" : "", min, max, total / times.size());
+  return true;
+}
+
+int main() {
+  string err;
+  if (!WriteTestData(&err)) {
+    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+    return 1;
+  }
+
+  bool ok = TimeLoad(kTextTestFilename, false) &&
+      TimeLoad(kTestFilename, false) && TimeLoad(kTestFilename, true);
 
   unlink(kTestFilename);
+  unlink(kTextTestFilename);
 
-  return 0;
+  return ok ? 0 : 1;
 }
-
@@ -14,6 +14,7 @@
 
 #include "build_log.h"
 
+#include "graph.h"
 #include "util.h"
 #include "test.h"
 
@@ -40,6 +41,12 @@ struct BuildLogTest : public StateTestWithBuiltinRules, public BuildLogUser {
     unlink(kTestFilename);
   }
   virtual bool IsPathDead(StringPiece s) const { return false; }
+  virtual string CommandFor(StringPiece output) const {
+    Node* node = state_.LookupNode(output);
+    if (!node || !node->in_edge())
+      return string();
+    return node->in_edge()->EvaluateCommand(true);
+  }
 };
 
 TEST_F(BuildLogTest, WriteRead) {
@@ -67,7 +74,58 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_TRUE(e2);
   ASSERT_TRUE(*e1 == *e2);
   ASSERT_EQ(15, e1->start_time);
-  ASSERT_EQ("out", e1->output);
+  ASSERT_EQ("out", e1->output.AsString());
+}
+
+TEST_F(BuildLogTest, OutputsOutliveTheManifest) {
+  // The log keeps its own copies of the paths it didn't load, in blocks
+  // that long paths don't fit in.
+  string long_path(20000, 'x');
+  BuildLog log;
+  {
+    State state;
+    AssertParse(&state,
+("rule cat\n  command = cat $in > $out\n"
+"build out1 " + long_path + ": cat in\n"
+"build out2: cat in\n").c_str());
+    log.RecordCommand(state.edges_[0], 15, 18);
+    log.RecordCommand(state.edges_[1], 20, 25);
+  }
+
+  ASSERT_EQ(3u, log.entries().size());
+  BuildLog::LogEntry* e = log.LookupByOutput(long_path);
+  ASSERT_TRUE(e);
+  EXPECT_EQ(long_path, e->output.AsString());
+  EXPECT_EQ(15, e->start_time);
+  e = log.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  EXPECT_EQ("out2", e->output.AsString());
+  EXPECT_EQ(20, e->start_time);
+}
+
+TEST_F(BuildLogTest, RecordsEdgeCommandHash) {
+  AssertParse(&state_,
+"rule cat_rsp\n"
+"  command = cat @$rspfile > $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"build out: cat_rsp in\n");
+
+  // The hash includes the response file, and is the one the log records.
+  Edge* edge = state_.edges_[0];
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(edge->EvaluateCommand(true)),
+            edge->CommandHash());
+
+  BuildLog log;
+  string err;
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.RecordCommand(edge, 15, 18);
+  log.Close();
+
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(edge->CommandHash(), e->command_hash);
 }
 
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
@@ -242,7 +300,8 @@ struct TestDiskInterface : public DiskInterface {
 TEST_F(BuildLogTest, Restat) {
   FILE* f = fopen(kTestFilename, "wb");
   fprintf(f, "# ninja log v4\n"
-             "1\t2\t3\tout\tcommand\n");
+             "1\t2\t3\tout\tcommand\n"
+             "1\t2\t3\tout2\tcommand2\n");
   fclose(f);
   std::string err;
   BuildLog log;
@@ -252,12 +311,14 @@ TEST_F(BuildLogTest, Restat) {
   ASSERT_EQ(3, e->mtime);
 
   TestDiskInterface testDiskInterface;
-  char out2[] = { 'o', 'u', 't', '2' };
+  char out2[] = "out2";
   char* filter2[] = { out2 };
   EXPECT_TRUE(log.Restat(kTestFilename, testDiskInterface, 1, filter2, &err));
   ASSERT_EQ("", err);
   e = log.LookupByOutput("out");
   ASSERT_EQ(3, e->mtime); // unchanged, since the filter doesn't match
+  e = log.LookupByOutput("out2");
+  ASSERT_EQ(4, e->mtime);
 
   EXPECT_TRUE(log.Restat(kTestFilename, testDiskInterface, 0, NULL, &err));
   ASSERT_EQ("", err);
@@ -305,14 +366,288 @@ TEST_F(BuildLogTest, MultiTargetEdge) {
   ASSERT_TRUE(e1);
   BuildLog::LogEntry* e2 = log.LookupByOutput("out.d");
   ASSERT_TRUE(e2);
-  ASSERT_EQ("out", e1->output);
-  ASSERT_EQ("out.d", e2->output);
+  ASSERT_EQ("out", e1->output.AsString());
+  ASSERT_EQ("out.d", e2->output.AsString());
   ASSERT_EQ(21, e1->start_time);
   ASSERT_EQ(21, e2->start_time);
   ASSERT_EQ(22, e2->end_time);
   ASSERT_EQ(22, e2->end_time);
 }
 
+TEST_F(BuildLogTest, UpgradeTextLog) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v5\n");
+  fprintf(f, "123\t456\t789\tout\t1234abcd\n");
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  // Opening for writing rewrites the log in the current format.
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(0u, contents.find("# ninja log v8\n"));
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(456, e->end_time);
+  ASSERT_EQ(789, e->mtime);
+  ASSERT_EQ(0x1234abcdu, e->command_hash);
+}
+
+TEST_F(BuildLogTest, UpgradeV6Log) {
+  // A path record for "out", and an entry record for it.
+  const char kPath[] = "out\0";
+  uint32_t path_header = 8, id = ~0u;
+  uint32_t entry_header = 28 | 1u << 30;
+  int32_t entry[3] = { 0, 123, 456 };
+  int64_t mtime = 789;
+  uint64_t hash = 0x1234abcd;
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  fwrite(&path_header, 4, 1, f);
+  fwrite(kPath, 4, 1, f);
+  fwrite(&id, 4, 1, f);
+  fwrite(&entry_header, 4, 1, f);
+  fwrite(entry, 4, 3, f);
+  fwrite(&mtime, 8, 1, f);
+  fwrite(&hash, 8, 1, f);
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(0u, e->usage.max_rss);
+  // Opening for writing rewrites the log in the current format.
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(0u, contents.find("# ninja log v8\n"));
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(456, e->end_time);
+  ASSERT_EQ(789, e->mtime);
+  ASSERT_EQ(0x1234abcdu, e->command_hash);
+}
+
+TEST_F(BuildLogTest, Merge) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, 5);
+  log1.RecordCommand(state_.edges_[1], 20, 25, 10);
+
+  // "out" is older on the other shard, "mid" newer, and "other" new.
+  BuildLog log2;
+  log2.RecordCommand(state_.edges_[0], 1, 2, 3);
+  log2.RecordCommand(state_.edges_[1], 1, 2, 20);
+  AssertParse(&state_, "build /shard/other: cat in\n");
+  log2.RecordCommand(state_.edges_[2], 3, 4, 20);
+
+  PathRemaps remaps;
+  remaps.push_back(make_pair("/shard", "/here"));
+  EXPECT_EQ(2, log1.Merge(&log2, remaps));
+  log1.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, log3.entries().size());
+  EXPECT_EQ(5, log3.LookupByOutput("out")->mtime);
+  EXPECT_EQ(20, log3.LookupByOutput("mid")->mtime);
+  EXPECT_EQ(1, log3.LookupByOutput("mid")->start_time);
+  ASSERT_TRUE(log3.LookupByOutput("/here/other"));
+  EXPECT_FALSE(log3.LookupByOutput("/shard/other"));
+}
+
+TEST_F(BuildLogTest, UpgradeConvertsCommandHashes) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n");
+
+  // Entries for "out", with the hash version 7 gave its command, and for
+  // "out2", whose command changed since.
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v7\n");
+  const char* kPaths[] = { "out\0", "out2" };
+  const uint64_t kHashes[] = { 0x825e3d38f2a7975bull, 0x1234abcd };
+  for (uint32_t id = 0; id < 2; ++id) {
+    uint32_t path_header = 8, check = ~id;
+    fwrite(&path_header, 4, 1, f);
+    fwrite(kPaths[id], 4, 1, f);
+    fwrite(&check, 4, 1, f);
+    uint32_t entry_header = 48 | 1u << 30;
+    int32_t entry[3] = { (int32_t)id, 123, 456 };
+    int64_t mtime = 789;
+    uint32_t usage[5] = { 0, 0, 0, 0, 0 };
+    fwrite(&entry_header, 4, 1, f);
+    fwrite(entry, 4, 3, f);
+    fwrite(&mtime, 8, 1, f);
+    fwrite(&kHashes[id], 8, 1, f);
+    fwrite(usage, 4, 5, f);
+  }
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(GetNode("out")->in_edge()->CommandHash(), e->command_hash);
+  EXPECT_EQ(789, e->mtime);
+  e = log2.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(0x1234abcdu, e->command_hash);
+}
+
+TEST_F(BuildLogTest, Usage) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  ResourceUsage usage;
+  usage.user_time = 1;
+  usage.system_time = 2;
+  usage.max_rss = 3;
+  usage.read_blocks = 4;
+  usage.write_blocks = 5;
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, usage);
+  usage.max_rss = 6;
+  log1.RecordCommand(state_.edges_[1], 20, 25, 0, usage);
+  log1.Close();
+
+  // The usage is in both appended entries and tables.
+  for (int i = 0; i < 2; ++i) {
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    BuildLog::LogEntry* e = log2.LookupByOutput("out");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(1u, e->usage.user_time);
+    EXPECT_EQ(2u, e->usage.system_time);
+    EXPECT_EQ(3u, e->usage.max_rss);
+    EXPECT_EQ(4u, e->usage.read_blocks);
+    EXPECT_EQ(5u, e->usage.write_blocks);
+    e = log2.LookupByOutput("mid");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(6u, e->usage.max_rss);
+    EXPECT_TRUE(log2.Recompact(kTestFilename, *this, &err));
+    ASSERT_EQ("", err);
+  }
+}
+
+TEST_F(BuildLogTest, Table) {
+  FILE* f;
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n"
+"build out2 out3: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, 3);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.RecordCommand(state_.edges_[2], 30, 31);
+  EXPECT_TRUE(log1.Recompact(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+
+  // Entries are read from the table as they're looked up.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e1 = log1.LookupByOutput("out");
+  BuildLog::LogEntry* e2 = log2.LookupByOutput("out");
+  ASSERT_TRUE(e2);
+  ASSERT_TRUE(*e1 == *e2);
+  ASSERT_EQ("out", e2->output.AsString());
+  ASSERT_EQ(3, e2->mtime);
+  ASSERT_EQ(e2, log2.LookupByOutput("out"));
+  ASSERT_FALSE(log2.LookupByOutput("in"));
+  ASSERT_EQ(4u, log2.entries().size());
+  ASSERT_TRUE(*log1.LookupByOutput("out3") == *log2.LookupByOutput("out3"));
+
+  // Entries appended after the table override it.
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  EXPECT_TRUE(log3.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log3.RecordCommand(state_.edges_[1], 40, 41);
+  log3.RecordCommand(state_.edges_[1], 50, 51);
+  log3.Close();
+
+  BuildLog log4;
+  EXPECT_TRUE(log4.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log4.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(50, e->start_time);
+  e = log4.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(30, e->start_time);
+  ASSERT_EQ(4u, log4.entries().size());
+
+  struct stat statbuf;
+  ASSERT_EQ(0, stat(kTestFilename, &statbuf));
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+
+  // For all possible truncations of the table, assert that we don't
+  // crash when loading or looking up.
+  for (off_t size = statbuf.st_size; size > 0; --size) {
+    f = fopen(kTestFilename, "wb");
+    fwrite(contents.data(), size, 1, f);
+    fclose(f);
+
+    BuildLog log5;
+    err.clear();
+    ASSERT_TRUE(log5.Load(kTestFilename, &err) == LOAD_SUCCESS ||
+                !err.empty());
+    log5.LookupByOutput("out");
+    log5.LookupByOutput("mid");
+    log5.entries();
+  }
+}
+
 struct BuildLogRecompactTest : public BuildLogTest {
   virtual bool IsPathDead(StringPiece s) const { return s == "out2"; }
 };
@@ -353,4 +688,52 @@ TEST_F(BuildLogRecompactTest, Recompact) {
   ASSERT_FALSE(log2.LookupByOutput("out2"));
 }
 
+TEST_F(BuildLogRecompactTest, BackgroundRecompact) {
+  AssertParse(&state_,
+"build out: cat in\n"
+"build out2: cat in\n"
+"build out3: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  for (int i = 0; i < 200; ++i)
+    log1.RecordCommand(state_.edges_[0], 15, 18 + i);
+  log1.RecordCommand(state_.edges_[1], 21, 22);
+  log1.Close();
+
+  // Opening the log starts recompacting it; record more while it runs.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log2.RecordCommand(state_.edges_[0], 30, 31);
+  log2.RecordCommand(state_.edges_[2], 40, 41);
+  log2.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log3.entries().size());
+  BuildLog::LogEntry* e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(30, e->start_time);
+  e = log3.LookupByOutput("out3");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(40, e->start_time);
+  ASSERT_FALSE(log3.LookupByOutput("out2"));
+
+  // Appending to the recompacted log still works.
+  EXPECT_TRUE(log3.OpenForWrite(kTestFilename, *this, &err));
+  log3.RecordCommand(state_.edges_[2], 50, 51);
+  log3.Close();
+  BuildLog log4;
+  EXPECT_TRUE(log4.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(50, log4.LookupByOutput("out3")->start_time);
+  ASSERT_EQ(30, log4.LookupByOutput("out")->start_time);
+}
+
 }  // anonymous namespace
@@ -0,0 +1,429 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays a full build of a real build directory through Builder, with
+// each command taking as long as .ninja_log says it last did, on a clock
+// that only moves when a command finishes.  Nothing is run and nothing on
+// disk changes, so scheduling changes (to Plan, pools, -j, -m) can be
+// compared on the logs of real builds in seconds.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <set>
+
+#ifdef _WIN32
+#include "getopt.h"
+#include <direct.h>
+#else
+#include <getopt.h>
+#include <unistd.h>
+#endif
+
+#include "build.h"
+#include "build_log.h"
+#include "deps_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+/// A disk on which the files no edge makes exist and are old, and the
+/// outputs of edges appear once their command has run in the simulation.
+/// Every edge of the targets is then dirty, and restat sees every output
+/// change.  Files are read from the real disk, for depfiles and dyndep.
+struct SimulatedDisk : public DiskInterface {
+  explicit SimulatedDisk(State* state) : state_(state) {}
+
+  virtual TimeStamp Stat(const string& path, string* err) const {
+    Node* node = state_->LookupNode(path);
+    if (!node)
+      return 0;
+    if (!node->in_edge())
+      return 1;
+    return built_.count(node) ? 2 : 0;
+  }
+  virtual bool MakeDir(const string& path) { return true; }
+  virtual bool WriteFile(const string& path, const string& contents) {
+    return true;
+  }
+  virtual Status ReadFile(const string& path, string* contents, string* err) {
+    return disk_.ReadFile(path, contents, err);
+  }
+  virtual int RemoveFile(const string& path) { return 1; }
+
+  void Built(Edge* edge) {
+    built_.insert(edge->outputs_.begin(), edge->outputs_.end());
+  }
+
+ private:
+  State* state_;
+  set<const Node*> built_;
+  RealDiskInterface disk_;
+};
+
+/// A stretch of the build during which fewer commands ran than -j allows.
+struct Gap {
+  int64_t start;
+  int64_t end;
+  int min_running;  ///< The fewest commands running during it.
+};
+
+bool LongerGap(const Gap& a, const Gap& b) {
+  return a.end - a.start > b.end - b.start;
+}
+
+/// Runs each command for its logged duration on a virtual clock.
+struct SimulatedCommandRunner : public CommandRunner {
+  SimulatedCommandRunner(const BuildConfig& config, BuildLog* build_log,
+                         SimulatedDisk* disk)
+      : parallelism_(config.parallelism), build_log_(build_log), disk_(disk),
+        now_(0), work_(0), logged_(0), estimated_(0), sequence_(0),
+        in_gap_(false) {
+    // Commands the log doesn't know take as long as the average one, as
+    // Plan assumes when it weighs the critical path.
+    int64_t total = 0;
+    const BuildLog::Entries& entries = build_log->entries();
+    for (BuildLog::Entries::const_iterator i = entries.begin();
+         i != entries.end(); ++i)
+      total += i->second->end_time - i->second->start_time;
+    estimate_ = entries.empty() ? 1 : total / (int64_t)entries.size();
+  }
+
+  // Overridden from CommandRunner:
+  virtual bool CanRunMore() const {
+    return running_.size() < (size_t)parallelism_;
+  }
+
+  virtual bool StartCommand(Edge* edge) {
+    Command command;
+    command.edge = edge;
+    command.start = now_;
+    BuildLog::LogEntry* entry =
+        build_log_->LookupByOutput(edge->outputs_[0]->path());
+    if (entry) {
+      command.duration = entry->end_time - entry->start_time;
+      command.usage = entry->usage;
+      ++logged_;
+    } else {
+      command.duration = estimate_;
+      ++estimated_;
+    }
+    command.sequence = sequence_++;
+    running_.push(command);
+    return true;
+  }
+
+  virtual bool WaitForCommand(Result* result) {
+    if (running_.empty())
+      return false;
+    Command command = running_.top();
+    Advance(command.start + command.duration);
+    running_.pop();
+
+    work_ += command.duration;
+    durations_[command.edge] = command.duration;
+    disk_->Built(command.edge);
+    result->edge = command.edge;
+    result->status = ExitSuccess;
+    result->usage = command.usage;
+    return true;
+  }
+
+  virtual vector<Edge*> GetActiveEdges() {
+    vector<Edge*> edges;
+    priority_queue<Command> running = running_;
+    for (; !running.empty(); running.pop())
+      edges.push_back(running.top().edge);
+    return edges;
+  }
+
+  /// The longest chain of commands that had to run one after the other,
+  /// which no schedule can beat.
+  int64_t CriticalPath() {
+    int64_t longest = 0;
+    for (map<Edge*, int64_t>::iterator i = durations_.begin();
+         i != durations_.end(); ++i)
+      longest = max(longest, ChainTo(i->first));
+    return longest;
+  }
+
+  /// Close the gap the build ends in, if any.
+  void Finish() {
+    if (in_gap_) {
+      in_gap_ = false;
+      gap_.end = now_;
+      gaps_.push_back(gap_);
+    }
+  }
+
+  int parallelism_;
+  BuildLog* build_log_;
+  SimulatedDisk* disk_;
+  int64_t estimate_;
+
+  int64_t now_;
+  int64_t work_;  ///< The sum of the durations of the finished commands.
+  int logged_;  ///< Commands whose duration was in the log.
+  int estimated_;  ///< Commands that took |estimate_|.
+  vector<Gap> gaps_;
+
+ private:
+  struct Command {
+    Edge* edge;
+    int64_t start;
+    int64_t duration;
+    int sequence;
+    ResourceUsage usage;
+
+    /// The command that finishes first comes out of the queue first, and
+    /// of those that finish together, the one started first.
+    bool operator<(const Command& other) const {
+      int64_t end = start + duration;
+      int64_t other_end = other.start + other.duration;
+      if (end != other_end)
+        return end > other_end;
+      return sequence > other.sequence;
+    }
+  };
+
+  /// Move the clock to |time|, noting whether cores sat idle until then.
+  void Advance(int64_t time) {
+    if (time == now_)
+      return;
+    int running = (int)running_.size();
+    if (running < parallelism_) {
+      if (!in_gap_) {
+        in_gap_ = true;
+        gap_.start = now_;
+        gap_.min_running = running;
+      }
+      gap_.min_running = min(gap_.min_running, running);
+    } else {
+      Finish();
+    }
+    now_ = time;
+  }
+
+  int64_t ChainTo(Edge* edge) {
+    map<Edge*, int64_t>::iterator i = chains_.find(edge);
+    if (i != chains_.end())
+      return i->second;
+    int64_t longest = 0;
+    for (Node** in = edge->inputs_.begin(); in != edge->inputs_.end(); ++in) {
+      Edge* producer = (*in)->in_edge();
+      if (producer && (durations_.count(producer) || producer->is_phony()))
+        longest = max(longest, ChainTo(producer));
+    }
+    map<Edge*, int64_t>::iterator d = durations_.find(edge);
+    longest += d == durations_.end() ? 0 : d->second;
+    chains_[edge] = longest;
+    return longest;
+  }
+
+  priority_queue<Command> running_;
+  int sequence_;
+  map<Edge*, int64_t> durations_;
+  map<Edge*, int64_t> chains_;
+  bool in_gap_;
+  Gap gap_;
+};
+
+void Usage() {
+  printf(
+"usage: build_sim_bench [options] [targets...]\n"
+"\n"
+"Simulate a full build of the targets (default: the manifest's defaults),\n"
+"with each command taking as long as it last did according to .ninja_log.\n"
+"\n"
+"options:\n"
+"  -C DIR   change to DIR before doing anything else\n"
+"  -f FILE  specify input build file [default=build.ninja]\n"
+"  -j N     run N jobs in parallel [default=%d]\n"
+"  -m SIZE  don't start commands that would take the estimated memory of\n"
+"           the running ones over SIZE, as ninja -m does\n",
+      GetProcessorCount());
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+  config.parallelism = GetProcessorCount();
+  const char* input_file = "build.ninja";
+  const char* working_dir = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("C:f:j:m:h"))) != -1) {
+    switch (opt) {
+    case 'C':
+      working_dir = optarg;
+      break;
+    case 'f':
+      input_file = optarg;
+      break;
+    case 'j': {
+      char* end;
+      int value = strtol(optarg, &end, 10);
+      if (*end != 0 || value <= 0) {
+        fprintf(stderr, "invalid -j parameter\n");
+        return 1;
+      }
+      config.parallelism = value;
+      break;
+    }
+    case 'm':
+      if (!ParseMemorySize(optarg, &config.max_memory)) {
+        fprintf(stderr, "invalid -m parameter\n");
+        return 1;
+      }
+      break;
+    case 'h':
+    default:
+      Usage();
+      return 1;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (working_dir && chdir(working_dir) < 0)
+    Fatal("chdir to '%s': %s", working_dir, strerror(errno));
+
+  State state;
+  string err;
+  RealDiskInterface disk_interface;
+  ManifestParser parser(&state, &disk_interface);
+  if (!parser.Load(input_file, &err)) {
+    fprintf(stderr, "%s\n", err.c_str());
+    return 1;
+  }
+
+  string log_path = ".ninja_log";
+  string deps_path = ".ninja_deps";
+  string build_dir = state.bindings_.LookupVariable("builddir");
+  if (!build_dir.empty()) {
+    log_path = build_dir + "/" + log_path;
+    deps_path = build_dir + "/" + deps_path;
+  }
+  BuildLog build_log;
+  if (build_log.Load(log_path, &err) != LOAD_SUCCESS) {
+    fprintf(stderr, "loading %s: %s\n", log_path.c_str(),
+            err.empty() ? "not found" : err.c_str());
+    return 1;
+  }
+  DepsLog deps_log;
+  if (deps_log.Load(deps_path, &state, &err) == LOAD_ERROR) {
+    fprintf(stderr, "loading %s: %s\n", deps_path.c_str(), err.c_str());
+    return 1;
+  }
+  err.clear();
+  // The deps of the simulated commands have to go somewhere; not into the
+  // real log.
+  string scratch_path = deps_path + ".sim";
+  remove(scratch_path.c_str());
+  if (!deps_log.OpenForWrite(scratch_path, &err)) {
+    fprintf(stderr, "opening %s: %s\n", scratch_path.c_str(), err.c_str());
+    return 1;
+  }
+
+  SimulatedDisk disk(&state);
+  Builder builder(&state, config, &build_log, &deps_log, &disk);
+  SimulatedCommandRunner* runner =
+      new SimulatedCommandRunner(config, &build_log, &disk);
+  builder.command_runner_.reset(runner);
+
+  vector<Node*> targets;
+  for (int i = 0; i < argc; ++i) {
+    Node* node = state.LookupNode(argv[i]);
+    if (!node) {
+      fprintf(stderr, "unknown target '%s'\n", argv[i]);
+      return 1;
+    }
+    targets.push_back(node);
+  }
+  if (targets.empty()) {
+    targets = state.DefaultNodes(&err);
+    if (!err.empty()) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (!builder.AddTarget(targets[i], &err)) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+    }
+  }
+  if (builder.AlreadyUpToDate()) {
+    printf("nothing to do\n");
+    return 0;
+  }
+
+  int64_t start = GetTimeMillis();
+  if (!builder.Build(&err)) {
+    fprintf(stderr, "%s\n", err.c_str());
+    return 1;
+  }
+  int64_t end = GetTimeMillis();
+  runner->Finish();
+  deps_log.Close();
+  remove(scratch_path.c_str());
+
+  int64_t makespan = runner->now_;
+  int64_t critical_path = runner->CriticalPath();
+  int commands = runner->logged_ + runner->estimated_;
+  printf("%d commands simulated in %dms", commands, (int)(end - start));
+  if (runner->estimated_) {
+    printf(", %d not in the log taken as %" PRId64 "ms each",
+           runner->estimated_, runner->estimate_);
+  }
+  printf("\n");
+  printf("makespan:      %.3fs at -j%d\n", makespan / 1000.0,
+         config.parallelism);
+  printf("critical path: %.3fs (%.0f%% of the makespan)\n",
+         critical_path / 1000.0,
+         makespan ? 100.0 * critical_path / makespan : 100.0);
+  printf("total work:    %.3fs\n", runner->work_ / 1000.0);
+  printf("utilization:   %.1f%% of %d cores\n",
+         makespan ? 100.0 * runner->work_ /
+                        ((double)makespan * config.parallelism) : 100.0,
+         config.parallelism);
+
+  vector<Gap>& gaps = runner->gaps_;
+  int64_t gap_total = 0;
+  for (size_t i = 0; i < gaps.size(); ++i)
+    gap_total += gaps[i].end - gaps[i].start;
+  printf("idle gaps:     %d, %.3fs in all with fewer than %d commands "
+         "running\n", (int)gaps.size(), gap_total / 1000.0,
+         config.parallelism);
+  sort(gaps.begin(), gaps.end(), LongerGap);
+  for (size_t i = 0; i < gaps.size() && i < 5; ++i) {
+    printf("  %9.3fs - %9.3fs  %8.3fs  down to %d running\n",
+           gaps[i].start / 1000.0, gaps[i].end / 1000.0,
+           (gaps[i].end - gaps[i].start) / 1000.0, gaps[i].min_running);
+  }
+
+  return 0;
+}
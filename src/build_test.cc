@@ -15,9 +15,11 @@
 #include "build.h"
 
 #include <assert.h>
+#include <algorithm>
 
 #include "build_log.h"
 #include "deps_log.h"
+#include "failure_log.h"
 #include "graph.h"
 #include "test.h"
 
@@ -59,6 +61,7 @@ TEST_F(PlanTest, Basic) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -96,6 +99,7 @@ TEST_F(PlanTest, DoubleOutputDirect) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
@@ -113,6 +117,37 @@ TEST_F(PlanTest, DoubleOutputDirect) {
   ASSERT_FALSE(edge);  // done
 }
 
+// Test that an edge listing the same input several times becomes ready
+// once, after the input is built.
+TEST_F(PlanTest, RepeatedInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid in mid\n"
+"build mid: cat in\n"));
+  GetNode("mid")->MarkDirty();
+  GetNode("out")->MarkDirty();
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  ASSERT_EQ("mid", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  ASSERT_EQ("out", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
 // Test that two outputs from one rule can eventually be routed to another.
 TEST_F(PlanTest, DoubleOutputIndirect) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -128,6 +163,7 @@ TEST_F(PlanTest, DoubleOutputIndirect) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
@@ -170,6 +206,7 @@ TEST_F(PlanTest, DoubleDependent) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge;
@@ -206,6 +243,7 @@ void PlanTest::TestPoolWithDepthOne(const char* test_case) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(plan_.AddTarget(GetNode("out2"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -285,6 +323,7 @@ TEST_F(PlanTest, PoolsWithDepthTwo) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("allTheThings"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
 
   deque<Edge*> edges;
   FindWorkSorted(&edges, 5);
@@ -363,6 +402,7 @@ TEST_F(PlanTest, PoolWithRedundantEdges) {
   string err;
   EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = NULL;
@@ -436,6 +476,7 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(plan_.AddTarget(GetNode("out2"), &err));
   ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
   ASSERT_TRUE(plan_.more_to_do());
 
   Edge* edge = plan_.FindWork();
@@ -464,6 +505,269 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ(0, edge);
 }
 
+TEST_F(PlanTest, CriticalPathWithoutLog) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a1: cat in\n"
+"build a2: cat a1\n"
+"build b: cat in\n"
+"build out: cat a2 b\n"));
+  GetNode("a1")->MarkDirty();
+  GetNode("a2")->MarkDirty();
+  GetNode("b")->MarkDirty();
+  GetNode("out")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(NULL);
+
+  // Without any history every command counts the same, so the longer
+  // chain through a1 goes first.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a1", edge->outputs_[0]->path());
+  EXPECT_EQ(3, edge->critical_path_weight());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b", edge->outputs_[0]->path());
+  EXPECT_EQ(2, edge->critical_path_weight());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+TEST_F(PlanTest, CriticalPathFromBuildLog) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a1: cat in\n"
+"build a2: cat a1\n"
+"build b: cat in\n"
+"build out: cat a2 b\n"));
+  GetNode("a1")->MarkDirty();
+  GetNode("a2")->MarkDirty();
+  GetNode("b")->MarkDirty();
+  GetNode("out")->MarkDirty();
+
+  BuildLog log;
+  log.RecordCommand(GetNode("a1")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("a2")->in_edge(), 10, 20);
+  log.RecordCommand(GetNode("b")->in_edge(), 0, 100);
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(&log);
+
+  // "b" alone takes longer than the whole a1 -> a2 chain.  "out" has no
+  // log entry and is estimated at the average of the known durations.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b", edge->outputs_[0]->path());
+  EXPECT_EQ(140, edge->critical_path_weight());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a1", edge->outputs_[0]->path());
+  EXPECT_EQ(60, edge->critical_path_weight());
+  ASSERT_FALSE(plan_.FindWork());
+
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a2", edge->outputs_[0]->path());
+  EXPECT_EQ(50, edge->critical_path_weight());
+}
+
+TEST_F(PlanTest, PriorityBinding) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a1: cat in\n"
+"build a2: cat a1\n"
+"build b1: cat in\n"
+"build b2: cat b1\n"
+"  priority = 5\n"
+"build c: cat in\n"
+"build out: cat a2 b2 c\n"));
+  GetNode("a1")->MarkDirty();
+  GetNode("a2")->MarkDirty();
+  GetNode("b1")->MarkDirty();
+  GetNode("b2")->MarkDirty();
+  GetNode("c")->MarkDirty();
+  GetNode("out")->MarkDirty();
+
+  BuildLog log;
+  log.RecordCommand(GetNode("a1")->in_edge(), 0, 100);
+  log.RecordCommand(GetNode("a2")->in_edge(), 100, 200);
+  log.RecordCommand(GetNode("b1")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("b2")->in_edge(), 10, 20);
+  log.RecordCommand(GetNode("c")->in_edge(), 0, 50);
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(&log);
+
+  // b1 inherits the priority of b2, which is built from it, and goes ahead
+  // of the longer a1 -> a2 chain.  The rest go by their critical paths.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b1", edge->outputs_[0]->path());
+  EXPECT_EQ(5, edge->plan_priority());
+  Edge* a1 = plan_.FindWork();
+  ASSERT_TRUE(a1);
+  EXPECT_EQ("a1", a1->outputs_[0]->path());
+  EXPECT_EQ(0, a1->plan_priority());
+  Edge* c = plan_.FindWork();
+  ASSERT_TRUE(c);
+  EXPECT_EQ("c", c->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+
+  plan_.EdgeFinished(a1, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b2", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a2", edge->outputs_[0]->path());
+}
+
+TEST_F(PlanTest, FailedFirst) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat in\n"
+"build b1: cat in\n"
+"build b2: cat b1\n"
+"build c: cat in\n"
+"  priority = 5\n"
+"build out: cat a b2 c\n"));
+  GetNode("a")->MarkDirty();
+  GetNode("b1")->MarkDirty();
+  GetNode("b2")->MarkDirty();
+  GetNode("c")->MarkDirty();
+  GetNode("out")->MarkDirty();
+
+  BuildLog log;
+  log.RecordCommand(GetNode("a")->in_edge(), 0, 100);
+  log.RecordCommand(GetNode("b1")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("b2")->in_edge(), 10, 20);
+  FailureLog failures;
+  failures.RecordResult(GetNode("b2")->in_edge(), false);
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  plan_.PrepareQueue(&log, &failures);
+
+  // b2 failed last time, so b1 goes ahead of any explicit priority.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b1", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("c", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a", edge->outputs_[0]->path());
+}
+
+TEST_F(PlanTest, PoolWithMemory) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool big\n"
+"  memory = 3G\n"
+"rule link\n"
+"  command = ld $in > $out\n"
+"  pool = big\n"
+"build out1: link in\n"
+"  memory = 2G\n"
+"build out2: link in\n"
+"  memory = 2G\n"
+"build out3: link in\n"
+"build out4: cat in\n"));
+  GetNode("out1")->MarkDirty();
+  GetNode("out2")->MarkDirty();
+  GetNode("out3")->MarkDirty();
+  GetNode("out4")->MarkDirty();
+
+  // out3 declares nothing and used 4G last time; out4 is estimated at the
+  // average.
+  BuildLog log;
+  ResourceUsage usage;
+  usage.max_rss = 4 << 20;
+  log.RecordCommand(GetNode("out3")->in_edge(), 0, 10, 0, usage);
+  usage.max_rss = 2 << 20;
+  log.RecordCommand(GetNode("out1")->in_edge(), 0, 10, 0, usage);
+
+  string err;
+  for (int i = 1; i <= 4; ++i) {
+    char out[8];
+    snprintf(out, sizeof(out), "out%d", i);
+    EXPECT_TRUE(plan_.AddTarget(GetNode(out), &err));
+    ASSERT_EQ("", err);
+  }
+  plan_.PrepareQueue(&log);
+  EXPECT_EQ(4 << 20, GetNode("out3")->in_edge()->memory());
+  EXPECT_EQ(3 << 20, GetNode("out4")->in_edge()->memory());
+
+  // out4 isn't in the pool.  Of the others, no two fit in the budget, and
+  // out3 runs on its own although it needs more.
+  deque<Edge*> edges;
+  FindWorkSorted(&edges, 2);
+  EXPECT_EQ("out4", edges[1]->outputs_[0]->path());
+  plan_.EdgeFinished(edges[1], Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  Pool* pool = state_.LookupPool("big");
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(edges[0]->memory(), pool->current_memory());
+    plan_.EdgeFinished(edges[0], Plan::kEdgeSucceeded, &err);
+    ASSERT_EQ("", err);
+    edges.clear();
+    if (i < 2)
+      FindWorkSorted(&edges, 1);
+  }
+  EXPECT_EQ(0, pool->current_memory());
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
+TEST_F(PlanTest, MaxMemory) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule link\n"
+"  command = ld $in > $out\n"
+"  memory = 2G\n"
+"build out1: link in\n"
+"build out2: link in\n"
+"build out3: link in\n"
+"  memory = 1G\n"));
+  GetNode("out1")->MarkDirty();
+  GetNode("out2")->MarkDirty();
+  GetNode("out3")->MarkDirty();
+
+  BuildConfig config;
+  config.max_memory = 3 << 20;
+  Builder builder(&state_, config, NULL, NULL, NULL);
+  Plan& plan = builder.plan_;
+  string err;
+  EXPECT_TRUE(plan.AddTarget(GetNode("out1"), &err));
+  EXPECT_TRUE(plan.AddTarget(GetNode("out2"), &err));
+  EXPECT_TRUE(plan.AddTarget(GetNode("out3"), &err));
+  ASSERT_EQ("", err);
+  plan.PrepareQueue(NULL);
+
+  // Edges are held back while they would exceed the budget.
+  vector<Edge*> edges;
+  int64_t running = 0;
+  while (Edge* edge = plan.FindWork()) {
+    edges.push_back(edge);
+    running += edge->memory();
+  }
+  ASSERT_LT(0u, edges.size());
+  EXPECT_GE(3 << 20, running);
+  while (!edges.empty()) {
+    plan.EdgeFinished(edges.back(), Plan::kEdgeSucceeded, &err);
+    ASSERT_EQ("", err);
+    edges.pop_back();
+    while (Edge* edge = plan.FindWork())
+      edges.push_back(edge);
+  }
+  EXPECT_FALSE(plan.more_to_do());
+}
+
 /// Fake implementation of CommandRunner, useful for tests.
 struct FakeCommandRunner : public CommandRunner {
   explicit FakeCommandRunner(VirtualFileSystem* fs) :
@@ -592,7 +896,7 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
       edge->rule().name() == "touch" ||
       edge->rule().name() == "touch-interrupt" ||
       edge->rule().name() == "touch-fail-tick2") {
-    for (vector<Node*>::iterator out = edge->outputs_.begin();
+    for (Node** out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
       fs_->Create((*out)->path(), "");
     }
@@ -652,7 +956,7 @@ bool FakeCommandRunner::WaitForCommand(Result* result) {
 
   if (edge->rule().name() == "cp_multi_msvc") {
     const std::string prefix = edge->GetBinding("msvc_deps_prefix");
-    for (std::vector<Node*>::iterator in = edge->inputs_.begin();
+    for (Node** in = edge->inputs_.begin();
          in != edge->inputs_.end(); ++in) {
       result->output += prefix + (*in)->path() + '\n';
     }
@@ -664,6 +968,10 @@ bool FakeCommandRunner::WaitForCommand(Result* result) {
   else
     result->status = ExitSuccess;
 
+  // Report what the command "used", for the build log to record.
+  result->usage.user_time = commands_ran_.size();
+  result->usage.max_rss = 1024;
+
   // Provide a way for test cases to verify when an edge finishes that
   // some other edge is still active.  This is useful for test cases
   // covering behavior involving multiple active edges.
@@ -891,6 +1199,155 @@ TEST_F(BuildTest, MakeDirs) {
   EXPECT_EQ("subdir/dir2", fs_.directories_made_[1]);
 }
 
+/// With an I/O thread, each directory is created once, before the commands
+/// that need it start, and response files are written there too.
+TEST_F(BuildTest, IOThread) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cat_rsp\n"
+"  command = cat $rspfile > $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"build sub/dir/a: cat in1\n"
+"build sub/dir/b: cat in1\n"
+"build sub/c: cat_rsp sub/dir/a sub/dir/b\n"));
+
+  config_.io_thread = true;
+  Builder builder(&state_, config_, NULL, NULL, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  string err;
+  EXPECT_TRUE(builder.AddTarget("sub/c", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat sub/c.rsp > sub/c", command_runner_.commands_ran_[2]);
+  // The fake file system doesn't remember directories, so "sub" is made
+  // again for "sub/c", but "sub/dir" only once for its two outputs.
+  EXPECT_EQ(1, count(fs_.directories_made_.begin(),
+                     fs_.directories_made_.end(), "sub/dir"));
+  EXPECT_EQ(1u, fs_.files_created_.count("sub/c.rsp"));
+}
+
+/// While a command runs, the inputs of the next edge are prefetched, but
+/// not its order-only ones.
+TEST_F(BuildTest, Prefetch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat in1\n"
+"build b: cat in2 || order\n"
+"build c: cat in3\n"
+"build out: cat a b c\n"));
+  fs_.Create("in1", "1");
+  fs_.Create("in2", "2");
+  fs_.Create("in3", "3");
+  fs_.Create("order", "o");
+
+  config_.prefetch_edges = 1;
+  Builder builder(&state_, config_, NULL, NULL, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  string err;
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+
+  ASSERT_EQ(4u, command_runner_.commands_ran_.size());
+  ASSERT_EQ(2u, fs_.files_prefetched_.size());
+  EXPECT_EQ("in2", fs_.files_prefetched_[0]);
+  EXPECT_EQ("in3", fs_.files_prefetched_[1]);
+}
+
+/// Edges the scan finds ready start before the scan is done, and only once.
+TEST_F(BuildTest, StartDuringScan) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat in1\n"
+"build b: cat in1\n"
+"build c: cat a b\n"
+"build d: cat missing\n"));
+
+  config_.start_during_scan = true;
+  command_runner_.max_active_edges_ = 2;
+  Builder builder(&state_, config_, NULL, NULL, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  string err;
+  EXPECT_TRUE(builder.AddTarget("c", &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in1 > a", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cat in1 > b", command_runner_.commands_ran_[1]);
+
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat a b > c", command_runner_.commands_ran_[2]);
+
+  // An edge missing an input isn't started.
+  Builder missing(&state_, config_, NULL, NULL, &fs_);
+  missing.command_runner_.reset(&command_runner_);
+  EXPECT_FALSE(missing.AddTarget("d", &err));
+  EXPECT_EQ("'missing', needed by 'd', missing and no known rule to make it",
+            err);
+  missing.command_runner_.release();
+  EXPECT_EQ(3u, command_runner_.commands_ran_.size());
+}
+
+/// Both sharing modes start an edge of "app" although the chains of
+/// "tests" are longer.
+TEST_F(BuildTest, TargetShare) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat in1\n"
+"build b: cat in1\n"
+"build app: cat a b\n"
+"build t1: cat in1\n"
+"build t2: cat t1\n"
+"build u1: cat in1\n"
+"build u2: cat u1\n"
+"build tests: cat t2 u2\n"));
+
+  // Each pair of edges starts at once.
+  const char* const kFirstCommands[] = {
+    "cat in1 > a", "cat in1 > b", NULL
+  };
+  const char* const kFairCommands[] = {
+    "cat in1 > a", "cat in1 > t1", NULL
+  };
+  const char* const kNoneCommands[] = {
+    "cat in1 > t1", "cat in1 > u1", NULL
+  };
+  struct {
+    BuildConfig::TargetShare share;
+    const char* const* commands;
+  } kCases[] = {
+    { BuildConfig::SHARE_FIRST, kFirstCommands },
+    { BuildConfig::SHARE_FAIR, kFairCommands },
+    { BuildConfig::SHARE_NONE, kNoneCommands },
+  };
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+    state_.Reset();
+    command_runner_.commands_ran_.clear();
+    command_runner_.max_active_edges_ = 2;
+    config_.target_share = kCases[i].share;
+    Builder builder(&state_, config_, NULL, NULL, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    string err;
+    EXPECT_TRUE(builder.AddTarget("app", &err));
+    EXPECT_TRUE(builder.AddTarget("tests", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+    builder.command_runner_.release();
+
+    ASSERT_EQ(8u, command_runner_.commands_ran_.size());
+    for (size_t j = 0; kCases[i].commands[j]; ++j)
+      EXPECT_EQ(kCases[i].commands[j], command_runner_.commands_ran_[j]);
+    fs_.Tick();
+    fs_.Create("in1", "");
+  }
+}
+
 TEST_F(BuildTest, DepFileMissing) {
   string err;
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -920,11 +1377,12 @@ TEST_F(BuildTest, DepFileOK) {
   ASSERT_EQ(1u, fs_.files_read_.size());
   EXPECT_EQ("foo.o.d", fs_.files_read_[0]);
 
-  // Expect three new edges: one generating foo.o, and two more from
-  // loading the depfile.
-  ASSERT_EQ(orig_edges + 3, (int)state_.edges_.size());
+  // Expect one new edge generating foo.o; loading the depfile adds none.
+  ASSERT_EQ(orig_edges + 1, (int)state_.edges_.size());
   // Expect our edge to now have three inputs: foo.c and two headers.
   ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_TRUE(GetNode("bar.h")->found_by_dep_loader());
+  EXPECT_FALSE(GetNode("foo.c")->found_by_dep_loader());
 
   // Expect the command line we generate to only use the original input.
   ASSERT_EQ("cc foo.c", edge->EvaluateCommand());
@@ -950,7 +1408,7 @@ TEST_F(BuildTest, EncounterReadyTwice) {
 "build b: touch || c\n"
 "build a: touch | b || c\n"));
 
-  vector<Edge*> c_out = GetNode("c")->out_edges();
+  SmallVector<Edge*, 2> c_out = GetNode("c")->out_edges();
   ASSERT_EQ(2u, c_out.size());
   EXPECT_EQ("b", c_out[0]->outputs_[0]->path());
   EXPECT_EQ("a", c_out[1]->outputs_[0]->path());
@@ -1101,9 +1559,8 @@ TEST_F(BuildTest, DepFileCanonicalize) {
   // The depfile path does not get Canonicalize as it seems unnecessary.
   EXPECT_EQ("gen/stuff\\things/foo.o.d", fs_.files_read_[0]);
 
-  // Expect three new edges: one generating foo.o, and two more from
-  // loading the depfile.
-  ASSERT_EQ(orig_edges + 3, (int)state_.edges_.size());
+  // Expect one new edge generating foo.o; loading the depfile adds none.
+  ASSERT_EQ(orig_edges + 1, (int)state_.edges_.size());
   // Expect our edge to now have three inputs: foo.c and two headers.
   ASSERT_EQ(3u, edge->inputs_.size());
 
@@ -1333,6 +1790,7 @@ TEST_F(BuildWithLogTest, RebuildAfterFailure) {
   fs_.Tick();
 
   // Run again, should rerun even though the output file is up to date on disk
+  err.clear();
   EXPECT_TRUE(builder_.AddTarget("out1", &err));
   EXPECT_FALSE(builder_.AlreadyUpToDate());
   EXPECT_TRUE(builder_.Build(&err));
@@ -1340,6 +1798,70 @@ TEST_F(BuildWithLogTest, RebuildAfterFailure) {
   EXPECT_EQ("", err);
 }
 
+TEST_F(BuildWithLogTest, RecordsUsage) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch\n"
+"build out1: touch\n"
+"build out2: touch out1\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+
+  BuildLog::LogEntry* entry = build_log_.LookupByOutput("out1");
+  ASSERT_TRUE(entry);
+  EXPECT_EQ(1u, entry->usage.user_time);
+  EXPECT_EQ(1024u, entry->usage.max_rss);
+  entry = build_log_.LookupByOutput("out2");
+  ASSERT_TRUE(entry);
+  EXPECT_EQ(2u, entry->usage.user_time);
+}
+
+TEST_F(BuildWithLogTest, Batch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"  batch = 3\n"
+"build out1: touch in1\n"
+"build out2: touch in2\n"
+"build out3: touch in3\n"
+"build out4: touch in4\n"
+"build all: phony out1 out2 out3 out4\n"));
+  fs_.Create("in1", "");
+  fs_.Create("in2", "");
+  fs_.Create("in3", "");
+  fs_.Create("in4", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // Three edges share a command, and the last one runs on its own.
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("touch out1 ", command_runner_.commands_ran_[0].substr(0, 11));
+  EXPECT_EQ(string::npos, command_runner_.commands_ran_[0].find("out", 20));
+  EXPECT_EQ(10u, command_runner_.commands_ran_[1].size());
+
+  // Each edge is logged with its own command, so that the next build finds
+  // them up to date however they're batched.
+  for (int i = 1; i <= 4; ++i) {
+    string out = "out" + string(1, '0' + i);
+    BuildLog::LogEntry* entry = build_log_.LookupByOutput(out);
+    ASSERT_TRUE(entry);
+    EXPECT_EQ(BuildLog::LogEntry::HashCommand("touch " + out),
+              entry->command_hash);
+  }
+
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
 TEST_F(BuildWithLogTest, RebuildWithNoInputs) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule touch\n"
@@ -1606,6 +2128,35 @@ TEST_F(BuildDryRun, AllCommandsShown) {
   ASSERT_EQ(3u, command_runner_.commands_ran_.size());
 }
 
+TEST_F(BuildDryRun, ListsCommands) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"build a.o: cc a.c\n"
+"build b.o: cc b.c\n"
+"build objs: phony a.o b.o\n"
+"build app: cat objs\n"));
+  fs_.Create("a.c", "");
+  fs_.Create("b.c", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("app", &err));
+  ASSERT_EQ("", err);
+  vector<Edge*> edges;
+  EXPECT_TRUE(builder_.DryRun(&edges, &err));
+  ASSERT_EQ("", err);
+
+  // The phony edge isn't listed, and the others come after their inputs.
+  ASSERT_EQ(3u, edges.size());
+  EXPECT_EQ("app", edges[2]->outputs_[0]->path());
+  // Nothing was run, and no response file written.
+  EXPECT_TRUE(command_runner_.commands_ran_.empty());
+  EXPECT_EQ(0u, fs_.files_created_.count("a.o.rsp"));
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
 // Test that RSP files are created when & where appropriate and deleted after
 // successful execution.
 TEST_F(BuildTest, RspFileSuccess)
@@ -1659,6 +2210,37 @@ TEST_F(BuildTest, RspFileSuccess)
   ASSERT_EQ(1u, fs_.files_removed_.count("out 3.rsp"));
 }
 
+// Commands running at once with the same response file content share it,
+// and a kept one that holds the content already isn't written again.
+TEST_F(BuildTest, RspFileShared) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+    "rule cat_rsp\n"
+    "  command = cat $rspfile > $out\n"
+    "  rspfile = $out.rsp\n"
+    "  rspfile_content = $in\n"
+    "build out1: cat_rsp in\n"
+    "build out2: cat_rsp in\n"
+    "build out3: cat_rsp in\n"));
+  command_runner_.max_active_edges_ = 3;
+  fs_.Create("in", "");
+  fs_.Create("out3.rsp", "in");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out1", &err));
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  EXPECT_TRUE(builder_.AddTarget("out3", &err));
+  ASSERT_EQ("", err);
+  size_t files_created = fs_.files_created_.size();
+
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  // One is written, one linked to it, and one kept as it was.
+  EXPECT_EQ(files_created + 4, fs_.files_created_.size());
+  EXPECT_EQ(1u, fs_.files_linked_.size());
+  EXPECT_EQ(3u, fs_.files_removed_.size());
+}
+
 // Test that RSP file is created but not removed for commands, which fail
 TEST_F(BuildTest, RspFileFailure) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -2165,6 +2747,95 @@ TEST_F(BuildWithDepsLogTest, Straightforward) {
   }
 }
 
+/// Read the depfiles on deps threads; the deps of every edge must still
+/// be recorded before anything that depends on it is finished.
+TEST_F(BuildWithDepsLogTest, DepsThreads) {
+  string err;
+  const char* manifest =
+      "build out1: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = out1.d\n"
+      "build out2: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = out2.d\n"
+      "build out3: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = out3.d\n"
+      "build all: cat out1 out2 out3\n";
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+  ASSERT_EQ("", err);
+
+  config_.deps_threads = 2;
+  command_runner_.max_active_edges_ = 3;
+  Builder builder(&state, config_, NULL, &deps_log, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  EXPECT_TRUE(builder.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("out1.d", "out1: h1 h2");
+  fs_.Create("out2.d", "out2: ./h2 h3");
+  fs_.Create("out3.d", "out3: h3");
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(4u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat out1 out2 out3 > all", command_runner_.commands_ran_[3]);
+
+  DepsLog::Deps* deps = deps_log.GetDeps(state.LookupNode("out2"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("h2", deps->nodes[0]->path());
+  EXPECT_EQ("h3", deps->nodes[1]->path());
+  deps = deps_log.GetDeps(state.LookupNode("out1"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(2, deps->node_count);
+  deps = deps_log.GetDeps(state.LookupNode("out3"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(1, deps->node_count);
+
+  // The depfiles should have been removed.
+  EXPECT_EQ(0, fs_.Stat("out1.d", &err));
+  EXPECT_EQ(0, fs_.Stat("out2.d", &err));
+  EXPECT_EQ(0, fs_.Stat("out3.d", &err));
+
+  deps_log.Close();
+  builder.command_runner_.release();
+}
+
+/// A depfile that fails to parse on a deps thread fails its edge.
+TEST_F(BuildWithDepsLogTest, DepsThreadsBadDepfile) {
+  string err;
+  const char* manifest =
+      "build out: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n";
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+  ASSERT_EQ("", err);
+
+  config_.deps_threads = 2;
+  Builder builder(&state, config_, NULL, &deps_log, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  EXPECT_TRUE(builder.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("in1.d", "out: in2\nin2: in3\n");
+  EXPECT_FALSE(builder.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_FALSE(deps_log.GetDeps(state.LookupNode("out")));
+
+  deps_log.Close();
+  builder.command_runner_.release();
+}
+
 /// Verify that obsolete dependency info causes a rebuild.
 /// 1) Run a successful build where everything has time t, record deps.
 /// 2) Move input/output to time t+1 -- despite files in alignment,
@@ -2402,9 +3073,8 @@ TEST_F(BuildWithDepsLogTest, DepFileOKDepsLog) {
     EXPECT_TRUE(builder.AddTarget("fo o.o", &err));
     ASSERT_EQ("", err);
 
-    // Expect three new edges: one generating fo o.o, and two more from
-    // loading the depfile.
-    ASSERT_EQ(3u, state.edges_.size());
+    // Expect one edge generating fo o.o; loading the deps adds none.
+    ASSERT_EQ(1u, state.edges_.size());
     // Expect our edge to now have three inputs: foo.c and two headers.
     ASSERT_EQ(3u, edge->inputs_.size());
 
@@ -2466,9 +3136,8 @@ TEST_F(BuildWithDepsLogTest, DepFileDepsLogCanonicalize) {
     EXPECT_TRUE(builder.AddTarget("a/b/c/d/e/fo o.o", &err));
     ASSERT_EQ("", err);
 
-    // Expect three new edges: one generating fo o.o, and two more from
-    // loading the depfile.
-    ASSERT_EQ(3u, state.edges_.size());
+    // Expect one edge generating fo o.o; loading the deps adds none.
+    ASSERT_EQ(1u, state.edges_.size());
     // Expect our edge to now have three inputs: foo.c and two headers.
     ASSERT_EQ(3u, edge->inputs_.size());
 
@@ -28,6 +28,7 @@ Cleaner::Cleaner(State* state,
   : state_(state),
     config_(config),
     dyndep_loader_(state, disk_interface),
+    flushed_(0),
     removed_(),
     cleaned_(),
     cleaned_files_count_(0),
@@ -35,10 +36,6 @@ Cleaner::Cleaner(State* state,
     status_(0) {
 }
 
-int Cleaner::RemoveFile(const string& path) {
-  return disk_interface_->RemoveFile(path);
-}
-
 bool Cleaner::FileExists(const string& path) {
   string err;
   TimeStamp mtime = disk_interface_->Stat(path, &err);
@@ -55,23 +52,43 @@ void Cleaner::Report(const string& path) {
 
 void Cleaner::Remove(const string& path) {
   if (!IsAlreadyRemoved(path)) {
-    removed_.insert(path);
-    if (config_.dry_run) {
-      if (FileExists(path))
-        Report(path);
-    } else {
-      int ret = RemoveFile(path);
-      if (ret == 0)
-        Report(path);
-      else if (ret == -1)
-        status_ = 1;
-    }
+    queued_.push_back(path);
+    removed_.insert(make_pair(StringPiece(queued_.back()), true));
   }
 }
 
 bool Cleaner::IsAlreadyRemoved(const string& path) {
-  set<string>::iterator i = removed_.find(path);
-  return (i != removed_.end());
+  return removed_.find(path) != removed_.end();
+}
+
+void Cleaner::Flush() {
+  // Removing files one by one is bound by the latency of each call, which
+  // dominates on network file systems, so they go to the disk interface
+  // in one batch that it may spread over threads.
+  vector<string> paths(queued_.begin() + flushed_, queued_.end());
+  flushed_ = queued_.size();
+  if (paths.empty())
+    return;
+
+  if (config_.dry_run) {
+    vector<TimeStamp> mtimes;
+    disk_interface_->StatBatch(paths, &mtimes);
+    for (size_t i = 0; i < paths.size(); ++i) {
+      // StatBatch() doesn't describe errors; Stat() again for them.
+      if (mtimes[i] == -1 ? FileExists(paths[i]) : mtimes[i] > 0)
+        Report(paths[i]);
+    }
+    return;
+  }
+
+  vector<int> results;
+  disk_interface_->RemoveFileBatch(paths, &results);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (results[i] == 0)
+      Report(paths[i]);
+    else if (results[i] == -1)
+      status_ = 1;
+  }
 }
 
 void Cleaner::RemoveEdgeFiles(Edge* edge) {
@@ -111,15 +128,16 @@ int Cleaner::CleanAll(bool generator) {
     if ((*e)->is_phony())
       continue;
     // Do not remove generator's files unless generator specified.
-    if (!generator && (*e)->GetBindingBool("generator"))
+    if (!generator && (*e)->GetBindingBool(kVarGenerator))
       continue;
-    for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
+    for (Node** out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
       Remove((*out_node)->path());
     }
 
     RemoveEdgeFiles(*e);
   }
+  Flush();
   PrintFooter();
   return status_;
 }
@@ -133,6 +151,7 @@ int Cleaner::CleanDead(const BuildLog::Entries& entries) {
       Remove(i->first.AsString());
     }
   }
+  Flush();
   PrintFooter();
   return status_;
 }
@@ -144,7 +163,7 @@ void Cleaner::DoCleanTarget(Node* target) {
       Remove(target->path());
       RemoveEdgeFiles(e);
     }
-    for (vector<Node*>::iterator n = e->inputs_.begin(); n != e->inputs_.end();
+    for (Node** n = e->inputs_.begin(); n != e->inputs_.end();
          ++n) {
       Node* next = *n;
       // call DoCleanTarget recursively if this node has not been visited
@@ -165,6 +184,7 @@ int Cleaner::CleanTarget(Node* target) {
   PrintHeader();
   LoadDyndeps();
   DoCleanTarget(target);
+  Flush();
   PrintFooter();
   return status_;
 }
@@ -200,12 +220,14 @@ int Cleaner::CleanTargets(int target_count, char* targets[]) {
         if (IsVerbose())
           printf("Target %s\n", target_name.c_str());
         DoCleanTarget(target);
+        Flush();
       } else {
         Error("unknown target '%s'", target_name.c_str());
         status_ = 1;
       }
     }
   }
+  Flush();
   PrintFooter();
   return status_;
 }
@@ -216,7 +238,7 @@ void Cleaner::DoCleanRule(const Rule* rule) {
   for (vector<Edge*>::iterator e = state_->edges_.begin();
        e != state_->edges_.end(); ++e) {
     if ((*e)->rule().name() == rule->name()) {
-      for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
+      for (Node** out_node = (*e)->outputs_.begin();
            out_node != (*e)->outputs_.end(); ++out_node) {
         Remove((*out_node)->path());
         RemoveEdgeFiles(*e);
@@ -232,6 +254,7 @@ int Cleaner::CleanRule(const Rule* rule) {
   PrintHeader();
   LoadDyndeps();
   DoCleanRule(rule);
+  Flush();
   PrintFooter();
   return status_;
 }
@@ -263,11 +286,13 @@ int Cleaner::CleanRules(int rule_count, char* rules[]) {
       if (IsVerbose())
         printf("Rule %s\n", rule_name);
       DoCleanRule(rule);
+      Flush();
     } else {
       Error("unknown rule '%s'", rule_name);
       status_ = 1;
     }
   }
+  Flush();
   PrintFooter();
   return status_;
 }
@@ -276,6 +301,8 @@ void Cleaner::Reset() {
   status_ = 0;
   cleaned_files_count_ = 0;
   removed_.clear();
+  queued_.clear();
+  flushed_ = 0;
   cleaned_.clear();
 }
 
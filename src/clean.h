@@ -15,12 +15,14 @@
 #ifndef NINJA_CLEAN_H_
 #define NINJA_CLEAN_H_
 
+#include <deque>
 #include <set>
 #include <string>
 
 #include "build.h"
 #include "dyndep.h"
 #include "build_log.h"
+#include "hash_map.h"
 
 using namespace std;
 
@@ -76,17 +78,17 @@ struct Cleaner {
   }
 
  private:
-  /// Remove the file @a path.
-  /// @return whether the file has been removed.
-  int RemoveFile(const string& path);
   /// @returns whether the file @a path exists.
   bool FileExists(const string& path);
   void Report(const string& path);
 
-  /// Remove the given @a path file only if it has not been already removed.
+  /// Queue the given @a path file for removal, unless it already was.
   void Remove(const string& path);
-  /// @return whether the given @a path has already been removed.
+  /// @return whether the given @a path has already been queued.
   bool IsAlreadyRemoved(const string& path);
+  /// Remove the queued files, several at a time, and report them in the
+  /// order they were queued.
+  void Flush();
   /// Remove the depfile and rspfile for an Edge.
   void RemoveEdgeFiles(Edge* edge);
 
@@ -103,7 +105,12 @@ struct Cleaner {
   State* state_;
   const BuildConfig& config_;
   DyndepLoader dyndep_loader_;
-  set<string> removed_;
+  /// Every path queued since Reset(), in order; the ones from
+  /// |flushed_| on are yet to be removed.
+  deque<string> queued_;
+  size_t flushed_;
+  /// The paths in |queued_|, pointing into it.
+  ExternalStringHashMap<bool>::Type removed_;
   set<Node*> cleaned_;
   int cleaned_files_count_;
   DiskInterface* disk_interface_;
@@ -16,14 +16,17 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <deque>
+#include <mutex>
 #include <string.h>
 
+#include "hash_map.h"
 #include "metrics.h"
+#include "string_piece.h"
 #include "string_piece_util.h"
 
 #ifdef _WIN32
 #include "includes_normalize.h"
-#include "string_piece.h"
 #else
 #include "util.h"
 #endif
@@ -36,23 +39,104 @@ bool EndsWith(const string& input, const string& needle) {
           input.substr(input.size() - needle.size()) == needle);
 }
 
+/// Return the path in a line of /showIncludes output, or an empty piece if
+/// \a line is something else.
+StringPiece ShowIncludesPath(StringPiece line, const string& deps_prefix) {
+  static const char kDepsPrefixEnglish[] = "Note: including file: ";
+  StringPiece prefix = deps_prefix.empty() ?
+      StringPiece(kDepsPrefixEnglish, sizeof(kDepsPrefixEnglish) - 1) :
+      StringPiece(deps_prefix);
+  if (line.size() > prefix.size() &&
+      memcmp(line.str_, prefix.str_, prefix.size()) == 0) {
+    const char* in = line.str_ + prefix.size();
+    const char* end = line.str_ + line.size();
+    while (in < end && *in == ' ')
+      ++in;
+    return StringPiece(in, end - in);
+  }
+  return StringPiece();
+}
+
+/// What one spelling of an include normalizes to.
+struct NormalizedInclude {
+  NormalizedInclude() : path(NULL), system(false) {}
+
+  /// The normalized path, shared by all spellings that normalize to it.
+  const string* path;
+  bool system;
+};
+
+/// The includes cl.exe has printed, for the whole process.  Nearly every
+/// compile reports the same few thousand SDK and STL headers, spelled the
+/// same way each time, so each spelling is only normalized once.  Parses
+/// run on the builder's deps threads too, so it takes a lock.
+struct IncludeCache {
+  /// Find what |spelling| normalizes to.  Returns false if it hasn't been
+  /// seen yet.
+  bool Find(StringPiece spelling, NormalizedInclude* include) {
+    lock_guard<mutex> lock(mutex_);
+    ExternalStringHashMap<NormalizedInclude>::Type::iterator i =
+        spellings_.find(spelling);
+    if (i == spellings_.end())
+      return false;
+    *include = i->second;
+    return true;
+  }
+
+  /// Record that |spelling| normalizes to |path|.
+  NormalizedInclude Add(StringPiece spelling, const string& path,
+                        bool system) {
+    lock_guard<mutex> lock(mutex_);
+    NormalizedInclude include;
+    include.system = system;
+    ExternalStringHashMap<const string*>::Type::iterator i =
+        paths_.find(path);
+    if (i != paths_.end()) {
+      include.path = i->second;
+    } else {
+      strings_.push_back(path);
+      include.path = &strings_.back();
+      paths_.insert(make_pair(StringPiece(strings_.back()), include.path));
+    }
+    if (spellings_.find(spelling) == spellings_.end()) {
+      strings_.push_back(spelling.AsString());
+      spellings_.insert(make_pair(StringPiece(strings_.back()), include));
+    }
+    return include;
+  }
+
+  /// Forget the normalized paths if the directory they are relative to
+  /// changed.
+  void SetRelativeTo(const string& dir) {
+    lock_guard<mutex> lock(mutex_);
+    if (dir == relative_to_)
+      return;
+    relative_to_ = dir;
+    spellings_.clear();
+    paths_.clear();
+  }
+
+  mutex mutex_;
+  ExternalStringHashMap<NormalizedInclude>::Type spellings_;
+  ExternalStringHashMap<const string*>::Type paths_;
+  /// The keys and paths above point into here.  Its elements never move
+  /// and are never freed, so a path handed out stays valid even after
+  /// SetRelativeTo() clears the maps.
+  deque<string> strings_;
+  string relative_to_;
+};
+
+IncludeCache& Includes() {
+  static IncludeCache includes;
+  return includes;
+}
+
 }  // anonymous namespace
 
 // static
 string CLParser::FilterShowIncludes(const string& line,
                                     const string& deps_prefix) {
-  const string kDepsPrefixEnglish = "Note: including file: ";
-  const char* in = line.c_str();
-  const char* end = in + line.size();
-  const string& prefix = deps_prefix.empty() ? kDepsPrefixEnglish : deps_prefix;
-  if (end - in > (int)prefix.size() &&
-      memcmp(in, prefix.c_str(), (int)prefix.size()) == 0) {
-    in += prefix.size();
-    while (*in == ' ')
-      ++in;
-    return line.substr(in - line.c_str());
-  }
-  return "";
+  return ShowIncludesPath(line, deps_prefix).AsString();
 }
 
 // static
@@ -81,37 +165,48 @@ bool CLParser::Parse(const string& output, const string& deps_prefix,
   // Loop over all lines in the output to process them.
   assert(&output != filtered_output);
   size_t start = 0;
+  IncludeCache& cache = Includes();
 #ifdef _WIN32
-  IncludesNormalize normalizer(".");
+  string cwd = IncludesNormalize::AbsPath(".", err);
+  if (!err->empty())
+    return false;
+  IncludesNormalize normalizer(cwd);
+  cache.SetRelativeTo(cwd);
 #endif
+  ExternalStringHashMap<bool>::Type seen;
 
   while (start < output.size()) {
-    size_t end = output.find_first_of("\r\n", start);
-    if (end == string::npos)
-      end = output.size();
-    string line = output.substr(start, end - start);
+    size_t end = start;
+    while (end < output.size() && output[end] != '\r' && output[end] != '\n')
+      ++end;
+    StringPiece line(output.data() + start, end - start);
 
-    string include = FilterShowIncludes(line, deps_prefix);
+    StringPiece include = ShowIncludesPath(line, deps_prefix);
     if (!include.empty()) {
-      string normalized;
+      NormalizedInclude normalized;
+      if (!cache.Find(include, &normalized)) {
+        string path;
 #ifdef _WIN32
-      if (!normalizer.Normalize(include, &normalized, err))
-        return false;
+        if (!normalizer.Normalize(include.AsString(), &path, err))
+          return false;
 #else
-      // TODO: should this make the path relative to cwd?
-      normalized = include;
-      uint64_t slash_bits;
-      if (!CanonicalizePath(&normalized, &slash_bits, err))
-        return false;
+        // TODO: should this make the path relative to cwd?
+        path = include.AsString();
+        uint64_t slash_bits;
+        if (!CanonicalizePath(&path, &slash_bits, err))
+          return false;
 #endif
-      if (!IsSystemInclude(normalized))
-        includes_.insert(normalized);
-    } else if (FilterInputFilename(line)) {
+        normalized = cache.Add(include, path, IsSystemInclude(path));
+      }
+      if (!normalized.system &&
+          seen.insert(make_pair(StringPiece(*normalized.path), true)).second)
+        includes_.push_back(*normalized.path);
+    } else if (FilterInputFilename(line.AsString())) {
       // Drop it.
       // TODO: if we support compiling multiple output files in a single
       // cl.exe invocation, we should stash the filename.
     } else {
-      filtered_output->append(line);
+      filtered_output->append(line.str_, line.len_);
       filtered_output->append("\n");
     }
 
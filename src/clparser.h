@@ -15,8 +15,8 @@
 #ifndef NINJA_CLPARSER_H_
 #define NINJA_CLPARSER_H_
 
-#include <set>
 #include <string>
+#include <vector>
 using namespace std;
 
 /// Visual Studio's cl.exe requires some massaging to work with Ninja;
@@ -46,7 +46,9 @@ struct CLParser {
   bool Parse(const string& output, const string& deps_prefix,
              string* filtered_output, string* err);
 
-  set<string> includes_;
+  /// The includes that aren't system headers, normalized, in the order
+  /// cl.exe first printed them.
+  vector<string> includes_;
 };
 
 #endif  // NINJA_CLPARSER_H_
@@ -115,3 +115,23 @@ TEST(CLParserTest, DuplicatedHeaderPathConverted) {
   ASSERT_EQ("", output);
   ASSERT_EQ(2u, parser.includes_.size());
 }
+
+TEST(CLParserTest, IncludesInOrderAcrossParses) {
+  const char kInput[] =
+      "Note: including file: zzz.h\r\n"
+      "Note: including file: c:\\Program Files\\foo.h\r\n"
+      "Note: including file: aaa.h\r\n"
+      "Note: including file: ./zzz.h\r\n";
+
+  // The second parse finds every include already normalized, and must
+  // come to the same result.
+  for (int i = 0; i < 2; ++i) {
+    CLParser parser;
+    string output, err;
+    ASSERT_TRUE(parser.Parse(kInput, "", &output, &err));
+    ASSERT_EQ("", output);
+    ASSERT_EQ(2u, parser.includes_.size());
+    EXPECT_EQ("zzz.h", parser.includes_[0]);
+    EXPECT_EQ("aaa.h", parser.includes_[1]);
+  }
+}
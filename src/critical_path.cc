@@ -0,0 +1,157 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "critical_path.h"
+
+#include "build_log.h"
+#include "graph.h"
+
+namespace {
+
+/// Orders indices in CriticalPath::timings_ by how much their edges block
+/// the build, most first.
+struct MoreBlocking {
+  MoreBlocking(const vector<CriticalPath::Timing>& timings, int64_t length)
+      : timings_(&timings), length_(length) {}
+  bool operator()(size_t a, size_t b) const {
+    int64_t ba = (*timings_)[a].blocking(length_);
+    int64_t bb = (*timings_)[b].blocking(length_);
+    if (ba != bb)
+      return ba > bb;
+    return a < b;
+  }
+  const vector<CriticalPath::Timing>* timings_;
+  int64_t length_;
+};
+
+}  // anonymous namespace
+
+void CriticalPath::Analyze(const vector<Node*>& targets,
+                           BuildLog* build_log) {
+  // Sort the edges behind the targets so that every edge comes after the
+  // edges producing its inputs, and index them by Edge::id().
+  // |index| holds kSeen for edges on the stack.
+  const size_t kNone = (size_t)-1, kSeen = kNone - 1;
+  vector<size_t> index;
+  vector<pair<Edge*, size_t> > stack;
+  for (vector<Node*>::const_iterator t = targets.begin(); t != targets.end();
+       ++t) {
+    Edge* edge = (*t)->in_edge();
+    for (;;) {
+      if (edge) {
+        if (edge->id() >= index.size())
+          index.resize(edge->id() + 1, kNone);
+        if (index[edge->id()] == kNone) {
+          index[edge->id()] = kSeen;
+          stack.push_back(make_pair(edge, 0));
+        }
+      }
+      if (stack.empty())
+        break;
+      edge = stack.back().first;
+      size_t input = stack.back().second++;
+      if (input < edge->inputs_.size()) {
+        edge = edge->inputs_[input]->in_edge();
+        continue;
+      }
+      index[edge->id()] = timings_.size();
+      timings_.push_back(Timing());
+      timings_.back().edge = edge;
+      stack.pop_back();
+      edge = NULL;
+    }
+  }
+
+  // Walk forwards for the earliest finish of each edge...
+  for (vector<Timing>::iterator t = timings_.begin(); t != timings_.end();
+       ++t) {
+    Edge* edge = t->edge;
+    if (!edge->is_phony()) {
+      BuildLog::LogEntry* entry = build_log ?
+          build_log->LookupByOutput(edge->outputs_[0]->path()) : NULL;
+      if (entry)
+        t->duration = max(entry->end_time - entry->start_time, 0);
+      else
+        ++missing_;
+      ++commands_;
+      work_ += t->duration;
+      RuleTotal* rule = &rules_[edge->rule().name()];
+      ++rule->commands;
+      rule->total += t->duration;
+      rule->max = max(rule->max, t->duration);
+    }
+    int64_t start = 0;
+    for (Node** in = edge->inputs_.begin(); in != edge->inputs_.end(); ++in) {
+      if (Edge* producer = (*in)->in_edge())
+        start = max(start, timings_[index[producer->id()]].finish);
+    }
+    t->finish = start + t->duration;
+    length_ = max(length_, t->finish);
+  }
+
+  // ...and backwards for the longest chain after it.
+  vector<int64_t> tail(timings_.size(), 0);
+  for (size_t i = timings_.size(); i-- > 0; ) {
+    Timing* t = &timings_[i];
+    t->path = t->finish + tail[i];
+    for (Node** in = t->edge->inputs_.begin(); in != t->edge->inputs_.end();
+         ++in) {
+      if (Edge* producer = (*in)->in_edge()) {
+        size_t p = index[producer->id()];
+        tail[p] = max(tail[p], t->duration + tail[i]);
+      }
+    }
+  }
+
+  // Follow the chain that finishes last back to its start.
+  size_t last = kNone;
+  for (size_t i = 0; i < timings_.size(); ++i) {
+    if (last == kNone || timings_[i].finish > timings_[last].finish)
+      last = i;
+  }
+  for (size_t i = last; i != kNone; ) {
+    const Timing& t = timings_[i];
+    if (!t.edge->is_phony())
+      path_.push_back(i);
+    size_t next = kNone;
+    for (Node** in = t.edge->inputs_.begin(); in != t.edge->inputs_.end();
+         ++in) {
+      Edge* producer = (*in)->in_edge();
+      if (!producer)
+        continue;
+      size_t p = index[producer->id()];
+      if (timings_[p].finish == t.finish - t.duration &&
+          (next == kNone || p > next))
+        next = p;
+    }
+    i = next;
+  }
+  reverse(path_.begin(), path_.end());
+}
+
+vector<size_t> CriticalPath::MostBlocking(size_t count) const {
+  vector<size_t> edges;
+  for (size_t i = 0; i < timings_.size(); ++i) {
+    if (timings_[i].blocking(length_) > 0)
+      edges.push_back(i);
+  }
+  MoreBlocking more(timings_, length_);
+  if (edges.size() > count) {
+    partial_sort(edges.begin(), edges.begin() + count, edges.end(), more);
+    edges.resize(count);
+  } else {
+    sort(edges.begin(), edges.end(), more);
+  }
+  return edges;
+}
@@ -0,0 +1,86 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_CRITICAL_PATH_H_
+#define NINJA_CRITICAL_PATH_H_
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BuildLog;
+struct Edge;
+struct Node;
+
+/// The timing of the graph behind some targets, with each command taking
+/// as long as the build log says it took the last time it ran: the
+/// longest chain of commands, how the time is spread over the rules, and
+/// which commands hold the build up most.  See "-t critpath".
+struct CriticalPath {
+  CriticalPath() : length_(0), work_(0), commands_(0), missing_(0) {}
+
+  /// Analyze the edges |targets| are built from, with the durations in
+  /// |build_log|.  Commands without a log entry count as taking no time.
+  void Analyze(const vector<Node*>& targets, BuildLog* build_log);
+
+  struct Timing {
+    Timing() : edge(NULL), duration(0), finish(0), path(0) {}
+    Edge* edge;
+    /// In milliseconds.
+    int64_t duration;
+    /// When the edge would finish at the earliest, with as many jobs as
+    /// it takes.
+    int64_t finish;
+    /// The longest chain of commands through the edge.
+    int64_t path;
+
+    /// How much of the duration the rest of the build can't hide: the
+    /// most the build would gain if the command took no time.
+    int64_t blocking(int64_t length) const {
+      return max(duration - (length - path), (int64_t)0);
+    }
+  };
+
+  /// The edges, phony ones too, in an order they could run in.
+  vector<Timing> timings_;
+  /// The indices in |timings_| of the longest chain of commands, from the
+  /// first to run to the last.
+  vector<size_t> path_;
+  /// The length of that chain, in milliseconds.
+  int64_t length_;
+  /// The sum of all durations.
+  int64_t work_;
+  int commands_;
+  /// The number of commands without a log entry.
+  int missing_;
+
+  struct RuleTotal {
+    RuleTotal() : commands(0), total(0), max(0) {}
+    int commands;
+    int64_t total;
+    int64_t max;
+  };
+  map<string, RuleTotal> rules_;
+
+  /// The indices in |timings_| of the |count| edges blocking the build
+  /// most, those blocking it most first.  Edges that don't block it are
+  /// left out.
+  vector<size_t> MostBlocking(size_t count) const;
+};
+
+#endif  // NINJA_CRITICAL_PATH_H_
@@ -0,0 +1,113 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "critical_path.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct CriticalPathTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"build a1: cat in\n"
+"build a2: cat a1\n"
+"build b: touch in\n"
+"build out: cat a2 b\n"
+"build c: cat in\n"
+"build all: phony out c\n");
+    log_.RecordCommand(GetNode("a1")->in_edge(), 0, 10);
+    log_.RecordCommand(GetNode("a2")->in_edge(), 10, 20);
+    log_.RecordCommand(GetNode("b")->in_edge(), 0, 100);
+    log_.RecordCommand(GetNode("out")->in_edge(), 100, 105);
+  }
+
+  /// The output of the edge at |index| in |critical_.timings_|.
+  string Output(size_t index) {
+    return critical_.timings_[index].edge->outputs_[0]->path();
+  }
+
+  BuildLog log_;
+  CriticalPath critical_;
+};
+
+TEST_F(CriticalPathTest, Path) {
+  critical_.Analyze(vector<Node*>(1, GetNode("all")), &log_);
+
+  // The phony edge is timed, but is neither a command nor on the path.
+  EXPECT_EQ(6u, critical_.timings_.size());
+  EXPECT_EQ(5, critical_.commands_);
+  EXPECT_EQ(1, critical_.missing_);
+  EXPECT_EQ(105, critical_.length_);
+  EXPECT_EQ(125, critical_.work_);
+  ASSERT_EQ(2u, critical_.path_.size());
+  EXPECT_EQ("b", Output(critical_.path_[0]));
+  EXPECT_EQ("out", Output(critical_.path_[1]));
+}
+
+TEST_F(CriticalPathTest, Rules) {
+  critical_.Analyze(vector<Node*>(1, GetNode("all")), &log_);
+
+  ASSERT_EQ(2u, critical_.rules_.size());
+  const CriticalPath::RuleTotal& cat = critical_.rules_["cat"];
+  EXPECT_EQ(4, cat.commands);
+  EXPECT_EQ(25, cat.total);
+  EXPECT_EQ(10, cat.max);
+  const CriticalPath::RuleTotal& touch = critical_.rules_["touch"];
+  EXPECT_EQ(1, touch.commands);
+  EXPECT_EQ(100, touch.total);
+}
+
+TEST_F(CriticalPathTest, MostBlocking) {
+  critical_.Analyze(vector<Node*>(1, GetNode("all")), &log_);
+
+  // The a1 -> a2 chain hides behind "b", so it doesn't block the build.
+  vector<size_t> blocking = critical_.MostBlocking(10);
+  ASSERT_EQ(2u, blocking.size());
+  EXPECT_EQ("b", Output(blocking[0]));
+  EXPECT_EQ(100, critical_.timings_[blocking[0]].blocking(critical_.length_));
+  EXPECT_EQ("out", Output(blocking[1]));
+
+  blocking = critical_.MostBlocking(1);
+  ASSERT_EQ(1u, blocking.size());
+  EXPECT_EQ("b", Output(blocking[0]));
+}
+
+TEST_F(CriticalPathTest, Subgraph) {
+  // Only the edges behind the targets count.
+  critical_.Analyze(vector<Node*>(1, GetNode("a2")), &log_);
+
+  EXPECT_EQ(2, critical_.commands_);
+  EXPECT_EQ(20, critical_.length_);
+  ASSERT_EQ(2u, critical_.path_.size());
+  EXPECT_EQ("a1", Output(critical_.path_[0]));
+  EXPECT_EQ("a2", Output(critical_.path_[1]));
+}
+
+TEST_F(CriticalPathTest, NoInputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, "build gen: touch\n"));
+  log_.RecordCommand(GetNode("gen")->in_edge(), 0, 7);
+  critical_.Analyze(vector<Node*>(1, GetNode("gen")), &log_);
+
+  EXPECT_EQ(7, critical_.length_);
+  ASSERT_EQ(1u, critical_.path_.size());
+  EXPECT_EQ("gen", Output(critical_.path_[0]));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,203 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "depfile_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "depfile_parser.h"
+#include "metrics.h"
+
+namespace {
+
+const char kFileSignature[] = "# ninjadepfiles\n";
+const uint32_t kCurrentVersion = 1;
+
+}  // anonymous namespace
+
+#ifdef _WIN32
+const TimeStamp DepfileCache::kRacyWindow = 2 * 10000000LL;
+#else
+const TimeStamp DepfileCache::kRacyWindow = 2 * 1000000000LL;
+#endif
+
+LoadStatus DepfileCache::Load(const std::string& path, std::string* err) {
+  METRIC_RECORD_PHASE(".ninja_depfiles load");
+  path_ = path;
+  entries_.clear();
+  changed_ = false;
+
+  std::string data;
+  if (::ReadFile(path, &data, err) < 0) {
+    if (errno == ENOENT) {
+      err->clear();
+      return LOAD_NOT_FOUND;
+    }
+    return LOAD_ERROR;
+  }
+
+  // Records are the sizes of the path and of the paths in the depfile, the
+  // number of outputs and of inputs, the mtime, then the path, the paths in
+  // the depfile and the slash bits of the inputs.
+  const size_t kSignatureSize = sizeof(kFileSignature) - 1;
+  const size_t kRecordHeaderSize = 4 * 4 + 8;
+  uint32_t version = 0;
+  if (data.size() >= kSignatureSize + 4)
+    memcpy(&version, data.data() + kSignatureSize, 4);
+  if (data.size() < kSignatureSize + 4 ||
+      memcmp(data.data(), kFileSignature, kSignatureSize) != 0 ||
+      version != kCurrentVersion) {
+    *err = "bad depfile cache signature or version; starting over";
+    changed_ = true;
+    return LOAD_SUCCESS;
+  }
+
+  size_t offset = kSignatureSize + 4;
+  while (offset < data.size()) {
+    uint32_t path_size, paths_size, outs, ins;
+    int64_t mtime;
+    if (data.size() - offset < kRecordHeaderSize) {
+      *err = "truncated depfile cache; dropping the end of it";
+      changed_ = true;
+      break;
+    }
+    const char* header = data.data() + offset;
+    memcpy(&path_size, header, 4);
+    memcpy(&paths_size, header + 4, 4);
+    memcpy(&outs, header + 8, 4);
+    memcpy(&ins, header + 12, 4);
+    memcpy(&mtime, header + 16, 8);
+    offset += kRecordHeaderSize;
+    if (data.size() - offset <
+        (uint64_t)path_size + paths_size + 8 * (uint64_t)ins) {
+      *err = "truncated depfile cache; dropping the end of it";
+      changed_ = true;
+      break;
+    }
+    const char* paths = data.data() + offset + path_size;
+    if ((uint64_t)std::count(paths, paths + paths_size, '\0') !=
+        (uint64_t)outs + ins) {
+      *err = "damaged depfile cache; dropping the end of it";
+      changed_ = true;
+      break;
+    }
+    Entry& entry = entries_[data.substr(offset, path_size)];
+    entry.mtime = mtime;
+    entry.outs = outs;
+    entry.paths.assign(paths, paths_size);
+    entry.slash_bits.resize(ins);
+    if (ins)
+      memcpy(&entry.slash_bits[0], paths + paths_size, 8 * ins);
+    offset += path_size + paths_size + 8 * ins;
+  }
+  return LOAD_SUCCESS;
+}
+
+bool DepfileCache::Write(std::string* err) {
+  if (path_.empty() || !changed_)
+    return true;
+
+  std::string temp_path = path_ + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) == 1 &&
+      fwrite(&kCurrentVersion, 4, 1, f) == 1;
+  for (std::map<std::string, Entry>::const_iterator i = entries_.begin();
+       ok && i != entries_.end(); ++i) {
+    const Entry& entry = i->second;
+    uint32_t header[4] = {
+      (uint32_t)i->first.size(), (uint32_t)entry.paths.size(), entry.outs,
+      (uint32_t)entry.slash_bits.size()
+    };
+    int64_t mtime = entry.mtime;
+    ok = fwrite(header, 4, 4, f) == 4 && fwrite(&mtime, 8, 1, f) == 1 &&
+        fwrite(i->first.data(), 1, header[0], f) == header[0] &&
+        fwrite(entry.paths.data(), 1, header[1], f) == header[1] &&
+        (entry.slash_bits.empty() ||
+         fwrite(&entry.slash_bits[0], 8, header[3], f) == header[3]);
+  }
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // On Windows, rename() doesn't replace an existing file.
+  if (unlink(path_.c_str()) < 0 && errno != ENOENT) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (rename(temp_path.c_str(), path_.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  changed_ = false;
+  return true;
+}
+
+bool DepfileCache::Lookup(const std::string& path, TimeStamp mtime,
+                          DepfileParser* depfile) const {
+  std::map<std::string, Entry>::const_iterator i = entries_.find(path);
+  if (mtime <= 0 || i == entries_.end() || i->second.mtime != mtime)
+    return false;
+  const Entry& entry = i->second;
+  depfile->outs_.clear();
+  depfile->ins_.clear();
+  const char* p = entry.paths.data();
+  for (uint32_t n = 0; n < entry.outs + entry.slash_bits.size(); ++n) {
+    size_t len = strlen(p);
+    (n < entry.outs ? depfile->outs_ : depfile->ins_).push_back(
+        StringPiece(p, len));
+    p += len + 1;
+  }
+  depfile->ins_slash_bits_ = entry.slash_bits;
+  return true;
+}
+
+void DepfileCache::Add(const std::string& path, TimeStamp mtime,
+                       TimeStamp now, const DepfileParser& depfile) {
+  if (mtime <= 0)
+    return;
+  if (mtime > now - kRacyWindow) {
+    if (entries_.erase(path))
+      changed_ = true;
+    return;
+  }
+  Entry& entry = entries_[path];
+  entry.mtime = mtime;
+  entry.outs = depfile.outs_.size();
+  entry.paths.clear();
+  for (size_t i = 0; i < depfile.outs_.size(); ++i) {
+    entry.paths.append(depfile.outs_[i].str_, depfile.outs_[i].len_);
+    entry.paths.push_back('\0');
+  }
+  for (size_t i = 0; i < depfile.ins_.size(); ++i) {
+    entry.paths.append(depfile.ins_[i].str_, depfile.ins_[i].len_);
+    entry.paths.push_back('\0');
+  }
+  entry.slash_bits = depfile.ins_slash_bits_;
+  changed_ = true;
+}
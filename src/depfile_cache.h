@@ -0,0 +1,75 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_DEPFILE_CACHE_H_
+#define NINJA_DEPFILE_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "load_status.h"
+#include "timestamp.h"
+#include "util.h"  // For uint64_t.
+
+struct DepfileParser;
+
+/// Keeps the parsed depfiles of the edges without "deps" that one run
+/// loads for the next, with their mtimes, so that depfiles that haven't
+/// changed since are neither read nor parsed again.
+struct DepfileCache {
+  DepfileCache() : changed_(false) {}
+
+  /// Load the cache an earlier run wrote to |path|, where Write() writes it
+  /// back.  A damaged cache is dropped, with a warning in |err|.
+  LoadStatus Load(const std::string& path, std::string* err);
+
+  /// Write the cache back, if anything in it changed since Load().
+  bool Write(std::string* err);
+
+  /// Fill |depfile| with the paths cached for the depfile at |path|, if
+  /// they were parsed from a file with |mtime|.  The paths stay valid until
+  /// the next Add() for |path|.  Returns false if there are none.
+  bool Lookup(const std::string& path, TimeStamp mtime,
+              DepfileParser* depfile) const;
+
+  /// Cache what ParseCanonical() filled |depfile| with, for the depfile at
+  /// |path| with |mtime|, which was read after |now|.  A depfile modified
+  /// less than kRacyWindow before then could have changed again since
+  /// without its mtime moving, so it isn't cached.
+  void Add(const std::string& path, TimeStamp mtime, TimeStamp now,
+           const DepfileParser& depfile);
+
+  /// How long after a file was modified it may change again with the same
+  /// mtime, on file systems with coarse clocks: two seconds, as on FAT.
+  static const TimeStamp kRacyWindow;
+
+ private:
+  struct Entry {
+    Entry() : mtime(0), outs(0) {}
+    TimeStamp mtime;
+    /// The number of outputs in |paths|, which come before the inputs.
+    uint32_t outs;
+    /// Each path followed by a NUL.
+    std::string paths;
+    /// The slash bits of each input.
+    std::vector<uint64_t> slash_bits;
+  };
+
+  std::string path_;
+  std::map<std::string, Entry> entries_;
+  bool changed_;
+};
+
+#endif  // NINJA_DEPFILE_CACHE_H_
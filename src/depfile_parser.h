@@ -20,6 +20,7 @@
 using namespace std;
 
 #include "string_piece.h"
+#include "util.h"  // uint64_t
 
 struct DepfileParserOptions {
   DepfileParserOptions() {}
@@ -35,9 +36,19 @@ struct DepfileParser {
   /// pointers within it.
   bool Parse(string* content, string* err);
 
+  /// Like Parse(), but also canonicalize the paths in place as they are
+  /// parsed, filling in ins_slash_bits_, so that the inputs can go straight
+  /// to State::GetNode().
+  bool ParseCanonical(string* content, string* err);
+
   std::vector<StringPiece> outs_;
   vector<StringPiece> ins_;
+  /// The slash bits of each of ins_, after ParseCanonical().
+  vector<uint64_t> ins_slash_bits_;
   DepfileParserOptions options_;
+
+ private:
+  bool Parse(string* content, bool canonicalize, string* err);
 };
 
 #endif // NINJA_DEPFILE_PARSER_H_
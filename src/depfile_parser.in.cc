@@ -13,15 +13,84 @@
 // limitations under the License.
 
 #include "depfile_parser.h"
+#include "hash_map.h"
 #include "util.h"
 
 #include <algorithm>
 
+#if defined(NINJA_HAVE_SSE2)
+#include <emmintrin.h>
+#elif defined(NINJA_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
 DepfileParser::DepfileParser(DepfileParserOptions options)
   : options_(options)
 {
 }
 
+namespace {
+
+/// Return the first byte at or after |p| that may not be plain path text,
+/// or the point within 16 bytes of |end| where the vector loop stops; the
+/// scanner takes it from there.  Plain text here is letters, digits, bytes
+/// from 0x80 up and "+,-./:@[_{", which covers nearly every path that
+/// compilers write; the rarer plain characters are left to the scanner.
+char* SkipPlainText(char* p, const char* end) {
+#if defined(NINJA_HAVE_SSE2)
+  // A byte is in [lo, lo + span] if subtracting lo leaves at most span.
+  const __m128i punct_lo = _mm_set1_epi8('+');
+  const __m128i punct_span = _mm_set1_epi8(':' - '+');
+  const __m128i upper_lo = _mm_set1_epi8('@');
+  const __m128i upper_span = _mm_set1_epi8('[' - '@');
+  const __m128i lower_lo = _mm_set1_epi8('a');
+  const __m128i lower_span = _mm_set1_epi8('{' - 'a');
+  const __m128i underscore = _mm_set1_epi8('_');
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i punct = _mm_sub_epi8(chunk, punct_lo);
+    __m128i upper = _mm_sub_epi8(chunk, upper_lo);
+    __m128i lower = _mm_sub_epi8(chunk, lower_lo);
+    __m128i plain = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(punct, punct_span), punct),
+            _mm_cmpeq_epi8(_mm_min_epu8(upper, upper_span), upper)),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(lower, lower_span), lower),
+            _mm_cmpeq_epi8(chunk, underscore)));
+    // The sign bits of the chunk itself mark the bytes from 0x80 up.
+    unsigned mask = (unsigned)(_mm_movemask_epi8(plain) |
+                               _mm_movemask_epi8(chunk)) ^ 0xffff;
+    if (mask)
+      return p + CountTrailingZeros(mask);
+  }
+#elif defined(NINJA_HAVE_NEON)
+  const uint8x16_t punct_lo = vdupq_n_u8('+');
+  const uint8x16_t punct_span = vdupq_n_u8(':' - '+');
+  const uint8x16_t upper_lo = vdupq_n_u8('@');
+  const uint8x16_t upper_span = vdupq_n_u8('[' - '@');
+  const uint8x16_t lower_lo = vdupq_n_u8('a');
+  const uint8x16_t lower_span = vdupq_n_u8('{' - 'a');
+  const uint8x16_t underscore = vdupq_n_u8('_');
+  const uint8x16_t high = vdupq_n_u8(0x80);
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t plain = vorrq_u8(
+        vorrq_u8(vcleq_u8(vsubq_u8(chunk, punct_lo), punct_span),
+                 vcleq_u8(vsubq_u8(chunk, upper_lo), upper_span)),
+        vorrq_u8(vcleq_u8(vsubq_u8(chunk, lower_lo), lower_span),
+                 vorrq_u8(vceqq_u8(chunk, underscore),
+                          vcgeq_u8(chunk, high))));
+    // NEON has no movemask; leave the rest of the chunk to the scanner.
+    if (vminvq_u8(plain) == 0)
+      break;
+  }
+#endif
+  return p;
+}
+
+}  // anonymous namespace
+
 // A note on backslashes in Makefiles, from reading the docs:
 // Backslash-newline is the line continuation character.
 // Backslash-# escapes a # (otherwise meaningful as a comment start).
@@ -43,6 +112,14 @@ DepfileParser::DepfileParser(DepfileParserOptions options)
 // If anyone actually has depfiles that rely on the more complicated
 // behavior we can adjust this.
 bool DepfileParser::Parse(string* content, string* err) {
+  return Parse(content, false, err);
+}
+
+bool DepfileParser::ParseCanonical(string* content, string* err) {
+  return Parse(content, true, err);
+}
+
+bool DepfileParser::Parse(string* content, bool canonicalize, string* err) {
   // in: current parser input point.
   // end: end of input.
   // parsing_targets: whether we are parsing targets or dependencies.
@@ -51,6 +128,8 @@ bool DepfileParser::Parse(string* content, string* err) {
   bool have_target = false;
   bool parsing_targets = true;
   bool poisoned_input = false;
+  // The inputs so far, to skip repeats.
+  ExternalStringHashMap<bool>::Type seen_ins;
   while (in < end) {
     bool have_newline = false;
     // out: current output point (typically same as in, but can fall behind
@@ -59,6 +138,16 @@ bool DepfileParser::Parse(string* content, string* err) {
     // filename: start of the current parsed filename.
     char* filename = out;
     for (;;) {
+      // Take runs of plain text 16 bytes at a time before the scanner goes
+      // byte by byte.
+      char* plain = SkipPlainText(in, end);
+      if (plain != in) {
+        // Need to shift it over if we're overwriting backslashes.
+        if (out < in)
+          memmove(out, in, plain - in);
+        out += plain - in;
+        in = plain;
+      }
       // start: beginning of the current parsed span.
       const char* start = in;
       char* yymarker = NULL;
@@ -146,10 +235,18 @@ bool DepfileParser::Parse(string* content, string* err) {
     }
 
     if (len > 0) {
+      // Canonicalize while the path is still at hand, targets too so that
+      // they compare with the inputs.
+      uint64_t slash_bits = 0;
+      if (canonicalize) {
+        size_t canonical_len = len;
+        if (!CanonicalizePath(filename, &canonical_len, &slash_bits, err))
+          return false;
+        len = (int)canonical_len;
+      }
       StringPiece piece = StringPiece(filename, len);
       // If we've seen this as an input before, skip it.
-      std::vector<StringPiece>::iterator pos = std::find(ins_.begin(), ins_.end(), piece);
-      if (pos == ins_.end()) {
+      if (seen_ins.find(piece) == seen_ins.end()) {
         if (is_dependency) {
           if (poisoned_input) {
             *err = "inputs may not also have inputs";
@@ -157,6 +254,9 @@ bool DepfileParser::Parse(string* content, string* err) {
           }
           // New input.
           ins_.push_back(piece);
+          if (canonicalize)
+            ins_slash_bits_.push_back(slash_bits);
+          seen_ins.insert(make_pair(piece, true));
         } else {
           // Check for a new output.
           if (std::find(outs_.begin(), outs_.end(), piece) == outs_.end())
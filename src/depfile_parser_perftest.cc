@@ -16,45 +16,106 @@
 #include <stdlib.h>
 
 #include "depfile_parser.h"
+#include "state.h"
 #include "util.h"
 #include "metrics.h"
 
-int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    printf("usage: %s <file1> <file2...>\n", argv[0]);
-    return 1;
-  }
+namespace {
 
-  vector<float> times;
-  for (int i = 1; i < argc; ++i) {
-    const char* filename = argv[i];
+/// A depfile like the one gcc writes for a translation unit heavy with
+/// templates: a few thousand headers, one per continued line, many of them
+/// reached through "..".
+string LargeTUDepfile(int headers) {
+  const char* const kDirs[] = {
+    "../../src/base/",
+    "../../third_party/boost/include/boost/mpl/aux_/preprocessed/gcc/",
+    "../../third_party/abseil-cpp/absl/container/internal/",
+    "/usr/lib/gcc/x86_64-linux-gnu/13/../../../../include/c++/13/bits/",
+    "/usr/include/x86_64-linux-gnu/bits/types/",
+    "gen/services/network/public/mojom/",
+  };
+  const int kNumDirs = sizeof(kDirs) / sizeof(kDirs[0]);
 
-    for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
-      int64_t start = GetTimeMillis();
-      for (int rep = 0; rep < limit; ++rep) {
-        string buf;
-        string err;
-        if (ReadFile(filename, &buf, &err) < 0) {
-          printf("%s: %s\n", filename, err.c_str());
-          return 1;
-        }
+  string content = "obj/src/heavy/heavy_template_instantiations.o: "
+                   "../../src/heavy/heavy_template_instantiations.cc";
+  char name[64];
+  for (int i = 0; i < headers; ++i) {
+    snprintf(name, sizeof(name), "header_%04d_impl.h", i);
+    content += " \\\n  ";
+    content += kDirs[i % kNumDirs];
+    content += name;
+  }
+  content += "\n";
+  return content;
+}
 
-        DepfileParser parser;
-        if (!parser.Parse(&buf, &err)) {
-          printf("%s: %s\n", filename, err.c_str());
-          return 1;
-        }
+/// Parse |content| over and over, for at least 100ms, and if |state| is
+/// given, canonicalize the inputs and look up their nodes too.
+/// @return the microseconds per parse, or -1 on error.
+float TimeParse(const string& label, const string& content, State* state) {
+  for (int limit = 1 << 4; limit < (1 << 20); limit *= 2) {
+    int64_t start = GetTimeMillis();
+    for (int rep = 0; rep < limit; ++rep) {
+      string buf = content;
+      string err;
+      DepfileParser parser;
+      if (!(state ? parser.ParseCanonical(&buf, &err)
+                  : parser.Parse(&buf, &err))) {
+        printf("%s: %s\n", label.c_str(), err.c_str());
+        return -1;
       }
-      int64_t end = GetTimeMillis();
-
-      if (end - start > 100) {
-        int delta = (int)(end - start);
-        float time = delta*1000 / (float)limit;
-        printf("%s: %.1fus\n", filename, time);
-        times.push_back(time);
-        break;
+      // Then go on to the nodes, as loading deps does.
+      if (state) {
+        for (size_t i = 0; i < parser.ins_.size(); ++i)
+          state->GetNode(parser.ins_[i], parser.ins_slash_bits_[i]);
       }
     }
+    int64_t end = GetTimeMillis();
+
+    if (end - start > 100) {
+      int delta = (int)(end - start);
+      return delta * 1000 / (float)limit;
+    }
+  }
+  return -1;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  vector<pair<string, string> > inputs;
+  if (argc < 2) {
+    printf("no depfiles given; using generated ones\n");
+    inputs.push_back(make_pair(string("large TU, 4000 headers"),
+                               LargeTUDepfile(4000)));
+    inputs.push_back(make_pair(string("small TU, 100 headers"),
+                               LargeTUDepfile(100)));
+  }
+  for (int i = 1; i < argc; ++i) {
+    string buf;
+    string err;
+    if (ReadFile(argv[i], &buf, &err) < 0) {
+      printf("%s: %s\n", argv[i], err.c_str());
+      return 1;
+    }
+    inputs.push_back(make_pair(string(argv[i]), buf));
+  }
+
+  vector<float> times;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const string& label = inputs[i].first;
+    const string& content = inputs[i].second;
+
+    float time = TimeParse(label, content, NULL);
+    if (time < 0)
+      return 1;
+    State state;
+    float node_time = TimeParse(label, content, &state);
+    if (node_time < 0)
+      return 1;
+    printf("%s: %.1fus (%.0f MB/s), with nodes %.1fus\n", label.c_str(), time,
+           content.size() / time, node_time);
+    times.push_back(time);
   }
 
   if (!times.empty()) {
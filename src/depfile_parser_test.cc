@@ -341,3 +341,64 @@ TEST_F(DepfileParserTest, BuggyMP) {
                      "z:\n", &err));
   ASSERT_EQ("inputs may not also have inputs", err);
 }
+
+TEST_F(DepfileParserTest, LongPaths) {
+  // Escapes and the rarer plain characters well into long runs of text.
+  string err;
+  EXPECT_TRUE(Parse(
+"out/obj/some/deeply/nested/directory/target.o: \\\n"
+"  /usr/lib/gcc/x86_64-linux-gnu/13/../../../../include/c++/13/vector \\\n"
+"  ../../third_party/some\\ directory/with\\ spaces/header.h \\\n"
+"  ../../third_party/dollar/$$ORIGIN/lib/libfoo_headers.h \\\n"
+"  ../../third_party/odd/dir=with~tilde/and(parens)/header.h\n",
+      &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, parser_.outs_.size());
+  EXPECT_EQ("out/obj/some/deeply/nested/directory/target.o",
+            parser_.outs_[0].AsString());
+  ASSERT_EQ(4u, parser_.ins_.size());
+  EXPECT_EQ("/usr/lib/gcc/x86_64-linux-gnu/13/../../../../include/c++/13/vector",
+            parser_.ins_[0].AsString());
+  EXPECT_EQ("../../third_party/some directory/with spaces/header.h",
+            parser_.ins_[1].AsString());
+  EXPECT_EQ("../../third_party/dollar/$ORIGIN/lib/libfoo_headers.h",
+            parser_.ins_[2].AsString());
+  EXPECT_EQ("../../third_party/odd/dir=with~tilde/and(parens)/header.h",
+            parser_.ins_[3].AsString());
+}
+
+TEST_F(DepfileParserTest, ManyRepeatedInputs) {
+  string input = "foo.o:";
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < 500; ++i) {
+      char name[32];
+      snprintf(name, sizeof(name), " include/header_%d.h", i);
+      input += name;
+    }
+  }
+  input += "\n";
+  string err;
+  EXPECT_TRUE(Parse(input.c_str(), &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(500u, parser_.ins_.size());
+  EXPECT_EQ("include/header_0.h", parser_.ins_[0].AsString());
+  EXPECT_EQ("include/header_499.h", parser_.ins_[499].AsString());
+}
+
+TEST_F(DepfileParserTest, ParseCanonical) {
+  input_ =
+"obj/./foo.o: ../src/../include/x.h ./y.h y.h\n"
+"../src/../include/x.h:\n"
+"y.h:\n";
+  string err;
+  EXPECT_TRUE(parser_.ParseCanonical(&input_, &err));
+  ASSERT_EQ("", err);
+  // The -MP targets match the inputs once both are canonical.
+  ASSERT_EQ(1u, parser_.outs_.size());
+  EXPECT_EQ("obj/foo.o", parser_.outs_[0].AsString());
+  ASSERT_EQ(2u, parser_.ins_.size());
+  EXPECT_EQ("../include/x.h", parser_.ins_[0].AsString());
+  EXPECT_EQ("y.h", parser_.ins_[1].AsString());
+  ASSERT_EQ(2u, parser_.ins_slash_bits_.size());
+  EXPECT_EQ(0u, parser_.ins_slash_bits_[0]);
+}
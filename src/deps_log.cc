@@ -18,6 +18,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+
+#include <algorithm>
+#include <map>
 #ifndef _WIN32
 #include <unistd.h>
 #elif defined(_MSC_VER) && (_MSC_VER < 1900)
@@ -27,56 +30,274 @@ typedef unsigned __int32 uint32_t;
 
 #include "graph.h"
 #include "metrics.h"
+#include "probes.h"
 #include "state.h"
 #include "util.h"
 
 // The version is stored as 4 bytes after the signature and also serves as a
 // byte order mark. Signature and version combined are 16 bytes long.
 const char kFileSignature[] = "# ninjadeps\n";
-const int kCurrentVersion = 4;
+const int kCurrentVersion = 6;
+/// The version that stored whole paths and 4 byte ids, which is still read.
+const int kUncompressedVersion = 4;
+/// The version before shared deps records, which is still read.
+const int kUnsharedVersion = 5;
 
 // Record size is currently limited to less than the full 32 bit, due to
 // internal buffers having to have this size.
 const unsigned kMaxRecordSize = (1 << 19) - 1;
 
+namespace {
+
+template<typename T>
+void Append(string* out, T value) {
+  out->append((const char*)&value, sizeof(value));
+}
+
+void AppendVarint(string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back((char)value);
+}
+
+/// Read a varint from |*p|, which must be before |end|, and move past it.
+bool ReadVarint(const char** p, const char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*p)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/// Give small differences of either sign small varints.
+uint64_t ZigZag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+int64_t UnZigZag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/// Copy |ids| for RecordDeps(), with room in front to count the Deps that
+/// share them.
+int* NewIds(const vector<int>& ids) {
+  int* block = new int[ids.size() + 1];
+  block[0] = 0;
+  copy(ids.begin(), ids.end(), block + 1);
+  return block + 1;
+}
+
+void RetainIds(const int* ids) {
+  ++const_cast<int*>(ids)[-1];
+}
+
+void ReleaseIds(const int* ids) {
+  int* block = const_cast<int*>(ids) - 1;
+  if (--block[0] == 0)
+    delete [] block;
+}
+
+void AppendMtime(string* out, TimeStamp mtime) {
+  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
+  Append(out, mtime_part);
+  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
+  Append(out, mtime_part);
+}
+
+/// Fill in the size of the record started at |start| in |out|, now that it
+/// is complete.
+bool FinishRecord(string* out, size_t start, unsigned type_bit) {
+  unsigned size = out->size() - start - 4;
+  if (size > kMaxRecordSize) {
+    out->resize(start);
+    errno = ERANGE;
+    return false;
+  }
+  size |= type_bit;
+  memcpy(&(*out)[start], &size, 4);
+  return true;
+}
+
+/// Append the record that gives |path| |id| to |out|, where the record
+/// before it was for |last_path|.
+bool WritePathRecord(string* out, StringPiece path, StringPiece last_path,
+                     int id) {
+  size_t prefix = 0;
+  size_t max_prefix = min(path.size(), last_path.size());
+  while (prefix < max_prefix && path.str_[prefix] == last_path.str_[prefix])
+    ++prefix;
+
+  size_t start = out->size();
+  Append(out, 0u);
+  AppendVarint(out, prefix);
+  out->append(path.str_ + prefix, path.size() - prefix);
+  unsigned checksum = ~(unsigned)id;
+  Append(out, checksum);
+  return FinishRecord(out, start, 0);
+}
+
+/// Append a deps record for the |output_count| outputs |out_ids|, whose
+/// mtimes are |mtimes|, to |out|; a shared one if there are several.
+bool WriteDepsRecord(string* out, int output_count, const int* out_ids,
+                     const TimeStamp* mtimes, int node_count,
+                     const int* ids) {
+  size_t start = out->size();
+  Append(out, 0u);
+  if (output_count == 1) {
+    AppendVarint(out, out_ids[0]);
+    AppendMtime(out, mtimes[0]);
+  } else {
+    AppendVarint(out, output_count);
+    int64_t last_id = 0;
+    for (int i = 0; i < output_count; ++i) {
+      AppendVarint(out, ZigZag(out_ids[i] - last_id));
+      last_id = out_ids[i];
+      AppendMtime(out, mtimes[i]);
+    }
+  }
+  AppendVarint(out, node_count);
+  int64_t last_id = out_ids[0];
+  for (int i = 0; i < node_count; ++i) {
+    AppendVarint(out, ZigZag(ids[i] - last_id));
+    last_id = ids[i];
+  }
+  // Deps record: high bit; shared deps record: both high bits.
+  return FinishRecord(out, start, output_count == 1 ? 0x80000000 : 0xC0000000);
+}
+
+/// Read the outputs of a deps record at |*p|, of which there are several
+/// if it is |shared|, into |out_ids| and |mtimes|, and move past them.
+/// Their ids must be below |id_limit|.
+bool ReadDepsOutputs(const char** p, const char* end, bool shared,
+                     size_t id_limit, vector<int>* out_ids,
+                     vector<TimeStamp>* mtimes) {
+  out_ids->clear();
+  mtimes->clear();
+  uint64_t output_count = 1;
+  // Each output takes 9 bytes at least.
+  if (shared && (!ReadVarint(p, end, &output_count) || output_count < 2 ||
+                 output_count > (uint64_t)(end - *p) / 9))
+    return false;
+  int64_t id = 0;
+  for (uint64_t i = 0; i < output_count; ++i) {
+    uint64_t value;
+    if (!ReadVarint(p, end, &value) || end - *p < 8)
+      return false;
+    id = shared ? id + UnZigZag(value) : (int64_t)value;
+    if (id < 0 || id >= (int64_t)id_limit)
+      return false;
+    uint32_t mtime_parts[2];
+    memcpy(mtime_parts, *p, 8);
+    *p += 8;
+    out_ids->push_back((int)id);
+    mtimes->push_back((TimeStamp)(((uint64_t)mtime_parts[1] << 32) |
+                                  mtime_parts[0]));
+  }
+  return true;
+}
+
+/// Write |record| to |f| and clear it.
+bool WriteRecord(FILE* f, string* record) {
+  bool ok = fwrite(record->data(), record->size(), 1, f) == 1;
+  record->clear();
+  return ok;
+}
+
+/// Writes a recompacted deps log in the background.  It keeps all path
+/// records, so that the ids of the records appended meanwhile stay valid,
+/// and drops the deps records that are dead or were superseded.
+struct BackgroundWriter : public LogRecompaction::Writer {
+  virtual ~BackgroundWriter() {
+    for (size_t i = 0; i < copies_.size(); ++i)
+      delete [] copies_[i];
+  }
+
+  virtual bool WriteLog(FILE* f) {
+    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) < 1)
+      return false;
+    if (fwrite(&kCurrentVersion, 4, 1, f) < 1)
+      return false;
+    string record;
+    StringPiece last_path;
+    for (size_t id = 0; id < paths_.size(); ++id) {
+      if (!WritePathRecord(&record, paths_[id], last_path, id) ||
+          !WriteRecord(f, &record))
+        return false;
+      last_path = paths_[id];
+    }
+    for (size_t i = 0; i < records_.size(); ++i) {
+      const Record& r = records_[i];
+      if (!WriteDepsRecord(&record, r.out_ids.size(), &r.out_ids[0],
+                           &r.mtimes[0], r.node_count, r.ids) ||
+          !WriteRecord(f, &record))
+        return false;
+    }
+    return true;
+  }
+
+  struct Record {
+    vector<int> out_ids;
+    vector<TimeStamp> mtimes;
+    int node_count;
+    const int* ids;
+  };
+  /// Maps id -> path.  The paths are in the loaded log or in Nodes.
+  vector<StringPiece> paths_;
+  vector<Record> records_;
+  /// Copies of the ids that the log might free while this runs.
+  vector<int*> copies_;
+};
+
+}  // anonymous namespace
+
 DepsLog::~DepsLog() {
   Close();
+  for (size_t id = 0; id < deps_.size(); ++id) {
+    if (owned_ids_[id])
+      ReleaseIds(deps_[id]->nodes.ids_);
+  }
+  FreeDecoded();
 }
 
 bool DepsLog::OpenForWrite(const string& path, string* err) {
-  if (needs_recompaction_) {
+  // An old log is upgraded right away, so that nothing is appended to it.
+  if (needs_upgrade_) {
     if (!Recompact(path, err))
       return false;
+  } else if (needs_recompaction_) {
+    if (!StartRecompaction(path, err))
+      return false;
   }
 
-  file_ = fopen(path.c_str(), "ab");
-  if (!file_) {
+  FILE* f = fopen(path.c_str(), "ab");
+  if (!f) {
     *err = strerror(errno);
     return false;
   }
-  // Set the buffer size to this and flush the file buffer after every record
-  // to make sure records aren't written partially.
-  setvbuf(file_, NULL, _IOFBF, kMaxRecordSize + 1);
-  SetCloseOnExec(fileno(file_));
+  SetCloseOnExec(fileno(f));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
-  fseek(file_, 0, SEEK_END);
+  fseek(f, 0, SEEK_END);
 
-  if (ftell(file_) == 0) {
-    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, file_) < 1) {
-      *err = strerror(errno);
-      return false;
-    }
-    if (fwrite(&kCurrentVersion, 4, 1, file_) < 1) {
+  if (ftell(f) == 0) {
+    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) < 1 ||
+        fwrite(&kCurrentVersion, 4, 1, f) < 1) {
       *err = strerror(errno);
+      fclose(f);
       return false;
     }
   }
-  if (fflush(file_) != 0) {
+  if (fflush(f) != 0) {
     *err = strerror(errno);
+    fclose(f);
     return false;
   }
+  writer_.Open(f);
   return true;
 }
 
@@ -88,17 +309,25 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
 
 bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
                          int node_count, Node** nodes) {
+  return RecordDeps(1, &node, &mtime, node_count, nodes);
+}
+
+bool DepsLog::RecordDeps(int output_count, Node** outputs,
+                         const TimeStamp* mtimes, int node_count,
+                         Node** nodes) {
   // Track whether there's any new data to be recorded.
   bool made_change = false;
 
   // Assign ids to all nodes that are missing one.
-  if (node->id() < 0) {
-    if (!RecordId(node))
-      return false;
-    made_change = true;
+  for (int i = 0; i < output_count; ++i) {
+    if (outputs[i]->id() < 0 && !FindId(outputs[i])) {
+      if (!RecordId(outputs[i]))
+        return false;
+      made_change = true;
+    }
   }
   for (int i = 0; i < node_count; ++i) {
-    if (nodes[i]->id() < 0) {
+    if (nodes[i]->id() < 0 && !FindId(nodes[i])) {
       if (!RecordId(nodes[i]))
         return false;
       made_change = true;
@@ -106,10 +335,10 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
   }
 
   // See if the new data is different than the existing data, if any.
-  if (!made_change) {
-    Deps* deps = GetDeps(node);
+  for (int o = 0; o < output_count && !made_change; ++o) {
+    Deps* deps = GetDeps(outputs[o]);
     if (!deps ||
-        deps->mtime != mtime ||
+        deps->mtime != mtimes[o] ||
         deps->node_count != node_count) {
       made_change = true;
     } else {
@@ -127,139 +356,250 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
     return true;
 
   // Update on-disk representation.
-  unsigned size = 4 * (1 + 2 + node_count);
-  if (size > kMaxRecordSize) {
-    errno = ERANGE;
-    return false;
-  }
-  size |= 0x80000000;  // Deps record: set high bit.
-  if (fwrite(&size, 4, 1, file_) < 1)
-    return false;
-  int id = node->id();
-  if (fwrite(&id, 4, 1, file_) < 1)
-    return false;
-  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
-  if (fwrite(&mtime_part, 4, 1, file_) < 1)
-    return false;
-  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
-  if (fwrite(&mtime_part, 4, 1, file_) < 1)
+  NINJA_PROBE2(deps__record, outputs[0]->path().c_str(), node_count);
+  vector<int> out_ids(output_count);
+  for (int i = 0; i < output_count; ++i)
+    out_ids[i] = outputs[i]->id();
+  vector<int> ids(node_count);
+  for (int i = 0; i < node_count; ++i)
+    ids[i] = nodes[i]->id();
+  string record;
+  if (!WriteDepsRecord(&record, output_count, &out_ids[0], mtimes,
+                       node_count, ids.empty() ? NULL : &ids[0]) ||
+      !writer_.Append(record)) {
     return false;
-  for (int i = 0; i < node_count; ++i) {
-    id = nodes[i]->id();
-    if (fwrite(&id, 4, 1, file_) < 1)
-      return false;
   }
-  if (fflush(file_) != 0)
-    return false;
 
   // Update in-memory representation.
-  Deps* deps = new Deps(mtime, node_count);
-  for (int i = 0; i < node_count; ++i)
-    deps->nodes[i] = nodes[i];
-  UpdateDeps(node->id(), deps);
+  int* owned_ids = NewIds(ids);
+  for (int i = 0; i < output_count; ++i)
+    UpdateDeps(out_ids[i], mtimes[i], node_count, owned_ids, true);
 
   return true;
 }
 
 void DepsLog::Close() {
-  if (file_)
-    fclose(file_);
-  file_ = NULL;
+  if (writer_.is_open() && !writer_.Close())
+    Warning("writing deps log: %s", strerror(errno));
+
+  if (recompaction_.running()) {
+    string err;
+    if (!recompaction_.Finish(&err))
+      Warning("recompacting deps log: %s", err.c_str());
+  }
+}
+
+bool DepsLog::StartRecompaction(const string& path, string* err) {
+  METRIC_RECORD_PHASE(".ninja_deps recompact start");
+  needs_recompaction_ = false;
+
+  // Decide what to keep here, as the build may change the state and the
+  // deps; the background thread only gets what won't change.
+  BackgroundWriter* writer = new BackgroundWriter;
+  writer->paths_ = paths_;
+  for (size_t id = paths_.size(); id < nodes_.size(); ++id)
+    writer->paths_.push_back(nodes_[id]->path());
+  // Maps the ids and count of deps -> their record.
+  map<pair<const int*, int>, size_t> records;
+  for (int id = 0; id < (int)deps_.size(); ++id) {
+    Deps* deps = deps_[id];
+    if (!deps)
+      continue;
+    // Don't create nodes just to find out that they're dead.
+    Node* node = nodes_[id] ? nodes_[id] : state_->LookupNode(paths_[id]);
+    if (!node || !IsDepsEntryLiveFor(node))
+      continue;
+
+    // Outputs that share their ids share their record again.
+    pair<map<pair<const int*, int>, size_t>::iterator, bool> shared =
+        records.insert(make_pair(make_pair(deps->nodes.ids_,
+                                           deps->node_count),
+                                 writer->records_.size()));
+    if (shared.second) {
+      writer->records_.push_back(BackgroundWriter::Record());
+      BackgroundWriter::Record& record = writer->records_.back();
+      record.node_count = deps->node_count;
+      record.ids = deps->nodes.ids_;
+      if (owned_ids_[id]) {
+        int* copy = new int[deps->node_count];
+        copy_n(deps->nodes.ids_, deps->node_count, copy);
+        writer->copies_.push_back(copy);
+        record.ids = copy;
+      }
+    }
+    BackgroundWriter::Record& record = writer->records_[shared.first->second];
+    record.out_ids.push_back(id);
+    record.mtimes.push_back(deps->mtime);
+  }
+  return recompaction_.Start(path, writer, err);
 }
 
 LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
-  METRIC_RECORD(".ninja_deps load");
-  char buf[kMaxRecordSize + 1];
-  FILE* f = fopen(path.c_str(), "rb");
-  if (!f) {
-    if (errno == ENOENT)
+  METRIC_RECORD_PHASE(".ninja_deps load");
+  // A recompaction may still be reading the old mapping.
+  assert(!recompaction_.running());
+  state_ = state;
+  int status = mapped_.Map(path, err);
+  if (status < 0) {
+    if (status == -ENOENT) {
+      err->clear();
       return LOAD_NOT_FOUND;
-    *err = strerror(errno);
+    }
     return LOAD_ERROR;
   }
+  const char* data = mapped_.data();
+  size_t size = mapped_.size();
 
-  bool valid_header = true;
+  const size_t kHeaderSize = sizeof(kFileSignature) - 1 + 4;
   int version = 0;
-  if (!fgets(buf, sizeof(buf), f) || fread(&version, 4, 1, f) < 1)
-    valid_header = false;
+  if (size >= kHeaderSize)
+    memcpy(&version, data + kHeaderSize - 4, 4);
   // Note: For version differences, this should migrate to the new format.
   // But the v1 format could sometimes (rarely) end up with invalid data, so
   // don't migrate v1 to v3 to force a rebuild. (v2 only existed for a few days,
   // and there was no release with it, so pretend that it never happened.)
-  if (!valid_header || strcmp(buf, kFileSignature) != 0 ||
-      version != kCurrentVersion) {
+  if (size < kHeaderSize ||
+      memcmp(data, kFileSignature, sizeof(kFileSignature) - 1) != 0 ||
+      (version != kCurrentVersion && version != kUnsharedVersion &&
+       version != kUncompressedVersion)) {
     if (version == 1)
       *err = "deps log version change; rebuilding";
     else
       *err = "bad deps log signature or version; starting over";
-    fclose(f);
+    mapped_.Unmap();
     unlink(path.c_str());
     // Don't report this as a failure.  An empty deps log will cause
     // us to rebuild the outputs anyway.
     return LOAD_SUCCESS;
   }
+  bool compressed = version != kUncompressedVersion;
 
-  long offset;
+  size_t offset = kHeaderSize;
   bool read_failed = false;
+  vector<int> out_ids;
+  vector<TimeStamp> mtimes;
   int unique_dep_record_count = 0;
   int total_dep_record_count = 0;
-  for (;;) {
-    offset = ftell(f);
-
-    unsigned size;
-    if (fread(&size, 4, 1, f) < 1) {
-      if (!feof(f))
-        read_failed = true;
+  while (offset < size) {
+    unsigned record_size;
+    if (size - offset < 4) {
+      read_failed = true;
+      break;
+    }
+    memcpy(&record_size, data + offset, 4);
+    bool is_deps = (record_size >> 31) != 0;
+    bool is_shared = is_deps && ((record_size >> 30) & 1) != 0;
+    record_size = record_size & 0x3FFFFFFF;
+    if (is_shared && version != kCurrentVersion) {
+      read_failed = true;
       break;
     }
-    bool is_deps = (size >> 31) != 0;
-    size = size & 0x7FFFFFFF;
 
-    if (size > kMaxRecordSize || fread(buf, size, 1, f) < 1) {
+    if (record_size > kMaxRecordSize || record_size > size - offset - 4) {
       read_failed = true;
       break;
     }
+    const char* buf = data + offset + 4;
+    const char* end = buf + record_size;
+
+    if (is_deps && compressed) {
+      uint64_t deps_count;
+      const char* p = buf;
+      if (!ReadDepsOutputs(&p, end, is_shared, nodes_.size(), &out_ids,
+                           &mtimes)) {
+        read_failed = true;
+        break;
+      }
+      // Each id takes a byte at least.
+      if (!ReadVarint(&p, end, &deps_count) ||
+          deps_count > (uint64_t)(end - p)) {
+        read_failed = true;
+        break;
+      }
+      int* ids = reinterpret_cast<int*>(
+          AllocateDecoded(deps_count * sizeof(int)));
+      int64_t id = out_ids[0];
+      for (uint64_t i = 0; i < deps_count && !read_failed; ++i) {
+        uint64_t delta;
+        if (!ReadVarint(&p, end, &delta)) {
+          read_failed = true;
+          break;
+        }
+        id += UnZigZag(delta);
+        if (id < 0 || id >= (int64_t)nodes_.size())
+          read_failed = true;
+        ids[i] = (int)id;
+      }
+      if (read_failed || p != end) {
+        read_failed = true;
+        break;
+      }
 
-    if (is_deps) {
-      assert(size % 4 == 0);
-      int* deps_data = reinterpret_cast<int*>(buf);
+      // The outputs of a shared record share the decoded ids.
+      for (size_t i = 0; i < out_ids.size(); ++i) {
+        total_dep_record_count++;
+        if (!UpdateDeps(out_ids[i], mtimes[i], (int)deps_count, ids, false))
+          ++unique_dep_record_count;
+      }
+    } else if (is_deps) {
+      // Records are padded to 4 bytes, so the mapped ids are aligned.
+      assert(record_size % 4 == 0);
+      if (record_size < 3 * 4) {
+        read_failed = true;
+        break;
+      }
+      const int* deps_data = reinterpret_cast<const int*>(buf);
       int out_id = deps_data[0];
       TimeStamp mtime;
       mtime = (TimeStamp)(((uint64_t)(unsigned int)deps_data[2] << 32) |
                           (uint64_t)(unsigned int)deps_data[1]);
       deps_data += 3;
-      int deps_count = (size / 4) - 3;
+      int deps_count = (record_size / 4) - 3;
 
-      Deps* deps = new Deps(mtime, deps_count);
-      for (int i = 0; i < deps_count; ++i) {
+#ifndef NDEBUG
+      for (int i = 0; i < deps_count; ++i)
         assert(deps_data[i] < (int)nodes_.size());
-        assert(nodes_[deps_data[i]]);
-        deps->nodes[i] = nodes_[deps_data[i]];
-      }
+#endif
 
       total_dep_record_count++;
-      if (!UpdateDeps(out_id, deps))
+      if (!UpdateDeps(out_id, mtime, deps_count, deps_data, false))
         ++unique_dep_record_count;
     } else {
-      int path_size = size - 4;
-      assert(path_size > 0);  // CanonicalizePath() rejects empty paths.
-      // There can be up to 3 bytes of padding.
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      StringPiece subpath(buf, path_size);
-      // It is not necessary to pass in a correct slash_bits here. It will
-      // either be a Node that's in the manifest (in which case it will already
-      // have a correct slash_bits that GetNode will look up), or it is an
-      // implicit dependency from a .d which does not affect the build command
-      // (and so need not have its slashes maintained).
-      Node* node = state->GetNode(subpath, 0);
+      if (record_size < 4) {
+        read_failed = true;
+        break;
+      }
+      StringPiece subpath;
+      if (compressed) {
+        uint64_t prefix;
+        const char* p = buf;
+        if (!ReadVarint(&p, end - 4, &prefix) ||
+            prefix > last_path_.size() ||
+            prefix + (end - 4 - p) == 0) {
+          read_failed = true;
+          break;
+        }
+        size_t path_size = prefix + (end - 4 - p);
+        char* path = AllocateDecoded(path_size);
+        memcpy(path, last_path_.data(), prefix);
+        memcpy(path + prefix, p, path_size - prefix);
+        subpath = StringPiece(path, path_size);
+      } else {
+        int path_size = record_size - 4;
+        assert(path_size > 0);  // CanonicalizePath() rejects empty paths.
+        // There can be up to 3 bytes of padding.
+        if (buf[path_size - 1] == '\0') --path_size;
+        if (buf[path_size - 1] == '\0') --path_size;
+        if (buf[path_size - 1] == '\0') --path_size;
+        subpath = StringPiece(buf, path_size);
+      }
 
       // Check that the expected index matches the actual index. This can only
       // happen if two ninja processes write to the same deps log concurrently.
       // (This uses unary complement to make the checksum look less like a
       // dependency record entry.)
-      unsigned checksum = *reinterpret_cast<unsigned*>(buf + size - 4);
+      unsigned checksum;
+      memcpy(&checksum, buf + record_size - 4, 4);
       int expected_id = ~checksum;
       int id = nodes_.size();
       if (id != expected_id) {
@@ -267,22 +607,23 @@ LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
         break;
       }
 
-      assert(node->id() < 0);
-      node->set_id(id);
-      nodes_.push_back(node);
+      // The node is created when a lookup first needs it.
+      nodes_.push_back(NULL);
+      paths_.push_back(subpath);
+      path_ids_[subpath] = id;
+      last_path_.assign(subpath.str_, subpath.len_);
     }
+    offset += 4 + record_size;
+  }
+  if (version != kCurrentVersion) {
+    needs_recompaction_ = true;
+    needs_upgrade_ = true;
   }
 
   if (read_failed) {
     // An error occurred while loading; try to recover by truncating the
-    // file to the last fully-read record.
-    if (ferror(f)) {
-      *err = strerror(ferror(f));
-    } else {
-      *err = "premature end of file";
-    }
-    fclose(f);
-
+    // file to the last fully-read record.  Nothing loaded points past it.
+    *err = "premature end of file";
     if (!Truncate(path, offset, err))
       return LOAD_ERROR;
 
@@ -292,8 +633,6 @@ LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
     return LOAD_SUCCESS;
   }
 
-  fclose(f);
-
   // Rebuild the log if there are too many dead records.
   int kMinCompactionEntryCount = 1000;
   int kCompactionRatio = 3;
@@ -305,16 +644,98 @@ LoadStatus DepsLog::Load(const string& path, State* state, string* err) {
   return LOAD_SUCCESS;
 }
 
+char* DepsLog::AllocateDecoded(size_t size) {
+  const size_t kBlockSize = 1 << 20;
+  size = (size + sizeof(int) - 1) & ~(sizeof(int) - 1);
+  if (size > decoded_left_) {
+    size_t block_size = max(size, kBlockSize);
+    char* block = static_cast<char*>(malloc(block_size));
+    if (!block)
+      Fatal("out of memory");
+    decoded_blocks_.push_back(block);
+    decoded_left_ = block_size;
+  }
+  // Blocks are filled from the back, so the last one is the one with room.
+  decoded_left_ -= size;
+  return decoded_blocks_.back() + decoded_left_;
+}
+
+void DepsLog::FreeDecoded() {
+  for (size_t i = 0; i < decoded_blocks_.size(); ++i)
+    free(decoded_blocks_[i]);
+  decoded_blocks_.clear();
+  decoded_left_ = 0;
+}
+
 DepsLog::Deps* DepsLog::GetDeps(Node* node) {
   // Abort if the node has no id (never referenced in the deps) or if
   // there's no deps recorded for the node.
-  if (node->id() < 0 || node->id() >= (int)deps_.size())
+  if ((node->id() < 0 && !FindId(node)) || node->id() >= (int)deps_.size())
     return NULL;
   return deps_[node->id()];
 }
 
+const vector<Node*>& DepsLog::nodes() {
+  for (size_t id = 0; id < nodes_.size(); ++id)
+    GetNode(id);
+  return nodes_;
+}
+
+bool DepsLog::FindId(Node* node) {
+  ExternalStringHashMap<int>::Type::iterator i = path_ids_.find(node->path());
+  if (i == path_ids_.end())
+    return false;
+  int id = i->second;
+  path_ids_.erase(i);
+  assert(!nodes_[id]);
+  node->set_id(id);
+  nodes_[id] = node;
+  return true;
+}
+
+Node* DepsLog::CreateNode(int id) {
+  // It is not necessary to pass in a correct slash_bits here. It will
+  // either be a Node that's in the manifest (in which case it will already
+  // have a correct slash_bits that GetNode will look up), or it is an
+  // implicit dependency from a .d which does not affect the build command
+  // (and so need not have its slashes maintained).
+  Node* node = state_->GetNode(paths_[id], 0);
+  path_ids_.erase(paths_[id]);
+  assert(node->id() < 0);
+  node->set_id(id);
+  nodes_[id] = node;
+  return node;
+}
+
+int DepsLog::Merge(DepsLog* other, State* state, const PathRemaps& remaps) {
+  int merged = 0;
+  const vector<Node*>& nodes = other->nodes();
+  vector<Node*> deps_nodes;
+  for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end();
+       ++n) {
+    Deps* theirs = other->GetDeps(*n);
+    if (!theirs)
+      continue;
+    Node* node = state->GetNode(RemapPath((*n)->path(), remaps),
+                                (*n)->slash_bits());
+    Deps* ours = GetDeps(node);
+    if (ours && ours->mtime >= theirs->mtime)
+      continue;
+    deps_nodes.clear();
+    for (int i = 0; i < theirs->node_count; ++i) {
+      Node* dep = theirs->nodes[i];
+      deps_nodes.push_back(state->GetNode(RemapPath(dep->path(), remaps),
+                                          dep->slash_bits()));
+    }
+    if (!RecordDeps(node, theirs->mtime, deps_nodes))
+      return -1;
+    ++merged;
+  }
+  return merged;
+}
+
 bool DepsLog::Recompact(const string& path, string* err) {
-  METRIC_RECORD(".ninja_deps recompact");
+  METRIC_RECORD_PHASE(".ninja_deps recompact");
 
   Close();
   string temp_path = path + ".recompact";
@@ -329,10 +750,13 @@ bool DepsLog::Recompact(const string& path, string* err) {
 
   // Clear all known ids so that new ones can be reassigned.  The new indices
   // will refer to the ordering in new_log, not in the current log.
+  nodes();
   for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
     (*i)->set_id(-1);
 
-  // Write out all deps again.
+  // Gather the outputs that share their ids, to share their record again.
+  vector<vector<int> > records;
+  map<pair<const int*, int>, size_t> record_ids;
   for (int old_id = 0; old_id < (int)deps_.size(); ++old_id) {
     Deps* deps = deps_[old_id];
     if (!deps) continue;  // If nodes_[old_id] is a leaf, it has no deps.
@@ -340,8 +764,33 @@ bool DepsLog::Recompact(const string& path, string* err) {
     if (!IsDepsEntryLiveFor(nodes_[old_id]))
       continue;
 
-    if (!new_log.RecordDeps(nodes_[old_id], deps->mtime,
-                            deps->node_count, deps->nodes)) {
+    pair<map<pair<const int*, int>, size_t>::iterator, bool> shared =
+        record_ids.insert(make_pair(make_pair(deps->nodes.ids_,
+                                              deps->node_count),
+                                    records.size()));
+    if (shared.second)
+      records.push_back(vector<int>());
+    records[shared.first->second].push_back(old_id);
+  }
+
+  // Write out all deps again.
+  vector<Node*> outputs;
+  vector<TimeStamp> mtimes;
+  vector<Node*> nodes;
+  for (vector<vector<int> >::iterator r = records.begin(); r != records.end();
+       ++r) {
+    outputs.clear();
+    mtimes.clear();
+    for (vector<int>::iterator id = r->begin(); id != r->end(); ++id) {
+      outputs.push_back(nodes_[*id]);
+      mtimes.push_back(deps_[*id]->mtime);
+    }
+    Deps* deps = deps_[r->front()];
+    nodes.resize(deps->node_count);
+    for (int i = 0; i < deps->node_count; ++i)
+      nodes[i] = deps->nodes[i];
+    if (!new_log.RecordDeps(outputs.size(), &outputs[0], &mtimes[0],
+                            nodes.size(), nodes.empty() ? NULL : &nodes[0])) {
       new_log.Close();
       return false;
     }
@@ -349,9 +798,22 @@ bool DepsLog::Recompact(const string& path, string* err) {
 
   new_log.Close();
 
-  // All nodes now have ids that refer to new_log, so steal its data.
+  // All nodes now have ids that refer to new_log, so steal its data.  Its
+  // deps own their ids; ours may point into the old file.
   deps_.swap(new_log.deps_);
+  owned_ids_.swap(new_log.owned_ids_);
+  deps_storage_.swap(new_log.deps_storage_);
   nodes_.swap(new_log.nodes_);
+  for (vector<Deps*>::iterator i = deps_.begin(); i != deps_.end(); ++i) {
+    if (*i)
+      (*i)->nodes.log_ = this;
+  }
+  last_path_.swap(new_log.last_path_);
+  // Nothing refers to the old file any more.
+  paths_.clear();
+  mapped_.Unmap();
+  FreeDecoded();
+  needs_upgrade_ = false;
 
   if (unlink(path.c_str()) < 0) {
     *err = strerror(errno);
@@ -373,43 +835,41 @@ bool DepsLog::IsDepsEntryLiveFor(Node* node) {
   // entries are no longer needed.
   // (Without the check for "deps", a chain of two or more nodes that each
   // had deps wouldn't be collected in a single recompaction.)
-  return node->in_edge() && !node->in_edge()->GetBinding("deps").empty();
+  return node->in_edge() && !node->in_edge()->GetBinding(kVarDeps).empty();
 }
 
-bool DepsLog::UpdateDeps(int out_id, Deps* deps) {
-  if (out_id >= (int)deps_.size())
+bool DepsLog::UpdateDeps(int out_id, TimeStamp mtime, int node_count,
+                         const int* ids, bool owned) {
+  if (out_id >= (int)deps_.size()) {
     deps_.resize(out_id + 1);
+    owned_ids_.resize(out_id + 1);
+  }
 
-  bool delete_old = deps_[out_id] != NULL;
-  if (delete_old)
-    delete deps_[out_id];
-  deps_[out_id] = deps;
-  return delete_old;
+  Deps* deps = deps_[out_id];
+  bool replace_old = deps != NULL;
+  if (!replace_old) {
+    deps_storage_.push_back(Deps());
+    deps = deps_[out_id] = &deps_storage_.back();
+  } else if (owned_ids_[out_id]) {
+    ReleaseIds(deps->nodes.ids_);
+  }
+  if (owned)
+    RetainIds(ids);
+  deps->mtime = mtime;
+  deps->node_count = node_count;
+  deps->nodes.ids_ = ids;
+  deps->nodes.log_ = this;
+  owned_ids_[out_id] = owned;
+  return replace_old;
 }
 
 bool DepsLog::RecordId(Node* node) {
-  int path_size = node->path().size();
-  int padding = (4 - path_size % 4) % 4;  // Pad path to 4 byte boundary.
-
-  unsigned size = path_size + padding + 4;
-  if (size > kMaxRecordSize) {
-    errno = ERANGE;
-    return false;
-  }
-  if (fwrite(&size, 4, 1, file_) < 1)
-    return false;
-  if (fwrite(node->path().data(), path_size, 1, file_) < 1) {
-    assert(node->path().size() > 0);
-    return false;
-  }
-  if (padding && fwrite("\0\0", padding, 1, file_) < 1)
-    return false;
   int id = nodes_.size();
-  unsigned checksum = ~(unsigned)id;
-  if (fwrite(&checksum, 4, 1, file_) < 1)
-    return false;
-  if (fflush(file_) != 0)
+  string record;
+  if (!WritePathRecord(&record, node->path(), last_path_, id) ||
+      !writer_.Append(record))
     return false;
+  last_path_ = node->path();
 
   node->set_id(id);
   nodes_.push_back(node);
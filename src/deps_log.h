@@ -15,14 +15,20 @@
 #ifndef NINJA_DEPS_LOG_H_
 #define NINJA_DEPS_LOG_H_
 
+#include <deque>
 #include <string>
 #include <vector>
 using namespace std;
 
 #include <stdio.h>
 
+#include "hash_map.h"
 #include "load_status.h"
+#include "log_recompaction.h"
+#include "log_writer.h"
+#include "string_piece.h"
 #include "timestamp.h"
+#include "util.h"
 
 struct Node;
 struct State;
@@ -53,44 +59,89 @@ struct State;
 /// Concretely, a record is:
 ///    four bytes record length, high bit indicates record type
 ///      (but max record sizes are capped at 512kB)
-///    path records contain the string name of the path, followed by up to 3
-///      padding bytes to align on 4 byte boundaries, followed by the
-///      one's complement of the expected index of the record (to detect
-///      concurrent writes of multiple ninja processes to the log).
-///    dependency records are an array of 4-byte integers
-///      [output path id,
+///    path records contain a varint of how many leading bytes the path
+///      shares with the path of the record before, then the rest of the
+///      path, then the one's complement of the expected index of the
+///      record as four bytes (to detect concurrent writes of multiple
+///      ninja processes to the log).
+///    dependency records contain
+///      [output path id as a varint,
 ///       output path mtime (lower 4 bytes), output path mtime (upper 4 bytes),
-///       input path id, input path id...]
+///       input count as a varint,
+///       for each input, its id less the one before (the output's for the
+///       first), zigzag encoded as a varint]
 ///      (The mtime is compared against the on-disk output path mtime
 ///      to verify the stored data is up-to-date.)
+///    shared dependency records, which have both high bits set, are for
+///      the outputs of one edge, which have the same inputs:
+///      [output count as a varint,
+///       for each output, its id less the one before (0 for the first),
+///       zigzag encoded as a varint, and its mtime as above,
+///       input count and inputs as above, relative to the first output]
+/// A build's paths mostly share long directory prefixes with the path
+/// recorded before them, and its inputs have ids close to each other, so
+/// this is a fraction of the size of version 4, which stored whole paths
+/// padded to 4 bytes and 4 byte ids.  Version 4 logs are still read, and
+/// rewritten in the current format when they're opened for writing, as are
+/// version 5 logs, which had no shared records.
 /// If two records reference the same output the latter one in the file
 /// wins, allowing updates to just be appended to the file.  A separate
 /// repacking step can run occasionally to remove dead records.
+///
+/// Loading maps the file into memory.  The loaded paths and deps are
+/// decoded into blocks the log keeps (a version 4 log's deps refer to the
+/// ids in the mapped records instead).  The outputs of a shared record get
+/// Deps of their own, for their mtimes, that point to the same ids.  Nodes are only created for the
+/// paths in the log once a lookup reaches them.
 struct DepsLog {
-  DepsLog() : needs_recompaction_(false), file_(NULL) {}
+  DepsLog()
+      : needs_recompaction_(false), needs_upgrade_(false), state_(NULL),
+        decoded_left_(0) {}
   ~DepsLog();
 
   // Writing (build-time) interface.
   bool OpenForWrite(const string& path, string* err);
   bool RecordDeps(Node* node, TimeStamp mtime, const vector<Node*>& nodes);
   bool RecordDeps(Node* node, TimeStamp mtime, int node_count, Node** nodes);
+  /// Record |nodes| as the deps of each of the |output_count| |outputs|,
+  /// whose mtimes are |mtimes|, in one record that they share.
+  bool RecordDeps(int output_count, Node** outputs, const TimeStamp* mtimes,
+                  int node_count, Node** nodes);
+  /// Stop writing, and finish the recompaction OpenForWrite() started.
   void Close();
 
   // Reading (startup-time) interface.
   struct Deps {
-    Deps(int64_t mtime, int node_count)
-        : mtime(mtime), node_count(node_count), nodes(new Node*[node_count]) {}
-    ~Deps() { delete [] nodes; }
+    /// The input nodes, stored as ids that are looked up on access.
+    struct Nodes {
+      Node* operator[](int i) const { return log_->GetNode(ids_[i]); }
+      const int* ids_;
+      DepsLog* log_;
+    };
+
     TimeStamp mtime;
     int node_count;
-    Node** nodes;
+    Nodes nodes;
   };
   LoadStatus Load(const string& path, State* state, string* err);
   Deps* GetDeps(Node* node);
 
+  /// Returns the node with id |id|, adding it to the state if no lookup
+  /// has needed it yet.
+  Node* GetNode(int id) {
+    Node* node = nodes_[id];
+    return node ? node : CreateNode(id);
+  }
+
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const string& path, string* err);
 
+  /// Take the deps of |other| for the nodes that, with |remaps| applied to
+  /// their paths and those of their deps, have none here or older ones,
+  /// creating the nodes in |state|.  Returns the number of nodes whose
+  /// deps were taken, or -1 on error writing.
+  int Merge(DepsLog* other, State* state, const PathRemaps& remaps);
+
   /// Returns if the deps entry for a node is still reachable from the manifest.
   ///
   /// The deps log can contain deps entries for files that were built in the
@@ -99,26 +150,67 @@ struct DepsLog {
   /// it from code that runs on every build.
   bool IsDepsEntryLiveFor(Node* node);
 
-  /// Used for tests.
-  const vector<Node*>& nodes() const { return nodes_; }
+  /// Used for tests and -t deps.  Creates the nodes for all paths in
+  /// the log.
+  const vector<Node*>& nodes();
   const vector<Deps*>& deps() const { return deps_; }
 
  private:
-  // Updates the in-memory representation.  Takes ownership of |deps|.
-  // Returns true if a prior deps record was deleted.
-  bool UpdateDeps(int out_id, Deps* deps);
+  // Updates the in-memory representation to give |out_id| the |node_count|
+  // inputs in |ids|, which must outlive the log, or be allocated with
+  // NewIds() if |owned|.  Returns true if a prior deps record was replaced.
+  bool UpdateDeps(int out_id, TimeStamp mtime, int node_count, const int* ids,
+                  bool owned);
   // Write a node name record, assigning it an id.
   bool RecordId(Node* node);
+  // Give |node| the id of its path in the loaded log, if it is there.
+  // Returns whether it was found.
+  bool FindId(Node* node);
+  Node* CreateNode(int id);
+  // Start rewriting the log without its dead records in the background.
+  // Close() finishes it.
+  bool StartRecompaction(const string& path, string* err);
+  // Room for |size| bytes of decoded data, aligned for ints.
+  char* AllocateDecoded(size_t size);
+  void FreeDecoded();
 
   bool needs_recompaction_;
-  FILE* file_;
-
-  /// Maps id -> Node.
+  /// Whether the loaded log is in an older version, which isn't appended
+  /// to.
+  bool needs_upgrade_;
+  /// Appends to the log OpenForWrite() opened.
+  LogWriter writer_;
+
+  /// The loaded log, which Deps loaded from it point into.
+  MappedFile mapped_;
+  /// The recompaction started by OpenForWrite(), if any.
+  LogRecompaction recompaction_;
+
+  /// The state nodes from the loaded log are added to.
+  State* state_;
+  /// Maps id -> Node, or NULL if the node hasn't been created yet.
   vector<Node*> nodes_;
+  /// Maps id -> path, for the path records in the loaded log.
+  vector<StringPiece> paths_;
+  /// The path of the last path record in the log, which the next one is
+  /// written relative to.
+  string last_path_;
+  /// The paths and ids decoded from the loaded log, in large blocks, and
+  /// how much of the last block is free.
+  vector<char*> decoded_blocks_;
+  size_t decoded_left_;
+  /// Maps path -> id, for the paths whose nodes haven't been created yet.
+  ExternalStringHashMap<int>::Type path_ids_;
   /// Maps id -> deps of that id.
   vector<Deps*> deps_;
+  /// Maps id -> whether the ids of its deps were allocated by RecordDeps(),
+  /// which counts the Deps sharing them.
+  vector<bool> owned_ids_;
+  /// The Deps that deps_ points to, allocated in blocks.
+  deque<Deps> deps_storage_;
 
   friend struct DepsLogTest;
+  friend struct MemoryStats;
 };
 
 #endif  // NINJA_DEPS_LOG_H_
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #endif
 
+#include "disk_interface.h"
 #include "graph.h"
 #include "util.h"
 #include "test.h"
@@ -26,14 +27,17 @@
 namespace {
 
 const char kTestFilename[] = "DepsLogTest-tempfile";
+const char kTestFilename2[] = "DepsLogTest-tempfile2";
 
 struct DepsLogTest : public testing::Test {
   virtual void SetUp() {
     // In case a crashing test left a stale file behind.
     unlink(kTestFilename);
+    unlink(kTestFilename2);
   }
   virtual void TearDown() {
     unlink(kTestFilename);
+    unlink(kTestFilename2);
   }
 };
 
@@ -87,6 +91,156 @@ TEST_F(DepsLogTest, WriteRead) {
   ASSERT_EQ("bar2.h", log_deps->nodes[1]->path());
 }
 
+TEST_F(DepsLogTest, Merge) {
+  State state1;
+  DepsLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  vector<Node*> deps;
+  deps.push_back(state1.GetNode("foo.h", 0));
+  log1.RecordDeps(state1.GetNode("out.o", 0), 10, deps);
+  log1.RecordDeps(state1.GetNode("old.o", 0), 10, deps);
+
+  // The other log is written to a file of its own and loaded back, as
+  // -t mergelogs would find it.
+  {
+    State state;
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename2, &err));
+    ASSERT_EQ("", err);
+    deps.clear();
+    deps.push_back(state.GetNode("/shard/bar.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 20, deps);
+    log.RecordDeps(state.GetNode("old.o", 0), 5, deps);
+    log.RecordDeps(state.GetNode("/shard/new.o", 0), 5, deps);
+    log.Close();
+  }
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename2, &state2, &err));
+  ASSERT_EQ("", err);
+
+  PathRemaps remaps;
+  remaps.push_back(make_pair("/shard", "src"));
+  EXPECT_EQ(2, log1.Merge(&log2, &state1, remaps));
+  log1.Close();
+
+  State state3;
+  DepsLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &state3, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* out = log3.GetDeps(state3.GetNode("out.o", 0));
+  ASSERT_TRUE(out);
+  EXPECT_EQ(20, out->mtime);
+  ASSERT_EQ(1, out->node_count);
+  EXPECT_EQ("src/bar.h", out->nodes[0]->path());
+  DepsLog::Deps* old = log3.GetDeps(state3.GetNode("old.o", 0));
+  ASSERT_TRUE(old);
+  EXPECT_EQ(10, old->mtime);
+  EXPECT_EQ("foo.h", old->nodes[0]->path());
+  EXPECT_TRUE(log3.GetDeps(state3.GetNode("src/new.o", 0)));
+}
+
+// The outputs of an edge share one record of their deps, and their Deps
+// share the ids, through loading and recompaction.
+TEST_F(DepsLogTest, Shared) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.h out.cc out.o: cc\n";
+
+  vector<string> deps_paths;
+  for (int i = 0; i < 100; ++i) {
+    char buf[64];
+    sprintf(buf, "some/long/include/directory/header%d.h", i);
+    deps_paths.push_back(buf);
+  }
+  const char* kOutputs[] = { "out.h", "out.cc", "out.o" };
+  int shared_size = 0, unshared_size = 0;
+  for (int shared = 0; shared < 2; ++shared) {
+    unlink(kTestFilename);
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    for (size_t i = 0; i < deps_paths.size(); ++i)
+      deps.push_back(state.GetNode(deps_paths[i], 0));
+    Node* outputs[3];
+    TimeStamp mtimes[3];
+    for (int i = 0; i < 3; ++i) {
+      outputs[i] = state.GetNode(kOutputs[i], 0);
+      mtimes[i] = i + 1;
+    }
+    if (shared) {
+      ASSERT_TRUE(log.RecordDeps(3, outputs, mtimes, deps.size(), &deps[0]));
+    } else {
+      for (int i = 0; i < 3; ++i)
+        ASSERT_TRUE(log.RecordDeps(outputs[i], mtimes[i], deps));
+    }
+    log.Close();
+
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestFilename, &st));
+    (shared ? shared_size : unshared_size) = (int)st.st_size;
+  }
+  // Each input takes a byte, in one record instead of three.
+  EXPECT_LT(shared_size + 200, unshared_size);
+
+  for (int pass = 0; pass < 2; ++pass) {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    DepsLog::Deps* deps[3];
+    for (int i = 0; i < 3; ++i) {
+      deps[i] = log.GetDeps(state.GetNode(kOutputs[i], 0));
+      ASSERT_TRUE(deps[i]);
+      EXPECT_EQ(i + 1, deps[i]->mtime);
+      ASSERT_EQ(100, deps[i]->node_count);
+      EXPECT_EQ(deps_paths[99], deps[i]->nodes[99]->path());
+      EXPECT_EQ(deps[0]->nodes.ids_, deps[i]->nodes.ids_);
+    }
+
+    // Recompaction keeps them shared.
+    if (pass == 0) {
+      ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+      EXPECT_EQ(deps[0]->nodes.ids_, deps[2]->nodes.ids_);
+      log.Close();
+      struct stat st;
+      ASSERT_EQ(0, stat(kTestFilename, &st));
+      EXPECT_EQ(shared_size, (int)st.st_size);
+    }
+  }
+
+  // Replacing the deps of one output leaves the others theirs.
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps(1, state.GetNode("other.h", 0));
+    ASSERT_TRUE(log.RecordDeps(state.GetNode("out.cc", 0), 4, deps));
+    log.Close();
+    EXPECT_EQ(100, log.GetDeps(state.GetNode("out.o", 0))->node_count);
+  }
+  State state;
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1, log.GetDeps(state.GetNode("out.cc", 0))->node_count);
+  EXPECT_EQ(100, log.GetDeps(state.GetNode("out.h", 0))->node_count);
+  EXPECT_EQ(100, log.GetDeps(state.GetNode("out.o", 0))->node_count);
+}
+
 TEST_F(DepsLogTest, LotsOfDeps) {
   const int kNumDeps = 100000;  // More than 64k.
 
@@ -166,6 +320,100 @@ TEST_F(DepsLogTest, DoubleEntry) {
   }
 }
 
+// Verify that deps loaded from the file can be replaced by new ones.
+TEST_F(DepsLogTest, ReplaceLoaded) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("other.o", 0), 1, deps);
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  vector<Node*> deps;
+  deps.push_back(state.GetNode("bar.h", 0));
+  deps.push_back(state.GetNode("baz.h", 0));
+  deps.push_back(state.GetNode("foo.h", 0));
+  log.RecordDeps(state.GetNode("out.o", 0), 2, deps);
+  log.Close();
+
+  DepsLog::Deps* log_deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(2, log_deps->mtime);
+  ASSERT_EQ(3, log_deps->node_count);
+  ASSERT_EQ("bar.h", log_deps->nodes[0]->path());
+  ASSERT_EQ("baz.h", log_deps->nodes[1]->path());
+  ASSERT_EQ("foo.h", log_deps->nodes[2]->path());
+
+  // The other loaded deps are unaffected.
+  log_deps = log.GetDeps(state.GetNode("other.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(2, log_deps->node_count);
+  ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
+  ASSERT_EQ("bar.h", log_deps->nodes[1]->path());
+}
+
+// Verify that nodes are only created for the paths in the log on demand.
+TEST_F(DepsLogTest, LazyNodes) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    deps.clear();
+    deps.push_back(state.GetNode("baz.h", 0));
+    log.RecordDeps(state.GetNode("other.o", 0), 1, deps);
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(state.LookupNode("out.o") == NULL);
+  EXPECT_TRUE(state.LookupNode("foo.h") == NULL);
+
+  Node* out = state.GetNode("out.o", 0);
+  DepsLog::Deps* log_deps = log.GetDeps(out);
+  ASSERT_TRUE(log_deps);
+  EXPECT_EQ(0, out->id());
+  EXPECT_TRUE(state.LookupNode("foo.h") == NULL);
+  ASSERT_EQ(2, log_deps->node_count);
+  EXPECT_EQ("foo.h", log_deps->nodes[0]->path());
+  EXPECT_EQ("bar.h", log_deps->nodes[1]->path());
+  EXPECT_TRUE(state.LookupNode("foo.h") != NULL);
+  EXPECT_TRUE(state.LookupNode("other.o") == NULL);
+  EXPECT_TRUE(state.LookupNode("baz.h") == NULL);
+
+  EXPECT_TRUE(log.GetDeps(state.GetNode("missing.o", 0)) == NULL);
+
+  // Asking for all nodes creates the rest.
+  EXPECT_EQ(5u, log.nodes().size());
+  EXPECT_TRUE(state.LookupNode("baz.h") != NULL);
+}
+
 // Verify that adding the new deps works and can be compacted away.
 TEST_F(DepsLogTest, Recompact) {
   const char kManifest[] =
@@ -322,6 +570,76 @@ TEST_F(DepsLogTest, Recompact) {
   }
 }
 
+// Verify that a recompaction started by OpenForWrite() keeps the deps
+// recorded while it runs.
+TEST_F(DepsLogTest, BackgroundRecompact) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n";
+
+  // Write enough dead records to trigger a recompaction.
+  int file_size;
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    for (int i = 0; i < 2000; ++i)
+      log.RecordDeps(state.GetNode("out.o", 0), i, deps);
+    log.RecordDeps(state.GetNode("dead.o", 0), 1, deps);
+    log.Close();
+
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestFilename, &st));
+    file_size = (int)st.st_size;
+  }
+
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("other_out.o", 0), 5, deps);
+    log.Close();
+
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestFilename, &st));
+    ASSERT_LT((int)st.st_size, file_size / 10);
+  }
+
+  State state;
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(1999, deps->mtime);
+  ASSERT_EQ(1, deps->node_count);
+  ASSERT_EQ("foo.h", deps->nodes[0]->path());
+  deps = log.GetDeps(state.GetNode("other_out.o", 0));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(5, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  ASSERT_EQ("foo.h", deps->nodes[0]->path());
+  ASSERT_EQ("bar.h", deps->nodes[1]->path());
+  ASSERT_FALSE(log.GetDeps(state.GetNode("dead.o", 0)));
+}
+
 // Verify that invalid file headers cause a new build.
 TEST_F(DepsLogTest, InvalidHeader) {
   const char *kInvalidHeaders[] = {
@@ -348,6 +666,105 @@ TEST_F(DepsLogTest, InvalidHeader) {
   }
 }
 
+// Paths sharing a directory and nearby ids take a few bytes each.
+TEST_F(DepsLogTest, Compressed) {
+  State state;
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  vector<Node*> deps;
+  for (int i = 0; i < 100; ++i) {
+    char buf[64];
+    sprintf(buf, "some/long/include/directory/header%d.h", i);
+    deps.push_back(state.GetNode(buf, 0));
+  }
+  ASSERT_TRUE(log.RecordDeps(state.GetNode("out.o", 0), 1, deps));
+  log.Close();
+
+  // Without sharing, the paths alone would take 3700 bytes.
+  struct stat st;
+  ASSERT_EQ(0, stat(kTestFilename, &st));
+  EXPECT_LT(st.st_size, 1500);
+
+  DepsLog log2;
+  State state2;
+  ASSERT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* log_deps = log2.GetDeps(state2.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(100, log_deps->node_count);
+  EXPECT_EQ("some/long/include/directory/header0.h",
+            log_deps->nodes[0]->path());
+  EXPECT_EQ("some/long/include/directory/header99.h",
+            log_deps->nodes[99]->path());
+}
+
+// A version 4 log loads, and is rewritten in the current version when it
+// is opened for writing.
+TEST_F(DepsLogTest, UpgradeFromVersion4) {
+  string contents("# ninjadeps\n");
+  int version = 4;
+  contents.append((const char*)&version, 4);
+  const char* paths[] = { "out.o", "foo.h", "bar.h" };
+  for (int id = 0; id < 3; ++id) {
+    string path = paths[id];
+    path.resize((path.size() + 3) & ~3, '\0');
+    unsigned size = path.size() + 4;
+    unsigned checksum = ~(unsigned)id;
+    contents.append((const char*)&size, 4);
+    contents.append(path);
+    contents.append((const char*)&checksum, 4);
+  }
+  unsigned record[] = { 0x80000000 | 5 * 4, 0, 7, 0, 1, 2 };
+  contents.append((const char*)record, sizeof(record));
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f != NULL);
+  ASSERT_EQ(1u, fwrite(contents.data(), contents.size(), 1, f));
+  ASSERT_EQ(0, fclose(f));
+
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state,
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build out.o: cc\n"));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o", 0));
+    ASSERT_TRUE(deps);
+    EXPECT_EQ(7, deps->mtime);
+    ASSERT_EQ(2, deps->node_count);
+    EXPECT_EQ("bar.h", deps->nodes[1]->path());
+
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    vector<Node*> nodes;
+    nodes.push_back(state.GetNode("baz.h", 0));
+    ASSERT_TRUE(log.RecordDeps(state.GetNode("out.o", 0), 8, nodes));
+    log.Close();
+  }
+
+  string err;
+  contents.clear();
+  ASSERT_EQ(DiskInterface::Okay,
+            RealDiskInterface().ReadFile(kTestFilename, &contents, &err));
+  memcpy(&version, contents.data() + 12, 4);
+  EXPECT_EQ(6, version);
+
+  State state;
+  DepsLog log;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(8, deps->mtime);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("baz.h", deps->nodes[0]->path());
+}
+
 // Simulate what happens when loading a truncated log file.
 TEST_F(DepsLogTest, Truncated) {
   // Create a file with some entries.
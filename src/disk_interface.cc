@@ -17,6 +17,7 @@
 #include <algorithm>
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -26,29 +27,28 @@
 #include <sstream>
 #include <windows.h>
 #include <direct.h>  // _mkdir
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
 #endif
 
 #include "metrics.h"
+#include "parallel.h"
 #include "util.h"
 
 namespace {
 
-string DirName(const string& path) {
+/// The files of a directory and their mtimes, as StatAllFilesInDir() lists
+/// them.
+typedef vector<pair<string, TimeStamp> > DirListing;
+
 #ifdef _WIN32
-  static const char kPathSeparators[] = "\\/";
+const char kPathSeparators[] = "\\/";
 #else
-  static const char kPathSeparators[] = "/";
+const char kPathSeparators[] = "/";
 #endif
-  static const char* const kEnd = kPathSeparators + sizeof(kPathSeparators) - 1;
-
-  string::size_type slash_pos = path.find_last_of(kPathSeparators);
-  if (slash_pos == string::npos)
-    return string();  // Nothing to do.
-  while (slash_pos > 0 &&
-         std::find(kPathSeparators, kEnd, path[slash_pos - 1]) != kEnd)
-    --slash_pos;
-  return path.substr(0, slash_pos);
-}
 
 int MakeDir(const string& path) {
 #ifdef _WIN32
@@ -70,6 +70,7 @@ TimeStamp TimeStampFromFileTime(const FILETIME& filetime) {
 }
 
 TimeStamp StatSingleFile(const string& path, string* err) {
+  METRIC_COUNT("stat calls", 1);
   WIN32_FILE_ATTRIBUTE_DATA attrs;
   if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attrs)) {
     DWORD win_err = GetLastError();
@@ -91,44 +92,244 @@ bool IsWindows7OrLater() {
       &version_info, VER_MAJORVERSION | VER_MINORVERSION, comparison);
 }
 
-bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
+/// Convert |path| from the code page the -A functions use.
+bool ToWide(const string& path, wstring* wide) {
+  wide->clear();
+  if (path.empty())
+    return true;
+  int len = MultiByteToWideChar(CP_ACP, 0, path.data(), (int)path.size(),
+                                NULL, 0);
+  if (len == 0)
+    return false;
+  wide->resize(len);
+  return MultiByteToWideChar(CP_ACP, 0, path.data(), (int)path.size(),
+                             &(*wide)[0], len) == len;
+}
+
+bool StatAllFilesInDir(const string& dir, DirListing* stamps,
                        string* err) {
-  // FindExInfoBasic is 30% faster than FindExInfoStandard.
-  static bool can_use_basic_info = IsWindows7OrLater();
-  // This is not in earlier SDKs.
+  METRIC_COUNT("stat dirs listed", 1);
+  // FindExInfoBasic is 30% faster than FindExInfoStandard, and a large
+  // fetch gets more entries per call; neither is there before Windows 7.
+  static bool is_windows7 = IsWindows7OrLater();
+  // These are not in earlier SDKs.
   const FINDEX_INFO_LEVELS kFindExInfoBasic =
       static_cast<FINDEX_INFO_LEVELS>(1);
-  FINDEX_INFO_LEVELS level =
-      can_use_basic_info ? kFindExInfoBasic : FindExInfoStandard;
-  WIN32_FIND_DATAA ffd;
-  HANDLE find_handle = FindFirstFileExA((dir + "\\*").c_str(), level, &ffd,
-                                        FindExSearchNameMatch, NULL, 0);
+  const DWORD kFindFirstExLargeFetch = 2;
+  FINDEX_INFO_LEVELS level = is_windows7 ? kFindExInfoBasic
+                                         : FindExInfoStandard;
+  DWORD flags = is_windows7 ? kFindFirstExLargeFetch : 0;
+
+  wstring pattern;
+  if (!ToWide(dir + "\\*", &pattern)) {
+    *err = "MultiByteToWideChar(" + dir + "): " + GetLastErrorString();
+    return false;
+  }
+  // A pattern past MAX_PATH only works as an extended-length path, which
+  // must be absolute and use backslashes.
+  if (pattern.size() >= MAX_PATH && pattern.size() > 2 &&
+      pattern[1] == L':' && (pattern[2] == L'\\' || pattern[2] == L'/')) {
+    replace(pattern.begin(), pattern.end(), L'/', L'\\');
+    pattern.insert(0, L"\\\\?\\");
+  }
 
+  WIN32_FIND_DATAW ffd;
+  HANDLE find_handle = FindFirstFileExW(pattern.c_str(), level, &ffd,
+                                        FindExSearchNameMatch, NULL, flags);
   if (find_handle == INVALID_HANDLE_VALUE) {
     DWORD win_err = GetLastError();
     if (win_err == ERROR_FILE_NOT_FOUND || win_err == ERROR_PATH_NOT_FOUND)
       return true;
-    *err = "FindFirstFileExA(" + dir + "): " + GetLastErrorString();
+    *err = "FindFirstFileExW(" + dir + "): " + GetLastErrorString();
     return false;
   }
+  char name[MAX_PATH * 4];
   do {
-    string lowername = ffd.cFileName;
-    if (lowername == "..") {
+    if (wcscmp(ffd.cFileName, L"..") == 0) {
       // Seems to just copy the timestamp for ".." from ".", which is wrong.
       // This is the case at least on NTFS under Windows 7.
       continue;
     }
+    int len = WideCharToMultiByte(CP_ACP, 0, ffd.cFileName, -1, name,
+                                  sizeof(name), NULL, NULL);
+    if (len <= 1)
+      continue;  // Stat() finds the file itself.
+    string lowername(name, len - 1);
     transform(lowername.begin(), lowername.end(), lowername.begin(), ::tolower);
-    stamps->insert(make_pair(lowername,
-                             TimeStampFromFileTime(ffd.ftLastWriteTime)));
-  } while (FindNextFileA(find_handle, &ffd));
+    stamps->push_back(make_pair(lowername,
+                                TimeStampFromFileTime(ffd.ftLastWriteTime)));
+  } while (FindNextFileW(find_handle, &ffd));
   FindClose(find_handle);
   return true;
 }
+#else  // _WIN32
+TimeStamp TimeStampFromStat(const struct stat& st) {
+  // Some users (Flatpak) set mtime to 0, this should be harmless
+  // and avoids conflicting with our return value of 0 meaning
+  // that it doesn't exist.
+  if (st.st_mtime == 0)
+    return 1;
+#if defined(_AIX)
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+#elif defined(__APPLE__)
+  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
+          st.st_mtimespec.tv_nsec);
+#elif defined(st_mtime) // A macro, so we're likely on modern POSIX.
+  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
+#endif
+}
+
+TimeStamp StatSingleFile(const string& path, string* err) {
+  METRIC_COUNT("stat calls", 1);
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    *err = "stat(" + path + "): " + strerror(errno);
+    return -1;
+  }
+  return TimeStampFromStat(st);
+}
+
+bool StatAllFilesInDir(const string& dir, DirListing* stamps,
+                       string* err) {
+  METRIC_COUNT("stat dirs listed", 1);
+  DIR* dp = opendir(dir.c_str());
+  if (!dp) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return true;
+    *err = "opendir(" + dir + "): " + strerror(errno);
+    return false;
+  }
+  // Stat relative to the open directory so that the kernel does not have
+  // to look up the directory again for every file.
+  int fd = dirfd(dp);
+  bool success = true;
+  while (struct dirent* entry = readdir(dp)) {
+    METRIC_COUNT("stat calls", 1);
+    struct stat st;
+    if (fstatat(fd, entry->d_name, &st, 0) < 0) {
+      // Dangling symlinks are missing files, as they are for stat().
+      if (errno == ENOENT || errno == ENOTDIR)
+        continue;
+      *err = "stat(" + dir + "/" + entry->d_name + "): " + strerror(errno);
+      success = false;
+      break;
+    }
+    stamps->push_back(make_pair(string(entry->d_name),
+                                TimeStampFromStat(st)));
+  }
+  closedir(dp);
+  return success;
+}
 #endif  // _WIN32
 
+/// Split |path| into the directory and file name used as stat cache keys.
+/// Returns false if |path| can't be looked up in the cache.
+bool StatCacheKey(const string& path, string* dir, string* base) {
+  *dir = DirName(path);
+  *base = path.substr(dir->size() ? dir->size() + 1 : 0);
+  if (*base == "..") {
+    // StatAllFilesInDir does not report any information for base = "..".
+    *base = ".";
+    *dir = path;
+  }
+  // Paths like "/foo", "foo/" or "a//b".
+  if (base->empty() || base->find_first_of(kPathSeparators) != string::npos)
+    return false;
+#ifdef NAME_MAX
+  // Leave it to stat() to report names that are too long.
+  if (base->size() > NAME_MAX)
+    return false;
+#endif
+
+#ifdef _WIN32
+  transform(dir->begin(), dir->end(), dir->begin(), ::tolower);
+  transform(base->begin(), base->end(), base->begin(), ::tolower);
+#endif
+  return true;
+}
+
+struct BatchStatAllFilesInDir {
+  BatchStatAllFilesInDir(const vector<string>& dirs,
+                         vector<DirListing>* stamps,
+                         vector<char>* success)
+      : dirs_(dirs), stamps_(stamps), success_(success) {}
+
+  void operator()(size_t i) {
+    string err;
+    (*success_)[i] = StatAllFilesInDir(dirs_[i].empty() ? "." : dirs_[i],
+                                       &(*stamps_)[i], &err);
+  }
+
+  const vector<string>& dirs_;
+  vector<DirListing>* stamps_;
+  vector<char>* success_;
+};
+
+/// Below this many paths per thread, starting threads costs more than the
+/// stat() calls they would take over.
+const size_t kMinStatsPerThread = 64;
+
+struct BatchStat {
+  BatchStat(const vector<string>& paths, vector<TimeStamp>* mtimes)
+      : paths_(paths), mtimes_(mtimes) {}
+
+  void operator()(size_t i) {
+    string err;
+    (*mtimes_)[i] = StatSingleFile(paths_[i], &err);
+  }
+
+  const vector<string>& paths_;
+  vector<TimeStamp>* mtimes_;
+};
+
+/// Below this many paths per thread, starting threads costs more than the
+/// remove() calls they would take over.  On a network file system each
+/// call mostly waits on a round trip, so more threads than processors pay
+/// off, up to a point.
+const size_t kMinRemovesPerThread = 64;
+const int kMaxRemoveThreads = 16;
+
+struct BatchRemove {
+  BatchRemove(const vector<string>& paths, vector<int>* errnos)
+      : paths_(paths), errnos_(errnos) {}
+
+  void operator()(size_t i) {
+    (*errnos_)[i] = remove(paths_[i].c_str()) < 0 ? errno : 0;
+  }
+
+  const vector<string>& paths_;
+  vector<int>* errnos_;
+};
+
 }  // namespace
 
+// FileReader ------------------------------------------------------------------
+
+FileReader::Status FileReader::MapFile(const string& path, MappedFile* file,
+                                       string* err) {
+  string contents;
+  Status status = ReadFile(path, &contents, err);
+  if (status == Okay)
+    file->Take(&contents);
+  return status;
+}
+
+string DirName(const string& path) {
+  static const char* const kEnd = kPathSeparators + sizeof(kPathSeparators) - 1;
+
+  string::size_type slash_pos = path.find_last_of(kPathSeparators);
+  if (slash_pos == string::npos)
+    return string();  // Nothing to do.
+  while (slash_pos > 0 &&
+         std::find(kPathSeparators, kEnd, path[slash_pos - 1]) != kEnd)
+    --slash_pos;
+  return path.substr(0, slash_pos);
+}
+
 // DiskInterface ---------------------------------------------------------------
 
 bool DiskInterface::MakeDirs(const string& path) {
@@ -151,8 +352,71 @@ bool DiskInterface::MakeDirs(const string& path) {
   return MakeDir(dir);
 }
 
+void DiskInterface::StatBatch(const vector<string>& paths,
+                              vector<TimeStamp>* mtimes) const {
+  mtimes->resize(paths.size());
+  string err;
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*mtimes)[i] = Stat(paths[i], &err);
+}
+
+void DiskInterface::RemoveFileBatch(const vector<string>& paths,
+                                    vector<int>* results) {
+  results->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*results)[i] = RemoveFile(paths[i]);
+}
+
+TimeStamp DiskInterface::Now() const {
+#ifdef _WIN32
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  return TimeStampFromFileTime(now);
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t)now.tv_sec * 1000000000LL + (int64_t)now.tv_usec * 1000;
+#endif
+}
+
 // RealDiskInterface -----------------------------------------------------------
 
+void RealDiskInterface::DirCache::Fill(
+    const vector<pair<string, TimeStamp> >& listing) {
+  size_t size = 0;
+  for (DirListing::const_iterator i = listing.begin(); i != listing.end();
+       ++i) {
+    size += i->first.size();
+  }
+  // Reserve it all, so that the keys don't move.
+  names_.clear();
+  names_.reserve(size);
+  entries_.clear();
+  entries_.reserve(listing.size());
+  for (DirListing::const_iterator i = listing.begin(); i != listing.end();
+       ++i) {
+    const char* name = names_.data() + names_.size();
+    names_.append(i->first);
+    entries_.insert(make_pair(StringPiece(name, i->first.size()),
+                              i->second));
+  }
+}
+
+TimeStamp RealDiskInterface::DirCache::Find(StringPiece name) const {
+  ExternalStringHashMap<TimeStamp>::Type::const_iterator i =
+      entries_.find(name);
+  return i != entries_.end() ? i->second : 0;
+}
+
+void RealDiskInterface::DirCache::Clear() {
+  entries_.clear();
+  names_.clear();
+}
+
+RealDiskInterface::~RealDiskInterface() {
+  ClearStatCache();
+}
+
 TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
   METRIC_RECORD("node stat");
 #ifdef _WIN32
@@ -165,57 +429,126 @@ TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
     *err = err_stream.str();
     return -1;
   }
-  if (!use_cache_)
+#endif
+  string dir, base;
+  if (!use_cache_ || !StatCacheKey(path, &dir, &base))
     return StatSingleFile(path, err);
 
-  string dir = DirName(path);
-  string base(path.substr(dir.size() ? dir.size() + 1 : 0));
-  if (base == "..") {
-    // StatAllFilesInDir does not report any information for base = "..".
-    base = ".";
-    dir = path;
-  }
-
-  transform(dir.begin(), dir.end(), dir.begin(), ::tolower);
-  transform(base.begin(), base.end(), base.begin(), ::tolower);
-
+  lock_guard<mutex> lock(cache_mutex_);
   Cache::iterator ci = cache_.find(dir);
   if (ci == cache_.end()) {
-    ci = cache_.insert(make_pair(dir, DirCache())).first;
-    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &ci->second, err)) {
-      cache_.erase(ci);
+    DirCache* dir_cache = new DirCache(dir);
+    DirListing listing;
+    if (StatAllFilesInDir(dir.empty() ? "." : dir, &listing, err)) {
+      dir_cache->Fill(listing);
+    } else {
+#ifdef _WIN32
+      delete dir_cache;
       return -1;
+#else
+      // The directory may be searchable without being readable.
+      err->clear();
+      dir_cache->stale_ = true;
+#endif
     }
+    ci = cache_.insert(make_pair(StringPiece(dir_cache->dir_),
+                                 dir_cache)).first;
   }
-  DirCache::iterator di = ci->second.find(base);
-  return di != ci->second.end() ? di->second : 0;
-#else
-  struct stat st;
-  if (stat(path.c_str(), &st) < 0) {
-    if (errno == ENOENT || errno == ENOTDIR)
-      return 0;
-    *err = "stat(" + path + "): " + strerror(errno);
-    return -1;
+  DirCache* dir_cache = ci->second;
+  if (dir_cache->stale_)
+    return StatSingleFile(path, err);
+  METRIC_COUNT("stat cache hits", 1);
+  return dir_cache->Find(base);
+}
+
+void RealDiskInterface::StatBatch(const vector<string>& paths,
+                                  vector<TimeStamp>* mtimes) const {
+  METRIC_RECORD("node stat batch");
+  mtimes->resize(paths.size());
+  if (use_cache_) {
+    // Read the directories in parallel, then answer from the cache.
+    vector<string> dirs;
+    string dir, base;
+    for (vector<string>::const_iterator i = paths.begin(); i != paths.end();
+         ++i) {
+      if (StatCacheKey(*i, &dir, &base))
+        dirs.push_back(dir);
+    }
+    FillStatCache(dirs);
+    string err;
+    for (size_t i = 0; i < paths.size(); ++i)
+      (*mtimes)[i] = Stat(paths[i], &err);
+    return;
   }
-  // Some users (Flatpak) set mtime to 0, this should be harmless
-  // and avoids conflicting with our return value of 0 meaning
-  // that it doesn't exist.
-  if (st.st_mtime == 0)
-    return 1;
-#if defined(_AIX)
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
-#elif defined(__APPLE__)
-  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
-          st.st_mtimespec.tv_nsec);
-#elif defined(st_mtime) // A macro, so we're likely on modern POSIX.
-  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
-#else
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
-#endif
-#endif
+
+  int threads = GetProcessorCount();
+  if ((size_t)threads > paths.size() / kMinStatsPerThread)
+    threads = (int)(paths.size() / kMinStatsPerThread);
+  BatchStat stat_one(paths, mtimes);
+  ParallelFor(paths.size(), threads, stat_one);
+}
+
+void RealDiskInterface::FillStatCache(const vector<string>& all_dirs) const {
+  vector<string> dirs(all_dirs);
+  sort(dirs.begin(), dirs.end());
+  dirs.erase(unique(dirs.begin(), dirs.end()), dirs.end());
+  size_t missing = 0;
+  {
+    lock_guard<mutex> lock(cache_mutex_);
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      if (cache_.find(dirs[i]) == cache_.end())
+        dirs[missing++].swap(dirs[i]);
+    }
+  }
+  dirs.resize(missing);
+
+  vector<DirListing> stamps(dirs.size());
+  vector<char> success(dirs.size());
+  BatchStatAllFilesInDir stat_dir(dirs, &stamps, &success);
+  ParallelFor(dirs.size(), GetProcessorCount(), stat_dir);
+
+  lock_guard<mutex> lock(cache_mutex_);
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    // Leave directories that failed for Stat() to report or work around.
+    if (!success[i])
+      continue;
+    DirCache* dir_cache = new DirCache(dirs[i]);
+    dir_cache->Fill(stamps[i]);
+    // A directory invalidated meanwhile is already there, and stale.
+    if (!cache_.insert(make_pair(StringPiece(dir_cache->dir_),
+                                 dir_cache)).second) {
+      delete dir_cache;
+    }
+  }
+}
+
+void RealDiskInterface::InvalidateStatCache(const string& path) {
+  string dir, base;
+  if (!StatCacheKey(path, &dir, &base))
+    return;
+  lock_guard<mutex> lock(cache_mutex_);
+  Cache::iterator ci = cache_.find(dir);
+  if (ci == cache_.end()) {
+    // Don't read the directory later on; it is being written to.
+    if (!use_cache_)
+      return;
+    DirCache* dir_cache = new DirCache(dir);
+    ci = cache_.insert(make_pair(StringPiece(dir_cache->dir_),
+                                 dir_cache)).first;
+  }
+  ci->second->Clear();
+  ci->second->stale_ = true;
+}
+
+void RealDiskInterface::ClearStatCache() {
+  lock_guard<mutex> lock(cache_mutex_);
+  for (Cache::iterator i = cache_.begin(); i != cache_.end(); ++i)
+    delete i->second;
+  cache_.clear();
 }
 
 bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
+  InvalidateStatCache(path);
   FILE* fp = fopen(path.c_str(), "w");
   if (fp == NULL) {
     Error("WriteFile(%s): Unable to create file. %s",
@@ -239,7 +572,17 @@ bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
   return true;
 }
 
+bool RealDiskInterface::LinkFile(const string& from, const string& to) {
+  InvalidateStatCache(to);
+#ifdef _WIN32
+  return CreateHardLinkA(to.c_str(), from.c_str(), NULL) != 0;
+#else
+  return link(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
 bool RealDiskInterface::MakeDir(const string& path) {
+  InvalidateStatCache(path);
   if (::MakeDir(path) < 0) {
     if (errno == EEXIST) {
       return true;
@@ -260,7 +603,18 @@ FileReader::Status RealDiskInterface::ReadFile(const string& path,
   }
 }
 
+FileReader::Status RealDiskInterface::MapFile(const string& path,
+                                              MappedFile* file,
+                                              string* err) {
+  switch (file->Map(path, err, true)) {
+  case 0:       return Okay;
+  case -ENOENT: return NotFound;
+  default:      return OtherError;
+  }
+}
+
 int RealDiskInterface::RemoveFile(const string& path) {
+  InvalidateStatCache(path);
   if (remove(path.c_str()) < 0) {
     switch (errno) {
       case ENOENT:
@@ -274,10 +628,91 @@ int RealDiskInterface::RemoveFile(const string& path) {
   }
 }
 
-void RealDiskInterface::AllowStatCache(bool allow) {
+void RealDiskInterface::RemoveFileBatch(const vector<string>& paths,
+                                        vector<int>* results) {
+  METRIC_RECORD("remove batch");
+  for (size_t i = 0; i < paths.size(); ++i)
+    InvalidateStatCache(paths[i]);
+
+  int threads = min(GetProcessorCount() * 4, kMaxRemoveThreads);
+  if ((size_t)threads > paths.size() / kMinRemovesPerThread)
+    threads = (int)(paths.size() / kMinRemovesPerThread);
+  vector<int> errnos(paths.size());
+  BatchRemove remove_one(paths, &errnos);
+  ParallelFor(paths.size(), threads, remove_one);
+
+  results->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (errnos[i] == 0) {
+      (*results)[i] = 0;
+    } else if (errnos[i] == ENOENT) {
+      (*results)[i] = 1;
+    } else {
+      Error("remove(%s): %s", paths[i].c_str(), strerror(errnos[i]));
+      (*results)[i] = -1;
+    }
+  }
+}
+
+int64_t RealDiskInterface::Prefetch(const string& path, int64_t max_bytes) {
+#if defined(POSIX_FADV_WILLNEED) || defined(F_RDADVISE)
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return 0;
+  int64_t size = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      st.st_size <= max_bytes) {
+#ifdef POSIX_FADV_WILLNEED
+    if (posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED) == 0)
+      size = st.st_size;
+#else
+    struct radvisory advice;
+    advice.ra_offset = 0;
+    advice.ra_count = (int)min((int64_t)st.st_size, (int64_t)INT_MAX);
+    if (fcntl(fd, F_RDADVISE, &advice) == 0)
+      size = st.st_size;
+#endif
+  }
+  close(fd);
+  return size;
+#else
+  return 0;
+#endif
+}
+
+bool RealDiskInterface::SetMTime(const string& path, TimeStamp mtime) {
+  InvalidateStatCache(path);
 #ifdef _WIN32
+  HANDLE handle = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                  FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS,
+                              NULL);
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+  // The inverse of TimeStampFromFileTime().
+  uint64_t time = (uint64_t)(mtime + 12622770400LL * (1000000000LL / 100));
+  FILETIME filetime;
+  filetime.dwLowDateTime = (DWORD)time;
+  filetime.dwHighDateTime = (DWORD)(time >> 32);
+  bool ok = SetFileTime(handle, NULL, NULL, &filetime) != 0;
+  CloseHandle(handle);
+  return ok;
+#elif defined(UTIME_OMIT)
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = (time_t)(mtime / 1000000000LL);
+  times[1].tv_nsec = (long)(mtime % 1000000000LL);
+  return utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+#else
+  return false;
+#endif
+}
+
+void RealDiskInterface::AllowStatCache(bool allow) {
   use_cache_ = allow;
   if (!use_cache_)
-    cache_.clear();
-#endif
+    ClearStatCache();
 }
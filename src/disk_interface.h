@@ -16,11 +16,19 @@
 #define NINJA_DISK_INTERFACE_H_
 
 #include <map>
+#include <mutex>
 #include <string>
+#include <vector>
 using namespace std;
 
+#include "hash_map.h"
 #include "timestamp.h"
 
+struct MappedFile;
+
+/// The directory |path| is in, or "" if it has no directory part.
+string DirName(const string& path);
+
 /// Interface for reading files from disk.  See DiskInterface for details.
 /// This base offers the minimum interface needed just to read files.
 struct FileReader {
@@ -37,6 +45,11 @@ struct FileReader {
   /// On error, return another Status and fill |err|.
   virtual Status ReadFile(const string& path, string* contents,
                           string* err) = 0;
+
+  /// Map the file at |path| into |file|, with a nul byte after its
+  /// contents, so that callers can point into it instead of copying it.
+  /// The default reads the file with ReadFile().
+  virtual Status MapFile(const string& path, MappedFile* file, string* err);
 };
 
 /// Interface for accessing the disk.
@@ -48,6 +61,13 @@ struct DiskInterface: public FileReader {
   /// other errors.
   virtual TimeStamp Stat(const string& path, string* err) const = 0;
 
+  /// stat() many files at once, storing the result for |paths[i]| in
+  /// |(*mtimes)[i]| with the same meaning as for Stat().  Implementations
+  /// may issue the calls concurrently.  Errors are not described; callers
+  /// should Stat() a path again to get the message.
+  virtual void StatBatch(const vector<string>& paths,
+                         vector<TimeStamp>* mtimes) const;
+
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const string& path) = 0;
 
@@ -55,6 +75,13 @@ struct DiskInterface: public FileReader {
   /// Returns true on success, false on failure
   virtual bool WriteFile(const string& path, const string& contents) = 0;
 
+  /// Make |to| another name for the existing file |from|, which must not
+  /// be written in place afterwards.  Returns false, without reporting an
+  /// error, if that isn't possible; callers write the file instead.
+  virtual bool LinkFile(const string& from, const string& to) {
+    return false;
+  }
+
   /// Remove the file named @a path. It behaves like 'rm -f path' so no errors
   /// are reported if it does not exists.
   /// @returns 0 if the file has been removed,
@@ -62,6 +89,34 @@ struct DiskInterface: public FileReader {
   ///          -1 if an error occurs.
   virtual int RemoveFile(const string& path) = 0;
 
+  /// Remove many files at once, storing the result for |paths[i]| in
+  /// |(*results)[i]| with the same meaning as for RemoveFile().
+  /// Implementations may issue the calls concurrently, but report errors
+  /// in the order of |paths|.
+  virtual void RemoveFileBatch(const vector<string>& paths,
+                               vector<int>* results);
+
+  /// Forget any cached stat() information about the directory containing
+  /// |path|, because a command may have written into it.
+  virtual void InvalidateStatCache(const string& path) {}
+
+  /// Ask the system to start reading the file at |path| into its cache,
+  /// without waiting for it, if it's no larger than |max_bytes|.
+  /// @returns the number of bytes asked for, or 0 if none.
+  virtual int64_t Prefetch(const string& path, int64_t max_bytes) {
+    return 0;
+  }
+
+  /// Set the modification time of the file at |path| to |mtime|, as
+  /// returned by Stat().
+  /// @returns false if it can't be set.
+  virtual bool SetMTime(const string& path, TimeStamp mtime) {
+    return false;
+  }
+
+  /// The current time, in the units of the mtimes Stat() returns.
+  virtual TimeStamp Now() const;
+
   /// Create all the parent directories for path; like mkdir -p
   /// `basename path`.
   bool MakeDirs(const string& path);
@@ -69,32 +124,62 @@ struct DiskInterface: public FileReader {
 
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
-  RealDiskInterface()
-#ifdef _WIN32
-                      : use_cache_(false)
-#endif
-                      {}
-  virtual ~RealDiskInterface() {}
+  RealDiskInterface() : use_cache_(false) {}
+  virtual ~RealDiskInterface();
   virtual TimeStamp Stat(const string& path, string* err) const;
+  virtual void StatBatch(const vector<string>& paths,
+                         vector<TimeStamp>* mtimes) const;
   virtual bool MakeDir(const string& path);
   virtual bool WriteFile(const string& path, const string& contents);
+  virtual bool LinkFile(const string& from, const string& to);
   virtual Status ReadFile(const string& path, string* contents, string* err);
+  virtual Status MapFile(const string& path, MappedFile* file, string* err);
   virtual int RemoveFile(const string& path);
-
-  /// Whether stat information can be cached.  Only has an effect on Windows.
+  virtual void RemoveFileBatch(const vector<string>& paths,
+                               vector<int>* results);
+  virtual void InvalidateStatCache(const string& path);
+  virtual int64_t Prefetch(const string& path, int64_t max_bytes);
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+
+  /// Whether stat information can be cached.  When allowed, the first
+  /// Stat() of a file in a directory reads the mtimes of all the files in
+  /// that directory at once.
   void AllowStatCache(bool allow);
 
  private:
-#ifdef _WIN32
   /// Whether stat information can be cached.
   bool use_cache_;
 
-  typedef map<string, TimeStamp> DirCache;
-  // TODO: Neither a map nor a hashmap seems ideal here.  If the statcache
-  // works out, come up with a better data structure.
-  typedef map<string, DirCache> Cache;
+  /// The mtimes of the files in one directory.
+  struct DirCache {
+    explicit DirCache(const string& dir) : dir_(dir), stale_(false) {}
+
+    /// Index |listing|, the files in the directory and their mtimes.
+    void Fill(const vector<pair<string, TimeStamp> >& listing);
+    /// The mtime of the file |name|, or 0 if there is none.
+    TimeStamp Find(StringPiece name) const;
+    void Clear();
+
+    /// The directory's path, which the key of Cache points into.
+    string dir_;
+    /// The file names, one after another, which the keys of |entries_|
+    /// point into.
+    string names_;
+    ExternalStringHashMap<TimeStamp>::Type entries_;
+    /// Set once the directory may have changed since |entries_| was read,
+    /// or could not be read.  Its files are then stat()ed one by one.
+    bool stale_;
+  };
+  typedef ExternalStringHashMap<DirCache*>::Type Cache;
   mutable Cache cache_;
-#endif
+  /// Guards |cache_|, which the Builder's I/O thread invalidates (see
+  /// BuildConfig::io_thread) while the build loop reads it.
+  mutable mutex cache_mutex_;
+
+  /// Read the entries of all the listed directories that are not cached
+  /// yet, several at a time.
+  void FillStatCache(const vector<string>& dirs) const;
+  void ClearStatCache();
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
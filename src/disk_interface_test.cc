@@ -17,11 +17,14 @@
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #include "disk_interface.h"
 #include "graph.h"
 #include "test.h"
+#include "util.h"
 
 namespace {
 
@@ -104,6 +107,76 @@ TEST_F(DiskInterfaceTest, StatExistingDir) {
             disk_.Stat("subdir/subsubdir/.", &err));
 }
 
+TEST_F(DiskInterfaceTest, StatBatch) {
+  string err;
+  vector<string> paths;
+  // Enough paths to be spread over several threads on a multicore machine.
+  for (int i = 0; i < 1000; ++i) {
+    char name[32];
+    sprintf(name, "file%d", i);
+    if (i % 2 == 0)
+      ASSERT_TRUE(Touch(name));
+    paths.push_back(name);
+  }
+  paths.push_back(string(512, 'x'));
+
+  vector<TimeStamp> mtimes;
+  disk_.StatBatch(paths, &mtimes);
+  ASSERT_EQ(paths.size(), mtimes.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    EXPECT_EQ(disk_.Stat(paths[i], &err), mtimes[i]);
+#ifndef _WIN32
+  EXPECT_EQ(-1, mtimes.back());
+#endif
+
+  // The same with the stat cache, which lists the directory instead.
+  disk_.AllowStatCache(true);
+  vector<TimeStamp> cached_mtimes;
+  disk_.StatBatch(paths, &cached_mtimes);
+  EXPECT_EQ(mtimes, cached_mtimes);
+}
+
+#ifndef _WIN32
+TEST_F(DiskInterfaceTest, StatCachePosix) {
+  string err;
+
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(Touch("subdir/subfile1"));
+  ASSERT_TRUE(symlink("nosuchfile", "dangling") == 0);
+
+  disk_.AllowStatCache(false);
+  TimeStamp file1_uncached = disk_.Stat("file1", &err);
+  TimeStamp subdir_uncached = disk_.Stat("subdir", &err);
+  disk_.AllowStatCache(true);
+
+  EXPECT_EQ(file1_uncached, disk_.Stat("file1", &err));
+  EXPECT_EQ("", err);
+  // Unlike on Windows, the cache is case sensitive.
+  EXPECT_EQ(0, disk_.Stat("FILE1", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("dangling", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(subdir_uncached, disk_.Stat("subdir", &err));
+  EXPECT_EQ(subdir_uncached, disk_.Stat("subdir/.", &err));
+  EXPECT_EQ(subdir_uncached, disk_.Stat("subdir//.", &err));
+  EXPECT_GT(disk_.Stat("subdir/subfile1", &err), 1);
+  EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile", &err));
+  EXPECT_EQ(0, disk_.Stat("file1/nosuchfile", &err));
+  EXPECT_EQ("", err);
+
+  // A file created behind the cache's back is not seen until the directory
+  // is invalidated; one created through the interface is.
+  ASSERT_TRUE(Touch("subdir/subfile2"));
+  EXPECT_EQ(0, disk_.Stat("subdir/subfile2", &err));
+  disk_.InvalidateStatCache("subdir/subfile2");
+  EXPECT_GT(disk_.Stat("subdir/subfile2", &err), 1);
+  ASSERT_TRUE(disk_.WriteFile("file2", ""));
+  EXPECT_GT(disk_.Stat("file2", &err), 1);
+  EXPECT_EQ("", err);
+}
+#endif
+
 #ifdef _WIN32
 TEST_F(DiskInterfaceTest, StatCache) {
   string err;
@@ -188,6 +261,27 @@ TEST_F(DiskInterfaceTest, ReadFile) {
   EXPECT_EQ("", err);
 }
 
+TEST_F(DiskInterfaceTest, MapFile) {
+  string err;
+  MappedFile file;
+  ASSERT_EQ(DiskInterface::NotFound, disk_.MapFile("foobar", &file, &err));
+  EXPECT_NE("", err);
+  err.clear();
+
+  // Contents that fill pages exactly, and so have no zeros after them in a
+  // mapping, as well as ones that don't.
+  const size_t kSizes[] = { 0, 15, 4096, 8192 };
+  for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+    string contents(kSizes[i], 'x');
+    ASSERT_TRUE(disk_.WriteFile("testfile", contents));
+    ASSERT_EQ(DiskInterface::Okay, disk_.MapFile("testfile", &file, &err));
+    EXPECT_EQ("", err);
+    ASSERT_EQ(contents.size(), file.size());
+    EXPECT_EQ(contents, string(file.data(), file.size()));
+    EXPECT_EQ('\0', file.data()[file.size()]);
+  }
+}
+
 TEST_F(DiskInterfaceTest, MakeDirs) {
   string path = "path/with/double//slash/";
   EXPECT_TRUE(disk_.MakeDirs(path.c_str()));
@@ -211,6 +305,56 @@ TEST_F(DiskInterfaceTest, RemoveFile) {
   EXPECT_EQ(1, disk_.RemoveFile("does not exist"));
 }
 
+#if defined(__linux__)
+TEST_F(DiskInterfaceTest, Prefetch) {
+  ASSERT_TRUE(disk_.WriteFile("file", "0123456789"));
+  EXPECT_EQ(10, disk_.Prefetch("file", 10));
+  // Too large for what's left, or nothing to read.
+  EXPECT_EQ(0, disk_.Prefetch("file", 9));
+  EXPECT_EQ(0, disk_.Prefetch("does not exist", 100));
+  EXPECT_EQ(0, disk_.Prefetch(".", 100));
+}
+#endif
+
+TEST_F(DiskInterfaceTest, SetMTime) {
+  string err;
+  ASSERT_TRUE(Touch("file"));
+  TimeStamp mtime = disk_.Stat("file", &err);
+  ASSERT_GT(mtime, 0);
+
+  // Also when the stat cache saw the file first.
+  disk_.AllowStatCache(true);
+  EXPECT_EQ(mtime, disk_.Stat("file", &err));
+  ASSERT_TRUE(disk_.SetMTime("file", mtime - 1000000000));
+  EXPECT_EQ(mtime - 1000000000, disk_.Stat("file", &err));
+  EXPECT_FALSE(disk_.SetMTime("does not exist", mtime));
+}
+
+TEST_F(DiskInterfaceTest, RemoveFileBatch) {
+  string err;
+  vector<string> paths;
+  // Enough paths to be spread over several threads.
+  for (int i = 0; i < 1000; ++i) {
+    char name[32];
+    sprintf(name, "file%d", i);
+    if (i % 2 == 0)
+      ASSERT_TRUE(Touch(name));
+    paths.push_back(name);
+  }
+
+  // Removing a file drops it from the stat cache too.
+  disk_.AllowStatCache(true);
+  EXPECT_GT(disk_.Stat("file0", &err), 0);
+
+  vector<int> results;
+  disk_.RemoveFileBatch(paths, &results);
+  ASSERT_EQ(paths.size(), results.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    EXPECT_EQ((i % 2 == 0 ? 0 : 1), results[i]);
+    EXPECT_EQ(0, disk_.Stat(paths[i], &err));
+  }
+}
+
 struct StatTest : public StateTestWithBuiltinRules,
                   public DiskInterface {
   StatTest() : scan_(&state_, NULL, NULL, this, NULL) {}
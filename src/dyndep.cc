@@ -15,15 +15,223 @@
 #include "dyndep.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "debug_flags.h"
 #include "disk_interface.h"
 #include "dyndep_parser.h"
 #include "graph.h"
+#include "parallel.h"
 #include "state.h"
 #include "util.h"
 
+namespace {
+
+const char kFileSignature[] = "# ninjadyndep\n";
+const uint32_t kCurrentVersion = 1;
+
+/// The most files DyndepCache::Prefetch() reads at the same time.
+const int kMaxReadThreads = 16;
+
+/// Reads the files of a DyndepCache::Prefetch(), each into its own slot.
+struct BatchRead {
+  BatchRead(const std::vector<std::string>& paths,
+            DiskInterface* disk_interface,
+            std::vector<std::string>* contents, std::vector<char>* read)
+      : paths_(paths), disk_interface_(disk_interface), contents_(contents),
+        read_(read) {}
+
+  void operator()(size_t i) {
+    std::string err;
+    (*read_)[i] = disk_interface_->ReadFile(paths_[i], &(*contents_)[i],
+                                            &err) == FileReader::Okay;
+  }
+
+  const std::vector<std::string>& paths_;
+  DiskInterface* disk_interface_;
+  std::vector<std::string>* contents_;
+  std::vector<char>* read_;
+};
+
+/// Hands a DyndepParser the contents a DyndepCache has for its file.
+struct CachedFileReader : public FileReader {
+  explicit CachedFileReader(const std::string& contents)
+      : contents_(contents) {}
+
+  virtual Status ReadFile(const std::string& path, std::string* contents,
+                          std::string* err) {
+    *contents = contents_;
+    return Okay;
+  }
+
+  const std::string& contents_;
+};
+
+}  // anonymous namespace
+
+LoadStatus DyndepCache::Load(const std::string& path, std::string* err) {
+  path_ = path;
+  entries_.clear();
+  changed_ = false;
+
+  std::string data;
+  if (::ReadFile(path, &data, err) < 0) {
+    if (errno == ENOENT) {
+      err->clear();
+      return LOAD_NOT_FOUND;
+    }
+    return LOAD_ERROR;
+  }
+
+  // Records are the path length, the contents length, the mtime, then the
+  // path and the contents.
+  const size_t kSignatureSize = sizeof(kFileSignature) - 1;
+  const size_t kRecordHeaderSize = 4 + 4 + 8;
+  uint32_t version = 0;
+  if (data.size() >= kSignatureSize + 4)
+    memcpy(&version, data.data() + kSignatureSize, 4);
+  if (data.size() < kSignatureSize + 4 ||
+      memcmp(data.data(), kFileSignature, kSignatureSize) != 0 ||
+      version != kCurrentVersion) {
+    *err = "bad dyndep cache signature or version; starting over";
+    changed_ = true;
+    return LOAD_SUCCESS;
+  }
+
+  size_t offset = kSignatureSize + 4;
+  while (offset < data.size()) {
+    uint32_t path_size, contents_size;
+    int64_t mtime;
+    if (data.size() - offset < kRecordHeaderSize) {
+      *err = "truncated dyndep cache; dropping the end of it";
+      changed_ = true;
+      break;
+    }
+    memcpy(&path_size, data.data() + offset, 4);
+    memcpy(&contents_size, data.data() + offset + 4, 4);
+    memcpy(&mtime, data.data() + offset + 8, 8);
+    offset += kRecordHeaderSize;
+    if (data.size() - offset < (size_t)path_size + contents_size) {
+      *err = "truncated dyndep cache; dropping the end of it";
+      changed_ = true;
+      break;
+    }
+    Entry& entry = entries_[data.substr(offset, path_size)];
+    entry.mtime = mtime;
+    entry.contents.assign(data, offset + path_size, contents_size);
+    offset += path_size + contents_size;
+  }
+  return LOAD_SUCCESS;
+}
+
+bool DyndepCache::Write(std::string* err) {
+  if (path_.empty() || !changed_)
+    return true;
+
+  std::string temp_path = path_ + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) == 1 &&
+      fwrite(&kCurrentVersion, 4, 1, f) == 1;
+  for (std::map<std::string, Entry>::const_iterator i = entries_.begin();
+       ok && i != entries_.end(); ++i) {
+    if (i->second.mtime <= 0)
+      continue;
+    uint32_t path_size = i->first.size();
+    uint32_t contents_size = i->second.contents.size();
+    int64_t mtime = i->second.mtime;
+    ok = fwrite(&path_size, 4, 1, f) == 1 &&
+        fwrite(&contents_size, 4, 1, f) == 1 &&
+        fwrite(&mtime, 8, 1, f) == 1 &&
+        fwrite(i->first.data(), 1, path_size, f) == path_size &&
+        fwrite(i->second.contents.data(), 1, contents_size, f) ==
+            contents_size;
+  }
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // On Windows, rename() doesn't replace an existing file.
+  if (unlink(path_.c_str()) < 0 && errno != ENOENT) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (rename(temp_path.c_str(), path_.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  changed_ = false;
+  return true;
+}
+
+void DyndepCache::Prefetch(const std::vector<std::string>& paths,
+                           const std::vector<TimeStamp>& mtimes,
+                           DiskInterface* disk_interface) {
+  std::vector<std::string> stale_paths;
+  std::vector<TimeStamp> stale_mtimes;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (mtimes[i] <= 0)
+      continue;
+    std::map<std::string, Entry>::const_iterator e = entries_.find(paths[i]);
+    if (e == entries_.end() || e->second.mtime != mtimes[i]) {
+      stale_paths.push_back(paths[i]);
+      stale_mtimes.push_back(mtimes[i]);
+    }
+  }
+  if (stale_paths.empty())
+    return;
+
+  std::vector<std::string> contents(stale_paths.size());
+  std::vector<char> read(stale_paths.size());
+  BatchRead batch(stale_paths, disk_interface, &contents, &read);
+  ParallelFor(stale_paths.size(), kMaxReadThreads, batch);
+
+  // Leave the files that failed for Read() to report.
+  for (size_t i = 0; i < stale_paths.size(); ++i) {
+    if (!read[i])
+      continue;
+    Entry& entry = entries_[stale_paths[i]];
+    entry.mtime = stale_mtimes[i];
+    entry.contents.swap(contents[i]);
+    changed_ = true;
+  }
+}
+
+FileReader::Status DyndepCache::Read(const Node* file,
+                                     DiskInterface* disk_interface,
+                                     const std::string** contents,
+                                     std::string* err) {
+  Entry& entry = entries_[file->path()];
+  if (file->mtime() <= 0 || entry.mtime != file->mtime()) {
+    std::string fresh;
+    FileReader::Status status =
+        disk_interface->ReadFile(file->path(), &fresh, err);
+    if (status != FileReader::Okay) {
+      entries_.erase(file->path());
+      return status;
+    }
+    // A file whose mtime isn't known can't be looked up by it later.
+    entry.mtime = file->mtime() > 0 ? file->mtime() : 0;
+    entry.contents.swap(fresh);
+    changed_ = true;
+  }
+  *contents = &entry.contents;
+  return FileReader::Okay;
+}
+
 bool DyndepLoader::LoadDyndeps(Node* node, std::string* err) const {
   DyndepFile ddf;
   return LoadDyndeps(node, &ddf, err);
@@ -40,8 +248,8 @@ bool DyndepLoader::LoadDyndeps(Node* node, DyndepFile* ddf,
     return false;
 
   // Update each edge that specified this node as its dyndep binding.
-  std::vector<Edge*> const& out_edges = node->out_edges();
-  for (std::vector<Edge*>::const_iterator oe = out_edges.begin();
+  SmallVector<Edge*, 2> const& out_edges = node->out_edges();
+  for (Edge* const* oe = out_edges.begin();
        oe != out_edges.end(); ++oe) {
     Edge* const edge = *oe;
     if (edge->dyndep_ != node)
@@ -84,6 +292,7 @@ bool DyndepLoader::UpdateEdge(Edge* edge, Dyndeps const* dyndeps,
   // scope because it has a "dyndep" binding.
   if (dyndeps->restat_)
     edge->env_->AddBinding("restat", "1");
+  edge->ClearBindingCache();
 
   // Add the dyndep-discovered outputs to the edge.
   edge->outputs_.insert(edge->outputs_.end(),
@@ -119,6 +328,19 @@ bool DyndepLoader::UpdateEdge(Edge* edge, Dyndeps const* dyndeps,
 
 bool DyndepLoader::LoadDyndepFile(Node* file, DyndepFile* ddf,
                                   std::string* err) const {
-  DyndepParser parser(state_, disk_interface_, ddf);
+  if (!cache_) {
+    DyndepParser parser(state_, disk_interface_, ddf);
+    return parser.Load(file->path(), err);
+  }
+
+  const std::string* contents;
+  std::string read_err;
+  if (cache_->Read(file, disk_interface_, &contents, &read_err) !=
+      FileReader::Okay) {
+    *err = "loading '" + file->path() + "': " + read_err;
+    return false;
+  }
+  CachedFileReader reader(*contents);
+  DyndepParser parser(state_, &reader, ddf);
   return parser.Load(file->path(), err);
 }
@@ -19,7 +19,10 @@
 #include <string>
 #include <vector>
 
-struct DiskInterface;
+#include "disk_interface.h"
+#include "load_status.h"
+#include "timestamp.h"
+
 struct Edge;
 struct Node;
 struct State;
@@ -39,11 +42,49 @@ struct Dyndeps {
 /// forward-declare it in other headers.
 struct DyndepFile: public std::map<Edge*, Dyndeps> {};
 
+/// Keeps the contents of the dyndep files one run reads for the next,
+/// with their mtimes, so that the files that haven't changed since aren't
+/// read again.
+struct DyndepCache {
+  DyndepCache() : changed_(false) {}
+
+  /// Load the cache an earlier run wrote to |path|, where Write() writes it
+  /// back.  A damaged cache is dropped, with a warning in |err|.
+  LoadStatus Load(const std::string& path, std::string* err);
+
+  /// Write the cache back, if anything in it changed since Load().
+  bool Write(std::string* err);
+
+  /// Read the files at |paths| whose mtimes, in |mtimes|, don't match the
+  /// cached ones, several at a time.  Missing files are skipped.
+  void Prefetch(const std::vector<std::string>& paths,
+                const std::vector<TimeStamp>& mtimes,
+                DiskInterface* disk_interface);
+
+  /// Point |contents| at the contents of |file|: those cached if the
+  /// mtime of |file| matches, or else those read through |disk_interface|.
+  FileReader::Status Read(const Node* file, DiskInterface* disk_interface,
+                          const std::string** contents, std::string* err);
+
+ private:
+  struct Entry {
+    Entry() : mtime(0) {}
+    /// The mtime the file had when read, or 0 if it isn't to be trusted.
+    TimeStamp mtime;
+    std::string contents;
+  };
+
+  std::string path_;
+  std::map<std::string, Entry> entries_;
+  bool changed_;
+};
+
 /// DyndepLoader loads dynamically discovered dependencies, as
 /// referenced via the "dyndep" attribute in build files.
 struct DyndepLoader {
-  DyndepLoader(State* state, DiskInterface* disk_interface)
-      : state_(state), disk_interface_(disk_interface) {}
+  DyndepLoader(State* state, DiskInterface* disk_interface,
+               DyndepCache* cache = NULL)
+      : state_(state), disk_interface_(disk_interface), cache_(cache) {}
 
   /// Load a dyndep file from the given node's path and update the
   /// build graph with the new information.  One overload accepts
@@ -52,6 +93,9 @@ struct DyndepLoader {
   bool LoadDyndeps(Node* node, std::string* err) const;
   bool LoadDyndeps(Node* node, DyndepFile* ddf, std::string* err) const;
 
+  /// The cache the dyndep files are read through, or NULL.
+  DyndepCache* cache() const { return cache_; }
+
  private:
   bool LoadDyndepFile(Node* file, DyndepFile* ddf, std::string* err) const;
 
@@ -59,6 +103,7 @@ struct DyndepLoader {
 
   State* state_;
   DiskInterface* disk_interface_;
+  DyndepCache* cache_;
 };
 
 #endif  // NINJA_DYNDEP_LOADER_H_
@@ -28,7 +28,7 @@ DyndepParser::DyndepParser(State* state, FileReader* file_reader,
     , dyndep_file_(dyndep_file) {
 }
 
-bool DyndepParser::Parse(const string& filename, const string& input,
+bool DyndepParser::Parse(const string& filename, StringPiece input,
                          string* err) {
   lexer_.Start(filename, input);
 
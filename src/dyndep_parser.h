@@ -33,7 +33,7 @@ struct DyndepParser: public Parser {
 
 private:
   /// Parse a file, given its contents as a string.
-  bool Parse(const string& filename, const string& input, string* err);
+  bool Parse(const string& filename, StringPiece input, string* err);
 
   bool ParseDyndepVersion(string* err);
   bool ParseLet(string* key, EvalString* val, string* err);
@@ -14,6 +14,8 @@
 
 #include "edit_distance.h"
 
+#include <stdlib.h>
+
 #include <algorithm>
 #include <vector>
 
@@ -33,19 +35,36 @@ int EditDistance(const StringPiece& s1,
   // only the entries to the left, top, and top-left are needed.  The left
   // entry is in row[x-1], the top entry is what's in row[x] from the last
   // iteration, and the top-left entry is stored in previous.
+  //
+  // With a |max_edit_distance|, only the entries within that distance of
+  // the diagonal can stay under it, so each row is only computed in that
+  // band, and strings whose lengths differ by more are rejected outright.
+  // This is what keeps checking a typo against every path in a large graph
+  // cheap.
   int m = s1.len_;
   int n = s2.len_;
 
+  if (max_edit_distance && abs(m - n) > max_edit_distance)
+    return max_edit_distance + 1;
+
   vector<int> row(n + 1);
   for (int i = 1; i <= n; ++i)
     row[i] = i;
 
   for (int y = 1; y <= m; ++y) {
-    row[0] = y;
-    int best_this_row = row[0];
+    int first = 1;
+    int last = n;
+    if (max_edit_distance) {
+      first = max(1, y - max_edit_distance);
+      last = min(n, y + max_edit_distance);
+    }
+    // Left of the band is out of reach.  (Right of it, row still holds
+    // its initial values, which are out of reach as well.)
+    int previous = row[first - 1];
+    row[first - 1] = first == 1 ? y : max_edit_distance + 1;
+    int best_this_row = row[first - 1];
 
-    int previous = y - 1;
-    for (int x = 1; x <= n; ++x) {
+    for (int x = first; x <= last; ++x) {
       int old_row = row[x];
       if (allow_replacements) {
         row[x] = min(previous + (s1.str_[y - 1] == s2.str_[x - 1] ? 0 : 1),
@@ -65,5 +84,7 @@ int EditDistance(const StringPiece& s1,
       return max_edit_distance + 1;
   }
 
+  if (max_edit_distance && row[n] > max_edit_distance)
+    return max_edit_distance + 1;
   return row[n];
 }
@@ -14,6 +14,8 @@
 
 #include "edit_distance.h"
 
+#include <algorithm>
+
 #include "test.h"
 
 TEST(EditDistanceTest, TestEmpty) {
@@ -46,3 +48,24 @@ TEST(EditDistanceTest, TestBasics) {
   EXPECT_EQ(1, EditDistance("browser_test", "browser_tests"));
   EXPECT_EQ(1, EditDistance("browser_tests", "browser_test"));
 }
+
+TEST(EditDistanceTest, TestMaxDistanceBand) {
+  // With a limit, distances within it come out the same as without one.
+  const char* const kWords[] = {
+    "", "a", "ab", "ninja", "njnja", "ninjas", "jninja", "build.ninja",
+    "out/foo.o", "out/fo.o", "out/food.o", "obj/foo.o", "tuo/foo.o",
+  };
+  const int kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+  for (int i = 0; i < kNumWords; ++i) {
+    for (int j = 0; j < kNumWords; ++j) {
+      for (int replace = 0; replace < 2; ++replace) {
+        int distance = EditDistance(kWords[i], kWords[j], replace != 0);
+        for (int max_distance = 1; max_distance < 5; ++max_distance) {
+          EXPECT_EQ(min(distance, max_distance + 1),
+                    EditDistance(kWords[i], kWords[j], replace != 0,
+                                 max_distance));
+        }
+      }
+    }
+  }
+}
@@ -1,32 +1,122 @@
-// Copyright 2011 Google Inc. All Rights Reserved.
-//
-// Licensed under the Apache License, Version 2.0 (the "License");
-// you may not use this file except in compliance with the License.
-// You may obtain a copy of the License at
-//
-//     http://www.apache.org/licenses/LICENSE-2.0
-//
-// Unless required by applicable law or agreed to in writing, software
-// distributed under the License is distributed on an "AS IS" BASIS,
-// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-// See the License for the specific language governing permissions and
-// limitations under the License.
-
 #include <assert.h>
 
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
 #include "eval_env.h"
+#include "hash_map.h"
+#include "metrics.h"
+
+namespace {
+
+/// The names of the variables with fixed ids, in the order of their ids.
+const char* const kFixedVariables[] = {
+  "in", "in_newline", "out",
+  "batch", "cache", "command", "depfile", "dyndep", "description", "deps",
+  "generator", "hash_inputs", "memory", "pool", "priority", "restat",
+  "rspfile", "rspfile_content", "shell", "worker", "msvc_deps_prefix",
+};
+
+/// The variable names interned so far.  Manifests are parsed on several
+/// threads, so access is locked.
+struct VariableNames {
+  VariableNames() {
+    for (size_t i = 0;
+         i < sizeof(kFixedVariables) / sizeof(kFixedVariables[0]); ++i)
+      Intern(kFixedVariables[i]);
+  }
+
+  VarId Intern(StringPiece name) {
+    lock_guard<mutex> lock(mutex_);
+    ExternalStringHashMap<VarId>::Type::iterator i = ids_.find(name);
+    if (i != ids_.end())
+      return i->second;
+    VarId id = (VarId)names_.size();
+    names_.push_back(name.AsString());
+    ids_.insert(make_pair(StringPiece(names_.back()), id));
+    return id;
+  }
+
+  VarId Find(StringPiece name) {
+    lock_guard<mutex> lock(mutex_);
+    ExternalStringHashMap<VarId>::Type::iterator i = ids_.find(name);
+    return i == ids_.end() ? kNoVar : i->second;
+  }
+
+  const string& Name(VarId id) {
+    lock_guard<mutex> lock(mutex_);
+    assert(id < names_.size());
+    return names_[id];
+  }
+
+  mutex mutex_;
+  /// Keys point into |names_|, whose elements never move.
+  ExternalStringHashMap<VarId>::Type ids_;
+  deque<string> names_;
+};
+
+VariableNames& Names() {
+  static VariableNames names;
+  return names;
+}
+
+/// Orders a flat table of bindings by id.
+template<typename Binding>
+bool BindingBefore(const Binding& binding, VarId id) {
+  return binding.first < id;
+}
+
+}  // anonymous namespace
+
+VarId InternVariable(StringPiece name) {
+  return Names().Intern(name);
+}
+
+VarId FindVariable(StringPiece name) {
+  return Names().Find(name);
+}
+
+const string& VariableName(VarId id) {
+  return Names().Name(id);
+}
+
+const string* BindingEnv::Find(VarId var) const {
+  Bindings::const_iterator i = lower_bound(
+      bindings_.begin(), bindings_.end(), var,
+      BindingBefore<Bindings::value_type>);
+  if (i == bindings_.end() || i->first != var)
+    return NULL;
+  return &i->second;
+}
 
 string BindingEnv::LookupVariable(const string& var) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
-    return i->second;
-  if (parent_)
-    return parent_->LookupVariable(var);
+  VarId id = FindVariable(var);
+  if (id == kNoVar)
+    return "";
+  return LookupVariableById(id);
+}
+
+string BindingEnv::LookupVariableById(VarId var) {
+  for (const BindingEnv* env = this; env; env = env->parent_) {
+    if (const string* value = env->Find(var))
+      return *value;
+  }
   return "";
 }
 
 void BindingEnv::AddBinding(const string& key, const string& val) {
-  bindings_[key] = val;
+  AddBinding(InternVariable(key), val);
+}
+
+void BindingEnv::AddBinding(VarId key, const string& val) {
+  Bindings::iterator i = lower_bound(
+      bindings_.begin(), bindings_.end(), key,
+      BindingBefore<Bindings::value_type>);
+  if (i != bindings_.end() && i->first == key)
+    i->second = val;
+  else
+    bindings_.insert(i, make_pair(key, val));
 }
 
 void BindingEnv::AddRule(const Rule* rule) {
@@ -51,82 +141,162 @@ const Rule* BindingEnv::LookupRule(const string& rule_name) {
 }
 
 void Rule::AddBinding(const string& key, const EvalString& val) {
-  bindings_[key] = val;
+  // Rules outlive the manifest text their bindings were parsed from.
+  EvalString& binding = Binding(InternVariable(key));
+  binding = val;
+  binding.Detach();
+}
+
+EvalString& Rule::Binding(VarId key) {
+  Bindings::iterator i = lower_bound(
+      bindings_.begin(), bindings_.end(), key,
+      BindingBefore<Bindings::value_type>);
+  if (i == bindings_.end() || i->first != key)
+    i = bindings_.insert(i, make_pair(key, EvalString()));
+  return i->second;
 }
 
 const EvalString* Rule::GetBinding(const string& key) const {
-  Bindings::const_iterator i = bindings_.find(key);
-  if (i == bindings_.end())
+  VarId id = FindVariable(key);
+  if (id == kNoVar)
+    return NULL;
+  return GetBinding(id);
+}
+
+const EvalString* Rule::GetBinding(VarId key) const {
+  Bindings::const_iterator i = lower_bound(
+      bindings_.begin(), bindings_.end(), key,
+      BindingBefore<Bindings::value_type>);
+  if (i == bindings_.end() || i->first != key)
     return NULL;
   return &i->second;
 }
 
 // static
 bool Rule::IsReservedBinding(const string& var) {
-  return var == "command" ||
-      var == "depfile" ||
-      var == "dyndep" ||
-      var == "description" ||
-      var == "deps" ||
-      var == "generator" ||
-      var == "pool" ||
-      var == "restat" ||
-      var == "rspfile" ||
-      var == "rspfile_content" ||
-      var == "msvc_deps_prefix";
+  VarId id = FindVariable(var);
+  return id >= kVarBatch && id <= kVarMsvcDepsPrefix;
 }
 
 const map<string, const Rule*>& BindingEnv::GetRules() const {
   return rules_;
 }
 
-string BindingEnv::LookupWithFallback(const string& var,
-                                      const EvalString* eval,
+string BindingEnv::LookupWithFallback(VarId var, const EvalString* eval,
                                       Env* env) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
-    return i->second;
+  if (const string* value = Find(var))
+    return *value;
 
   if (eval)
     return eval->Evaluate(env);
 
   if (parent_)
-    return parent_->LookupVariable(var);
+    return parent_->LookupVariableById(var);
 
   return "";
 }
 
+EvalString::EvalString(const EvalString& other)
+    : tokens_(other.tokens_), base_(other.base_), text_(other.text_),
+      detached_(other.detached_), raw_size_(other.raw_size_) {
+  if (detached_)
+    base_ = text_.data();
+}
+
+EvalString& EvalString::operator=(const EvalString& other) {
+  tokens_ = other.tokens_;
+  text_ = other.text_;
+  detached_ = other.detached_;
+  base_ = detached_ ? text_.data() : other.base_;
+  raw_size_ = other.raw_size_;
+  return *this;
+}
+
+void EvalString::Clear() {
+  tokens_.clear();
+  base_ = NULL;
+  text_.clear();
+  detached_ = false;
+  raw_size_ = 0;
+}
+
 string EvalString::Evaluate(Env* env) const {
+  METRIC_COUNT("evalstring evaluations", 1);
   string result;
-  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
-    if (i->second == RAW)
-      result.append(i->first);
+  result.reserve(raw_size_);
+  for (TokenList::const_iterator i = tokens_.begin(); i != tokens_.end(); ++i) {
+    if (i->type == RAW)
+      result.append(base_ + i->offset, i->len);
     else
-      result.append(env->LookupVariable(i->first));
+      result.append(env->LookupVariableById(i->offset));
   }
   return result;
 }
 
-void EvalString::AddText(StringPiece text) {
-  // Add it to the end of an existing RAW token if possible.
-  if (!parsed_.empty() && parsed_.back().second == RAW) {
-    parsed_.back().first.append(text.str_, text.len_);
-  } else {
-    parsed_.push_back(make_pair(text.AsString(), RAW));
+void EvalString::Add(StringPiece text, TokenType type) {
+  if (type == SPECIAL) {
+    tokens_.push_back(Token(InternVariable(text), 0, SPECIAL));
+    return;
   }
+
+  if (!base_)
+    base_ = text.str_;
+  // Parsed tokens come in order from one buffer, so their offsets fit; copy
+  // anything else.
+  uintptr_t offset = (uintptr_t)text.str_ - (uintptr_t)base_;
+  if (!detached_ &&
+      ((uintptr_t)text.str_ < (uintptr_t)base_ ||
+       offset + text.len_ > 0xffffffffu))
+    Detach();
+  if (detached_) {
+    offset = text_.size();
+    text_.append(text.str_, text.len_);
+    base_ = text_.data();
+  }
+
+  raw_size_ += text.len_;
+  // Extend a RAW token that the text carries straight on from, as runs of
+  // text broken up by the lexer do.
+  if (!tokens_.empty() && tokens_.back().type == RAW &&
+      tokens_.back().offset + tokens_.back().len == offset) {
+    tokens_.back().len += text.len_;
+    return;
+  }
+  tokens_.push_back(Token((uint32_t)offset, (uint32_t)text.len_, RAW));
 }
-void EvalString::AddSpecial(StringPiece text) {
-  parsed_.push_back(make_pair(text.AsString(), SPECIAL));
+
+void EvalString::Detach() {
+  if (detached_)
+    return;
+  string text;
+  for (TokenList::iterator i = tokens_.begin(); i != tokens_.end(); ++i) {
+    if (i->type == SPECIAL)
+      continue;
+    size_t offset = text.size();
+    text.append(base_ + i->offset, i->len);
+    i->offset = (uint32_t)offset;
+  }
+  text_.swap(text);
+  base_ = text_.data();
+  detached_ = true;
 }
 
 string EvalString::Serialize() const {
   string result;
-  for (TokenList::const_iterator i = parsed_.begin();
-       i != parsed_.end(); ++i) {
-    result.append("[");
-    if (i->second == SPECIAL)
+  for (TokenList::const_iterator i = tokens_.begin();
+       i != tokens_.end(); ++i) {
+    // Show the text of neighbouring RAW tokens, which may have been parsed
+    // from different places, as one token.
+    bool continued = i != tokens_.begin() && i->type == RAW &&
+        (i - 1)->type == RAW;
+    if (continued)
+      result.resize(result.size() - 1);
+    else
+      result.append("[");
+    if (i->type == SPECIAL)
       result.append("$");
-    result.append(i->first);
+    StringPiece text = TextOf(*i);
+    result.append(text.str_, text.len_);
     result.append("]");
   }
   return result;
@@ -134,12 +304,13 @@ string EvalString::Serialize() const {
 
 string EvalString::Unparse() const {
   string result;
-  for (TokenList::const_iterator i = parsed_.begin();
-       i != parsed_.end(); ++i) {
-    bool special = (i->second == SPECIAL);
+  for (TokenList::const_iterator i = tokens_.begin();
+       i != tokens_.end(); ++i) {
+    bool special = (i->type == SPECIAL);
     if (special)
       result.append("${");
-    result.append(i->first);
+    StringPiece text = TextOf(*i);
+    result.append(text.str_, text.len_);
     if (special)
       result.append("}");
   }
@@ -21,18 +21,72 @@
 using namespace std;
 
 #include "string_piece.h"
+#include "util.h"  // uint32_t
 
 struct Rule;
 
+/// Variables are known by small integer ids, interned from their names as
+/// manifests are parsed, so that scopes look them up without comparing
+/// strings.  The variables ninja itself looks up have fixed ids.
+typedef uint32_t VarId;
+enum {
+  kVarIn,
+  kVarInNewline,
+  kVarOut,
+  // The bindings reserved to rules, up to kVarMsvcDepsPrefix.
+  kVarBatch,
+  kVarCache,
+  kVarCommand,
+  kVarDepfile,
+  kVarDyndep,
+  kVarDescription,
+  kVarDeps,
+  kVarGenerator,
+  kVarHashInputs,
+  kVarMemory,
+  kVarPool,
+  kVarPriority,
+  kVarRestat,
+  kVarRspfile,
+  kVarRspfileContent,
+  kVarShell,
+  kVarWorker,
+  kVarMsvcDepsPrefix,
+};
+/// The id of a name no variable has been given.
+const VarId kNoVar = 0xffffffffu;
+
+/// @return the id of the variable @a name, allocating one the first time.
+VarId InternVariable(StringPiece name);
+
+/// @return the id of the variable @a name, or kNoVar if there is none.
+VarId FindVariable(StringPiece name);
+
+/// @return the name of the variable @a id.
+const string& VariableName(VarId id);
+
 /// An interface for a scope for variable (e.g. "$foo") lookups.
 struct Env {
   virtual ~Env() {}
   virtual string LookupVariable(const string& var) = 0;
+  /// Look up a variable by its id; by default, by its name.
+  virtual string LookupVariableById(VarId var) {
+    return LookupVariable(VariableName(var));
+  }
 };
 
 /// A tokenized string that contains variable references.
 /// Can be evaluated relative to an Env.
+///
+/// The tokens point into the text they were parsed from, which must outlive
+/// the EvalString, unless it has been Detach()ed.  They are kept as offsets
+/// from one base pointer, so an EvalString is a flat array of small records
+/// plus, once detached, a single buffer of text.
 struct EvalString {
+  EvalString() : base_(NULL), detached_(false), raw_size_(0) {}
+  EvalString(const EvalString& other);
+  EvalString& operator=(const EvalString& other);
+
   /// @return The evaluated string with variable expanded using value found in
   ///         environment @a env.
   string Evaluate(Env* env) const;
@@ -40,20 +94,52 @@ struct EvalString {
   /// @return The string with variables not expanded.
   string Unparse() const;
 
-  void Clear() { parsed_.clear(); }
-  bool empty() const { return parsed_.empty(); }
+  void Clear();
+  bool empty() const { return tokens_.empty(); }
 
-  void AddText(StringPiece text);
-  void AddSpecial(StringPiece text);
+  void AddText(StringPiece text) { Add(text, RAW); }
+  void AddSpecial(StringPiece text) { Add(text, SPECIAL); }
+
+  /// Copy the text of the tokens into the EvalString, so that it no longer
+  /// depends on the text it was parsed from.  Tokens added afterwards are
+  /// copied as they come.
+  void Detach();
 
   /// Construct a human-readable representation of the parsed state,
   /// for use in tests.
   string Serialize() const;
 
 private:
+  friend struct ManifestCache;
+  friend struct MemoryStats;
+
   enum TokenType { RAW, SPECIAL };
-  typedef vector<pair<string, TokenType> > TokenList;
-  TokenList parsed_;
+  /// Text, |len| bytes at |offset| from |base_|, or the id of a variable
+  /// in |offset|.
+  struct Token {
+    Token(uint32_t offset, uint32_t len, TokenType type)
+        : offset(offset), len(len), type(type) {}
+    uint32_t offset;
+    uint32_t len : 31;
+    uint32_t type : 1;
+  };
+  typedef vector<Token> TokenList;
+
+  void Add(StringPiece text, TokenType type);
+  StringPiece TextOf(const Token& token) const {
+    if (token.type == SPECIAL)
+      return VariableName(token.offset);
+    return StringPiece(base_ + token.offset, token.len);
+  }
+
+  TokenList tokens_;
+  /// What the offsets count from: the text of the first RAW token, or
+  /// |text_| once detached.
+  const char* base_;
+  string text_;
+  bool detached_;
+  /// The length of the RAW tokens, the least that Evaluate() produces.
+  size_t raw_size_;
 };
 
 /// An invokable build command and associated metadata (description, etc.).
@@ -67,13 +153,21 @@ struct Rule {
   static bool IsReservedBinding(const string& var);
 
   const EvalString* GetBinding(const string& key) const;
+  const EvalString* GetBinding(VarId key) const;
 
  private:
   // Allow the parsers to reach into this object and fill out its fields.
   friend struct ManifestParser;
+  friend struct ManifestCache;
+  friend struct MemoryStats;
+  friend struct State;
+
+  /// @return the binding for @a key, adding an empty one if there is none.
+  EvalString& Binding(VarId key);
 
   string name_;
-  typedef map<string, EvalString> Bindings;
+  /// Sorted by id.
+  typedef vector<pair<VarId, EvalString> > Bindings;
   Bindings bindings_;
 };
 
@@ -85,6 +179,7 @@ struct BindingEnv : public Env {
 
   virtual ~BindingEnv() {}
   virtual string LookupVariable(const string& var);
+  virtual string LookupVariableById(VarId var);
 
   void AddRule(const Rule* rule);
   const Rule* LookupRule(const string& rule_name);
@@ -92,17 +187,26 @@ struct BindingEnv : public Env {
   const map<string, const Rule*>& GetRules() const;
 
   void AddBinding(const string& key, const string& val);
+  void AddBinding(VarId key, const string& val);
 
   /// This is tricky.  Edges want lookup scope to go in this order:
   /// 1) value set on edge itself (edge_->env_)
   /// 2) value set on rule, with expansion in the edge's scope
   /// 3) value set on enclosing scope of edge (edge_->env_->parent_)
   /// This function takes as parameters the necessary info to do (2).
-  string LookupWithFallback(const string& var, const EvalString* eval,
-                            Env* env);
+  string LookupWithFallback(VarId var, const EvalString* eval, Env* env);
 
 private:
-  map<string, string> bindings_;
+  friend struct ManifestCache;
+  friend struct MemoryStats;
+  friend struct State;
+
+  /// @return the value bound to @a var in this scope itself, or NULL.
+  const string* Find(VarId var) const;
+
+  /// A flat table sorted by id, as scopes bind few variables.
+  typedef vector<pair<VarId, string> > Bindings;
+  Bindings bindings_;
   map<string, const Rule*> rules_;
   BindingEnv* parent_;
 };
@@ -0,0 +1,93 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "failure_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "util.h"
+
+using namespace std;
+
+LoadStatus FailureLog::Load(const string& path, string* err) {
+  path_ = path;
+  outputs_.clear();
+  changed_ = false;
+  string contents;
+  int status = ::ReadFile(path, &contents, err);
+  if (status == -ENOENT) {
+    err->clear();
+    return LOAD_NOT_FOUND;
+  }
+  if (status < 0)
+    return LOAD_ERROR;
+  size_t start = 0;
+  while (start < contents.size()) {
+    size_t end = contents.find('\n', start);
+    if (end == string::npos)
+      end = contents.size();
+    if (end > start)
+      outputs_.insert(contents.substr(start, end - start));
+    start = end + 1;
+  }
+  return LOAD_SUCCESS;
+}
+
+bool FailureLog::Save(string* err) {
+  if (!changed_)
+    return true;
+  if (outputs_.empty()) {
+    if (unlink(path_.c_str()) < 0 && errno != ENOENT) {
+      *err = strerror(errno);
+      return false;
+    }
+    changed_ = false;
+    return true;
+  }
+  FILE* f = fopen(path_.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  for (set<string>::const_iterator o = outputs_.begin(); o != outputs_.end();
+       ++o) {
+    fputs(o->c_str(), f);
+    fputc('\n', f);
+  }
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  changed_ = false;
+  return true;
+}
+
+bool FailureLog::Failed(const Edge* edge) const {
+  return !outputs_.empty() &&
+      outputs_.count(edge->outputs_[0]->path()) != 0;
+}
+
+void FailureLog::RecordResult(const Edge* edge, bool success) {
+  const string& path = edge->outputs_[0]->path();
+  if (success)
+    changed_ = outputs_.erase(path) != 0 || changed_;
+  else
+    changed_ = outputs_.insert(path).second || changed_;
+}
@@ -0,0 +1,54 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FAILURE_LOG_H_
+#define NINJA_FAILURE_LOG_H_
+
+#include <set>
+#include <string>
+
+#include "load_status.h"
+
+struct Edge;
+
+/// Remembers the edges whose commands failed, by their first outputs, until
+/// they succeed, so that the next build can run them first: when iterating
+/// on a broken change, whether the fix worked is what's waited for.
+///
+/// The file lists one path per line.  It only ever holds a few, so Save()
+/// rewrites it whole.
+struct FailureLog {
+  FailureLog() : changed_(false) {}
+
+  /// Read the outputs listed at |path|, which Save() writes back to.
+  LoadStatus Load(const std::string& path, std::string* err);
+
+  /// Write the outputs back, if a result changed them.
+  bool Save(std::string* err);
+
+  /// Whether the command of |edge| failed the last time it ran.
+  bool Failed(const Edge* edge) const;
+
+  /// Record whether the command of |edge| succeeded.
+  void RecordResult(const Edge* edge, bool success);
+
+  size_t size() const { return outputs_.size(); }
+
+ private:
+  std::string path_;
+  std::set<std::string> outputs_;
+  bool changed_;
+};
+
+#endif  // NINJA_FAILURE_LOG_H_
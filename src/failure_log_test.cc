@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "failure_log.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "FailureLogTest-tempfile";
+
+struct FailureLogTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+    AssertParse(&state_,
+"build out1: cat in\n"
+"build out2 out3: cat in\n");
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+};
+
+TEST_F(FailureLogTest, RoundTrip) {
+  Edge* edge1 = GetNode("out1")->in_edge();
+  Edge* edge2 = GetNode("out2")->in_edge();
+  string err;
+  FailureLog log;
+  EXPECT_EQ(LOAD_NOT_FOUND, log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log.RecordResult(edge1, false);
+  log.RecordResult(edge2, false);
+  EXPECT_TRUE(log.Save(&err));
+  ASSERT_EQ("", err);
+
+  FailureLog log2;
+  EXPECT_EQ(LOAD_SUCCESS, log2.Load(kTestFilename, &err));
+  EXPECT_TRUE(log2.Failed(edge1));
+  EXPECT_TRUE(log2.Failed(edge2));
+
+  // Once an edge succeeds, it's forgotten.
+  log2.RecordResult(edge1, true);
+  EXPECT_FALSE(log2.Failed(edge1));
+  EXPECT_TRUE(log2.Save(&err));
+  FailureLog log3;
+  EXPECT_EQ(LOAD_SUCCESS, log3.Load(kTestFilename, &err));
+  EXPECT_FALSE(log3.Failed(edge1));
+  EXPECT_TRUE(log3.Failed(edge2));
+
+  // And with none left, so is the file.
+  log3.RecordResult(edge2, true);
+  EXPECT_TRUE(log3.Save(&err));
+  EXPECT_EQ(LOAD_NOT_FOUND, log3.Load(kTestFilename, &err));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,130 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+
+namespace {
+
+/// Append |str| to |out| as a JSON string.
+void AppendJSONString(string* out, const string& str) {
+  out->push_back('"');
+  for (string::const_iterator c = str.begin(); c != str.end(); ++c) {
+    if (*c == '"' || *c == '\\') {
+      out->push_back('\\');
+      out->push_back(*c);
+    } else if (*c == '\n') {
+      out->append("\\n");
+    } else if ((unsigned char)*c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)*c);
+      out->append(buf);
+    } else {
+      out->push_back(*c);
+    }
+  }
+  out->push_back('"');
+}
+
+void AppendInt(string* out, const char* key, int value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), ",\"%s\":%d", key, value);
+  out->append(buf);
+}
+
+}  // anonymous namespace
+
+void Frontend::TotalEdges(int total) {
+  string event = "{\"type\":\"total\"";
+  AppendInt(&event, "edges", total);
+  event += "}";
+  Write(event);
+}
+
+void Frontend::EdgeStarted(const Edge* edge, int time) {
+  int id = next_id_++;
+  ids_[edge] = id;
+
+  string event = "{\"type\":\"started\"";
+  AppendInt(&event, "id", id);
+  AppendInt(&event, "time", time);
+  event += ",\"description\":";
+  AppendJSONString(&event, edge->GetBinding(kVarDescription));
+  event += ",\"command\":";
+  AppendJSONString(&event, edge->EvaluateCommand());
+  event += ",\"outputs\":[";
+  for (Node* const* o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    if (o != edge->outputs_.begin())
+      event += ",";
+    AppendJSONString(&event, (*o)->path());
+  }
+  event += "],\"console\":";
+  event += edge->use_console() ? "true" : "false";
+  event += "}";
+  Write(event);
+}
+
+void Frontend::EdgeFinished(const Edge* edge, int time, bool success,
+                            const string& output) {
+  map<const Edge*, int>::iterator i = ids_.find(edge);
+  string event = "{\"type\":\"finished\"";
+  AppendInt(&event, "id", i->second);
+  AppendInt(&event, "time", time);
+  event += ",\"success\":";
+  event += success ? "true" : "false";
+  event += ",\"output\":";
+  AppendJSONString(&event, output);
+  event += "}";
+  ids_.erase(i);
+  Write(event);
+}
+
+void Frontend::BuildFinished() {
+  Write("{\"type\":\"build_finished\"}");
+}
+
+void Frontend::Write(const string& event) {
+  unsigned size = event.size();
+  string data;
+  for (int i = 0; i < 4; ++i)
+    data.push_back((char)((size >> (8 * i)) & 0xff));
+  data += event;
+
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+#ifdef _WIN32
+    int len = _write(fd_, p, (unsigned)left);
+#else
+    ssize_t len = write(fd_, p, left);
+#endif
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return;  // The frontend went away; keep building regardless.
+    p += len;
+    left -= len;
+  }
+}
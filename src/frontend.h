@@ -0,0 +1,60 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FRONTEND_H_
+#define NINJA_FRONTEND_H_
+
+#include <map>
+#include <string>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct Edge;
+
+/// Reports the progress of a build as events for a frontend, such as an
+/// IDE, to show however it likes, instead of ninja printing it.  Used for
+/// "--frontend-fd=N".
+///
+/// Each event is a 4-byte little-endian length followed by that many
+/// bytes of a JSON object with a "type":
+///
+///   {"type":"total","edges":N}   the number of commands to run changed
+///   {"type":"started","id":N,"time":MS,"description":"...",
+///    "command":"...","outputs":["..."],"console":false}
+///   {"type":"finished","id":N,"time":MS,"success":true,"output":"..."}
+///   {"type":"build_finished"}
+///
+/// Ids match up the started and finished events of a command, and times
+/// are in milliseconds since the build started.
+struct Frontend {
+  explicit Frontend(int fd) : fd_(fd), next_id_(0) {}
+
+  void TotalEdges(int total);
+  void EdgeStarted(const Edge* edge, int time);
+  void EdgeFinished(const Edge* edge, int time, bool success,
+                    const string& output);
+  void BuildFinished();
+
+ private:
+  /// Write |event| with its length in front.
+  void Write(const string& event);
+
+  int fd_;
+  int next_id_;
+  /// The ids of the running edges.
+  map<const Edge*, int> ids_;
+};
+
+#endif  // NINJA_FRONTEND_H_
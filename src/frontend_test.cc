@@ -0,0 +1,71 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+/// Split the contents of an event stream into its events.
+vector<string> ReadEvents(FILE* file) {
+  vector<string> events;
+  rewind(file);
+  unsigned char size[4];
+  while (fread(size, 1, 4, file) == 4) {
+    unsigned len = size[0] | size[1] << 8 | size[2] << 16 | size[3] << 24;
+    string event(len, '\0');
+    if (fread(&event[0], 1, len, file) != len)
+      break;
+    events.push_back(event);
+  }
+  return events;
+}
+
+struct FrontendTest : public StateTestWithBuiltinRules {};
+
+TEST_F(FrontendTest, Events) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule echo\n"
+"  command = echo $out\n"
+"  description = ECHO \"$out\"\n"
+"build out: echo in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+
+  FILE* file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  Frontend frontend(fileno(file));
+  frontend.TotalEdges(1);
+  frontend.EdgeStarted(edge, 5);
+  frontend.EdgeFinished(edge, 12, false, "bad\n\x1b[0m");
+  frontend.BuildFinished();
+
+  vector<string> events = ReadEvents(file);
+  fclose(file);
+  ASSERT_EQ(4u, events.size());
+  EXPECT_EQ("{\"type\":\"total\",\"edges\":1}", events[0]);
+  EXPECT_EQ("{\"type\":\"started\",\"id\":0,\"time\":5,"
+            "\"description\":\"ECHO \\\"out\\\"\",\"command\":\"echo out\","
+            "\"outputs\":[\"out\"],\"console\":false}", events[1]);
+  EXPECT_EQ("{\"type\":\"finished\",\"id\":0,\"time\":12,\"success\":false,"
+            "\"output\":\"bad\\n\\u001b[0m\"}", events[2]);
+  EXPECT_EQ("{\"type\":\"build_finished\"}", events[3]);
+}
+
+}  // anonymous namespace
@@ -15,140 +15,413 @@
 #include "graph.h"
 
 #include <algorithm>
+#include <map>
+#include <mutex>
 #include <assert.h>
 #include <stdio.h>
 
 #include "build_log.h"
 #include "debug_flags.h"
+#include "depfile_cache.h"
 #include "depfile_parser.h"
 #include "deps_log.h"
 #include "disk_interface.h"
+#include "hash_log.h"
 #include "manifest_parser.h"
 #include "metrics.h"
+#include "parallel.h"
+#include "scan_summary.h"
 #include "state.h"
 #include "util.h"
 
+uint16_t g_graph_generations[256];
+
+namespace {
+
+mutex g_graph_slots_mutex;
+/// Which slots of g_graph_generations a State holds.  Slot 0 never is.
+bool g_graph_slots_used[256];
+
+}  // anonymous namespace
+
+uint8_t AcquireGraphSlot() {
+  lock_guard<mutex> lock(g_graph_slots_mutex);
+  for (int slot = 1; slot < 256; ++slot) {
+    if (!g_graph_slots_used[slot]) {
+      g_graph_slots_used[slot] = true;
+      return (uint8_t)slot;
+    }
+  }
+  Fatal("more than 255 build graphs loaded at once");
+  return 0;  // Not reached.
+}
+
+void ReleaseGraphSlot(uint8_t slot) {
+  lock_guard<mutex> lock(g_graph_slots_mutex);
+  g_graph_slots_used[slot] = false;
+}
+
 bool Node::Stat(DiskInterface* disk_interface, string* err) {
-  return (mtime_ = disk_interface->Stat(path_, err)) != -1;
+  Touch();
+  return (mtime_ = disk_interface->Stat(cold_->path, err)) != -1;
 }
 
-bool DependencyScan::RecomputeDirty(Node* node, string* err) {
-  vector<Node*> stack;
-  return RecomputeDirty(node, &stack, err);
+// static
+bool Node::IsPlainPath(const NodeCold& cold) {
+  if (cold.slash_bits != 0)
+    return false;
+#ifdef _WIN32
+  return !StringNeedsWin32Escaping(cold.path);
+#else
+  return !StringNeedsShellEscaping(cold.path);
+#endif
 }
 
-bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
-                                    string* err) {
-  Edge* edge = node->in_edge();
-  if (!edge) {
-    // If we already visited this leaf node then we are done.
-    if (node->status_known())
-      return true;
-    // This node has no in-edge; it is dirty if it is missing.
-    if (!node->StatIfNecessary(disk_interface_, err))
-      return false;
-    if (!node->exists())
-      EXPLAIN("%s has no in-edge and is missing", node->path().c_str());
-    node->set_dirty(!node->exists());
-    return true;
+void Node::PruneOutEdges(const vector<bool>& edges) {
+  map<Edge*, int> kept;
+  Edge** out = cold_->out_edges.begin();
+  for (Edge** e = cold_->out_edges.begin();
+       e != cold_->out_edges.end(); ++e) {
+    Edge* edge = *e;
+    if (edge->id() < edges.size() && edges[edge->id()]) {
+      int uses = count(edge->inputs_.begin(), edge->inputs_.end(), this);
+      if (kept[edge]++ >= uses)
+        continue;
+    }
+    *out++ = edge;
   }
+  cold_->out_edges.erase(out, cold_->out_edges.end());
+}
 
-  // If we already finished this edge then we are done.
-  if (edge->mark_ == Edge::VisitDone)
-    return true;
+namespace {
 
-  // If we encountered this edge earlier in the call stack we have a cycle.
-  if (!VerifyDAG(node, stack, err))
-    return false;
+/// Below this many commands to a thread, starting threads costs more than
+/// hashing the commands serially.
+const size_t kMinHashesPerThread = 256;
 
-  // Mark the edge temporarily while in the call stack.
-  edge->mark_ = Edge::VisitInStack;
-  stack->push_back(node);
+/// Evaluates and hashes the commands of edges, for ParallelFor.
+struct HashCommands {
+  explicit HashCommands(const vector<Edge*>& edges) : edges_(edges) {}
+  void operator()(size_t i) const { edges_[i]->CommandHash(); }
+  const vector<Edge*>& edges_;
+};
 
-  bool dirty = false;
-  edge->outputs_ready_ = true;
-  edge->deps_missing_ = false;
+}  // anonymous namespace
 
-  if (!edge->deps_loaded_) {
-    // This is our first encounter with this edge.
-    // If there is a pending dyndep file, visit it now:
-    // * If the dyndep file is ready then load it now to get any
-    //   additional inputs and outputs for this and other edges.
-    //   Once the dyndep file is loaded it will no longer be pending
-    //   if any other edges encounter it, but they will already have
-    //   been updated.
-    // * If the dyndep file is not ready then since is known to be an
-    //   input to this edge, the edge will not be considered ready below.
-    //   Later during the build the dyndep file will become ready and be
-    //   loaded to update this edge before it can possibly be scheduled.
-    if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
-      if (!RecomputeDirty(edge->dyndep_, stack, err))
-        return false;
+bool DependencyScan::RecomputeDirty(Node* node, string* err) {
+  if (!node->status_known())
+    PrestatNodes(node);
+  vector<ScanFrame> stack;
+  bool success = RecomputeDirty(node, &stack, err);
+  // Drop the prestat results; from now on files may change under us.
+  prestat_nodes_.clear();
+  prestat_mtimes_.clear();
+  return success;
+}
+
+void DependencyScan::PrestatNodes(Node* node) {
+  METRIC_RECORD("prestat nodes");
+  DepsLog* deps_log = dep_loader_.deps_log();
+  DyndepCache* dyndep_cache = dyndep_loader_.cache();
+  vector<Node*> nodes;
+  vector<Node*> dyndeps;
+  vector<Edge*> hashes;
+  vector<bool> visited_edges;
+  vector<Node*> stack(1, node);
+  while (!stack.empty()) {
+    Node* n = stack.back();
+    stack.pop_back();
+    if (!n->status_known())
+      nodes.push_back(n);
+
+    // Edges finished by an earlier walk have all of their nodes examined.
+    Edge* edge = n->in_edge();
+    if (!edge || edge->mark() == Edge::VisitDone)
+      continue;
+    if (edge->id() >= visited_edges.size())
+      visited_edges.resize(edge->id() + 1, false);
+    if (visited_edges[edge->id()])
+      continue;
+    visited_edges[edge->id()] = true;
+
+    for (Node** o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      if (!(*o)->status_known())
+        nodes.push_back(*o);
+    }
+    stack.insert(stack.end(), edge->inputs_.begin(), edge->inputs_.end());
+    // The walk compares the command of every edge in the build log with the
+    // one logged.  Looking up the log may add to it, so only that is done
+    // here.
+    if (build_log() && !edge->is_phony() &&
+        build_log()->LookupByOutput(edge->outputs_[0]->path()))
+      hashes.push_back(edge);
+    if (dyndep_cache && edge->dyndep_ && edge->dyndep_->dyndep_pending())
+      dyndeps.push_back(edge->dyndep_);
+    if (deps_log && !edge->deps_loaded()) {
+      DepsLog::Deps* deps = deps_log->GetDeps(edge->outputs_[0]);
+      for (int i = 0; deps && i < deps->node_count; ++i)
+        stack.push_back(deps->nodes[i]);
+    }
+  }
+
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+  vector<string> paths;
+  paths.reserve(nodes.size());
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+    paths.push_back((*n)->path());
+
+  disk_interface_->StatBatch(paths, &prestat_mtimes_);
+  prestat_nodes_.swap(nodes);
+
+  // Evaluating a command reads only the edge and its scopes, so the
+  // commands can be hashed on as many threads as there are processors.
+  int threads = GetProcessorCount();
+  if ((size_t)threads > hashes.size() / kMinHashesPerThread)
+    threads = (int)(hashes.size() / kMinHashesPerThread);
+  HashCommands hash(hashes);
+  ParallelFor(hashes.size(), threads, hash);
+
+  // Read the dyndep files while the walk doesn't need them yet.  Those that
+  // turn out not to be ready are read again once they are.
+  if (!dyndeps.empty()) {
+    sort(dyndeps.begin(), dyndeps.end());
+    dyndeps.erase(unique(dyndeps.begin(), dyndeps.end()), dyndeps.end());
+    vector<string> dyndep_paths;
+    vector<TimeStamp> dyndep_mtimes;
+    for (vector<Node*>::iterator n = dyndeps.begin(); n != dyndeps.end();
+         ++n) {
+      vector<Node*>::iterator i =
+          lower_bound(prestat_nodes_.begin(), prestat_nodes_.end(), *n);
+      TimeStamp mtime = (*n)->mtime();
+      if (i != prestat_nodes_.end() && *i == *n)
+        mtime = prestat_mtimes_[i - prestat_nodes_.begin()];
+      dyndep_paths.push_back((*n)->path());
+      dyndep_mtimes.push_back(mtime);
+    }
+    dyndep_cache->Prefetch(dyndep_paths, dyndep_mtimes, disk_interface_);
+  }
+}
+
+bool DependencyScan::StatIfNecessary(Node* node, string* err) {
+  if (node->status_known())
+    return true;
+  vector<Node*>::iterator i =
+      lower_bound(prestat_nodes_.begin(), prestat_nodes_.end(), node);
+  if (i != prestat_nodes_.end() && *i == node) {
+    TimeStamp mtime = prestat_mtimes_[i - prestat_nodes_.begin()];
+    if (mtime >= 0) {
+      node->set_mtime(mtime);
+      return true;
+    }
+  }
+  return node->Stat(disk_interface_, err);
+}
+
+/// An edge on the stack of RecomputeDirty(), and how far its scan got.
+struct DependencyScan::ScanFrame {
+  explicit ScanFrame(Node* node)
+      : node(node), step(kVisitDyndep), input(0), most_recent_input(NULL),
+        dirty(false) {}
+
+  /// The output of the edge the walk reached it through.
+  Node* node;
+  enum Step {
+    /// Visit the pending dyndep file, if the edge has one.
+    kVisitDyndep,
+    /// Load the dyndep file just visited, if it's ready.
+    kLoadDyndep,
+    /// Stat the outputs and load the deps.
+    kLoadDeps,
+    /// Visit inputs_[input], or finish the edge past the last input.
+    kVisitInput,
+    /// Take what the visit of inputs_[input] found.
+    kTakeInput,
+  };
+  Step step;
+  size_t input;
+  Node* most_recent_input;
+  bool dirty;
+};
 
+bool DependencyScan::RecomputeDirty(Node* node, vector<ScanFrame>* stack,
+                                    string* err) {
+  // The walk keeps its own stack rather than recursing, so that deep
+  // chains of edges can't run out of the thread's.
+  if (!VisitNode(node, stack, err))
+    return false;
+  while (!stack->empty()) {
+    // Visiting a node may push a frame, which moves the others.
+    ScanFrame* frame = &stack->back();
+    Edge* edge = frame->node->in_edge();
+    switch (frame->step) {
+    case ScanFrame::kVisitDyndep:
+      // On our first encounter with this edge, if there is a pending
+      // dyndep file, visit it now:
+      // * If the dyndep file is ready then load it now to get any
+      //   additional inputs and outputs for this and other edges.
+      //   Once the dyndep file is loaded it will no longer be pending
+      //   if any other edges encounter it, but they will already have
+      //   been updated.
+      // * If the dyndep file is not ready then since is known to be an
+      //   input to this edge, the edge will not be considered ready below.
+      //   Later during the build the dyndep file will become ready and be
+      //   loaded to update this edge before it can possibly be scheduled.
+      if (!edge->deps_loaded() && edge->dyndep_ &&
+          edge->dyndep_->dyndep_pending()) {
+        frame->step = ScanFrame::kLoadDyndep;
+        if (!VisitNode(edge->dyndep_, stack, err))
+          return false;
+      } else {
+        frame->step = ScanFrame::kLoadDeps;
+      }
+      break;
+
+    case ScanFrame::kLoadDyndep:
       if (!edge->dyndep_->in_edge() ||
           edge->dyndep_->in_edge()->outputs_ready()) {
         // The dyndep file is ready, so load it now.
         if (!LoadDyndeps(edge->dyndep_, err))
           return false;
       }
-    }
-  }
+      frame->step = ScanFrame::kLoadDeps;
+      break;
+
+    case ScanFrame::kLoadDeps:
+      // Load output mtimes so we can compare them to the most recent input
+      // below.
+      for (Node** o = edge->outputs_.begin();
+           o != edge->outputs_.end(); ++o) {
+        if (!StatIfNecessary(*o, err))
+          return false;
+      }
 
-  // Load output mtimes so we can compare them to the most recent input below.
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
-       o != edge->outputs_.end(); ++o) {
-    if (!(*o)->StatIfNecessary(disk_interface_, err))
-      return false;
-  }
+      if (!edge->deps_loaded()) {
+        // This is our first encounter with this edge.  Load discovered
+        // deps.
+        edge->set_deps_loaded(true);
+        if (!dep_loader_.LoadDeps(edge, err)) {
+          if (!err->empty())
+            return false;
+          // Failed to load dependency info: rebuild to regenerate it.
+          // LoadDeps() did EXPLAIN() already, no need to do it here.
+          frame->dirty = edge->deps_missing_ = true;
+        }
+      }
+      frame->step = ScanFrame::kVisitInput;
+      break;
 
-  if (!edge->deps_loaded_) {
-    // This is our first encounter with this edge.  Load discovered deps.
-    edge->deps_loaded_ = true;
-    if (!dep_loader_.LoadDeps(edge, err)) {
-      if (!err->empty())
+    case ScanFrame::kVisitInput:
+      // Visit all inputs; we're dirty if any of the inputs are dirty.
+      if (frame->input == edge->inputs_.size()) {
+        if (!FinishEdge(frame, err))
+          return false;
+        stack->pop_back();
+        break;
+      }
+      frame->step = ScanFrame::kTakeInput;
+      if (!VisitNode(edge->inputs_[frame->input], stack, err))
         return false;
-      // Failed to load dependency info: rebuild to regenerate it.
-      // LoadDeps() did EXPLAIN() already, no need to do it here.
-      dirty = edge->deps_missing_ = true;
+      break;
+
+    case ScanFrame::kTakeInput: {
+      Node* input = edge->inputs_[frame->input];
+      // If an input is not ready, neither are our outputs.
+      if (Edge* in_edge = input->in_edge()) {
+        if (!in_edge->outputs_ready())
+          edge->set_outputs_ready(false);
+      }
+
+      if (!edge->is_order_only(frame->input)) {
+        // If a regular input is dirty (or missing), we're dirty.
+        // Otherwise consider mtime.
+        if (input->dirty()) {
+          EXPLAIN("%s is dirty", input->path().c_str());
+          frame->dirty = true;
+        } else if (!frame->most_recent_input ||
+                   input->mtime() > frame->most_recent_input->mtime()) {
+          frame->most_recent_input = input;
+        }
+      }
+      ++frame->input;
+      frame->step = ScanFrame::kVisitInput;
+      break;
+    }
     }
   }
+  return true;
+}
 
-  // Visit all inputs; we're dirty if any of the inputs are dirty.
-  Node* most_recent_input = NULL;
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
-       i != edge->inputs_.end(); ++i) {
-    // Visit this input.
-    if (!RecomputeDirty(*i, stack, err))
+bool DependencyScan::VisitNode(Node* node, vector<ScanFrame>* stack,
+                               string* err) {
+  Edge* edge = node->in_edge();
+  if (!edge) {
+    // If we already visited this leaf node then we are done.
+    if (node->status_known())
+      return true;
+    // This node has no in-edge; it is dirty if it is missing.
+    if (!StatIfNecessary(node, err))
       return false;
+    if (!node->exists())
+      EXPLAIN("%s has no in-edge and is missing", node->path().c_str());
+    node->set_dirty(!node->exists());
+    return true;
+  }
 
-    // If an input is not ready, neither are our outputs.
-    if (Edge* in_edge = (*i)->in_edge()) {
-      if (!in_edge->outputs_ready_)
-        edge->outputs_ready_ = false;
-    }
+  // If we already finished this edge then we are done.
+  if (edge->mark() == Edge::VisitDone)
+    return true;
 
-    if (!edge->is_order_only(i - edge->inputs_.begin())) {
-      // If a regular input is dirty (or missing), we're dirty.
-      // Otherwise consider mtime.
-      if ((*i)->dirty()) {
-        EXPLAIN("%s is dirty", (*i)->path().c_str());
-        dirty = true;
-      } else {
-        if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime()) {
-          most_recent_input = *i;
-        }
+  // Where nothing changed since a build found the edge up to date, there's
+  // no need to look at anything it is built from, only at its outputs.
+  if (edge->mark() == Edge::VisitNone && summary_ &&
+      summary_->Unchanged(edge)) {
+    bool outputs_exist = true;
+    for (Node** o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      if (!StatIfNecessary(*o, err))
+        return false;
+      outputs_exist = outputs_exist && (*o)->exists();
+    }
+    if (outputs_exist) {
+      EXPLAIN("skipping the scan of what %s is built from: nothing "
+              "changed there", node->path().c_str());
+      summary_->Skipped(edge);
+      for (Node** o = edge->outputs_.begin();
+           o != edge->outputs_.end(); ++o) {
+        (*o)->set_dirty(false);
       }
+      edge->set_outputs_ready(true);
+      edge->set_mark(Edge::VisitDone);
+      return true;
     }
   }
 
+  // If we encountered this edge earlier in the stack we have a cycle.
+  if (!VerifyDAG(node, stack, err))
+    return false;
+
+  // Mark the edge temporarily while in the stack.
+  edge->set_mark(Edge::VisitInStack);
+  stack->push_back(ScanFrame(node));
+  edge->set_outputs_ready(true);
+  edge->deps_missing_ = false;
+  return true;
+}
+
+bool DependencyScan::FinishEdge(ScanFrame* frame, string* err) {
+  Edge* edge = frame->node->in_edge();
+  bool dirty = frame->dirty;
+
   // We may also be dirty due to output state: missing outputs, out of
   // date outputs, etc.  Visit all outputs and determine whether they're dirty.
   if (!dirty)
-    if (!RecomputeOutputsDirty(edge, most_recent_input, &dirty, err))
+    if (!RecomputeOutputsDirty(edge, frame->most_recent_input, &dirty, err))
       return false;
 
   // Finally, visit each output and update their dirty state if necessary.
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
+  for (Node** o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
     if (dirty)
       (*o)->MarkDirty();
@@ -159,29 +432,30 @@ bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
   // order-only inputs.)
   // But phony edges with no inputs have nothing to do, so are always
   // ready.
+  bool inputs_ready = edge->outputs_ready();
   if (dirty && !(edge->is_phony() && edge->inputs_.empty()))
-    edge->outputs_ready_ = false;
+    edge->set_outputs_ready(false);
+  if (dirty && inputs_ready && observer_ && !edge->is_phony())
+    observer_->EdgeReady(edge);
 
   // Mark the edge as finished during this walk now that it will no longer
-  // be in the call stack.
-  edge->mark_ = Edge::VisitDone;
-  assert(stack->back() == node);
-  stack->pop_back();
-
+  // be in the stack.
+  edge->set_mark(Edge::VisitDone);
   return true;
 }
 
-bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
+bool DependencyScan::VerifyDAG(Node* node, vector<ScanFrame>* stack,
+                               string* err) {
   Edge* edge = node->in_edge();
   assert(edge != NULL);
 
   // If we have no temporary mark on the edge then we do not yet have a cycle.
-  if (edge->mark_ != Edge::VisitInStack)
+  if (edge->mark() != Edge::VisitInStack)
     return true;
 
-  // We have this edge earlier in the call stack.  Find it.
-  vector<Node*>::iterator start = stack->begin();
-  while (start != stack->end() && (*start)->in_edge() != edge)
+  // We have this edge earlier in the stack.  Find it.
+  vector<ScanFrame>::iterator start = stack->begin();
+  while (start != stack->end() && start->node->in_edge() != edge)
     ++start;
   assert(start != stack->end());
 
@@ -191,15 +465,15 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
   //   build a b: cat c
   //   build c: cat a
   // should report a -> c -> a instead of b -> c -> a.
-  *start = node;
+  start->node = node;
 
   // Construct the error message rejecting the cycle.
   *err = "dependency cycle: ";
-  for (vector<Node*>::const_iterator i = start; i != stack->end(); ++i) {
-    err->append((*i)->path());
+  for (vector<ScanFrame>::const_iterator i = start; i != stack->end(); ++i) {
+    err->append(i->node->path());
     err->append(" -> ");
   }
-  err->append((*start)->path());
+  err->append(start->node->path());
 
   if ((start + 1) == stack->end() && edge->maybe_phonycycle_diagnostic()) {
     // The manifest parser would have filtered out the self-referencing
@@ -212,10 +486,9 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
 
 bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
                                            bool* outputs_dirty, string* err) {
-  string command = edge->EvaluateCommand(/*incl_rsp_file=*/true);
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
+  for (Node** o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (RecomputeOutputDirty(edge, most_recent_input, command, *o)) {
+    if (RecomputeOutputDirty(edge, most_recent_input, *o)) {
       *outputs_dirty = true;
       return true;
     }
@@ -225,7 +498,6 @@ bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
 
 bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
                                           const Node* most_recent_input,
-                                          const string& command,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
@@ -246,8 +518,11 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
     return true;
   }
 
-  // Dirty if the output is older than the input.
-  if (most_recent_input && output->mtime() < most_recent_input->mtime()) {
+  // Dirty if the output is older than the input, unless the inputs' contents
+  // say otherwise.
+  bool unchanged_by_hash = false;
+  if (most_recent_input && output->mtime() < most_recent_input->mtime() &&
+      !(unchanged_by_hash = InputsUnchangedByHash(edge, output))) {
     TimeStamp output_mtime = output->mtime();
 
     // If this is a restat rule, we may have cleaned the output with a restat
@@ -255,7 +530,7 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
     // build log.  Use that mtime instead, so that the file will only be
     // considered dirty if an input was modified since the previous run.
     bool used_restat = false;
-    if (edge->GetBindingBool("restat") && build_log() &&
+    if (edge->GetBindingBool(kVarRestat) && build_log() &&
         (entry = build_log()->LookupByOutput(output->path()))) {
       output_mtime = entry->mtime;
       used_restat = true;
@@ -272,17 +547,18 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
   }
 
   if (build_log()) {
-    bool generator = edge->GetBindingBool("generator");
+    bool generator = edge->GetBindingBool(kVarGenerator);
     if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
       if (!generator &&
-          BuildLog::LogEntry::HashCommand(command) != entry->command_hash) {
+          edge->CommandHash() != entry->command_hash) {
         // May also be dirty due to the command changing since the last build.
         // But if this is a generator rule, the command changing does not make us
         // dirty.
         EXPLAIN("command line changed for %s", output->path().c_str());
         return true;
       }
-      if (most_recent_input && entry->mtime < most_recent_input->mtime()) {
+      if (most_recent_input && entry->mtime < most_recent_input->mtime() &&
+          !unchanged_by_hash && !InputsUnchangedByHash(edge, output)) {
         // May also be dirty due to the mtime in the log being older than the
         // mtime of the most recent input.  This can occur even when the mtime
         // on disk is newer if a previous run wrote to the output file but
@@ -302,6 +578,17 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
   return false;
 }
 
+bool DependencyScan::InputsUnchangedByHash(const Edge* edge,
+                                           const Node* output) {
+  if (!hash_log_ || !edge->GetBindingBool(kVarHashInputs))
+    return false;
+  if (!hash_log_->InputsUnchanged(edge, output))
+    return false;
+  EXPLAIN("contents of the inputs of %s unchanged since it was built",
+          output->path().c_str());
+  return true;
+}
+
 bool DependencyScan::LoadDyndeps(Node* node, string* err) const {
   return dyndep_loader_.LoadDyndeps(node, err);
 }
@@ -312,7 +599,7 @@ bool DependencyScan::LoadDyndeps(Node* node, DyndepFile* ddf,
 }
 
 bool Edge::AllInputsReady() const {
-  for (vector<Node*>::const_iterator i = inputs_.begin();
+  for (Node* const* i = inputs_.begin();
        i != inputs_.end(); ++i) {
     if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
       return false;
@@ -327,20 +614,28 @@ struct EdgeEnv : public Env {
   EdgeEnv(const Edge* const edge, const EscapeKind escape)
       : edge_(edge), escape_in_out_(escape), recursive_(false) {}
   virtual string LookupVariable(const string& var);
+  virtual string LookupVariableById(VarId var);
 
   /// Given a span of Nodes, construct a list of paths suitable for a command
   /// line.
   std::string MakePathList(const Node* const* span, size_t size, char sep) const;
 
  private:
-  vector<string> lookups_;
+  vector<VarId> lookups_;
   const Edge* const edge_;
   EscapeKind escape_in_out_;
   bool recursive_;
 };
 
 string EdgeEnv::LookupVariable(const string& var) {
-  if (var == "in" || var == "in_newline") {
+  VarId id = FindVariable(var);
+  if (id == kNoVar)
+    return "";
+  return LookupVariableById(id);
+}
+
+string EdgeEnv::LookupVariableById(VarId var) {
+  if (var == kVarIn || var == kVarInNewline) {
     int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
       edge_->order_only_deps_;
 #if __cplusplus >= 201103L
@@ -348,19 +643,19 @@ string EdgeEnv::LookupVariable(const string& var) {
 #else
     return MakePathList(&edge_->inputs_[0], explicit_deps_count,
 #endif
-                        var == "in" ? ' ' : '\n');
-  } else if (var == "out") {
+                        var == kVarIn ? ' ' : '\n');
+  } else if (var == kVarOut) {
     int explicit_outs_count = edge_->outputs_.size() - edge_->implicit_outs_;
     return MakePathList(&edge_->outputs_[0], explicit_outs_count, ' ');
   }
 
   if (recursive_) {
-    vector<string>::const_iterator it;
+    vector<VarId>::const_iterator it;
     if ((it = find(lookups_.begin(), lookups_.end(), var)) != lookups_.end()) {
       string cycle;
       for (; it != lookups_.end(); ++it)
-        cycle.append(*it + " -> ");
-      cycle.append(var);
+        cycle.append(VariableName(*it) + " -> ");
+      cycle.append(VariableName(var));
       Fatal(("cycle in rule variables: " + cycle).c_str());
     }
   }
@@ -378,11 +673,21 @@ string EdgeEnv::LookupVariable(const string& var) {
 
 std::string EdgeEnv::MakePathList(const Node* const* const span,
                                   const size_t size, const char sep) const {
+  const Node* const* const end = span + size;
+  size_t length = 0;
+  for (const Node* const* i = span; i != end; ++i)
+    length += (*i)->path().size() + 1;
+
   string result;
-  for (const Node* const* i = span; i != span + size; ++i) {
-    if (!result.empty())
+  result.reserve(length);
+  for (const Node* const* i = span; i != end; ++i) {
+    if (i != span)
       result.push_back(sep);
-    const string& path = (*i)->PathDecanonicalized();
+    if ((*i)->plain_path()) {
+      result.append((*i)->path());
+      continue;
+    }
+    const string path = (*i)->PathDecanonicalized();
     if (escape_in_out_ == kShellEscape) {
 #ifdef _WIN32
       GetWin32EscapedString(path, &result);
@@ -397,47 +702,125 @@ std::string EdgeEnv::MakePathList(const Node* const* const span,
 }
 
 std::string Edge::EvaluateCommand(const bool incl_rsp_file) const {
-  string command = GetBinding("command");
+  string command = GetBinding(kVarCommand);
   if (incl_rsp_file) {
-    string rspfile_content = GetBinding("rspfile_content");
+    string rspfile_content = GetBinding(kVarRspfileContent);
     if (!rspfile_content.empty())
       command += ";rspfile=" + rspfile_content;
   }
   return command;
 }
 
+/// The values of the bindings that the build looks up over and over for
+/// an edge, in RecomputeOutputDirty(), StartEdge(), FinishCommand() and the
+/// logs, kept so that each is evaluated once.
+struct Edge::BindingCache {
+  enum {
+    DEPS,
+    MSVC_DEPS_PREFIX,
+    RESTAT,
+    GENERATOR,
+    HASH_INPUTS,
+    UNESCAPED_DEPFILE,
+    UNESCAPED_RSPFILE,
+    COMMAND_HASH,
+  };
+
+  BindingCache() : evaluated(0), command_hash(0) {}
+
+  /// Bit i is set once value i has been evaluated.
+  unsigned evaluated;
+  string values[COMMAND_HASH];
+  uint64_t command_hash;
+};
+
+namespace {
+
+/// The shell-escaped bindings in Edge::BindingCache, by index.
+const VarId kCachedBindings[] = {
+  kVarDeps, kVarMsvcDepsPrefix, kVarRestat, kVarGenerator, kVarHashInputs,
+};
+
+}  // anonymous namespace
+
+Edge::~Edge() {
+  delete binding_cache_;
+}
+
+const string& Edge::CachedBinding(int index, VarId key, bool escape) const {
+  if (!binding_cache_)
+    binding_cache_ = new BindingCache;
+  if (!(binding_cache_->evaluated & (1u << index))) {
+    EdgeEnv env(this, escape ? EdgeEnv::kShellEscape : EdgeEnv::kDoNotEscape);
+    binding_cache_->values[index] = env.LookupVariableById(key);
+    binding_cache_->evaluated |= 1u << index;
+  }
+  return binding_cache_->values[index];
+}
+
+void Edge::ClearBindingCache() {
+  delete binding_cache_;
+  binding_cache_ = NULL;
+}
+
 std::string Edge::GetBinding(const std::string& key) const {
+  VarId id = FindVariable(key);
+  if (id == kNoVar)
+    return "";
+  return GetBinding(id);
+}
+
+std::string Edge::GetBinding(VarId key) const {
+  for (size_t i = 0;
+       i < sizeof(kCachedBindings) / sizeof(kCachedBindings[0]); ++i) {
+    if (key == kCachedBindings[i])
+      return CachedBinding(i, kCachedBindings[i], true);
+  }
   EdgeEnv env(this, EdgeEnv::kShellEscape);
-  return env.LookupVariable(key);
+  return env.LookupVariableById(key);
 }
 
 bool Edge::GetBindingBool(const string& key) const {
   return !GetBinding(key).empty();
 }
 
+bool Edge::GetBindingBool(VarId key) const {
+  return !GetBinding(key).empty();
+}
+
 string Edge::GetUnescapedDepfile() const {
-  EdgeEnv env(this, EdgeEnv::kDoNotEscape);
-  return env.LookupVariable("depfile");
+  return CachedBinding(BindingCache::UNESCAPED_DEPFILE, kVarDepfile, false);
 }
 
 string Edge::GetUnescapedDyndep() const {
   EdgeEnv env(this, EdgeEnv::kDoNotEscape);
-  return env.LookupVariable("dyndep");
+  return env.LookupVariableById(kVarDyndep);
 }
 
 std::string Edge::GetUnescapedRspfile() const {
-  EdgeEnv env(this, EdgeEnv::kDoNotEscape);
-  return env.LookupVariable("rspfile");
+  return CachedBinding(BindingCache::UNESCAPED_RSPFILE, kVarRspfile, false);
+}
+
+uint64_t Edge::CommandHash() const {
+  if (!binding_cache_)
+    binding_cache_ = new BindingCache;
+  const unsigned bit = 1u << BindingCache::COMMAND_HASH;
+  if (!(binding_cache_->evaluated & bit)) {
+    binding_cache_->command_hash =
+        BuildLog::LogEntry::HashCommand(EvaluateCommand(true));
+    binding_cache_->evaluated |= bit;
+  }
+  return binding_cache_->command_hash;
 }
 
 void Edge::Dump(const char* prefix) const {
   printf("%s[ ", prefix);
-  for (vector<Node*>::const_iterator i = inputs_.begin();
+  for (Node* const* i = inputs_.begin();
        i != inputs_.end() && *i != NULL; ++i) {
     printf("%s ", (*i)->path().c_str());
   }
   printf("--%s-> ", rule_->name().c_str());
-  for (vector<Node*>::const_iterator i = outputs_.begin();
+  for (Node* const* i = outputs_.begin();
        i != outputs_.end() && *i != NULL; ++i) {
     printf("%s ", (*i)->path().c_str());
   }
@@ -493,14 +876,67 @@ void Node::Dump(const char* prefix) const {
     printf("no in-edge\n");
   }
   printf(" out edges:\n");
-  for (vector<Edge*>::const_iterator e = out_edges().begin();
+  for (Edge* const* e = out_edges().begin();
        e != out_edges().end() && *e != NULL; ++e) {
     (*e)->Dump(" +- ");
   }
 }
 
+namespace {
+
+/// Orders positions in a heap of edges as EdgePriorityLess orders the
+/// edges there.
+struct HeapPositionLess {
+  explicit HeapPositionLess(const vector<Edge*>& heap) : heap_(&heap) {}
+  bool operator()(size_t a, size_t b) const {
+    return EdgePriorityLess()((*heap_)[a], (*heap_)[b]);
+  }
+  const vector<Edge*>* heap_;
+};
+
+}  // anonymous namespace
+
+void EdgePriorityQueue::Peek(size_t count, vector<Edge*>* edges) const {
+  // No edge in the heap comes before its parent, at (i - 1) / 2, so the
+  // next edge is always a child of one already taken.
+  priority_queue<size_t, vector<size_t>, HeapPositionLess> next(
+      (HeapPositionLess(c)));
+  if (!c.empty())
+    next.push(0);
+  for (; count > 0 && !next.empty(); --count) {
+    size_t i = next.top();
+    next.pop();
+    edges->push_back(c[i]);
+    if (2 * i + 1 < c.size())
+      next.push(2 * i + 1);
+    if (2 * i + 2 < c.size())
+      next.push(2 * i + 2);
+  }
+}
+
+void EdgePriorityQueue::TakeBatch(const Edge* edge, size_t count,
+                                  vector<Edge*>* edges) {
+  // Edges whose bindings come from the same scope differ in nothing but
+  // their inputs and outputs.
+  size_t kept = 0;
+  for (size_t i = 0; i < c.size(); ++i) {
+    Edge* other = c[i];
+    if (count > 0 && other->rule_ == edge->rule_ &&
+        other->env_ == edge->env_ && other->pool_ == edge->pool_) {
+      edges->push_back(other);
+      --count;
+    } else {
+      c[kept++] = other;
+    }
+  }
+  if (kept == c.size())
+    return;
+  c.resize(kept);
+  make_heap(c.begin(), c.end(), comp);
+}
+
 bool ImplicitDepLoader::LoadDeps(Edge* edge, string* err) {
-  string deps_type = edge->GetBinding("deps");
+  string deps_type = edge->GetBinding(kVarDeps);
   if (!deps_type.empty())
     return LoadDepsFromLog(edge, err);
 
@@ -526,31 +962,47 @@ struct matches {
 bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
                                     string* err) {
   METRIC_RECORD("depfile load");
-  // Read depfile content.  Treat a missing depfile as empty.
-  string content;
-  switch (disk_interface_->ReadFile(path, &content, err)) {
-  case DiskInterface::Okay:
-    break;
-  case DiskInterface::NotFound:
-    err->clear();
-    break;
-  case DiskInterface::OtherError:
-    *err = "loading '" + path + "': " + *err;
-    return false;
-  }
-  // On a missing depfile: return false and empty *err.
-  if (content.empty()) {
-    EXPLAIN("depfile '%s' is missing", path.c_str());
-    return false;
-  }
-
   DepfileParser depfile(depfile_parser_options_
                         ? *depfile_parser_options_
                         : DepfileParserOptions());
-  string depfile_err;
-  if (!depfile.Parse(&content, &depfile_err)) {
-    *err = path + ": " + depfile_err;
-    return false;
+  string content;
+
+  // Take the paths the cache kept if the depfile didn't change since.
+  TimeStamp mtime = 0;
+  if (depfile_cache_) {
+    mtime = disk_interface_->Stat(path, err);
+    if (mtime == -1) {
+      *err = "loading '" + path + "': " + *err;
+      return false;
+    }
+  }
+  if (!depfile_cache_ || !depfile_cache_->Lookup(path, mtime, &depfile)) {
+    TimeStamp now = depfile_cache_ ? disk_interface_->Now() : 0;
+    // Read depfile content.  Treat a missing depfile as empty.
+    switch (disk_interface_->ReadFile(path, &content, err)) {
+    case DiskInterface::Okay:
+      break;
+    case DiskInterface::NotFound:
+      err->clear();
+      break;
+    case DiskInterface::OtherError:
+      *err = "loading '" + path + "': " + *err;
+      return false;
+    }
+    METRIC_COUNT("depfile bytes read", content.size());
+    // On a missing depfile: return false and empty *err.
+    if (content.empty()) {
+      EXPLAIN("depfile '%s' is missing", path.c_str());
+      return false;
+    }
+
+    string depfile_err;
+    if (!depfile.ParseCanonical(&content, &depfile_err)) {
+      *err = path + ": " + depfile_err;
+      return false;
+    }
+    if (depfile_cache_)
+      depfile_cache_->Add(path, mtime, now, depfile);
   }
 
   if (depfile.outs_.empty()) {
@@ -558,13 +1010,7 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
     return false;
   }
 
-  uint64_t unused;
   std::vector<StringPiece>::iterator primary_out = depfile.outs_.begin();
-  if (!CanonicalizePath(const_cast<char*>(primary_out->str_),
-                        &primary_out->len_, &unused, err)) {
-    *err = path + ": " + *err;
-    return false;
-  }
 
   // Check that this depfile matches the edge's output, if not return false to
   // mark the edge as dirty.
@@ -587,21 +1033,14 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
   }
 
   // Preallocate space in edge->inputs_ to be filled in below.
-  vector<Node*>::iterator implicit_dep =
-      PreallocateSpace(edge, depfile.ins_.size());
+  Node** implicit_dep = PreallocateSpace(edge, depfile.ins_.size());
 
   // Add all its in-edges.
-  for (vector<StringPiece>::iterator i = depfile.ins_.begin();
-       i != depfile.ins_.end(); ++i, ++implicit_dep) {
-    uint64_t slash_bits;
-    if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits,
-                          err))
-      return false;
-
-    Node* node = state_->GetNode(*i, slash_bits);
+  for (size_t i = 0; i < depfile.ins_.size(); ++i, ++implicit_dep) {
+    Node* node = state_->GetNode(depfile.ins_[i], depfile.ins_slash_bits_[i]);
     *implicit_dep = node;
     node->AddOutEdge(edge);
-    CreatePhonyInEdge(node);
+    node->set_found_by_dep_loader();
   }
 
   return true;
@@ -623,38 +1062,19 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, string* err) {
     return false;
   }
 
-  vector<Node*>::iterator implicit_dep =
-      PreallocateSpace(edge, deps->node_count);
+  Node** implicit_dep = PreallocateSpace(edge, deps->node_count);
   for (int i = 0; i < deps->node_count; ++i, ++implicit_dep) {
     Node* node = deps->nodes[i];
     *implicit_dep = node;
     node->AddOutEdge(edge);
-    CreatePhonyInEdge(node);
+    node->set_found_by_dep_loader();
   }
   return true;
 }
 
-vector<Node*>::iterator ImplicitDepLoader::PreallocateSpace(Edge* edge,
-                                                            int count) {
-  edge->inputs_.insert(edge->inputs_.end() - edge->order_only_deps_,
-                       (size_t)count, 0);
+Node** ImplicitDepLoader::PreallocateSpace(Edge* edge, int count) {
   edge->implicit_deps_ += count;
-  return edge->inputs_.end() - edge->order_only_deps_ - count;
-}
-
-void ImplicitDepLoader::CreatePhonyInEdge(Node* node) {
-  if (node->in_edge())
-    return;
-
-  Edge* phony_edge = state_->AddEdge(&State::kPhonyRule);
-  node->set_in_edge(phony_edge);
-  phony_edge->outputs_.push_back(node);
-
-  // RecomputeDirty might not be called for phony_edge if a previous call
-  // to RecomputeDirty had caused the file to be stat'ed.  Because previous
-  // invocations of RecomputeDirty would have seen this node without an
-  // input edge (and therefore ready), we have to set outputs_ready_ to true
-  // to avoid a potential stuck build.  If we do call RecomputeDirty for
-  // this node, it will simply set outputs_ready_ to the correct value.
-  phony_edge->outputs_ready_ = true;
+  edge->loaded_deps_ += count;
+  return edge->inputs_.insert(edge->inputs_.end() - edge->order_only_deps_,
+                              (size_t)count, NULL);
 }
@@ -15,12 +15,14 @@
 #ifndef NINJA_GRAPH_H_
 #define NINJA_GRAPH_H_
 
+#include <queue>
 #include <string>
 #include <vector>
 using namespace std;
 
 #include "dyndep.h"
 #include "eval_env.h"
+#include "small_vector.h"
 #include "timestamp.h"
 #include "util.h"
 
@@ -29,21 +31,63 @@ struct DepfileParserOptions;
 struct DiskInterface;
 struct DepsLog;
 struct Edge;
+struct DepfileCache;
+struct HashLog;
 struct Node;
 struct Pool;
+struct ScanSummary;
 struct State;
 
+/// The generation of the per-build state of Nodes and Edges: mtimes, dirty
+/// bits and visit marks.  State::Reset() starts a new one, and any such
+/// state set in an earlier generation reads as reset, so that a reset
+/// needn't visit every node and edge.
+///
+/// Each live State has a slot of its own, whose index its nodes and edges
+/// keep, so that resetting one State leaves the others alone.  Slot 0 is
+/// for edges made outside of any State, and never moves on.
+extern uint16_t g_graph_generations[256];
+
+/// Take a free slot of g_graph_generations, or give one back.
+uint8_t AcquireGraphSlot();
+void ReleaseGraphSlot(uint8_t slot);
+
+/// The parts of a Node that are only needed once it is looked at by path,
+/// or its dependents are.
+struct NodeCold {
+  NodeCold(const string& path, uint64_t slash_bits)
+      : path(path), slash_bits(slash_bits) {}
+
+  string path;
+
+  /// Set bits starting from lowest for backslashes that were normalized
+  /// to forward slashes by CanonicalizePath. See |Node::PathDecanonicalized|.
+  uint64_t slash_bits;
+
+  /// All Edges that use this Node as an input.
+  SmallVector<Edge*, 2> out_edges;
+};
+
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
+///
+/// What the dirty walk looks at is in the Node itself, and the rest in a
+/// NodeCold kept apart, so that the nodes the walk goes through are small
+/// and sit close together.
 struct Node {
-  Node(const string& path, uint64_t slash_bits)
-      : path_(path),
-        slash_bits_(slash_bits),
-        mtime_(-1),
+  /// A node for the file |cold| describes, in the graph of |slot|; |cold|
+  /// must outlive it.
+  Node(NodeCold* cold, uint8_t slot)
+      : mtime_(-1),
+        in_edge_(NULL),
+        cold_(cold),
+        id_(-1),
         dirty_(false),
         dyndep_pending_(false),
-        in_edge_(NULL),
-        id_(-1) {}
+        found_by_dep_loader_(false),
+        plain_path_(IsPlainPath(*cold)),
+        slot_(slot),
+        generation_(g_graph_generations[slot]) {}
 
   /// Return false on error.
   bool Stat(DiskInterface* disk_interface, string* err);
@@ -59,56 +103,83 @@ struct Node {
   void ResetState() {
     mtime_ = -1;
     dirty_ = false;
+    generation_ = g_graph_generations[slot_];
   }
 
   /// Mark the Node as already-stat()ed and missing.
   void MarkMissing() {
+    Touch();
     mtime_ = 0;
   }
 
   bool exists() const {
-    return mtime_ != 0;
+    return mtime() != 0;
   }
 
   bool status_known() const {
-    return mtime_ != -1;
+    return mtime() != -1;
   }
 
-  const string& path() const { return path_; }
+  const string& path() const { return cold_->path; }
   /// Get |path()| but use slash_bits to convert back to original slash styles.
   string PathDecanonicalized() const {
-    return PathDecanonicalized(path_, slash_bits_);
+    return PathDecanonicalized(cold_->path, cold_->slash_bits);
   }
   static string PathDecanonicalized(const string& path,
                                     uint64_t slash_bits);
-  uint64_t slash_bits() const { return slash_bits_; }
-
-  TimeStamp mtime() const { return mtime_; }
+  uint64_t slash_bits() const { return cold_->slash_bits; }
+  /// Whether |path()| is also how commands spell the node: it has no
+  /// slashes to convert back and nothing the shell would need quoted.
+  bool plain_path() const { return plain_path_; }
+
+  TimeStamp mtime() const { return current() ? mtime_ : -1; }
+  /// Record an mtime obtained by stat()ing the node's path elsewhere, e.g.
+  /// through DiskInterface::StatBatch.
+  void set_mtime(TimeStamp mtime) {
+    Touch();
+    mtime_ = mtime;
+  }
 
-  bool dirty() const { return dirty_; }
-  void set_dirty(bool dirty) { dirty_ = dirty; }
-  void MarkDirty() { dirty_ = true; }
+  bool dirty() const { return current() && dirty_; }
+  void set_dirty(bool dirty) {
+    Touch();
+    dirty_ = dirty;
+  }
+  void MarkDirty() { set_dirty(true); }
 
   bool dyndep_pending() const { return dyndep_pending_; }
   void set_dyndep_pending(bool pending) { dyndep_pending_ = pending; }
 
+  /// Whether the node is a dependency loaded from a depfile or the deps
+  /// log.  If nothing builds it, its being missing makes its dependents
+  /// dirty rather than failing the build: it's a header that went away.
+  bool found_by_dep_loader() const { return found_by_dep_loader_; }
+  void set_found_by_dep_loader() { found_by_dep_loader_ = true; }
+
   Edge* in_edge() const { return in_edge_; }
   void set_in_edge(Edge* edge) { in_edge_ = edge; }
 
   int id() const { return id_; }
   void set_id(int id) { id_ = id; }
 
-  const vector<Edge*>& out_edges() const { return out_edges_; }
-  void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
+  const SmallVector<Edge*, 2>& out_edges() const { return cold_->out_edges; }
+  void AddOutEdge(Edge* edge) { cold_->out_edges.push_back(edge); }
+
+  /// Drop the out-edge entries of the edges whose id is set in \a edges,
+  /// except for those through which the edge still lists this node as an
+  /// input.
+  void PruneOutEdges(const vector<bool>& edges);
 
   void Dump(const char* prefix="") const;
 
 private:
-  string path_;
-
-  /// Set bits starting from lowest for backslashes that were normalized to
-  /// forward slashes by CanonicalizePath. See |PathDecanonicalized|.
-  uint64_t slash_bits_;
+  /// Whether mtime_ and dirty_ were set in this generation.
+  bool current() const { return generation_ == g_graph_generations[slot_]; }
+  /// Bring the per-build state into this generation.
+  void Touch() {
+    if (!current())
+      ResetState();
+  }
 
   /// Possible values of mtime_:
   ///   -1: file hasn't been examined
@@ -116,24 +187,36 @@ private:
   ///   >0: actual file's mtime
   TimeStamp mtime_;
 
+  /// The Edge that produces this Node, or NULL when there is no
+  /// known edge to produce it.
+  Edge* in_edge_;
+
+  NodeCold* cold_;
+
+  /// A dense integer id for the node, assigned and used by DepsLog.
+  int id_;
+
   /// Dirty is true when the underlying file is out-of-date.
   /// But note that Edge::outputs_ready_ is also used in judging which
   /// edges to build.
-  bool dirty_;
+  bool dirty_ : 1;
 
   /// Store whether dyndep information is expected from this node but
   /// has not yet been loaded.
-  bool dyndep_pending_;
+  bool dyndep_pending_ : 1;
 
-  /// The Edge that produces this Node, or NULL when there is no
-  /// known edge to produce it.
-  Edge* in_edge_;
+  bool found_by_dep_loader_ : 1;
 
-  /// All Edges that use this Node as an input.
-  vector<Edge*> out_edges_;
+  /// See plain_path().  Set once here, as commands are evaluated on
+  /// several threads while the dependency scan hashes them.
+  bool plain_path_ : 1;
+  static bool IsPlainPath(const NodeCold& cold);
 
-  /// A dense integer id for the node, assigned and used by DepsLog.
-  int id_;
+  /// The slot of g_graph_generations of the State the node is in.
+  uint8_t slot_;
+
+  /// The generation mtime_ and dirty_ were set in.
+  uint16_t generation_;
 };
 
 /// An edge in the dependency graph; links between Nodes using Rules.
@@ -144,10 +227,16 @@ struct Edge {
     VisitDone
   };
 
-  Edge() : rule_(NULL), pool_(NULL), dyndep_(NULL), env_(NULL),
-           mark_(VisitNone), outputs_ready_(false), deps_loaded_(false),
-           deps_missing_(false), implicit_deps_(0), order_only_deps_(0),
-           implicit_outs_(0) {}
+  /// An edge in the graph of |slot|, or of none.
+  explicit Edge(uint8_t slot = 0) : rule_(NULL), pool_(NULL), dyndep_(NULL), env_(NULL),
+           id_(0), deps_missing_(false),
+           critical_path_weight_(0), priority_(0), plan_priority_(0),
+           memory_(0), memory_declared_(false), batch_(1),
+           implicit_deps_(0), loaded_deps_(0),
+           order_only_deps_(0), implicit_outs_(0), mark_(VisitNone),
+           outputs_ready_(false), deps_loaded_(false), slot_(slot),
+           generation_(g_graph_generations[slot]), binding_cache_(NULL) {}
+  ~Edge();
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
@@ -159,7 +248,9 @@ struct Edge {
 
   /// Returns the shell-escaped value of |key|.
   std::string GetBinding(const string& key) const;
+  std::string GetBinding(VarId key) const;
   bool GetBindingBool(const string& key) const;
+  bool GetBindingBool(VarId key) const;
 
   /// Like GetBinding("depfile"), but without shell escaping.
   string GetUnescapedDepfile() const;
@@ -168,23 +259,87 @@ struct Edge {
   /// Like GetBinding("rspfile"), but without shell escaping.
   std::string GetUnescapedRspfile() const;
 
+  /// The hash of EvaluateCommand(true), which the build log records.
+  uint64_t CommandHash() const;
+
+  /// Forget the values that GetBinding() and friends cache for the bindings
+  /// the build looks up repeatedly, after a change to the edge's inputs,
+  /// outputs or scope.
+  void ClearBindingCache();
+
   void Dump(const char* prefix="") const;
 
   const Rule* rule_;
   Pool* pool_;
-  vector<Node*> inputs_;
-  vector<Node*> outputs_;
+  SmallVector<Node*, 4> inputs_;
+  SmallVector<Node*, 1> outputs_;
   Node* dyndep_;
   BindingEnv* env_;
-  VisitMark mark_;
-  bool outputs_ready_;
-  bool deps_loaded_;
+  /// A dense id for the edge, its index in State::edges_.
+  size_t id_;
   bool deps_missing_;
 
+  /// Estimated time (in milliseconds) of the longest chain of commands
+  /// from this edge to any target of the build, including this edge itself.
+  /// Computed by Plan::PrepareQueue and used to decide which ready edge to
+  /// start first.
+  int64_t critical_path_weight_;
+
+  /// Given by the `priority` binding: ready edges with a higher priority
+  /// start before those with a lower one, whatever their critical paths.
+  int priority_;
+  /// The highest priority of this edge and of the edges in the plan built
+  /// from its outputs, so that what a high priority edge waits for is
+  /// hurried along too.  Computed by Plan::PrepareQueue.
+  int plan_priority_;
+
+  /// Estimated peak memory (in kilobytes) of the command, which pools
+  /// with a memory budget and -m hold it to.  Given by the `memory`
+  /// binding if |memory_declared_|, and otherwise set by Plan::PrepareQueue
+  /// from the build log.
+  int64_t memory_;
+  bool memory_declared_;
+
+  /// Given by the `batch` binding: how many ready edges of the rule, this
+  /// one included, may run as one command.  See Plan::FindBatch().
+  int batch_;
+
   const Rule& rule() const { return *rule_; }
   Pool* pool() const { return pool_; }
+  size_t id() const { return id_; }
   int weight() const { return 1; }
-  bool outputs_ready() const { return outputs_ready_; }
+  int64_t memory() const { return memory_; }
+
+  /// The per-build state, which reads as reset once State::Reset() starts
+  /// a new generation.
+  VisitMark mark() const { return current() ? mark_ : VisitNone; }
+  void set_mark(VisitMark mark) {
+    Touch();
+    mark_ = mark;
+  }
+  bool outputs_ready() const { return current() && outputs_ready_; }
+  void set_outputs_ready(bool ready) {
+    Touch();
+    outputs_ready_ = ready;
+  }
+  bool deps_loaded() const { return current() && deps_loaded_; }
+  void set_deps_loaded(bool loaded) {
+    Touch();
+    deps_loaded_ = loaded;
+  }
+  /// Forget the per-build state.
+  void ResetState() {
+    mark_ = VisitNone;
+    outputs_ready_ = false;
+    deps_loaded_ = false;
+    generation_ = g_graph_generations[slot_];
+  }
+
+  int64_t critical_path_weight() const { return critical_path_weight_; }
+  void set_critical_path_weight(int64_t weight) {
+    critical_path_weight_ = weight;
+  }
+  int plan_priority() const { return plan_priority_; }
 
   // There are three types of inputs.
   // 1) explicit deps, which show up as $in on the command line;
@@ -194,7 +349,10 @@ struct Edge {
   //                     don't cause the target to rebuild.
   // These are stored in inputs_ in that order, and we keep counts of
   // #2 and #3 when we need to access the various subsets.
+  // |loaded_deps_| counts the implicit deps that were loaded from a depfile
+  // or the deps log rather than declared in the manifest; they come last.
   int implicit_deps_;
+  int loaded_deps_;
   int order_only_deps_;
   bool is_implicit(size_t index) {
     return index >= inputs_.size() - order_only_deps_ - implicit_deps_ &&
@@ -217,6 +375,65 @@ struct Edge {
   bool is_phony() const;
   bool use_console() const;
   bool maybe_phonycycle_diagnostic() const;
+
+ private:
+  struct BindingCache;
+
+  /// Whether the per-build state was set in this generation.
+  bool current() const { return generation_ == g_graph_generations[slot_]; }
+  /// Bring the per-build state into this generation.
+  void Touch() {
+    if (!current())
+      ResetState();
+  }
+
+  VisitMark mark_;
+  bool outputs_ready_;
+  bool deps_loaded_;
+  /// The slot of g_graph_generations of the State the edge is in.
+  uint8_t slot_;
+  /// The generation the per-build state was set in.
+  uint16_t generation_;
+
+  /// The cached value of binding |key|, evaluating it if need be.
+  const string& CachedBinding(int index, VarId key, bool escape) const;
+
+  /// Allocated on the first cached lookup.
+  mutable BindingCache* binding_cache_;
+
+  Edge(const Edge&);
+  void operator=(const Edge&);
+};
+
+/// Orders edges so that the edge with the heaviest critical path compares
+/// greatest.  Ties go to the edge declared first in the manifest.
+struct EdgePriorityLess {
+  bool operator()(const Edge* e1, const Edge* e2) const {
+    if (e1->plan_priority() != e2->plan_priority())
+      return e1->plan_priority() < e2->plan_priority();
+    const int64_t cw1 = e1->critical_path_weight();
+    const int64_t cw2 = e2->critical_path_weight();
+    if (cw1 != cw2)
+      return cw1 < cw2;
+    return e1->id() > e2->id();
+  }
+};
+
+/// A priority queue of ready edges, handing out the edge with the highest
+/// priority first, and among those the one with the heaviest critical path.
+struct EdgePriorityQueue :
+    public priority_queue<Edge*, vector<Edge*>, EdgePriorityLess> {
+  void clear() {
+    c.clear();
+  }
+
+  /// Append the |count| edges top() would return first, in that order, to
+  /// |edges|, without taking them off the queue.
+  void Peek(size_t count, vector<Edge*>* edges) const;
+
+  /// Take up to |count| edges that can run in one command with |edge| off
+  /// the queue, appending them to |edges|.
+  void TakeBatch(const Edge* edge, size_t count, vector<Edge*>* edges);
 };
 
 
@@ -225,9 +442,11 @@ struct Edge {
 struct ImplicitDepLoader {
   ImplicitDepLoader(State* state, DepsLog* deps_log,
                     DiskInterface* disk_interface,
-                    DepfileParserOptions const* depfile_parser_options)
+                    DepfileParserOptions const* depfile_parser_options,
+                    DepfileCache* depfile_cache = NULL)
       : state_(state), disk_interface_(disk_interface), deps_log_(deps_log),
-        depfile_parser_options_(depfile_parser_options) {}
+        depfile_parser_options_(depfile_parser_options),
+        depfile_cache_(depfile_cache) {}
 
   /// Load implicit dependencies for \a edge.
   /// @return false on error (without filling \a err if info is just missing
@@ -248,31 +467,43 @@ struct ImplicitDepLoader {
   bool LoadDepsFromLog(Edge* edge, string* err);
 
   /// Preallocate \a count spaces in the input array on \a edge, returning
-  /// an iterator pointing at the first new space.
-  vector<Node*>::iterator PreallocateSpace(Edge* edge, int count);
-
-  /// If we don't have a edge that generates this input already,
-  /// create one; this makes us not abort if the input is missing,
-  /// but instead will rebuild in that circumstance.
-  void CreatePhonyInEdge(Node* node);
+  /// a pointer to the first new space.  The array grows at most once, and
+  /// only the order-only inputs move to make room.
+  Node** PreallocateSpace(Edge* edge, int count);
 
   State* state_;
   DiskInterface* disk_interface_;
   DepsLog* deps_log_;
   DepfileParserOptions const* depfile_parser_options_;
+  /// The cache depfiles are parsed through, or NULL.
+  DepfileCache* depfile_cache_;
 };
 
 
+/// Told by DependencyScan about the edges it finds dirty, so that they can
+/// start while the rest of the graph is still being scanned.
+struct DirtyEdgeObserver {
+  virtual ~DirtyEdgeObserver() {}
+
+  /// |edge| is dirty, not phony, and the edges of all its inputs are ready.
+  virtual void EdgeReady(Edge* edge) = 0;
+};
+
 /// DependencyScan manages the process of scanning the files in a graph
 /// and updating the dirty/outputs_ready state of all the nodes and edges.
 struct DependencyScan {
   DependencyScan(State* state, BuildLog* build_log, DepsLog* deps_log,
                  DiskInterface* disk_interface,
-                 DepfileParserOptions const* depfile_parser_options)
+                 DepfileParserOptions const* depfile_parser_options,
+                 HashLog* hash_log = NULL, DyndepCache* dyndep_cache = NULL,
+                 DepfileCache* depfile_cache = NULL)
       : build_log_(build_log),
+        hash_log_(hash_log),
         disk_interface_(disk_interface),
-        dep_loader_(state, deps_log, disk_interface, depfile_parser_options),
-        dyndep_loader_(state, disk_interface) {}
+        dep_loader_(state, deps_log, disk_interface, depfile_parser_options,
+                    depfile_cache),
+        dyndep_loader_(state, disk_interface, dyndep_cache),
+        observer_(NULL), summary_(NULL) {}
 
   /// Update the |dirty_| state of the given node by inspecting its input edge.
   /// Examine inputs, outputs, and command lines to judge whether an edge
@@ -297,6 +528,21 @@ struct DependencyScan {
     return dep_loader_.deps_log();
   }
 
+  HashLog* hash_log() const {
+    return hash_log_;
+  }
+
+  /// Set the observer RecomputeDirty() tells about ready edges, or NULL.
+  void set_observer(DirtyEdgeObserver* observer) {
+    observer_ = observer;
+  }
+
+  /// Set the summary of the previous build that lets RecomputeDirty() skip
+  /// the parts of the graph where nothing changed, or NULL.
+  void set_summary(ScanSummary* summary) {
+    summary_ = summary;
+  }
+
   /// Load a dyndep file from the given node's path and update the
   /// build graph with the new information.  One overload accepts
   /// a caller-owned 'DyndepFile' object in which to store the
@@ -305,18 +551,49 @@ struct DependencyScan {
   bool LoadDyndeps(Node* node, DyndepFile* ddf, string* err) const;
 
  private:
-  bool RecomputeDirty(Node* node, vector<Node*>* stack, string* err);
-  bool VerifyDAG(Node* node, vector<Node*>* stack, string* err);
+  struct ScanFrame;
+
+  bool RecomputeDirty(Node* node, vector<ScanFrame>* stack, string* err);
+  /// Start the scan of the edge building |node|, pushing it on |stack|,
+  /// unless there's nothing to scan.
+  bool VisitNode(Node* node, vector<ScanFrame>* stack, string* err);
+  /// Decide whether the edge of |frame|, whose inputs are all visited, is
+  /// dirty.
+  bool FinishEdge(ScanFrame* frame, string* err);
+  bool VerifyDAG(Node* node, vector<ScanFrame>* stack, string* err);
+
+  /// Stat all not yet examined nodes that a RecomputeDirty of |node| is
+  /// going to look at, including the dependencies recorded in the deps
+  /// log, with a single DiskInterface::StatBatch.  The results are kept
+  /// in |prestat_nodes_| and |prestat_mtimes_| for the walk to pick up.
+  /// The pending dyndep files among them are read into the DyndepCache,
+  /// if there is one.
+  void PrestatNodes(Node* node);
+
+  /// Like Node::StatIfNecessary, but uses the result of PrestatNodes if
+  /// there is one.  Failed prestats are retried to report the error.
+  bool StatIfNecessary(Node* node, string* err);
 
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(const Edge* edge, const Node* most_recent_input,
-                            const string& command, Node* output);
+                            Node* output);
+
+  /// Returns true if |edge| has hash_inputs set and the hash log shows
+  /// that none of its inputs changed since |output| was built.
+  bool InputsUnchangedByHash(const Edge* edge, const Node* output);
 
   BuildLog* build_log_;
+  HashLog* hash_log_;
   DiskInterface* disk_interface_;
   ImplicitDepLoader dep_loader_;
   DyndepLoader dyndep_loader_;
+  DirtyEdgeObserver* observer_;
+  ScanSummary* summary_;
+
+  /// Nodes stat()ed by PrestatNodes, sorted by address, and their mtimes.
+  vector<Node*> prestat_nodes_;
+  vector<TimeStamp> prestat_mtimes_;
 };
 
 #endif  // NINJA_GRAPH_H_
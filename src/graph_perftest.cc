@@ -0,0 +1,316 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "build.h"
+#include "build_log.h"
+#include "deps_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+const char kDepsLogFilename[] = "GraphPerfTest-tempfile";
+
+/// A disk where every source exists, and the outputs either are all newer
+/// than them, so that a scan finds nothing to do and spends its time
+/// walking the graph, or are all missing, so that everything is to build.
+struct SyntheticDisk : public DiskInterface {
+  SyntheticDisk() : outputs_exist_(true) {}
+
+  virtual TimeStamp Stat(const string& path, string* err) const {
+    if (path.compare(0, 4, "obj/") != 0)
+      return 1;
+    return outputs_exist_ ? 2 : 0;
+  }
+  virtual bool MakeDir(const string& path) { return true; }
+  virtual bool WriteFile(const string& path, const string& contents) {
+    return true;
+  }
+  virtual Status ReadFile(const string& path, string* contents, string* err) {
+    *err = "not supported";
+    return OtherError;
+  }
+  virtual int RemoveFile(const string& path) { return 1; }
+
+  bool outputs_exist_;
+};
+
+const Rule* ParseRules(State* state) {
+  string err;
+  ManifestParser parser(state, NULL);
+  if (!parser.ParseTest("rule cc\n  command = cc $in -o $out\n"
+                        "rule cc_deps\n  command = cc -MD $in -o $out\n"
+                        "  deps = gcc\n  depfile = $out.d\n"
+                        "rule ar\n  command = ar $out $in\n"
+                        "rule link\n  command = ld $in -o $out\n", &err)) {
+    printf("%s\n", err.c_str());
+    exit(1);
+  }
+  return state->bindings_.LookupRule("cc");
+}
+
+/// Build a graph of |sources| compiles, each including a few headers out
+/// of a shared set, archived 1000 objects at a time and linked together.
+/// @return the final output.
+Node* BuildLibs(State* state, DepsLog*, int sources) {
+  const Rule* cc = ParseRules(state);
+  const Rule* ar = state->bindings_.LookupRule("ar");
+  const Rule* link = state->bindings_.LookupRule("link");
+
+  const int kHeaders = 5000;
+  const int kObjectsPerLib = 1000;
+  Edge* link_edge = state->AddEdge(link);
+  state->AddOut(link_edge, "obj/app", 0);
+  Edge* ar_edge = NULL;
+  char buf[64];
+  for (int i = 0; i < sources; ++i) {
+    if (i % kObjectsPerLib == 0) {
+      ar_edge = state->AddEdge(ar);
+      snprintf(buf, sizeof(buf), "obj/lib%d.a", i / kObjectsPerLib);
+      state->AddOut(ar_edge, buf, 0);
+      state->AddIn(link_edge, buf, 0);
+    }
+    Edge* edge = state->AddEdge(cc);
+    snprintf(buf, sizeof(buf), "src/dir%d/file%d.cc", i % 97, i);
+    state->AddIn(edge, buf, 0);
+    for (int h = 0; h < 4; ++h) {
+      snprintf(buf, sizeof(buf), "include/dir%d/header%d.h", h,
+               (i * 7 + h * 1231) % kHeaders);
+      state->AddIn(edge, buf, 0);
+    }
+    snprintf(buf, sizeof(buf), "obj/dir%d/file%d.o", i % 97, i);
+    state->AddOut(edge, buf, 0);
+    state->AddIn(ar_edge, buf, 0);
+  }
+  return state->LookupNode("obj/app");
+}
+
+/// Build a graph of |sources| compiles all linked by one edge.
+Node* BuildWide(State* state, DepsLog*, int sources) {
+  const Rule* cc = ParseRules(state);
+  const Rule* link = state->bindings_.LookupRule("link");
+
+  Edge* link_edge = state->AddEdge(link);
+  state->AddOut(link_edge, "obj/app", 0);
+  char buf[64];
+  for (int i = 0; i < sources; ++i) {
+    Edge* edge = state->AddEdge(cc);
+    snprintf(buf, sizeof(buf), "src/file%d.cc", i);
+    state->AddIn(edge, buf, 0);
+    snprintf(buf, sizeof(buf), "obj/file%d.o", i);
+    state->AddOut(edge, buf, 0);
+    state->AddIn(link_edge, buf, 0);
+  }
+  return state->LookupNode("obj/app");
+}
+
+/// Build a chain of |length| edges, each reading the output of the last.
+Node* BuildDeep(State* state, DepsLog*, int length) {
+  const Rule* cc = ParseRules(state);
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "src/file.cc");
+  for (int i = 0; i < length; ++i) {
+    Edge* edge = state->AddEdge(cc);
+    state->AddIn(edge, buf, 0);
+    snprintf(buf, sizeof(buf), "obj/step%d", i);
+    state->AddOut(edge, buf, 0);
+  }
+  return state->LookupNode(buf);
+}
+
+/// Build a graph of |sources| compiles linked together, whose headers, 40
+/// each out of a shared set, are recorded in |deps_log| as a compiler's
+/// depfile would have them.
+Node* BuildDeps(State* state, DepsLog* deps_log, int sources) {
+  ParseRules(state);
+  const Rule* cc = state->bindings_.LookupRule("cc_deps");
+  const Rule* link = state->bindings_.LookupRule("link");
+
+  const int kHeaders = 20000;
+  const int kHeadersPerSource = 40;
+  vector<Node*> headers;
+  char buf[64];
+  for (int h = 0; h < kHeaders; ++h) {
+    snprintf(buf, sizeof(buf), "include/dir%d/header%d.h", h % 31, h);
+    headers.push_back(state->GetNode(buf, 0));
+  }
+
+  Edge* link_edge = state->AddEdge(link);
+  state->AddOut(link_edge, "obj/app", 0);
+  vector<Node*> deps(kHeadersPerSource);
+  for (int i = 0; i < sources; ++i) {
+    Edge* edge = state->AddEdge(cc);
+    snprintf(buf, sizeof(buf), "src/dir%d/file%d.cc", i % 97, i);
+    state->AddIn(edge, buf, 0);
+    snprintf(buf, sizeof(buf), "obj/dir%d/file%d.o", i % 97, i);
+    state->AddOut(edge, buf, 0);
+    state->AddIn(link_edge, buf, 0);
+    for (int h = 0; h < kHeadersPerSource; ++h)
+      deps[h] = headers[(i * 13 + h * 487) % kHeaders];
+    deps_log->RecordDeps(edge->outputs_[0], 2, deps);
+  }
+  return state->LookupNode("obj/app");
+}
+
+/// Record every edge in |build_log| as last built with its current command.
+void FillBuildLog(State* state, BuildLog* build_log) {
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    if (!(*e)->is_phony())
+      build_log->RecordCommand(*e, 0, 1, 2);
+  }
+}
+
+void Report(const char* what, const vector<int>& times, size_t nodes) {
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (size_t i = 0; i < times.size(); ++i) {
+    total += times[i];
+    if (times[i] < min)
+      min = times[i];
+    else if (times[i] > max)
+      max = times[i];
+  }
+
+  float avg = total / times.size();
+  printf("%s: min %dms  max %dms  avg %.1fms  %.0f nodes/s\n", what,
+         min, max, avg, avg > 0 ? nodes * 1000.0 / avg : 0.0);
+}
+
+struct Shape {
+  const char* name;
+  Node* (*build)(State* state, DepsLog* deps_log, int count);
+  /// The count when none is given.
+  int count;
+  const char* description;
+};
+
+const Shape kShapes[] = {
+  { "libs", BuildLibs, 500000, "compiles with headers, archived and linked" },
+  { "wide", BuildWide, 500000, "compiles all linked by one edge" },
+  // Plan::AddTarget() recurses down the chain.
+  { "deep", BuildDeep, 10000, "one chain of edges" },
+  { "deps", BuildDeps, 100000, "compiles with headers from the deps log" },
+};
+
+void Usage() {
+  printf("usage: graph_perftest [shape [count]]\n"
+         "\n"
+         "shapes:\n");
+  for (size_t i = 0; i < sizeof(kShapes) / sizeof(kShapes[0]); ++i)
+    printf("  %-5s %s (%d)\n", kShapes[i].name, kShapes[i].description,
+           kShapes[i].count);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  const Shape* shape = &kShapes[0];
+  if (argc > 1) {
+    shape = NULL;
+    for (size_t i = 0; i < sizeof(kShapes) / sizeof(kShapes[0]); ++i) {
+      if (strcmp(argv[1], kShapes[i].name) == 0)
+        shape = &kShapes[i];
+    }
+    if (!shape) {
+      Usage();
+      return 1;
+    }
+  }
+  int count = shape->count;
+  if (argc > 2)
+    count = atoi(argv[2]);
+
+  string err;
+  State state;
+  BuildLog build_log;
+  DepsLog deps_log;
+  unlink(kDepsLogFilename);
+  if (!deps_log.OpenForWrite(kDepsLogFilename, &err)) {
+    printf("%s\n", err.c_str());
+    return 1;
+  }
+  int64_t start = GetTimeMillis();
+  Node* root = shape->build(&state, &deps_log, count);
+  FillBuildLog(&state, &build_log);
+  int64_t end = GetTimeMillis();
+  deps_log.Close();
+  unlink(kDepsLogFilename);
+  printf("%s %d: %zu nodes, %zu edges: built in %dms\n", shape->name, count,
+         state.paths_.size(), state.edges_.size(), (int)(end - start));
+
+  SyntheticDisk disk;
+  DependencyScan scan(&state, &build_log, &deps_log, &disk, NULL);
+  const int kNumRepetitions = 5;
+  vector<int> scan_times, dirty_scan_times, plan_times;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    disk.outputs_exist_ = true;
+    start = GetTimeMillis();
+    state.Reset();
+    if (!scan.RecomputeDirty(root, &err)) {
+      printf("%s\n", err.c_str());
+      return 1;
+    }
+    end = GetTimeMillis();
+    if (root->dirty()) {
+      printf("unexpectedly dirty\n");
+      return 1;
+    }
+    scan_times.push_back(end - start);
+
+    disk.outputs_exist_ = false;
+    start = GetTimeMillis();
+    state.Reset();
+    if (!scan.RecomputeDirty(root, &err)) {
+      printf("%s\n", err.c_str());
+      return 1;
+    }
+    end = GetTimeMillis();
+    dirty_scan_times.push_back(end - start);
+
+    Plan plan;
+    start = GetTimeMillis();
+    if (!plan.AddTarget(root, &err)) {
+      printf("%s\n", err.c_str());
+      return 1;
+    }
+    plan.PrepareQueue(&build_log);
+    end = GetTimeMillis();
+    if (!plan.more_to_do()) {
+      printf("unexpectedly clean\n");
+      return 1;
+    }
+    plan_times.push_back(end - start);
+  }
+
+  size_t nodes = state.paths_.size();
+  Report("no-op scan", scan_times, nodes);
+  Report("full scan", dirty_scan_times, nodes);
+  Report("plan", plan_times, nodes);
+
+  return 0;
+}
@@ -13,7 +13,12 @@
 // limitations under the License.
 
 #include "graph.h"
+
+#include <algorithm>
+
 #include "build.h"
+#include "build_log.h"
+#include "depfile_cache.h"
 
 #include "test.h"
 
@@ -77,6 +82,118 @@ TEST_F(GraphTest, FunkyMakefilePath) {
   EXPECT_TRUE(GetNode("out.o")->dirty());
 }
 
+TEST_F(GraphTest, DepfileCache) {
+  const char kManifest[] =
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc\n";
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, kManifest));
+  fs_.Create("foo.cc", "");
+  fs_.Create("implicit.h", "");
+  fs_.Create("out.o.d", "out.o: ./implicit.h\n");
+  fs_.Create("out.o", "");
+  fs_.now_ += DepfileCache::kRacyWindow;
+
+  DepfileCache cache;
+  DependencyScan scan(&state_, NULL, NULL, &fs_, NULL, NULL, NULL, &cache);
+  string err;
+  EXPECT_TRUE(scan.RecomputeDirty(GetNode("out.o"), &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, fs_.files_read_.size());
+
+  // The next run takes the depfile's paths from the cache...
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DependencyScan cached_scan(&state, NULL, NULL, &fs_, NULL, NULL, NULL,
+                             &cache);
+  fs_.files_read_.clear();
+  Node* out = state.LookupNode("out.o");
+  EXPECT_TRUE(cached_scan.RecomputeDirty(out, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(fs_.files_read_.empty());
+  ASSERT_EQ(2u, out->in_edge()->inputs_.size());
+  EXPECT_EQ("implicit.h", out->in_edge()->inputs_[1]->path());
+
+  // ...until it changes.
+  State changed_state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&changed_state, kManifest));
+  DependencyScan changed_scan(&changed_state, NULL, NULL, &fs_, NULL, NULL,
+                              NULL, &cache);
+  fs_.Tick();
+  fs_.Create("out.o.d", "out.o: other.h\n");
+  fs_.now_ += DepfileCache::kRacyWindow;
+  out = changed_state.LookupNode("out.o");
+  EXPECT_TRUE(changed_scan.RecomputeDirty(out, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, fs_.files_read_.size());
+  EXPECT_EQ("other.h", out->in_edge()->inputs_[1]->path());
+  EXPECT_TRUE(out->dirty());
+
+  // The cache outlives the run.
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("Ninja-GraphTest-DepfileCache");
+  DepfileCache saved;
+  EXPECT_EQ(LOAD_NOT_FOUND, saved.Load(".ninja_depfiles", &err));
+  State saved_state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&saved_state, kManifest));
+  DependencyScan saved_scan(&saved_state, NULL, NULL, &fs_, NULL, NULL, NULL,
+                            &saved);
+  EXPECT_TRUE(saved_scan.RecomputeDirty(saved_state.LookupNode("out.o"),
+                                        &err));
+  EXPECT_TRUE(saved.Write(&err));
+  ASSERT_EQ("", err);
+  DepfileCache loaded;
+  EXPECT_EQ(LOAD_SUCCESS, loaded.Load(".ninja_depfiles", &err));
+  ASSERT_EQ("", err);
+  temp_dir.Cleanup();
+
+  State loaded_state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&loaded_state, kManifest));
+  DependencyScan loaded_scan(&loaded_state, NULL, NULL, &fs_, NULL, NULL,
+                             NULL, &loaded);
+  fs_.files_read_.clear();
+  out = loaded_state.LookupNode("out.o");
+  EXPECT_TRUE(loaded_scan.RecomputeDirty(out, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(fs_.files_read_.empty());
+  EXPECT_EQ("other.h", out->in_edge()->inputs_[1]->path());
+}
+
+TEST_F(GraphTest, DepfileCacheRacyDepfile) {
+  const char kManifest[] =
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc\n";
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, kManifest));
+  fs_.Create("foo.cc", "");
+  fs_.Create("out.o", "");
+  fs_.Create("out.o.d", "out.o: old.h\n");
+
+  DepfileCache cache;
+  DependencyScan scan(&state_, NULL, NULL, &fs_, NULL, NULL, NULL, &cache);
+  string err;
+  EXPECT_TRUE(scan.RecomputeDirty(GetNode("out.o"), &err));
+  ASSERT_EQ("", err);
+
+  // The command rewrites the depfile within the same tick of a coarse
+  // clock, so its mtime doesn't change.
+  fs_.Create("out.o.d", "out.o: new.h\n");
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DependencyScan next_scan(&state, NULL, NULL, &fs_, NULL, NULL, NULL,
+                           &cache);
+  fs_.files_read_.clear();
+  Node* out = state.LookupNode("out.o");
+  EXPECT_TRUE(next_scan.RecomputeDirty(out, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, fs_.files_read_.size());
+  ASSERT_EQ(2u, out->in_edge()->inputs_.size());
+  EXPECT_EQ("new.h", out->in_edge()->inputs_[1]->path());
+}
+
 TEST_F(GraphTest, ExplicitImplicit) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule catdep\n"
@@ -227,6 +344,27 @@ TEST_F(GraphTest, VarInOutPathEscaping) {
 #endif
 }
 
+TEST_F(GraphTest, VarInOutPlainPaths) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule lines\n"
+"  command = lines $in_newline > $out\n"
+"  depfile = $in.d\n"
+"build out$ 1 out2: lines in1 in$ 2 in3\n"));
+
+  EXPECT_TRUE(GetNode("in1")->plain_path());
+  EXPECT_FALSE(GetNode("in 2")->plain_path());
+
+  Edge* edge = GetNode("out2")->in_edge();
+#ifdef _WIN32
+  EXPECT_EQ("lines in1\n\"in 2\"\nin3 > \"out 1\" out2",
+            edge->EvaluateCommand());
+#else
+  EXPECT_EQ("lines in1\n'in 2'\nin3 > 'out 1' out2",
+            edge->EvaluateCommand());
+#endif
+  EXPECT_EQ("in1 in 2 in3.d", edge->GetUnescapedDepfile());
+}
+
 // Regression test for https://github.com/ninja-build/ninja/issues/380
 TEST_F(GraphTest, DepfileWithCanonicalizablePath) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -509,6 +647,32 @@ TEST_F(GraphTest, DyndepLoadTrivial) {
   EXPECT_FALSE(edge->GetBindingBool("restat"));
 }
 
+TEST_F(GraphTest, DyndepLoadClearsCachedBindings) {
+  AssertParse(&state_,
+"rule r\n"
+"  command = unused\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n"
+  );
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+"  restat = 1\n"
+  );
+
+  // Looked up, and cached, before the dyndep file is loaded.
+  Edge* edge = GetNode("out")->in_edge();
+  EXPECT_FALSE(edge->GetBindingBool("restat"));
+  uint64_t hash = edge->CommandHash();
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand("unused"), hash);
+
+  string err;
+  EXPECT_TRUE(scan_.LoadDyndeps(GetNode("dd"), &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(edge->GetBindingBool("restat"));
+  EXPECT_EQ(hash, edge->CommandHash());
+}
+
 TEST_F(GraphTest, DyndepLoadMissingFile) {
   AssertParse(&state_,
 "rule r\n"
@@ -561,6 +725,65 @@ TEST_F(GraphTest, DyndepLoadExtraEntry) {
             "does not have a dyndep binding for the file", err);
 }
 
+TEST_F(GraphTest, DyndepCache) {
+  const char* manifest =
+"rule r\n"
+"  command = unused\n"
+"build out: r in || dd\n"
+"  dyndep = dd\n";
+  fs_.Create("in", "");
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+"  restat = 1\n"
+  );
+
+  // The scan reads the file, and a later one with the same mtime doesn't.
+  DyndepCache cache;
+  string err;
+  for (int i = 0; i < 2; ++i) {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+    DependencyScan scan(&state, NULL, NULL, &fs_, NULL, NULL, &cache);
+    EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("out"), &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(state.LookupNode("out")->in_edge()->GetBindingBool("restat"));
+    EXPECT_EQ(1, count(fs_.files_read_.begin(), fs_.files_read_.end(),
+                       "dd"));
+  }
+
+  // The cache outlives the run.
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("Ninja-GraphTest-DyndepCache");
+  EXPECT_EQ(LOAD_NOT_FOUND, cache.Load(".ninja_dyndep", &err));
+  cache.Prefetch(vector<string>(1, "dd"),
+                 vector<TimeStamp>(1, fs_.Stat("dd", &err)), &fs_);
+  EXPECT_EQ(2, count(fs_.files_read_.begin(), fs_.files_read_.end(), "dd"));
+  EXPECT_TRUE(cache.Write(&err));
+  ASSERT_EQ("", err);
+  DyndepCache loaded;
+  EXPECT_EQ(LOAD_SUCCESS, loaded.Load(".ninja_dyndep", &err));
+  ASSERT_EQ("", err);
+  temp_dir.Cleanup();
+
+  // A changed file is read again.
+  fs_.Tick();
+  fs_.Create("dd",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep\n"
+  );
+  for (int i = 0; i < 2; ++i) {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+    DependencyScan scan(&state, NULL, NULL, &fs_, NULL, NULL, &loaded);
+    EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("out"), &err));
+    ASSERT_EQ("", err);
+    EXPECT_FALSE(state.LookupNode("out")->in_edge()->GetBindingBool("restat"));
+    EXPECT_EQ(3, count(fs_.files_read_.begin(), fs_.files_read_.end(),
+                       "dd"));
+  }
+}
+
 TEST_F(GraphTest, DyndepLoadOutputWithMultipleRules1) {
   AssertParse(&state_,
 "rule r\n"
@@ -856,3 +1079,140 @@ TEST_F(GraphTest, DyndepFileCircular) {
   EXPECT_EQ(1u, edge->implicit_deps_);
   EXPECT_EQ(1u, edge->order_only_deps_);
 }
+
+TEST_F(GraphTest, ClearLoadedDeps) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc | manifest.h || order\n"
+"build other.o: catdep bar.cc\n"));
+  fs_.Create("foo.cc", "");
+  fs_.Create("bar.cc", "");
+  fs_.Create("manifest.h", "");
+  fs_.Create("order", "");
+  fs_.Create("out.o.d", "out.o: foo.h manifest.h\n");
+  fs_.Create("other.o.d", "other.o: foo.h\n");
+  fs_.Create("foo.h", "");
+  fs_.Create("out.o", "");
+  fs_.Create("other.o", "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out.o"), &err));
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("other.o"), &err));
+  ASSERT_EQ("", err);
+  Edge* edge = GetNode("out.o")->in_edge();
+  ASSERT_EQ(5u, edge->inputs_.size());
+  EXPECT_EQ(2u, GetNode("manifest.h")->out_edges().size());
+  EXPECT_EQ(2u, GetNode("foo.h")->out_edges().size());
+
+  vector<Edge*> edges(1, edge);
+  state_.ClearLoadedDeps(edges);
+  EXPECT_FALSE(edge->deps_loaded());
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ("manifest.h", edge->inputs_[1]->path());
+  EXPECT_EQ(1, edge->implicit_deps_);
+  EXPECT_EQ(1, edge->order_only_deps_);
+  ASSERT_EQ(1u, GetNode("manifest.h")->out_edges().size());
+  EXPECT_EQ(edge, GetNode("manifest.h")->out_edges()[0]);
+  ASSERT_EQ(1u, GetNode("foo.h")->out_edges().size());
+  EXPECT_EQ(GetNode("other.o")->in_edge(), GetNode("foo.h")->out_edges()[0]);
+
+  // The next scan loads the deps again.
+  state_.Reset();
+  fs_.Create("out.o.d", "out.o: foo.h\n");
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out.o"), &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(4u, edge->inputs_.size());
+  EXPECT_EQ("foo.h", edge->inputs_[2]->path());
+  EXPECT_EQ(2u, GetNode("foo.h")->out_edges().size());
+}
+
+// The scan only touches the hot half of a Node; paths and out-edges live
+// apart, but must still read back through the node.
+TEST_F(GraphTest, NodeLayout) {
+  EXPECT_LE(sizeof(Node), 4 * sizeof(void*));
+
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in\n"
+"build other: cat in\n"));
+  Node* in = GetNode("in");
+  EXPECT_EQ("in", in->path());
+  EXPECT_EQ(0u, in->slash_bits());
+  ASSERT_EQ(2u, in->out_edges().size());
+  EXPECT_EQ(GetNode("out")->in_edge(), in->out_edges()[0]);
+  EXPECT_EQ(GetNode("other")->in_edge(), in->out_edges()[1]);
+
+  // Resetting the scan state leaves the cold half alone.
+  state_.Reset();
+  EXPECT_EQ("in", GetNode("in")->path());
+}
+
+// Reset() doesn't walk the graph, but everything the scan set reads back
+// as it was before the scan, even across a wrap of the generation.
+TEST_F(GraphTest, ResetGeneration) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in\n"));
+  fs_.Create("out", "");
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  for (int i = 0; i < 70000; ++i) {
+    string err;
+    EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+    ASSERT_EQ("", err);
+    Edge* edge = GetNode("out")->in_edge();
+    EXPECT_TRUE(GetNode("out")->dirty());
+    EXPECT_TRUE(GetNode("in")->status_known());
+    EXPECT_EQ(Edge::VisitDone, edge->mark());
+
+    state_.Reset();
+    EXPECT_FALSE(GetNode("out")->dirty());
+    EXPECT_FALSE(GetNode("in")->status_known());
+    EXPECT_EQ(Edge::VisitNone, edge->mark());
+    EXPECT_FALSE(edge->outputs_ready());
+    EXPECT_FALSE(edge->deps_loaded());
+  }
+}
+
+// Resetting one State leaves what was found out about another alone.
+TEST_F(GraphTest, ResetOtherState) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in\n"));
+  fs_.Create("in", "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("out")->dirty());
+
+  for (int i = 0; i < 70000; ++i) {
+    State other;
+    other.GetNode("in", 0);
+    other.Reset();
+  }
+  EXPECT_TRUE(GetNode("out")->dirty());
+  EXPECT_TRUE(GetNode("in")->status_known());
+  EXPECT_EQ(Edge::VisitDone, GetNode("out")->in_edge()->mark());
+}
+
+// A chain far deeper than a recursive scan's stack would allow.
+TEST_F(GraphTest, DeepChain) {
+  const int kDepth = 100000;
+  string manifest;
+  char buf[64];
+  for (int i = 0; i < kDepth; ++i) {
+    snprintf(buf, sizeof(buf), "build n%d: cat n%d\n", i + 1, i);
+    manifest += buf;
+  }
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  fs_.Create("n0", "");
+
+  string err;
+  snprintf(buf, sizeof(buf), "n%d", kDepth);
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode(buf), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode(buf)->dirty());
+  EXPECT_TRUE(GetNode("n1")->dirty());
+  EXPECT_FALSE(GetNode(buf)->in_edge()->outputs_ready());
+}
@@ -20,27 +20,57 @@
 #include "dyndep.h"
 #include "graph.h"
 
+namespace {
+
+/// Write |str| as a JSON string.
+void WriteJSONString(FILE* file, const string& str) {
+  fputc('"', file);
+  for (string::const_iterator c = str.begin(); c != str.end(); ++c) {
+    if (*c == '"' || *c == '\\')
+      fprintf(file, "\\%c", *c);
+    else if ((unsigned char)*c < 0x20)
+      fprintf(file, "\\u%04x", (unsigned char)*c);
+    else
+      fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+/// Write the paths of [|begin|, |end|) as a JSON array.
+void WriteJSONPaths(FILE* file, Node* const* begin, Node* const* end) {
+  fputc('[', file);
+  for (Node* const* n = begin; n != end; ++n) {
+    if (n != begin)
+      fputc(',', file);
+    WriteJSONString(file, (*n)->path());
+  }
+  fputc(']', file);
+}
+
+}  // anonymous namespace
+
 void GraphViz::AddTarget(Node* node) {
   if (visited_nodes_.find(node) != visited_nodes_.end())
     return;
-
-  string pathstr = node->path();
-  replace(pathstr.begin(), pathstr.end(), '\\', '/');
-  printf("\"%p\" [label=\"%s\"]\n", node, pathstr.c_str());
+  if (max_nodes_ && nodes_ >= max_nodes_)
+    return;
   visited_nodes_.insert(node);
+  ++nodes_;
+  queue_.clear();
+  queue_.push_back(make_pair(node, 0));
+  for (size_t i = 0; i < queue_.size(); ++i)
+    AddNode(queue_[i].first, queue_[i].second);
+}
 
+void GraphViz::AddNode(Node* node, int depth) {
   Edge* edge = node->in_edge();
-
   if (!edge) {
     // Leaf node.
     // Draw as a rect?
+    WriteNode(node, false);
     return;
   }
 
-  if (visited_edges_.find(edge) != visited_edges_.end())
-    return;
-  visited_edges_.insert(edge);
-
   if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
     std::string err;
     if (!dyndep_loader_.LoadDyndeps(edge->dyndep_, &err)) {
@@ -48,41 +78,104 @@ void GraphViz::AddTarget(Node* node) {
     }
   }
 
+  // Only follow the edge if all the inputs new to the graph fit.
+  bool fits = max_depth_ < 0 || depth < max_depth_;
+  if (fits && max_nodes_) {
+    vector<Node*> added;
+    for (Node** in = edge->inputs_.begin(); in != edge->inputs_.end(); ++in) {
+      if (visited_nodes_.find(*in) == visited_nodes_.end())
+        added.push_back(*in);
+    }
+    sort(added.begin(), added.end());
+    fits = nodes_ + (unique(added.begin(), added.end()) - added.begin()) <=
+        max_nodes_;
+  }
+  if (!fits) {
+    WriteNode(node, true);
+    return;
+  }
+  for (Node** in = edge->inputs_.begin(); in != edge->inputs_.end(); ++in) {
+    if (visited_nodes_.insert(*in).second) {
+      ++nodes_;
+      queue_.push_back(make_pair(*in, depth + 1));
+    }
+  }
+
+  WriteNode(node, false);
+  if (format_ == DOT && visited_edges_.insert(edge).second)
+    WriteEdge(edge);
+}
+
+void GraphViz::WriteNode(Node* node, bool truncated) {
+  Edge* edge = node->in_edge();
+  if (format_ == JSON) {
+    fputs(written_++ ? ",\n{\"path\":" : "\n{\"path\":", out_);
+    WriteJSONString(out_, node->path());
+    if (edge) {
+      fputs(",\"rule\":", out_);
+      WriteJSONString(out_, edge->rule_->name());
+      if (truncated) {
+        fputs(",\"truncated\":true", out_);
+      } else {
+        Node* const* explicit_end = edge->inputs_.end() -
+            edge->implicit_deps_ - edge->order_only_deps_;
+        Node* const* implicit_end = edge->inputs_.end() -
+            edge->order_only_deps_;
+        fputs(",\"explicit\":", out_);
+        WriteJSONPaths(out_, edge->inputs_.begin(), explicit_end);
+        fputs(",\"implicit\":", out_);
+        WriteJSONPaths(out_, explicit_end, implicit_end);
+        fputs(",\"order_only\":", out_);
+        WriteJSONPaths(out_, implicit_end, edge->inputs_.end());
+      }
+    }
+    fputc('}', out_);
+    return;
+  }
+
+  string pathstr = node->path();
+  replace(pathstr.begin(), pathstr.end(), '\\', '/');
+  fprintf(out_, "\"%p\" [label=\"%s\"%s]\n", node, pathstr.c_str(),
+          truncated ? ", style=dashed" : "");
+}
+
+void GraphViz::WriteEdge(Edge* edge) {
   if (edge->inputs_.size() == 1 && edge->outputs_.size() == 1) {
     // Can draw simply.
     // Note extra space before label text -- this is cosmetic and feels
     // like a graphviz bug.
-    printf("\"%p\" -> \"%p\" [label=\" %s\"]\n",
-           edge->inputs_[0], edge->outputs_[0], edge->rule_->name().c_str());
-  } else {
-    printf("\"%p\" [label=\"%s\", shape=ellipse]\n",
-           edge, edge->rule_->name().c_str());
-    for (vector<Node*>::iterator out = edge->outputs_.begin();
-         out != edge->outputs_.end(); ++out) {
-      printf("\"%p\" -> \"%p\"\n", edge, *out);
-    }
-    for (vector<Node*>::iterator in = edge->inputs_.begin();
-         in != edge->inputs_.end(); ++in) {
-      const char* order_only = "";
-      if (edge->is_order_only(in - edge->inputs_.begin()))
-        order_only = " style=dotted";
-      printf("\"%p\" -> \"%p\" [arrowhead=none%s]\n", (*in), edge, order_only);
-    }
+    fprintf(out_, "\"%p\" -> \"%p\" [label=\" %s\"]\n",
+            edge->inputs_[0], edge->outputs_[0],
+            edge->rule_->name().c_str());
+    return;
   }
-
-  for (vector<Node*>::iterator in = edge->inputs_.begin();
+  fprintf(out_, "\"%p\" [label=\"%s\", shape=ellipse]\n",
+          edge, edge->rule_->name().c_str());
+  for (Node** out = edge->outputs_.begin();
+       out != edge->outputs_.end(); ++out) {
+    fprintf(out_, "\"%p\" -> \"%p\"\n", edge, *out);
+  }
+  for (Node** in = edge->inputs_.begin();
        in != edge->inputs_.end(); ++in) {
-    AddTarget(*in);
+    const char* order_only = "";
+    if (edge->is_order_only(in - edge->inputs_.begin()))
+      order_only = " style=dotted";
+    fprintf(out_, "\"%p\" -> \"%p\" [arrowhead=none%s]\n", (*in), edge,
+            order_only);
   }
 }
 
 void GraphViz::Start() {
-  printf("digraph ninja {\n");
-  printf("rankdir=\"LR\"\n");
-  printf("node [fontsize=10, shape=box, height=0.25]\n");
-  printf("edge [fontsize=10]\n");
+  if (format_ == JSON) {
+    fputc('[', out_);
+    return;
+  }
+  fprintf(out_, "digraph ninja {\n");
+  fprintf(out_, "rankdir=\"LR\"\n");
+  fprintf(out_, "node [fontsize=10, shape=box, height=0.25]\n");
+  fprintf(out_, "edge [fontsize=10]\n");
 }
 
 void GraphViz::Finish() {
-  printf("}\n");
+  fprintf(out_, format_ == JSON ? "\n]\n" : "}\n");
 }
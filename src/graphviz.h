@@ -15,7 +15,10 @@
 #ifndef NINJA_GRAPHVIZ_H_
 #define NINJA_GRAPHVIZ_H_
 
+#include <stdio.h>
+
 #include <set>
+#include <vector>
 
 #include "dyndep.h"
 
@@ -24,10 +27,22 @@ struct Node;
 struct Edge;
 struct State;
 
-/// Runs the process of creating GraphViz .dot file output.
+/// Runs the process of creating GraphViz .dot file output, or a JSON
+/// array of the nodes with the inputs of each, written out as the graph is
+/// walked.
+///
+/// The graph is walked breadth first from the targets, so that with a
+/// depth or node limit what's written is what's nearest to them.  A node
+/// whose inputs are left out for the limits is marked as truncated.
 struct GraphViz {
+  enum Format {
+    DOT,
+    JSON
+  };
+
   GraphViz(State* state, DiskInterface* disk_interface)
-      : dyndep_loader_(state, disk_interface) {}
+      : dyndep_loader_(state, disk_interface), format_(DOT), max_depth_(-1),
+        max_nodes_(0), out_(stdout), nodes_(0), written_(0) {}
   void Start();
   void AddTarget(Node* node);
   void Finish();
@@ -35,6 +50,26 @@ struct GraphViz {
   DyndepLoader dyndep_loader_;
   std::set<Node*> visited_nodes_;
   std::set<Edge*> visited_edges_;
+
+  Format format_;
+  /// The number of edges to follow from the targets, or -1 for all.
+  int max_depth_;
+  /// The number of nodes to write at most, or 0 for no limit.
+  size_t max_nodes_;
+  FILE* out_;
+
+ private:
+  /// Write |node|, and queue its inputs at |depth| + 1.
+  void AddNode(Node* node, int depth);
+  void WriteNode(Node* node, bool truncated);
+  void WriteEdge(Edge* edge);
+
+  /// The nodes written and yet to be expanded, with their depths.
+  std::vector<std::pair<Node*, int> > queue_;
+  /// The number of nodes queued, written or to be.
+  size_t nodes_;
+  /// The number of nodes written.
+  size_t written_;
 };
 
 #endif  // NINJA_GRAPHVIZ_H_
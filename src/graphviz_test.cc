@@ -0,0 +1,100 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "graphviz.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct GraphVizTest : public StateTestWithBuiltinRules {
+  GraphVizTest() : graph_(&state_, &fs_) {}
+
+  virtual void SetUp() {
+    AssertParse(&state_,
+"build out: cat mid1 mid2 | imp || order\n"
+"build mid1: cat in1\n"
+"build mid2: cat in2\n");
+    graph_.out_ = tmpfile();
+  }
+
+  virtual void TearDown() {
+    fclose(graph_.out_);
+  }
+
+  /// What |graph_| wrote for "out".
+  string Write() {
+    graph_.Start();
+    graph_.AddTarget(GetNode("out"));
+    graph_.Finish();
+    string contents;
+    rewind(graph_.out_);
+    char buf[1024];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), graph_.out_)) > 0)
+      contents.append(buf, len);
+    return contents;
+  }
+
+  VirtualFileSystem fs_;
+  GraphViz graph_;
+};
+
+TEST_F(GraphVizTest, JSON) {
+  graph_.format_ = GraphViz::JSON;
+  EXPECT_EQ("[\n"
+"{\"path\":\"out\",\"rule\":\"cat\",\"explicit\":[\"mid1\",\"mid2\"],"
+"\"implicit\":[\"imp\"],\"order_only\":[\"order\"]},\n"
+"{\"path\":\"mid1\",\"rule\":\"cat\",\"explicit\":[\"in1\"],"
+"\"implicit\":[],\"order_only\":[]},\n"
+"{\"path\":\"mid2\",\"rule\":\"cat\",\"explicit\":[\"in2\"],"
+"\"implicit\":[],\"order_only\":[]},\n"
+"{\"path\":\"imp\"},\n"
+"{\"path\":\"order\"},\n"
+"{\"path\":\"in1\"},\n"
+"{\"path\":\"in2\"}\n"
+"]\n", Write());
+}
+
+TEST_F(GraphVizTest, MaxDepth) {
+  graph_.format_ = GraphViz::JSON;
+  graph_.max_depth_ = 1;
+  string json = Write();
+  EXPECT_NE(string::npos, json.find("{\"path\":\"mid1\",\"rule\":\"cat\","
+                                    "\"truncated\":true}"));
+  EXPECT_EQ(string::npos, json.find("in1"));
+}
+
+TEST_F(GraphVizTest, MaxNodes) {
+  // All four inputs of "out" don't fit.
+  graph_.format_ = GraphViz::JSON;
+  graph_.max_nodes_ = 4;
+  EXPECT_EQ("[\n"
+"{\"path\":\"out\",\"rule\":\"cat\",\"truncated\":true}\n"
+"]\n", Write());
+}
+
+TEST_F(GraphVizTest, Dot) {
+  graph_.max_depth_ = 1;
+  string dot = Write();
+  EXPECT_EQ(0u, dot.find("digraph ninja {\n"));
+  EXPECT_NE(string::npos, dot.find("[label=\"mid1\", style=dashed]\n"));
+  EXPECT_NE(string::npos, dot.find("[label=\"cat\", shape=ellipse]\n"));
+  EXPECT_NE(string::npos, dot.find("[arrowhead=none style=dotted]\n"));
+  EXPECT_EQ(dot.size() - 2, dot.find("}\n"));
+}
+
+}  // anonymous namespace
@@ -13,8 +13,13 @@
 // limitations under the License.
 
 #include "build_log.h"
+#include "hash.h"
+#include "hash_map.h"
+#include "metrics.h"
 
 #include <algorithm>
+#include <string>
+#include <vector>
 using namespace std;
 
 #include <stdlib.h>
@@ -31,6 +36,93 @@ void RandomCommand(char** s) {
     (*s)[i] = (char)random(32, 127);
 }
 
+/// Print how many MB/s HashBytes() gets through in pieces of |size| bytes.
+void BenchThroughput(size_t size) {
+  const size_t kTotal = 256 << 20;
+  string data(size + 64, 'x');
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = (char)random(32, 127);
+  uint64_t sum = 0;
+  int64_t start = GetTimeMillis();
+  for (size_t done = 0; done < kTotal; done += size) {
+    // Vary the start, so that the hash can't be hoisted out of the loop.
+    sum += HashBytes(data.data() + (done & 63), size);
+  }
+  int64_t ms = GetTimeMillis() - start;
+  printf("  %6d bytes: %8.0f MB/s  (%d)\n", (int)size,
+         (kTotal >> 20) * 1000.0 / (ms > 0 ? ms : 1), (int)(sum & 1));
+}
+
+/// Lay the hashes of |paths| out as StringPieceHashMap does after a
+/// reserve() for them, and print how far lookups probe on average, next to
+/// what uniform hashes would give.
+void BenchProbeLengths(const vector<string>& paths) {
+  size_t capacity = 16;
+  while (capacity - capacity / 4 < paths.size())
+    capacity *= 2;
+  vector<bool> used(capacity);
+  size_t mask = capacity - 1;
+  uint64_t probes = 0;
+  size_t longest = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    size_t slot = StringPieceHashMap<int>::Hash(paths[i]) & mask;
+    size_t length = 1;
+    while (used[slot]) {
+      slot = (slot + 1) & mask;
+      ++length;
+    }
+    used[slot] = true;
+    probes += length;
+    if (length > longest)
+      longest = length;
+  }
+  double load = (double)paths.size() / capacity;
+  printf("  %.2f probes per lookup at %.0f%% load (uniform: %.2f), "
+         "longest %d\n", (double)probes / paths.size(), 100 * load,
+         (1 + 1 / (1 - load)) / 2, (int)longest);
+}
+
+/// Time inserting |paths| into a map of type Map and looking each up
+/// |rounds| times, and return the milliseconds that took.
+template<typename Map>
+int64_t TimeLookups(const vector<string>& paths, int rounds) {
+  int64_t start = GetTimeMillis();
+  Map map;
+  for (size_t i = 0; i < paths.size(); ++i)
+    map[paths[i]] = (int)i;
+  int found = 0;
+  for (int r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < paths.size(); ++i)
+      found += map.find(paths[i]) != map.end();
+  }
+  if (found != rounds * (int)paths.size())
+    printf("lost some paths!\n");
+  return GetTimeMillis() - start;
+}
+
+/// Compare the path maps ninja uses with the std::unordered_map they
+/// replaced, on paths shaped like those of a large build.
+void BenchPathLookups() {
+  const int kPaths = 1000 * 1000;
+  const int kRounds = 5;
+  vector<string> paths;
+  paths.reserve(kPaths);
+  char buf[128];
+  for (int i = 0; i < kPaths; ++i) {
+    snprintf(buf, sizeof(buf), "out/obj/third_party/module%d/src/file%d.o",
+             random(0, 2000), i);
+    paths.push_back(buf);
+  }
+  BenchProbeLengths(paths);
+  printf("%d paths, %d lookups each:\n", kPaths, kRounds);
+  printf("  StringPieceHashMap: %dms\n",
+         (int)TimeLookups<StringPieceHashMap<int> >(paths, kRounds));
+#if (__cplusplus >= 201103L) || (_MSC_VER >= 1900)
+  printf("  std::unordered_map: %dms\n",
+         (int)TimeLookups<unordered_map<StringPiece, int> >(paths, kRounds));
+#endif
+}
+
 int main() {
   const int N = 20 * 1000 * 1000;
 
@@ -60,4 +152,11 @@ int main() {
     }
   }
   printf("\n\n%d collisions after %d runs\n", collision_count, N);
+
+  printf("HashBytes() throughput:\n");
+  const size_t kSizes[] = { 16, 64, 256, 4096, 65536 };
+  for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i)
+    BenchThroughput(kSizes[i]);
+
+  BenchPathLookups();
 }
@@ -0,0 +1,409 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "build_log.h"
+#include "graph.h"
+#include "metrics.h"
+
+namespace {
+
+const char kFileSignature[] = "# ninjahashes\n";
+const int kCurrentVersion = 2;
+
+/// The high bit of a record's size marks output records.
+const unsigned kOutputRecord = 0x80000000;
+const unsigned kMaxRecordSize = (1 << 19) - 1;
+
+template<typename T>
+void Append(string* out, T value) {
+  out->append((const char*)&value, sizeof(value));
+}
+
+template<typename T>
+void Read(const char** data, T* value) {
+  memcpy(value, *data, sizeof(*value));
+  *data += sizeof(*value);
+}
+
+/// The size of the fixed part of each kind of record, before the path.
+const unsigned kFileRecordSize = 8 * 4;
+const unsigned kOutputRecordSize = 8 * 3;
+
+bool WriteRecord(string* out, bool output, const string& path,
+                 const uint64_t* fields, int field_count) {
+  unsigned size = 8 * field_count + path.size();
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return false;
+  }
+  Append(out, output ? size | kOutputRecord : size);
+  out->append((const char*)fields, 8 * field_count);
+  out->append(path);
+  return true;
+}
+
+/// The stat() fields that tell whether a file may have changed, and its
+/// mtime in seconds.  Returns false and sets errno on error.
+bool StatFile(const string& path, TimeStamp* mtime, uint64_t* size,
+              uint64_t* inode, time_t* seconds) {
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64(path.c_str(), &st) < 0)
+    return false;
+  *mtime = st.st_mtime;
+  *inode = 0;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return false;
+#if defined(__APPLE__)
+  *mtime = ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
+            st.st_mtimespec.tv_nsec);
+#elif defined(st_mtime)  // A macro, so we're likely on modern POSIX.
+  *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  *mtime = st.st_mtime;
+#endif
+  *inode = st.st_ino;
+#endif
+  if ((st.st_mode & S_IFMT) != S_IFREG) {
+    errno = EISDIR;
+    return false;
+  }
+  *size = st.st_size;
+  *seconds = st.st_mtime;
+  return true;
+}
+
+bool PathLess(const Node* a, const Node* b) {
+  return a->path() < b->path();
+}
+
+}  // anonymous namespace
+
+HashLog::~HashLog() {
+  Close();
+}
+
+bool HashLog::OpenForWrite(const string& path, string* err) {
+  path_ = path;
+  if (needs_recompaction_)
+    return Recompact(path, err);
+  return true;
+}
+
+void HashLog::Close() {
+  if (writer_.is_open() && !writer_.Close())
+    Warning("writing hash log: %s", strerror(errno));
+}
+
+LoadStatus HashLog::Load(const string& path, string* err) {
+  METRIC_RECORD_PHASE(".ninja_hashes load");
+  MappedFile mapped;
+  int status = mapped.Map(path, err);
+  if (status < 0) {
+    if (status == -ENOENT) {
+      err->clear();
+      return LOAD_NOT_FOUND;
+    }
+    return LOAD_ERROR;
+  }
+  const char* data = mapped.data();
+  size_t size = mapped.size();
+
+  const size_t kHeaderSize = sizeof(kFileSignature) - 1 + 4;
+  int version = 0;
+  if (size >= kHeaderSize)
+    memcpy(&version, data + kHeaderSize - 4, 4);
+  if (size < kHeaderSize ||
+      memcmp(data, kFileSignature, sizeof(kFileSignature) - 1) != 0 ||
+      version != kCurrentVersion) {
+    *err = "bad hash log signature or version; starting over";
+    mapped.Unmap();
+    unlink(path.c_str());
+    // Without hashes, outputs are judged by their mtimes alone.
+    return LOAD_SUCCESS;
+  }
+
+  size_t offset = kHeaderSize;
+  int record_count = 0;
+  while (offset < size) {
+    unsigned record_size;
+    if (size - offset < 4)
+      break;
+    memcpy(&record_size, data + offset, 4);
+    bool is_output = (record_size & kOutputRecord) != 0;
+    record_size &= ~kOutputRecord;
+    unsigned fixed_size = is_output ? kOutputRecordSize : kFileRecordSize;
+    if (record_size > size - offset - 4 || record_size <= fixed_size)
+      break;
+    const char* p = data + offset + 4;
+    string record_path(p + fixed_size, record_size - fixed_size);
+    if (is_output) {
+      OutputEntry& entry = outputs_[record_path];
+      Read(&p, &entry.mtime);
+      Read(&p, &entry.inputs_hash);
+      Read(&p, &entry.contents_hash);
+    } else {
+      FileEntry& entry = files_[record_path];
+      Read(&p, &entry.mtime);
+      Read(&p, &entry.size);
+      Read(&p, &entry.inode);
+      Read(&p, &entry.hash);
+    }
+    ++record_count;
+    offset += 4 + record_size;
+  }
+
+  if (offset < size) {
+    // Rewriting the log drops the partial record, which a crash while
+    // appending it may have left.
+    *err = "premature end of file; recovering";
+    needs_recompaction_ = true;
+    return LOAD_SUCCESS;
+  }
+
+  // Rebuild the log if there are too many dead records.
+  int kMinCompactionEntryCount = 1000;
+  int kCompactionRatio = 3;
+  int unique_count = files_.size() + outputs_.size();
+  if (record_count > kMinCompactionEntryCount &&
+      record_count > unique_count * kCompactionRatio) {
+    needs_recompaction_ = true;
+  }
+  return LOAD_SUCCESS;
+}
+
+bool HashLog::GetFileHash(const string& path, uint64_t* hash) {
+  FileEntry current;
+  time_t seconds;
+  if (!StatFile(path, &current.mtime, &current.size, &current.inode,
+                &seconds)) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      *hash = 0;
+      return true;
+    }
+    return false;
+  }
+
+  map<string, FileEntry>::iterator i = files_.find(path);
+  if (i != files_.end() && i->second.mtime == current.mtime &&
+      i->second.size == current.size && i->second.inode == current.inode) {
+    *hash = i->second.hash;
+    return true;
+  }
+
+  METRIC_RECORD("hash input file");
+  MappedFile mapped;
+  string err;
+  if (mapped.Map(path, &err) < 0)
+    return false;
+  current.hash = BuildLog::LogEntry::HashCommand(
+      StringPiece(mapped.data(), mapped.size()));
+  *hash = current.hash;
+
+  // A file modified within the last moments could change again without
+  // its mtime moving, given the granularity of the file system's clock, so
+  // its hash may only be used this once.
+  if (time(NULL) - seconds < 2)
+    return true;
+  files_[path] = current;
+
+  uint64_t fields[] = {
+    (uint64_t)current.mtime, current.size, current.inode, current.hash
+  };
+  string record;
+  if (WriteRecord(&record, false, path, fields, 4) && !AppendRecord(record))
+    Warning("writing hash log: %s", strerror(errno));
+  return true;
+}
+
+bool HashLog::HashInputs(const vector<Node*>& inputs, uint64_t* hash) {
+  vector<Node*> sorted(inputs);
+  sort(sorted.begin(), sorted.end(), PathLess);
+  sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+  string hashes;
+  for (vector<Node*>::iterator i = sorted.begin(); i != sorted.end(); ++i) {
+    uint64_t file_hash;
+    if (!GetFileHash((*i)->path(), &file_hash))
+      return false;
+    hashes.append((*i)->path());
+    hashes.push_back('\0');
+    Append(&hashes, file_hash);
+  }
+  *hash = BuildLog::LogEntry::HashCommand(hashes);
+  return true;
+}
+
+bool HashLog::InputsUnchanged(const Edge* edge, const Node* output) {
+  map<string, OutputEntry>::iterator i = outputs_.find(output->path());
+  if (i == outputs_.end() || i->second.mtime != output->mtime())
+    return false;
+  vector<Node*> inputs(edge->inputs_.begin(),
+                       edge->inputs_.end() - edge->order_only_deps_);
+  uint64_t hash;
+  return HashInputs(inputs, &hash) && hash == i->second.inputs_hash;
+}
+
+bool HashLog::RecordEdge(const Edge* edge, const vector<Node*>& extra_inputs,
+                         const vector<TimeStamp>& output_mtimes,
+                         string* err) {
+  vector<Node*> inputs(edge->inputs_.begin(),
+                       edge->inputs_.end() - edge->order_only_deps_);
+  inputs.insert(inputs.end(), extra_inputs.begin(), extra_inputs.end());
+  uint64_t hash;
+  // An input that can't be read can't be vouched for; the mtimes decide.
+  if (!HashInputs(inputs, &hash))
+    return true;
+
+  assert(output_mtimes.size() == edge->outputs_.size());
+  for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+    const string& path = edge->outputs_[i]->path();
+    TimeStamp mtime = output_mtimes[i];
+    OutputEntry& entry = outputs_[path];
+    if (entry.mtime == mtime && entry.inputs_hash == hash)
+      continue;
+    entry.mtime = mtime;
+    entry.inputs_hash = hash;
+    if (!WriteOutput(path, entry, err))
+      return false;
+  }
+  return true;
+}
+
+bool HashLog::RecordContents(const string& path, bool* unchanged,
+                             string* err) {
+  *unchanged = false;
+  METRIC_RECORD("hash output file");
+  MappedFile mapped;
+  string map_err;
+  if (mapped.Map(path, &map_err) < 0)
+    return true;
+  // 0 marks outputs without recorded contents.
+  uint64_t hash = BuildLog::LogEntry::HashCommand(
+      StringPiece(mapped.data(), mapped.size())) | 1;
+
+  OutputEntry& entry = outputs_[path];
+  if (entry.contents_hash == hash) {
+    *unchanged = true;
+    return true;
+  }
+  entry.contents_hash = hash;
+  return WriteOutput(path, entry, err);
+}
+
+bool HashLog::WriteOutput(const string& path, const OutputEntry& entry,
+                          string* err) {
+  uint64_t fields[] = {
+    (uint64_t)entry.mtime, entry.inputs_hash, entry.contents_hash
+  };
+  string record;
+  if (!WriteRecord(&record, true, path, fields, 3) ||
+      !AppendRecord(record)) {
+    *err = string("writing hash log: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool HashLog::AppendRecord(const string& record) {
+  if (!writer_.is_open()) {
+    if (path_.empty())
+      return true;
+    FILE* f = fopen(path_.c_str(), "ab");
+    if (!f)
+      return false;
+    SetCloseOnExec(fileno(f));
+    // Opening a file in append mode doesn't set the file pointer to the
+    // file's end on Windows. Do that explicitly.
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0 &&
+        (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) < 1 ||
+         fwrite(&kCurrentVersion, 4, 1, f) < 1 || fflush(f) != 0)) {
+      fclose(f);
+      return false;
+    }
+    writer_.Open(f);
+  }
+  return writer_.Append(record);
+}
+
+bool HashLog::Recompact(const string& path, string* err) {
+  METRIC_RECORD_PHASE(".ninja_hashes recompact");
+  needs_recompaction_ = false;
+  Close();
+
+  string temp_path = path + ".recompact";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) == 1 &&
+      fwrite(&kCurrentVersion, 4, 1, f) == 1;
+  string record;
+  for (map<string, FileEntry>::iterator i = files_.begin();
+       ok && i != files_.end(); ++i) {
+    uint64_t fields[] = {
+      (uint64_t)i->second.mtime, i->second.size, i->second.inode,
+      i->second.hash
+    };
+    record.clear();
+    ok = WriteRecord(&record, false, i->first, fields, 4) &&
+        fwrite(record.data(), record.size(), 1, f) == 1;
+  }
+  for (map<string, OutputEntry>::iterator i = outputs_.begin();
+       ok && i != outputs_.end(); ++i) {
+    uint64_t fields[] = {
+      (uint64_t)i->second.mtime, i->second.inputs_hash,
+      i->second.contents_hash
+    };
+    record.clear();
+    ok = WriteRecord(&record, true, i->first, fields, 3) &&
+        fwrite(record.data(), record.size(), 1, f) == 1;
+  }
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,111 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_HASH_LOG_H_
+#define NINJA_HASH_LOG_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "load_status.h"
+#include "log_writer.h"
+#include "timestamp.h"
+#include "util.h"  // For uint64_t.
+
+struct Edge;
+struct Node;
+
+/// Remembers the contents of the inputs of the edges with hash_inputs set,
+/// so that an input which was touched without changing, as by checking out
+/// another branch and back, doesn't make their outputs dirty.
+///
+/// The log keeps a hash of each input file along with the mtime, size and
+/// inode it had when it was hashed, so that files are only read again when
+/// one of those changed.  For each output it keeps a hash over the inputs
+/// it was built from and the mtime it had right after.  When the output
+/// changed since, for instance by a build without the log, the record is
+/// ignored.
+///
+/// For the outputs of rules with "restat = hash" it also keeps a hash of
+/// the contents the command last wrote, so that an output rewritten with
+/// the same contents can count as unchanged.
+struct HashLog {
+  HashLog() : needs_recompaction_(false) {}
+  ~HashLog();
+
+  /// Prepare to append to |path|.  The file is only created once there's
+  /// something to write.
+  bool OpenForWrite(const string& path, string* err);
+  void Close();
+
+  LoadStatus Load(const string& path, string* err);
+
+  /// Get the hash of the contents of |path|, reading it only if it's new
+  /// or changed.  A file that doesn't exist has hash 0.  Returns false if
+  /// it can't be read.
+  bool GetFileHash(const string& path, uint64_t* hash);
+
+  /// Returns true if |output| of |edge| was recorded with the inputs the
+  /// edge has now, and those have the same contents they had then.
+  bool InputsUnchanged(const Edge* edge, const Node* output);
+
+  /// Record the hash of the inputs of |edge|, plus |extra_inputs| which
+  /// the next scan will find among them, for each of its outputs, with
+  /// the mtime in |output_mtimes| at the same index.
+  bool RecordEdge(const Edge* edge, const vector<Node*>& extra_inputs,
+                  const vector<TimeStamp>& output_mtimes, string* err);
+
+  /// Hash the contents of |path| as its command just wrote them, and
+  /// record them.  Sets |*unchanged| if they're the contents recorded the
+  /// last time.  A file that can't be read counts as changed.
+  bool RecordContents(const string& path, bool* unchanged, string* err);
+
+  /// Rewrite the log with only the latest records.
+  bool Recompact(const string& path, string* err);
+
+ private:
+  struct FileEntry {
+    TimeStamp mtime;
+    uint64_t size;
+    uint64_t inode;
+    uint64_t hash;
+  };
+  struct OutputEntry {
+    TimeStamp mtime;
+    uint64_t inputs_hash;
+    /// 0 if not recorded.
+    uint64_t contents_hash;
+  };
+
+  /// Compute the hash over the paths and contents of |inputs|.  Returns
+  /// false if one of them can't be read.
+  bool HashInputs(const vector<Node*>& inputs, uint64_t* hash);
+
+  /// Write the record of the output |path|.
+  bool WriteOutput(const string& path, const OutputEntry& entry,
+                   string* err);
+
+  /// Queue |record| for writing, creating the file if it's the first.
+  bool AppendRecord(const string& record);
+
+  map<string, FileEntry> files_;
+  map<string, OutputEntry> outputs_;
+  string path_;
+  bool needs_recompaction_;
+  LogWriter writer_;
+};
+
+#endif  // NINJA_HASH_LOG_H_
@@ -0,0 +1,159 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_log.h"
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "HashLogTest-tempfile";
+
+struct HashLogTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-HashLogTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(HashLogTest, FileHash) {
+  HashLog log;
+  uint64_t hash, again;
+  ASSERT_TRUE(disk_.WriteFile("in", "hello"));
+  ASSERT_TRUE(log.GetFileHash("in", &hash));
+  EXPECT_NE(0u, hash);
+
+  // Rewriting the same contents keeps the hash.
+  ASSERT_TRUE(disk_.WriteFile("in", "hello"));
+  ASSERT_TRUE(log.GetFileHash("in", &again));
+  EXPECT_EQ(hash, again);
+
+  ASSERT_TRUE(disk_.WriteFile("in", "hello world"));
+  ASSERT_TRUE(log.GetFileHash("in", &again));
+  EXPECT_NE(hash, again);
+
+  ASSERT_TRUE(log.GetFileHash("missing", &hash));
+  EXPECT_EQ(0u, hash);
+}
+
+TEST_F(HashLogTest, RecordAndLoad) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in1 in2 | imp || oo\n"
+"build other: cat in1\n"));
+  ASSERT_TRUE(disk_.WriteFile("in1", "one"));
+  ASSERT_TRUE(disk_.WriteFile("in2", "two"));
+  ASSERT_TRUE(disk_.WriteFile("imp", "imp"));
+  ASSERT_TRUE(disk_.WriteFile("oo", "oo"));
+  ASSERT_TRUE(disk_.WriteFile("out", "out"));
+  Node* out = GetNode("out");
+  Edge* edge = out->in_edge();
+
+  string err;
+  {
+    HashLog log;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_TRUE(out->Stat(&disk_, &err));
+    ASSERT_TRUE(log.RecordEdge(edge, vector<Node*>(),
+                               vector<TimeStamp>(1, out->mtime()), &err));
+    ASSERT_EQ("", err);
+    log.Close();
+  }
+
+  HashLog log;
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.InputsUnchanged(edge, out));
+
+  // Touching an input, or changing an order-only one, doesn't matter.
+  ASSERT_TRUE(disk_.WriteFile("in1", "one"));
+  ASSERT_TRUE(disk_.WriteFile("oo", "changed"));
+  EXPECT_TRUE(log.InputsUnchanged(edge, out));
+
+  ASSERT_TRUE(disk_.WriteFile("imp", "changed"));
+  EXPECT_FALSE(log.InputsUnchanged(edge, out));
+  ASSERT_TRUE(disk_.WriteFile("imp", "imp"));
+  EXPECT_TRUE(log.InputsUnchanged(edge, out));
+
+  // Nothing was recorded for the other output.
+  Node* other = GetNode("other");
+  EXPECT_FALSE(log.InputsUnchanged(other->in_edge(), other));
+}
+
+TEST_F(HashLogTest, ExtraInputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in\n"));
+  ASSERT_TRUE(disk_.WriteFile("in", "in"));
+  ASSERT_TRUE(disk_.WriteFile("in.h", "header"));
+  ASSERT_TRUE(disk_.WriteFile("out", "out"));
+  Node* out = GetNode("out");
+  Edge* edge = out->in_edge();
+
+  HashLog log;
+  string err;
+  vector<Node*> deps;
+  deps.push_back(GetNode("in.h"));
+  ASSERT_TRUE(out->Stat(&disk_, &err));
+  ASSERT_TRUE(log.RecordEdge(edge, deps, vector<TimeStamp>(1, out->mtime()),
+                             &err));
+
+  // The header isn't an input of the edge before its deps are loaded.
+  EXPECT_FALSE(log.InputsUnchanged(edge, out));
+  edge->inputs_.push_back(GetNode("in.h"));
+  edge->implicit_deps_++;
+  EXPECT_TRUE(log.InputsUnchanged(edge, out));
+}
+
+TEST_F(HashLogTest, Contents) {
+  string err;
+  bool unchanged;
+  {
+    HashLog log;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_TRUE(disk_.WriteFile("out", "generated"));
+    ASSERT_TRUE(log.RecordContents("out", &unchanged, &err));
+    EXPECT_FALSE(unchanged);
+    ASSERT_TRUE(log.RecordContents("out", &unchanged, &err));
+    EXPECT_TRUE(unchanged);
+    log.Close();
+  }
+
+  HashLog log;
+  EXPECT_EQ(LOAD_SUCCESS, log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(disk_.WriteFile("out", "generated"));
+  ASSERT_TRUE(log.RecordContents("out", &unchanged, &err));
+  EXPECT_TRUE(unchanged);
+
+  ASSERT_TRUE(disk_.WriteFile("out", "generated again"));
+  ASSERT_TRUE(log.RecordContents("out", &unchanged, &err));
+  EXPECT_FALSE(unchanged);
+
+  // An empty file has contents too; a missing one doesn't.
+  ASSERT_TRUE(disk_.WriteFile("empty", ""));
+  ASSERT_TRUE(log.RecordContents("empty", &unchanged, &err));
+  ASSERT_TRUE(log.RecordContents("empty", &unchanged, &err));
+  EXPECT_TRUE(unchanged);
+  ASSERT_TRUE(log.RecordContents("missing", &unchanged, &err));
+  EXPECT_FALSE(unchanged);
+}
+
+}  // anonymous namespace
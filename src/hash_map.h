@@ -16,43 +16,14 @@
 #define NINJA_MAP_H_
 
 #include <algorithm>
+#include <utility>
+#include <vector>
 #include <string.h>
+#include "hash.h"
+#include "metrics.h"
 #include "string_piece.h"
 #include "util.h"
 
-// MurmurHash2, by Austin Appleby
-static inline
-unsigned int MurmurHash2(const void* key, size_t len) {
-  static const unsigned int seed = 0xDECAFBAD;
-  const unsigned int m = 0x5bd1e995;
-  const int r = 24;
-  unsigned int h = seed ^ len;
-  const unsigned char* data = (const unsigned char*)key;
-  while (len >= 4) {
-    unsigned int k;
-    memcpy(&k, data, sizeof k);
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h *= m;
-    h ^= k;
-    data += 4;
-    len -= 4;
-  }
-  switch (len) {
-  case 3: h ^= data[2] << 16;
-          NINJA_FALLTHROUGH;
-  case 2: h ^= data[1] << 8;
-          NINJA_FALLTHROUGH;
-  case 1: h ^= data[0];
-    h *= m;
-  };
-  h ^= h >> 13;
-  h *= m;
-  h ^= h >> 15;
-  return h;
-}
-
 #if (__cplusplus >= 201103L) || (_MSC_VER >= 1900)
 #include <unordered_map>
 
@@ -63,7 +34,7 @@ struct hash<StringPiece> {
   typedef size_t result_type;
 
   size_t operator()(StringPiece key) const {
-    return MurmurHash2(key.str_, key.len_);
+    return (size_t)HashBytes(key.str_, key.len_);
   }
 };
 }
@@ -76,7 +47,7 @@ using stdext::hash_compare;
 
 struct StringPieceCmp : public hash_compare<StringPiece> {
   size_t operator()(const StringPiece& key) const {
-    return MurmurHash2(key.str_, key.len_);
+    return (size_t)HashBytes(key.str_, key.len_);
   }
   bool operator()(const StringPiece& a, const StringPiece& b) const {
     int cmp = memcmp(a.str_, b.str_, min(a.len_, b.len_));
@@ -99,25 +70,215 @@ namespace __gnu_cxx {
 template<>
 struct hash<StringPiece> {
   size_t operator()(StringPiece key) const {
-    return MurmurHash2(key.str_, key.len_);
+    return (size_t)HashBytes(key.str_, key.len_);
   }
 };
 }
 #endif
 
+/// A hash map from StringPiece to V, for the maps ninja looks paths up in
+/// all the time.  Entries live in one array, found by linear probing from
+/// their hash, with the hashes kept in an array of their own so that a
+/// probe mostly walks a few adjacent words and only compares the strings
+/// of an entry whose hash matches.  Erasing shifts the following entries
+/// back, so there are no tombstones.
+///
+/// It has the parts of the std::unordered_map interface ninja uses.
+/// Unlike there, inserting or erasing an entry moves the others, so
+/// iterators and pointers to values don't survive either.
+template<typename V>
+struct StringPieceHashMap {
+  typedef StringPiece key_type;
+  typedef V mapped_type;
+  typedef pair<StringPiece, V> value_type;
+
+  template<typename Map, typename Value>
+  struct Iterator {
+    Iterator() : map_(NULL), i_(0) {}
+    Iterator(Map* map, size_t i) : map_(map), i_(i) { Skip(); }
+    template<typename M, typename W>
+    Iterator(const Iterator<M, W>& other) : map_(other.map_), i_(other.i_) {}
+
+    Value& operator*() const { return map_->slots_[i_]; }
+    Value* operator->() const { return &map_->slots_[i_]; }
+    Iterator& operator++() {
+      ++i_;
+      Skip();
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator old = *this;
+      ++*this;
+      return old;
+    }
+    bool operator==(const Iterator& other) const { return i_ == other.i_; }
+    bool operator!=(const Iterator& other) const { return i_ != other.i_; }
+
+    Map* map_;
+    size_t i_;
+
+   private:
+    void Skip() {
+      while (i_ < map_->hashes_.size() && !map_->hashes_[i_])
+        ++i_;
+    }
+  };
+  typedef Iterator<StringPieceHashMap, value_type> iterator;
+  typedef Iterator<const StringPieceHashMap, const value_type> const_iterator;
+
+  StringPieceHashMap() : size_(0) {}
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, hashes_.size()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, hashes_.size()); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t bucket_count() const { return hashes_.size(); }
+
+  /// The hash of |key|, which is never 0, as that marks an empty slot.
+  /// A caller that looks a key up and then inserts it can pass this to
+  /// both instead of hashing the key twice.
+  static unsigned int Hash(StringPiece key) {
+    unsigned int hash = (unsigned int)HashBytes(key.str_, key.len_);
+    return hash ? hash : 1;
+  }
+
+  iterator find(StringPiece key) {
+    return iterator(this, Find(key, Hash(key)));
+  }
+  const_iterator find(StringPiece key) const {
+    return const_iterator(this, Find(key, Hash(key)));
+  }
+  /// find(), for a key whose Hash() is |hash|.
+  const_iterator find(StringPiece key, unsigned int hash) const {
+    return const_iterator(this, Find(key, hash));
+  }
+
+  pair<iterator, bool> insert(const value_type& value) {
+    return insert(value, Hash(value.first));
+  }
+  /// insert(), for a value whose key's Hash() is |hash|.
+  pair<iterator, bool> insert(const value_type& value, unsigned int hash) {
+    size_t i = Find(value.first, hash);
+    if (i != hashes_.size())
+      return make_pair(iterator(this, i), false);
+    return make_pair(iterator(this, Insert(value, hash)), true);
+  }
+
+  V& operator[](StringPiece key) {
+    unsigned int hash = Hash(key);
+    size_t i = Find(key, hash);
+    if (i == hashes_.size())
+      i = Insert(value_type(key, V()), hash);
+    return slots_[i].second;
+  }
+
+  size_t erase(StringPiece key) {
+    size_t i = Find(key, Hash(key));
+    if (i == hashes_.size())
+      return 0;
+    EraseSlot(i);
+    return 1;
+  }
+  void erase(iterator it) { EraseSlot(it.i_); }
+
+  /// Make room for |count| entries without growing again.
+  void reserve(size_t count) {
+    size_t capacity = 16;
+    while (capacity - capacity / 4 < count)
+      capacity *= 2;
+    if (capacity > hashes_.size())
+      Rehash(capacity);
+  }
+
+  void clear() {
+    hashes_.clear();
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  void EraseSlot(size_t i) {
+    // Move back each following entry that may sit there.
+    size_t mask = hashes_.size() - 1;
+    for (size_t j = (i + 1) & mask; hashes_[j]; j = (j + 1) & mask) {
+      size_t home = hashes_[j] & mask;
+      bool between = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (between)
+        continue;
+      hashes_[i] = hashes_[j];
+      slots_[i] = slots_[j];
+      i = j;
+    }
+    hashes_[i] = 0;
+    slots_[i] = value_type();
+    --size_;
+  }
+
+  /// The slot holding |key|, or hashes_.size() if there's none.
+  size_t Find(StringPiece key, unsigned int hash) const {
+    if (hashes_.empty())
+      return 0;
+    size_t mask = hashes_.size() - 1;
+    size_t i = hash & mask;
+    int probes = 1;
+    for (; hashes_[i]; i = (i + 1) & mask, ++probes) {
+      if (hashes_[i] == hash && slots_[i].first == key)
+        break;
+    }
+    METRIC_COUNT("hash map lookups", 1);
+    METRIC_COUNT("hash map probes", probes);
+    return hashes_[i] ? i : hashes_.size();
+  }
+
+  /// Add |value|, which isn't in the map yet, and return its slot.
+  size_t Insert(const value_type& value, unsigned int hash) {
+    // Keep the map at most three quarters full.
+    if ((size_ + 1) * 4 > hashes_.size() * 3)
+      Rehash(hashes_.empty() ? 16 : hashes_.size() * 2);
+    size_t mask = hashes_.size() - 1;
+    size_t i = hash & mask;
+    while (hashes_[i])
+      i = (i + 1) & mask;
+    hashes_[i] = hash;
+    slots_[i] = value;
+    ++size_;
+    return i;
+  }
+
+  void Rehash(size_t capacity) {
+    vector<unsigned int> hashes(capacity, 0);
+    vector<value_type> slots(capacity);
+    hashes.swap(hashes_);
+    slots.swap(slots_);
+    size_t mask = capacity - 1;
+    for (size_t j = 0; j < hashes.size(); ++j) {
+      if (!hashes[j])
+        continue;
+      size_t i = hashes[j] & mask;
+      while (hashes_[i])
+        i = (i + 1) & mask;
+      hashes_[i] = hashes[j];
+      slots_[i] = slots[j];
+    }
+  }
+
+  vector<unsigned int> hashes_;
+  vector<value_type> slots_;
+  size_t size_;
+
+  template<typename Map, typename Value> friend struct Iterator;
+};
+
 /// A template for hash_maps keyed by a StringPiece whose string is
 /// owned externally (typically by the values).  Use like:
 /// ExternalStringHash<Foo*>::Type foos; to make foos into a hash
 /// mapping StringPiece => Foo*.
 template<typename V>
 struct ExternalStringHashMap {
-#if (__cplusplus >= 201103L) || (_MSC_VER >= 1900)
-  typedef std::unordered_map<StringPiece, V> Type;
-#elif defined(_MSC_VER)
-  typedef hash_map<StringPiece, V, StringPieceCmp> Type;
-#else
-  typedef hash_map<StringPiece, V> Type;
-#endif
+  typedef StringPieceHashMap<V> Type;
 };
 
 #endif // NINJA_MAP_H_
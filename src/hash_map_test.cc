@@ -0,0 +1,132 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_map.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "test.h"
+
+namespace {
+
+typedef StringPieceHashMap<int> Map;
+
+vector<string> MakeKeys(int count) {
+  vector<string> keys;
+  for (int i = 0; i < count; ++i) {
+    char buf[32];
+    sprintf(buf, "path/%d", i);
+    keys.push_back(buf);
+  }
+  return keys;
+}
+
+TEST(StringPieceHashMap, InsertAndFind) {
+  Map map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find("a") == map.end());
+
+  EXPECT_TRUE(map.insert(Map::value_type("a", 1)).second);
+  EXPECT_FALSE(map.insert(Map::value_type("a", 2)).second);
+  map["b"] = 3;
+  EXPECT_EQ(2u, map.size());
+  EXPECT_EQ(1, map.find("a")->second);
+  EXPECT_EQ(3, map["b"]);
+  EXPECT_TRUE(map.find("c") == map.end());
+}
+
+TEST(StringPieceHashMap, GrowAndIterate) {
+  vector<string> keys = MakeKeys(1000);
+  Map map;
+  for (size_t i = 0; i < keys.size(); ++i)
+    map[keys[i]] = (int)i;
+  EXPECT_EQ(keys.size(), map.size());
+  EXPECT_GE(map.bucket_count() * 3, map.size() * 4);
+
+  vector<bool> seen(keys.size());
+  for (Map::const_iterator i = map.begin(); i != map.end(); ++i) {
+    EXPECT_EQ(keys[i->second], i->first.AsString());
+    EXPECT_FALSE(seen[i->second]);
+    seen[i->second] = true;
+  }
+  for (size_t i = 0; i < keys.size(); ++i)
+    EXPECT_EQ((int)i, map.find(keys[i])->second);
+}
+
+TEST(StringPieceHashMap, Erase) {
+  // Erase every other key, which moves back the keys probed past them,
+  // and check the rest are still found.
+  vector<string> keys = MakeKeys(200);
+  Map map;
+  for (size_t i = 0; i < keys.size(); ++i)
+    map[keys[i]] = (int)i;
+  for (size_t i = 0; i < keys.size(); i += 2)
+    EXPECT_EQ(1u, map.erase(keys[i]));
+  EXPECT_EQ(0u, map.erase(keys[0]));
+  map.erase(map.find(keys[1]));
+
+  EXPECT_EQ(keys.size() / 2 - 1, map.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    Map::iterator it = map.find(keys[i]);
+    if (i % 2 == 0 || i == 1) {
+      EXPECT_TRUE(it == map.end());
+    } else {
+      ASSERT_TRUE(it != map.end());
+      EXPECT_EQ((int)i, it->second);
+    }
+  }
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find(keys[3]) == map.end());
+}
+
+TEST(StringPieceHashMap, HashedFindAndInsert) {
+  Map map;
+  unsigned int hash = Map::Hash("foo");
+  EXPECT_TRUE(map.find("foo", hash) == map.end());
+  EXPECT_TRUE(map.insert(Map::value_type("foo", 1), hash).second);
+  EXPECT_FALSE(map.insert(Map::value_type("foo", 2), hash).second);
+  EXPECT_EQ(1, map.find("foo")->second);
+  EXPECT_EQ(1, map.find("foo", hash)->second);
+}
+
+TEST(HashBytes, ReadsOnlyItsBytes) {
+  // Each length takes a different path through the hash; none may look
+  // past the end, and every byte must count.
+  char a[128], b[128];
+  for (size_t i = 0; i < sizeof(a); ++i)
+    a[i] = b[i] = (char)(i * 7 + 1);
+  vector<uint64_t> hashes;
+  for (size_t len = 0; len < 100; ++len) {
+    b[len] = 'x';
+    uint64_t hash = HashBytes(a, len);
+    EXPECT_EQ(hash, HashBytes(b, len));
+    b[len] = a[len];
+    for (size_t i = 0; i < len; ++i) {
+      b[i] ^= 1;
+      EXPECT_NE(hash, HashBytes(b, len));
+      b[i] = a[i];
+    }
+    hashes.push_back(hash);
+  }
+  sort(hashes.begin(), hashes.end());
+  EXPECT_TRUE(adjacent_find(hashes.begin(), hashes.end()) == hashes.end());
+}
+
+}  // anonymous namespace
@@ -0,0 +1,343 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+namespace {
+
+/// The most slots a jobserver we run has, so that its tokens fit into the
+/// fifo's buffer.
+const int kMaxSlots = 4096;
+
+bool ParseFds(const string& value, int* read_fd, int* write_fd) {
+  const char* str = value.c_str();
+  char* end;
+  long read = strtol(str, &end, 10);
+  if (end == str || *end != ',')
+    return false;
+  str = end + 1;
+  long write = strtol(str, &end, 10);
+  if (end == str || *end != '\0' || read < 0 || write < 0)
+    return false;
+  *read_fd = read;
+  *write_fd = write;
+  return true;
+}
+
+}  // anonymous namespace
+
+bool ParseJobserverAuth(const string& makeflags, string* fifo, int* read_fd,
+                        int* write_fd) {
+  static const char* const kPrefixes[] = {
+    "--jobserver-auth=", "--jobserver-fds=", NULL
+  };
+  bool found = false;
+  size_t start = 0;
+  while (start < makeflags.size()) {
+    size_t end = makeflags.find(' ', start);
+    if (end == string::npos)
+      end = makeflags.size();
+    string word = makeflags.substr(start, end - start);
+    start = end + 1;
+    // Variable definitions follow "--".
+    if (word == "--")
+      break;
+    for (const char* const* prefix = kPrefixes; *prefix; ++prefix) {
+      size_t len = strlen(*prefix);
+      if (word.compare(0, len, *prefix) != 0)
+        continue;
+      // The last one counts, as for make.
+      string value = word.substr(len);
+      if (value.compare(0, 5, "fifo:") == 0 && value.size() > 5) {
+        *fifo = value.substr(5);
+        found = true;
+      } else if (ParseFds(value, read_fd, write_fd)) {
+        fifo->clear();
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+Jobserver::Jobserver()
+    : read_fd_(-1), write_fd_(-1), lock_fd_(-1), announced_(false),
+      had_makeflags_(false) {}
+
+#ifdef _WIN32
+
+Jobserver::~Jobserver() {}
+
+bool Jobserver::Connect() {
+  return false;
+}
+
+bool Jobserver::Create(int slots, string* err) {
+  *err = "not supported on this platform";
+  return false;
+}
+
+bool Jobserver::Share(const string& fifo, int slots, string* err) {
+  *err = "not supported on this platform";
+  return false;
+}
+
+bool Jobserver::Acquire() {
+  return false;
+}
+
+void Jobserver::Release() {}
+
+#else  // !_WIN32
+
+Jobserver::~Jobserver() {
+  while (!tokens_.empty())
+    Release();
+  if (read_fd_ >= 0)
+    close(read_fd_);
+  if (write_fd_ >= 0 && write_fd_ != read_fd_)
+    close(write_fd_);
+
+  // Closing the lock leaves the processes sharing the jobserver.
+  if (lock_fd_ >= 0)
+    close(lock_fd_);
+
+  if (!fifo_dir_.empty()) {
+    unlink(fifo_.c_str());
+    rmdir(fifo_dir_.c_str());
+  }
+  if (announced_) {
+    if (had_makeflags_)
+      setenv("MAKEFLAGS", old_makeflags_.c_str(), 1);
+    else
+      unsetenv("MAKEFLAGS");
+  }
+}
+
+bool Jobserver::Connect() {
+  const char* makeflags = getenv("MAKEFLAGS");
+  string fifo;
+  int read_fd, write_fd;
+  if (!makeflags || !ParseJobserverAuth(makeflags, &fifo, &read_fd, &write_fd))
+    return false;
+  string err;
+  if (!Open(fifo, read_fd, write_fd, &err)) {
+    Warning("ignoring jobserver: %s", err.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Jobserver::Open(const string& fifo, int read_fd, int write_fd,
+                     string* err) {
+  if (!fifo.empty()) {
+    read_fd_ = write_fd_ = open(fifo.c_str(), O_RDWR | O_NONBLOCK);
+    if (read_fd_ < 0) {
+      *err = fifo + ": " + strerror(errno);
+      return false;
+    }
+    SetCloseOnExec(read_fd_);
+    return true;
+  }
+
+  if (fcntl(read_fd, F_GETFD) < 0 || fcntl(write_fd, F_GETFD) < 0) {
+    *err = "its fds aren't open (mark the command running ninja with '+' "
+        "in the makefile)";
+    return false;
+  }
+  // Reading must not block, but the pipe is shared with the other
+  // processes of the build, so it can't just be made non-blocking.  Where
+  // the pipe can be opened anew through /proc, that gives a private file
+  // description to make non-blocking.
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", read_fd);
+  read_fd_ = open(path, O_RDONLY | O_NONBLOCK);
+  if (read_fd_ < 0) {
+    read_fd_ = dup(read_fd);
+    if (read_fd_ < 0 ||
+        fcntl(read_fd_, F_SETFL, fcntl(read_fd_, F_GETFL) | O_NONBLOCK) < 0) {
+      *err = strerror(errno);
+      return false;
+    }
+  }
+  SetCloseOnExec(read_fd_);
+  write_fd_ = dup(write_fd);
+  if (write_fd_ < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(write_fd_);
+  return true;
+}
+
+bool Jobserver::Create(int slots, string* err) {
+  if (slots > kMaxSlots) {
+    *err = "too many jobs to share";
+    return false;
+  }
+
+  const char* tmpdir = getenv("TMPDIR");
+  string dir = string(tmpdir && *tmpdir ? tmpdir : "/tmp") +
+      "/ninja-jobserver-XXXXXX";
+  if (!mkdtemp(&dir[0])) {
+    *err = dir + ": " + strerror(errno);
+    return false;
+  }
+  fifo_dir_ = dir;
+  fifo_ = dir + "/fifo";
+  if (mkfifo(fifo_.c_str(), 0600) < 0) {
+    *err = fifo_ + ": " + strerror(errno);
+    return false;
+  }
+  if (!Open(fifo_, -1, -1, err))
+    return false;
+
+  // We take the implicit slot ourselves.
+  if (!Fill(slots - 1, err))
+    return false;
+  Announce(slots);
+  return true;
+}
+
+namespace {
+
+/// Set a lock of |type| (F_RDLCK, F_WRLCK or F_UNLCK) on byte |offset| of
+/// |fd|, waiting for it if |wait|.  Returns false if it can't be set.
+bool LockByte(int fd, off_t offset, short type, bool wait) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = offset;
+  lock.l_len = 1;
+  int result;
+  do {
+    result = fcntl(fd, wait ? F_SETLKW : F_SETLK, &lock);
+  } while (result < 0 && errno == EINTR);
+  return result == 0;
+}
+
+}  // anonymous namespace
+
+bool Jobserver::Share(const string& fifo, int slots, string* err) {
+  if (slots > kMaxSlots) {
+    *err = "too many jobs to share";
+    return false;
+  }
+
+  // Byte 0 of the lock serializes the processes joining; each process
+  // taking part holds a read lock on byte 1 until it exits.  The fcntl()
+  // locks go away with the process, however it ends.
+  string lock_path = fifo + ".lock";
+  lock_fd_ = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+  if (lock_fd_ < 0) {
+    *err = lock_path + ": " + strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(lock_fd_);
+  if (!LockByte(lock_fd_, 0, F_WRLCK, true)) {
+    *err = lock_path + ": " + strerror(errno);
+    return false;
+  }
+  if (mkfifo(fifo.c_str(), 0666) < 0 && errno != EEXIST) {
+    *err = fifo + ": " + strerror(errno);
+    return false;
+  }
+  fifo_ = fifo;
+  bool ok = Open(fifo, -1, -1, err);
+  if (ok && LockByte(lock_fd_, 1, F_WRLCK, false)) {
+    // Nobody else takes part, so the tokens left, if any, are stale.
+    char buf[512];
+    while (read(read_fd_, buf, sizeof(buf)) > 0) {
+    }
+    ok = Fill(slots - 1, err);
+  }
+  // Turning our lock on byte 1 into a read lock is atomic.
+  if (ok && !LockByte(lock_fd_, 1, F_RDLCK, true)) {
+    *err = lock_path + ": " + strerror(errno);
+    ok = false;
+  }
+  LockByte(lock_fd_, 0, F_UNLCK, false);
+  if (!ok)
+    return false;
+  Announce(slots);
+  return true;
+}
+
+bool Jobserver::Fill(int tokens, string* err) {
+  string bytes(tokens, '+');
+  if (!bytes.empty() &&
+      write(write_fd_, bytes.data(), bytes.size()) != (ssize_t)bytes.size()) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void Jobserver::Announce(int slots) {
+  announced_ = true;
+  const char* makeflags = getenv("MAKEFLAGS");
+  had_makeflags_ = makeflags != NULL;
+  if (makeflags)
+    old_makeflags_ = makeflags;
+  char flags[32];
+  snprintf(flags, sizeof(flags), "-j%d", slots);
+  string auth = string(flags) + " --jobserver-auth=fifo:" + fifo_;
+  // Keep the flags in front of any variable definitions.
+  string new_makeflags = old_makeflags_;
+  size_t variables = new_makeflags.find(" -- ");
+  if (variables != string::npos)
+    new_makeflags.insert(variables, " " + auth);
+  else if (new_makeflags.empty())
+    new_makeflags = auth;
+  else
+    new_makeflags += " " + auth;
+  setenv("MAKEFLAGS", new_makeflags.c_str(), 1);
+}
+
+bool Jobserver::Acquire() {
+  char token;
+  ssize_t len;
+  do {
+    len = read(read_fd_, &token, 1);
+  } while (len < 0 && errno == EINTR);
+  if (len != 1)
+    return false;
+  tokens_.push_back(token);
+  return true;
+}
+
+void Jobserver::Release() {
+  if (tokens_.empty())
+    return;
+  char token = tokens_[tokens_.size() - 1];
+  tokens_.resize(tokens_.size() - 1);
+  while (write(write_fd_, &token, 1) < 0 && errno == EINTR) {
+  }
+}
+
+#endif  // _WIN32
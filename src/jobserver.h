@@ -0,0 +1,90 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_JOBSERVER_H_
+#define NINJA_JOBSERVER_H_
+
+#include <string>
+using namespace std;
+
+// A GNU make jobserver shares job slots between the processes of a build:
+// a pipe or fifo holds a byte, a token, for every slot but the one each
+// process has implicitly.  A process takes a token before it starts
+// another job and writes it back once the job is done.  The jobserver is
+// announced to child processes in MAKEFLAGS, as "--jobserver-auth=R,W"
+// (or "--jobserver-fds=R,W" before make 4.2) giving the fds of an
+// inherited pipe, or as "--jobserver-auth=fifo:PATH" since make 4.4.
+
+/// Where the jobserver in |makeflags| is.  Returns false if there's none.
+bool ParseJobserverAuth(const string& makeflags, string* fifo, int* read_fd,
+                        int* write_fd);
+
+/// A connection to a jobserver, or one we run.  POSIX only; elsewhere
+/// there's never a jobserver.
+struct Jobserver {
+  Jobserver();
+  ~Jobserver();
+
+  /// Join the jobserver announced in the MAKEFLAGS environment variable.
+  /// Returns false if there's none, and warns if it can't be used.
+  bool Connect();
+
+  /// Run a jobserver with |slots| slots, and announce it to child
+  /// processes in MAKEFLAGS until it's destroyed.  Returns false on error.
+  bool Create(int slots, string* err);
+
+  /// Join the jobserver on the fifo at |fifo| that other, unrelated ninja
+  /// processes share, filling it with the tokens for |slots| slots first
+  /// if none of them is running, and announce it like Create() does.  Each
+  /// process has a slot besides the tokens.  "|fifo|.lock" tells which
+  /// processes take part; tokens held by one that crashed are only found
+  /// again once none takes part.  Returns false on error.
+  bool Share(const string& fifo, int slots, string* err);
+
+  bool is_connected() const { return read_fd_ >= 0; }
+  size_t token_count() const { return tokens_.size(); }
+
+  /// Take a token if one is free, without waiting.
+  bool Acquire();
+
+  /// Give back a token taken with Acquire().
+  void Release();
+
+ private:
+  /// Set up read_fd_ and write_fd_ for |fifo| or the pipe fds.
+  bool Open(const string& fifo, int read_fd, int write_fd, string* err);
+
+  /// Put |tokens| into the fifo.
+  bool Fill(int tokens, string* err);
+
+  /// Announce the jobserver on |fifo_| with |slots| slots in MAKEFLAGS.
+  void Announce(int slots);
+
+  int read_fd_;
+  int write_fd_;
+  /// The tokens taken, so that the same bytes go back.
+  string tokens_;
+
+  /// For a jobserver we run or share, its fifo, the directory this
+  /// created for it if any, and the lock of the processes sharing it.
+  string fifo_;
+  string fifo_dir_;
+  int lock_fd_;
+  /// What MAKEFLAGS was before the jobserver was announced, if it was.
+  bool announced_;
+  bool had_makeflags_;
+  string old_makeflags_;
+};
+
+#endif  // NINJA_JOBSERVER_H_
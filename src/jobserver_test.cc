@@ -0,0 +1,167 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+TEST(ParseJobserverAuth, Pipe) {
+  string fifo;
+  int read_fd = -1, write_fd = -1;
+  EXPECT_TRUE(ParseJobserverAuth(" -j8 --jobserver-auth=3,4", &fifo, &read_fd,
+                                 &write_fd));
+  EXPECT_EQ("", fifo);
+  EXPECT_EQ(3, read_fd);
+  EXPECT_EQ(4, write_fd);
+
+  // make before 4.2.
+  EXPECT_TRUE(ParseJobserverAuth("k -j --jobserver-fds=5,6", &fifo, &read_fd,
+                                 &write_fd));
+  EXPECT_EQ(5, read_fd);
+  EXPECT_EQ(6, write_fd);
+}
+
+TEST(ParseJobserverAuth, Fifo) {
+  string fifo;
+  int read_fd = -1, write_fd = -1;
+  EXPECT_TRUE(ParseJobserverAuth("-j4 --jobserver-auth=fifo:/tmp/GMfifo1",
+                                 &fifo, &read_fd, &write_fd));
+  EXPECT_EQ("/tmp/GMfifo1", fifo);
+}
+
+TEST(ParseJobserverAuth, LastWins) {
+  string fifo;
+  int read_fd = -1, write_fd = -1;
+  EXPECT_TRUE(ParseJobserverAuth(
+      "--jobserver-auth=fifo:/tmp/a --jobserver-auth=7,8", &fifo, &read_fd,
+      &write_fd));
+  EXPECT_EQ("", fifo);
+  EXPECT_EQ(7, read_fd);
+  EXPECT_EQ(8, write_fd);
+}
+
+TEST(ParseJobserverAuth, None) {
+  string fifo;
+  int read_fd = -1, write_fd = -1;
+  EXPECT_FALSE(ParseJobserverAuth("", &fifo, &read_fd, &write_fd));
+  EXPECT_FALSE(ParseJobserverAuth("-j8 -k", &fifo, &read_fd, &write_fd));
+  EXPECT_FALSE(ParseJobserverAuth("--jobserver-auth=3", &fifo, &read_fd,
+                                  &write_fd));
+  EXPECT_FALSE(ParseJobserverAuth("--jobserver-auth=fifo:", &fifo, &read_fd,
+                                  &write_fd));
+  // Variable definitions aren't flags.
+  EXPECT_FALSE(ParseJobserverAuth("k -- X=--jobserver-auth=3,4", &fifo,
+                                  &read_fd, &write_fd));
+}
+
+#ifndef _WIN32
+TEST(Jobserver, CreateAndConnect) {
+  const char* makeflags = getenv("MAKEFLAGS");
+  bool had_makeflags = makeflags != NULL;
+  string old_makeflags = makeflags ? makeflags : "";
+  setenv("MAKEFLAGS", "k", 1);
+
+  {
+    Jobserver server;
+    string err;
+    ASSERT_TRUE(server.Create(3, &err));
+    EXPECT_EQ("", err);
+    string fifo;
+    int read_fd, write_fd;
+    ASSERT_TRUE(ParseJobserverAuth(getenv("MAKEFLAGS"), &fifo, &read_fd,
+                                   &write_fd));
+    EXPECT_EQ(0, string(getenv("MAKEFLAGS")).find("k -j3 --jobserver-auth="));
+
+    Jobserver client;
+    ASSERT_TRUE(client.Connect());
+    EXPECT_TRUE(client.is_connected());
+    // Three slots are two tokens, plus the one each process has.
+    EXPECT_TRUE(client.Acquire());
+    EXPECT_TRUE(client.Acquire());
+    EXPECT_FALSE(client.Acquire());
+    EXPECT_EQ(2u, client.token_count());
+
+    client.Release();
+    EXPECT_EQ(1u, client.token_count());
+    EXPECT_TRUE(server.Acquire());
+    EXPECT_FALSE(server.Acquire());
+  }
+
+  // The server put MAKEFLAGS back.
+  EXPECT_EQ("k", string(getenv("MAKEFLAGS")));
+  if (had_makeflags)
+    setenv("MAKEFLAGS", old_makeflags.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+}
+
+TEST(Jobserver, Share) {
+  const char* makeflags = getenv("MAKEFLAGS");
+  bool had_makeflags = makeflags != NULL;
+  string old_makeflags = makeflags ? makeflags : "";
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("Ninja-JobserverTest-Share");
+
+  string err;
+  {
+    Jobserver first;
+    ASSERT_TRUE(first.Share("fifo", 3, &err));
+    EXPECT_EQ("", err);
+    EXPECT_NE(string::npos,
+              string(getenv("MAKEFLAGS")).find("--jobserver-auth=fifo:fifo"));
+    EXPECT_TRUE(first.Acquire());
+    EXPECT_TRUE(first.Acquire());
+    EXPECT_FALSE(first.Acquire());
+    first.Release();
+
+    // Another process joins with the one token left, whatever its -j.
+    // (The locks of one process don't exclude each other.)
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+      bool ok;
+      {
+        Jobserver second;
+        string child_err;
+        ok = second.Share("fifo", 8, &child_err) && second.Acquire() &&
+            !second.Acquire();
+      }
+      _exit(ok ? 0 : 1);
+    }
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    EXPECT_TRUE(first.Acquire());
+  }
+
+  // Once nobody takes part, the next process starts over with its slots,
+  // whatever was left in the fifo.
+  Jobserver again;
+  ASSERT_TRUE(again.Share("fifo", 2, &err));
+  EXPECT_TRUE(again.Acquire());
+  EXPECT_FALSE(again.Acquire());
+
+  temp_dir.Cleanup();
+  if (had_makeflags)
+    setenv("MAKEFLAGS", old_makeflags.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+}
+#endif  // !_WIN32
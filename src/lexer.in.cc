@@ -19,6 +19,12 @@
 #include "eval_env.h"
 #include "util.h"
 
+#if defined(NINJA_HAVE_SSE2)
+#include <emmintrin.h>
+#elif defined(NINJA_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
 bool Lexer::Error(const string& message, string* err) {
   // Compute line/column.
   int line = 1;
@@ -113,13 +119,124 @@ void Lexer::UnreadToken() {
   ofs_ = last_token_;
 }
 
+namespace {
+
+/// Whether |c| ends a run of plain text in an eval string: it's one of the
+/// bytes ReadEvalString() treats specially, or the nul ending the input.
+inline bool IsEvalStringSpecial(char c) {
+  switch (c) {
+  case '$':
+  case ' ':
+  case ':':
+  case '\r':
+  case '\n':
+  case '|':
+  case '\0':
+    return true;
+  default:
+    return false;
+  }
+}
+
+/// Return the first byte at or after |p| that IsEvalStringSpecial().
+/// Most of a generated manifest is runs of plain path text, so where the
+/// target has SSE2 or NEON this looks at 16 bytes at a time until it gets
+/// near |end|, the end of the input; past that it relies on the nul.
+const char* SkipPlainText(const char* p, const char* end) {
+#if defined(NINJA_HAVE_SSE2)
+  const __m128i dollar = _mm_set1_epi8('$');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i pipe = _mm_set1_epi8('|');
+  const __m128i nul = _mm_setzero_si128();
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, dollar),
+                     _mm_cmpeq_epi8(chunk, space)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, colon), _mm_cmpeq_epi8(chunk, cr)));
+    hits = _mm_or_si128(
+        hits, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, lf),
+                                        _mm_cmpeq_epi8(chunk, pipe)),
+                           _mm_cmpeq_epi8(chunk, nul)));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+    if (mask)
+      return p + CountTrailingZeros(mask);
+  }
+#elif defined(NINJA_HAVE_NEON)
+  const uint8x16_t dollar = vdupq_n_u8('$');
+  const uint8x16_t space = vdupq_n_u8(' ');
+  const uint8x16_t colon = vdupq_n_u8(':');
+  const uint8x16_t cr = vdupq_n_u8('\r');
+  const uint8x16_t lf = vdupq_n_u8('\n');
+  const uint8x16_t pipe = vdupq_n_u8('|');
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t hits = vorrq_u8(
+        vorrq_u8(vceqq_u8(chunk, dollar), vceqq_u8(chunk, space)),
+        vorrq_u8(vceqq_u8(chunk, colon), vceqq_u8(chunk, cr)));
+    hits = vorrq_u8(hits, vorrq_u8(vorrq_u8(vceqq_u8(chunk, lf),
+                                            vceqq_u8(chunk, pipe)),
+                                   vceqzq_u8(chunk)));
+    // NEON has no movemask; finish the chunk with the scalar loop below.
+    if (vmaxvq_u8(hits))
+      break;
+  }
+#endif
+  while (!IsEvalStringSpecial(*p))
+    ++p;
+  return p;
+}
+
+/// Return the first newline or nul at or after |p|, the end of a comment.
+/// Like SkipPlainText(), this takes 16 bytes at a time when it can.
+const char* SkipToLineEnd(const char* p, const char* end) {
+#if defined(NINJA_HAVE_SSE2)
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i nul = _mm_setzero_si128();
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hits =
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, nul));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+    if (mask)
+      return p + CountTrailingZeros(mask);
+  }
+#elif defined(NINJA_HAVE_NEON)
+  const uint8x16_t lf = vdupq_n_u8('\n');
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    if (vmaxvq_u8(vorrq_u8(vceqq_u8(chunk, lf), vceqzq_u8(chunk))))
+      break;
+  }
+#endif
+  while (*p != '\n' && *p != '\0')
+    ++p;
+  return p;
+}
+
+}  // anonymous namespace
+
 Lexer::Token Lexer::ReadToken() {
   const char* p = ofs_;
   const char* q;
   const char* start;
   Lexer::Token token;
+  const char* end = input_.str_ + input_.len_;
   for (;;) {
     start = p;
+    // Skip a comment without leading spaces, the usual kind, in bulk.  The
+    // state machine handles the rest, and a comment running into the end
+    // of the input.
+    if (*p == '#') {
+      const char* eol = SkipToLineEnd(p + 1, end);
+      if (*eol == '\n') {
+        p = eol + 1;
+        continue;
+      }
+    }
     /*!re2c
     re2c:define:YYCTYPE = "unsigned char";
     re2c:define:YYCURSOR = p;
@@ -206,8 +323,16 @@ bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
   const char* p = ofs_;
   const char* q;
   const char* start;
+  const char* end = input_.str_ + input_.len_;
   for (;;) {
     start = p;
+    // Take a run of plain text in one go, and leave the state machine to
+    // the bytes that mean something.
+    p = SkipPlainText(p, end);
+    if (p != start) {
+      eval->AddText(StringPiece(start, p - start));
+      continue;
+    }
     /*!re2c
     [^$ :\r\n|\000]+ {
       eval->AddText(StringPiece(start, p - start));
@@ -230,11 +355,11 @@ bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
       }
     }
     "$$" {
-      eval->AddText(StringPiece("$", 1));
+      eval->AddText(StringPiece(start + 1, 1));
       continue;
     }
     "$ " {
-      eval->AddText(StringPiece(" ", 1));
+      eval->AddText(StringPiece(start + 1, 1));
       continue;
     }
     "$\r\n"[ ]* {
@@ -252,7 +377,7 @@ bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
       continue;
     }
     "$:" {
-      eval->AddText(StringPiece(":", 1));
+      eval->AddText(StringPiece(start + 1, 1));
       continue;
     }
     "$". {
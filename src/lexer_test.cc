@@ -37,6 +37,49 @@ TEST(Lexer, ReadEvalStringEscapes) {
             eval.Serialize());
 }
 
+TEST(Lexer, ReadLongPaths) {
+  // Runs of plain text longer than the 16 bytes the lexer scans at a time,
+  // with the bytes that end them at different offsets.
+  Lexer lexer("build out/gen/third_party/WebKit/Source.o: cxx "
+              "../../third_party/WebKit/Source/WebCore/Document.cpp"
+              " | a_long_implicit_dependency.h\n"
+              "  cflags = -DSOME_LONG_DEFINE=1 -I../../third_party$:x $in\n");
+  EvalString eval;
+  string err;
+  EXPECT_EQ(Lexer::BUILD, lexer.ReadToken());
+  EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+  EXPECT_EQ("[out/gen/third_party/WebKit/Source.o]", eval.Serialize());
+  EXPECT_EQ(Lexer::COLON, lexer.ReadToken());
+  EXPECT_EQ(Lexer::IDENT, lexer.ReadToken());
+  eval.Clear();
+  EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+  EXPECT_EQ("[../../third_party/WebKit/Source/WebCore/Document.cpp]",
+            eval.Serialize());
+  EXPECT_EQ(Lexer::PIPE, lexer.ReadToken());
+  eval.Clear();
+  EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+  EXPECT_EQ("[a_long_implicit_dependency.h]", eval.Serialize());
+  EXPECT_EQ(Lexer::NEWLINE, lexer.ReadToken());
+  EXPECT_EQ(Lexer::INDENT, lexer.ReadToken());
+  string ident;
+  EXPECT_TRUE(lexer.ReadIdent(&ident));
+  EXPECT_EQ(Lexer::EQUALS, lexer.ReadToken());
+  eval.Clear();
+  EXPECT_TRUE(lexer.ReadVarValue(&eval, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ("[-DSOME_LONG_DEFINE=1 -I../../third_party:x ][$in]",
+            eval.Serialize());
+  EXPECT_EQ(Lexer::TEOF, lexer.ReadToken());
+}
+
+TEST(Lexer, ReadLongComment) {
+  Lexer lexer("# A comment that goes on for longer than sixteen bytes.\n"
+              "# Another one.\n"
+              "  # And an indented one.\n"
+              "build");
+  EXPECT_EQ(Lexer::BUILD, lexer.ReadToken());
+}
+
 TEST(Lexer, ReadIdent) {
   Lexer lexer("foo baR baz_123 foo-bar");
   string ident;
@@ -28,9 +28,17 @@
 #include <sys/time.h>
 #endif
 
+#include <algorithm>
+
 #include "util.h"
 
-LinePrinter::LinePrinter() : have_blank_line_(true), console_locked_(false) {
+const size_t LinePrinter::kReplayChunk;
+const size_t LinePrinter::kMaxBufferInMemory;
+
+LinePrinter::LinePrinter()
+    : have_blank_line_(true), console_locked_(false), replaying_(false),
+      replayed_(0), output_spill_(NULL), spill_written_(0),
+      spill_replayed_(0) {
   const char* term = getenv("TERM");
 #ifndef _WIN32
   smart_terminal_ = isatty(1) && term && string(term) != "dumb";
@@ -66,8 +74,13 @@ LinePrinter::LinePrinter() : have_blank_line_(true), console_locked_(false) {
 #endif
 }
 
+LinePrinter::~LinePrinter() {
+  if (output_spill_)
+    fclose(output_spill_);
+}
+
 void LinePrinter::Print(string to_print, LineType type) {
-  if (console_locked_) {
+  if (console_locked_ || replaying_) {
     line_buffer_ = to_print;
     line_type_ = type;
     return;
@@ -120,8 +133,8 @@ void LinePrinter::Print(string to_print, LineType type) {
 }
 
 void LinePrinter::PrintOrBuffer(const char* data, size_t size) {
-  if (console_locked_) {
-    output_buffer_.append(data, size);
+  if (console_locked_ || replaying_) {
+    BufferOutput(data, size);
   } else {
     // Avoid printf and C strings, since the actual output might contain null
     // bytes like UTF-16 does (yuck).
@@ -129,10 +142,22 @@ void LinePrinter::PrintOrBuffer(const char* data, size_t size) {
   }
 }
 
+void LinePrinter::BufferOutput(const char* data, size_t size) {
+  if (!output_spill_ && output_buffer_.size() + size > kMaxBufferInMemory) {
+    output_spill_ = tmpfile();  // Keep it all in memory if that fails.
+  }
+  if (!output_spill_) {
+    output_buffer_.append(data, size);
+    return;
+  }
+  fseek(output_spill_, spill_written_, SEEK_SET);
+  spill_written_ += (long)fwrite(data, 1, size, output_spill_);
+}
+
 void LinePrinter::PrintOnNewLine(const string& to_print) {
-  if (console_locked_ && !line_buffer_.empty()) {
-    output_buffer_.append(line_buffer_);
-    output_buffer_.append(1, '\n');
+  if ((console_locked_ || replaying_) && !line_buffer_.empty()) {
+    line_buffer_.append(1, '\n');
+    BufferOutput(line_buffer_.data(), line_buffer_.size());
     line_buffer_.clear();
   }
   if (!have_blank_line_) {
@@ -148,17 +173,59 @@ void LinePrinter::SetConsoleLocked(bool locked) {
   if (locked == console_locked_)
     return;
 
-  if (locked)
+  if (locked) {
+    // The console is the locking command's; what came before goes first.
+    ReplayOutput(string::npos);
     PrintOnNewLine("");
+  }
 
   console_locked_ = locked;
 
   if (!locked) {
-    PrintOnNewLine(output_buffer_);
-    if (!line_buffer_.empty()) {
-      Print(line_buffer_, line_type_);
+    replaying_ = true;
+    ReplayOutput();
+  }
+}
+
+void LinePrinter::ReplayOutput(size_t max_bytes) {
+  if (!replaying_)
+    return;
+
+  // Avoid printf and C strings, as in PrintOrBuffer().
+  size_t left = max_bytes;
+  if (replayed_ < output_buffer_.size()) {
+    size_t size = min(left, output_buffer_.size() - replayed_);
+    fwrite(output_buffer_.data() + replayed_, 1, size, stdout);
+    replayed_ += size;
+    left -= size;
+    if (replayed_ == output_buffer_.size()) {
+      output_buffer_.clear();
+      replayed_ = 0;
     }
-    output_buffer_.clear();
+  }
+  if (output_spill_ && left > 0) {
+    char buf[64 << 10];
+    size_t len = 1;
+    fseek(output_spill_, spill_replayed_, SEEK_SET);
+    while (left > 0 && spill_replayed_ < spill_written_ &&
+           (len = fread(buf, 1, min(left, sizeof(buf)), output_spill_)) > 0) {
+      fwrite(buf, 1, len, stdout);
+      spill_replayed_ += (long)len;
+      left -= len;
+    }
+    // Give up on a spill that can't be read back.
+    if (spill_replayed_ >= spill_written_ || len == 0) {
+      fclose(output_spill_);
+      output_spill_ = NULL;
+      spill_written_ = spill_replayed_ = 0;
+    }
+  }
+  if (!output_buffer_.empty() || output_spill_)
+    return;
+
+  replaying_ = false;
+  if (!line_buffer_.empty()) {
+    Print(line_buffer_, line_type_);
     line_buffer_.clear();
   }
 }
@@ -16,6 +16,7 @@
 #define NINJA_LINE_PRINTER_H_
 
 #include <stddef.h>
+#include <stdio.h>
 #include <string>
 using namespace std;
 
@@ -23,6 +24,7 @@ using namespace std;
 /// if the terminal supports it.
 struct LinePrinter {
   LinePrinter();
+  ~LinePrinter();
 
   bool is_smart_terminal() const { return smart_terminal_; }
   void set_smart_terminal(bool smart) { smart_terminal_ = smart; }
@@ -41,9 +43,28 @@ struct LinePrinter {
   void PrintOnNewLine(const string& to_print);
 
   /// Lock or unlock the console.  Any output sent to the LinePrinter while the
-  /// console is locked will not be printed until it is unlocked.
+  /// console is locked will not be printed until it is unlocked.  Unlocking
+  /// prints the first kReplayChunk bytes of it; ReplayOutput() prints the
+  /// rest, and until it's all out, more output queues up behind it.
   void SetConsoleLocked(bool locked);
 
+  bool is_console_locked() const { return console_locked_; }
+
+  /// Whether output held back while the console was locked is left to print.
+  bool is_replaying() const { return replaying_; }
+
+  /// Print up to |max_bytes| of the output held back while the console was
+  /// locked, and the status line once it's all out.
+  void ReplayOutput(size_t max_bytes = kReplayChunk);
+
+  /// How much held back output to print at a time, so that a lot of it
+  /// doesn't hold up the build.
+  static const size_t kReplayChunk = 64 << 10;
+
+  /// How much output to hold back in memory before spilling the rest to a
+  /// temporary file.
+  static const size_t kMaxBufferInMemory = 1 << 20;
+
  private:
   /// Whether we can do fancy terminal control codes.
   bool smart_terminal_;
@@ -63,8 +84,18 @@ struct LinePrinter {
   /// Buffered line type while console is locked.
   LineType line_type_;
 
-  /// Buffered console output while console is locked.
+  /// Whether held back output is being printed.
+  bool replaying_;
+
+  /// Buffered console output while console is locked, from |replayed_| on.
   string output_buffer_;
+  size_t replayed_;
+
+  /// Where buffered output past kMaxBufferInMemory goes, once there is
+  /// some, with how much of it was written and how much printed.
+  FILE* output_spill_;
+  long spill_written_;
+  long spill_replayed_;
 
 #ifdef _WIN32
   void* console_;
@@ -72,6 +103,9 @@ struct LinePrinter {
 
   /// Print the given data to the console, or buffer it if it is locked.
   void PrintOrBuffer(const char *data, size_t size);
+
+  /// Hold back output behind what's already held back.
+  void BufferOutput(const char* data, size_t size);
 };
 
 #endif  // NINJA_LINE_PRINTER_H_
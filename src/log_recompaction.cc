@@ -0,0 +1,102 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log_recompaction.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+LogRecompaction::~LogRecompaction() {
+  assert(!running());
+}
+
+bool LogRecompaction::Start(const string& path, Writer* writer, string* err) {
+  assert(!running());
+  // Everything from the current end of the file on is copied over later.
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f || fseek(f, 0, SEEK_END) != 0 || (tail_offset_ = ftell(f)) < 0) {
+    *err = strerror(errno);
+    if (f)
+      fclose(f);
+    delete writer;
+    return false;
+  }
+  fclose(f);
+
+  path_ = path;
+  temp_path_ = path + ".recompact";
+  writer_ = writer;
+  thread_ = thread(&LogRecompaction::Run, this);
+  return true;
+}
+
+void LogRecompaction::Run() {
+  // This replaces anything left over from a recompaction that crashed.
+  FILE* f = fopen(temp_path_.c_str(), "wb");
+  ok_ = f && writer_->WriteLog(f);
+  error_ = errno;
+  if (f && fclose(f) != 0 && ok_) {
+    ok_ = false;
+    error_ = errno;
+  }
+}
+
+bool LogRecompaction::Finish(string* err) {
+  assert(running());
+  thread_.join();
+  delete writer_;
+  writer_ = NULL;
+
+  bool ok = ok_;
+  if (!ok)
+    errno = error_;
+
+  // Append the records written since Start().
+  FILE* in = NULL;
+  FILE* out = NULL;
+  if (ok) {
+    in = fopen(path_.c_str(), "rb");
+    out = fopen(temp_path_.c_str(), "ab");
+    ok = in && out && fseek(in, tail_offset_, SEEK_SET) == 0;
+  }
+  char buf[64 << 10];
+  while (ok) {
+    size_t size = fread(buf, 1, sizeof(buf), in);
+    if (size == 0) {
+      ok = !ferror(in);
+      break;
+    }
+    ok = fwrite(buf, 1, size, out) == size;
+  }
+  if (in)
+    fclose(in);
+  if (out && fclose(out) != 0)
+    ok = false;
+
+  if (ok)
+    ok = unlink(path_.c_str()) == 0 &&
+        rename(temp_path_.c_str(), path_.c_str()) == 0;
+  if (!ok) {
+    *err = strerror(errno);
+    unlink(temp_path_.c_str());
+    return false;
+  }
+  return true;
+}
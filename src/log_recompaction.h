@@ -0,0 +1,67 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_LOG_RECOMPACTION_H_
+#define NINJA_LOG_RECOMPACTION_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <thread>
+using namespace std;
+
+/// Rewrites one of the logs on a background thread while the build keeps
+/// appending to the old file.  Finish() copies the records appended in the
+/// meantime to the end of the new file and moves it into place.
+///
+/// The new file must start with the same records the old one had up to
+/// Start(), as far as the appended records refer to them (by id, for the
+/// logs), since those are copied unchanged.
+struct LogRecompaction {
+  /// Writes the compacted log.  Runs on the background thread, so it may
+  /// only use data the rest of ninja leaves alone until Finish().
+  struct Writer {
+    virtual ~Writer() {}
+    /// Write the log to |f|.  Returns false and sets errno on error.
+    virtual bool WriteLog(FILE* f) = 0;
+  };
+
+  LogRecompaction() : writer_(NULL), tail_offset_(0), ok_(false), error_(0) {}
+  ~LogRecompaction();
+
+  /// Start rewriting |path| with |writer|, which this takes ownership of.
+  bool Start(const string& path, Writer* writer, string* err);
+
+  bool running() const { return writer_ != NULL; }
+
+  /// Wait for the rewrite, append what was appended to the old file since
+  /// Start() and replace it.  The old file must be closed for writing.
+  /// Leaves the old file in place on error.
+  bool Finish(string* err);
+
+ private:
+  void Run();
+
+  string path_;
+  string temp_path_;
+  Writer* writer_;
+  long tail_offset_;
+  thread thread_;
+
+  /// The result of Run().
+  bool ok_;
+  int error_;
+};
+
+#endif  // NINJA_LOG_RECOMPACTION_H_
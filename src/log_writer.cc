@@ -0,0 +1,102 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log_writer.h"
+
+#include <assert.h>
+#include <errno.h>
+
+#include <chrono>
+
+#include "metrics.h"
+
+const int LogWriter::kMaxBatchDelay;
+const size_t LogWriter::kMaxBatchSize;
+
+LogWriter::~LogWriter() {
+  assert(!is_open());
+}
+
+void LogWriter::Open(FILE* f) {
+  assert(!is_open());
+  // Batches are written with a single fwrite(), which should be a single
+  // write() as well.
+  setvbuf(f, NULL, _IONBF, 0);
+  file_ = f;
+  closing_ = false;
+  error_ = 0;
+  thread_ = thread(&LogWriter::Run, this);
+}
+
+bool LogWriter::Append(const string& record) {
+  assert(is_open());
+  lock_guard<mutex> lock(mutex_);
+  if (error_) {
+    errno = error_;
+    return false;
+  }
+  bool was_empty = queue_.empty();
+  queue_ += record;
+  if (was_empty || queue_.size() >= kMaxBatchSize)
+    wake_.notify_one();
+  return true;
+}
+
+bool LogWriter::Close() {
+  assert(is_open());
+  {
+    lock_guard<mutex> lock(mutex_);
+    closing_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+
+  int error = error_;
+  if (fclose(file_) != 0 && !error)
+    error = errno;
+  file_ = NULL;
+  if (error) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+void LogWriter::Run() {
+  string batch;
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    while (queue_.empty() && !closing_)
+      wake_.wait(lock);
+    if (queue_.empty())
+      break;
+
+    // Give the build a little while to queue more records.
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+        chrono::milliseconds(kMaxBatchDelay);
+    while (!closing_ && queue_.size() < kMaxBatchSize &&
+           wake_.wait_until(lock, deadline) != cv_status::timeout) {
+    }
+
+    batch.swap(queue_);
+    lock.unlock();
+    METRIC_COUNT("log writes", 1);
+    bool ok = fwrite(batch.data(), batch.size(), 1, file_) == 1;
+    int error = errno;
+    batch.clear();
+    lock.lock();
+    if (!ok && !error_)
+      error_ = error ? error : EIO;
+  }
+}
@@ -0,0 +1,71 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_LOG_WRITER_H_
+#define NINJA_LOG_WRITER_H_
+
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+/// Appends records to one of the logs on a background thread, so that the
+/// build doesn't wait for the writes.
+///
+/// Records are queued whole and written in batches, each with a single
+/// write, at the latest kMaxBatchDelay milliseconds after its first record
+/// was queued or as soon as it holds kMaxBatchSize bytes.  A crash may lose
+/// the batches not written yet, or leave the last one partially written,
+/// which loading discards like any other truncated record.
+struct LogWriter {
+  static const int kMaxBatchDelay = 50;
+  static const size_t kMaxBatchSize = 64 << 10;
+
+  LogWriter() : file_(NULL), closing_(false), error_(0) {}
+  ~LogWriter();
+
+  /// Start appending to |f|, which this takes ownership of.
+  void Open(FILE* f);
+
+  bool is_open() const { return file_ != NULL; }
+
+  /// Queue |record| to be appended.  Returns false and sets errno if
+  /// writing an earlier batch failed.
+  bool Append(const string& record);
+
+  /// Write everything queued and close the file.  Returns false and sets
+  /// errno if any write failed.
+  bool Close();
+
+ private:
+  void Run();
+
+  FILE* file_;
+  thread thread_;
+
+  /// Guards the members below, which the background thread shares.
+  mutex mutex_;
+  /// Signalled when the first record of a batch is queued, when the batch
+  /// is full, and on Close().
+  condition_variable wake_;
+  string queue_;
+  bool closing_;
+  /// The errno of the first failed write, or 0.
+  int error_;
+};
+
+#endif  // NINJA_LOG_WRITER_H_
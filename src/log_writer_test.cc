@@ -0,0 +1,104 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log_writer.h"
+
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "disk_interface.h"
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "LogWriterTest-tempfile";
+
+struct LogWriterTest : public testing::Test {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  string ReadTestFile() {
+    string contents, err;
+    EXPECT_EQ(FileReader::Okay,
+              disk_.ReadFile(kTestFilename, &contents, &err));
+    return contents;
+  }
+
+  RealDiskInterface disk_;
+};
+
+TEST_F(LogWriterTest, Append) {
+  FILE* f = fopen(kTestFilename, "ab");
+  ASSERT_TRUE(f != NULL);
+  fputs("header\n", f);
+
+  LogWriter writer;
+  writer.Open(f);
+  EXPECT_TRUE(writer.is_open());
+  string expected = "header\n";
+  for (int i = 0; i < 1000; ++i) {
+    string record(i % 7 + 1, 'a' + i % 26);
+    EXPECT_TRUE(writer.Append(record));
+    expected += record;
+  }
+  // More than a batch at once.
+  string large(LogWriter::kMaxBatchSize * 2, 'x');
+  EXPECT_TRUE(writer.Append(large));
+  expected += large;
+  EXPECT_TRUE(writer.Close());
+  EXPECT_FALSE(writer.is_open());
+
+  EXPECT_EQ(expected, ReadTestFile());
+}
+
+TEST_F(LogWriterTest, Reopen) {
+  LogWriter writer;
+  writer.Open(fopen(kTestFilename, "ab"));
+  EXPECT_TRUE(writer.Append("one"));
+  EXPECT_TRUE(writer.Close());
+  writer.Open(fopen(kTestFilename, "ab"));
+  EXPECT_TRUE(writer.Append("two"));
+  EXPECT_TRUE(writer.Close());
+
+  EXPECT_EQ("onetwo", ReadTestFile());
+}
+
+TEST_F(LogWriterTest, WriteError) {
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f != NULL);
+  fclose(f);
+
+  // Writes to a file opened for reading fail.
+  LogWriter writer;
+  writer.Open(fopen(kTestFilename, "rb"));
+  EXPECT_TRUE(writer.Append("lost"));
+  errno = 0;
+  EXPECT_FALSE(writer.Close());
+  EXPECT_NE(0, errno);
+
+  // The error sticks until the writer is reopened.
+  writer.Open(fopen(kTestFilename, "ab"));
+  EXPECT_TRUE(writer.Append("kept"));
+  EXPECT_TRUE(writer.Close());
+  EXPECT_EQ("kept", ReadTestFile());
+}
+
+}  // anonymous namespace
@@ -0,0 +1,877 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <map>
+#include <mutex>
+#include <set>
+
+#include "build_log.h"
+#include "disk_interface.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+// The cache is a header followed by a body.  The header identifies the
+// manifest: its name, the parser options, every file read while parsing
+// with its mtime, the hash of its contents and the unit it was parsed
+// into, and the units.  The body is the State, with nodes, edges and
+// scopes referring to each other by index and each scope to its unit, and
+// is guarded by a hash.
+// Integers are stored in host byte order; the cache never leaves the
+// machine that wrote it.
+
+const char kManifestCachePath[] = ".ninja_manifest";
+
+namespace {
+
+const char kFileSignature[] = "# ninjamanifest\n";
+const uint32_t kCurrentVersion = 6;
+const uint32_t kNone = 0xffffffff;
+
+/// Reads the manifest for ManifestParser, remembering the mtime of every
+/// file it reads.
+struct RecordingFileReader : public FileReader {
+  RecordingFileReader(DiskInterface* disk_interface,
+                      vector<pair<string, TimeStamp> >* files)
+      : disk_interface_(disk_interface), files_(files) {}
+
+  virtual Status ReadFile(const string& path, string* contents, string* err) {
+    // Stat before reading, so that an edit racing with us is caught.
+    string stat_err;
+    files_->push_back(make_pair(path, disk_interface_->Stat(path, &stat_err)));
+    return disk_interface_->ReadFile(path, contents, err);
+  }
+
+  virtual Status MapFile(const string& path, MappedFile* file, string* err) {
+    string stat_err;
+    files_->push_back(make_pair(path, disk_interface_->Stat(path, &stat_err)));
+    return disk_interface_->MapFile(path, file, err);
+  }
+
+  DiskInterface* disk_interface_;
+  vector<pair<string, TimeStamp> >* files_;
+};
+
+struct Writer {
+  void Write32(uint32_t value) {
+    data_.append((const char*)&value, sizeof(value));
+  }
+  void Write64(uint64_t value) {
+    data_.append((const char*)&value, sizeof(value));
+  }
+  void WriteString(StringPiece value) {
+    Write32(value.len_);
+    data_.append(value.str_, value.len_);
+  }
+
+  string data_;
+};
+
+/// Reads what a Writer wrote.  Reading past the end yields zeros and
+/// clears ok_.
+struct Reader {
+  Reader(const char* begin, const char* end)
+      : pos_(begin), end_(end), ok_(true) {}
+
+  uint32_t Read32() {
+    uint32_t value = 0;
+    Take(&value, sizeof(value));
+    return value;
+  }
+  uint64_t Read64() {
+    uint64_t value = 0;
+    Take(&value, sizeof(value));
+    return value;
+  }
+  StringPiece ReadPiece() {
+    uint32_t len = Read32();
+    if (!ok_ || (size_t)(end_ - pos_) < len) {
+      ok_ = false;
+      return StringPiece();
+    }
+    StringPiece piece(pos_, len);
+    pos_ += len;
+    return piece;
+  }
+  string ReadString() { return ReadPiece().AsString(); }
+
+  /// Read an index into a table of |size| entries, or kNone.
+  uint32_t ReadIndex(size_t size) {
+    uint32_t index = Read32();
+    if (index != kNone && index >= size)
+      ok_ = false;
+    return ok_ ? index : kNone;
+  }
+
+  void Take(void* out, size_t size) {
+    if (!ok_ || (size_t)(end_ - pos_) < size) {
+      ok_ = false;
+      return;
+    }
+    memcpy(out, pos_, size);
+    pos_ += size;
+  }
+
+  const char* pos_;
+  const char* end_;
+  bool ok_;
+};
+
+uint64_t HashContents(StringPiece contents) {
+  return BuildLog::LogEntry::HashCommand(contents);
+}
+
+/// Replace the file at |path| with |header| followed by |body|.  Write to
+/// a temporary file and move it into place, so that an interrupted write
+/// never leaves a truncated cache behind.
+bool ReplaceFile(const string& path, StringPiece header, StringPiece body,
+                 string* err) {
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool written =
+      fwrite(header.str_, 1, header.len_, f) == header.len_ &&
+      fwrite(body.str_, 1, body.len_, f) == body.len_;
+  if (fclose(f) != 0)
+    written = false;
+  if (!written) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // On Windows, rename() doesn't replace an existing file.
+  unlink(path.c_str());
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+/// Records which unit each file, and so each scope, belongs to, and what
+/// decides whether a unit can be parsed again on its own.
+struct ManifestCache::Recorder : public ManifestObserver {
+  /// Add to |units|, which may already hold the units of a state being
+  /// parsed into.
+  explicit Recorder(vector<Unit>* units)
+      : units_(units), first_new_(units->size()), sequence_(0),
+        last_pool_(0) {
+    for (size_t i = 0; i < units->size(); ++i)
+      unit_ids_[(*units)[i].env] = (uint32_t)i;
+  }
+
+  virtual void FileParsed(const string& filename, StringPiece contents,
+                          BindingEnv* env) {
+    uint64_t hash = HashContents(contents);
+    lock_guard<mutex> lock(mutex_);
+    ++sequence_;
+    map<BindingEnv*, uint32_t>::iterator i = unit_ids_.find(env);
+    if (i == unit_ids_.end()) {
+      // A new scope: the top level or a subninja, whose parent scope
+      // already has its unit.
+      Unit unit;
+      unit.path = filename;
+      unit.env = env;
+      if (env->parent_)
+        unit.parent = unit_ids_[env->parent_];
+      i = unit_ids_.insert(make_pair(env, (uint32_t)units_->size())).first;
+      units_->push_back(unit);
+      starts_.push_back(sequence_);
+    }
+    File file;
+    file.path = filename;
+    file.mtime = 0;
+    file.hash = hash;
+    file.unit = i->second;
+    files_.push_back(file);
+  }
+
+  virtual void ScopeChanged(BindingEnv* env) {
+    lock_guard<mutex> lock(mutex_);
+    changed_[env] = ++sequence_;
+  }
+
+  virtual void PoolAdded(BindingEnv* env) {
+    lock_guard<mutex> lock(mutex_);
+    last_pool_ = ++sequence_;
+    (*units_)[unit_ids_[env]].declares_globals = true;
+  }
+
+  virtual void DefaultAdded(BindingEnv* env) {
+    lock_guard<mutex> lock(mutex_);
+    (*units_)[unit_ids_[env]].declares_globals = true;
+  }
+
+  /// Decide which of the units added can be parsed again on their own,
+  /// once parsing is done.
+  void Finish() {
+    for (size_t i = first_new_; i < units_->size(); ++i) {
+      Unit* unit = &(*units_)[i];
+      uint64_t start = starts_[i - first_new_];
+      unit->reparsable = i > 0 && last_pool_ < start;
+      for (uint32_t a = i; a > 0 && unit->reparsable; ) {
+        a = (*units_)[a].parent;
+        map<BindingEnv*, uint64_t>::iterator changed =
+            changed_.find((*units_)[a].env);
+        if (changed != changed_.end() && changed->second > start)
+          unit->reparsable = false;
+      }
+    }
+  }
+
+  vector<Unit>* units_;
+  size_t first_new_;
+  /// The files parsed, in order, without their mtimes.
+  vector<File> files_;
+
+  mutex mutex_;
+  map<BindingEnv*, uint32_t> unit_ids_;
+  /// Counts the events below, to order them.
+  uint64_t sequence_;
+  /// When each new unit started.
+  vector<uint64_t> starts_;
+  /// When each scope last gained a binding or rule.
+  map<BindingEnv*, uint64_t> changed_;
+  uint64_t last_pool_;
+};
+
+ManifestCache::ManifestCache(State* state, DiskInterface* disk_interface,
+                             ManifestParserOptions options)
+    : state_(state), disk_interface_(disk_interface), options_(options),
+      loaded_from_cache_(false), reparsed_subninjas_(0), stale_(false) {}
+
+bool ManifestCache::Load(const string& input_file, const string& cache_path,
+                         bool update, string* err) {
+  LoadStatus status = LOAD_NOT_FOUND;
+  if (!cache_path.empty()) {
+    status = Read(input_file, cache_path, err);
+    if (status == LOAD_ERROR)
+      return false;
+  }
+
+  if (status == LOAD_NOT_FOUND && !Parse(input_file, err))
+    return false;
+
+  if (!cache_path.empty() && update && stale_) {
+    // If only mtimes changed, the cache as read just needs them updated.
+    string write_err;
+    if (!(refreshed_.empty() ?
+          Write(input_file, cache_path, &write_err) :
+          ReplaceFile(cache_path, refreshed_, StringPiece(), &write_err))) {
+      Warning("writing %s: %s", cache_path.c_str(), write_err.c_str());
+    }
+  }
+  return true;
+}
+
+vector<pair<string, TimeStamp> > ManifestCache::files() const {
+  vector<pair<string, TimeStamp> > files;
+  for (vector<File>::const_iterator i = files_.begin(); i != files_.end();
+       ++i) {
+    files.push_back(make_pair(i->path, i->mtime));
+  }
+  return files;
+}
+
+bool ManifestCache::Parse(const string& input_file, string* err) {
+  loaded_from_cache_ = false;
+  reparsed_subninjas_ = 0;
+  stale_ = true;
+  refreshed_.clear();
+  files_.clear();
+  units_.clear();
+
+  vector<pair<string, TimeStamp> > read;
+  RecordingFileReader file_reader(disk_interface_, &read);
+  Recorder recorder(&units_);
+  ManifestParserOptions options = options_;
+  options.observer_ = &recorder;
+  ManifestParser parser(state_, &file_reader, options);
+  bool parsed = parser.Load(input_file, err);
+  recorder.Finish();
+
+  if (!parsed) {
+    // Keep the files read, one of which failed to parse.
+    for (vector<pair<string, TimeStamp> >::iterator i = read.begin();
+         i != read.end(); ++i) {
+      File file;
+      file.path = i->first;
+      file.mtime = i->second;
+      file.hash = 0;
+      file.unit = 0;
+      files_.push_back(file);
+    }
+    return false;
+  }
+
+  // Pair the files parsed with their mtimes when read.
+  map<string, TimeStamp> mtimes(read.begin(), read.end());
+  files_.swap(recorder.files_);
+  for (vector<File>::iterator i = files_.begin(); i != files_.end(); ++i)
+    i->mtime = mtimes[i->path];
+  return true;
+}
+
+LoadStatus ManifestCache::Read(const string& input_file,
+                               const string& cache_path, string* err) {
+  METRIC_RECORD_PHASE(".ninja_manifest load");
+  loaded_from_cache_ = false;
+  reparsed_subninjas_ = 0;
+  stale_ = false;
+  refreshed_.clear();
+
+  // Stat before reading: if the cache is replaced in between, we compare
+  // against an older mtime, which errs on the side of reparsing.
+  string stat_err;
+  TimeStamp cache_mtime = disk_interface_->Stat(cache_path, &stat_err);
+  if (cache_mtime <= 0)
+    return LOAD_NOT_FOUND;
+  string contents;
+  if (disk_interface_->ReadFile(cache_path, &contents, &stat_err) !=
+      FileReader::Okay) {
+    return LOAD_NOT_FOUND;
+  }
+
+  const size_t kSignatureLength = sizeof(kFileSignature) - 1;
+  if (contents.compare(0, kSignatureLength, kFileSignature) != 0)
+    return LOAD_NOT_FOUND;
+  Reader header(contents.data() + kSignatureLength,
+                contents.data() + contents.size());
+  if (header.Read32() != kCurrentVersion ||
+      header.ReadString() != input_file ||
+      header.Read32() != (uint32_t)options_.dupe_edge_action_ ||
+      header.Read32() != (uint32_t)options_.phony_cycle_action_ ||
+      !header.ok_) {
+    return LOAD_NOT_FOUND;
+  }
+
+  vector<File> files(header.Read32());
+  vector<size_t> mtime_offsets(files.size());
+  for (size_t i = 0; i < files.size() && header.ok_; ++i) {
+    files[i].path = header.ReadString();
+    mtime_offsets[i] = header.pos_ - contents.data();
+    files[i].mtime = (TimeStamp)header.Read64();
+    files[i].hash = header.Read64();
+    files[i].unit = header.Read32();
+  }
+  vector<Unit> units(header.Read32());
+  vector<uint32_t> unit_envs(units.size());
+  for (size_t i = 0; i < units.size() && header.ok_; ++i) {
+    units[i].path = header.ReadString();
+    units[i].parent = header.ReadIndex(i);
+    unit_envs[i] = header.Read32();
+    uint32_t flags = header.Read32();
+    units[i].reparsable = (flags & 1) != 0;
+    units[i].declares_globals = (flags & 2) != 0;
+    // Only the top level has no parent.
+    if ((i == 0) != (units[i].parent == kNone))
+      header.ok_ = false;
+  }
+  uint64_t hash = header.Read64();
+  if (!header.ok_ || units.empty() ||
+      hash != HashContents(StringPiece(header.pos_,
+                                       header.end_ - header.pos_))) {
+    return LOAD_NOT_FOUND;
+  }
+
+  // Find the units with files that changed.  Generators may write a file
+  // again without changing it, so a file with a new mtime only counts as
+  // changed if its contents did.
+  vector<bool> dropped(units.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    File* f = &files[i];
+    if (f->unit >= units.size())
+      return LOAD_NOT_FOUND;
+    TimeStamp mtime = disk_interface_->Stat(f->path, &stat_err);
+    // A file modified in the same tick as the cache was written may have
+    // changed after we read it without changing its mtime.
+    if (mtime == f->mtime && mtime < cache_mtime)
+      continue;
+    string file_contents;
+    if (mtime > 0 &&
+        disk_interface_->ReadFile(f->path, &file_contents, &stat_err) ==
+            FileReader::Okay &&
+        HashContents(file_contents) == f->hash) {
+      f->mtime = mtime;
+      uint64_t value = (uint64_t)mtime;
+      memcpy(&contents[mtime_offsets[i]], &value, sizeof(value));
+      stale_ = true;
+      continue;
+    }
+    dropped[f->unit] = true;
+  }
+
+  // Changes to the top level can change anything.  A changed subninja is
+  // dropped, along with the subninjas under it, and parsed again, if that
+  // gives the same result as parsing everything.
+  if (dropped[0])
+    return LOAD_NOT_FOUND;
+  vector<uint32_t> reparse;
+  for (size_t i = 1; i < units.size(); ++i) {
+    if (dropped[units[i].parent]) {
+      dropped[i] = true;
+    } else if (dropped[i]) {
+      if (!units[i].reparsable)
+        return LOAD_NOT_FOUND;
+      reparse.push_back(i);
+    }
+    if (dropped[i] && units[i].declares_globals)
+      return LOAD_NOT_FOUND;
+  }
+
+  // The cache matches the manifest; from here on it fills in the state,
+  // leaving out the dropped units.
+  Reader r(header.pos_, header.end_);
+
+  for (uint32_t count = r.Read32(); count > 0 && r.ok_; --count) {
+    string name = r.ReadString();
+    int depth = (int)r.Read32();
+    int64_t memory = (int64_t)r.Read64();
+    bool local = r.Read32() != 0;
+    if (state_->LookupPool(name))
+      r.ok_ = false;
+    else
+      state_->AddPool(new Pool(name, depth, memory, local));
+  }
+
+  vector<BindingEnv*> envs(r.Read32());
+  for (size_t i = 0; i < envs.size() && r.ok_; ++i) {
+    uint32_t parent = r.ReadIndex(i);
+    uint32_t unit = r.ReadIndex(units.size());
+    if (unit == kNone || (i == 0) != (parent == kNone)) {
+      r.ok_ = false;
+      break;
+    }
+    // Scopes of dropped units stay NULL.  Their children belong to
+    // dropped units too.
+    BindingEnv* env = NULL;
+    if (i == 0) {
+      env = &state_->bindings_;
+    } else if (!dropped[unit]) {
+      if (!envs[parent]) {
+        r.ok_ = false;
+        break;
+      }
+      env = new BindingEnv(envs[parent]);
+    }
+    envs[i] = env;
+    for (uint32_t count = r.Read32(); count > 0 && r.ok_; --count) {
+      VarId key = InternVariable(r.ReadPiece());
+      string value = r.ReadString();
+      if (env)
+        env->AddBinding(key, value);
+    }
+    for (uint32_t count = r.Read32(); count > 0 && r.ok_; --count) {
+      Rule* rule = new Rule(r.ReadString());
+      for (uint32_t bindings = r.Read32(); bindings > 0 && r.ok_;
+           --bindings) {
+        EvalString& value = rule->Binding(InternVariable(r.ReadPiece()));
+        for (uint32_t tokens = r.Read32(); tokens > 0 && r.ok_; --tokens) {
+          EvalString::TokenType type = r.Read32() == EvalString::SPECIAL ?
+              EvalString::SPECIAL : EvalString::RAW;
+          value.Add(r.ReadPiece(), type);
+        }
+        value.Detach();
+      }
+      if (env)
+        env->AddRule(rule);
+      else
+        delete rule;
+    }
+  }
+  for (size_t i = 0; i < units.size() && r.ok_; ++i) {
+    if (unit_envs[i] >= envs.size())
+      r.ok_ = false;
+    else
+      units[i].env = envs[unit_envs[i]];
+  }
+
+  vector<Node*> nodes(r.Read32());
+  for (size_t i = 0; i < nodes.size() && r.ok_; ++i) {
+    StringPiece path = r.ReadPiece();
+    uint64_t slash_bits = r.Read64();
+    nodes[i] = state_->GetNode(path, slash_bits);
+    nodes[i]->set_dyndep_pending(r.Read32() != 0);
+  }
+
+  // The edges of dropped units stay NULL.
+  vector<Edge*> edges(r.Read32());
+  vector<Node*> ins, outs;
+  for (size_t i = 0; i < edges.size() && r.ok_; ++i) {
+    uint32_t rule_env = r.ReadIndex(envs.size());
+    string rule_name = r.ReadString();
+    string pool_name = r.ReadString();
+    uint32_t env = r.ReadIndex(envs.size());
+    uint32_t dyndep = r.ReadIndex(nodes.size());
+    ins.resize(r.Read32());
+    for (size_t in = 0; in < ins.size() && r.ok_; ++in) {
+      uint32_t node = r.ReadIndex(nodes.size());
+      ins[in] = node == kNone ? NULL : nodes[node];
+    }
+    int implicit_deps = (int)r.Read32();
+    int order_only_deps = (int)r.Read32();
+    outs.resize(r.Read32());
+    for (size_t out = 0; out < outs.size() && r.ok_; ++out) {
+      uint32_t node = r.ReadIndex(nodes.size());
+      outs[out] = node == kNone ? NULL : nodes[node];
+    }
+    int implicit_outs = (int)r.Read32();
+    bool memory_declared = r.Read32() != 0;
+    int64_t memory = memory_declared ? (int64_t)r.Read64() : 0;
+    int priority = (int)r.Read32();
+    int batch = (int)r.Read32();
+    if (!r.ok_ || env == kNone) {
+      r.ok_ = false;
+      break;
+    }
+    if (!envs[env])
+      continue;
+
+    const Rule* rule = rule_env == kNone || !envs[rule_env] ? NULL :
+        envs[rule_env]->LookupRuleCurrentScope(rule_name);
+    Pool* pool = state_->LookupPool(pool_name);
+    if (!rule || !pool) {
+      r.ok_ = false;
+      break;
+    }
+
+    Edge* edge = edges[i] = state_->AddEdge(rule);
+    edge->pool_ = pool;
+    edge->env_ = envs[env];
+    edge->dyndep_ = dyndep == kNone ? NULL : nodes[dyndep];
+    edge->inputs_.assign(ins.begin(), ins.end());
+    edge->implicit_deps_ = implicit_deps;
+    edge->order_only_deps_ = order_only_deps;
+    edge->outputs_.assign(outs.begin(), outs.end());
+    for (vector<Node*>::iterator o = outs.begin(); o != outs.end(); ++o) {
+      if (*o)
+        (*o)->set_in_edge(edge);
+    }
+    edge->implicit_outs_ = implicit_outs;
+    edge->memory_declared_ = memory_declared;
+    edge->memory_ = memory;
+    edge->priority_ = edge->plan_priority_ = priority;
+    edge->batch_ = batch;
+  }
+
+  // Out-edges are stored rather than rebuilt from the inputs: ones the
+  // parser left behind (e.g. for phony cycles) affect the root nodes.
+  for (size_t i = 0; i < nodes.size() && r.ok_; ++i) {
+    for (uint32_t count = r.Read32(); count > 0 && r.ok_; --count) {
+      uint32_t edge = r.ReadIndex(edges.size());
+      if (edge != kNone && edges[edge])
+        nodes[i]->AddOutEdge(edges[edge]);
+    }
+  }
+
+  for (uint32_t count = r.Read32(); count > 0 && r.ok_; --count) {
+    uint32_t node = r.ReadIndex(nodes.size());
+    if (node != kNone)
+      state_->defaults_.push_back(nodes[node]);
+  }
+
+  if (!r.ok_ || r.pos_ != r.end_) {
+    *err = "corrupt " + cache_path + "; remove it and try again";
+    return LOAD_ERROR;
+  }
+
+  // Keep what the units left describe, renumbered.
+  vector<uint32_t> unit_ids(units.size(), kNone);
+  units_.clear();
+  for (size_t i = 0; i < units.size(); ++i) {
+    if (dropped[i])
+      continue;
+    unit_ids[i] = units_.size();
+    units_.push_back(units[i]);
+    if (i > 0)
+      units_.back().parent = unit_ids[units[i].parent];
+  }
+  files_.clear();
+  for (vector<File>::iterator f = files.begin(); f != files.end(); ++f) {
+    if (dropped[f->unit])
+      continue;
+    files_.push_back(*f);
+    files_.back().unit = unit_ids[f->unit];
+  }
+
+  if (!reparse.empty()) {
+    // Only the dropped edges could have been what made a node dyndep.
+    for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+      (*n)->set_dyndep_pending(false);
+    for (vector<Edge*>::iterator e = state_->edges_.begin();
+         e != state_->edges_.end(); ++e) {
+      if ((*e)->dyndep_)
+        (*e)->dyndep_->set_dyndep_pending(true);
+    }
+
+    vector<pair<string, TimeStamp> > read;
+    RecordingFileReader file_reader(disk_interface_, &read);
+    Recorder recorder(&units_);
+    ManifestParserOptions options = options_;
+    options.observer_ = &recorder;
+    // Duplicate outputs and phony cycles are resolved in favor of what
+    // comes first, which parsing out of order would get wrong; leave them
+    // to a full parse, which also reports any errors in the right context.
+    options.dupe_edge_action_ = kDupeEdgeActionError;
+    options.phony_cycle_action_ = kPhonyCycleActionError;
+    for (vector<uint32_t>::iterator i = reparse.begin(); i != reparse.end();
+         ++i) {
+      ManifestParser parser(state_, &file_reader, options);
+      string parse_err;
+      if (!parser.LoadSubninja(units[*i].path,
+                               units_[unit_ids[units[*i].parent]].env,
+                               &parse_err)) {
+        state_->Clear();
+        files_.clear();
+        units_.clear();
+        return LOAD_NOT_FOUND;
+      }
+    }
+    recorder.Finish();
+
+    map<string, TimeStamp> mtimes(read.begin(), read.end());
+    for (vector<File>::iterator f = recorder.files_.begin();
+         f != recorder.files_.end(); ++f) {
+      files_.push_back(*f);
+      files_.back().mtime = mtimes[f->path];
+    }
+    reparsed_subninjas_ = (int)reparse.size();
+    stale_ = true;
+  }
+
+  // The header holds no hash, so the mtimes can be updated in place.
+  if (stale_ && reparse.empty())
+    refreshed_.swap(contents);
+
+  loaded_from_cache_ = true;
+  return LOAD_SUCCESS;
+}
+
+bool ManifestCache::Write(const string& input_file, const string& cache_path,
+                          string* err) {
+  METRIC_RECORD_PHASE(".ninja_manifest save");
+
+  // Number the scopes parents first, so they can be created in order:
+  // those of the units, then those of edges with bindings of their own.
+  map<const BindingEnv*, uint32_t> env_ids;
+  vector<const BindingEnv*> envs;
+  env_ids[&state_->bindings_] = 0;
+  envs.push_back(&state_->bindings_);
+  vector<const BindingEnv*> leaves;
+  for (vector<Unit>::iterator u = units_.begin(); u != units_.end(); ++u)
+    leaves.push_back(u->env);
+  for (vector<Edge*>::iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    leaves.push_back((*e)->env_);
+  }
+  for (vector<const BindingEnv*>::iterator l = leaves.begin();
+       l != leaves.end(); ++l) {
+    vector<const BindingEnv*> chain;
+    for (const BindingEnv* env = *l; env && !env_ids.count(env);
+         env = env->parent_) {
+      chain.push_back(env);
+    }
+    for (vector<const BindingEnv*>::reverse_iterator i = chain.rbegin();
+         i != chain.rend(); ++i) {
+      env_ids[*i] = envs.size();
+      envs.push_back(*i);
+    }
+  }
+
+  // A scope belongs to the unit it is the scope of, or else to its
+  // parent's.
+  map<const BindingEnv*, uint32_t> unit_ids;
+  for (size_t i = 0; i < units_.size(); ++i)
+    unit_ids[units_[i].env] = i;
+  vector<uint32_t> env_units(envs.size(), 0);
+  for (size_t i = 1; i < envs.size(); ++i) {
+    map<const BindingEnv*, uint32_t>::iterator unit = unit_ids.find(envs[i]);
+    env_units[i] = unit != unit_ids.end() ? unit->second :
+        env_units[env_ids[envs[i]->parent_]];
+  }
+
+  Writer header;
+  header.data_.append(kFileSignature);
+  header.Write32(kCurrentVersion);
+  header.WriteString(input_file);
+  header.Write32(options_.dupe_edge_action_);
+  header.Write32(options_.phony_cycle_action_);
+  header.Write32(files_.size());
+  for (vector<File>::iterator i = files_.begin(); i != files_.end(); ++i) {
+    header.WriteString(i->path);
+    header.Write64(i->mtime);
+    header.Write64(i->hash);
+    header.Write32(i->unit);
+  }
+  header.Write32(units_.size());
+  for (size_t i = 0; i < units_.size(); ++i) {
+    const Unit& unit = units_[i];
+    header.WriteString(unit.path);
+    header.Write32(i > 0 ? unit.parent : kNone);
+    header.Write32(env_ids[unit.env]);
+    header.Write32((unit.reparsable ? 1 : 0) |
+                   (unit.declares_globals ? 2 : 0));
+  }
+
+  Writer w;
+
+  vector<Pool*> pools;
+  for (map<string, Pool*>::iterator i = state_->pools_.begin();
+       i != state_->pools_.end(); ++i) {
+    if (i->second != &State::kDefaultPool && i->second != &State::kConsolePool)
+      pools.push_back(i->second);
+  }
+  w.Write32(pools.size());
+  for (vector<Pool*>::iterator i = pools.begin(); i != pools.end(); ++i) {
+    w.WriteString((*i)->name());
+    w.Write32((*i)->depth());
+    w.Write64((*i)->memory());
+    w.Write32((*i)->local());
+  }
+
+  w.Write32(envs.size());
+  for (size_t i = 0; i < envs.size(); ++i) {
+    const BindingEnv* env = envs[i];
+    w.Write32(env->parent_ ? env_ids[env->parent_] : kNone);
+    w.Write32(env_units[i]);
+    w.Write32(env->bindings_.size());
+    for (BindingEnv::Bindings::const_iterator b = env->bindings_.begin();
+         b != env->bindings_.end(); ++b) {
+      w.WriteString(VariableName(b->first));
+      w.WriteString(b->second);
+    }
+    uint32_t rules = env->rules_.size();
+    if (env->rules_.count(State::kPhonyRule.name()))
+      --rules;
+    w.Write32(rules);
+    for (map<string, const Rule*>::const_iterator r = env->rules_.begin();
+         r != env->rules_.end(); ++r) {
+      const Rule* rule = r->second;
+      if (rule == &State::kPhonyRule)
+        continue;
+      w.WriteString(rule->name());
+      w.Write32(rule->bindings_.size());
+      for (Rule::Bindings::const_iterator b = rule->bindings_.begin();
+           b != rule->bindings_.end(); ++b) {
+        w.WriteString(VariableName(b->first));
+        const EvalString& value = b->second;
+        w.Write32(value.tokens_.size());
+        for (EvalString::TokenList::const_iterator t = value.tokens_.begin();
+             t != value.tokens_.end(); ++t) {
+          w.Write32(t->type);
+          w.WriteString(value.TextOf(*t));
+        }
+      }
+    }
+  }
+
+  map<const Node*, uint32_t> node_ids;
+  vector<const Node*> nodes;
+  nodes.reserve(state_->paths_.size());
+  // Nodes only dropped edges used are left out.
+  set<const Node*> defaults(state_->defaults_.begin(),
+                            state_->defaults_.end());
+  for (State::Paths::iterator i = state_->paths_.begin();
+       i != state_->paths_.end(); ++i) {
+    const Node* node = i->second;
+    if (!node->in_edge() && node->out_edges().empty() &&
+        !defaults.count(node)) {
+      continue;
+    }
+    node_ids[node] = nodes.size();
+    nodes.push_back(node);
+  }
+  w.Write32(nodes.size());
+  for (vector<const Node*>::iterator n = nodes.begin(); n != nodes.end();
+       ++n) {
+    w.WriteString((*n)->path());
+    w.Write64((*n)->slash_bits());
+    w.Write32((*n)->dyndep_pending());
+  }
+
+  w.Write32(state_->edges_.size());
+  for (vector<Edge*>::iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    const Edge* edge = *e;
+    uint32_t rule_env = kNone;
+    for (const BindingEnv* env = edge->env_; env; env = env->parent_) {
+      map<string, const Rule*>::const_iterator r =
+          env->rules_.find(edge->rule_->name());
+      if (r != env->rules_.end() && r->second == edge->rule_) {
+        rule_env = env_ids[env];
+        break;
+      }
+    }
+    w.Write32(rule_env);
+    w.WriteString(edge->rule_->name());
+    w.WriteString(edge->pool_->name());
+    w.Write32(env_ids[edge->env_]);
+    w.Write32(edge->dyndep_ ? node_ids[edge->dyndep_] : kNone);
+    w.Write32(edge->inputs_.size());
+    for (Node* const* i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      w.Write32(node_ids[*i]);
+    }
+    w.Write32(edge->implicit_deps_);
+    w.Write32(edge->order_only_deps_);
+    w.Write32(edge->outputs_.size());
+    for (Node* const* o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      w.Write32(node_ids[*o]);
+    }
+    w.Write32(edge->implicit_outs_);
+    w.Write32(edge->memory_declared_);
+    if (edge->memory_declared_)
+      w.Write64(edge->memory_);
+    w.Write32((uint32_t)edge->priority_);
+    w.Write32((uint32_t)edge->batch_);
+  }
+
+  for (vector<const Node*>::iterator n = nodes.begin(); n != nodes.end();
+       ++n) {
+    const SmallVector<Edge*, 2>& out_edges = (*n)->out_edges();
+    w.Write32(out_edges.size());
+    for (Edge* const* e = out_edges.begin();
+         e != out_edges.end(); ++e) {
+      w.Write32((*e)->id());
+    }
+  }
+
+  w.Write32(state_->defaults_.size());
+  for (vector<Node*>::iterator n = state_->defaults_.begin();
+       n != state_->defaults_.end(); ++n) {
+    w.Write32(node_ids[*n]);
+  }
+
+  header.Write64(BuildLog::LogEntry::HashCommand(w.data_));
+
+  return ReplaceFile(cache_path, header.data_, w.data_, err);
+}
@@ -0,0 +1,128 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_CACHE_H_
+#define NINJA_MANIFEST_CACHE_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include "load_status.h"
+#include "manifest_parser.h"
+#include "timestamp.h"
+
+struct BindingEnv;
+struct DiskInterface;
+struct State;
+
+/// Where ninja keeps the cache, relative to the directory it runs in.
+extern const char kManifestCachePath[];
+
+/// Loads a manifest like ManifestParser, but keeps a binary snapshot of the
+/// resulting State (nodes, edges, rules, pools and scopes) in a cache file.
+/// As long as none of the files the parser read has changed, later loads
+/// read the snapshot instead of parsing.
+///
+/// The snapshot also records which subninja each scope and edge came from
+/// and a hash of each file's contents.  A file whose mtime changed but
+/// whose contents didn't, as when a generator rewrites the whole tree,
+/// doesn't count as changed.  If only subninjas changed, the snapshot is
+/// loaded without them and just those files are parsed again.
+///
+/// The cache can't live next to the logs in $builddir, which is only known
+/// after parsing, so it goes into the working directory.
+struct ManifestCache {
+  ManifestCache(State* state, DiskInterface* disk_interface,
+                ManifestParserOptions options = ManifestParserOptions());
+
+  /// Load |input_file| into the state, reading the cache at |cache_path|
+  /// if it is up to date.  Otherwise parse the manifest and, if |update|,
+  /// rewrite the cache.  An empty |cache_path| just parses.
+  bool Load(const string& input_file, const string& cache_path, bool update,
+            string* err);
+
+  /// Whether the last Load() or Read() came from the cache.
+  bool loaded_from_cache() const { return loaded_from_cache_; }
+
+  /// How many subninjas the last Read() parsed again, because they had
+  /// changed, rather than loading them from the cache.
+  int reparsed_subninjas() const { return reparsed_subninjas_; }
+
+  /// The files the state was loaded from, and their mtimes when read.
+  vector<pair<string, TimeStamp> > files() const;
+
+  /// Parse |input_file| into the state, recording files().
+  bool Parse(const string& input_file, string* err);
+
+  /// Fill the state from the cache at |cache_path|, parsing again any
+  /// subninjas that changed since.  Returns LOAD_NOT_FOUND, leaving the
+  /// state empty, if there is no cache or it doesn't match the manifest
+  /// files on disk closely enough; LOAD_ERROR if it is damaged past that
+  /// point.
+  LoadStatus Read(const string& input_file, const string& cache_path,
+                  string* err);
+
+  /// Write the state, as loaded from files(), to |cache_path|.
+  bool Write(const string& input_file, const string& cache_path,
+             string* err);
+
+ private:
+  struct Recorder;
+
+  /// A file the manifest was loaded from.
+  struct File {
+    string path;
+    TimeStamp mtime;
+    uint64_t hash;
+    /// The index of the unit the file was parsed into.
+    uint32_t unit;
+  };
+
+  /// The statements parsed into one scope: the top-level manifest, which
+  /// is always the first, or a subninja, along with the files they include.
+  struct Unit {
+    Unit() : parent(0), env(NULL), reparsable(false), declares_globals(false) {}
+
+    /// The file that started the unit.
+    string path;
+    /// The index of the unit the subninja line was in.
+    uint32_t parent;
+    BindingEnv* env;
+    /// Whether the unit can be parsed again on its own, with the same
+    /// result: no scope above it gained a binding or rule, and no pool was
+    /// declared, after it was parsed.
+    bool reparsable;
+    /// Whether it declared pools or defaults, which aren't scoped and so
+    /// can't be dropped with it.
+    bool declares_globals;
+  };
+
+  State* state_;
+  DiskInterface* disk_interface_;
+  ManifestParserOptions options_;
+  bool loaded_from_cache_;
+  int reparsed_subninjas_;
+  /// Whether the cache on disk is out of date with files_.
+  bool stale_;
+  /// The cache as Read() read it, with the mtimes of files that were
+  /// written again without changing brought up to date; empty if anything
+  /// else changed.
+  string refreshed_;
+  vector<File> files_;
+  vector<Unit> units_;
+};
+
+#endif  // NINJA_MANIFEST_CACHE_H_
@@ -0,0 +1,421 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+const char kManifest[] =
+"pool link\n"
+"  depth = 2\n"
+"  memory = 8G\n"
+"  local = 1\n"
+"cflags = -O2\n"
+"rule cc\n"
+"  command = cc $cflags -c $in -o $out\n"
+"  description = CC $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"rule link\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"  memory = 2G\n"
+"include rules.ninja\n"
+"build a.o: cc a.c | a.h || gen\n"
+"build b.o: cc b.c\n"
+"  cflags = -g\n"
+"build gen: phony\n"
+"build out | out.map: link a.o b.o\n"
+"subninja sub.ninja\n"
+"default out\n";
+
+const char kRules[] =
+"rule cp\n"
+"  command = cp $in $out\n";
+
+const char kSub[] =
+"cflags = -O0\n"
+"rule cc\n"
+"  command = subcc $cflags $in $out\n"
+"build sub.o: cc sub.c\n"
+"build sub.txt: cp a.c\n"
+"  pool = console\n";
+
+struct ManifestCacheTest : public testing::Test {
+  virtual void SetUp() {
+    // These tests do real disk accesses, so create a temp dir.
+    temp_dir_.CreateAndEnter("Ninja-ManifestCacheTest");
+    WriteFile("build.ninja", kManifest);
+    WriteFile("rules.ninja", kRules);
+    WriteFile("sub.ninja", kSub);
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Write |contents| to |path|, dated |age| seconds in the past so that
+  /// the cache written right after doesn't look racy.
+  void WriteFile(const char* path, const char* contents, int age = 10) {
+    FILE* f = fopen(path, "wb");
+    ASSERT_TRUE(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - age;
+    ASSERT_EQ(0, utime(path, &times));
+  }
+
+  /// A description of everything in |state| the build depends on.
+  string Dump(State* state) {
+    string result;
+    for (vector<Edge*>::iterator e = state->edges_.begin();
+         e != state->edges_.end(); ++e) {
+      Edge* edge = *e;
+      result += edge->rule().name() + " [" + edge->pool()->name() + "] " +
+          edge->EvaluateCommand() + " | " + edge->GetBinding("description") +
+          " | " + edge->GetUnescapedDepfile() + " |";
+      for (Node** i = edge->inputs_.begin();
+           i != edge->inputs_.end(); ++i) {
+        result += " " + (*i)->path();
+      }
+      result += " ->";
+      for (Node** o = edge->outputs_.begin();
+           o != edge->outputs_.end(); ++o) {
+        result += " " + (*o)->path();
+      }
+      char counts[64];
+      snprintf(counts, sizeof(counts), " %d %d %d %d %lld\n",
+               edge->implicit_deps_, edge->order_only_deps_,
+               edge->implicit_outs_, edge->memory_declared_,
+               (long long)edge->memory_);
+      result += counts;
+    }
+    for (map<string, Pool*>::iterator p = state->pools_.begin();
+         p != state->pools_.end(); ++p) {
+      char depth[64];
+      snprintf(depth, sizeof(depth), "%d %lld %d", p->second->depth(),
+               (long long)p->second->memory(), p->second->local());
+      result += "pool " + p->first + " " + depth + "\n";
+    }
+    string err;
+    vector<Node*> defaults = state->DefaultNodes(&err);
+    for (vector<Node*>::iterator n = defaults.begin(); n != defaults.end();
+         ++n) {
+      result += "default " + (*n)->path() + "\n";
+    }
+    return result;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(ManifestCacheTest, RoundTrip) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_EQ("", err);
+  EXPECT_FALSE(writer.loaded_from_cache());
+  EXPECT_EQ(3u, writer.files().size());
+
+  State cached;
+  ManifestCache reader(&cached, &disk_);
+  EXPECT_TRUE(reader.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(reader.loaded_from_cache());
+  EXPECT_EQ(3u, reader.files().size());
+
+  EXPECT_EQ(Dump(&parsed), Dump(&cached));
+  EXPECT_EQ(parsed.paths_.size(), cached.paths_.size());
+  // Edges are numbered as the parser numbered them.
+  for (size_t i = 0; i < cached.edges_.size(); ++i)
+    EXPECT_EQ(i, cached.edges_[i]->id());
+  EXPECT_EQ(2u, cached.LookupNode("a.o")->out_edges().size() +
+                cached.LookupNode("b.o")->out_edges().size());
+
+  // Scopes still resolve against their parents.
+  EXPECT_EQ("-O2", cached.bindings_.LookupVariable("cflags"));
+  EXPECT_TRUE(cached.bindings_.LookupRule("cp") != NULL);
+  EXPECT_TRUE(cached.bindings_.LookupRule("phony") == &State::kPhonyRule);
+}
+
+TEST_F(ManifestCacheTest, ChangedInclude) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  WriteFile("rules.ninja", "rule cp\n  command = copy $in $out\n", 5);
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            reader.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(0u, state.edges_.size());
+
+  // Load() falls back to parsing, and refreshes the cache.
+  EXPECT_TRUE(reader.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_FALSE(reader.loaded_from_cache());
+  EXPECT_EQ("copy a.c sub.txt",
+            state.LookupNode("sub.txt")->in_edge()->EvaluateCommand());
+
+  State cached;
+  ManifestCache again(&cached, &disk_);
+  EXPECT_EQ(LOAD_SUCCESS, again.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(Dump(&state), Dump(&cached));
+}
+
+TEST_F(ManifestCacheTest, RacyManifest) {
+  // A manifest modified as recently as the cache may have changed after
+  // it was read, so its contents are checked.
+  WriteFile("rules.ninja", kRules, -10);
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_EQ(LOAD_SUCCESS,
+            reader.Read("build.ninja", kManifestCachePath, &err));
+
+  WriteFile("rules.ninja", "rule cp\n  command = copy $in $out\n", -10);
+  State changed;
+  ManifestCache again(&changed, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            again.Read("build.ninja", kManifestCachePath, &err));
+}
+
+TEST_F(ManifestCacheTest, RewrittenUnchanged) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  // A generator that writes every file again doesn't change them.
+  WriteFile("build.ninja", kManifest, 5);
+  WriteFile("rules.ninja", kRules, 5);
+  WriteFile("sub.ninja", kSub, 5);
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_TRUE(reader.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_TRUE(reader.loaded_from_cache());
+  EXPECT_EQ(0, reader.reparsed_subninjas());
+  EXPECT_EQ(Dump(&parsed), Dump(&state));
+  EXPECT_EQ(disk_.Stat("build.ninja", &err), reader.files()[0].second);
+
+  // The cache now has the new mtimes.
+  State cached;
+  ManifestCache again(&cached, &disk_);
+  EXPECT_EQ(LOAD_SUCCESS, again.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(disk_.Stat("build.ninja", &err), again.files()[0].second);
+}
+
+TEST_F(ManifestCacheTest, ChangedSubninja) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  const char kNewSub[] =
+"cflags = -O1\n"
+"rule cc\n"
+"  command = subcc $cflags $in $out\n"
+"build sub.o: cc sub.c\n"
+"build sub2.o: cc sub2.c | a.o\n";
+  WriteFile("sub.ninja", kNewSub, 5);
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_TRUE(reader.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(reader.loaded_from_cache());
+  EXPECT_EQ(1, reader.reparsed_subninjas());
+  EXPECT_EQ(3u, reader.files().size());
+
+  // The same as parsing it all again.
+  State fresh;
+  ManifestCache fresh_parser(&fresh, &disk_);
+  EXPECT_TRUE(fresh_parser.Parse("build.ninja", &err));
+  EXPECT_EQ(Dump(&fresh), Dump(&state));
+  EXPECT_EQ("subcc -O1 sub2.c sub2.o",
+            state.LookupNode("sub2.o")->in_edge()->EvaluateCommand());
+  EXPECT_EQ(2u, state.LookupNode("a.o")->out_edges().size());
+  // sub.txt is gone with its edge, and left out of the cache.
+  EXPECT_EQ(NULL, state.LookupNode("sub.txt")->in_edge());
+
+  State cached;
+  ManifestCache again(&cached, &disk_);
+  EXPECT_EQ(LOAD_SUCCESS, again.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(0, again.reparsed_subninjas());
+  EXPECT_EQ(Dump(&fresh), Dump(&cached));
+  EXPECT_EQ(fresh.paths_.size(), cached.paths_.size());
+}
+
+TEST_F(ManifestCacheTest, ChangedNestedSubninja) {
+  WriteFile("sub.ninja", "subninja nested.ninja\nbuild sub.o: cc sub.c\n");
+  WriteFile("nested.ninja", "build nested.o: cc nested.c\n");
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  WriteFile("nested.ninja", "build nested2.o: cc nested.c\n", 5);
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_TRUE(reader.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_EQ(1, reader.reparsed_subninjas());
+  EXPECT_TRUE(state.LookupNode("nested2.o")->in_edge() != NULL);
+  EXPECT_TRUE(state.LookupNode("sub.o")->in_edge() != NULL);
+
+  // A changed subninja takes the ones under it along.
+  WriteFile("sub.ninja", "subninja nested.ninja\n", 5);
+  State again_state;
+  ManifestCache again(&again_state, &disk_);
+  EXPECT_TRUE(again.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_EQ(1, again.reparsed_subninjas());
+  EXPECT_TRUE(again_state.LookupNode("nested2.o")->in_edge() != NULL);
+  EXPECT_EQ(NULL, again_state.LookupNode("sub.o")->in_edge());
+
+  State fresh;
+  ManifestCache fresh_parser(&fresh, &disk_);
+  EXPECT_TRUE(fresh_parser.Parse("build.ninja", &err));
+  EXPECT_EQ(Dump(&fresh), Dump(&again_state));
+}
+
+TEST_F(ManifestCacheTest, SubninjaNotReparsable) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+
+  // Bindings added to the scope above a subninja after it was parsed
+  // would be seen by parsing it again, but not by parsing everything.
+  WriteFile("build.ninja", "subninja sub.ninja\nx = 1\n");
+  WriteFile("sub.ninja", "rule cat\n  command = cat $in > $out\n"
+                         "build out$x: cat in\n");
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+  WriteFile("sub.ninja", "rule cat\n  command = cat $in > $out\n"
+                         "build new$x: cat in\n", 5);
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            reader.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(0u, state.edges_.size());
+  EXPECT_TRUE(reader.Load("build.ninja", kManifestCachePath, true, &err));
+  EXPECT_TRUE(state.LookupNode("new") != NULL);
+
+  // So are pools and defaults, which can't be dropped with a subninja.
+  WriteFile("build.ninja", "subninja sub.ninja\n", 5);
+  WriteFile("sub.ninja", "pool p\n  depth = 1\n", 5);
+  State pooled;
+  ManifestCache pool_writer(&pooled, &disk_);
+  EXPECT_TRUE(pool_writer.Load("build.ninja", kManifestCachePath, true, &err));
+  WriteFile("sub.ninja", "pool p\n  depth = 2\n", 2);
+  State repooled;
+  ManifestCache pool_reader(&repooled, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            pool_reader.Read("build.ninja", kManifestCachePath, &err));
+}
+
+TEST_F(ManifestCacheTest, ReparseFallsBack) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  // An output another edge already builds needs a full parse to tell
+  // which edge wins.  The state is left empty for it.
+  WriteFile("sub.ninja", "build b.o: phony\n", 5);
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            reader.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(0u, state.edges_.size());
+  EXPECT_EQ(0u, state.paths_.size());
+  EXPECT_TRUE(state.bindings_.LookupVariable("cflags").empty());
+  EXPECT_EQ(2u, state.pools_.size());
+}
+
+TEST_F(ManifestCacheTest, OtherManifest) {
+  WriteFile("other.ninja", "build x: phony\n");
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            reader.Read("other.ninja", kManifestCachePath, &err));
+  ManifestParserOptions options;
+  options.dupe_edge_action_ = kDupeEdgeActionError;
+  ManifestCache strict(&state, &disk_, options);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            strict.Read("build.ninja", kManifestCachePath, &err));
+}
+
+TEST_F(ManifestCacheTest, Corrupt) {
+  State parsed;
+  ManifestCache writer(&parsed, &disk_);
+  string err;
+  EXPECT_TRUE(writer.Load("build.ninja", kManifestCachePath, true, &err));
+
+  string contents;
+  ASSERT_EQ(FileReader::Okay,
+            disk_.ReadFile(kManifestCachePath, &contents, &err));
+  contents[contents.size() - 5] ^= 1;
+  FILE* f = fopen(kManifestCachePath, "wb");
+  ASSERT_TRUE(f != NULL);
+  fwrite(contents.data(), contents.size(), 1, f);
+  fclose(f);
+
+  State state;
+  ManifestCache reader(&state, &disk_);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            reader.Read("build.ninja", kManifestCachePath, &err));
+  EXPECT_EQ(0u, state.edges_.size());
+
+  // Truncation is caught as well.
+  f = fopen(kManifestCachePath, "wb");
+  ASSERT_TRUE(f != NULL);
+  fwrite(contents.data(), contents.size() / 2, 1, f);
+  fclose(f);
+  EXPECT_EQ(LOAD_NOT_FOUND,
+            reader.Read("build.ninja", kManifestCachePath, &err));
+}
+
+TEST_F(ManifestCacheTest, NoCache) {
+  State state;
+  ManifestCache cache(&state, &disk_);
+  string err;
+  EXPECT_TRUE(cache.Load("build.ninja", "", true, &err));
+  EXPECT_FALSE(cache.loaded_from_cache());
+  EXPECT_EQ(0, disk_.Stat(kManifestCachePath, &err));
+}
+
+}  // anonymous namespace
@@ -14,25 +14,166 @@
 
 #include "manifest_parser.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+
+#include <algorithm>
+#include <list>
+#include <mutex>
 #include <vector>
 
+#include "disk_interface.h"
 #include "graph.h"
+#include "metrics.h"
+#include "parallel.h"
 #include "state.h"
 #include "util.h"
 #include "version.h"
 
+/// A build statement with its paths evaluated and canonicalized, but not
+/// yet added to the state.
+struct ManifestParser::StagedEdge {
+  StagedEdge() : rule(NULL), env(NULL), outs(0), ins(0), implicit_outs(0),
+                 implicit(0), order_only(0) {}
+
+  const Rule* rule;
+  BindingEnv* env;
+  string pool_name;
+  /// The outputs followed by the inputs.  If a path failed to canonicalize,
+  /// the list stops short of it and path_err says why.
+  vector<pair<string, uint64_t> > paths;
+  string path_err;
+  size_t outs;
+  size_t ins;
+  int implicit_outs;
+  int implicit;
+  int order_only;
+};
+
+/// The statements of a subninja that depend on or change the state,
+/// recorded while parsing it off the main thread.
+struct ManifestParser::Staging {
+  struct Statement {
+    enum Kind { POOL, EDGE, DEFAULT, VERSION };
+
+    Statement(Kind kind, const Lexer& lexer)
+        : kind(kind), lexer(lexer), depth(-1), memory(0), local(false) {}
+
+    Kind kind;
+    /// The position to report errors at.
+    Lexer lexer;
+    /// The pool name, default target or required version.
+    string name;
+    /// The pool depth, or -1 if the pool failed to parse, its memory and
+    /// whether it's local.
+    int depth;
+    int64_t memory;
+    bool local;
+    StagedEdge edge;
+  };
+
+  Staging() : ok(false) {}
+
+  vector<Statement> statements;
+  /// The names and contents of the files parsed, which the lexers in
+  /// |statements| point into.
+  list<string> filenames;
+  list<MappedFile> files;
+  /// Whether parsing succeeded; if not, |err| follows the statements.
+  bool ok;
+  string err;
+};
+
+namespace {
+
+/// Serializes the reads of a FileReader that needn't be thread-safe.
+struct LockedFileReader : public FileReader {
+  explicit LockedFileReader(FileReader* file_reader)
+      : file_reader_(file_reader) {}
+
+  virtual Status ReadFile(const string& path, string* contents, string* err) {
+    lock_guard<mutex> lock(mutex_);
+    return file_reader_->ReadFile(path, contents, err);
+  }
+
+  virtual Status MapFile(const string& path, MappedFile* file, string* err) {
+    lock_guard<mutex> lock(mutex_);
+    return file_reader_->MapFile(path, file, err);
+  }
+
+  FileReader* file_reader_;
+  mutex mutex_;
+};
+
+int SubninjaThreads(const ManifestParserOptions& options) {
+  // METRIC_RECORD isn't thread-safe.
+  if (g_metrics)
+    return 1;
+  if (options.subninja_threads_ > 0)
+    return options.subninja_threads_;
+  return GetProcessorCount();
+}
+
+}  // anonymous namespace
+
+/// Parses each of a run of subninjas into its own Staging.
+struct ManifestParser::SubninjaTask {
+  SubninjaTask(ManifestParser* parent, FileReader* file_reader,
+               const pair<string, Lexer>* subninjas, Staging* stagings)
+      : parent_(parent), file_reader_(file_reader), subninjas_(subninjas),
+        stagings_(stagings) {}
+
+  void operator()(size_t i) {
+    ManifestParser subparser(parent_->state_, file_reader_, parent_->options_);
+    subparser.env_ = new BindingEnv(parent_->env_);
+    subparser.staging_ = &stagings_[i];
+    Lexer lexer = subninjas_[i].second;
+    stagings_[i].ok =
+        subparser.Load(subninjas_[i].first, &stagings_[i].err, &lexer);
+  }
+
+  ManifestParser* parent_;
+  FileReader* file_reader_;
+  const pair<string, Lexer>* subninjas_;
+  Staging* stagings_;
+};
+
 ManifestParser::ManifestParser(State* state, FileReader* file_reader,
                                ManifestParserOptions options)
     : Parser(state, file_reader),
-      options_(options), quiet_(false) {
+      staging_(NULL), options_(options), quiet_(false) {
   env_ = &state->bindings_;
 }
 
-bool ManifestParser::Parse(const string& filename, const string& input,
+bool ManifestParser::LoadSubninja(const string& filename, BindingEnv* parent,
+                                  string* err) {
+  env_ = new BindingEnv(parent);
+  return Load(filename, err);
+}
+
+MappedFile* ManifestParser::InputFile() {
+  if (!staging_)
+    return NULL;
+  staging_->files.emplace_back();
+  return &staging_->files.back();
+}
+
+bool ManifestParser::Parse(const string& filename, StringPiece input,
                            string* err) {
-  lexer_.Start(filename, input);
+  if (staging_) {
+    // Staged statements report their errors after this returns.  Their
+    // input is already kept by InputFile().
+    staging_->filenames.push_back(filename);
+    lexer_.Start(staging_->filenames.back(), input);
+  } else {
+    lexer_.Start(filename, input);
+  }
+  if (options_.observer_) {
+    options_.observer_->FileParsed(
+        filename, StringPiece(input.str_, input.len_ - 1), env_);
+  }
 
   for (;;) {
     Lexer::Token token = lexer_.ReadToken();
@@ -62,9 +203,18 @@ bool ManifestParser::Parse(const string& filename, const string& input,
       string value = let_value.Evaluate(env_);
       // Check ninja_required_version immediately so we can exit
       // before encountering any syntactic surprises.
-      if (name == "ninja_required_version")
-        CheckNinjaVersion(value);
+      if (name == "ninja_required_version") {
+        if (staging_) {
+          staging_->statements.push_back(
+              Staging::Statement(Staging::Statement::VERSION, lexer_));
+          staging_->statements.back().name = value;
+        } else {
+          CheckNinjaVersion(value);
+        }
+      }
       env_->AddBinding(name, value);
+      if (options_.observer_)
+        options_.observer_->ScopeChanged(env_);
       break;
     }
     case Lexer::INCLUDE:
@@ -99,10 +249,21 @@ bool ManifestParser::ParsePool(string* err) {
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
-  if (state_->LookupPool(name) != NULL)
+  // Pools are shared by all files, so a staged pool is only checked for
+  // duplicates when it's added.
+  Staging::Statement* staged = NULL;
+  if (staging_) {
+    staging_->statements.push_back(
+        Staging::Statement(Staging::Statement::POOL, lexer_));
+    staged = &staging_->statements.back();
+    staged->name = name;
+  } else if (state_->LookupPool(name) != NULL) {
     return lexer_.Error("duplicate pool '" + name + "'", err);
+  }
 
   int depth = -1;
+  int64_t memory = 0;
+  bool local = false;
 
   while (lexer_.PeekToken(Lexer::INDENT)) {
     string key;
@@ -115,15 +276,31 @@ bool ManifestParser::ParsePool(string* err) {
       depth = atol(depth_string.c_str());
       if (depth < 0)
         return lexer_.Error("invalid pool depth", err);
+    } else if (key == "memory") {
+      if (!ParseMemorySize(value.Evaluate(env_), &memory))
+        return lexer_.Error("invalid pool memory", err);
+    } else if (key == "local") {
+      local = !value.Evaluate(env_).empty();
     } else {
       return lexer_.Error("unexpected variable '" + key + "'", err);
     }
   }
 
+  // A pool that only has a memory budget doesn't limit its depth.
+  if (depth < 0 && memory > 0)
+    depth = 0;
   if (depth < 0)
     return lexer_.Error("expected 'depth =' line", err);
 
-  state_->AddPool(new Pool(name, depth));
+  if (staged) {
+    staged->depth = depth;
+    staged->memory = memory;
+    staged->local = local;
+  } else {
+    state_->AddPool(new Pool(name, depth, memory, local));
+  }
+  if (options_.observer_)
+    options_.observer_->PoolAdded(env_);
   return true;
 }
 
@@ -156,16 +333,18 @@ bool ManifestParser::ParseRule(string* err) {
     }
   }
 
-  if (rule->bindings_["rspfile"].empty() !=
-      rule->bindings_["rspfile_content"].empty()) {
+  if (rule->Binding(kVarRspfile).empty() !=
+      rule->Binding(kVarRspfileContent).empty()) {
     return lexer_.Error("rspfile and rspfile_content need to be "
                         "both specified", err);
   }
 
-  if (rule->bindings_["command"].empty())
+  if (rule->Binding(kVarCommand).empty())
     return lexer_.Error("expected 'command =' line", err);
 
   env_->AddRule(rule);
+  if (options_.observer_)
+    options_.observer_->ScopeChanged(env_);
   return true;
 }
 
@@ -192,8 +371,15 @@ bool ManifestParser::ParseDefault(string* err) {
     uint64_t slash_bits;  // Unused because this only does lookup.
     if (!CanonicalizePath(&path, &slash_bits, &path_err))
       return lexer_.Error(path_err, err);
-    if (!state_->AddDefault(path, &path_err))
+    if (staging_) {
+      staging_->statements.push_back(
+          Staging::Statement(Staging::Statement::DEFAULT, lexer_));
+      staging_->statements.back().name = path;
+    } else if (!state_->AddDefault(path, &path_err)) {
       return lexer_.Error(path_err, err);
+    }
+    if (options_.observer_)
+      options_.observer_->DefaultAdded(env_);
 
     eval.Clear();
     if (!lexer_.ReadPath(&eval, err))
@@ -304,27 +490,63 @@ bool ManifestParser::ParseEdge(string* err) {
     has_indent_token = lexer_.PeekToken(Lexer::INDENT);
   }
 
-  Edge* edge = state_->AddEdge(rule);
-  edge->env_ = env;
+  StagedEdge local;
+  StagedEdge* staged = &local;
+  if (staging_) {
+    staging_->statements.push_back(
+        Staging::Statement(Staging::Statement::EDGE, lexer_));
+    staged = &staging_->statements.back().edge;
+  }
+  staged->rule = rule;
+  staged->env = env;
+  {
+    // The pool is looked up before the edge has any inputs or outputs.
+    Edge edge;
+    edge.rule_ = rule;
+    edge.env_ = env;
+    staged->pool_name = edge.GetBinding(kVarPool);
+  }
 
-  string pool_name = edge->GetBinding("pool");
+  staged->outs = outs.size();
+  staged->ins = ins.size();
+  staged->implicit_outs = implicit_outs;
+  staged->implicit = implicit;
+  staged->order_only = order_only;
+  staged->paths.reserve(outs.size() + ins.size());
+  for (size_t i = 0; i < outs.size() + ins.size(); ++i) {
+    const EvalString& value =
+        i < outs.size() ? outs[i] : ins[i - outs.size()];
+    string path = value.Evaluate(env);
+    uint64_t slash_bits;
+    if (!CanonicalizePath(&path, &slash_bits, &staged->path_err))
+      break;
+    staged->paths.push_back(make_pair(path, slash_bits));
+  }
+
+  return staging_ || AddEdge(staged, &lexer_, err);
+}
+
+bool ManifestParser::AddEdge(StagedEdge* staged, Lexer* lexer, string* err) {
+  Edge* edge = state_->AddEdge(staged->rule);
+  edge->env_ = staged->env;
+
+  const string& pool_name = staged->pool_name;
   if (!pool_name.empty()) {
     Pool* pool = state_->LookupPool(pool_name);
     if (pool == NULL)
-      return lexer_.Error("unknown pool name '" + pool_name + "'", err);
+      return lexer->Error("unknown pool name '" + pool_name + "'", err);
     edge->pool_ = pool;
   }
 
-  edge->outputs_.reserve(outs.size());
-  for (size_t i = 0, e = outs.size(); i != e; ++i) {
-    string path = outs[i].Evaluate(env);
-    string path_err;
-    uint64_t slash_bits;
-    if (!CanonicalizePath(&path, &slash_bits, &path_err))
-      return lexer_.Error(path_err, err);
-    if (!state_->AddOut(edge, path, slash_bits)) {
+  int implicit_outs = staged->implicit_outs;
+  edge->outputs_.reserve(staged->outs);
+  for (size_t i = 0, e = staged->outs; i != e; ++i) {
+    if (i == staged->paths.size())
+      return lexer->Error(staged->path_err, err);
+    const string& path = staged->paths[i].first;
+    if (!state_->AddOut(edge, path, staged->paths[i].second)) {
       if (options_.dupe_edge_action_ == kDupeEdgeActionError) {
-        lexer_.Error("multiple rules generate " + path + " [-w dupbuild=err]",
+        lexer->Error("multiple rules generate " + path + " [-w dupbuild=err]",
                      err);
         return false;
       } else {
@@ -342,23 +564,20 @@ bool ManifestParser::ParseEdge(string* err) {
   if (edge->outputs_.empty()) {
     // All outputs of the edge are already created by other edges. Don't add
     // this edge.  Do this check before input nodes are connected to the edge.
+    // It stays in the State's arena until the State goes away.
     state_->edges_.pop_back();
-    delete edge;
     return true;
   }
   edge->implicit_outs_ = implicit_outs;
 
-  edge->inputs_.reserve(ins.size());
-  for (vector<EvalString>::iterator i = ins.begin(); i != ins.end(); ++i) {
-    string path = i->Evaluate(env);
-    string path_err;
-    uint64_t slash_bits;
-    if (!CanonicalizePath(&path, &slash_bits, &path_err))
-      return lexer_.Error(path_err, err);
-    state_->AddIn(edge, path, slash_bits);
+  edge->inputs_.reserve(staged->ins);
+  for (size_t i = staged->outs, e = i + staged->ins; i != e; ++i) {
+    if (i == staged->paths.size())
+      return lexer->Error(staged->path_err, err);
+    state_->AddIn(edge, staged->paths[i].first, staged->paths[i].second);
   }
-  edge->implicit_deps_ = implicit;
-  edge->order_only_deps_ = order_only;
+  edge->implicit_deps_ = staged->implicit;
+  edge->order_only_deps_ = staged->order_only;
 
   if (options_.phony_cycle_action_ == kPhonyCycleActionWarn &&
       edge->maybe_phonycycle_diagnostic()) {
@@ -367,7 +586,7 @@ bool ManifestParser::ParseEdge(string* err) {
     // build graph but that has since been fixed.  Filter them out to
     // support users of those old CMake versions.
     Node* out = edge->outputs_[0];
-    vector<Node*>::iterator new_end =
+    Node** new_end =
         remove(edge->inputs_.begin(), edge->inputs_.end(), out);
     if (new_end != edge->inputs_.end()) {
       edge->inputs_.erase(new_end, edge->inputs_.end());
@@ -379,6 +598,37 @@ bool ManifestParser::ParseEdge(string* err) {
     }
   }
 
+  string memory = edge->GetBinding(kVarMemory);
+  if (!memory.empty()) {
+    if (!ParseMemorySize(memory, &edge->memory_))
+      return lexer->Error("invalid memory '" + memory + "'", err);
+    edge->memory_declared_ = true;
+  }
+
+  string priority = edge->GetBinding(kVarPriority);
+  if (!priority.empty()) {
+    char* end;
+    errno = 0;
+    long value = strtol(priority.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || value < INT_MIN || value > INT_MAX)
+      return lexer->Error("invalid priority '" + priority + "'", err);
+    edge->priority_ = edge->plan_priority_ = (int)value;
+  }
+
+  string batch = edge->GetBinding(kVarBatch);
+  if (!batch.empty()) {
+    char* end;
+    errno = 0;
+    long value = strtol(batch.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || value < 1 || value > INT_MAX)
+      return lexer->Error("invalid batch '" + batch + "'", err);
+    // The deps of one command can't be told apart by output.
+    if (value > 1 && (!edge->GetBinding(kVarDeps).empty() ||
+                      !edge->GetBinding(kVarDepfile).empty()))
+      return lexer->Error("batch can't be used with deps or depfile", err);
+    edge->batch_ = (int)value;
+  }
+
   // Lookup, validate, and save any dyndep binding.  It will be used later
   // to load generated dependency information dynamically, but it must
   // be one of our manifest-specified inputs.
@@ -389,10 +639,10 @@ bool ManifestParser::ParseEdge(string* err) {
       return false;
     edge->dyndep_ = state_->GetNode(dyndep, slash_bits);
     edge->dyndep_->set_dyndep_pending(true);
-    vector<Node*>::iterator dgi =
+    Node** dgi =
       std::find(edge->inputs_.begin(), edge->inputs_.end(), edge->dyndep_);
     if (dgi == edge->inputs_.end()) {
-      return lexer_.Error("dyndep '" + dyndep + "' is not an input", err);
+      return lexer->Error("dyndep '" + dyndep + "' is not an input", err);
     }
   }
 
@@ -405,12 +655,44 @@ bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
     return false;
   string path = eval.Evaluate(env_);
 
+  int threads = new_scope && !staging_ ? SubninjaThreads(options_) : 1;
+  if (threads > 1) {
+    // Nothing between consecutive subninja lines can change our scope, so
+    // the whole run can be parsed at once.
+    vector<pair<string, Lexer> > subninjas(1, make_pair(path, lexer_));
+    bool read_newline = false;
+    while (lexer_.PeekToken(Lexer::NEWLINE)) {
+      read_newline = true;
+      Lexer next = lexer_;
+      Lexer::Token token;
+      do {
+        token = lexer_.ReadToken();
+      } while (token == Lexer::NEWLINE);
+      string path_err;
+      eval.Clear();
+      if (token != Lexer::SUBNINJA || !lexer_.ReadPath(&eval, &path_err)) {
+        // Leave whatever this is to Parse().
+        lexer_ = next;
+        break;
+      }
+      subninjas.push_back(make_pair(eval.Evaluate(env_), lexer_));
+      read_newline = false;
+    }
+    if (subninjas.size() > 1) {
+      if (!ParseSubninjas(subninjas, threads, err))
+        return false;
+      return read_newline || ExpectToken(Lexer::NEWLINE, err);
+    }
+    lexer_ = subninjas[0].second;
+  }
+
   ManifestParser subparser(state_, file_reader_, options_);
   if (new_scope) {
     subparser.env_ = new BindingEnv(env_);
   } else {
     subparser.env_ = env_;
   }
+  subparser.staging_ = staging_;
 
   if (!subparser.Load(path, err, &lexer_))
     return false;
@@ -420,3 +702,56 @@ bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
 
   return true;
 }
+
+bool ManifestParser::ParseSubninjas(
+    const vector<pair<string, Lexer> >& subninjas, int threads,
+    string* err) {
+  LockedFileReader file_reader(file_reader_);
+
+  // Only a chunk of files is staged at a time, to bound memory use.
+  const size_t kChunkSize = 256;
+  for (size_t start = 0; start < subninjas.size(); start += kChunkSize) {
+    size_t count = min(kChunkSize, subninjas.size() - start);
+    vector<Staging> stagings(count);
+    SubninjaTask task(this, &file_reader, &subninjas[start], &stagings[0]);
+    ParallelFor(count, threads, task);
+
+    for (size_t i = 0; i < count; ++i) {
+      // Add the statements as the subparser would have.
+      ManifestParser subparser(state_, file_reader_, options_);
+      if (!subparser.Apply(&stagings[i], err))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool ManifestParser::Apply(Staging* staging, string* err) {
+  for (vector<Staging::Statement>::iterator s = staging->statements.begin();
+       s != staging->statements.end(); ++s) {
+    switch (s->kind) {
+    case Staging::Statement::POOL:
+      if (state_->LookupPool(s->name) != NULL)
+        return s->lexer.Error("duplicate pool '" + s->name + "'", err);
+      if (s->depth >= 0)
+        state_->AddPool(new Pool(s->name, s->depth, s->memory, s->local));
+      break;
+    case Staging::Statement::EDGE:
+      if (!AddEdge(&s->edge, &s->lexer, err))
+        return false;
+      break;
+    case Staging::Statement::DEFAULT: {
+      string path_err;
+      if (!state_->AddDefault(s->name, &path_err))
+        return s->lexer.Error(path_err, err);
+      break;
+    }
+    case Staging::Statement::VERSION:
+      CheckNinjaVersion(s->name);
+      break;
+    }
+  }
+  if (!staging->ok)
+    *err = staging->err;
+  return staging->ok;
+}
@@ -15,6 +15,9 @@
 #ifndef NINJA_MANIFEST_PARSER_H_
 #define NINJA_MANIFEST_PARSER_H_
 
+#include <utility>
+#include <vector>
+
 #include "parser.h"
 
 struct BindingEnv;
@@ -30,12 +33,37 @@ enum PhonyCycleAction {
   kPhonyCycleActionError,
 };
 
+/// Told what each file a ManifestParser parses adds to which scope, for
+/// loaders that need to know which statements came from which subninja.
+/// Subninjas are parsed on several threads, so the calls may come from
+/// any of them at once.
+struct ManifestObserver {
+  virtual ~ManifestObserver() {}
+
+  /// The file |filename|, holding |contents|, is about to be parsed into
+  /// |env|.  A subninja's scope is new when its first file is parsed.
+  virtual void FileParsed(const string& filename, StringPiece contents,
+                          BindingEnv* env) = 0;
+  /// A binding or rule was added to |env|.
+  virtual void ScopeChanged(BindingEnv* env) = 0;
+  /// A pool was declared by a file parsed into |env|.
+  virtual void PoolAdded(BindingEnv* env) = 0;
+  /// A default target was declared by a file parsed into |env|.
+  virtual void DefaultAdded(BindingEnv* env) = 0;
+};
+
 struct ManifestParserOptions {
   ManifestParserOptions()
       : dupe_edge_action_(kDupeEdgeActionWarn),
-        phony_cycle_action_(kPhonyCycleActionWarn) {}
+        phony_cycle_action_(kPhonyCycleActionWarn),
+        subninja_threads_(0), observer_(NULL) {}
   DupeEdgeAction dupe_edge_action_;
   PhonyCycleAction phony_cycle_action_;
+  /// How many threads parse runs of subninja files; 0 means one per
+  /// processor.
+  int subninja_threads_;
+  /// Told about the files parsed, if not NULL.
+  ManifestObserver* observer_;
 };
 
 /// Parses .ninja files.
@@ -43,6 +71,10 @@ struct ManifestParser : public Parser {
   ManifestParser(State* state, FileReader* file_reader,
                  ManifestParserOptions options = ManifestParserOptions());
 
+  /// Load and parse |filename| into a new scope under |parent|, as a
+  /// 'subninja' line in a file parsed into |parent| would.
+  bool LoadSubninja(const string& filename, BindingEnv* parent, string* err);
+
   /// Parse a text string of input.  Used by tests.
   bool ParseTest(const string& input, string* err) {
     quiet_ = true;
@@ -50,8 +82,15 @@ struct ManifestParser : public Parser {
   }
 
 private:
+  struct StagedEdge;
+  struct Staging;
+  struct SubninjaTask;
+
   /// Parse a file, given its contents as a string.
-  bool Parse(const string& filename, const string& input, string* err);
+  bool Parse(const string& filename, StringPiece input, string* err);
+
+  /// Keep the files of staged subninjas, which their statements point into.
+  MappedFile* InputFile();
 
   /// Parse various statement types.
   bool ParsePool(string* err);
@@ -63,7 +102,24 @@ private:
   /// Parse either a 'subninja' or 'include' line.
   bool ParseFileInclude(bool new_scope, string* err);
 
+  /// Parse a run of 'subninja' lines, given their paths and the positions
+  /// to report errors loading them at.  The files are parsed on |threads|
+  /// threads and added to the state in order, with the same result as
+  /// parsing them one after the other.
+  bool ParseSubninjas(const vector<pair<string, Lexer> >& subninjas,
+                      int threads, string* err);
+
+  /// Add a parsed build statement to the state, reporting errors at
+  /// |lexer|'s position.
+  bool AddEdge(StagedEdge* staged, Lexer* lexer, string* err);
+
+  /// Add the statements of a file parsed into |staging| to the state.
+  bool Apply(Staging* staging, string* err);
+
   BindingEnv* env_;
+  /// Where statements go instead of the state while parsing a subninja
+  /// off the main thread, or NULL.
+  Staging* staging_;
   ManifestParserOptions options_;
   bool quiet_;
 };
@@ -183,6 +183,34 @@ TEST_F(ParserTest, VariableScope) {
   EXPECT_EQ("cmd bar b outer", state.edges_[1]->EvaluateCommand());
 }
 
+TEST_F(ParserTest, VariableIds) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cmd\n"
+"  command = cmd $zz_late $zz_early $in\n"
+"zz_early = 1\n"
+"build out: cmd a\n"
+"  zz_late = 2\n"
+"  zz_early = 3\n"
+"zz_late = 4\n"));
+
+  // Names are interned once, and scopes bound out of id order still find
+  // them.
+  VarId early = FindVariable("zz_early");
+  VarId late = FindVariable("zz_late");
+  ASSERT_NE(kNoVar, early);
+  ASSERT_NE(kNoVar, late);
+  EXPECT_EQ(late, InternVariable("zz_late"));
+  EXPECT_EQ("zz_early", VariableName(early));
+  EXPECT_EQ(kVarCommand, FindVariable("command"));
+  EXPECT_EQ(kNoVar, FindVariable("zz_never_named"));
+
+  ASSERT_EQ(1u, state.edges_.size());
+  EXPECT_EQ("cmd 2 3 a", state.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("4", state.bindings_.LookupVariableById(late));
+  EXPECT_EQ("1", state.bindings_.LookupVariable("zz_early"));
+  EXPECT_EQ("", state.bindings_.LookupVariable("zz_never_named"));
+}
+
 TEST_F(ParserTest, Continuation) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "rule link\n"
@@ -811,6 +839,63 @@ TEST_F(ParserTest, Errors) {
               , err);
   }
 
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  memory = lots\n", &err));
+    EXPECT_EQ("input:2: invalid pool memory\n"
+              "  memory = lots\n"
+              "               ^ near here"
+              , err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "build out: run in\n"
+                                  "  memory = 1X\n", &err));
+    EXPECT_EQ("input:5: invalid memory '1X'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "build out: run in\n"
+                                  "  priority = high\n", &err));
+    EXPECT_EQ("input:5: invalid priority 'high'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  batch = 0\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:5: invalid batch '0'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  batch = 8\n"
+                                  "  deps = gcc\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:6: batch can't be used with deps or depfile\n", err);
+  }
+
   {
     State local_state;
     ManifestParser parser(&local_state, NULL);
@@ -836,6 +921,45 @@ TEST_F(ParserTest, Errors) {
   }
 }
 
+TEST_F(ParserTest, Memory) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  memory = 8G\n"
+"rule link\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"  memory = 2G\n"
+"build a: link a.o\n"
+"build b: link b.o\n"
+"  memory = 512M\n"
+"build c: link c.o\n"
+"  memory =\n"));
+
+  Pool* pool = state.LookupPool("link");
+  ASSERT_TRUE(pool != NULL);
+  EXPECT_EQ(0, pool->depth());
+  EXPECT_EQ(8 * 1024 * 1024, pool->memory());
+  ASSERT_EQ(3u, state.edges_.size());
+  EXPECT_TRUE(state.edges_[0]->memory_declared_);
+  EXPECT_EQ(2 * 1024 * 1024, state.edges_[0]->memory());
+  EXPECT_EQ(512 * 1024, state.edges_[1]->memory());
+  EXPECT_FALSE(state.edges_[2]->memory_declared_);
+}
+
+TEST_F(ParserTest, LocalPool) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 2\n"
+"  local = 1\n"
+"pool compile\n"
+"  depth = 8\n"));
+
+  EXPECT_TRUE(state.LookupPool("link")->local());
+  EXPECT_FALSE(state.LookupPool("compile")->local());
+  EXPECT_TRUE(state.LookupPool("console")->local());
+  EXPECT_FALSE(state.LookupPool("")->local());
+}
+
 TEST_F(ParserTest, MissingInput) {
   State local_state;
   ManifestParser parser(&local_state, &fs_);
@@ -923,6 +1047,163 @@ TEST_F(ParserTest, DuplicateRuleInDifferentSubninjasWithInclude) {
                                 "build y : cat\n", &err));
 }
 
+namespace {
+
+/// Parse |input| with runs of subninjas spread over |threads| threads, and
+/// describe the resulting state, or the error.
+string ParseSubninjasWith(VirtualFileSystem* fs, const char* input,
+                          int threads) {
+  State state;
+  ManifestParserOptions options;
+  options.dupe_edge_action_ = kDupeEdgeActionError;
+  options.subninja_threads_ = threads;
+  ManifestParser parser(&state, fs, options);
+  string err;
+  if (!parser.ParseTest(input, &err))
+    return "error: " + err;
+
+  string result;
+  for (vector<Edge*>::iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    char id[32];
+    snprintf(id, sizeof(id), "%d ", (int)(*e)->id());
+    result += id + (*e)->EvaluateCommand() + " [" + (*e)->pool()->name() +
+        "]";
+    for (Node** o = (*e)->outputs_.begin();
+         o != (*e)->outputs_.end(); ++o) {
+      result += " " + (*o)->path();
+    }
+    result += "\n";
+  }
+  for (vector<Node*>::iterator n = state.defaults_.begin();
+       n != state.defaults_.end(); ++n) {
+    result += "default " + (*n)->path() + "\n";
+  }
+  return result;
+}
+
+}  // anonymous namespace
+
+TEST_F(ParserTest, SubNinjaRun) {
+  fs_.Create("a.ninja",
+    "pool p\n"
+    "  depth = 1\n"
+    "var = a\n"
+    "build a.o: cc a.c\n"
+    "  pool = p\n");
+  // Sees the pool and targets of the previous file.
+  fs_.Create("b.ninja",
+    "build b.o: cc b.c\n"
+    "  pool = p\n"
+    "build all: phony a.o b.o\n"
+    "default a.o all\n");
+  fs_.Create("c.ninja",
+    "include inc.ninja\n"
+    "build $var.o: cc c.c\n");
+  fs_.Create("inc.ninja", "var = c\n");
+  const char kInput[] =
+"rule cc\n"
+"  command = cc $var $in\n"
+"var = top\n"
+"subninja a.ninja\n"
+"\n"
+"# comment\n"
+"subninja b.ninja\n"
+"subninja c.ninja\n"
+"build top.o: cc top.c\n";
+
+  EXPECT_EQ("0 cc a a.c [p] a.o\n"
+            "1 cc top b.c [p] b.o\n"
+            "2  [] all\n"
+            "3 cc c c.c [] c.o\n"
+            "4 cc top top.c [] top.o\n"
+            "default a.o\n"
+            "default all\n",
+            ParseSubninjasWith(&fs_, kInput, 1));
+  EXPECT_EQ(ParseSubninjasWith(&fs_, kInput, 1),
+            ParseSubninjasWith(&fs_, kInput, 3));
+}
+
+TEST_F(ParserTest, SubNinjaRunErrors) {
+  fs_.Create("rules.ninja",
+    "rule cc\n"
+    "  command = cc $in\n");
+  fs_.Create("out.ninja",
+    "include rules.ninja\n"
+    "build out: cc in\n");
+  fs_.Create("pool.ninja",
+    "pool p\n"
+    "  depth = 1\n");
+  fs_.Create("uses_pool.ninja",
+    "include rules.ninja\n"
+    "build x: cc y\n"
+    "  pool = p\n");
+  fs_.Create("default.ninja", "default out\n");
+  fs_.Create("broken.ninja", "build\n");
+
+  const char* kInputs[] = {
+    // A later file's output, pool or default target conflicts with or
+    // relies on an earlier one.
+    "subninja out.ninja\nsubninja out.ninja\n",
+    "subninja pool.ninja\nsubninja pool.ninja\n",
+    "subninja uses_pool.ninja\nsubninja pool.ninja\n",
+    "subninja default.ninja\nsubninja out.ninja\n",
+    // The first error wins, after the files before it were added.
+    "subninja out.ninja\nsubninja missing.ninja\nsubninja broken.ninja\n",
+    "subninja out.ninja\nsubninja broken.ninja\nsubninja missing.ninja\n",
+    "subninja out.ninja\nsubninja pool.ninja extra\n",
+    "subninja pool.ninja\nsubninja uses_pool.ninja\nbuild\n",
+  };
+  const char* kErrors[] = {
+    "out.ninja:3: multiple rules generate out [-w dupbuild=err]\n",
+    "pool.ninja:1: duplicate pool 'p'\n"
+        "pool p\n"
+        "      ^ near here",
+    "uses_pool.ninja:4: unknown pool name 'p'\n",
+    "default.ninja:1: unknown target 'out'\n"
+        "default out\n"
+        "           ^ near here",
+    "input:2: loading 'missing.ninja': No such file or directory\n"
+        "subninja missing.ninja\n"
+        "                      ^ near here",
+    "broken.ninja:1: expected path\n"
+        "build\n"
+        "     ^ near here",
+    "input:2: expected newline, got identifier\n"
+        "subninja pool.ninja extra\n"
+        "                    ^ near here",
+    "input:3: expected path\n"
+        "build\n"
+        "     ^ near here",
+  };
+  for (size_t i = 0; i < sizeof(kInputs) / sizeof(kInputs[0]); ++i) {
+    EXPECT_EQ(ParseSubninjasWith(&fs_, kInputs[i], 1),
+              ParseSubninjasWith(&fs_, kInputs[i], 2));
+    EXPECT_EQ(string("error: ") + kErrors[i],
+              ParseSubninjasWith(&fs_, kInputs[i], 2));
+  }
+}
+
+TEST_F(ParserTest, RulesOutliveTheirFiles) {
+  // Rules keep their own copy of their bindings' text, which is otherwise
+  // only held on to for as long as the parse takes.
+  fs_.Create("rules.ninja", "rule cat\n  command = cat $in > $out\n");
+  fs_.Create("sub.ninja",
+"rule cp\n"
+"  command = cp $in $out\n"
+"build sub_out: cp sub_in\n");
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"include rules.ninja\n"
+"subninja sub.ninja\n"
+"build out: cat in\n"));
+  fs_.Create("rules.ninja", "");
+  fs_.Create("sub.ninja", "");
+
+  ASSERT_EQ(2u, state.edges_.size());
+  EXPECT_EQ("cp sub_in sub_out", state.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("cat in > out", state.edges_[1]->EvaluateCommand());
+}
+
 TEST_F(ParserTest, Include) {
   fs_.Create("include.ninja", "var = inner\n");
   ASSERT_NO_FATAL_FAILURE(AssertParse(
@@ -0,0 +1,321 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "memory_stats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+// As in subprocess-win32.cc, so that there's no psapi.lib to link.
+#define PSAPI_VERSION 2
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "state.h"
+
+namespace {
+
+/// The heap bytes of |s|, beyond the string itself, which holds short
+/// strings inline.
+size_t HeapBytes(const string& s) {
+  const char* data = s.data();
+  const char* self = reinterpret_cast<const char*>(&s);
+  if (data >= self && data < self + sizeof(s))
+    return 0;
+  return s.capacity() + 1;
+}
+
+template <typename T>
+size_t HeapBytes(const vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+template <typename T, unsigned N>
+size_t HeapBytes(const SmallVector<T, N>& v) {
+  return v.capacity() > N ? v.capacity() * sizeof(T) : 0;
+}
+
+template <typename V>
+size_t HeapBytes(const StringPieceHashMap<V>& map) {
+  return map.bucket_count() *
+      (sizeof(unsigned) + sizeof(typename StringPieceHashMap<V>::value_type));
+}
+
+/// The bytes of one entry of a std::map: the tree node's links and color,
+/// and the entry.
+template <typename K, typename V>
+size_t MapEntryBytes(const map<K, V>&) {
+  return 4 * sizeof(void*) + sizeof(pair<const K, V>);
+}
+
+/// The bytes of a node, with the cold part and the path.
+size_t NodeBytes(const Node* node) {
+  return sizeof(Node) + sizeof(NodeCold) + HeapBytes(node->path()) +
+      HeapBytes(node->out_edges());
+}
+
+/// |bytes| in the largest unit that keeps it above 1.
+string FormatBytes(size_t bytes) {
+  const char* const kUnits[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  double value = (double)bytes;
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < sizeof(kUnits) / sizeof(kUnits[0])) {
+    value /= 1024;
+    ++unit;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), unit ? "%.1f %s" : "%.0f %s", value,
+           kUnits[unit]);
+  return buf;
+}
+
+/// Orders scopes by their bytes, most first.
+struct MoreBytes {
+  bool operator()(const MemoryStats::Scope* a,
+                  const MemoryStats::Scope* b) const {
+    return a->bytes > b->bytes;
+  }
+};
+
+}  // anonymous namespace
+
+MemoryStats::Category* MemoryStats::Get(const char* name) {
+  for (vector<Category>::iterator c = categories_.begin();
+       c != categories_.end(); ++c) {
+    if (strcmp(c->name, name) == 0)
+      return &*c;
+  }
+  categories_.push_back(Category(name));
+  return &categories_.back();
+}
+
+void MemoryStats::Add(const char* name, size_t count, size_t bytes) {
+  Category* category = Get(name);
+  category->count += count;
+  category->bytes += bytes;
+}
+
+size_t MemoryStats::EvalStringBytes(const EvalString& eval) {
+  return HeapBytes(eval.tokens_) + HeapBytes(eval.text_);
+}
+
+size_t MemoryStats::RuleBytes(const Rule* rule) {
+  size_t bytes = sizeof(Rule) + HeapBytes(rule->name_) +
+      HeapBytes(rule->bindings_);
+  for (Rule::Bindings::const_iterator b = rule->bindings_.begin();
+       b != rule->bindings_.end(); ++b)
+    bytes += EvalStringBytes(b->second);
+  return bytes;
+}
+
+size_t MemoryStats::EnvBytes(const BindingEnv* env) {
+  size_t bytes = sizeof(BindingEnv) + HeapBytes(env->bindings_) +
+      env->rules_.size() * MapEntryBytes(env->rules_);
+  for (BindingEnv::Bindings::const_iterator b = env->bindings_.begin();
+       b != env->bindings_.end(); ++b)
+    bytes += HeapBytes(b->second);
+  return bytes;
+}
+
+void MemoryStats::AddState(const State& state) {
+  size_t node_bytes = 0, path_bytes = 0;
+  for (State::Paths::const_iterator p = state.paths_.begin();
+       p != state.paths_.end(); ++p) {
+    const Node* node = p->second;
+    node_bytes += sizeof(Node) + sizeof(NodeCold) +
+        HeapBytes(node->out_edges());
+    path_bytes += HeapBytes(node->path());
+  }
+  Add("nodes", state.paths_.size(), node_bytes);
+  Add("node paths", state.paths_.size(), path_bytes);
+  Add("path index", state.paths_.size(), HeapBytes(state.paths_));
+
+  // Each file a subninja reads gets a scope, and each edge with bindings
+  // of its own gets one too, under the scope of its file.  Nothing records
+  // which is which, but an edge's scope serves only that edge and has no
+  // rules; a file with one edge and no rules is counted with its parent.
+  map<const BindingEnv*, size_t> env_edges;
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e)
+    ++env_edges[(*e)->env_];
+
+  map<const BindingEnv*, size_t> scope_index;
+  scopes_.push_back(Scope());
+  scopes_.back().env = &state.bindings_;
+  scope_index[&state.bindings_] = scopes_.size() - 1;
+
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    const Edge* edge = *e;
+    const BindingEnv* env = edge->env_;
+    size_t bytes = sizeof(Edge) + HeapBytes(edge->inputs_) +
+        HeapBytes(edge->outputs_);
+    Add("edges", 1, bytes);
+    if (env->parent_ && env->rules_.empty() && env_edges[env] == 1) {
+      size_t env_bytes = EnvBytes(env);
+      Add("edge scopes", 1, env_bytes);
+      bytes += env_bytes;
+      env = env->parent_;
+    }
+
+    // The nodes an edge builds are counted with it; the others, like
+    // source files, only in total.
+    for (Node* const* o = edge->outputs_.begin(); o != edge->outputs_.end();
+         ++o)
+      bytes += NodeBytes(*o);
+
+    map<const BindingEnv*, size_t>::iterator i = scope_index.find(env);
+    if (i == scope_index.end()) {
+      i = scope_index.insert(make_pair(env, scopes_.size())).first;
+      scopes_.push_back(Scope());
+      scopes_.back().env = env;
+    }
+    Scope* scope = &scopes_[i->second];
+    if (scope->first_output.empty() && !edge->outputs_.empty())
+      scope->first_output = edge->outputs_[0]->path();
+    ++scope->edges;
+    scope->bytes += bytes;
+  }
+  Get("edges")->bytes += HeapBytes(state.edges_);
+
+  for (vector<Scope>::iterator s = scopes_.begin(); s != scopes_.end(); ++s) {
+    size_t bytes = EnvBytes(s->env);
+    Add("file scopes", 1, bytes);
+    for (map<string, const Rule*>::const_iterator r = s->env->rules_.begin();
+         r != s->env->rules_.end(); ++r) {
+      if (r->second == &State::kPhonyRule)
+        continue;
+      size_t rule_bytes = RuleBytes(r->second);
+      Add("rules", 1, rule_bytes);
+      bytes += rule_bytes;
+    }
+    s->bytes += bytes;
+  }
+}
+
+void MemoryStats::AddBuildLog(const BuildLog& log) {
+  Add("build log entries", log.entries_.size(),
+      log.entries_.size() * sizeof(BuildLog::LogEntry) +
+          HeapBytes(log.entries_));
+  Add("build log paths", log.paths_.size(),
+      log.output_strings_.bytes() + HeapBytes(log.path_ids_) +
+          HeapBytes(log.paths_));
+  mapped_ += log.mapped_.size();
+}
+
+void MemoryStats::AddDepsLog(const DepsLog& log) {
+  size_t bytes = log.deps_storage_.size() * sizeof(DepsLog::Deps) +
+      HeapBytes(log.deps_) + log.owned_ids_.capacity() / 8;
+  for (size_t id = 0; id < log.deps_.size(); ++id) {
+    if (!log.owned_ids_[id])
+      continue;
+    // Ids that RecordDeps() gave several outputs are counted in front,
+    // and shared out between them here.
+    const int* ids = log.deps_[id]->nodes.ids_;
+    bytes += (log.deps_[id]->node_count + 1) * sizeof(int) / ids[-1];
+  }
+  Add("deps log deps", log.deps_storage_.size(), bytes);
+
+  // The decoded blocks are a megabyte, unless one record needed more.
+  const size_t kDecodedBlockSize = 1 << 20;
+  Add("deps log paths", log.paths_.size(),
+      HeapBytes(log.nodes_) + HeapBytes(log.paths_) +
+          HeapBytes(log.path_ids_) + HeapBytes(log.last_path_) +
+          log.decoded_blocks_.size() * kDecodedBlockSize);
+  mapped_ += log.mapped_.size();
+}
+
+size_t MemoryStats::total() const {
+  size_t bytes = 0;
+  for (vector<Category>::const_iterator c = categories_.begin();
+       c != categories_.end(); ++c)
+    bytes += c->bytes;
+  return bytes;
+}
+
+void MemoryStats::Report(FILE* out, size_t top) const {
+  fprintf(out, "%-20s %10s %12s\n", "category", "count", "bytes");
+  for (vector<Category>::const_iterator c = categories_.begin();
+       c != categories_.end(); ++c) {
+    fprintf(out, "%-20s %10zu %12s\n", c->name, c->count,
+            FormatBytes(c->bytes).c_str());
+  }
+  fprintf(out, "%-20s %10s %12s\n", "total", "",
+          FormatBytes(total()).c_str());
+  fprintf(out, "%-20s %10s %12s\n", "logs mapped", "",
+          FormatBytes(mapped_).c_str());
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 33)
+  // What the estimates leave out: the allocator's overhead, and whatever
+  // else the process allocated.
+  fprintf(out, "%-20s %10s %12s\n", "heap in use", "",
+          FormatBytes(mallinfo2().uordblks).c_str());
+#endif
+#endif
+  size_t peak = PeakResidentKB();
+  if (peak)
+    fprintf(out, "%-20s %10s %12s\n", "peak resident", "",
+            FormatBytes(peak * 1024).c_str());
+
+  if (!top || scopes_.empty())
+    return;
+  vector<const Scope*> scopes;
+  for (vector<Scope>::const_iterator s = scopes_.begin(); s != scopes_.end();
+       ++s)
+    scopes.push_back(&*s);
+  stable_sort(scopes.begin(), scopes.end(), MoreBytes());
+  if (scopes.size() > top)
+    scopes.resize(top);
+
+  fprintf(out, "\nfile scopes holding the most:\n");
+  fprintf(out, "%12s %10s  %s\n", "bytes", "edges", "first output");
+  for (vector<const Scope*>::const_iterator s = scopes.begin();
+       s != scopes.end(); ++s) {
+    string name = (*s)->first_output;
+    if ((*s)->env == scopes_[0].env)
+      name += " (top level)";
+    fprintf(out, "%12s %10zu  %s\n", FormatBytes((*s)->bytes).c_str(),
+            (*s)->edges, name.c_str());
+  }
+}
+
+size_t PeakResidentKB() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS memory;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)))
+    return 0;
+  return memory.PeakWorkingSetSize / 1024;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;  // In bytes here.
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
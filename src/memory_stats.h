@@ -0,0 +1,100 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MEMORY_STATS_H_
+#define NINJA_MEMORY_STATS_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct BindingEnv;
+struct BuildLog;
+struct DepsLog;
+struct EvalString;
+struct Rule;
+struct State;
+
+/// Where the memory of a loaded build goes: the nodes and edges, their
+/// paths, the bindings of the rules and scopes, and the logs, in total and
+/// by the file scope the edges were declared in.  See "-t memstats".
+///
+/// The sizes are estimates from the objects' sizes and the capacities of
+/// the containers they own, without the allocator's overhead.  The parts
+/// of the logs that point into the mapped files count as mapped, not as
+/// heap.
+struct MemoryStats {
+  MemoryStats() : mapped_(0) {}
+
+  void AddState(const State& state);
+  void AddBuildLog(const BuildLog& log);
+  void AddDepsLog(const DepsLog& log);
+
+  /// The heap bytes of all the categories.
+  size_t total() const;
+
+  /// Print the categories, the |top| file scopes holding the most, and
+  /// how much the process holds, to |out|.
+  void Report(FILE* out, size_t top) const;
+
+  struct Category {
+    explicit Category(const char* name) : name(name), count(0), bytes(0) {}
+    const char* name;
+    /// The number of objects, of the kind the name says.
+    size_t count;
+    size_t bytes;
+  };
+  /// In the order they were first added.
+  vector<Category> categories_;
+
+  /// A scope of the manifest, which subninja makes for each file it
+  /// reads, with the edges declared in it and what they hold.
+  struct Scope {
+    Scope() : env(NULL), edges(0), bytes(0) {}
+    const BindingEnv* env;
+    /// The first output declared in the scope, to tell it by, or empty
+    /// if it has no edges.
+    string first_output;
+    size_t edges;
+    /// The edges, the nodes they build, their own bindings, and the
+    /// scope's bindings and rules.
+    size_t bytes;
+  };
+  /// The top-level scope first, then the others in the order their first
+  /// edges were declared.
+  vector<Scope> scopes_;
+
+  /// The bytes of the logs that are mapped from their files.
+  size_t mapped_;
+
+ private:
+  /// The category |name|, added if it's new.
+  Category* Get(const char* name);
+  /// Add |count| objects and |bytes| to the category |name|.
+  void Add(const char* name, size_t count, size_t bytes);
+
+  /// The bytes of a scope's own bindings and rule table, and of a rule
+  /// or an EvalString.
+  static size_t EnvBytes(const BindingEnv* env);
+  static size_t RuleBytes(const Rule* rule);
+  static size_t EvalStringBytes(const EvalString& eval);
+};
+
+/// The peak resident set size of this process in kilobytes, or 0 if the
+/// OS doesn't say.
+size_t PeakResidentKB();
+
+#endif  // NINJA_MEMORY_STATS_H_
@@ -0,0 +1,143 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "memory_stats.h"
+
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct MemoryStatsTest : public testing::Test, public BuildLogUser {
+  virtual void SetUp() {
+    fs_.Create("sub.ninja",
+"rule link\n"
+"  command = link $in -o $out\n"
+"build sub1: link a.o\n"
+"build sub2: link sub1\n"
+"  extra = " + string(100, 'x') + "\n");
+    ManifestParser parser(&state_, &fs_);
+    string err;
+    ASSERT_TRUE(parser.ParseTest(
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"build a.o: cc a.c\n"
+"build b.o: cc b.c\n"
+"  flags = -O2\n"
+"subninja sub.ninja\n", &err));
+    ASSERT_EQ("", err);
+  }
+
+  virtual bool IsPathDead(StringPiece s) const { return false; }
+
+  const MemoryStats::Category* Find(const char* name) {
+    for (size_t i = 0; i < stats_.categories_.size(); ++i) {
+      if (strcmp(stats_.categories_[i].name, name) == 0)
+        return &stats_.categories_[i];
+    }
+    return NULL;
+  }
+
+  State state_;
+  VirtualFileSystem fs_;
+  MemoryStats stats_;
+};
+
+TEST_F(MemoryStatsTest, State) {
+  stats_.AddState(state_);
+
+  const MemoryStats::Category* nodes = Find("nodes");
+  ASSERT_TRUE(nodes);
+  EXPECT_EQ(6u, nodes->count);  // a.c, b.c, a.o, b.o, sub1, sub2
+  EXPECT_GE(nodes->bytes, 6 * sizeof(Node));
+
+  const MemoryStats::Category* edges = Find("edges");
+  ASSERT_TRUE(edges);
+  EXPECT_EQ(4u, edges->count);
+
+  // The two edges with bindings of their own have scopes of their own.
+  const MemoryStats::Category* edge_scopes = Find("edge scopes");
+  ASSERT_TRUE(edge_scopes);
+  EXPECT_EQ(2u, edge_scopes->count);
+
+  // The phony rule isn't counted.
+  const MemoryStats::Category* rules = Find("rules");
+  ASSERT_TRUE(rules);
+  EXPECT_EQ(2u, rules->count);
+
+  ASSERT_EQ(2u, stats_.scopes_.size());
+  EXPECT_EQ(&state_.bindings_, stats_.scopes_[0].env);
+  EXPECT_EQ("a.o", stats_.scopes_[0].first_output);
+  EXPECT_EQ(2u, stats_.scopes_[0].edges);
+  EXPECT_EQ("sub1", stats_.scopes_[1].first_output);
+  EXPECT_EQ(2u, stats_.scopes_[1].edges);
+  // The subninja's long binding lives on the heap.
+  EXPECT_GT(stats_.scopes_[1].bytes, stats_.scopes_[0].bytes);
+
+  size_t total = 0;
+  for (size_t i = 0; i < stats_.categories_.size(); ++i)
+    total += stats_.categories_[i].bytes;
+  EXPECT_EQ(total, stats_.total());
+}
+
+TEST_F(MemoryStatsTest, Logs) {
+  const char kBuildLog[] = "MemoryStatsTest-build-log";
+  const char kDepsLog[] = "MemoryStatsTest-deps-log";
+
+  {
+    BuildLog log;
+    DepsLog deps_log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kBuildLog, *this, &err));
+    ASSERT_TRUE(deps_log.OpenForWrite(kDepsLog, &err));
+    for (size_t i = 0; i < state_.edges_.size(); ++i) {
+      Edge* edge = state_.edges_[i];
+      log.RecordCommand(edge, 0, 1);
+      deps_log.RecordDeps(edge->outputs_[0], 1,
+                          vector<Node*>(edge->inputs_.begin(),
+                                        edge->inputs_.end()));
+    }
+    log.Close();
+    deps_log.Close();
+  }
+
+  BuildLog log;
+  DepsLog deps_log;
+  string err;
+  ASSERT_EQ(LOAD_SUCCESS, log.Load(kBuildLog, &err));
+  ASSERT_EQ(LOAD_SUCCESS, deps_log.Load(kDepsLog, &state_, &err));
+  stats_.AddBuildLog(log);
+  stats_.AddDepsLog(deps_log);
+
+  const MemoryStats::Category* deps = Find("deps log deps");
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(4u, deps->count);
+  EXPECT_GE(deps->bytes, 4 * sizeof(DepsLog::Deps));
+  EXPECT_TRUE(Find("build log entries"));
+  EXPECT_GT(stats_.mapped_, 0u);
+
+  unlink(kBuildLog);
+  unlink(kDepsLog);
+}
+
+}  // anonymous namespace
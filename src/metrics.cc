@@ -19,26 +19,35 @@
 #include <string.h>
 
 #ifndef _WIN32
-#include <sys/time.h>
+#include <time.h>
 #else
 #include <windows.h>
 #endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define NINJA_HAVE_RDTSC
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define NINJA_HAVE_RDTSC
+#endif
 
 #include <algorithm>
 
+#include "probes.h"
 #include "util.h"
 
 Metrics* g_metrics = NULL;
+Tracer* g_tracer = NULL;
 
 namespace {
 
 #ifndef _WIN32
 /// Compute a platform-specific high-res timer value that fits into an int64.
 int64_t HighResTimer() {
-  timeval tv;
-  if (gettimeofday(&tv, NULL) < 0)
-    Fatal("gettimeofday: %s", strerror(errno));
-  return (int64_t)tv.tv_sec * 1000*1000 + tv.tv_usec;
+  timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    Fatal("clock_gettime: %s", strerror(errno));
+  return (int64_t)ts.tv_sec * 1000*1000 + ts.tv_nsec / 1000;
 }
 
 /// Convert a delta of HighResTimer() values to microseconds.
@@ -72,32 +81,134 @@ int64_t TimerToMicros(int64_t dt) {
 }
 #endif
 
+/// The ticks of the clock for metrics, which is called on hot paths.  The
+/// time stamp counter costs a few nanoseconds to read; elsewhere, the
+/// monotonic clock in nanoseconds is next best.
+int64_t MetricTicks() {
+#if defined(NINJA_HAVE_RDTSC)
+  return __rdtsc();
+#elif defined(_WIN32)
+  return HighResTimer();
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/// The bucket of a Metric's histogram that |ticks| go in.
+int BucketOf(int64_t ticks) {
+  if (ticks < 4)
+    return ticks < 0 ? 0 : (int)ticks;
+  int log2 = 2;
+  while (log2 < 62 && (ticks >> (log2 + 1)) != 0)
+    ++log2;
+  return (log2 - 1) * 4 + (int)((ticks >> (log2 - 2)) & 3);
+}
+
+/// The most ticks that go in |bucket|.
+int64_t BucketLimit(int bucket) {
+  if (bucket < 4)
+    return bucket;
+  int log2 = bucket / 4 + 1;
+  return ((int64_t)(4 + bucket % 4 + 1) << (log2 - 2)) - 1;
+}
+
+/// Write |str| as a JSON string.
+void WriteJSONString(FILE* file, const string& str) {
+  fputc('"', file);
+  for (string::const_iterator c = str.begin(); c != str.end(); ++c) {
+    if (*c == '"' || *c == '\\')
+      fprintf(file, "\\%c", *c);
+    else if ((unsigned char)*c < 0x20)
+      fprintf(file, "\\u%04x", (unsigned char)*c);
+    else
+      fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
 }  // anonymous namespace
 
 
-ScopedMetric::ScopedMetric(Metric* metric) {
+ScopedMetric::ScopedMetric(Metric* metric, const char* phase) {
   metric_ = metric;
+  phase_ = phase;
+  if (phase_) {
+    NINJA_PROBE1(phase__start, phase_);
+    if (g_tracer)
+      phase_start_ = GetTimeMicros();
+  }
   if (!metric_)
     return;
-  start_ = HighResTimer();
+  start_ = MetricTicks();
 }
 ScopedMetric::~ScopedMetric() {
+  if (phase_) {
+    if (g_tracer)
+      g_tracer->Phase(phase_, phase_start_, GetTimeMicros());
+    NINJA_PROBE1(phase__done, phase_);
+  }
   if (!metric_)
     return;
-  metric_->count++;
-  int64_t dt = TimerToMicros(HighResTimer() - start_);
-  metric_->sum += dt;
+  metric_->Add(MetricTicks() - start_);
+}
+
+void Metric::Add(int64_t ticks) {
+  ++count;
+  sum += ticks;
+  if (ticks > max)
+    max = ticks;
+  ++buckets[BucketOf(ticks)];
 }
 
+int64_t Metric::Percentile(double fraction) const {
+  int64_t wanted = (int64_t)(fraction * count + 0.5);
+  int64_t seen = 0;
+  for (int i = 0; i < kMetricBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= wanted && seen > 0)
+      return min(BucketLimit(i), max);
+  }
+  return max;
+}
+
+Metrics::Metrics()
+    : start_ticks_(MetricTicks()), start_micros_(GetTimeMicros()) {}
+
 Metric* Metrics::NewMetric(const string& name) {
   Metric* metric = new Metric;
   metric->name = name;
   metric->count = 0;
   metric->sum = 0;
+  metric->max = 0;
+  fill(metric->buckets, metric->buckets + kMetricBuckets, 0);
   metrics_.push_back(metric);
   return metric;
 }
 
+Counter* Metrics::NewCounter(const string& name) {
+  // Each instance of a template has a counter of its own name to share.
+  lock_guard<mutex> lock(counters_mutex_);
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    if ((*i)->name == name)
+      return *i;
+  }
+  Counter* counter = new Counter;
+  counter->name = name;
+  counter->value = 0;
+  counters_.push_back(counter);
+  return counter;
+}
+
+double Metrics::TicksPerMicro() const {
+  int64_t micros = GetTimeMicros() - start_micros_;
+  if (micros <= 0)
+    return 1;
+  return (MetricTicks() - start_ticks_) / (double)micros;
+}
+
 void Metrics::Report() {
   int width = 0;
   for (vector<Metric*>::iterator i = metrics_.begin();
@@ -105,16 +216,74 @@ void Metrics::Report() {
     width = max((int)(*i)->name.size(), width);
   }
 
-  printf("%-*s\t%-6s\t%-9s\t%s\n", width,
-         "metric", "count", "avg (us)", "total (ms)");
+  double ticks_per_us = TicksPerMicro();
+  printf("%-*s\t%-6s\t%-9s\t%-10s\t%-8s\t%-8s\t%-8s\t%s\n", width,
+         "metric", "count", "avg (us)", "total (ms)", "p50 (us)", "p90 (us)",
+         "p99 (us)", "max (us)");
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    Metric* metric = *i;
+    double total = metric->sum / ticks_per_us / 1000;
+    double avg = metric->sum / ticks_per_us / metric->count;
+    printf("%-*s\t%-6d\t%-8.1f\t%-10.1f\t%-8.1f\t%-8.1f\t%-8.1f\t%.1f\n",
+           width, metric->name.c_str(), metric->count, avg, total,
+           metric->Percentile(0.5) / ticks_per_us,
+           metric->Percentile(0.9) / ticks_per_us,
+           metric->Percentile(0.99) / ticks_per_us,
+           metric->max / ticks_per_us);
+  }
+
+  lock_guard<mutex> lock(counters_mutex_);
+  if (counters_.empty())
+    return;
+  width = 0;
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    width = max((int)(*i)->name.size(), width);
+  }
+  printf("\n%-*s\t%s\n", width, "counter", "count");
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    printf("%-*s\t%lld\n", width, (*i)->name.c_str(),
+           (long long)(*i)->value);
+  }
+}
+
+bool Metrics::ReportJSON(const string& path, string* err) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    *err = strerror(errno);
+    return false;
+  }
+  double ticks_per_us = TicksPerMicro();
+  fprintf(file, "{\"metrics\":[");
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
     Metric* metric = *i;
-    double total = metric->sum / (double)1000;
-    double avg = metric->sum / (double)metric->count;
-    printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, avg, total);
+    fprintf(file, "%s\n  {\"name\":", i == metrics_.begin() ? "" : ",");
+    WriteJSONString(file, metric->name);
+    fprintf(file, ",\"count\":%d,\"total_us\":%.1f,\"p50_us\":%.1f,"
+            "\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}",
+            metric->count, metric->sum / ticks_per_us,
+            metric->Percentile(0.5) / ticks_per_us,
+            metric->Percentile(0.9) / ticks_per_us,
+            metric->Percentile(0.99) / ticks_per_us,
+            metric->max / ticks_per_us);
+  }
+  fprintf(file, "\n],\"counters\":{");
+  lock_guard<mutex> lock(counters_mutex_);
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    fprintf(file, "%s\n  ", i == counters_.begin() ? "" : ",");
+    WriteJSONString(file, (*i)->name);
+    fprintf(file, ":%lld", (long long)(*i)->value);
+  }
+  fprintf(file, "\n}}\n");
+  if (fclose(file) != 0) {
+    *err = strerror(errno);
+    return false;
   }
+  return true;
 }
 
 uint64_t Stopwatch::Now() const {
@@ -125,3 +294,97 @@ int64_t GetTimeMillis() {
   return TimerToMicros(HighResTimer()) / 1000;
 }
 
+int64_t GetTimeMicros() {
+  return TimerToMicros(HighResTimer());
+}
+
+bool Tracer::Open(const string& path, string* err) {
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    *err = path + ": " + strerror(errno);
+    return false;
+  }
+  start_ = GetTimeMicros();
+  fprintf(file_, "[\n");
+  thread_lanes_[this_thread::get_id()] = 0;
+  NameLane(0, "ninja");
+  return true;
+}
+
+void Tracer::Close() {
+  lock_guard<mutex> lock(mutex_);
+  if (!file_)
+    return;
+  // The metadata event has no comma after it.
+  fprintf(file_, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+          "\"args\":{\"name\":\"ninja\"}}\n]\n");
+  fclose(file_);
+  file_ = NULL;
+}
+
+int Tracer::AcquireJobLane() {
+  lock_guard<mutex> lock(mutex_);
+  size_t lane = 0;
+  while (lane < job_lanes_.size() && job_lanes_[lane])
+    ++lane;
+  if (lane == job_lanes_.size()) {
+    job_lanes_.push_back(false);
+    char name[32];
+    snprintf(name, sizeof(name), "job %d", (int)lane + 1);
+    NameLane(lane + 1, name);
+  }
+  job_lanes_[lane] = true;
+  return lane + 1;
+}
+
+void Tracer::ReleaseJobLane(int lane) {
+  lock_guard<mutex> lock(mutex_);
+  job_lanes_[lane - 1] = false;
+}
+
+void Tracer::Slice(const string& name, const char* category, int lane,
+                   int64_t start, int64_t end) {
+  lock_guard<mutex> lock(mutex_);
+  if (!file_)
+    return;
+  fprintf(file_, "{\"name\":");
+  WriteJSONString(file_, name);
+  fprintf(file_, ",\"cat\":");
+  WriteJSONString(file_, category);
+  fprintf(file_, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":0,"
+          "\"tid\":%d},\n", (long long)(start - start_),
+          (long long)(end - start), lane);
+}
+
+void Tracer::Phase(const char* name, int64_t start, int64_t end) {
+  int lane;
+  {
+    lock_guard<mutex> lock(mutex_);
+    map<thread::id, int>::iterator i =
+        thread_lanes_.find(this_thread::get_id());
+    if (i != thread_lanes_.end()) {
+      lane = i->second;
+    } else {
+      lane = next_thread_lane_--;
+      thread_lanes_[this_thread::get_id()] = lane;
+      char lane_name[32];
+      snprintf(lane_name, sizeof(lane_name), "thread %d", -lane);
+      NameLane(lane, lane_name);
+    }
+  }
+  Slice(name, "ninja", lane, start, end);
+}
+
+void Tracer::NameLane(int lane, const string& name) {
+  if (!file_)
+    return;
+  fprintf(file_, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+          "\"tid\":%d,\"args\":{\"name\":", lane);
+  WriteJSONString(file_, name);
+  fprintf(file_, "}},\n");
+  // Keep the lanes in order: ninja's own, then the jobs, then threads.
+  fprintf(file_, "{\"name\":\"thread_sort_index\",\"ph\":\"M\","
+          "\"pid\":0,\"tid\":%d,\"args\":{\"sort_index\":%d}},\n",
+          lane, lane < 0 ? 1000000 - lane : lane);
+}
+
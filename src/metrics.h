@@ -15,7 +15,13 @@
 #ifndef NINJA_METRICS_H_
 #define NINJA_METRICS_H_
 
+#include <stdio.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 using namespace std;
 
@@ -24,44 +30,124 @@ using namespace std;
 /// The Metrics module is used for the debug mode that dumps timing stats of
 /// various actions.  To use, see METRIC_RECORD below.
 
+/// The number of buckets of a Metric's histogram: four for each power of
+/// two.
+const int kMetricBuckets = 256;
+
 /// A single metrics we're tracking, like "depfile load time".
+/// Times are in ticks of a cheap clock, which the report converts.
 struct Metric {
   string name;
   /// Number of times we've hit the code path.
   int count;
-  /// Total time (in micros) we've spent on the code path.
+  /// Total time we've spent on the code path.
   int64_t sum;
+  /// The longest time.
+  int64_t max;
+  /// How many times took each range of time, on a log scale.
+  int64_t buckets[kMetricBuckets];
+
+  /// Record one time.
+  void Add(int64_t ticks);
+  /// The time below which |fraction| of the times were, roughly.
+  int64_t Percentile(double fraction) const;
 };
 
+/// A count of events too cheap to time, like "stat calls".  Bumped from
+/// any thread.
+struct Counter {
+  string name;
+  atomic<int64_t> value;
+
+  void Add(int64_t n) { value.fetch_add(n, memory_order_relaxed); }
+};
 
 /// A scoped object for recording a metric across the body of a function.
-/// Used by the METRIC_RECORD macro.
+/// Used by the METRIC_RECORD and METRIC_RECORD_PHASE macros.
 struct ScopedMetric {
-  explicit ScopedMetric(Metric* metric);
+  /// |phase|, if given, is the name to show the body as in a trace.
+  explicit ScopedMetric(Metric* metric, const char* phase = NULL);
   ~ScopedMetric();
 
 private:
   Metric* metric_;
-  /// Timestamp when the measurement started.
-  /// Value is platform-dependent.
+  const char* phase_;
+  /// Ticks when the measurement started.
   int64_t start_;
+  /// Time when the phase started, as GetTimeMicros().
+  int64_t phase_start_;
 };
 
 /// The singleton that stores metrics and prints the report.
 struct Metrics {
+  Metrics();
+
   Metric* NewMetric(const string& name);
+  Counter* NewCounter(const string& name);
 
   /// Print a summary report to stdout.
   void Report();
 
+  /// Write the report as JSON to |path|.  Returns false on error.
+  bool ReportJSON(const string& path, string* err);
+
 private:
+  /// The number of ticks in a microsecond, from how far the clock went
+  /// since the metrics were created.
+  double TicksPerMicro() const;
+
   vector<Metric*> metrics_;
+  /// Counters are first bumped on whatever thread gets there first.
+  mutex counters_mutex_;
+  vector<Counter*> counters_;
+  int64_t start_ticks_;
+  int64_t start_micros_;
 };
 
 /// Get the current time as relative to some epoch.
 /// Epoch varies between platforms; only useful for measuring elapsed time.
 int64_t GetTimeMillis();
 
+/// The same as GetTimeMillis(), in microseconds.
+int64_t GetTimeMicros();
+
+/// Streams a timeline of the build to a file in the Trace Event format,
+/// which chrome://tracing and ui.perfetto.dev load.  Each command is a
+/// slice on the lane of the job slot it ran in, and each phase of ninja's
+/// own work a slice on the lane of the thread that did it.  Used for
+/// "-d trace=FILE".
+struct Tracer {
+  Tracer() : file_(NULL), start_(0), next_thread_lane_(-1) {}
+  ~Tracer() { Close(); }
+
+  bool Open(const string& path, string* err);
+  /// Finish the file.  Unfinished files load too.
+  void Close();
+
+  /// Take the free job slot lane with the lowest number, from 1 up.
+  int AcquireJobLane();
+  void ReleaseJobLane(int lane);
+
+  /// Record a slice from |start| to |end| (as GetTimeMicros()).
+  void Slice(const string& name, const char* category, int lane,
+             int64_t start, int64_t end);
+  /// Record a phase of ninja's work on the calling thread's lane.
+  void Phase(const char* name, int64_t start, int64_t end);
+
+ private:
+  /// Name a lane when it's first used.  Call with mutex_ held.
+  void NameLane(int lane, const string& name);
+
+  FILE* file_;
+  int64_t start_;
+  mutex mutex_;
+  /// The job slot lanes, and whether each is taken.
+  vector<bool> job_lanes_;
+  /// The lanes of threads (0 for the main one, the rest negative).
+  map<thread::id, int> thread_lanes_;
+  int next_thread_lane_;
+};
+
 /// A simple stopwatch which returns the time
 /// in seconds since Restart() was called.
 struct Stopwatch {
@@ -87,6 +173,24 @@ struct Stopwatch {
       g_metrics ? g_metrics->NewMetric(name) : NULL;                    \
   ScopedMetric metrics_h_scoped(metrics_h_metric);
 
+/// METRIC_RECORD that also shows the function in a trace.  Use it for the
+/// big phases of a build, not for code that runs for every node.
+#define METRIC_RECORD_PHASE(name)                                       \
+  static Metric* metrics_h_metric =                                     \
+      g_metrics ? g_metrics->NewMetric(name) : NULL;                    \
+  ScopedMetric metrics_h_scoped(metrics_h_metric, name);
+
+/// Add |n| to the counter |name|.  Without "-d stats" this costs a load and
+/// a branch, so it can go on the hottest paths.
+#define METRIC_COUNT(name, n)                                           \
+  do {                                                                  \
+    static Counter* metrics_h_counter =                                 \
+        g_metrics ? g_metrics->NewCounter(name) : NULL;                 \
+    if (metrics_h_counter)                                              \
+      metrics_h_counter->Add(n);                                        \
+  } while (0)
+
 extern Metrics* g_metrics;
+extern Tracer* g_tracer;
 
 #endif // NINJA_METRICS_H_
@@ -62,8 +62,8 @@ void WriteDepFileOrDie(const char* object_path, const CLParser& parse) {
     unlink(depfile_path.c_str());
     Fatal("writing %s", depfile_path.c_str());
   }
-  const set<string>& headers = parse.includes_;
-  for (set<string>::const_iterator i = headers.begin();
+  const vector<string>& headers = parse.includes_;
+  for (vector<string>::const_iterator i = headers.begin();
        i != headers.end(); ++i) {
     if (fprintf(depfile, "%s\n", EscapeForDepfile(*i).c_str()) < 0) {
       unlink(object_path);
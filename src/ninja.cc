@@ -17,7 +17,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <cstdlib>
+#include <memory>
+#include <thread>
 
 #ifdef _WIN32
 #include "getopt.h"
@@ -25,23 +28,38 @@
 #include <windows.h>
 #elif defined(_AIX)
 #include "getopt.h"
+#include <signal.h>
 #include <unistd.h>
 #else
 #include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 #endif
 
 #include "browse.h"
 #include "build.h"
 #include "build_log.h"
+#include "depfile_cache.h"
 #include "deps_log.h"
 #include "clean.h"
+#include "critical_path.h"
 #include "debug_flags.h"
 #include "disk_interface.h"
+#include "failure_log.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "hash_log.h"
+#include "jobserver.h"
+#include "manifest_cache.h"
 #include "manifest_parser.h"
+#include "memory_stats.h"
 #include "metrics.h"
+#include "parallel.h"
+#include "regen_stamp.h"
+#include "scan_summary.h"
+#ifndef _WIN32
+#include "server.h"
+#endif
 #include "state.h"
 #include "util.h"
 #include "version.h"
@@ -58,6 +76,9 @@ namespace {
 
 struct Tool;
 
+/// Where "-d stats=FILE" writes the metrics, or empty to print them.
+string g_metrics_file;
+
 /// Command-line options.
 struct Options {
   /// Build file to load.
@@ -74,13 +95,21 @@ struct Options {
 
   /// Whether phony cycles should warn or print an error.
   bool phony_cycle_should_err;
+
+  /// Whether to free the scopes of the manifest once it is loaded (see
+  /// State::CompactScopes()).
+  bool compact_scopes;
 };
 
 /// The Ninja main() loads up a series of data structures; various tools need
 /// to poke into these, so store them as fields on an object.
 struct NinjaMain : public BuildLogUser {
   NinjaMain(const char* ninja_command, const BuildConfig& config) :
-      ninja_command_(ninja_command), config_(config) {}
+      ninja_command_(ninja_command), config_(config), scan_summary_(NULL) {}
+  ~NinjaMain() {
+    if (log_loader_.joinable())
+      log_loader_.join();
+  }
 
   /// Command line used to run Ninja.
   const char* ninja_command_;
@@ -99,6 +128,23 @@ struct NinjaMain : public BuildLogUser {
 
   BuildLog build_log_;
   DepsLog deps_log_;
+  HashLog hash_log_;
+  DyndepCache dyndep_cache_;
+  DepfileCache depfile_cache_;
+  /// What RunBuild() may skip scanning, if anything tracks it.
+  ScanSummary* scan_summary_;
+
+  /// A log that StartLoadingLogs() loaded, from |path|.
+  struct PreloadedLog {
+    PreloadedLog() : status(LOAD_NOT_FOUND) {}
+    string path;
+    LoadStatus status;
+    string err;
+  };
+  PreloadedLog preloaded_build_log_;
+  PreloadedLog preloaded_deps_log_;
+  /// The thread StartLoadingLogs() started.
+  thread log_loader_;
 
   /// The type of functions that are the entry points to tools (subcommands).
   typedef int (NinjaMain::*ToolFunc)(const Options*, int, char**);
@@ -111,6 +157,19 @@ struct NinjaMain : public BuildLogUser {
   bool CollectTargetsFromArgs(int argc, char* argv[],
                               vector<Node*>* targets, string* err);
 
+  /// The type of functions that describe a target as a JSON object, for
+  /// RunBatchTool.
+  typedef void (NinjaMain::*BatchFunc)(const string& target, string* json);
+
+  /// Read targets from stdin, one per line, and print what \a func makes
+  /// of each on a line of its own, flushed as soon as it's done, so that
+  /// a tool can answer many queries for the cost of one load.
+  int RunBatchTool(BatchFunc func);
+
+  /// The JSON forms of "-t query" and "-t deps" for one target.
+  void QueryJSON(const string& target, string* json);
+  void DepsJSON(const string& target, string* json);
+
   // The various subcommands, run via "-t XXX".
   int ToolGraph(const Options* options, int argc, char* argv[]);
   int ToolQuery(const Options* options, int argc, char* argv[]);
@@ -119,22 +178,68 @@ struct NinjaMain : public BuildLogUser {
   int ToolMSVC(const Options* options, int argc, char* argv[]);
   int ToolTargets(const Options* options, int argc, char* argv[]);
   int ToolCommands(const Options* options, int argc, char* argv[]);
+  int ToolInputs(const Options* options, int argc, char* argv[]);
   int ToolClean(const Options* options, int argc, char* argv[]);
   int ToolCleanDead(const Options* options, int argc, char* argv[]);
   int ToolCompilationDatabase(const Options* options, int argc, char* argv[]);
+  int ToolCriticalPath(const Options* options, int argc, char* argv[]);
+  int ToolMemStats(const Options* options, int argc, char* argv[]);
+  int ToolMergeLogs(const Options* options, int argc, char* argv[]);
   int ToolRecompact(const Options* options, int argc, char* argv[]);
   int ToolRestat(const Options* options, int argc, char* argv[]);
   int ToolUrtle(const Options* options, int argc, char** argv);
   int ToolRules(const Options* options, int argc, char* argv[]);
+  int ToolServe(const Options* options, int argc, char* argv[]);
+  int ToolUsage(const Options* options, int argc, char* argv[]);
+
+  /// Start loading the build and deps logs on another thread, guessing
+  /// that they are in |build_dir|, so that it overlaps with loading the
+  /// manifest.  OpenBuildLog() and OpenDepsLog() take what it loaded if
+  /// the guess was right.  The logs don't need the manifest: the deps log
+  /// only creates nodes for its paths once a lookup needs them.
+  void StartLoadingLogs(const string& build_dir);
+
+  /// Wait for StartLoadingLogs(), once build_dir_ is known.  Returns false
+  /// if it loaded a log from the wrong place; then this NinjaMain has to
+  /// be thrown away.
+  bool FinishLoadingLogs();
+
+  /// Load the logs StartLoadingLogs() asked for, on its thread.
+  void LoadLogs();
 
   /// Open the build log.
   /// @return LOAD_ERROR on error.
   bool OpenBuildLog(bool recompact_only = false);
 
-  /// Open the deps log: load it, then open for writing.
+  /// Open the deps log: load it, then open for writing.  Unless only
+  /// recompacting, the hash log and the dyndep and depfile caches are
+  /// opened along with it.
   /// @return LOAD_ERROR on error.
   bool OpenDepsLog(bool recompact_only = false);
 
+  /// Open the hash log for the edges with hash_inputs: load it, then
+  /// open for writing.
+  /// @return false on error.
+  bool OpenHashLog();
+
+  /// Load the dyndep and depfile caches.
+  /// @return false on error.
+  bool OpenDyndepCache();
+
+  /// Close the logs, finishing their recompaction, and write the dyndep
+  /// and depfile caches.  real_main() exit()s without destroying this, so do it
+  /// explicitly.
+  void CloseLogs() {
+    build_log_.Close();
+    deps_log_.Close();
+    hash_log_.Close();
+    string err;
+    if (!config_.dry_run && !dyndep_cache_.Write(&err))
+      Warning("writing dyndep cache: %s", err.c_str());
+    if (!config_.dry_run && !depfile_cache_.Write(&err))
+      Warning("writing depfile cache: %s", err.c_str());
+  }
+
   /// Ensure the build directory exists, creating it if necessary.
   /// @return false on error.
   bool EnsureBuildDirExists();
@@ -144,6 +249,11 @@ struct NinjaMain : public BuildLogUser {
   /// @return true if the manifest was rebuilt.
   bool RebuildManifest(const char* input_file, string* err);
 
+  /// Run what |builder| planned as a dry run with Builder::DryRun(),
+  /// printing the commands in config_.dry_run_format.
+  /// @return false on error.
+  bool DryRun(Builder* builder, string* err);
+
   /// Build the targets listed on the command line.
   /// @return an exit code.
   int RunBuild(int argc, char** argv);
@@ -170,6 +280,13 @@ struct NinjaMain : public BuildLogUser {
       Error("%s", err.c_str());  // Log and ignore Stat() errors.
     return mtime == 0;
   }
+
+  virtual string CommandFor(StringPiece output) const {
+    Node* node = state_.LookupNode(output);
+    if (!node || !node->in_edge())
+      return string();
+    return node->in_edge()->EvaluateCommand(true);
+  }
 };
 
 /// Subtools, accessible via "-t foo".
@@ -207,6 +324,23 @@ void Usage(const BuildConfig& config) {
 "options:\n"
 "  --version      print ninja version (\"%s\")\n"
 "  -v, --verbose  show all command lines while building\n"
+"  --jobserver    share the -j job slots with commands as a make jobserver\n"
+"  --jobserver=FIFO  share one jobserver with every ninja given FIFO\n"
+"  --frontend-fd=N  report progress as events on fd N instead of printing it\n"
+"  --cache-dir=DIR  restore the outputs of rules with 'cache' from DIR\n"
+"  --remote=CMD   run the commands of pools not marked local through CMD\n"
+"  --remote-jobs=N  run N jobs in parallel with --remote [default=-j]\n"
+"  --targets=fair   split the jobs evenly between the targets given\n"
+"  --targets=first  build the targets given one after the other\n"
+"  --prefetch=N   read the inputs of the next N jobs ahead of time\n"
+"  --affinity=cpu   pin each command to a CPU of its own\n"
+"  --affinity=node  pin each command to the CPUs of a NUMA node\n"
+"  --compact-scopes  free the manifest's scopes once it is loaded\n"
+"  --dry-run=FMT  like -n, but only list the commands to run as\n"
+"                 outputs, commands or json\n"
+"  --deps-threads[=N]  read the deps of finished commands on N threads\n"
+"  --io-thread    make output directories and response files on a thread\n"
+"  --start-during-scan  start commands found ready before the scan is done\n"
 "\n"
 "  -C DIR   change to DIR before doing anything else\n"
 "  -f FILE  specify input build file [default=build.ninja]\n"
@@ -214,7 +348,11 @@ void Usage(const BuildConfig& config) {
 "  -j N     run N jobs in parallel (0 means infinity) [default=%d on this system]\n"
 "  -k N     keep going until N jobs fail (0 means infinity) [default=1]\n"
 "  -l N     do not start new jobs if the load average is greater than N\n"
+"  -m MEM   do not start new jobs that would take the estimated memory of\n"
+"           the running ones over MEM (like 64G)\n"
 "  -n       dry run (don't run commands but act like they succeeded)\n"
+"  -p PCT   run fewer jobs while the CPU or memory is contended for more\n"
+"           than PCT%% of the time, and more (up to -j) while it's not\n"
 "\n"
 "  -d MODE  enable debugging (use '-d list' to list modes)\n"
 "  -t TOOL  run a subtool (use '-t list' to list subtools)\n"
@@ -236,6 +374,12 @@ int GuessParallelism() {
   }
 }
 
+/// Choose how many threads read the deps of finished commands for
+/// --deps-threads without a number: one, and a few on big machines.
+int GuessDepsThreads() {
+  return max(1, min(GetProcessorCount() / 8, 4));
+}
+
 /// Rebuild the build manifest, if necessary.
 /// Returns true if the manifest was rebuilt.
 bool NinjaMain::RebuildManifest(const char* input_file, string* err) {
@@ -247,14 +391,31 @@ bool NinjaMain::RebuildManifest(const char* input_file, string* err) {
   if (!node)
     return false;
 
-  Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_);
+  // Nothing the manifest was last found up to date with changed since, so
+  // it still is.
+  string stamp_path = ".ninja_regen";
+  if (!build_dir_.empty())
+    stamp_path = build_dir_ + "/" + stamp_path;
+  RegenStamp stamp(&build_log_, &deps_log_, &disk_interface_);
+  if (stamp.Check(stamp_path, node))
+    return false;
+
+  Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_,
+                  &hash_log_, &dyndep_cache_, &depfile_cache_);
   if (!builder.AddTarget(node, err))
     return false;
 
-  if (builder.AlreadyUpToDate())
+  if (builder.AlreadyUpToDate()) {
+    if (!config_.dry_run && !stamp.Write(stamp_path, node, err)) {
+      Warning("writing %s: %s", stamp_path.c_str(), err->c_str());
+      err->clear();
+    }
     return false;  // Not an error, but we didn't rebuild.
+  }
 
-  if (!builder.Build(err))
+  bool listed = config_.dry_run &&
+      config_.dry_run_format != BuildConfig::DRY_RUN_STATUS;
+  if (listed ? !DryRun(&builder, err) : !builder.Build(err))
     return false;
 
   // The manifest was only rebuilt if it is now dirty (it may have been cleaned
@@ -331,6 +492,41 @@ bool NinjaMain::CollectTargetsFromArgs(int argc, char* argv[],
 }
 
 int NinjaMain::ToolGraph(const Options* options, int argc, char* argv[]) {
+  GraphViz graph(&state_, &disk_interface_);
+
+  // The graph tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "graph".
+  argc++;
+  argv--;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hd:n:j"))) != -1) {
+    switch (opt) {
+      case 'd':
+        graph.max_depth_ = atoi(optarg);
+        break;
+      case 'n':
+        graph.max_nodes_ = (size_t)max(atoi(optarg), 0);
+        break;
+      case 'j':
+        graph.format_ = GraphViz::JSON;
+        break;
+      case 'h':
+      default:
+        printf(
+"usage: ninja -t graph [options] [targets]\n"
+"\n"
+"options:\n"
+"  -d N   follow at most N edges from the targets\n"
+"  -n N   write at most N nodes, those nearest the targets\n"
+"  -j     write a JSON array of the nodes and their inputs instead of dot\n"
+               );
+        return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
   vector<Node*> nodes;
   string err;
   if (!CollectTargetsFromArgs(argc, argv, &nodes, &err)) {
@@ -338,7 +534,6 @@ int NinjaMain::ToolGraph(const Options* options, int argc, char* argv[]) {
     return 1;
   }
 
-  GraphViz graph(&state_, &disk_interface_);
   graph.Start();
   for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n)
     graph.AddTarget(*n);
@@ -347,11 +542,155 @@ int NinjaMain::ToolGraph(const Options* options, int argc, char* argv[]) {
   return 0;
 }
 
+/// Append |str| to |out|, escaped for a JSON string.
+void EncodeJSONString(StringPiece str, string* out) {
+  const char* run = str.str_;
+  const char* end = str.str_ + str.len_;
+  for (const char* p = run; p != end; ++p) {
+    if (*p == '"' || *p == '\\') {
+      out->append(run, p - run);
+      out->push_back('\\');
+      run = p;
+    }
+  }
+  out->append(run, end - run);
+}
+
+/// Append the paths of the nodes in [|begin|, |end|) to |out| as a JSON
+/// array.
+template <typename Iterator>
+void EncodeJSONPaths(Iterator begin, Iterator end, string* out) {
+  out->push_back('[');
+  for (Iterator n = begin; n != end; ++n) {
+    if (n != begin)
+      out->push_back(',');
+    out->push_back('"');
+    EncodeJSONString((*n)->path(), out);
+    out->push_back('"');
+  }
+  out->push_back(']');
+}
+
+/// Append the line listing the command of |edge| in |format| to |out|.
+void AppendCommandLine(const Edge* edge, BuildConfig::DryRunFormat format,
+                       string* out) {
+  switch (format) {
+  case BuildConfig::DRY_RUN_OUTPUTS:
+    for (Node* const* o = edge->outputs_.begin(); o != edge->outputs_.end();
+         ++o) {
+      out->append((*o)->path());
+      out->push_back('\n');
+    }
+    return;
+  case BuildConfig::DRY_RUN_JSON:
+    out->append("{\"rule\":\"");
+    EncodeJSONString(edge->rule_->name(), out);
+    out->append("\",\"outputs\":");
+    EncodeJSONPaths(edge->outputs_.begin(), edge->outputs_.end(), out);
+    out->append(",\"command\":\"");
+    EncodeJSONString(edge->EvaluateCommand(), out);
+    out->append("\"}\n");
+    return;
+  default:
+    out->append(edge->EvaluateCommand());
+    out->push_back('\n');
+    return;
+  }
+}
+
+/// Print the lines listing the commands of |edges| in |format|, a block
+/// at a time.
+void PrintCommandLines(const vector<Edge*>& edges,
+                       BuildConfig::DryRunFormat format) {
+  string out;
+  for (vector<Edge*>::const_iterator e = edges.begin(); e != edges.end();
+       ++e) {
+    AppendCommandLine(*e, format, &out);
+    if (out.size() >= (64 << 10)) {
+      fwrite(out.data(), 1, out.size(), stdout);
+      out.clear();
+    }
+  }
+  fwrite(out.data(), 1, out.size(), stdout);
+}
+
+int NinjaMain::RunBatchTool(BatchFunc func) {
+  string target;
+  string json;
+  char buf[1024];
+  while (fgets(buf, sizeof(buf), stdin)) {
+    target += buf;
+    if (target[target.size() - 1] != '\n' && !feof(stdin))
+      continue;
+    while (!target.empty() && (target[target.size() - 1] == '\n' ||
+                               target[target.size() - 1] == '\r')) {
+      target.resize(target.size() - 1);
+    }
+    if (!target.empty()) {
+      json.clear();
+      (this->*func)(target, &json);
+      json.push_back('\n');
+      fwrite(json.data(), 1, json.size(), stdout);
+      fflush(stdout);
+    }
+    target.clear();
+  }
+  return 0;
+}
+
+void NinjaMain::QueryJSON(const string& target, string* json) {
+  json->append("{\"target\":\"");
+  string err;
+  Node* node = CollectTarget(target.c_str(), &err);
+  if (!node) {
+    EncodeJSONString(target, json);
+    json->append("\",\"error\":\"");
+    EncodeJSONString(err, json);
+    json->append("\"}");
+    return;
+  }
+  EncodeJSONString(node->path(), json);
+  json->push_back('"');
+
+  if (Edge* edge = node->in_edge()) {
+    if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
+      DyndepLoader dyndep_loader(&state_, &disk_interface_);
+      if (!dyndep_loader.LoadDyndeps(edge->dyndep_, &err))
+        Warning("%s\n", err.c_str());
+    }
+    Node* const* explicit_end = edge->inputs_.end() -
+        edge->implicit_deps_ - edge->order_only_deps_;
+    Node* const* implicit_end = edge->inputs_.end() -
+        edge->order_only_deps_;
+    json->append(",\"input\":{\"rule\":\"");
+    EncodeJSONString(edge->rule_->name(), json);
+    json->append("\",\"explicit\":");
+    EncodeJSONPaths<Node* const*>(edge->inputs_.begin(), explicit_end, json);
+    json->append(",\"implicit\":");
+    EncodeJSONPaths(explicit_end, implicit_end, json);
+    json->append(",\"order_only\":");
+    EncodeJSONPaths<Node* const*>(implicit_end, edge->inputs_.end(), json);
+    json->push_back('}');
+  }
+
+  vector<Node*> outputs;
+  for (Edge* const* edge = node->out_edges().begin();
+       edge != node->out_edges().end(); ++edge) {
+    outputs.insert(outputs.end(), (*edge)->outputs_.begin(),
+                   (*edge)->outputs_.end());
+  }
+  json->append(",\"outputs\":");
+  EncodeJSONPaths(outputs.begin(), outputs.end(), json);
+  json->push_back('}');
+}
+
 int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
   if (argc == 0) {
     Error("expected a target to query");
     return 1;
   }
+  if (argc == 1 && strcmp(argv[0], "-") == 0)
+    return RunBatchTool(&NinjaMain::QueryJSON);
 
   DyndepLoader dyndep_loader(&state_, &disk_interface_);
 
@@ -381,9 +720,9 @@ int NinjaMain::ToolQuery(const Options* options, int argc, char* argv[]) {
       }
     }
     printf("  outputs:\n");
-    for (vector<Edge*>::const_iterator edge = node->out_edges().begin();
+    for (Edge* const* edge = node->out_edges().begin();
          edge != node->out_edges().end(); ++edge) {
-      for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
+      for (Node** out = (*edge)->outputs_.begin();
            out != (*edge)->outputs_.end(); ++out) {
         printf("    %s\n", (*out)->path().c_str());
       }
@@ -415,31 +754,88 @@ int NinjaMain::ToolMSVC(const Options* options, int argc, char* argv[]) {
 }
 #endif
 
-int ToolTargetsList(const vector<Node*>& nodes, int depth, int indent) {
-  for (vector<Node*>::const_iterator n = nodes.begin();
-       n != nodes.end();
-       ++n) {
-    for (int i = 0; i < indent; ++i)
-      printf("  ");
-    const char* target = (*n)->path().c_str();
-    if ((*n)->in_edge()) {
-      printf("%s: %s\n", target, (*n)->in_edge()->rule_->name().c_str());
-      if (depth > 1 || depth <= 0)
-        ToolTargetsList((*n)->in_edge()->inputs_, depth - 1, indent + 1);
-    } else {
-      printf("%s\n", target);
+/// Collects what a tool prints, to write it to stdout in large chunks
+/// rather than with a call per line.
+struct OutputBuffer {
+  OutputBuffer() { buf_.reserve(kSize); }
+  ~OutputBuffer() { Flush(); }
+
+  void Append(StringPiece str) {
+    buf_.append(str.str_, str.len_);
+    if (buf_.size() >= kSize)
+      Flush();
+  }
+  void Append(char c, size_t count = 1) {
+    buf_.append(count, c);
+  }
+
+  void Flush() {
+    fwrite(buf_.data(), 1, buf_.size(), stdout);
+    buf_.clear();
+  }
+
+ private:
+  static const size_t kSize = 1 << 16;
+  string buf_;
+};
+
+/// Print |nodes| and, down to |depth| levels (all if 0 or less), the
+/// inputs they are built from, indented.  If |unique|, print every node
+/// only the first time it comes up, rather than every subgraph shared by
+/// several nodes once per path to it.
+int ToolTargetsList(const vector<Node*>& nodes, int depth, bool unique) {
+  OutputBuffer out;
+  set<const Node*> seen;
+  // The nodes left to print at each level of indentation.
+  struct Level {
+    Node* const* next;
+    Node* const* end;
+    int depth;
+  };
+  vector<Level> stack;
+  Level roots = { nodes.empty() ? NULL : &nodes[0],
+                  nodes.empty() ? NULL : &nodes[0] + nodes.size(), depth };
+  stack.push_back(roots);
+  while (!stack.empty()) {
+    Level& level = stack.back();
+    if (level.next == level.end) {
+      stack.pop_back();
+      continue;
+    }
+    const Node* node = *level.next++;
+    int node_depth = level.depth;
+    if (unique && !seen.insert(node).second)
+      continue;
+
+    out.Append(' ', 2 * (stack.size() - 1));
+    out.Append(node->path());
+    const Edge* edge = node->in_edge();
+    if (!edge) {
+      out.Append('\n');
+      continue;
+    }
+    out.Append(": ");
+    out.Append(edge->rule_->name());
+    out.Append('\n');
+    if (node_depth > 1 || node_depth <= 0) {
+      Level inputs = { edge->inputs_.begin(), edge->inputs_.end(),
+                       node_depth - 1 };
+      stack.push_back(inputs);
     }
   }
   return 0;
 }
 
 int ToolTargetsSourceList(State* state) {
+  OutputBuffer out;
   for (vector<Edge*>::iterator e = state->edges_.begin();
        e != state->edges_.end(); ++e) {
-    for (vector<Node*>::iterator inps = (*e)->inputs_.begin();
+    for (Node** inps = (*e)->inputs_.begin();
          inps != (*e)->inputs_.end(); ++inps) {
-      if (!(*inps)->in_edge())
-        printf("%s\n", (*inps)->path().c_str());
+      if (!(*inps)->in_edge()) {
+        out.Append((*inps)->path());
+        out.Append('\n');
+      }
     }
   }
   return 0;
@@ -452,7 +848,7 @@ int ToolTargetsList(State* state, const string& rule_name) {
   for (vector<Edge*>::iterator e = state->edges_.begin();
        e != state->edges_.end(); ++e) {
     if ((*e)->rule_->name() == rule_name) {
-      for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
+      for (Node** out_node = (*e)->outputs_.begin();
            out_node != (*e)->outputs_.end(); ++out_node) {
         rules.insert((*out_node)->path());
       }
@@ -460,28 +856,64 @@ int ToolTargetsList(State* state, const string& rule_name) {
   }
 
   // Print them.
+  OutputBuffer out;
   for (set<string>::const_iterator i = rules.begin();
        i != rules.end(); ++i) {
-    printf("%s\n", (*i).c_str());
+    out.Append(*i);
+    out.Append('\n');
   }
 
   return 0;
 }
 
 int ToolTargetsList(State* state) {
+  OutputBuffer out;
   for (vector<Edge*>::iterator e = state->edges_.begin();
        e != state->edges_.end(); ++e) {
-    for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
+    for (Node** out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
-      printf("%s: %s\n",
-             (*out_node)->path().c_str(),
-             (*e)->rule_->name().c_str());
+      out.Append((*out_node)->path());
+      out.Append(": ");
+      out.Append((*e)->rule_->name());
+      out.Append('\n');
     }
   }
   return 0;
 }
 
+void NinjaMain::DepsJSON(const string& target, string* json) {
+  json->append("{\"target\":\"");
+  string err;
+  Node* node = CollectTarget(target.c_str(), &err);
+  DepsLog::Deps* deps = node ? deps_log_.GetDeps(node) : NULL;
+  if (!deps) {
+    EncodeJSONString(node ? node->path() : target, json);
+    json->append("\",\"error\":\"");
+    EncodeJSONString(node ? "deps not found" : err, json);
+    json->append("\"}");
+    return;
+  }
+  EncodeJSONString(node->path(), json);
+
+  TimeStamp mtime = disk_interface_.Stat(node->path(), &err);
+  if (mtime == -1)
+    Error("%s", err.c_str());  // Log and ignore Stat() errors;
+  char buf[64];
+  snprintf(buf, sizeof(buf), "\",\"deps_mtime\":%" PRId64 ",\"valid\":%s",
+           deps->mtime, !mtime || mtime > deps->mtime ? "false" : "true");
+  json->append(buf);
+  json->append(",\"deps\":");
+  vector<Node*> nodes(deps->node_count);
+  for (int i = 0; i < deps->node_count; ++i)
+    nodes[i] = deps->nodes[i];
+  EncodeJSONPaths(nodes.begin(), nodes.end(), json);
+  json->push_back('}');
+}
+
 int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
+  if (argc == 1 && strcmp(argv[0], "-") == 0)
+    return RunBatchTool(&NinjaMain::DepsJSON);
+
   vector<Node*> nodes;
   if (argc == 0) {
     for (vector<Node*>::const_iterator ni = deps_log_.nodes().begin();
@@ -523,6 +955,7 @@ int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
 
 int NinjaMain::ToolTargets(const Options* options, int argc, char* argv[]) {
   int depth = 1;
+  bool unique = false;
   if (argc >= 1) {
     string mode = argv[0];
     if (mode == "rule") {
@@ -534,8 +967,12 @@ int NinjaMain::ToolTargets(const Options* options, int argc, char* argv[]) {
       else
         return ToolTargetsList(&state_, rule);
     } else if (mode == "depth") {
-      if (argc > 1)
-        depth = atoi(argv[1]);
+      for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--unique") == 0)
+          unique = true;
+        else
+          depth = atoi(argv[i]);
+      }
     } else if (mode == "all") {
       return ToolTargetsList(&state_);
     } else {
@@ -554,7 +991,7 @@ int NinjaMain::ToolTargets(const Options* options, int argc, char* argv[]) {
   string err;
   vector<Node*> root_nodes = state_.RootNodes(&err);
   if (err.empty()) {
-    return ToolTargetsList(root_nodes, depth, 0);
+    return ToolTargetsList(root_nodes, depth, unique);
   } else {
     Error("%s", err.c_str());
     return 1;
@@ -600,7 +1037,7 @@ int NinjaMain::ToolRules(const Options* options, int argc, char* argv[]) {
     printf("%s", i->first.c_str());
     if (print_description) {
       const Rule* rule = i->second;
-      const EvalString* description = rule->GetBinding("description");
+      const EvalString* description = rule->GetBinding(kVarDescription);
       if (description != NULL) {
         printf(": %s", description->Unparse().c_str());
       }
@@ -611,20 +1048,34 @@ int NinjaMain::ToolRules(const Options* options, int argc, char* argv[]) {
 }
 
 enum PrintCommandMode { PCM_Single, PCM_All };
-void PrintCommands(Edge* edge, set<Edge*>* seen, PrintCommandMode mode) {
-  if (!edge)
-    return;
-  if (!seen->insert(edge).second)
-    return;
 
-  if (mode == PCM_All) {
-    for (vector<Node*>::iterator in = edge->inputs_.begin();
-         in != edge->inputs_.end(); ++in)
-      PrintCommands((*in)->in_edge(), seen, mode);
+/// Append |edge| to |edges|, after the edges building its inputs with
+/// PCM_All, each edge once.  Goes without recursing, as chains of edges can
+/// be deeper than the stack.
+void CollectCommands(Edge* edge, vector<bool>* seen, PrintCommandMode mode,
+                     vector<Edge*>* edges) {
+  if (!edge || (*seen)[edge->id()])
+    return;
+  (*seen)[edge->id()] = true;
+
+  // Each edge with the next of its inputs to visit.
+  vector<pair<Edge*, Node**> > stack(1, make_pair(edge, edge->inputs_.begin()));
+  while (!stack.empty()) {
+    Edge* top = stack.back().first;
+    Node** in = stack.back().second;
+    if (mode == PCM_All && in != top->inputs_.end()) {
+      ++stack.back().second;
+      Edge* in_edge = (*in)->in_edge();
+      if (in_edge && !(*seen)[in_edge->id()]) {
+        (*seen)[in_edge->id()] = true;
+        stack.push_back(make_pair(in_edge, in_edge->inputs_.begin()));
+      }
+      continue;
+    }
+    stack.pop_back();
+    if (!top->is_phony())
+      edges->push_back(top);
   }
-
-  if (!edge->is_phony())
-    puts(edge->EvaluateCommand().c_str());
 }
 
 int NinjaMain::ToolCommands(const Options* options, int argc, char* argv[]) {
@@ -634,11 +1085,15 @@ int NinjaMain::ToolCommands(const Options* options, int argc, char* argv[]) {
   --argv;
 
   PrintCommandMode mode = PCM_All;
+  BuildConfig::DryRunFormat format = BuildConfig::DRY_RUN_COMMANDS;
 
   optind = 1;
   int opt;
-  while ((opt = getopt(argc, argv, const_cast<char*>("hs"))) != -1) {
+  while ((opt = getopt(argc, argv, const_cast<char*>("hjs"))) != -1) {
     switch (opt) {
+    case 'j':
+      format = BuildConfig::DRY_RUN_JSON;
+      break;
     case 's':
       mode = PCM_Single;
       break;
@@ -648,6 +1103,7 @@ int NinjaMain::ToolCommands(const Options* options, int argc, char* argv[]) {
 "\n"
 "options:\n"
 "  -s     only print the final command to build [target], not the whole chain\n"
+"  -j     print each as a line of JSON with its rule and outputs\n"
              );
     return 1;
     }
@@ -662,10 +1118,138 @@ int NinjaMain::ToolCommands(const Options* options, int argc, char* argv[]) {
     return 1;
   }
 
-  set<Edge*> seen;
+  vector<bool> seen(state_.edges_.size(), false);
+  vector<Edge*> edges;
   for (vector<Node*>::iterator in = nodes.begin(); in != nodes.end(); ++in)
-    PrintCommands((*in)->in_edge(), &seen, mode);
+    CollectCommands((*in)->in_edge(), &seen, mode, &edges);
+  PrintCommandLines(edges, format);
+
+  return 0;
+}
+
+/// Orders nodes by path.
+struct PathLess {
+  bool operator()(const Node* a, const Node* b) const {
+    return a->path() < b->path();
+  }
+};
 
+/// Collects the inputs of edges, and of the edges building those, each
+/// once, for any number of targets.
+struct InputCollector {
+  InputCollector(State* state, DepsLog* deps_log)
+      : deps_log_(deps_log), node_numbers_(state->node_arena_),
+        seen_edges_(state->edges_.size(), false) {}
+
+  /// Add the inputs |node| is built from that no target added before was.
+  void AddTarget(Node* node) {
+    stack_.push_back(node);
+    while (!stack_.empty()) {
+      Edge* edge = stack_.back()->in_edge();
+      stack_.pop_back();
+      if (!edge || seen_edges_[edge->id()])
+        continue;
+      seen_edges_[edge->id()] = true;
+      for (Node** in = edge->inputs_.begin(); in != edge->inputs_.end(); ++in)
+        Add(*in);
+      // The outputs of an edge share the record of their deps.
+      if (DepsLog::Deps* deps = deps_log_->GetDeps(edge->outputs_[0])) {
+        for (int i = 0; i < deps->node_count; ++i)
+          Add(deps->nodes[i]);
+      }
+    }
+  }
+
+  /// The inputs, in the order they were found.
+  vector<Node*> inputs_;
+
+ private:
+  void Add(Node* node) {
+    size_t number = node_numbers_.Number(node);
+    if (number >= seen_nodes_.size())
+      seen_nodes_.resize(max(number + 1, 2 * seen_nodes_.size()), false);
+    if (seen_nodes_[number])
+      return;
+    seen_nodes_[number] = true;
+    inputs_.push_back(node);
+    stack_.push_back(node);
+  }
+
+  DepsLog* deps_log_;
+  ObjectNumbering<Node> node_numbers_;
+  vector<bool> seen_nodes_;
+  vector<bool> seen_edges_;
+  vector<Node*> stack_;
+};
+
+int NinjaMain::ToolInputs(const Options* options, int argc, char* argv[]) {
+  // The inputs tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "inputs".
+  ++argc;
+  --argv;
+
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("h"))) != -1) {
+    switch (opt) {
+    case 'h':
+    default:
+      printf("usage: ninja -t inputs [options] [targets | -]\n"
+"\n"
+"list the files the targets are built from, and the files those are, with\n"
+"the dependencies in the deps log, each once and sorted.  Given -, reads\n"
+"the targets from standard input, one per line.\n"
+             );
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  vector<Node*> nodes;
+  string err;
+  if (argc == 1 && strcmp(argv[0], "-") == 0) {
+    string target;
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), stdin)) {
+      target += buf;
+      if (target[target.size() - 1] != '\n' && !feof(stdin))
+        continue;
+      while (!target.empty() && (target[target.size() - 1] == '\n' ||
+                                 target[target.size() - 1] == '\r')) {
+        target.resize(target.size() - 1);
+      }
+      if (!target.empty()) {
+        Node* node = CollectTarget(target.c_str(), &err);
+        if (!node) {
+          Error("%s", err.c_str());
+          return 1;
+        }
+        nodes.push_back(node);
+      }
+      target.clear();
+    }
+  } else if (!CollectTargetsFromArgs(argc, argv, &nodes, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  InputCollector collector(&state_, &deps_log_);
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+    collector.AddTarget(*n);
+  vector<Node*>& inputs = collector.inputs_;
+  sort(inputs.begin(), inputs.end(), PathLess());
+
+  string out;
+  for (vector<Node*>::iterator i = inputs.begin(); i != inputs.end(); ++i) {
+    out.append((*i)->path());
+    out.push_back('\n');
+    if (out.size() >= (64 << 10)) {
+      fwrite(out.data(), 1, out.size(), stdout);
+      out.clear();
+    }
+  }
+  fwrite(out.data(), 1, out.size(), stdout);
   return 0;
 }
 
@@ -723,13 +1307,160 @@ int NinjaMain::ToolCleanDead(const Options* options, int argc, char* argv[]) {
   return cleaner.CleanDead(build_log_.entries());
 }
 
-void EncodeJSONString(const char *str) {
-  while (*str) {
-    if (*str == '"' || *str == '\\')
-      putchar('\\');
-    putchar(*str);
-    str++;
+namespace {
+
+/// Orders build log entries by their peak memory, largest first.
+struct CompareByMaxRss {
+  bool operator()(const BuildLog::LogEntry* a,
+                  const BuildLog::LogEntry* b) const {
+    if (a->usage.max_rss != b->usage.max_rss)
+      return a->usage.max_rss > b->usage.max_rss;
+    return a->output < b->output;
+  }
+};
+
+}  // anonymous namespace
+
+int NinjaMain::ToolUsage(const Options* options, int argc, char* argv[]) {
+  vector<BuildLog::LogEntry*> entries;
+  const BuildLog::Entries& all_entries = build_log_.entries();
+  for (BuildLog::Entries::const_iterator i = all_entries.begin();
+       i != all_entries.end(); ++i) {
+    if (!IsPathDead(i->first))
+      entries.push_back(i->second);
+  }
+  sort(entries.begin(), entries.end(), CompareByMaxRss());
+
+  printf("# max_rss(KB)\tuser(ms)\tsystem(ms)\tread\twritten\toutput\n");
+  for (vector<BuildLog::LogEntry*>::iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    const ResourceUsage& usage = (*i)->usage;
+    printf("%u\t%u\t%u\t%u\t%u\t%s\n", usage.max_rss, usage.user_time,
+           usage.system_time, usage.read_blocks, usage.write_blocks,
+           (*i)->output.AsString().c_str());
+  }
+  return 0;
+}
+
+int NinjaMain::ToolCriticalPath(const Options* options, int argc,
+                                char* argv[]) {
+  // The critpath tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "critpath".
+  argc++;
+  argv--;
+  optind = 1;
+  int top = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hn:"))) != -1) {
+    switch (opt) {
+      case 'n':
+        top = max(atoi(optarg), 0);
+        break;
+      case 'h':
+      default:
+        printf(
+"usage: ninja -t critpath [options] [targets]\n"
+"\n"
+"Time the graph behind the targets with the durations in the build log.\n"
+"\n"
+"options:\n"
+"  -n N   list the N commands blocking the build most [default=10]\n"
+               );
+        return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  vector<Node*> targets;
+  string err;
+  if (!CollectTargetsFromArgs(argc, argv, &targets, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  CriticalPath critical;
+  critical.Analyze(targets, &build_log_);
+  if (critical.missing_)
+    Warning("%d of %d commands have no build log entry and count as taking "
+            "no time", critical.missing_, critical.commands_);
+
+  printf("critical path: %.3fs\n", critical.length_ / 1e3);
+  for (vector<size_t>::const_iterator i = critical.path_.begin();
+       i != critical.path_.end(); ++i) {
+    const CriticalPath::Timing& t = critical.timings_[*i];
+    printf("  %9.3fs %-12s %s\n", t.duration / 1e3,
+           t.edge->rule().name().c_str(), t.edge->outputs_[0]->path().c_str());
+  }
+
+  // With |jobs| jobs the build takes at least as long as the critical path,
+  // and at least as long as the work spread evenly over the jobs.
+  int jobs = config_.parallelism;
+  int64_t bound = max(critical.length_, critical.work_ / jobs);
+  printf("\n%d commands, %.3fs of work\n", critical.commands_,
+         critical.work_ / 1e3);
+  if (critical.length_ > 0) {
+    printf("parallelism: %.1f\n", (double)critical.work_ / critical.length_);
+    printf("best time at -j%d: %.3fs, %.0f%% of the jobs busy\n", jobs,
+           bound / 1e3, 100.0 * critical.work_ / ((double)jobs * bound));
+  }
+
+  printf("\n%-20s %9s %11s %11s %6s\n", "rule", "commands", "total", "max",
+         "work");
+  for (map<string, CriticalPath::RuleTotal>::const_iterator r =
+           critical.rules_.begin(); r != critical.rules_.end(); ++r) {
+    printf("%-20s %9d %10.3fs %10.3fs %5.1f%%\n", r->first.c_str(),
+           r->second.commands, r->second.total / 1e3, r->second.max / 1e3,
+           critical.work_ ? 100.0 * r->second.total / critical.work_ : 0.0);
+  }
+
+  vector<size_t> blocking = critical.MostBlocking(top);
+  if (!blocking.empty()) {
+    printf("\n%10s %10s %s\n", "blocking", "duration", "output");
+    for (vector<size_t>::const_iterator i = blocking.begin();
+         i != blocking.end(); ++i) {
+      const CriticalPath::Timing& t = critical.timings_[*i];
+      printf("%9.3fs %9.3fs %s\n", t.blocking(critical.length_) / 1e3,
+             t.duration / 1e3, t.edge->outputs_[0]->path().c_str());
+    }
+  }
+  return 0;
+}
+
+int NinjaMain::ToolMemStats(const Options* options, int argc,
+                            char* argv[]) {
+  // The memstats tool uses getopt, and expects argv[0] to contain the name
+  // of the tool, i.e. "memstats".
+  argc++;
+  argv--;
+  optind = 1;
+  int top = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hn:"))) != -1) {
+    switch (opt) {
+      case 'n':
+        top = max(atoi(optarg), 0);
+        break;
+      case 'h':
+      default:
+        printf(
+"usage: ninja -t memstats [options]\n"
+"\n"
+"Show where the memory of the loaded manifest and logs goes.\n"
+"\n"
+"options:\n"
+"  -n N   list the N file scopes holding the most [default=10]\n"
+               );
+        return 1;
+    }
   }
+
+  MemoryStats stats;
+  stats.AddState(state_);
+  stats.AddBuildLog(build_log_);
+  stats.AddDepsLog(deps_log_);
+  stats.Report(stdout, top);
+  return 0;
 }
 
 enum EvaluateCommandMode {
@@ -750,7 +1481,7 @@ std::string EvaluateCommandWithRspfile(const Edge* edge,
   if (index == 0 || index == string::npos || command[index - 1] != '@')
     return command;
 
-  string rspfile_content = edge->GetBinding("rspfile_content");
+  string rspfile_content = edge->GetBinding(kVarRspfileContent);
   size_t newline_index = 0;
   while ((newline_index = rspfile_content.find('\n', newline_index)) !=
          string::npos) {
@@ -761,18 +1492,34 @@ std::string EvaluateCommandWithRspfile(const Edge* edge,
   return command;
 }
 
-void printCompdb(const char* const directory, const Edge* const edge,
-                 const EvaluateCommandMode eval_mode) {
-  printf("\n  {\n    \"directory\": \"");
-  EncodeJSONString(directory);
-  printf("\",\n    \"command\": \"");
-  EncodeJSONString(EvaluateCommandWithRspfile(edge, eval_mode).c_str());
-  printf("\",\n    \"file\": \"");
-  EncodeJSONString(edge->inputs_[0]->path().c_str());
-  printf("\",\n    \"output\": \"");
-  EncodeJSONString(edge->outputs_[0]->path().c_str());
-  printf("\"\n  }");
-}
+/// Formats the compilation database entries of a run of edges, one per
+/// call, so that their commands can be evaluated on several threads.
+struct CompdbEntries {
+  CompdbEntries(const string& directory, Edge* const* edges,
+                EvaluateCommandMode eval_mode, vector<string>* entries)
+      : directory_(directory), edges_(edges), eval_mode_(eval_mode),
+        entries_(entries) {}
+
+  void operator()(size_t i) {
+    const Edge* edge = edges_[i];
+    string* out = &(*entries_)[i];
+    out->clear();
+    out->append("\n  {\n    \"directory\": \"");
+    EncodeJSONString(directory_, out);
+    out->append("\",\n    \"command\": \"");
+    EncodeJSONString(EvaluateCommandWithRspfile(edge, eval_mode_), out);
+    out->append("\",\n    \"file\": \"");
+    EncodeJSONString(edge->inputs_[0]->path(), out);
+    out->append("\",\n    \"output\": \"");
+    EncodeJSONString(edge->outputs_[0]->path(), out);
+    out->append("\"\n  }");
+  }
+
+  const string& directory_;
+  Edge* const* edges_;
+  EvaluateCommandMode eval_mode_;
+  vector<string>* entries_;
+};
 
 int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
                                        char* argv[]) {
@@ -805,7 +1552,6 @@ int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
   argv += optind;
   argc -= optind;
 
-  bool first = true;
   vector<char> cwd;
   char* success = NULL;
 
@@ -818,31 +1564,42 @@ int NinjaMain::ToolCompilationDatabase(const Options* options, int argc,
     Error("cannot determine working directory: %s", strerror(errno));
     return 1;
   }
+  string directory = &cwd[0];
 
-  putchar('[');
+  vector<Edge*> edges;
   for (vector<Edge*>::iterator e = state_.edges_.begin();
        e != state_.edges_.end(); ++e) {
     if ((*e)->inputs_.empty())
       continue;
     if (argc == 0) {
-      if (!first) {
-        putchar(',');
-      }
-      printCompdb(&cwd[0], *e, eval_mode);
-      first = false;
+      edges.push_back(*e);
     } else {
       for (int i = 0; i != argc; ++i) {
         if ((*e)->rule_->name() == argv[i]) {
-          if (!first) {
-            putchar(',');
-          }
-          printCompdb(&cwd[0], *e, eval_mode);
-          first = false;
+          edges.push_back(*e);
+          break;
         }
       }
     }
   }
 
+  // Evaluating the commands is most of the work, so it is spread over
+  // threads, a chunk of edges at a time to bound the memory the entries
+  // take; each chunk is written out in order before the next one starts.
+  const size_t kChunkSize = 4096;
+  vector<string> entries(min(kChunkSize, edges.size()));
+  putchar('[');
+  for (size_t start = 0; start < edges.size(); start += kChunkSize) {
+    size_t count = min(kChunkSize, edges.size() - start);
+    CompdbEntries format(directory, &edges[start], eval_mode, &entries);
+    ParallelFor(count, GetProcessorCount(), format);
+    for (size_t i = 0; i < count; ++i) {
+      if (start + i > 0)
+        putchar(',');
+      fwrite(entries[i].data(), 1, entries[i].size(), stdout);
+    }
+  }
+
   puts("\n]");
   return 0;
 }
@@ -858,23 +1615,109 @@ int NinjaMain::ToolRecompact(const Options* options, int argc, char* argv[]) {
   return 0;
 }
 
-int NinjaMain::ToolRestat(const Options* options, int argc, char* argv[]) {
-  // The restat tool uses getopt, and expects argv[0] to contain the name of the
-  // tool, i.e. "restat"
+int NinjaMain::ToolMergeLogs(const Options* options, int argc,
+                             char* argv[]) {
+  // The mergelogs tool uses getopt, and expects argv[0] to contain the name
+  // of the tool, i.e. "mergelogs".
   argc++;
   argv--;
-
   optind = 1;
+  PathRemaps remaps;
   int opt;
-  while ((opt = getopt(argc, argv, const_cast<char*>("h"))) != -1) {
+  while ((opt = getopt(argc, argv, const_cast<char*>("hr:"))) != -1) {
+    const char* equals;
     switch (opt) {
-    case 'h':
-    default:
-      printf("usage: ninja -t restat [outputs]\n");
-      return 1;
-    }
-  }
-  argv += optind;
+      case 'r':
+        equals = strchr(optarg, '=');
+        if (!equals || equals == optarg) {
+          Error("-r takes FROM=TO, not '%s'", optarg);
+          return 1;
+        }
+        remaps.push_back(make_pair(string(optarg, equals - optarg),
+                                   string(equals + 1)));
+        break;
+      case 'h':
+      default:
+        printf(
+"usage: ninja -t mergelogs [options] DIR...\n"
+"\n"
+"Merge the build and deps logs in each DIR, the build directory of another\n"
+"build, into those of this one, taking the newer entry for each output.\n"
+"\n"
+"options:\n"
+"  -r FROM=TO  replace the path prefix FROM with TO in the merged logs\n"
+               );
+        return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+  if (argc == 0) {
+    Error("expected the directories of the logs to merge");
+    return 1;
+  }
+  if (config_.dry_run) {
+    Error("can't merge logs in a dry run");
+    return 1;
+  }
+
+  for (int i = 0; i < argc; ++i) {
+    string dir = argv[i];
+    string err;
+    BuildLog build_log;
+    string path = dir + "/.ninja_log";
+    LoadStatus status = build_log.Load(path, &err);
+    if (status == LOAD_ERROR) {
+      Error("loading %s: %s", path.c_str(), err.c_str());
+      return 1;
+    }
+    int build_merged = 0;
+    if (status == LOAD_SUCCESS &&
+        (build_merged = build_log_.Merge(&build_log, remaps)) < 0) {
+      Error("writing build log: %s", strerror(errno));
+      return 1;
+    }
+
+    // The other log's nodes go to a State of their own, so that its paths
+    // only show up here once they are remapped.
+    State state;
+    DepsLog deps_log;
+    path = dir + "/.ninja_deps";
+    err.clear();
+    status = deps_log.Load(path, &state, &err);
+    if (status == LOAD_ERROR) {
+      Error("loading %s: %s", path.c_str(), err.c_str());
+      return 1;
+    }
+    int deps_merged = 0;
+    if (status == LOAD_SUCCESS &&
+        (deps_merged = deps_log_.Merge(&deps_log, &state_, remaps)) < 0) {
+      Error("writing deps log: %s", strerror(errno));
+      return 1;
+    }
+    printf("%s: merged %d build log and %d deps log entries\n", dir.c_str(),
+           build_merged, deps_merged);
+  }
+  return 0;
+}
+
+int NinjaMain::ToolRestat(const Options* options, int argc, char* argv[]) {
+  // The restat tool uses getopt, and expects argv[0] to contain the name of the
+  // tool, i.e. "restat"
+  argc++;
+  argv--;
+
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("h"))) != -1) {
+    switch (opt) {
+    case 'h':
+    default:
+      printf("usage: ninja -t restat [outputs]\n");
+      return 1;
+    }
+  }
+  argv += optind;
   argc -= optind;
 
   if (!EnsureBuildDirExists())
@@ -956,16 +1799,24 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolClean },
     { "commands", "list all commands required to rebuild given targets",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCommands },
+    { "critpath", "time the critical path with the durations in the build log",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolCriticalPath },
     { "deps", "show dependencies stored in the deps log",
       Tool::RUN_AFTER_LOGS, &NinjaMain::ToolDeps },
     { "graph", "output graphviz dot file for targets",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolGraph },
+    { "inputs", "list all the files given targets are built from",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolInputs },
     { "query", "show inputs/outputs for a path",
       Tool::RUN_AFTER_LOGS, &NinjaMain::ToolQuery },
     { "targets",  "list targets by their rule or depth in the DAG",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolTargets },
     { "compdb",  "dump JSON compilation database to stdout",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCompilationDatabase },
+    { "memstats",  "show where the memory of the loaded build goes",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolMemStats },
+    { "mergelogs",  "merge the build and deps logs of other builds into ours",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolMergeLogs },
     { "recompact",  "recompacts ninja-internal data structures",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRecompact },
     { "restat",  "restats all outputs in the build log",
@@ -974,6 +1825,12 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRules },
     { "cleandead",  "clean built files that are no longer produced by the manifest",
       Tool::RUN_AFTER_LOGS, &NinjaMain::ToolCleanDead },
+    { "usage",  "show what the commands used the last time they ran",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolUsage },
+#ifndef _WIN32
+    { "serve",  "keep the build loaded and run builds for ninja in this directory",
+      Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolServe },
+#endif
     { "urtle", NULL,
       Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolUrtle },
     { NULL, NULL, Tool::RUN_AFTER_FLAGS, NULL }
@@ -1012,17 +1869,23 @@ bool DebugEnable(const string& name) {
   if (name == "list") {
     printf("debugging modes:\n"
 "  stats        print operation counts/timing info\n"
+"  stats=FILE   write them to FILE as JSON instead\n"
 "  explain      explain what caused a command to execute\n"
 "  keepdepfile  don't delete depfiles after they're read by ninja\n"
 "  keeprsp      don't delete @response files on success\n"
-#ifdef _WIN32
 "  nostatcache  don't batch stat() calls per directory and cache them\n"
-#endif
+"  nomanifestcache  always parse the manifest instead of using .ninja_manifest\n"
+"  trace=FILE   write a timeline of the build to FILE, for chrome://tracing\n"
+"               or ui.perfetto.dev\n"
 "multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
   } else if (name == "stats") {
     g_metrics = new Metrics;
     return true;
+  } else if (name.compare(0, 6, "stats=") == 0) {
+    g_metrics = new Metrics;
+    g_metrics_file = name.substr(6);
+    return true;
   } else if (name == "explain") {
     g_explaining = true;
     return true;
@@ -1035,11 +1898,22 @@ bool DebugEnable(const string& name) {
   } else if (name == "nostatcache") {
     g_experimental_statcache = false;
     return true;
+  } else if (name == "nomanifestcache") {
+    g_manifest_cache = false;
+    return true;
+  } else if (name.compare(0, 6, "trace=") == 0) {
+    string err;
+    g_tracer = new Tracer;
+    if (!g_tracer->Open(name.substr(6), &err)) {
+      Error("opening trace: %s", err.c_str());
+      return false;
+    }
+    return true;
   } else {
     const char* suggestion =
         SpellcheckString(name.c_str(),
                          "stats", "explain", "keepdepfile", "keeprsp",
-                         "nostatcache", NULL);
+                         "nostatcache", "nomanifestcache", "trace", NULL);
     if (suggestion) {
       Error("unknown debug setting '%s', did you mean '%s'?",
             name.c_str(), suggestion);
@@ -1089,13 +1963,89 @@ bool WarningEnable(const string& name, Options* options) {
   }
 }
 
+/// Runs NinjaMain::LoadLogs() on its own thread.
+struct LogLoader {
+  explicit LogLoader(NinjaMain* ninja) : ninja_(ninja) {}
+  void operator()() const { ninja_->LoadLogs(); }
+  NinjaMain* ninja_;
+};
+
+/// The path of the log |name| in |build_dir|.
+string LogPath(const string& build_dir, const char* name) {
+  return build_dir.empty() ? name : build_dir + "/" + name;
+}
+
+/// Guess the builddir of |input_file| from a top-level binding near its
+/// start, without parsing it.  Returns "" if there's no plain one there.
+string GuessBuildDir(const char* input_file) {
+  FILE* f = fopen(input_file, "rb");
+  if (!f)
+    return "";
+  string text(64 << 10, '\0');
+  text.resize(fread(&text[0], 1, text.size(), f));
+  fclose(f);
+
+  string build_dir;
+  for (size_t pos = 0; pos < text.size();) {
+    size_t end = text.find('\n', pos);
+    if (end == string::npos)
+      end = text.size();
+    if (text.compare(pos, 8, "builddir") == 0) {
+      size_t i = text.find_first_not_of(' ', pos + 8);
+      if (i < end && text[i] == '=') {
+        i = text.find_first_not_of(' ', i + 1);
+        size_t last = text.find_last_not_of(" \r", end - 1);
+        build_dir = i <= last && last < end ? text.substr(i, last + 1 - i)
+                                            : "";
+        // Anything with variables is left for the parser.
+        if (build_dir.find('$') != string::npos)
+          return "";
+      }
+    }
+    pos = end + 1;
+  }
+  return build_dir;
+}
+
+void NinjaMain::StartLoadingLogs(const string& build_dir) {
+  preloaded_build_log_.path = LogPath(build_dir, ".ninja_log");
+  preloaded_deps_log_.path = LogPath(build_dir, ".ninja_deps");
+  log_loader_ = thread(LogLoader(this));
+}
+
+void NinjaMain::LoadLogs() {
+  preloaded_build_log_.status =
+      build_log_.Load(preloaded_build_log_.path, &preloaded_build_log_.err);
+  preloaded_deps_log_.status =
+      deps_log_.Load(preloaded_deps_log_.path, &state_,
+                     &preloaded_deps_log_.err);
+}
+
+bool NinjaMain::FinishLoadingLogs() {
+  if (!log_loader_.joinable())
+    return true;
+  log_loader_.join();
+  // A log that wasn't found left nothing behind.
+  if (preloaded_build_log_.path != LogPath(build_dir_, ".ninja_log") &&
+      preloaded_build_log_.status != LOAD_NOT_FOUND)
+    return false;
+  if (preloaded_deps_log_.path != LogPath(build_dir_, ".ninja_deps") &&
+      preloaded_deps_log_.status != LOAD_NOT_FOUND)
+    return false;
+  return true;
+}
+
 bool NinjaMain::OpenBuildLog(bool recompact_only) {
-  string log_path = ".ninja_log";
-  if (!build_dir_.empty())
-    log_path = build_dir_ + "/" + log_path;
+  string log_path = LogPath(build_dir_, ".ninja_log");
 
   string err;
-  const LoadStatus status = build_log_.Load(log_path, &err);
+  LoadStatus status;
+  if (preloaded_build_log_.path == log_path) {
+    status = preloaded_build_log_.status;
+    err = preloaded_build_log_.err;
+  } else {
+    status = build_log_.Load(log_path, &err);
+  }
   if (status == LOAD_ERROR) {
     Error("loading build log %s: %s", log_path.c_str(), err.c_str());
     return false;
@@ -1129,12 +2079,16 @@ bool NinjaMain::OpenBuildLog(bool recompact_only) {
 /// Open the deps log: load it, then open for writing.
 /// @return false on error.
 bool NinjaMain::OpenDepsLog(bool recompact_only) {
-  string path = ".ninja_deps";
-  if (!build_dir_.empty())
-    path = build_dir_ + "/" + path;
+  string path = LogPath(build_dir_, ".ninja_deps");
 
   string err;
-  const LoadStatus status = deps_log_.Load(path, &state_, &err);
+  LoadStatus status;
+  if (preloaded_deps_log_.path == path) {
+    status = preloaded_deps_log_.status;
+    err = preloaded_deps_log_.err;
+  } else {
+    status = deps_log_.Load(path, &state_, &err);
+  }
   if (status == LOAD_ERROR) {
     Error("loading deps log %s: %s", path.c_str(), err.c_str());
     return false;
@@ -1162,10 +2116,68 @@ bool NinjaMain::OpenDepsLog(bool recompact_only) {
     }
   }
 
+  return OpenHashLog() && OpenDyndepCache();
+}
+
+bool NinjaMain::OpenHashLog() {
+  string path = ".ninja_hashes";
+  if (!build_dir_.empty())
+    path = build_dir_ + "/" + path;
+
+  string err;
+  if (hash_log_.Load(path, &err) == LOAD_ERROR) {
+    Error("loading hash log %s: %s", path.c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty()) {
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  if (!config_.dry_run) {
+    if (!hash_log_.OpenForWrite(path, &err)) {
+      Error("opening hash log: %s", err.c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool NinjaMain::OpenDyndepCache() {
+  string path = ".ninja_dyndep";
+  if (!build_dir_.empty())
+    path = build_dir_ + "/" + path;
+
+  string err;
+  if (dyndep_cache_.Load(path, &err) == LOAD_ERROR) {
+    Error("loading dyndep cache %s: %s", path.c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty()) {
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  path = ".ninja_depfiles";
+  if (!build_dir_.empty())
+    path = build_dir_ + "/" + path;
+  if (depfile_cache_.Load(path, &err) == LOAD_ERROR) {
+    Error("loading depfile cache %s: %s", path.c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
   return true;
 }
 
 void NinjaMain::DumpMetrics() {
+  if (!g_metrics_file.empty()) {
+    string err;
+    if (!g_metrics->ReportJSON(g_metrics_file, &err))
+      Error("writing %s: %s", g_metrics_file.c_str(), err.c_str());
+    return;
+  }
   g_metrics->Report();
 
   printf("\n");
@@ -1195,9 +2207,26 @@ int NinjaMain::RunBuild(int argc, char** argv) {
     return 1;
   }
 
+  // The cache stays on during the build: the builder invalidates the
+  // directories commands write into, so restat rules do not see stale
+  // timestamps.
   disk_interface_.AllowStatCache(g_experimental_statcache);
 
-  Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_);
+  Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_,
+                  &hash_log_, &dyndep_cache_, &depfile_cache_);
+  builder.SetScanSummary(scan_summary_);
+
+  // Run what failed last time first, so that its output comes soonest.
+  FailureLog failures;
+  string path = ".ninja_failed";
+  if (!build_dir_.empty())
+    path = build_dir_ + "/" + path;
+  if (failures.Load(path, &err) == LOAD_ERROR) {
+    Warning("loading %s: %s", path.c_str(), err.c_str());
+    err.clear();
+  }
+  builder.SetFailureLog(&failures);
+
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder.AddTarget(targets[i], &err)) {
       if (!err.empty()) {
@@ -1210,15 +2239,20 @@ int NinjaMain::RunBuild(int argc, char** argv) {
     }
   }
 
-  // Make sure restat rules do not see stale timestamps.
-  disk_interface_.AllowStatCache(false);
-
+  // A list of the commands to run is empty then.
+  bool listed = config_.dry_run &&
+      config_.dry_run_format != BuildConfig::DRY_RUN_STATUS;
   if (builder.AlreadyUpToDate()) {
-    printf("ninja: no work to do.\n");
+    if (!listed)
+      printf("ninja: no work to do.\n");
     return 0;
   }
 
-  if (!builder.Build(&err)) {
+  bool ok = listed ? DryRun(&builder, &err) : builder.Build(&err);
+  string save_err;
+  if (!config_.dry_run && !failures.Save(&save_err))
+    Warning("writing %s: %s", path.c_str(), save_err.c_str());
+  if (!ok) {
     printf("ninja: build stopped: %s.\n", err.c_str());
     if (err.find("interrupted by user") != string::npos) {
       return 2;
@@ -1229,6 +2263,360 @@ int NinjaMain::RunBuild(int argc, char** argv) {
   return 0;
 }
 
+bool NinjaMain::DryRun(Builder* builder, string* err) {
+  vector<Edge*> edges;
+  if (!builder->DryRun(&edges, err))
+    return false;
+  PrintCommandLines(edges, config_.dry_run_format);
+  return true;
+}
+
+#ifndef _WIN32
+
+volatile sig_atomic_t g_server_interrupted;
+
+void SetServerInterrupted(int) {
+  g_server_interrupted = 1;
+}
+
+/// Implements "-t serve": keeps a loaded NinjaMain around and runs the
+/// builds that "ninja" invocations in the same directory hand to it, so they
+/// skip parsing the manifest and logs and, where the ChangeWatcher can tell
+/// nothing changed, stat()ing files and scanning the parts of the graph
+/// built from them.
+struct BuildServer {
+  BuildServer(const char* ninja_command, const Options* options)
+      : ninja_command_(ninja_command), options_(options) {}
+
+  /// Serve builds until interrupted.  Returns an exit code.
+  int Run();
+
+ private:
+  /// Load the manifest and logs into a new NinjaMain.
+  /// @return false on error.
+  bool Load();
+
+  /// Whether a file Load() read was changed by someone else since.
+  bool Stale();
+
+  /// Remember the mtimes of the logs, which our own builds change.
+  void RecordLogs();
+
+  /// Reset the state left behind by the previous build, forgetting the
+  /// stat() results of the files that may have changed since.
+  void PrepareForBuild();
+
+  /// Run the build asked for by |request|.
+  /// @return an exit code.
+  int Build(const ServerRequest& request);
+
+  /// Run the build asked for on the client connection |fd|, with the
+  /// client's stdio and environment.
+  void HandleClient(int fd);
+
+  const char* ninja_command_;
+  const Options* options_;
+  BuildConfig config_;
+  unique_ptr<NinjaMain> ninja_;
+  vector<pair<string, TimeStamp> > manifest_files_;
+  vector<pair<string, TimeStamp> > log_files_;
+  ChangeWatcher watcher_;
+  /// Outlives |ninja_|, so that a regenerated manifest only has the parts
+  /// of the graph that changed scanned.
+  ScanSummary summary_;
+};
+
+int BuildServer::Run() {
+  ServerSocket socket;
+  string err;
+  if (!socket.Listen(&err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  if (!Load())
+    return 1;
+  printf("ninja: serving builds of '%s'\n", options_->input_file);
+  fflush(stdout);
+
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = SetServerInterrupted;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  sigaction(SIGHUP, &act, NULL);
+
+  for (;;) {
+    // Only a signal while idle stops the server; one that arrives during a
+    // build was forwarded by the client to interrupt that build.
+    g_server_interrupted = 0;
+    int fd = socket.Accept();
+    if (fd < 0) {
+      if (g_server_interrupted)
+        return 0;
+      Error("accepting connection: %s", strerror(errno));
+      return 1;
+    }
+    HandleClient(fd);
+    close(fd);
+  }
+}
+
+bool BuildServer::Load() {
+  ninja_.reset(new NinjaMain(ninja_command_, config_));
+
+  ManifestParserOptions parser_opts;
+  if (options_->dupe_edges_should_err) {
+    parser_opts.dupe_edge_action_ = kDupeEdgeActionError;
+  }
+  if (options_->phony_cycle_should_err) {
+    parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
+  }
+  ManifestCache cache(&ninja_->state_, &ninja_->disk_interface_,
+                      parser_opts);
+  string err;
+  bool loaded = cache.Load(options_->input_file,
+                           g_manifest_cache ? kManifestCachePath : "", true,
+                           &err);
+  manifest_files_ = cache.files();
+  if (!loaded) {
+    Error("%s", err.c_str());
+    ninja_.reset();
+    return false;
+  }
+
+  // Loading a dyndep file changes the graph for good, so a graph that uses
+  // them can't be reused between builds.
+  for (vector<Edge*>::iterator e = ninja_->state_.edges_.begin();
+       e != ninja_->state_.edges_.end(); ++e) {
+    if ((*e)->dyndep_) {
+      Error("'%s' uses dyndep, which isn't supported by -t serve",
+            (*e)->outputs_[0]->path().c_str());
+      ninja_.reset();
+      return false;
+    }
+  }
+  if (options_->compact_scopes)
+    ninja_->state_.CompactScopes();
+
+  if (!ninja_->EnsureBuildDirExists() ||
+      !ninja_->OpenBuildLog() || !ninja_->OpenDepsLog()) {
+    ninja_.reset();
+    return false;
+  }
+  RecordLogs();
+  summary_.Rebind(&ninja_->state_);
+  ninja_->scan_summary_ = &summary_;
+  return true;
+}
+
+bool BuildServer::Stale() {
+  vector<pair<string, TimeStamp> > files = manifest_files_;
+  files.insert(files.end(), log_files_.begin(), log_files_.end());
+  for (vector<pair<string, TimeStamp> >::iterator i = files.begin();
+       i != files.end(); ++i) {
+    string err;
+    if (ninja_->disk_interface_.Stat(i->first, &err) != i->second)
+      return true;
+  }
+  return false;
+}
+
+void BuildServer::RecordLogs() {
+  string prefix = ninja_->build_dir_.empty() ? "" : ninja_->build_dir_ + "/";
+  log_files_.clear();
+  log_files_.push_back(make_pair(prefix + ".ninja_log", 0));
+  log_files_.push_back(make_pair(prefix + ".ninja_deps", 0));
+  log_files_.push_back(make_pair(prefix + ".ninja_hashes", 0));
+  for (vector<pair<string, TimeStamp> >::iterator i = log_files_.begin();
+       i != log_files_.end(); ++i) {
+    string err;
+    i->second = ninja_->disk_interface_.Stat(i->first, &err);
+  }
+}
+
+void BuildServer::PrepareForBuild() {
+  State* state = &ninja_->state_;
+  vector<string> changed;
+  bool complete = watcher_.ReadChanges(&changed);
+
+  // Changes may have been made in what the summary vouches for, and in
+  // directories we couldn't watch anything could have changed.
+  if (complete) {
+    vector<string> dirs;
+    for (vector<string>::iterator i = changed.begin(); i != changed.end();
+         ++i) {
+      dirs.push_back(*i);
+      dirs.push_back(ScanSummary::DirOf(*i));
+    }
+    vector<string> summarized = summary_.Dirs();
+    for (vector<string>::iterator i = summarized.begin();
+         i != summarized.end(); ++i) {
+      if (!watcher_.IsWatching(*i))
+        dirs.push_back(*i);
+    }
+    summary_.Invalidate(dirs);
+  } else {
+    summary_.Clear();
+  }
+
+  // Keep what we know about files the watcher vouches for.  Missing files
+  // aren't worth it: they're cheap to stat, and a watch on their directory
+  // may not have been possible.
+  for (State::Paths::iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i) {
+    Node* node = i->second;
+    string dir = ScanSummary::DirOf(node->path());
+    if (complete && node->exists() && watcher_.IsWatching(dir)) {
+      node->set_dirty(false);
+      continue;
+    }
+    node->ResetState();
+    watcher_.Watch(dir);
+  }
+  for (vector<string>::iterator i = changed.begin(); i != changed.end(); ++i) {
+    if (Node* node = state->LookupNode(*i))
+      node->ResetState();
+  }
+
+  // Deps are only reloaded where the last build may have rewritten them.
+  vector<Edge*> stale_deps;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    edge->set_outputs_ready(false);
+    edge->set_mark(Edge::VisitNone);
+    bool stale = !edge->deps_loaded() || edge->deps_missing_;
+    for (Node** o = edge->outputs_.begin();
+         o != edge->outputs_.end() && !stale; ++o) {
+      stale = !(*o)->status_known();
+    }
+    if (stale || edge->GetBindingBool(kVarRestat))
+      stale_deps.push_back(edge);
+  }
+  state->ClearLoadedDeps(stale_deps);
+
+  for (map<string, Pool*>::iterator i = state->pools_.begin();
+       i != state->pools_.end(); ++i) {
+    i->second->Reset();
+  }
+}
+
+int BuildServer::Build(const ServerRequest& request) {
+  config_.verbosity = (BuildConfig::Verbosity)request.verbosity;
+  config_.parallelism = request.parallelism;
+  config_.deps_threads = request.deps_threads;
+  config_.io_thread = request.io_thread;
+  config_.start_during_scan = request.start_during_scan;
+  config_.failures_allowed = request.failures_allowed;
+  config_.max_load_average = request.max_load_average;
+  config_.max_pressure = request.max_pressure;
+  config_.max_memory = request.max_memory;
+  config_.jobserver = request.jobserver;
+  config_.target_share = (BuildConfig::TargetShare)request.target_share;
+  config_.prefetch_edges = request.prefetch_edges;
+  config_.affinity = (BuildConfig::Affinity)request.affinity;
+  g_explaining = request.explaining;
+  g_keep_depfile = request.keep_depfile;
+  g_keep_rsp = request.keep_rsp;
+  g_experimental_statcache = request.stat_cache;
+
+  if (ninja_ && Stale())
+    ninja_.reset();
+
+  // Limit number of rebuilds, to prevent infinite loops.
+  const int kCycleLimit = 100;
+  for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
+    if (!ninja_ && !Load())
+      return 1;
+    PrepareForBuild();
+
+    string err;
+    if (ninja_->RebuildManifest(options_->input_file, &err)) {
+      // Start the build over with the new manifest.
+      ninja_.reset();
+      continue;
+    } else if (!err.empty()) {
+      Error("rebuilding '%s': %s", options_->input_file, err.c_str());
+      RecordLogs();
+      return 1;
+    }
+
+    vector<char*> targets;
+    for (vector<string>::const_iterator i = request.targets.begin();
+         i != request.targets.end(); ++i) {
+      targets.push_back(const_cast<char*>(i->c_str()));
+    }
+    int result = ninja_->RunBuild(targets.size(),
+                                  targets.empty() ? NULL : &targets[0]);
+    // The stat cache must not outlive the build: we don't watch for
+    // changes while idle, only between builds.
+    ninja_->disk_interface_.AllowStatCache(false);
+    summary_.Record(&ninja_->state_);
+    RecordLogs();
+    return result;
+  }
+
+  Error("manifest '%s' still dirty after %d tries",
+        options_->input_file, kCycleLimit);
+  return 1;
+}
+
+void BuildServer::HandleClient(int fd) {
+  string payload;
+  vector<int> fds;
+  ServerRequest request;
+  string err;
+  if (!ReceiveServerMessage(fd, &payload, &fds) || fds.size() != 3 ||
+      !request.Decode(payload, &err) ||
+      request.input_file != options_->input_file) {
+    // The client builds by itself instead.
+    SendServerMessage(fd, "refused", vector<int>());
+    for (vector<int>::iterator i = fds.begin(); i != fds.end(); ++i)
+      close(*i);
+    return;
+  }
+
+  char reply[32];
+  snprintf(reply, sizeof(reply), "started %d", (int)getpid());
+  if (!SendServerMessage(fd, reply, vector<int>())) {
+    for (vector<int>::iterator i = fds.begin(); i != fds.end(); ++i)
+      close(*i);
+    return;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  int saved_fds[3];
+  for (int i = 0; i < 3; ++i) {
+    saved_fds[i] = dup(i);
+    SetCloseOnExec(saved_fds[i]);
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  vector<string> saved_environment = GetEnvironment();
+  SetEnvironment(request.environment);
+
+  int exit_code = Build(request);
+
+  fflush(stdout);
+  fflush(stderr);
+  SetEnvironment(saved_environment);
+  for (int i = 0; i < 3; ++i) {
+    dup2(saved_fds[i], i);
+    close(saved_fds[i]);
+  }
+
+  snprintf(reply, sizeof(reply), "exit %d", exit_code);
+  SendServerMessage(fd, reply, vector<int>());
+}
+
+int NinjaMain::ToolServe(const Options* options, int argc, char* argv[]) {
+  BuildServer server(ninja_command_, options);
+  return server.Run();
+}
+
+#endif  // !_WIN32
+
 #ifdef _MSC_VER
 
 /// This handler processes fatal crashes that you can't catch
@@ -1258,17 +2646,35 @@ int ReadFlags(int* argc, char*** argv,
               Options* options, BuildConfig* config) {
   config->parallelism = GuessParallelism();
 
-  enum { OPT_VERSION = 1 };
+  enum { OPT_VERSION = 1, OPT_JOBSERVER = 2, OPT_FRONTEND_FD = 3,
+         OPT_CACHE_DIR = 4, OPT_REMOTE = 5, OPT_REMOTE_JOBS = 6,
+         OPT_TARGETS = 7, OPT_PREFETCH = 8, OPT_AFFINITY = 9,
+         OPT_COMPACT_SCOPES = 10, OPT_DRY_RUN = 11,
+         OPT_DEPS_THREADS = 12, OPT_IO_THREAD = 13,
+         OPT_START_DURING_SCAN = 14 };
   const option kLongOptions[] = {
     { "help", no_argument, NULL, 'h' },
     { "version", no_argument, NULL, OPT_VERSION },
     { "verbose", no_argument, NULL, 'v' },
+    { "jobserver", optional_argument, NULL, OPT_JOBSERVER },
+    { "frontend-fd", required_argument, NULL, OPT_FRONTEND_FD },
+    { "cache-dir", required_argument, NULL, OPT_CACHE_DIR },
+    { "remote", required_argument, NULL, OPT_REMOTE },
+    { "remote-jobs", required_argument, NULL, OPT_REMOTE_JOBS },
+    { "targets", required_argument, NULL, OPT_TARGETS },
+    { "prefetch", required_argument, NULL, OPT_PREFETCH },
+    { "affinity", required_argument, NULL, OPT_AFFINITY },
+    { "compact-scopes", no_argument, NULL, OPT_COMPACT_SCOPES },
+    { "dry-run", optional_argument, NULL, OPT_DRY_RUN },
+    { "deps-threads", optional_argument, NULL, OPT_DEPS_THREADS },
+    { "io-thread", no_argument, NULL, OPT_IO_THREAD },
+    { "start-during-scan", no_argument, NULL, OPT_START_DURING_SCAN },
     { NULL, 0, NULL, 0 }
   };
 
   int opt;
   while (!options->tool &&
-         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:nt:vw:C:h", kLongOptions,
+         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:m:np:t:vw:C:h", kLongOptions,
                             NULL)) != -1) {
     switch (opt) {
       case 'd':
@@ -1309,9 +2715,21 @@ int ReadFlags(int* argc, char*** argv,
         config->max_load_average = value;
         break;
       }
+      case 'm':
+        if (!ParseMemorySize(optarg, &config->max_memory))
+          Fatal("invalid -m parameter: did you mean -m 64G?");
+        break;
       case 'n':
         config->dry_run = true;
         break;
+      case 'p': {
+        char* end;
+        double value = strtod(optarg, &end);
+        if (end == optarg || *end != 0)
+          Fatal("-p parameter not numeric: did you mean -p 20?");
+        config->max_pressure = value;
+        break;
+      }
       case 't':
         options->tool = ChooseTool(optarg);
         if (!options->tool)
@@ -1330,6 +2748,98 @@ int ReadFlags(int* argc, char*** argv,
       case OPT_VERSION:
         printf("%s\n", kNinjaVersion);
         return 0;
+      case OPT_JOBSERVER:
+        config->jobserver = true;
+        if (optarg)
+          config->jobserver_fifo = optarg;
+        break;
+      case OPT_FRONTEND_FD: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || end == optarg || value < 0)
+          Fatal("invalid --frontend-fd parameter");
+        config->frontend_fd = value;
+        // Keep commands from writing into the event stream.
+        SetCloseOnExec(value);
+        break;
+      }
+      case OPT_CACHE_DIR:
+        config->cache_dir = optarg;
+        break;
+      case OPT_REMOTE:
+        config->remote_launcher = optarg;
+        break;
+      case OPT_REMOTE_JOBS: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0)
+          Fatal("invalid --remote-jobs parameter");
+        // We want to run N jobs in parallel. For N = 0, INT_MAX
+        // is close enough to infinite for most sane builds.
+        config->remote_parallelism = value > 0 ? value : INT_MAX;
+        break;
+      }
+      case OPT_TARGETS:
+        if (strcmp(optarg, "fair") == 0)
+          config->target_share = BuildConfig::SHARE_FAIR;
+        else if (strcmp(optarg, "first") == 0)
+          config->target_share = BuildConfig::SHARE_FIRST;
+        else
+          Fatal("invalid --targets parameter (use 'fair' or 'first')");
+        break;
+      case OPT_PREFETCH: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || end == optarg || value < 0)
+          Fatal("invalid --prefetch parameter");
+        config->prefetch_edges = value;
+        break;
+      }
+      case OPT_AFFINITY:
+        if (strcmp(optarg, "cpu") == 0)
+          config->affinity = BuildConfig::AFFINITY_CPU;
+        else if (strcmp(optarg, "node") == 0)
+          config->affinity = BuildConfig::AFFINITY_NODE;
+        else
+          Fatal("invalid --affinity parameter (use 'cpu' or 'node')");
+        break;
+      case OPT_COMPACT_SCOPES:
+        options->compact_scopes = true;
+        break;
+      case OPT_DRY_RUN:
+        config->dry_run = true;
+        if (!optarg)
+          break;
+        if (strcmp(optarg, "outputs") == 0)
+          config->dry_run_format = BuildConfig::DRY_RUN_OUTPUTS;
+        else if (strcmp(optarg, "commands") == 0)
+          config->dry_run_format = BuildConfig::DRY_RUN_COMMANDS;
+        else if (strcmp(optarg, "json") == 0)
+          config->dry_run_format = BuildConfig::DRY_RUN_JSON;
+        else
+          Fatal("invalid --dry-run parameter "
+                "(use 'outputs', 'commands' or 'json')");
+        // Nothing runs, so there's no use starting during the scan.
+        config->start_during_scan = false;
+        break;
+      case OPT_DEPS_THREADS: {
+        if (!optarg) {
+          config->deps_threads = GuessDepsThreads();
+          break;
+        }
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || end == optarg || value < 0)
+          Fatal("invalid --deps-threads parameter");
+        config->deps_threads = value;
+        break;
+      }
+      case OPT_IO_THREAD:
+        config->io_thread = true;
+        break;
+      case OPT_START_DURING_SCAN:
+        config->start_during_scan = true;
+        break;
       case 'h':
       default:
         Usage(*config);
@@ -1370,6 +2880,48 @@ NORETURN void real_main(int argc, char** argv) {
     }
   }
 
+#ifndef _WIN32
+  // Hand the build to a "ninja -t serve" in this directory, if there is one.
+  // A jobserver or frontend on inherited fds can't be passed along, and
+  // the server doesn't share jobservers, keep an action cache or run
+  // remote commands.
+  string fifo;
+  int read_fd, write_fd;
+  const char* makeflags = getenv("MAKEFLAGS");
+  bool pipe_jobserver = makeflags &&
+      ParseJobserverAuth(makeflags, &fifo, &read_fd, &write_fd) &&
+      fifo.empty();
+  if (!options.tool && !config.dry_run && !g_metrics && !g_tracer &&
+      !pipe_jobserver && config.jobserver_fifo.empty() &&
+      config.frontend_fd < 0 &&
+      config.cache_dir.empty() && config.remote_launcher.empty()) {
+    ServerRequest request;
+    request.input_file = options.input_file;
+    request.verbosity = config.verbosity;
+    request.parallelism = config.parallelism;
+    request.failures_allowed = config.failures_allowed;
+    request.max_load_average = config.max_load_average;
+    request.max_pressure = config.max_pressure;
+    request.max_memory = config.max_memory;
+    request.jobserver = config.jobserver;
+    request.explaining = g_explaining;
+    request.keep_depfile = g_keep_depfile;
+    request.keep_rsp = g_keep_rsp;
+    request.stat_cache = g_experimental_statcache;
+    request.target_share = config.target_share;
+    request.prefetch_edges = config.prefetch_edges;
+    request.affinity = config.affinity;
+    request.deps_threads = config.deps_threads;
+    request.io_thread = config.io_thread;
+    request.start_during_scan = config.start_during_scan;
+    request.targets.assign(argv, argv + argc);
+    request.environment = GetEnvironment();
+    int exit_code = 1;
+    if (RunBuildOnServer(request, &exit_code))
+      exit(exit_code);
+  }
+#endif
+
   if (options.tool && options.tool->when == Tool::RUN_AFTER_FLAGS) {
     // None of the RUN_AFTER_FLAGS actually use a NinjaMain, but it's needed
     // by other tools.
@@ -1377,10 +2929,16 @@ NORETURN void real_main(int argc, char** argv) {
     exit((ninja.*options.tool->func)(&options, argc, argv));
   }
 
+  // Load the logs while the manifest loads, unless a tool may want them
+  // otherwise or metrics, which aren't thread-safe, are on.
+  bool preload_logs = !options.tool && !g_metrics;
+
   // Limit number of rebuilds, to prevent infinite loops.
   const int kCycleLimit = 100;
   for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
     NinjaMain ninja(ninja_command, config);
+    if (preload_logs)
+      ninja.StartLoadingLogs(GuessBuildDir(options.input_file));
 
     ManifestParserOptions parser_opts;
     if (options.dupe_edges_should_err) {
@@ -1389,9 +2947,12 @@ NORETURN void real_main(int argc, char** argv) {
     if (options.phony_cycle_should_err) {
       parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
     }
-    ManifestParser parser(&ninja.state_, &ninja.disk_interface_, parser_opts);
+    ManifestCache cache(&ninja.state_, &ninja.disk_interface_, parser_opts);
     string err;
-    if (!parser.Load(options.input_file, &err)) {
+    if (!cache.Load(options.input_file,
+                    g_manifest_cache ? kManifestCachePath : "",
+                    !config.dry_run, &err)) {
+      ninja.FinishLoadingLogs();
       Error("%s", err.c_str());
       exit(1);
     }
@@ -1399,21 +2960,37 @@ NORETURN void real_main(int argc, char** argv) {
     if (options.tool && options.tool->when == Tool::RUN_AFTER_LOAD)
       exit((ninja.*options.tool->func)(&options, argc, argv));
 
-    if (!ninja.EnsureBuildDirExists())
+    if (!ninja.EnsureBuildDirExists()) {
+      ninja.FinishLoadingLogs();
       exit(1);
+    }
+    if (!ninja.FinishLoadingLogs()) {
+      // The logs came from where the builddir used to be.  Start over
+      // and load them after the manifest.
+      preload_logs = false;
+      --cycle;
+      continue;
+    }
+    if (options.compact_scopes && !options.tool)
+      ninja.state_.CompactScopes();
 
     if (!ninja.OpenBuildLog() || !ninja.OpenDepsLog())
       exit(1);
 
-    if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS)
-      exit((ninja.*options.tool->func)(&options, argc, argv));
+    if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS) {
+      int result = (ninja.*options.tool->func)(&options, argc, argv);
+      ninja.CloseLogs();
+      exit(result);
+    }
 
     // Attempt to rebuild the manifest before building anything else
     if (ninja.RebuildManifest(options.input_file, &err)) {
       // In dry_run mode the regeneration will succeed without changing the
       // manifest forever. Better to return immediately.
-      if (config.dry_run)
+      if (config.dry_run) {
+        ninja.CloseLogs();
         exit(0);
+      }
       // Start the build over with the new manifest.
       continue;
     } else if (!err.empty()) {
@@ -1422,8 +2999,11 @@ NORETURN void real_main(int argc, char** argv) {
     }
 
     int result = ninja.RunBuild(argc, argv);
+    ninja.CloseLogs();
     if (g_metrics)
       ninja.DumpMetrics();
+    if (g_tracer)
+      g_tracer->Close();
     exit(result);
   }
 
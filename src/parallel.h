@@ -0,0 +1,66 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PARALLEL_H_
+#define NINJA_PARALLEL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/// Hands out the indices of a ParallelFor to the threads running it.
+template <typename Func>
+struct ParallelForWorker {
+  ParallelForWorker(Func* func, size_t count, std::atomic<size_t>* next)
+      : func_(func), count_(count), next_(next) {}
+
+  void operator()() const {
+    for (size_t i = next_->fetch_add(1); i < count_; i = next_->fetch_add(1))
+      (*func_)(i);
+  }
+
+  Func* func_;
+  size_t count_;
+  std::atomic<size_t>* next_;
+};
+
+/// Call |func(i)| for every i in [0, count), spreading the calls over at
+/// most |max_threads| threads, the calling thread included.  Returns once
+/// all calls have completed.  |func| must be safe to call concurrently for
+/// different indices.
+template <typename Func>
+void ParallelFor(size_t count, int max_threads, Func& func) {
+  size_t threads = max_threads > 1 ? max_threads : 1;
+  if (threads > count)
+    threads = count;
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; ++i)
+      func(i);
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  ParallelForWorker<Func> worker(&func, count, &next);
+  std::vector<std::thread> helpers;
+  helpers.reserve(threads - 1);
+  for (size_t i = 1; i < threads; ++i)
+    helpers.push_back(std::thread(worker));
+  worker();
+  for (size_t i = 0; i < helpers.size(); ++i)
+    helpers[i].join();
+}
+
+#endif  // NINJA_PARALLEL_H_
@@ -16,27 +16,33 @@
 
 #include "disk_interface.h"
 #include "metrics.h"
+#include "probes.h"
+#include "util.h"
 
 bool Parser::Load(const string& filename, string* err, Lexer* parent) {
-  METRIC_RECORD(".ninja parse");
-  string contents;
+  METRIC_RECORD_PHASE(".ninja parse");
+  NINJA_PROBE1(manifest__start, filename.c_str());
+  // Map the file rather than reading it, so that the lexer and the tokens
+  // it produces can point into it without copying.
+  MappedFile local_input;
+  MappedFile* input = InputFile();
+  if (!input)
+    input = &local_input;
   string read_err;
-  if (file_reader_->ReadFile(filename, &contents, &read_err) !=
-      FileReader::Okay) {
+  if (file_reader_->MapFile(filename, input, &read_err) != FileReader::Okay) {
     *err = "loading '" + filename + "': " + read_err;
     if (parent)
       parent->Error(string(*err), err);
+    NINJA_PROBE2(manifest__done, filename.c_str(), 0);
     return false;
   }
 
-  // The lexer needs a nul byte at the end of its input, to know when it's done.
-  // It takes a StringPiece, and StringPiece's string constructor uses
-  // string::data().  data()'s return value isn't guaranteed to be
-  // null-terminated (although in practice - libc++, libstdc++, msvc's stl --
-  // it is, and C++11 demands that too), so add an explicit nul byte.
-  contents.resize(contents.size() + 1);
-
-  return Parse(filename, contents, err);
+  // The lexer needs a nul byte at the end of its input, to know when it's
+  // done; MapFile() leaves one after the contents.
+  bool ok = Parse(filename, StringPiece(input->data(), input->size() + 1),
+                  err);
+  NINJA_PROBE2(manifest__done, filename.c_str(), ok ? 1 : 0);
+  return ok;
 }
 
 bool Parser::ExpectToken(Lexer::Token expected, string* err) {
@@ -22,6 +22,7 @@ using namespace std;
 #include "lexer.h"
 
 struct FileReader;
+struct MappedFile;
 struct State;
 
 /// Base class for parsers.
@@ -42,8 +43,13 @@ protected:
   Lexer lexer_;
 
 private:
-  /// Parse a file, given its contents as a string.
-  virtual bool Parse(const string& filename, const string& input,
+  /// Where Load() should read a file to, if the parser needs it to stay in
+  /// memory past Load(); NULL means only for the Parse() call.
+  virtual MappedFile* InputFile() { return NULL; }
+
+  /// Parse a file, given its contents, which are followed by a nul byte.
+  /// Tokens may point into them for as long as Load() keeps them.
+  virtual bool Parse(const string& filename, StringPiece input,
                      string* err) = 0;
 };
 
@@ -0,0 +1,87 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pressure.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "metrics.h"
+
+namespace {
+
+/// How often to look at the pressure.
+const int64_t kSampleIntervalMs = 250;
+
+}  // anonymous namespace
+
+bool ParsePressureStall(const string& contents, uint64_t* total_us) {
+  // The first line is "some avg10=... avg60=... avg300=... total=N".
+  if (contents.compare(0, 5, "some ") != 0)
+    return false;
+  size_t line_end = contents.find('\n');
+  size_t total = contents.find(" total=");
+  if (total == string::npos || total > line_end)
+    return false;
+  const char* start = contents.c_str() + total + 7;
+  char* end;
+  *total_us = strtoull(start, &end, 10);
+  return end != start;
+}
+
+AdaptiveParallelism::AdaptiveParallelism(int max_jobs, double max_pressure)
+    : max_jobs_(max_jobs), max_pressure_(max_pressure), limit_(max_jobs),
+      available_(true), last_sample_ms_(-1), last_cpu_us_(0),
+      last_memory_us_(0) {}
+
+bool AdaptiveParallelism::ReadStall(uint64_t* cpu_us,
+                                    uint64_t* memory_us) const {
+  string cpu, memory, err;
+  return ReadFile("/proc/pressure/cpu", &cpu, &err) == 0 &&
+      ReadFile("/proc/pressure/memory", &memory, &err) == 0 &&
+      ParsePressureStall(cpu, cpu_us) && ParsePressureStall(memory, memory_us);
+}
+
+void AdaptiveParallelism::Sample(int running) {
+  if (!available_)
+    return;
+  int64_t now = GetTimeMillis();
+  if (last_sample_ms_ >= 0 && now - last_sample_ms_ < kSampleIntervalMs)
+    return;
+
+  uint64_t cpu_us, memory_us;
+  if (!ReadStall(&cpu_us, &memory_us)) {
+    if (last_sample_ms_ < 0)
+      Warning("no pressure stall information; not adapting the jobs to it");
+    available_ = false;
+    limit_ = max_jobs_;
+    return;
+  }
+  if (last_sample_ms_ >= 0 && now > last_sample_ms_) {
+    uint64_t stall_us = max(cpu_us - last_cpu_us_, memory_us - last_memory_us_);
+    Update(stall_us / 1000.0 / (now - last_sample_ms_), running);
+  }
+  last_sample_ms_ = now;
+  last_cpu_us_ = cpu_us;
+  last_memory_us_ = memory_us;
+}
+
+void AdaptiveParallelism::Update(double pressure, int running) {
+  if (pressure > max_pressure_)
+    limit_ = max(1, min(limit_, running) * 3 / 4);
+  else if (pressure < max_pressure_ / 2 && running >= limit_ &&
+           limit_ < max_jobs_)
+    ++limit_;
+}
@@ -0,0 +1,67 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PRESSURE_H_
+#define NINJA_PRESSURE_H_
+
+#include <string>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+/// Parse the total time, in microseconds, that some task was stalled
+/// from the contents of a Linux pressure stall information file like
+/// /proc/pressure/cpu.  Returns false if it isn't there.
+bool ParsePressureStall(const string& contents, uint64_t* total_us);
+
+/// Adapts the number of jobs to run to how much the running ones contend
+/// for the CPU and memory, as told by Linux's pressure stall information.
+/// Whenever more than the target fraction of time was spent stalled on
+/// either since the last sample, a few hundred milliseconds ago, the
+/// limit drops to three quarters of the jobs running; when less than half
+/// of it was, and the limit is what holds the build back, it grows by one.  Between the two it
+/// stays, so that it doesn't swing back and forth.
+struct AdaptiveParallelism {
+  /// Adapt between 1 and |max_jobs| jobs, to keep the pressure below
+  /// |max_pressure| (a fraction of time).
+  AdaptiveParallelism(int max_jobs, double max_pressure);
+
+  /// The number of jobs to run at most.
+  int limit() const { return limit_; }
+
+  /// Read the pressure files if the last sample is old enough, and update
+  /// the limit for the |running| jobs.  When there's no pressure
+  /// information, the limit stays at |max_jobs|.
+  void Sample(int running);
+
+  /// Update the limit for a sample of the fraction of time stalled while
+  /// |running| jobs ran.
+  void Update(double pressure, int running);
+
+ private:
+  /// Read the total stall times on the CPU and memory.  Returns false if
+  /// the system doesn't say.
+  bool ReadStall(uint64_t* cpu_us, uint64_t* memory_us) const;
+
+  int max_jobs_;
+  double max_pressure_;
+  int limit_;
+  /// Whether the pressure files are readable, as far as is known.
+  bool available_;
+  int64_t last_sample_ms_;
+  uint64_t last_cpu_us_;
+  uint64_t last_memory_us_;
+};
+
+#endif  // NINJA_PRESSURE_H_
@@ -0,0 +1,58 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pressure.h"
+
+#include "test.h"
+
+TEST(ParsePressureStall, Basic) {
+  uint64_t total = 0;
+  EXPECT_TRUE(ParsePressureStall(
+      "some avg10=0.37 avg60=1.24 avg300=8.79 total=533449564\n"
+      "full avg10=0.00 avg60=0.00 avg300=0.00 total=12\n", &total));
+  EXPECT_EQ(533449564u, total);
+
+  EXPECT_FALSE(ParsePressureStall("", &total));
+  EXPECT_FALSE(ParsePressureStall("full avg10=0.00 total=12\n", &total));
+  EXPECT_FALSE(ParsePressureStall("some avg10=0.00\nfull total=12\n", &total));
+}
+
+TEST(AdaptiveParallelism, Update) {
+  AdaptiveParallelism adaptive(8, 0.2);
+  EXPECT_EQ(8, adaptive.limit());
+
+  // Too much pressure lowers the limit below what's running.
+  adaptive.Update(0.5, 8);
+  EXPECT_EQ(6, adaptive.limit());
+  adaptive.Update(0.5, 6);
+  EXPECT_EQ(4, adaptive.limit());
+
+  // In between, nothing changes.
+  adaptive.Update(0.15, 4);
+  EXPECT_EQ(4, adaptive.limit());
+
+  // Little pressure raises it, but only if the limit holds the build back.
+  adaptive.Update(0.05, 3);
+  EXPECT_EQ(4, adaptive.limit());
+  adaptive.Update(0.05, 4);
+  EXPECT_EQ(5, adaptive.limit());
+
+  // It stays within the bounds.
+  for (int i = 0; i < 10; ++i)
+    adaptive.Update(0.0, adaptive.limit());
+  EXPECT_EQ(8, adaptive.limit());
+  for (int i = 0; i < 10; ++i)
+    adaptive.Update(1.0, adaptive.limit());
+  EXPECT_EQ(1, adaptive.limit());
+}
@@ -0,0 +1,42 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PROBES_H_
+#define NINJA_PROBES_H_
+
+/// Static tracepoints for perf, bpftrace, SystemTap and DTrace, in the
+/// "ninja" provider.  A build configured with NINJA_USDT in CMake, or with
+/// --usdt in configure.py, gets them from <sys/sdt.h>; each is a nop until
+/// a tracer attaches to it.  Elsewhere they compile to nothing.
+///
+/// The probes are:
+///   phase__start(name), phase__done(name): a METRIC_RECORD_PHASE phase,
+///     like "dirty scan" or ".ninja_log recompact".
+///   manifest__start(path), manifest__done(path, ok): parsing a manifest,
+///     including each include and subninja.
+///   edge__start(id, output), edge__finish(id, output, status): a command.
+///   deps__record(output, count): writing a deps log record.
+#ifdef NINJA_HAVE_USDT
+#include <sys/sdt.h>
+
+#define NINJA_PROBE1(name, a) DTRACE_PROBE1(ninja, name, a)
+#define NINJA_PROBE2(name, a, b) DTRACE_PROBE2(ninja, name, a, b)
+#define NINJA_PROBE3(name, a, b, c) DTRACE_PROBE3(ninja, name, a, b, c)
+#else
+#define NINJA_PROBE1(name, a) do {} while (0)
+#define NINJA_PROBE2(name, a, b) do {} while (0)
+#define NINJA_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif  // NINJA_PROBES_H_
@@ -0,0 +1,200 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "regen_stamp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <set>
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "hash.h"
+#include "metrics.h"
+
+using namespace std;
+
+namespace {
+
+const char kFileSignature[] = "# ninjaregen\n";
+const uint32_t kCurrentVersion = 1;
+
+void AppendInt(string* out, int64_t value) {
+  out->append((const char*)&value, sizeof(value));
+}
+
+}  // anonymous namespace
+
+void RegenStamp::CollectEdges(Node* node) {
+  set<Edge*> seen;
+  vector<Node*> stack(1, node);
+  while (!stack.empty()) {
+    Edge* edge = stack.back()->in_edge();
+    stack.pop_back();
+    if (!edge || !seen.insert(edge).second)
+      continue;
+    edges_.push_back(edge);
+    stack.insert(stack.end(), edge->inputs_.begin(), edge->inputs_.end());
+  }
+}
+
+bool RegenStamp::Check(const string& path, Node* manifest) {
+  METRIC_RECORD("regen stamp check");
+  edges_.clear();
+  CollectEdges(manifest);
+
+  // Everything that decides whether the edges are dirty, other than the
+  // mtimes of their files: their commands and paths, and what the logs
+  // say about their outputs.
+  string key = manifest->path();
+  for (vector<Edge*>::const_iterator e = edges_.begin(); e != edges_.end();
+       ++e) {
+    Edge* edge = *e;
+    key.push_back('\0');
+    if (!edge->is_phony())
+      AppendInt(&key, (int64_t)edge->CommandHash());
+    AppendInt(&key, edge->implicit_deps_);
+    AppendInt(&key, edge->order_only_deps_);
+    for (Node* const* i = edge->inputs_.begin(); i != edge->inputs_.end();
+         ++i) {
+      key += (*i)->path();
+      key.push_back('\0');
+    }
+    bool has_deps = !edge->GetBinding(kVarDeps).empty();
+    for (Node* const* o = edge->outputs_.begin(); o != edge->outputs_.end();
+         ++o) {
+      key += (*o)->path();
+      key.push_back('\0');
+      if (edge->is_phony())
+        continue;
+      BuildLog::LogEntry* entry =
+          build_log_ ? build_log_->LookupByOutput((*o)->path()) : NULL;
+      AppendInt(&key, entry ? (int64_t)entry->command_hash : 0);
+      DepsLog::Deps* deps =
+          has_deps && deps_log_ ? deps_log_->GetDeps(*o) : NULL;
+      AppendInt(&key, deps ? deps->mtime : -1);
+      AppendInt(&key, deps ? deps->node_count : -1);
+    }
+  }
+  signature_ = HashBytes(key.data(), key.size());
+
+  string data, err;
+  if (::ReadFile(path, &data, &err) < 0)
+    return false;
+  const size_t kHeaderSize = sizeof(kFileSignature) - 1 + 4 + 8;
+  uint32_t version;
+  uint64_t signature;
+  if (data.size() < kHeaderSize ||
+      memcmp(data.data(), kFileSignature, sizeof(kFileSignature) - 1) != 0)
+    return false;
+  memcpy(&version, data.data() + kHeaderSize - 12, 4);
+  memcpy(&signature, data.data() + kHeaderSize - 8, 8);
+  if (version != kCurrentVersion || signature != signature_)
+    return false;
+
+  // Records are the size of the path and the mtime, then the path.
+  vector<string> paths;
+  vector<TimeStamp> recorded;
+  size_t offset = kHeaderSize;
+  while (offset < data.size()) {
+    uint32_t size;
+    int64_t mtime;
+    if (data.size() - offset < 12)
+      return false;
+    memcpy(&size, data.data() + offset, 4);
+    memcpy(&mtime, data.data() + offset + 4, 8);
+    offset += 12;
+    if (data.size() - offset < size)
+      return false;
+    paths.push_back(data.substr(offset, size));
+    recorded.push_back(mtime);
+    offset += size;
+  }
+
+  vector<TimeStamp> mtimes;
+  disk_interface_->StatBatch(paths, &mtimes);
+  return mtimes == recorded;
+}
+
+bool RegenStamp::Write(const string& path, Node* manifest, string* err) {
+  // The scan may have added inputs from depfiles and the deps log.
+  set<Node*> seen;
+  vector<Node*> nodes(1, manifest);
+  seen.insert(manifest);
+  for (vector<Edge*>::const_iterator e = edges_.begin(); e != edges_.end();
+       ++e) {
+    for (Node* const* i = (*e)->inputs_.begin(); i != (*e)->inputs_.end();
+         ++i) {
+      if (seen.insert(*i).second)
+        nodes.push_back(*i);
+    }
+    for (Node* const* o = (*e)->outputs_.begin(); o != (*e)->outputs_.end();
+         ++o) {
+      if (seen.insert(*o).second)
+        nodes.push_back(*o);
+    }
+  }
+
+  string data(kFileSignature, sizeof(kFileSignature) - 1);
+  data.append((const char*)&kCurrentVersion, 4);
+  data.append((const char*)&signature_, 8);
+  for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end();
+       ++n) {
+    // A stamp that can't list every file mustn't be left to match.
+    if (!(*n)->status_known() || (*n)->mtime() < 0) {
+      if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        *err = strerror(errno);
+        return false;
+      }
+      return true;
+    }
+    uint32_t size = (*n)->path().size();
+    data.append((const char*)&size, 4);
+    AppendInt(&data, (*n)->mtime());
+    data += (*n)->path();
+  }
+
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // On Windows, rename() doesn't replace an existing file.
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,62 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_REGEN_STAMP_H_
+#define NINJA_REGEN_STAMP_H_
+
+#include <string>
+#include <vector>
+
+#include "util.h"  // For uint64_t.
+
+struct BuildLog;
+struct DepsLog;
+struct DiskInterface;
+struct Edge;
+struct Node;
+
+/// Remembers the files behind the manifest, and their mtimes, as of the
+/// last time a dependency scan found the manifest up to date.  As long as
+/// the edges that regenerate it are the same and none of those files
+/// changed, it still is, which a batch of stats tells much faster than a
+/// scan of the generator's hundreds of inputs.
+struct RegenStamp {
+  RegenStamp(BuildLog* build_log, DepsLog* deps_log,
+             DiskInterface* disk_interface)
+      : build_log_(build_log), deps_log_(deps_log),
+        disk_interface_(disk_interface), signature_(0) {}
+
+  /// Whether the stamp at |path| was written for the edges behind
+  /// |manifest| as they are now, and none of the files it lists changed
+  /// since.  Call it before the dependency scan, which adds the inputs
+  /// from depfiles to the edges.
+  bool Check(const std::string& path, Node* manifest);
+
+  /// Write the stamp at |path| for the files behind |manifest|, after a
+  /// dependency scan of the edges Check() saw found it up to date.
+  bool Write(const std::string& path, Node* manifest, std::string* err);
+
+ private:
+  /// Collect the edges behind |node| in |edges_|.
+  void CollectEdges(Node* node);
+
+  BuildLog* build_log_;
+  DepsLog* deps_log_;
+  DiskInterface* disk_interface_;
+  /// The hash of the edges behind the manifest, which Check() computes.
+  uint64_t signature_;
+  std::vector<Edge*> edges_;
+};
+
+#endif  // NINJA_REGEN_STAMP_H_
@@ -0,0 +1,99 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "regen_stamp.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "RegenStampTest-tempfile";
+
+struct RegenStampTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+    AssertParse(&state_,
+"rule regen\n"
+"  command = regen $in\n"
+"  generator = 1\n"
+"build build.ninja: regen gen.in sub.in\n"
+"build sub.in: cat src\n");
+    fs_.Create("src", "");
+    fs_.Create("sub.in", "");
+    fs_.Create("gen.in", "");
+    fs_.Create("build.ninja", "");
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  /// Stat the files behind the manifest, as a dependency scan does, and
+  /// write the stamp.
+  void Write(RegenStamp* stamp) {
+    const char* paths[] = { "build.ninja", "gen.in", "sub.in", "src" };
+    string err;
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+      ASSERT_TRUE(GetNode(paths[i])->Stat(&fs_, &err));
+    ASSERT_TRUE(stamp->Write(kTestFilename, GetNode("build.ninja"), &err));
+    ASSERT_EQ("", err);
+  }
+
+  VirtualFileSystem fs_;
+  BuildLog build_log_;
+  DepsLog deps_log_;
+};
+
+TEST_F(RegenStampTest, UpToDate) {
+  RegenStamp stamp(&build_log_, &deps_log_, &fs_);
+  EXPECT_FALSE(stamp.Check(kTestFilename, GetNode("build.ninja")));
+  ASSERT_NO_FATAL_FAILURE(Write(&stamp));
+
+  RegenStamp stamp2(&build_log_, &deps_log_, &fs_);
+  EXPECT_TRUE(stamp2.Check(kTestFilename, GetNode("build.ninja")));
+
+  // Any file behind the manifest, however deep, counts.
+  fs_.Tick();
+  fs_.Create("src", "");
+  RegenStamp stamp3(&build_log_, &deps_log_, &fs_);
+  EXPECT_FALSE(stamp3.Check(kTestFilename, GetNode("build.ninja")));
+}
+
+TEST_F(RegenStampTest, Edges) {
+  RegenStamp stamp(&build_log_, &deps_log_, &fs_);
+  EXPECT_FALSE(stamp.Check(kTestFilename, GetNode("build.ninja")));
+  ASSERT_NO_FATAL_FAILURE(Write(&stamp));
+
+  // What the build log says about the edges counts as well.
+  build_log_.RecordCommand(GetNode("sub.in")->in_edge(), 0, 1);
+  RegenStamp stamp2(&build_log_, &deps_log_, &fs_);
+  EXPECT_FALSE(stamp2.Check(kTestFilename, GetNode("build.ninja")));
+
+  // And so does a new input, without any file changing.
+  ASSERT_NO_FATAL_FAILURE(Write(&stamp2));
+  RegenStamp stamp3(&build_log_, &deps_log_, &fs_);
+  EXPECT_TRUE(stamp3.Check(kTestFilename, GetNode("build.ninja")));
+  GetNode("build.ninja")->in_edge()->inputs_.push_back(GetNode("src"));
+  RegenStamp stamp4(&build_log_, &deps_log_, &fs_);
+  EXPECT_FALSE(stamp4.Check(kTestFilename, GetNode("build.ninja")));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,35 @@
+// Copyright 2019 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_RESOURCE_USAGE_H_
+#define NINJA_RESOURCE_USAGE_H_
+
+/// The resources a command used, as the OS reports them once it exited.
+/// Fields the OS doesn't report are 0.
+struct ResourceUsage {
+  ResourceUsage()
+      : user_time(0), system_time(0), max_rss(0), read_blocks(0),
+        write_blocks(0) {}
+
+  /// CPU time spent in user and kernel mode, in milliseconds.
+  unsigned user_time;
+  unsigned system_time;
+  /// Peak resident set size, in kilobytes.
+  unsigned max_rss;
+  /// Reads from and writes to storage, in 512-byte blocks.
+  unsigned read_blocks;
+  unsigned write_blocks;
+};
+
+#endif  // NINJA_RESOURCE_USAGE_H_
@@ -0,0 +1,137 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "result_queue.h"
+
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "util.h"
+
+ResultQueue::ResultQueue() : pushed_(NULL) {
+#ifdef _WIN32
+  // Auto-reset, so that a wait consumes the wakeup.
+  event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!event_)
+    Win32Fatal("CreateEvent");
+#else
+  if (pipe(wake_fds_) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  for (int i = 0; i < 2; ++i) {
+    SetCloseOnExec(wake_fds_[i]);
+    fcntl(wake_fds_[i], F_SETFL, fcntl(wake_fds_[i], F_GETFL) | O_NONBLOCK);
+  }
+#endif
+}
+
+ResultQueue::~ResultQueue() {
+  CommandRunner::Result result;
+  while (Pop(&result)) {
+    if (result.output_spill)
+      fclose(result.output_spill);
+  }
+#ifdef _WIN32
+  CloseHandle(event_);
+#else
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+#endif
+}
+
+void ResultQueue::Push(const CommandRunner::Result& result) {
+  Entry* entry = new Entry;
+  entry->result = result;
+  entry->next = pushed_.load(std::memory_order_relaxed);
+  while (!pushed_.compare_exchange_weak(entry->next, entry,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+  }
+  // Only the first result since the builder last looked needs to wake it;
+  // it takes all of them at once.
+  if (entry->next)
+    return;
+#ifdef _WIN32
+  SetEvent(event_);
+#else
+  char c = 0;
+  // A full pipe already wakes the builder.
+  while (write(wake_fds_[1], &c, 1) < 0 && errno == EINTR) {
+  }
+#endif
+}
+
+bool ResultQueue::Pop(CommandRunner::Result* result) {
+  if (ready_.empty()) {
+    Entry* entry = pushed_.exchange(NULL, std::memory_order_acquire);
+    // They're newest first; put them in order behind any older ones.
+    size_t count = 0;
+    for (; entry; entry = entry->next, ++count)
+      ready_.push_front(entry);
+    METRIC_COUNT("result queue takes", 1);
+    METRIC_COUNT("result queue results", count);
+    if (ready_.empty())
+      return false;
+  }
+  Entry* entry = ready_.front();
+  ready_.pop_front();
+  *result = entry->result;
+  delete entry;
+  return true;
+}
+
+bool ResultQueue::Wait(int timeout_millis) {
+  if (HasResult())
+    return true;
+#ifdef _WIN32
+  DWORD ret = WaitForSingleObject(event_,
+                                  timeout_millis < 0 ? INFINITE : timeout_millis);
+  if (ret == WAIT_FAILED)
+    Win32Fatal("WaitForSingleObject");
+  return true;
+#else
+  pollfd pfd = { wake_fds_[0], POLLIN, 0 };
+  int ret = poll(&pfd, 1, timeout_millis);
+  if (ret < 0) {
+    if (errno == EINTR)
+      return false;
+    Fatal("poll: %s", strerror(errno));
+  }
+  // Drain the wakeups.  The results they were for are in |pushed_| by now.
+  char buf[64];
+  while (read(wake_fds_[0], buf, sizeof(buf)) > 0) {
+  }
+  return true;
+#endif
+}
+
+bool AsyncCommandRunner::WaitForCommand(Result* result) {
+  while (!results_.Pop(result)) {
+    if (!results_.Wait(-1))
+      return false;
+  }
+  return true;
+}
+
+bool AsyncCommandRunner::WaitForActivity(int timeout_millis) {
+  return results_.Wait(timeout_millis);
+}
+
+bool AsyncCommandRunner::HasFinishedCommand() {
+  return results_.HasResult();
+}
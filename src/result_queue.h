@@ -0,0 +1,88 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_RESULT_QUEUE_H_
+#define NINJA_RESULT_QUEUE_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <atomic>
+#include <deque>
+
+#include "build.h"
+
+/// Hands the results of commands from the threads that ran them to the
+/// builder thread, without a lock.
+///
+/// Any number of threads may Push(); only the builder thread may Wait()
+/// and Pop().  A push onto an empty queue wakes the builder through a pipe
+/// (an event on Windows), so a busy queue costs no system calls.
+struct ResultQueue {
+  ResultQueue();
+  ~ResultQueue();
+
+  /// Queue |result|.  Safe from any thread.
+  void Push(const CommandRunner::Result& result);
+
+  /// Take the oldest result into |result|.  Returns false if there is none.
+  bool Pop(CommandRunner::Result* result);
+
+  /// Whether Pop() would return a result.
+  bool HasResult() const {
+    return !ready_.empty() || pushed_.load(std::memory_order_acquire);
+  }
+
+  /// Wait at most |timeout_millis|, or forever if it's negative, for a
+  /// result to be pushed.  Returns false if interrupted; may return true
+  /// without a result to Pop().
+  bool Wait(int timeout_millis);
+
+ private:
+  struct Entry {
+    CommandRunner::Result result;
+    Entry* next;
+  };
+
+  /// The results pushed and not yet taken by Pop(), newest first.
+  std::atomic<Entry*> pushed_;
+  /// The results taken from |pushed_|, oldest first.
+  std::deque<Entry*> ready_;
+
+#ifdef _WIN32
+  HANDLE event_;
+#else
+  int wake_fds_[2];
+#endif
+};
+
+/// A CommandRunner whose commands complete on threads of its own, like one
+/// that runs them remotely or on persistent workers.  Its StartCommand()
+/// hands the command off, and whichever thread learns of its completion
+/// calls Complete(); the builder waits on the queue.
+struct AsyncCommandRunner : public CommandRunner {
+  virtual bool WaitForCommand(Result* result);
+  virtual bool WaitForActivity(int timeout_millis);
+  virtual bool HasFinishedCommand();
+
+ protected:
+  /// Report that a command completed.  Safe from any thread.
+  void Complete(const Result& result) { results_.Push(result); }
+
+ private:
+  ResultQueue results_;
+};
+
+#endif  // NINJA_RESULT_QUEUE_H_
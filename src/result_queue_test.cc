@@ -0,0 +1,148 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "result_queue.h"
+
+#include <thread>
+#include <vector>
+
+#include "test.h"
+
+namespace {
+
+CommandRunner::Result MakeResult(int i) {
+  CommandRunner::Result result;
+  result.status = ExitSuccess;
+  result.output = string(1, 'a' + i % 26);
+  result.edge = reinterpret_cast<Edge*>((intptr_t)i + 1);
+  return result;
+}
+
+int ResultIndex(const CommandRunner::Result& result) {
+  return (int)(reinterpret_cast<intptr_t>(result.edge) - 1);
+}
+
+TEST(ResultQueueTest, Order) {
+  ResultQueue queue;
+  CommandRunner::Result result;
+  EXPECT_FALSE(queue.HasResult());
+  EXPECT_FALSE(queue.Pop(&result));
+  // Nothing was pushed, so this times out.
+  EXPECT_TRUE(queue.Wait(0));
+
+  queue.Push(MakeResult(0));
+  queue.Push(MakeResult(1));
+  EXPECT_TRUE(queue.HasResult());
+  EXPECT_TRUE(queue.Wait(-1));
+  ASSERT_TRUE(queue.Pop(&result));
+  EXPECT_EQ(0, ResultIndex(result));
+  EXPECT_EQ("a", result.output);
+
+  // Results pushed later come after those already taken.
+  queue.Push(MakeResult(2));
+  ASSERT_TRUE(queue.Pop(&result));
+  EXPECT_EQ(1, ResultIndex(result));
+  ASSERT_TRUE(queue.Pop(&result));
+  EXPECT_EQ(2, ResultIndex(result));
+  EXPECT_FALSE(queue.Pop(&result));
+  EXPECT_FALSE(queue.HasResult());
+}
+
+struct Producer {
+  Producer(ResultQueue* queue, int first, int count)
+      : queue_(queue), first_(first), count_(count) {}
+  void operator()() {
+    for (int i = first_; i < first_ + count_; ++i)
+      queue_->Push(MakeResult(i));
+  }
+  ResultQueue* queue_;
+  int first_;
+  int count_;
+};
+
+TEST(ResultQueueTest, Producers) {
+  const int kThreads = 4;
+  const int kPerThread = 10000;
+  ResultQueue queue;
+  vector<thread> threads;
+  for (int i = 0; i < kThreads; ++i)
+    threads.push_back(thread(Producer(&queue, i * kPerThread, kPerThread)));
+
+  // Each thread's results arrive in the order it pushed them.
+  vector<int> next(kThreads);
+  for (int i = 0; i < kThreads; ++i)
+    next[i] = i * kPerThread;
+  CommandRunner::Result result;
+  for (int taken = 0; taken < kThreads * kPerThread; ) {
+    if (!queue.Pop(&result)) {
+      ASSERT_TRUE(queue.Wait(-1));
+      continue;
+    }
+    int index = ResultIndex(result);
+    ASSERT_EQ(next[index / kPerThread], index);
+    ++next[index / kPerThread];
+    ++taken;
+  }
+  for (vector<thread>::iterator t = threads.begin(); t != threads.end(); ++t)
+    t->join();
+  EXPECT_FALSE(queue.Pop(&result));
+}
+
+/// Completes each command on a thread of its own.
+struct ThreadedCommandRunner : public AsyncCommandRunner {
+  virtual ~ThreadedCommandRunner() {
+    for (vector<thread>::iterator t = threads_.begin(); t != threads_.end();
+         ++t)
+      t->join();
+  }
+  virtual bool CanRunMore() const { return true; }
+  virtual bool StartCommand(Edge* edge) {
+    threads_.push_back(thread(Completer(this, edge)));
+    return true;
+  }
+
+  struct Completer {
+    Completer(ThreadedCommandRunner* runner, Edge* edge)
+        : runner_(runner), edge_(edge) {}
+    void operator()() {
+      Result result;
+      result.edge = edge_;
+      result.status = ExitSuccess;
+      runner_->Complete(result);
+    }
+    ThreadedCommandRunner* runner_;
+    Edge* edge_;
+  };
+
+  vector<thread> threads_;
+};
+
+TEST(ResultQueueTest, AsyncCommandRunner) {
+  ThreadedCommandRunner runner;
+  const int kCommands = 100;
+  for (int i = 0; i < kCommands; ++i)
+    runner.StartCommand(MakeResult(i).edge);
+
+  vector<bool> seen(kCommands);
+  CommandRunner::Result result;
+  for (int i = 0; i < kCommands; ++i) {
+    ASSERT_TRUE(runner.WaitForCommand(&result));
+    EXPECT_TRUE(result.success());
+    EXPECT_FALSE(seen[ResultIndex(result)]);
+    seen[ResultIndex(result)] = true;
+  }
+  EXPECT_FALSE(runner.HasFinishedCommand());
+}
+
+}  // anonymous namespace
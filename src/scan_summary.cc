@@ -0,0 +1,182 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "scan_summary.h"
+
+#include <stdio.h>
+
+#include "build_log.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "state.h"
+
+namespace {
+
+/// A hash of what decides whether |edge| is up to date: its command, the
+/// bindings that change how it's checked, and the inputs and outputs the
+/// manifest gives it.
+uint64_t HashEdge(const Edge* edge) {
+  string key = edge->rule().name();
+  key += '\0';
+  key += edge->EvaluateCommand(true);
+  const VarId kVars[] = { kVarDepfile, kVarDeps, kVarGenerator,
+                          kVarHashInputs, kVarRestat };
+  for (size_t i = 0; i < sizeof(kVars) / sizeof(kVars[0]); ++i) {
+    key += '\0';
+    key += edge->GetBinding(kVars[i]);
+  }
+  // Deps loaded by a scan aren't part of the manifest.
+  size_t loaded_end = edge->inputs_.size() - edge->order_only_deps_;
+  size_t loaded_begin = loaded_end - edge->loaded_deps_;
+  for (size_t i = 0; i < edge->inputs_.size(); ++i) {
+    if (i >= loaded_begin && i < loaded_end)
+      continue;
+    key += '\0';
+    key += edge->inputs_[i]->path();
+  }
+  char counts[64];
+  snprintf(counts, sizeof(counts), "%d %d %d", edge->implicit_deps_ -
+           edge->loaded_deps_, edge->order_only_deps_, edge->implicit_outs_);
+  key += '\0';
+  key += counts;
+  for (Node* const* o = edge->outputs_.begin(); o != edge->outputs_.end();
+       ++o) {
+    key += '\0';
+    key += (*o)->path();
+  }
+  return BuildLog::LogEntry::HashCommand(key);
+}
+
+}  // anonymous namespace
+
+string ScanSummary::DirOf(const string& path) {
+  string::size_type slash = path.rfind('/');
+  if (slash == string::npos)
+    return ".";
+  if (slash == 0)
+    return "/";
+  return path.substr(0, slash);
+}
+
+void ScanSummary::Clear() {
+  up_to_date_.clear();
+  dependents_.clear();
+  skipped_.clear();
+}
+
+void ScanSummary::Rebind(State* state) {
+  map<string, uint64_t> hashes;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    uint64_t hash = HashEdge(*e);
+    for (Node** o = (*e)->outputs_.begin(); o != (*e)->outputs_.end(); ++o) {
+      uint64_t* dir_hash = &hashes[DirOf((*o)->path())];
+      *dir_hash = *dir_hash * 1000003 ^ hash;
+    }
+  }
+
+  vector<string> changed;
+  for (map<string, uint64_t>::iterator i = hashes_.begin();
+       i != hashes_.end(); ++i) {
+    map<string, uint64_t>::iterator h = hashes.find(i->first);
+    if (h == hashes.end() || h->second != i->second)
+      changed.push_back(i->first);
+  }
+  // Directories only the new graph writes into can't be up to date, as
+  // nothing was recorded about them, but what reads from them might be.
+  for (map<string, uint64_t>::iterator h = hashes.begin();
+       h != hashes.end(); ++h) {
+    if (hashes_.find(h->first) == hashes_.end())
+      changed.push_back(h->first);
+  }
+  Invalidate(changed);
+  hashes_.swap(hashes);
+  skipped_.clear();
+}
+
+void ScanSummary::Invalidate(const vector<string>& dirs) {
+  set<string> seen(dirs.begin(), dirs.end());
+  vector<string> queue(seen.begin(), seen.end());
+  while (!queue.empty()) {
+    string dir = queue.back();
+    queue.pop_back();
+    up_to_date_.erase(dir);
+    map<string, set<string> >::iterator i = dependents_.find(dir);
+    if (i == dependents_.end())
+      continue;
+    for (set<string>::iterator d = i->second.begin(); d != i->second.end();
+         ++d) {
+      if (seen.insert(*d).second)
+        queue.push_back(*d);
+    }
+  }
+}
+
+vector<string> ScanSummary::Dirs() const {
+  vector<string> dirs;
+  for (map<string, set<string> >::const_iterator i = dependents_.begin();
+       i != dependents_.end(); ++i) {
+    dirs.push_back(i->first);
+  }
+  return dirs;
+}
+
+bool ScanSummary::Unchanged(const Edge* edge) const {
+  if (edge->is_phony() || edge->dyndep_)
+    return false;
+  for (Node* const* o = edge->outputs_.begin(); o != edge->outputs_.end();
+       ++o) {
+    if (up_to_date_.find(DirOf((*o)->path())) == up_to_date_.end())
+      return false;
+  }
+  return true;
+}
+
+void ScanSummary::Skipped(const Edge* edge) {
+  if (skipped_.size() <= edge->id())
+    skipped_.resize(edge->id() + 1);
+  skipped_[edge->id()] = true;
+}
+
+void ScanSummary::Record(State* state) {
+  set<string> stale;
+  set<string> dirs;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    dirs.clear();
+    for (Node** o = edge->outputs_.begin(); o != edge->outputs_.end(); ++o)
+      dirs.insert(DirOf((*o)->path()));
+    if (!edge->outputs_ready())
+      stale.insert(dirs.begin(), dirs.end());
+
+    // What a skipped edge reads from was recorded when it was scanned.
+    bool skipped = edge->id() < skipped_.size() && skipped_[edge->id()];
+    if (edge->mark() != Edge::VisitDone || skipped)
+      continue;
+    for (set<string>::iterator d = dirs.begin(); d != dirs.end(); ++d)
+      dependents_[*d].insert(dirs.begin(), dirs.end());
+    for (Node** i = edge->inputs_.begin(); i != edge->inputs_.end(); ++i) {
+      dependents_[DirOf((*i)->path())].insert(dirs.begin(), dirs.end());
+    }
+  }
+
+  up_to_date_.clear();
+  for (map<string, uint64_t>::iterator h = hashes_.begin();
+       h != hashes_.end(); ++h) {
+    if (stale.find(h->first) == stale.end())
+      up_to_date_.insert(h->first);
+  }
+  skipped_.clear();
+}
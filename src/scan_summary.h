@@ -0,0 +1,89 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SCAN_SUMMARY_H_
+#define NINJA_SCAN_SUMMARY_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // For uint64_t.
+
+struct Edge;
+struct State;
+
+/// Remembers, per directory, whether the edges writing into it were up to
+/// date after the last build, so that a later scan can skip the whole
+/// subgraph behind such an edge instead of stat()ing and checking every
+/// node in it again.
+///
+/// The summary only knows what changed because it's told: whoever keeps it
+/// must report every directory in which files may have changed since the
+/// last Record(), as a file watcher can.  A change in a directory makes the
+/// edges reading from or writing to it, and everything built from their
+/// outputs in turn, be scanned again.  A directory can only be
+/// "up to date" if every edge with an output in it was.
+///
+/// For each directory the summary also keeps a hash of the edges with
+/// outputs in it, so that it survives loading a regenerated manifest for
+/// the parts of the graph that didn't change.  Graphs using dyndep files
+/// aren't supported.
+struct ScanSummary {
+  /// The directory of |path|: "." for a path without a slash.  This is
+  /// also the name to report changes under.
+  static string DirOf(const string& path);
+
+  /// Forget everything, as when changes may have been missed.
+  void Clear();
+
+  /// Take the graph of |state|, which may have been loaded from a
+  /// regenerated manifest, from now on.  Directories whose edges differ
+  /// from those of the previous graph count as changed.
+  void Rebind(State* state);
+
+  /// Files in |dirs| may have changed since the last Record().
+  void Invalidate(const vector<string>& dirs);
+
+  /// The directories any recorded edge reads from or writes to.  Those
+  /// that can't be watched should be passed to Invalidate().
+  vector<string> Dirs() const;
+
+  /// Whether nothing |edge| is built from changed since a build found it
+  /// up to date.
+  bool Unchanged(const Edge* edge) const;
+
+  /// The scan took the shortcut for |edge|, and didn't look at its inputs.
+  void Skipped(const Edge* edge);
+
+  /// Remember the state the graph of the last Rebind() was left in by a
+  /// build.
+  void Record(State* state);
+
+ private:
+  /// Directories all of whose edges were up to date.
+  set<string> up_to_date_;
+  /// For each directory, those of the outputs of the edges reading from or
+  /// writing to it.  Entries are only ever added, so that what an edge
+  /// that was skipped read is still known.
+  map<string, set<string> > dependents_;
+  /// The hash of the edges with an output in each directory.
+  map<string, uint64_t> hashes_;
+  /// Indexed by edge id, whether the current scan skipped the edge.
+  vector<bool> skipped_;
+};
+
+#endif  // NINJA_SCAN_SUMMARY_H_
@@ -0,0 +1,143 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "scan_summary.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+const char kManifest[] =
+"build obj/a/a.o: cat src/a.c\n"
+"build obj/b/b.o: cat src/b.c\n"
+"build lib/lib.a: cat obj/a/a.o obj/b/b.o\n"
+"build out/app: cat lib/lib.a\n";
+
+struct ScanSummaryTest : public StateTestWithBuiltinRules {
+  ScanSummaryTest() : scan_(&state_, NULL, NULL, &fs_, NULL) {
+    scan_.set_summary(&summary_);
+  }
+
+  virtual void SetUp() {
+    AssertParse(&state_, kManifest);
+    fs_.Create("src/a.c", "");
+    fs_.Create("src/b.c", "");
+    fs_.Tick();
+    fs_.Create("obj/a/a.o", "");
+    fs_.Create("obj/b/b.o", "");
+    fs_.Create("lib/lib.a", "");
+    fs_.Create("out/app", "");
+  }
+
+  /// Scan out/app from scratch, as the next build would.
+  void Scan() {
+    state_.Reset();
+    string err;
+    EXPECT_TRUE(scan_.RecomputeDirty(state_.LookupNode("out/app"), &err));
+    ASSERT_EQ("", err);
+  }
+
+  VirtualFileSystem fs_;
+  DependencyScan scan_;
+  ScanSummary summary_;
+};
+
+TEST_F(ScanSummaryTest, DirOf) {
+  EXPECT_EQ(".", ScanSummary::DirOf("foo"));
+  EXPECT_EQ("/", ScanSummary::DirOf("/foo"));
+  EXPECT_EQ("a/b", ScanSummary::DirOf("a/b/foo"));
+}
+
+TEST_F(ScanSummaryTest, SkipsUnchanged) {
+  summary_.Rebind(&state_);
+  Scan();
+  EXPECT_TRUE(state_.LookupNode("src/a.c")->status_known());
+  summary_.Record(&state_);
+
+  Scan();
+  EXPECT_FALSE(state_.LookupNode("out/app")->dirty());
+  EXPECT_TRUE(state_.LookupNode("out/app")->in_edge()->outputs_ready());
+  // Only the output of the target was looked at.
+  EXPECT_TRUE(state_.LookupNode("out/app")->status_known());
+  EXPECT_FALSE(state_.LookupNode("lib/lib.a")->status_known());
+  EXPECT_FALSE(state_.LookupNode("src/a.c")->status_known());
+
+  // What the skipped edges read is still known after another record.
+  summary_.Record(&state_);
+  summary_.Invalidate(vector<string>(1, "src"));
+  Scan();
+  EXPECT_TRUE(state_.LookupNode("src/a.c")->status_known());
+}
+
+TEST_F(ScanSummaryTest, ChangeInvalidatesDependents) {
+  summary_.Rebind(&state_);
+  Scan();
+  summary_.Record(&state_);
+
+  fs_.Tick();
+  fs_.Create("src/b.c", "");
+  summary_.Invalidate(vector<string>(1, "src"));
+  Scan();
+  EXPECT_TRUE(state_.LookupNode("obj/b/b.o")->dirty());
+  EXPECT_TRUE(state_.LookupNode("out/app")->dirty());
+  EXPECT_FALSE(state_.LookupNode("obj/a/a.o")->dirty());
+
+  // Edges that weren't up to date after the build aren't skipped next
+  // time.
+  summary_.Record(&state_);
+  Scan();
+  EXPECT_TRUE(state_.LookupNode("src/b.c")->status_known());
+}
+
+TEST_F(ScanSummaryTest, MissingOutputIsScanned) {
+  summary_.Rebind(&state_);
+  Scan();
+  summary_.Record(&state_);
+
+  fs_.RemoveFile("out/app");
+  Scan();
+  EXPECT_TRUE(state_.LookupNode("out/app")->dirty());
+}
+
+TEST_F(ScanSummaryTest, RebindComparesEdges) {
+  summary_.Rebind(&state_);
+  Scan();
+  summary_.Record(&state_);
+
+  // Only the command of obj/b/b.o differs in the regenerated manifest.
+  State state;
+  AddCatRule(&state);
+  AssertParse(&state,
+"rule cc\n"
+"  command = cc $in > $out\n"
+"build obj/a/a.o: cat src/a.c\n"
+"build obj/b/b.o: cc src/b.c\n"
+"build lib/lib.a: cat obj/a/a.o obj/b/b.o\n"
+"build out/app: cat lib/lib.a\n"
+"build other/x: cat src/a.c\n");
+  summary_.Rebind(&state);
+
+  DependencyScan scan(&state, NULL, NULL, &fs_, NULL);
+  scan.set_summary(&summary_);
+  string err;
+  EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("out/app"), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(state.LookupNode("src/b.c")->status_known());
+  EXPECT_FALSE(state.LookupNode("src/a.c")->status_known());
+  EXPECT_FALSE(state.LookupNode("obj/a/a.o")->dirty());
+}
+
+}  // anonymous namespace
@@ -0,0 +1,525 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "util.h"
+
+extern char** environ;
+
+const char kServerSocketName[] = ".ninja_server";
+
+namespace {
+
+const char kRequestMagic[] = "ninja-serve-4";
+
+/// Upper bound on the size of a message, to reject garbage early.
+const uint32_t kMaxMessageSize = 64 << 20;
+
+/// Upper bound on the file descriptors passed with a message.
+const int kMaxMessageFds = 8;
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+/// Don't let a peer that went away kill us with SIGPIPE.
+void DisableSigPipe(int fd) {
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+bool MakeSocketAddress(sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (sizeof(kServerSocketName) > sizeof(addr->sun_path))
+    return false;
+  memcpy(addr->sun_path, kServerSocketName, sizeof(kServerSocketName));
+  return true;
+}
+
+/// Connect to the server socket in the current directory.
+/// Returns the connection, or -1 if nobody listens there.
+int ConnectToServer() {
+  sockaddr_un addr;
+  if (!MakeSocketAddress(&addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  SetCloseOnExec(fd);
+  DisableSigPipe(fd);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/// The server running the client's build, to forward signals to.
+volatile pid_t g_server_pid;
+volatile sig_atomic_t g_forwarded_signal;
+
+void ForwardSignal(int signum) {
+  g_forwarded_signal = signum;
+  kill(g_server_pid, signum);
+}
+
+void AppendField(string* data, const string& field) {
+  data->append(field);
+  data->push_back('\0');
+}
+
+void AppendField(string* data, int value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%d", value);
+  AppendField(data, buf);
+}
+
+bool ParseInt(const string& field, int* value) {
+  char* end;
+  *value = strtol(field.c_str(), &end, 10);
+  return !field.empty() && *end == '\0';
+}
+
+string JoinPath(const string& dir, const char* name) {
+  if (dir == ".")
+    return name;
+  if (!dir.empty() && dir[dir.size() - 1] == '/')
+    return dir + name;
+  return dir + "/" + name;
+}
+
+}  // anonymous namespace
+
+string ServerRequest::Encode() const {
+  string data;
+  AppendField(&data, kRequestMagic);
+  AppendField(&data, input_file);
+  AppendField(&data, verbosity);
+  AppendField(&data, parallelism);
+  AppendField(&data, failures_allowed);
+  char load[32];
+  snprintf(load, sizeof(load), "%.17g", max_load_average);
+  AppendField(&data, load);
+  char pressure[32];
+  snprintf(pressure, sizeof(pressure), "%.17g", max_pressure);
+  AppendField(&data, pressure);
+  char memory[32];
+  snprintf(memory, sizeof(memory), "%lld", (long long)max_memory);
+  AppendField(&data, memory);
+  string flags;
+  flags.push_back(explaining ? '1' : '0');
+  flags.push_back(keep_depfile ? '1' : '0');
+  flags.push_back(keep_rsp ? '1' : '0');
+  flags.push_back(stat_cache ? '1' : '0');
+  flags.push_back(jobserver ? '1' : '0');
+  flags.push_back(io_thread ? '1' : '0');
+  flags.push_back(start_during_scan ? '1' : '0');
+  AppendField(&data, flags);
+  AppendField(&data, target_share);
+  AppendField(&data, prefetch_edges);
+  AppendField(&data, affinity);
+  AppendField(&data, deps_threads);
+  AppendField(&data, (int)targets.size());
+  for (vector<string>::const_iterator i = targets.begin();
+       i != targets.end(); ++i) {
+    AppendField(&data, *i);
+  }
+  for (vector<string>::const_iterator i = environment.begin();
+       i != environment.end(); ++i) {
+    AppendField(&data, *i);
+  }
+  return data;
+}
+
+bool ServerRequest::Decode(const string& data, string* err) {
+  vector<string> fields;
+  for (size_t start = 0; start < data.size(); ) {
+    size_t end = data.find('\0', start);
+    if (end == string::npos) {
+      *err = "unterminated field";
+      return false;
+    }
+    fields.push_back(data.substr(start, end - start));
+    start = end + 1;
+  }
+
+  const size_t kHeaderFields = 14;
+  if (fields.size() < kHeaderFields || fields[0] != kRequestMagic) {
+    *err = "not a build request";
+    return false;
+  }
+  input_file = fields[1];
+  char* end;
+  max_load_average = strtod(fields[5].c_str(), &end);
+  bool load_ok = !fields[5].empty() && *end == '\0';
+  max_pressure = strtod(fields[6].c_str(), &end);
+  bool pressure_ok = !fields[6].empty() && *end == '\0';
+  max_memory = strtoll(fields[7].c_str(), &end, 10);
+  bool memory_ok = !fields[7].empty() && *end == '\0';
+  int target_count;
+  if (!ParseInt(fields[2], &verbosity) || !ParseInt(fields[3], &parallelism) ||
+      !ParseInt(fields[4], &failures_allowed) || !load_ok || !pressure_ok ||
+      !memory_ok || fields[8].size() != 7 ||
+      !ParseInt(fields[9], &target_share) ||
+      !ParseInt(fields[10], &prefetch_edges) ||
+      !ParseInt(fields[11], &affinity) ||
+      !ParseInt(fields[12], &deps_threads) ||
+      !ParseInt(fields[13], &target_count) || target_count < 0 ||
+      (size_t)target_count > fields.size() - kHeaderFields) {
+    *err = "malformed build request";
+    return false;
+  }
+  explaining = fields[8][0] == '1';
+  keep_depfile = fields[8][1] == '1';
+  keep_rsp = fields[8][2] == '1';
+  stat_cache = fields[8][3] == '1';
+  jobserver = fields[8][4] == '1';
+  io_thread = fields[8][5] == '1';
+  start_during_scan = fields[8][6] == '1';
+
+  vector<string>::iterator targets_end =
+      fields.begin() + kHeaderFields + target_count;
+  targets.assign(fields.begin() + kHeaderFields, targets_end);
+  environment.assign(targets_end, fields.end());
+  return true;
+}
+
+bool SendServerMessage(int fd, const string& payload, const vector<int>& fds) {
+  uint32_t size = payload.size();
+  string data((const char*)&size, sizeof(size));
+  data.append(payload);
+
+  iovec iov;
+  iov.iov_base = (void*)data.data();
+  iov.iov_len = data.size();
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  vector<char> control;
+  if (!fds.empty()) {
+    control.resize(CMSG_SPACE(sizeof(int) * fds.size()));
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+  }
+
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t len = sendmsg(fd, &msg, kSendFlags);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    sent += len;
+    iov.iov_base = (void*)(data.data() + sent);
+    iov.iov_len = data.size() - sent;
+    // The descriptors went out with the first chunk.
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+  }
+  return true;
+}
+
+bool ReceiveServerMessage(int fd, string* payload, vector<int>* fds) {
+  uint32_t size;
+  char* header = (char*)&size;
+  size_t received = 0;
+  while (received < sizeof(size)) {
+    iovec iov;
+    iov.iov_base = header + received;
+    iov.iov_len = sizeof(size) - received;
+    char control[CMSG_SPACE(sizeof(int) * kMaxMessageFds)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(fd, &msg, 0);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; ++i) {
+        int received_fd;
+        memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof(int),
+               sizeof(received_fd));
+        SetCloseOnExec(received_fd);
+        fds->push_back(received_fd);
+      }
+    }
+    received += len;
+  }
+  if (size > kMaxMessageSize)
+    return false;
+
+  payload->resize(size);
+  received = 0;
+  while (received < size) {
+    ssize_t len = recv(fd, &(*payload)[received], size - received, 0);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    received += len;
+  }
+  return true;
+}
+
+bool RunBuildOnServer(const ServerRequest& request, int* exit_code) {
+  int fd = ConnectToServer();
+  if (fd < 0)
+    return false;
+
+  vector<int> fds;
+  fds.push_back(0);
+  fds.push_back(1);
+  fds.push_back(2);
+  string reply;
+  vector<int> unused;
+  if (!SendServerMessage(fd, request.Encode(), fds) ||
+      !ReceiveServerMessage(fd, &reply, &unused) ||
+      reply.compare(0, 8, "started ") != 0) {
+    close(fd);
+    return false;
+  }
+
+  // The server runs the build in its own process group, so an interrupt
+  // from the terminal only reaches us.  Pass it on.
+  g_server_pid = atoi(reply.c_str() + 8);
+  g_forwarded_signal = 0;
+  struct sigaction act, old_int, old_term, old_hup;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = ForwardSignal;
+  sigaction(SIGINT, &act, &old_int);
+  sigaction(SIGTERM, &act, &old_term);
+  sigaction(SIGHUP, &act, &old_hup);
+
+  if (ReceiveServerMessage(fd, &reply, &unused) &&
+      reply.compare(0, 5, "exit ") == 0) {
+    *exit_code = atoi(reply.c_str() + 5);
+  } else {
+    Error("lost connection to the build server");
+    *exit_code = g_forwarded_signal ? 2 : 1;
+  }
+
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGTERM, &old_term, NULL);
+  sigaction(SIGHUP, &old_hup, NULL);
+  close(fd);
+  return true;
+}
+
+ServerSocket::~ServerSocket() {
+  if (fd_ >= 0) {
+    close(fd_);
+    unlink(kServerSocketName);
+  }
+}
+
+bool ServerSocket::Listen(string* err) {
+  sockaddr_un addr;
+  if (!MakeSocketAddress(&addr)) {
+    *err = "socket path too long";
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fd);
+
+  int result = bind(fd, (sockaddr*)&addr, sizeof(addr));
+  if (result < 0 && errno == EADDRINUSE) {
+    // Either another server is running or one died without cleaning up.
+    int other = ConnectToServer();
+    if (other >= 0) {
+      close(other);
+      close(fd);
+      *err = "another server is already running in this directory";
+      return false;
+    }
+    unlink(kServerSocketName);
+    result = bind(fd, (sockaddr*)&addr, sizeof(addr));
+  }
+  if (result < 0 || listen(fd, 16) < 0) {
+    *err = string(kServerSocketName) + ": " + strerror(errno);
+    close(fd);
+    return false;
+  }
+
+  fd_ = fd;
+  return true;
+}
+
+int ServerSocket::Accept() {
+  for (;;) {
+    int fd = accept(fd_, NULL, NULL);
+    if (fd >= 0) {
+      SetCloseOnExec(fd);
+      DisableSigPipe(fd);
+      return fd;
+    }
+    if (errno != ECONNABORTED)
+      return -1;
+  }
+}
+
+vector<string> GetEnvironment() {
+  vector<string> env;
+  for (char** var = environ; var && *var; ++var)
+    env.push_back(*var);
+  return env;
+}
+
+void SetEnvironment(const vector<string>& env) {
+  vector<string> current = GetEnvironment();
+  for (vector<string>::iterator i = current.begin(); i != current.end(); ++i)
+    unsetenv(i->substr(0, i->find('=')).c_str());
+  for (vector<string>::const_iterator i = env.begin(); i != env.end(); ++i) {
+    size_t eq = i->find('=');
+    if (eq == string::npos || eq == 0)
+      continue;
+    setenv(i->substr(0, eq).c_str(), i->c_str() + eq + 1, 1);
+  }
+}
+
+ChangeWatcher::ChangeWatcher() : fd_(-1) {
+#ifdef __linux__
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+ChangeWatcher::~ChangeWatcher() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool ChangeWatcher::IsWatching(const string& dir) const {
+  map<string, int>::const_iterator i = dirs_.find(dir);
+  return i != dirs_.end() && i->second >= 0;
+}
+
+bool ChangeWatcher::Watch(const string& dir) {
+  map<string, int>::iterator i = dirs_.find(dir);
+  if (i != dirs_.end())
+    return i->second >= 0;
+
+  int wd = -1;
+#ifdef __linux__
+  if (fd_ >= 0) {
+    wd = inotify_add_watch(fd_, dir.c_str(),
+                           IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                           IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF |
+                           IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+  }
+#endif
+  dirs_[dir] = wd;
+  if (wd < 0)
+    return false;
+  // Two spellings of one directory share a watch descriptor.
+  vector<string>& paths = paths_[wd];
+  if (find(paths.begin(), paths.end(), dir) == paths.end())
+    paths.push_back(dir);
+  return true;
+}
+
+bool ChangeWatcher::ReadChanges(vector<string>* paths) {
+  for (map<string, int>::iterator i = dirs_.begin(); i != dirs_.end(); ) {
+    if (i->second < 0)
+      dirs_.erase(i++);
+    else
+      ++i;
+  }
+  if (fd_ < 0)
+    return false;
+
+#ifdef __linux__
+  bool complete = true;
+  char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+  for (;;) {
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        complete = false;
+      break;
+    }
+    for (char* p = buf; p < buf + len; ) {
+      const inotify_event* event = (const inotify_event*)p;
+      p += sizeof(inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        complete = false;
+        continue;
+      }
+      map<int, vector<string> >::iterator watch = paths_.find(event->wd);
+      if (watch == paths_.end())
+        continue;
+      for (vector<string>::iterator dir = watch->second.begin();
+           dir != watch->second.end(); ++dir) {
+        paths->push_back(*dir);
+        if (event->len)
+          paths->push_back(JoinPath(*dir, event->name));
+      }
+      if (event->mask & IN_IGNORED) {
+        // The directory went away; Watch() it again once it's back.
+        for (vector<string>::iterator dir = watch->second.begin();
+             dir != watch->second.end(); ++dir) {
+          dirs_.erase(*dir);
+        }
+        paths_.erase(watch);
+      }
+    }
+  }
+  return complete;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,143 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SERVER_H_
+#define NINJA_SERVER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // int64_t
+
+/// Pieces of "ninja -t serve": a long-lived process that keeps the loaded
+/// manifest and logs in memory, and runs builds for "ninja" invocations in
+/// the same directory.  POSIX only.
+
+/// Name of the socket, relative to the directory ninja runs in, on which
+/// a server accepts builds.
+extern const char kServerSocketName[];
+
+/// What a client asks the server to build, and the parts of the client's
+/// command line and environment the build depends on.
+struct ServerRequest {
+  ServerRequest() : verbosity(0), parallelism(1), failures_allowed(1),
+                    max_load_average(-0.0f), max_pressure(-0.0),
+                    max_memory(0), jobserver(false), explaining(false),
+                    keep_depfile(false), keep_rsp(false), stat_cache(true),
+                    target_share(0), prefetch_edges(0), affinity(0),
+                    deps_threads(0), io_thread(false),
+                    start_during_scan(false) {}
+
+  /// Encode the request for sending over the socket.
+  string Encode() const;
+
+  /// Decode the output of Encode().  Returns false on malformed |data|.
+  bool Decode(const string& data, string* err);
+
+  string input_file;
+  int verbosity;
+  int parallelism;
+  int failures_allowed;
+  double max_load_average;
+  double max_pressure;
+  int64_t max_memory;
+  bool jobserver;
+  bool explaining;
+  bool keep_depfile;
+  bool keep_rsp;
+  bool stat_cache;
+  /// A BuildConfig::TargetShare.
+  int target_share;
+  int prefetch_edges;
+  /// A BuildConfig::Affinity.
+  int affinity;
+  int deps_threads;
+  bool io_thread;
+  bool start_during_scan;
+  vector<string> targets;
+  /// The client's environment as "NAME=value" strings.
+  vector<string> environment;
+};
+
+/// Send |payload| as one message over the stream socket |fd|, passing the
+/// file descriptors in |fds| along with it.  Returns false on error.
+bool SendServerMessage(int fd, const string& payload, const vector<int>& fds);
+
+/// Receive a message sent by SendServerMessage(), appending any file
+/// descriptors that came with it to |fds|.  Returns false on error or if
+/// the peer closed the connection.
+bool ReceiveServerMessage(int fd, string* payload, vector<int>* fds);
+
+/// Ask a server listening in the current directory to run |request|, with
+/// its output going to our stdout and stderr.  Returns false if there is no
+/// server or it refused the request, in which case the caller should build
+/// by itself; otherwise fills in |exit_code|.
+bool RunBuildOnServer(const ServerRequest& request, int* exit_code);
+
+/// The listening end of kServerSocketName.
+struct ServerSocket {
+  ServerSocket() : fd_(-1) {}
+  ~ServerSocket();
+
+  /// Start listening.  Fails if another server already listens here.
+  bool Listen(string* err);
+
+  /// Wait for the next client.  Returns its connection, or -1 on error,
+  /// including EINTR.
+  int Accept();
+
+ private:
+  int fd_;
+};
+
+/// The process environment as "NAME=value" strings.
+vector<string> GetEnvironment();
+
+/// Replace the process environment with |env|.
+void SetEnvironment(const vector<string>& env);
+
+/// Tracks which files change in a set of directories, so that a long-lived
+/// process only needs to re-stat those between builds.  Backed by inotify
+/// on Linux; elsewhere no directory can be watched and callers have to
+/// re-stat everything.
+struct ChangeWatcher {
+  ChangeWatcher();
+  ~ChangeWatcher();
+
+  /// Whether changes to files directly in |dir| are being reported.
+  bool IsWatching(const string& dir) const;
+
+  /// Start watching |dir|.  Returns false if that isn't possible, e.g.
+  /// because it doesn't exist; the attempt isn't repeated until the next
+  /// ReadChanges().
+  bool Watch(const string& dir);
+
+  /// Append the paths that changed since the last call to |paths|.  A
+  /// change in a watched directory reports both the entry and the
+  /// directory.  Returns false if changes were lost, in which case any
+  /// file may have changed.
+  bool ReadChanges(vector<string>* paths);
+
+ private:
+  int fd_;
+  /// Watched directories and their watch descriptors.  Directories that
+  /// couldn't be watched during the current round map to -1.
+  map<string, int> dirs_;
+  /// The directories behind each watch descriptor.
+  map<int, vector<string> > paths_;
+};
+
+#endif  // NINJA_SERVER_H_
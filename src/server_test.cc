@@ -0,0 +1,229 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "test.h"
+
+namespace {
+
+bool Contains(const vector<string>& paths, const string& path) {
+  return find(paths.begin(), paths.end(), path) != paths.end();
+}
+
+void Touch(const string& path) {
+  FILE* f = fopen(path.c_str(), "w");
+  ASSERT_TRUE(f != NULL);
+  fputs("x", f);
+  fclose(f);
+}
+
+struct ChangeWatcherTest : public testing::Test {
+  virtual void SetUp() {
+    // These tests do real disk accesses, so create a temp dir.
+    temp_dir_.CreateAndEnter("Ninja-ChangeWatcherTest");
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+}  // anonymous namespace
+
+TEST(ServerRequest, RoundTrip) {
+  ServerRequest request;
+  request.input_file = "sub/build.ninja";
+  request.verbosity = 2;
+  request.parallelism = 12;
+  request.failures_allowed = 3;
+  request.max_load_average = 2.5;
+  request.max_pressure = 12.5;
+  request.max_memory = 64LL << 20;
+  request.keep_rsp = true;
+  request.stat_cache = false;
+  request.jobserver = true;
+  request.target_share = 2;
+  request.prefetch_edges = 16;
+  request.affinity = 1;
+  request.deps_threads = 3;
+  request.io_thread = true;
+  request.start_during_scan = true;
+  request.targets.push_back("out with space");
+  request.targets.push_back("foo.o^");
+  request.environment.push_back("PATH=/bin:/usr/bin");
+  request.environment.push_back("EMPTY=");
+
+  ServerRequest decoded;
+  string err;
+  EXPECT_TRUE(decoded.Decode(request.Encode(), &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ("sub/build.ninja", decoded.input_file);
+  EXPECT_EQ(2, decoded.verbosity);
+  EXPECT_EQ(12, decoded.parallelism);
+  EXPECT_EQ(3, decoded.failures_allowed);
+  EXPECT_EQ(2.5, decoded.max_load_average);
+  EXPECT_EQ(12.5, decoded.max_pressure);
+  EXPECT_EQ(64LL << 20, decoded.max_memory);
+  EXPECT_FALSE(decoded.explaining);
+  EXPECT_FALSE(decoded.keep_depfile);
+  EXPECT_TRUE(decoded.keep_rsp);
+  EXPECT_FALSE(decoded.stat_cache);
+  EXPECT_TRUE(decoded.jobserver);
+  EXPECT_EQ(2, decoded.target_share);
+  EXPECT_EQ(16, decoded.prefetch_edges);
+  EXPECT_EQ(1, decoded.affinity);
+  EXPECT_EQ(3, decoded.deps_threads);
+  EXPECT_TRUE(decoded.io_thread);
+  EXPECT_TRUE(decoded.start_during_scan);
+  ASSERT_EQ(2u, decoded.targets.size());
+  EXPECT_EQ("out with space", decoded.targets[0]);
+  EXPECT_EQ("foo.o^", decoded.targets[1]);
+  ASSERT_EQ(2u, decoded.environment.size());
+  EXPECT_EQ("EMPTY=", decoded.environment[1]);
+}
+
+TEST(ServerRequest, DecodeErrors) {
+  ServerRequest request;
+  string err;
+  EXPECT_FALSE(request.Decode("", &err));
+  EXPECT_FALSE(request.Decode(string("something else\0", 15), &err));
+
+  string data = ServerRequest().Encode();
+  EXPECT_FALSE(request.Decode(data.substr(0, data.size() - 1), &err));
+  EXPECT_EQ("unterminated field", err);
+}
+
+TEST(ServerMessage, PassesDescriptors) {
+  int sockets[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  int pipe_fds[2];
+  ASSERT_EQ(0, pipe(pipe_fds));
+
+  vector<int> fds;
+  fds.push_back(pipe_fds[1]);
+  string payload(100000, 'x');
+  payload[0] = '\0';
+  // The payload doesn't fit into the socket buffer in one go.
+  pid_t sender = fork();
+  ASSERT_NE(-1, sender);
+  if (sender == 0)
+    _exit(SendServerMessage(sockets[0], payload, fds) ? 0 : 1);
+  close(pipe_fds[1]);
+
+  string received;
+  vector<int> received_fds;
+  ASSERT_TRUE(ReceiveServerMessage(sockets[1], &received, &received_fds));
+  EXPECT_TRUE(received == payload);
+  ASSERT_EQ(1u, received_fds.size());
+
+  ASSERT_EQ(1, write(received_fds[0], "!", 1));
+  char c = 0;
+  ASSERT_EQ(1, read(pipe_fds[0], &c, 1));
+  EXPECT_EQ('!', c);
+
+  int status;
+  ASSERT_EQ(sender, waitpid(sender, &status, 0));
+  EXPECT_EQ(0, status);
+
+  close(received_fds[0]);
+  close(pipe_fds[0]);
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+TEST(ServerMessage, PeerClosed) {
+  int sockets[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  close(sockets[0]);
+  string received;
+  vector<int> fds;
+  EXPECT_FALSE(ReceiveServerMessage(sockets[1], &received, &fds));
+  close(sockets[1]);
+}
+
+TEST(ServerEnvironment, SetEnvironment) {
+  vector<string> saved = GetEnvironment();
+  vector<string> env;
+  env.push_back("NINJA_SERVER_TEST=a=b");
+  SetEnvironment(env);
+  vector<string> current = GetEnvironment();
+  EXPECT_EQ(1u, current.size());
+  EXPECT_EQ(string("a=b"), getenv("NINJA_SERVER_TEST"));
+  SetEnvironment(saved);
+  EXPECT_EQ(NULL, getenv("NINJA_SERVER_TEST"));
+  EXPECT_EQ(saved.size(), GetEnvironment().size());
+}
+
+#ifdef __linux__
+TEST_F(ChangeWatcherTest, ReportsChanges) {
+  ASSERT_EQ(0, mkdir("sub", 0777));
+  Touch("top");
+  Touch("sub/old");
+
+  ChangeWatcher watcher;
+  vector<string> changed;
+  EXPECT_FALSE(watcher.IsWatching("."));
+  EXPECT_TRUE(watcher.Watch("."));
+  EXPECT_TRUE(watcher.Watch("sub"));
+  EXPECT_TRUE(watcher.IsWatching("sub"));
+  EXPECT_TRUE(watcher.ReadChanges(&changed));
+  EXPECT_TRUE(changed.empty());
+
+  Touch("top");
+  Touch("sub/new");
+  unlink("sub/old");
+  EXPECT_TRUE(watcher.ReadChanges(&changed));
+  EXPECT_TRUE(Contains(changed, "top"));
+  EXPECT_TRUE(Contains(changed, "."));
+  EXPECT_TRUE(Contains(changed, "sub/new"));
+  EXPECT_TRUE(Contains(changed, "sub/old"));
+  EXPECT_TRUE(Contains(changed, "sub"));
+
+  changed.clear();
+  EXPECT_TRUE(watcher.ReadChanges(&changed));
+  EXPECT_TRUE(changed.empty());
+}
+
+TEST_F(ChangeWatcherTest, RemovedDirectory) {
+  ASSERT_EQ(0, mkdir("sub", 0777));
+  ChangeWatcher watcher;
+  EXPECT_FALSE(watcher.Watch("missing"));
+  EXPECT_FALSE(watcher.IsWatching("missing"));
+  EXPECT_TRUE(watcher.Watch("sub"));
+
+  ASSERT_EQ(0, rmdir("sub"));
+  vector<string> changed;
+  EXPECT_TRUE(watcher.ReadChanges(&changed));
+  EXPECT_TRUE(Contains(changed, "sub"));
+  EXPECT_FALSE(watcher.IsWatching("sub"));
+
+  // Both can be watched once they exist.
+  ASSERT_EQ(0, mkdir("sub", 0777));
+  ASSERT_EQ(0, mkdir("missing", 0777));
+  EXPECT_TRUE(watcher.Watch("sub"));
+  EXPECT_TRUE(watcher.Watch("missing"));
+}
+#endif  // __linux__
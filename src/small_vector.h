@@ -0,0 +1,186 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SMALL_VECTOR_H_
+#define NINJA_SMALL_VECTOR_H_
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+/// A vector that keeps its first N elements inline and only goes to the
+/// heap when it grows past them.  Most edges have a few inputs and one
+/// output, and most nodes a couple of out-edges, so this saves an
+/// allocation per container and keeps them next to their owner.
+///
+/// Elements are moved with memcpy, so T must be trivially copyable; it is
+/// meant for pointers.  The subset of std::vector provided is what the
+/// graph uses.
+template <typename T, unsigned N>
+class SmallVector {
+ public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+  typedef size_t size_type;
+
+  SmallVector() : data_(inline_), size_(0), capacity_(N) {}
+  SmallVector(const SmallVector& other)
+      : data_(inline_), size_(0), capacity_(N) {
+    assign(other.begin(), other.end());
+  }
+  ~SmallVector() {
+    if (data_ != inline_)
+      free(data_);
+  }
+
+  SmallVector& operator=(const SmallVector& other) {
+    if (this != &other)
+      assign(other.begin(), other.end());
+    return *this;
+  }
+
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  iterator begin() { return data_; }
+  iterator end() { return data_ + size_; }
+  const_iterator begin() const { return data_; }
+  const_iterator end() const { return data_ + size_; }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+
+  T& operator[](size_t i) { assert(i < size_); return data_[i]; }
+  const T& operator[](size_t i) const { assert(i < size_); return data_[i]; }
+  T& front() { return (*this)[0]; }
+  const T& front() const { return (*this)[0]; }
+  T& back() { return (*this)[size_ - 1]; }
+  const T& back() const { return (*this)[size_ - 1]; }
+
+  void push_back(const T& value) {
+    if (size_ == capacity_) {
+      T copy = value;  // |value| may point into the storage we're growing.
+      Grow(size_ + 1);
+      data_[size_++] = copy;
+      return;
+    }
+    data_[size_++] = value;
+  }
+  void pop_back() { assert(size_ > 0); --size_; }
+
+  /// Make room for at least |n| elements with a single allocation.
+  void reserve(size_t n) {
+    if (n > capacity_)
+      Grow(n);
+  }
+
+  void resize(size_t n, const T& value = T()) {
+    reserve(n);
+    for (size_t i = size_; i < n; ++i)
+      data_[i] = value;
+    size_ = n;
+  }
+  void clear() { size_ = 0; }
+
+  /// Insert |count| copies of |value| before |pos|, growing at most once.
+  iterator insert(iterator pos, size_t count, const T& value) {
+    T copy = value;  // As in push_back().
+    iterator p = MakeGap(pos, count);
+    for (size_t i = 0; i < count; ++i)
+      p[i] = copy;
+    return p;
+  }
+  iterator insert(iterator pos, const T& value) {
+    return insert(pos, 1, value);
+  }
+  /// Insert [first, last) before |pos|; the range must not alias this.
+  template <typename It>
+  iterator insert(iterator pos, It first, It last) {
+    iterator p = MakeGap(pos, std::distance(first, last));
+    std::copy(first, last, p);
+    return p;
+  }
+
+  template <typename It>
+  void assign(It first, It last) {
+    clear();
+    insert(end(), first, last);
+  }
+
+  iterator erase(iterator pos) { return erase(pos, pos + 1); }
+  iterator erase(iterator first, iterator last) {
+    assert(begin() <= first && first <= last && last <= end());
+    memmove(first, last, (end() - last) * sizeof(T));
+    size_ -= last - first;
+    return first;
+  }
+
+  void swap(SmallVector& other) {
+    SmallVector tmp(other);
+    other = *this;
+    *this = tmp;
+  }
+
+ private:
+  /// Open up |count| uninitialized slots before |pos|.
+  iterator MakeGap(iterator pos, size_t count) {
+    assert(begin() <= pos && pos <= end());
+    size_t index = pos - data_;
+    reserve(size_ + count);
+    memmove(data_ + index + count, data_ + index,
+            (size_ - index) * sizeof(T));
+    size_ += count;
+    return data_ + index;
+  }
+
+  void Grow(size_t min_capacity) {
+    size_t capacity = capacity_ * 2;
+    if (capacity < min_capacity)
+      capacity = min_capacity;
+    T* data = static_cast<T*>(malloc(capacity * sizeof(T)));
+    if (!data)
+      abort();
+    memcpy(data, data_, size_ * sizeof(T));
+    if (data_ != inline_)
+      free(data_);
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  T* data_;
+  unsigned size_;
+  unsigned capacity_;
+  T inline_[N];
+};
+
+template <typename T, unsigned N>
+bool operator==(const SmallVector<T, N>& a, const SmallVector<T, N>& b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+#endif  // NINJA_SMALL_VECTOR_H_
@@ -0,0 +1,103 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "small_vector.h"
+
+#include <vector>
+
+#include "test.h"
+
+namespace {
+
+typedef SmallVector<int, 2> Vec;
+
+vector<int> Contents(const Vec& v) {
+  return vector<int>(v.begin(), v.end());
+}
+
+TEST(SmallVector, PushBackPastInline) {
+  Vec v;
+  EXPECT_TRUE(v.empty());
+  EXPECT_EQ(2u, v.capacity());
+  for (int i = 0; i < 10; ++i)
+    v.push_back(i);
+  ASSERT_EQ(10u, v.size());
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(i, v[i]);
+  EXPECT_EQ(0, v.front());
+  EXPECT_EQ(9, v.back());
+
+  // Pushing an element of the vector itself while it grows.
+  Vec w;
+  w.push_back(7);
+  w.push_back(8);
+  w.push_back(w[0]);
+  EXPECT_EQ(7, w[2]);
+}
+
+TEST(SmallVector, InsertGrowsOnce) {
+  Vec v;
+  v.push_back(1);
+  v.push_back(9);
+  // The gap opens before the tail, as deps are loaded before order-only
+  // inputs.
+  int* p = v.insert(v.end() - 1, (size_t)3, 0);
+  EXPECT_EQ(5u, v.capacity());
+  EXPECT_EQ(v.begin() + 1, p);
+  p[0] = 2;
+  p[1] = 3;
+  p[2] = 4;
+  int want[] = { 1, 2, 3, 4, 9 };
+  EXPECT_EQ(vector<int>(want, want + 5), Contents(v));
+
+  vector<int> more(2, 5);
+  v.insert(v.begin(), more.begin(), more.end());
+  EXPECT_EQ(7u, v.size());
+  EXPECT_EQ(5, v[0]);
+  EXPECT_EQ(1, v[2]);
+}
+
+TEST(SmallVector, Erase) {
+  Vec v;
+  for (int i = 0; i < 6; ++i)
+    v.push_back(i);
+  EXPECT_EQ(v.begin() + 1, v.erase(v.begin() + 1, v.begin() + 3));
+  int want[] = { 0, 3, 4, 5 };
+  EXPECT_EQ(vector<int>(want, want + 4), Contents(v));
+  v.erase(v.end() - 1);
+  EXPECT_EQ(3u, v.size());
+  EXPECT_EQ(4, v.back());
+  v.clear();
+  EXPECT_TRUE(v.empty());
+}
+
+TEST(SmallVector, Copy) {
+  Vec v;
+  for (int i = 0; i < 4; ++i)
+    v.push_back(i);
+  Vec copy(v);
+  EXPECT_TRUE(copy == v);
+  copy[0] = 10;
+  EXPECT_EQ(0, v[0]);
+
+  Vec small;
+  small.push_back(1);
+  small = v;
+  EXPECT_EQ(Contents(v), Contents(small));
+  v = Vec();
+  EXPECT_TRUE(v.empty());
+  EXPECT_EQ(4u, small.size());
+}
+
+}  // anonymous namespace
@@ -14,9 +14,13 @@
 
 #include "state.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stdio.h>
 
+#include <new>
+#include <set>
+
 #include "edit_distance.h"
 #include "graph.h"
 #include "metrics.h"
@@ -24,40 +28,47 @@
 
 
 void Pool::EdgeScheduled(const Edge& edge) {
-  if (depth_ != 0)
+  if (ShouldDelayEdge()) {
     current_use_ += edge.weight();
+    current_memory_ += edge.memory();
+  }
 }
 
 void Pool::EdgeFinished(const Edge& edge) {
-  if (depth_ != 0)
+  if (ShouldDelayEdge()) {
     current_use_ -= edge.weight();
+    current_memory_ -= edge.memory();
+  }
 }
 
 void Pool::DelayEdge(Edge* edge) {
-  assert(depth_ != 0);
-  delayed_.insert(edge);
+  assert(ShouldDelayEdge());
+  delayed_.push(edge);
 }
 
-void Pool::RetrieveReadyEdges(set<Edge*>* ready_queue) {
-  DelayedEdges::iterator it = delayed_.begin();
-  while (it != delayed_.end()) {
-    Edge* edge = *it;
-    if (current_use_ + edge->weight() > depth_)
+void Pool::RetrieveReadyEdges(EdgePriorityQueue* ready_queue) {
+  while (!delayed_.empty()) {
+    Edge* edge = delayed_.top();
+    if (depth_ != 0 && current_use_ + edge->weight() > depth_)
       break;
-    ready_queue->insert(edge);
+    // An edge estimated to need more than the whole budget runs alone.
+    if (memory_ != 0 && current_memory_ > 0 &&
+        current_memory_ + edge->memory() > memory_)
+      break;
+    ready_queue->push(edge);
     EdgeScheduled(*edge);
-    ++it;
+    delayed_.pop();
   }
-  delayed_.erase(delayed_.begin(), it);
 }
 
 void Pool::Dump() const {
-  printf("%s (%d/%d) ->\n", name_.c_str(), current_use_, depth_);
-  for (DelayedEdges::const_iterator it = delayed_.begin();
-       it != delayed_.end(); ++it)
-  {
+  printf("%s (%d/%d", name_.c_str(), current_use_, depth_);
+  if (memory_ != 0)
+    printf(", %" PRId64 "/%" PRId64 "K", current_memory_, memory_);
+  printf(") ->\n");
+  for (DelayedEdges delayed = delayed_; !delayed.empty(); delayed.pop()) {
     printf("\t");
-    (*it)->Dump();
+    delayed.top()->Dump();
   }
 }
 
@@ -66,19 +77,52 @@ bool Pool::WeightedEdgeCmp(const Edge* a, const Edge* b) {
   if (!a) return b;
   if (!b) return false;
   int weight_diff = a->weight() - b->weight();
-  return ((weight_diff < 0) || (weight_diff == 0 && a < b));
+  if (weight_diff != 0)
+    return weight_diff < 0;
+  // Among equally weighted edges, release the ones on the longest
+  // critical path first.
+  return EdgePriorityLess()(b, a);
 }
 
 Pool State::kDefaultPool("", 0);
-Pool State::kConsolePool("console", 1);
+Pool State::kConsolePool("console", 1, 0, true);
 const Rule State::kPhonyRule("phony");
 
-State::State() {
+State::State()
+    : graph_slot_(AcquireGraphSlot()), spellcheck_indexed_(0),
+      spellchecked_(false) {
   bindings_.AddRule(&kPhonyRule);
   AddPool(&kDefaultPool);
   AddPool(&kConsolePool);
 }
 
+State::~State() {
+  // The arenas destroy the nodes and edges; drop the pointers to them
+  // first.
+  paths_.clear();
+  edges_.clear();
+  defaults_.clear();
+  ReleaseGraphSlot(graph_slot_);
+}
+
+void State::Clear() {
+  paths_.clear();
+  edges_.clear();
+  defaults_.clear();
+  node_arena_.Clear();
+  node_cold_arena_.Clear();
+  edge_arena_.Clear();
+  edge_env_arena_.Clear();
+  pools_.clear();
+  AddPool(&kDefaultPool);
+  AddPool(&kConsolePool);
+  bindings_ = BindingEnv();
+  bindings_.AddRule(&kPhonyRule);
+  spellcheck_index_.clear();
+  spellcheck_indexed_ = 0;
+  spellchecked_ = false;
+}
+
 void State::AddPool(Pool* pool) {
   assert(LookupPool(pool->name()) == NULL);
   pools_[pool->name()] = pool;
@@ -92,20 +136,27 @@ Pool* State::LookupPool(const string& pool_name) {
 }
 
 Edge* State::AddEdge(const Rule* rule) {
-  Edge* edge = new Edge();
+  Edge* edge = new (edge_arena_.Allocate()) Edge(graph_slot_);
   edge->rule_ = rule;
   edge->pool_ = &State::kDefaultPool;
   edge->env_ = &bindings_;
+  edge->id_ = edges_.size();
   edges_.push_back(edge);
   return edge;
 }
 
 Node* State::GetNode(StringPiece path, uint64_t slash_bits) {
-  Node* node = LookupNode(path);
-  if (node)
-    return node;
-  node = new Node(path.AsString(), slash_bits);
-  paths_[node->path()] = node;
+  METRIC_RECORD("lookup node");
+  // The path is hashed once, for the lookup and the insertion both.
+  unsigned int hash = Paths::Hash(path);
+  Paths::const_iterator i = paths_.find(path, hash);
+  if (i != paths_.end())
+    return i->second;
+  METRIC_COUNT("nodes created", 1);
+  NodeCold* cold = new (node_cold_arena_.Allocate())
+      NodeCold(path.AsString(), slash_bits);
+  Node* node = new (node_arena_.Allocate()) Node(cold, graph_slot_);
+  paths_.insert(Paths::value_type(node->path(), node), hash);
   return node;
 }
 
@@ -117,23 +168,154 @@ Node* State::LookupNode(StringPiece path) const {
   return NULL;
 }
 
+namespace {
+
+bool PathLess(const Node* a, const Node* b) {
+  return a->path() < b->path();
+}
+
+/// Orders nodes by the first few characters of their paths.
+struct PrefixLess {
+  explicit PrefixLess(size_t len) : len_(len) {}
+  bool operator()(const Node* a, const Node* b) const {
+    return a->path().compare(0, len_, b->path(), 0, len_) < 0;
+  }
+  size_t len_;
+};
+
+/// Find the path in |bucket| that is closest to |query| and fewer than
+/// |*min_distance| edits away from it, and lower |*min_distance| to its
+/// distance.  The paths in |bucket| all have one length and are sorted, so
+/// it is walked as a trie: the rows of the edit distance table for a
+/// prefix are computed once for all the paths that share it, and once a
+/// row is out of reach, all of those paths are skipped.  Like
+/// EditDistance() with a limit, only the band of each row within the
+/// limit of the diagonal is computed.
+Node* SpellcheckBucket(const vector<Node*>& bucket, StringPiece query,
+                       int* min_distance) {
+  if (bucket.empty())
+    return NULL;
+  const int len = bucket[0]->path().size();
+  const int n = query.len_;
+
+  // table[d * (n + 1) + x] is the distance between the first d characters
+  // of the current path and the first x of |query|, capped at kFar.
+  // Entries outside the band are never written, and stay at kFar.  The
+  // band stays as wide as it starts even as closer paths are found, so
+  // that every row a path reuses was computed the same way.
+  const int kFar = *min_distance;
+  const int kBand = kFar - 1;
+  vector<int> table((len + 1) * (n + 1), kFar);
+  for (int x = 0; x <= n && x < kFar; ++x)
+    table[x] = x;
+  for (int d = 0; d <= len && d < kFar; ++d)
+    table[d * (n + 1)] = d;
+
+  Node* result = NULL;
+  const string* prev = NULL;
+  int valid = 0;  // How many rows past the first hold prev's prefix.
+  for (size_t i = 0; i < bucket.size();) {
+    const string& path = bucket[i]->path();
+    int d = 0;
+    if (prev) {
+      while (d < valid && path[d] == (*prev)[d])
+        ++d;
+    }
+
+    // Paths closer than the best so far are of interest.
+    int bound = *min_distance - 1;
+    for (++d; d <= len; ++d) {
+      int* row = &table[d * (n + 1)];
+      const int* up = row - (n + 1);
+      int best = d < kFar ? d : kFar;
+      int last = min(n, d + kBand);
+      for (int x = max(1, d - kBand); x <= last; ++x) {
+        int cost = min(up[x - 1] + (path[d - 1] == query.str_[x - 1] ? 0 : 1),
+                       min(row[x - 1], up[x]) + 1);
+        row[x] = min(cost, kFar);
+        best = min(best, row[x]);
+      }
+      if (best > bound)
+        break;
+    }
+
+    prev = &path;
+    if (d <= len) {
+      // Row d is out of reach, and so are all the paths sharing its prefix.
+      valid = d;
+      i = upper_bound(bucket.begin() + i + 1, bucket.end(), bucket[i],
+                      PrefixLess(d)) - bucket.begin();
+      continue;
+    }
+    valid = len;
+    int distance = table[len * (n + 1) + n];
+    if (distance < *min_distance) {
+      *min_distance = distance;
+      result = bucket[i];
+    }
+    ++i;
+  }
+  return result;
+}
+
+}  // anonymous namespace
+
 Node* State::SpellcheckNode(const string& path) {
   const bool kAllowReplacements = true;
   const int kMaxValidEditDistance = 3;
 
   int min_distance = kMaxValidEditDistance + 1;
   Node* result = NULL;
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
-    int distance = EditDistance(
-        i->first, path, kAllowReplacements, kMaxValidEditDistance);
-    if (distance < min_distance && i->second) {
-      min_distance = distance;
-      result = i->second;
+  if (!spellchecked_) {
+    // Measuring every path once is cheaper than indexing them, so a State
+    // that is only asked once, as for a mistyped target on the command
+    // line, never pays for the index.
+    spellchecked_ = true;
+    for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
+      int distance = EditDistance(
+          i->first, path, kAllowReplacements, kMaxValidEditDistance);
+      if (distance < min_distance && i->second) {
+        min_distance = distance;
+        result = i->second;
+      }
+    }
+    return result;
+  }
+
+  if (spellcheck_indexed_ != paths_.size())
+    BuildSpellcheckIndex();
+  // Paths whose lengths differ by more than the limit are out of reach.
+  size_t first = path.size() > (size_t)kMaxValidEditDistance ?
+      path.size() - kMaxValidEditDistance : 0;
+  for (size_t len = first;
+       len <= path.size() + kMaxValidEditDistance &&
+       len < spellcheck_index_.size(); ++len) {
+    if (Node* node =
+            SpellcheckBucket(spellcheck_index_[len], path, &min_distance)) {
+      result = node;
     }
   }
   return result;
 }
 
+void State::BuildSpellcheckIndex() {
+  METRIC_RECORD("spellcheck index");
+  spellcheck_index_.clear();
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
+    if (!i->second)
+      continue;
+    size_t len = i->first.len_;
+    if (len >= spellcheck_index_.size())
+      spellcheck_index_.resize(len + 1);
+    spellcheck_index_[len].push_back(i->second);
+  }
+  for (size_t len = 0; len < spellcheck_index_.size(); ++len) {
+    sort(spellcheck_index_[len].begin(), spellcheck_index_[len].end(),
+         PathLess);
+  }
+  spellcheck_indexed_ = paths_.size();
+}
+
 void State::AddIn(Edge* edge, StringPiece path, uint64_t slash_bits) {
   Node* node = GetNode(path, slash_bits);
   edge->inputs_.push_back(node);
@@ -164,7 +346,7 @@ vector<Node*> State::RootNodes(string* err) const {
   // Search for nodes with no output.
   for (vector<Edge*>::const_iterator e = edges_.begin();
        e != edges_.end(); ++e) {
-    for (vector<Node*>::const_iterator out = (*e)->outputs_.begin();
+    for (Node* const* out = (*e)->outputs_.begin();
          out != (*e)->outputs_.end(); ++out) {
       if ((*out)->out_edges().empty())
         root_nodes.push_back(*out);
@@ -182,13 +364,150 @@ vector<Node*> State::DefaultNodes(string* err) const {
 }
 
 void State::Reset() {
+  // What nodes and edges were told in the last generation now reads as
+  // reset.  Once the counter wraps around, that generation's leftovers
+  // would read as current again, so those are reset the long way.
+  if (++g_graph_generations[graph_slot_] != 0)
+    return;
   for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
     i->second->ResetState();
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
+    (*e)->ResetState();
+}
+
+void State::ClearLoadedDeps(const vector<Edge*>& edges) {
+  vector<bool> cleared(edges_.size(), false);
+  vector<Node*> nodes;
+  for (vector<Edge*>::const_iterator e = edges.begin(); e != edges.end(); ++e) {
+    Edge* edge = *e;
+    edge->set_deps_loaded(false);
+    if (edge->loaded_deps_ == 0)
+      continue;
+    cleared[edge->id()] = true;
+    Node** end = edge->inputs_.end() - edge->order_only_deps_;
+    Node** begin = end - edge->loaded_deps_;
+    nodes.insert(nodes.end(), begin, end);
+    edge->inputs_.erase(begin, end);
+    edge->implicit_deps_ -= edge->loaded_deps_;
+    edge->loaded_deps_ = 0;
+  }
+
+  // A failed depfile load can leave unfilled slots behind.
+  nodes.erase(remove(nodes.begin(), nodes.end(), (Node*)NULL), nodes.end());
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+    (*n)->PruneOutEdges(cleared);
+}
+
+size_t State::CompactScopes() {
+  METRIC_RECORD("compact scopes");
+
+  // A scope below the top-level one, with the scopes below it, binds
+  // variables for just the edges declared in them, so they can be freed
+  // together.  Edges whose scope doesn't lead up to the top-level one have
+  // been compacted already.
+  map<BindingEnv*, vector<Edge*> > trees;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    BindingEnv* top = (*e)->env_;
+    while (top->parent_ && top->parent_ != &bindings_)
+      top = top->parent_;
+    if (top->parent_)
+      trees[top].push_back(*e);
+  }
+
+  size_t compacted = 0;
+  vector<bool> done(edges_.size(), false);
+  vector<const Rule*> rules;
+  for (map<BindingEnv*, vector<Edge*> >::iterator t = trees.begin();
+       t != trees.end(); ++t) {
+    const vector<Edge*>& edges = t->second;
+    vector<BindingEnv::Bindings> values(edges.size());
+    set<BindingEnv*> envs;
+    size_t cost = 0;
+    bool keep = false;
+    for (size_t i = 0; i < edges.size(); ++i) {
+      Edge* edge = edges[i];
+      // Batches are made of edges sharing a scope.
+      if (edge->batch_ > 1)
+        keep = true;
+      for (VarId var = kVarBatch; var <= kVarMsvcDepsPrefix && !keep; ++var) {
+        string value = edge->GetBinding(var);
+        // The values are kept shell-escaped, as most are looked up; the
+        // depfile and rspfile are also looked up unescaped.
+        if ((var == kVarDepfile && value != edge->GetUnescapedDepfile()) ||
+            (var == kVarRspfile && value != edge->GetUnescapedRspfile()))
+          keep = true;
+        if (value.empty())
+          continue;
+        values[i].push_back(make_pair(var, value));
+        cost += sizeof(BindingEnv::Bindings::value_type) + value.capacity();
+      }
+      edge->ClearBindingCache();
+      cost += sizeof(BindingEnv);
+      for (BindingEnv* env = edge->env_; env != &bindings_;
+           env = env->parent_) {
+        if (!envs.insert(env).second)
+          break;
+      }
+    }
+    if (keep)
+      continue;
+    size_t freed = 0;
+    for (set<BindingEnv*>::iterator env = envs.begin(); env != envs.end();
+         ++env)
+      freed += ScopeBytes(*env);
+    if (cost > freed)
+      continue;
+
+    for (size_t i = 0; i < edges.size(); ++i) {
+      BindingEnv* env = new (edge_env_arena_.Allocate()) BindingEnv;
+      env->bindings_.swap(values[i]);
+      edges[i]->env_ = env;
+      done[edges[i]->id()] = true;
+    }
+    for (set<BindingEnv*>::iterator env = envs.begin(); env != envs.end();
+         ++env) {
+      for (map<string, const Rule*>::iterator r = (*env)->rules_.begin();
+           r != (*env)->rules_.end(); ++r)
+        rules.push_back(r->second);
+      delete *env;
+    }
+    compacted += edges.size();
+  }
+  if (compacted == 0)
+    return 0;
+
+  // A compacted edge doesn't look at its rule's bindings for anything its
+  // own scope lacks, as those evaluated empty.  Rules of the top-level
+  // scope may still be used by other edges.
+  for (map<string, const Rule*>::iterator r = bindings_.rules_.begin();
+       r != bindings_.rules_.end(); ++r)
+    rules.push_back(r->second);
+  set<const Rule*> in_use;
   for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
-    (*e)->outputs_ready_ = false;
-    (*e)->deps_loaded_ = false;
-    (*e)->mark_ = Edge::VisitNone;
+    if (!done[(*e)->id()])
+      in_use.insert((*e)->rule_);
+  }
+  for (vector<const Rule*>::iterator r = rules.begin(); r != rules.end();
+       ++r) {
+    if ((*r)->bindings_.empty() || in_use.count(*r))
+      continue;
+    Rule::Bindings().swap(const_cast<Rule*>(*r)->bindings_);
   }
+  return compacted;
+}
+
+size_t State::ScopeBytes(const BindingEnv* env) {
+  size_t bytes = sizeof(BindingEnv) + env->bindings_.capacity() *
+      sizeof(BindingEnv::Bindings::value_type);
+  for (BindingEnv::Bindings::const_iterator b = env->bindings_.begin();
+       b != env->bindings_.end(); ++b)
+    bytes += b->second.capacity();
+  // A map node holds three pointers and a color besides the entry.
+  bytes += env->rules_.size() *
+      (sizeof(map<string, const Rule*>::value_type) + 4 * sizeof(void*));
+  return bytes;
 }
 
 void State::Dump() {
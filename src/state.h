@@ -16,17 +16,21 @@
 #define NINJA_STATE_H_
 
 #include <map>
+#include <queue>
 #include <set>
 #include <string>
 #include <vector>
 using namespace std;
 
+#include "arena.h"
 #include "eval_env.h"
 #include "hash_map.h"
 #include "util.h"
 
 struct Edge;
+struct EdgePriorityQueue;
 struct Node;
+struct NodeCold;
 struct Rule;
 
 /// A pool for delayed edges.
@@ -37,18 +41,27 @@ struct Rule;
 /// allowing the Plan to schedule it. The Pool will relinquish queued Edges when
 /// the total scheduled weight diminishes enough (i.e. when a scheduled edge
 /// completes).
+/// A Pool can also have a memory budget, which it keeps the total estimated
+/// memory (see Edge::memory()) of its scheduled edges within the same way.
 struct Pool {
-  Pool(const string& name, int depth)
-    : name_(name), current_use_(0), depth_(depth), delayed_(&WeightedEdgeCmp) {}
+  Pool(const string& name, int depth, int64_t memory = 0, bool local = false)
+    : name_(name), current_use_(0), depth_(depth), current_memory_(0),
+      memory_(memory), local_(local) {}
 
   // A depth of 0 is infinite
   bool is_valid() const { return depth_ >= 0; }
   int depth() const { return depth_; }
+  /// The memory budget in kilobytes, or 0 if there's none.
+  int64_t memory() const { return memory_; }
+  /// Whether the commands of the pool must run on this machine, even with
+  /// a remote launcher (see BuildConfig::remote_launcher).
+  bool local() const { return local_; }
   const string& name() const { return name_; }
   int current_use() const { return current_use_; }
+  int64_t current_memory() const { return current_memory_; }
 
   /// true if the Pool might delay this edge
-  bool ShouldDelayEdge() const { return depth_ != 0; }
+  bool ShouldDelayEdge() const { return depth_ != 0 || memory_ != 0; }
 
   /// informs this Pool that the given edge is committed to be run.
   /// Pool will count this edge as using resources from this pool.
@@ -62,7 +75,15 @@ struct Pool {
   void DelayEdge(Edge* edge);
 
   /// Pool will add zero or more edges to the ready_queue
-  void RetrieveReadyEdges(set<Edge*>* ready_queue);
+  void RetrieveReadyEdges(EdgePriorityQueue* ready_queue);
+
+  /// Forget the edges a previous build scheduled or delayed, which an
+  /// interrupted build leaves behind.
+  void Reset() {
+    current_use_ = 0;
+    current_memory_ = 0;
+    delayed_ = DelayedEdges();
+  }
 
   /// Dump the Pool and its edges (useful for debugging).
   void Dump() const;
@@ -74,10 +95,24 @@ struct Pool {
   /// currently scheduled in the Plan (i.e. the edges in Plan::ready_).
   int current_use_;
   int depth_;
+  /// |current_memory_| is the total estimated memory of those edges.
+  int64_t current_memory_;
+  int64_t memory_;
+  bool local_;
 
   static bool WeightedEdgeCmp(const Edge* a, const Edge* b);
 
-  typedef set<Edge*,bool(*)(const Edge*, const Edge*)> DelayedEdges;
+  /// Orders delayed edges so that the one to release first compares
+  /// greatest.
+  struct ReleasedLater {
+    bool operator()(const Edge* a, const Edge* b) const {
+      return WeightedEdgeCmp(b, a);
+    }
+  };
+
+  /// A heap rather than a sorted set: edges are only ever taken from the
+  /// front, and a heap does that in O(log n) without allocating.
+  typedef priority_queue<Edge*, vector<Edge*>, ReleasedLater> DelayedEdges;
   DelayedEdges delayed_;
 };
 
@@ -88,6 +123,7 @@ struct State {
   static const Rule kPhonyRule;
 
   State();
+  ~State();
 
   void AddPool(Pool* pool);
   Pool* LookupPool(const string& pool_name);
@@ -96,6 +132,10 @@ struct State {
 
   Node* GetNode(StringPiece path, uint64_t slash_bits);
   Node* LookupNode(StringPiece path) const;
+
+  /// @return the node whose path is the fewest edits away from |path|, or
+  /// NULL if none is close enough to be a likely typo.  A State asked
+  /// more than once, as a server's is, indexes the paths the second time.
   Node* SpellcheckNode(const string& path);
 
   void AddIn(Edge* edge, StringPiece path, uint64_t slash_bits);
@@ -103,9 +143,33 @@ struct State {
   bool AddDefault(StringPiece path, string* error);
 
   /// Reset state.  Keeps all nodes and edges, but restores them to the
-  /// state where we haven't yet examined the disk for dirty state.
+  /// state where we haven't yet examined the disk for dirty state.  Takes
+  /// constant time, by starting a new generation in this State's slot of
+  /// g_graph_generations.
   void Reset();
 
+  /// Drop all nodes, edges, pools, scopes and defaults, leaving the state
+  /// as it was constructed.
+  void Clear();
+
+  /// Free what only the parser needs, for a build that runs for long: give
+  /// each edge declared in a scope below the top-level one a scope of its
+  /// own holding just the values of the bindings ninja looks up (command,
+  /// depfile, restat, ...), and free the scopes it was declared in, along
+  /// with the unevaluated bindings of rules no other edge uses.  Edges in
+  /// the top-level scope are left alone, as are scopes with batch edges
+  /// and, since every edge gets a copy of the values its scopes shared,
+  /// scopes where that would take more memory than it frees.  Other
+  /// variables can't be looked up from the edges afterwards, nor can more
+  /// be declared in the freed scopes.
+  /// @return the number of edges given scopes of their own.
+  size_t CompactScopes();
+
+  /// Drop the dependencies loaded from depfiles or the deps log for
+  /// \a edges, so that the next scan loads them again.  For processes
+  /// that run several builds on one State.
+  void ClearLoadedDeps(const vector<Edge*>& edges);
+
   /// Dump the nodes and Pools (useful for debugging).
   void Dump();
 
@@ -124,8 +188,33 @@ struct State {
   /// All the edges of the graph.
   vector<Edge*> edges_;
 
+  /// Where the nodes and edges live, laid out in the order they were
+  /// made, which is roughly the order the build walks them.  The cold
+  /// parts of the nodes live apart.
+  ObjectArena<Node> node_arena_;
+  ObjectArena<NodeCold> node_cold_arena_;
+  ObjectArena<Edge> edge_arena_;
+  /// The scopes CompactScopes() gave edges.
+  ObjectArena<BindingEnv, 256> edge_env_arena_;
+
   BindingEnv bindings_;
   vector<Node*> defaults_;
+
+ private:
+  void BuildSpellcheckIndex();
+
+  /// The bytes a scope holds for its bindings and rule table.
+  static size_t ScopeBytes(const BindingEnv* env);
+
+  /// The slot of g_graph_generations of this State's nodes and edges.
+  uint8_t graph_slot_;
+
+  /// The nodes by path length, each sorted by path, for SpellcheckNode.
+  vector<vector<Node*> > spellcheck_index_;
+  /// How many paths spellcheck_index_ holds; paths are only ever added,
+  /// so it is out of date when paths_ holds more.
+  size_t spellcheck_indexed_;
+  bool spellchecked_;
 };
 
 #endif  // NINJA_STATE_H_
@@ -12,7 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+
+#include "edit_distance.h"
 #include "graph.h"
+#include "manifest_parser.h"
 #include "state.h"
 #include "test.h"
 
@@ -43,4 +47,160 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out", 0)->dirty());
 }
 
+TEST(State, EdgeIds) {
+  State state;
+  Rule* rule = new Rule("cat");
+  state.bindings_.AddRule(rule);
+
+  for (size_t i = 0; i < 3; ++i) {
+    Edge* edge = state.AddEdge(rule);
+    EXPECT_EQ(i, edge->id());
+    EXPECT_EQ(edge, state.edges_[edge->id()]);
+  }
+}
+
+TEST(State, CompactScopes) {
+  State state;
+  VirtualFileSystem fs;
+  fs.Create("sub.ninja",
+"rule link\n"
+"  command = link $in -o $out\n"
+"  depfile = $out.d\n"
+"  restat = 1\n"
+"unused = " + string(1000, 'x') + "\n"
+"build sub1: link a.o\n"
+"build sub2: link sub1\n"
+"  description = linking\n");
+  // Each edge would need its own copy of the flags.
+  fs.Create("flags.ninja",
+"flags = " + string(200, 'y') + "\n"
+"build c.o: cc c.c\n"
+"build d.o: cc d.c\n"
+"build e.o: cc e.c\n");
+  ManifestParser parser(&state, &fs);
+  string err;
+  ASSERT_TRUE(parser.ParseTest(
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"build a.o: cc a.c\n"
+"subninja sub.ninja\n"
+"subninja flags.ninja\n", &err));
+  ASSERT_EQ("", err);
+
+  Edge* sub1 = state.LookupNode("sub1")->in_edge();
+  Edge* sub2 = state.LookupNode("sub2")->in_edge();
+  Edge* c = state.LookupNode("c.o")->in_edge();
+  BindingEnv* c_env = c->env_;
+  const Rule* link = &sub1->rule();
+
+  EXPECT_EQ(2u, state.CompactScopes());
+
+  EXPECT_EQ("", sub1->env_->LookupVariable("unused"));
+  EXPECT_EQ("link a.o -o sub1", sub1->EvaluateCommand());
+  EXPECT_EQ("sub1.d", sub1->GetUnescapedDepfile());
+  EXPECT_TRUE(sub1->GetBindingBool(kVarRestat));
+  EXPECT_EQ("linking", sub2->GetBinding(kVarDescription));
+  EXPECT_EQ(NULL, link->GetBinding(kVarCommand));
+
+  EXPECT_EQ(c_env, c->env_);
+  EXPECT_EQ("cc " + string(200, 'y') + " c.c -o c.o", c->EvaluateCommand());
+  EXPECT_EQ(&state.bindings_, state.LookupNode("a.o")->in_edge()->env_);
+  EXPECT_TRUE(state.bindings_.LookupRule("cc")->GetBinding(kVarCommand));
+
+  // The compacted scopes are left alone.
+  EXPECT_EQ(0u, state.CompactScopes());
+  EXPECT_EQ("link sub1 -o sub2", sub2->EvaluateCommand());
+}
+
+TEST(State, ManyNodes) {
+  // Enough nodes to span several arena blocks; they all stay put.
+  State state;
+  vector<Node*> nodes;
+  for (int i = 0; i < 3000; ++i) {
+    char path[16];
+    sprintf(path, "n%d", i);
+    nodes.push_back(state.GetNode(path, 0));
+  }
+  for (int i = 0; i < 3000; ++i) {
+    char path[16];
+    sprintf(path, "n%d", i);
+    EXPECT_EQ(nodes[i], state.LookupNode(path));
+    EXPECT_EQ(path, nodes[i]->path());
+  }
+}
+
+TEST(State, NodeNumbers) {
+  // The nodes are numbered in the order they were made, across blocks,
+  // including those made after the numbering started.
+  State state;
+  ObjectNumbering<Node> numbers(state.node_arena_);
+  vector<Node*> nodes;
+  for (int i = 0; i < 3000; ++i) {
+    char path[16];
+    sprintf(path, "n%d", i);
+    nodes.push_back(state.GetNode(path, 0));
+    if (i == 1500)
+      EXPECT_EQ(1500u, numbers.Number(nodes[i]));
+  }
+  for (size_t i = 0; i < nodes.size(); ++i)
+    EXPECT_EQ(i, numbers.Number(nodes[i]));
+}
+
+TEST(State, SpellcheckNode) {
+  State state;
+  state.GetNode("out/foo.o", 0);
+  state.GetNode("out/bar.o", 0);
+  state.GetNode("gen/foo.h", 0);
+
+  // The first call measures every path; later ones go through the index.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(state.LookupNode("out/foo.o"), state.SpellcheckNode("out/fo.o"));
+    EXPECT_EQ(state.LookupNode("gen/foo.h"), state.SpellcheckNode("gen/fooo.h"));
+    EXPECT_EQ(state.LookupNode("out/bar.o"), state.SpellcheckNode("out/bar.o"));
+    EXPECT_EQ(NULL, state.SpellcheckNode("src/baz.cc"));
+  }
+
+  // Paths added after the index was built are found too.
+  Node* node = state.GetNode("src/baz.c", 0);
+  EXPECT_EQ(node, state.SpellcheckNode("src/baz.cc"));
+
+  state.Clear();
+  EXPECT_EQ(NULL, state.SpellcheckNode("out/fo.o"));
+  EXPECT_EQ(NULL, state.SpellcheckNode("out/fo.o"));
+}
+
+TEST(State, SpellcheckNodeIndex) {
+  // The index finds paths as close as measuring every one does, among
+  // paths that share long prefixes and differ in a few characters.
+  State state;
+  for (int i = 0; i < 2000; ++i) {
+    char path[64];
+    sprintf(path, "obj/module_%d/sub_%d/file_%d.o", i % 17, i % 5, i);
+    state.GetNode(path, 0);
+  }
+  state.SpellcheckNode("");
+
+  const char* const kQueries[] = {
+    "obj/module_3/sub_0/file_20.o", "obj/modle_3/sub_0/file_20.o",
+    "obj/module_3/sub_0/file_20.oo", "obj/module_3/sub_4/file_21.o",
+    "bj/module_3/sub_0/file_2.o", "obj/module_3/sub_0/file_20",
+    "obj/module_16/sub_1/file_1990.o", "obj/mdule_16/sb_1/fle_1990.o",
+    "obj/mdule_16/sb_1/fle_199.o", "file_20.o", "obj",
+  };
+  for (size_t q = 0; q < sizeof(kQueries) / sizeof(kQueries[0]); ++q) {
+    int expected = 4;
+    for (State::Paths::iterator i = state.paths_.begin();
+         i != state.paths_.end(); ++i) {
+      expected = min(expected, EditDistance(i->first, kQueries[q], true, 3));
+    }
+    Node* node = state.SpellcheckNode(kQueries[q]);
+    if (expected > 3) {
+      EXPECT_EQ(NULL, node);
+    } else {
+      ASSERT_TRUE(node != NULL);
+      EXPECT_EQ(expected, EditDistance(node->path(), kQueries[q]));
+    }
+  }
+}
+
 }  // namespace
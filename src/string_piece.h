@@ -41,6 +41,10 @@ struct StringPiece {
   bool operator!=(const StringPiece& other) const {
     return !(*this == other);
   }
+  bool operator<(const StringPiece& other) const {
+    int cmp = memcmp(str_, other.str_, len_ < other.len_ ? len_ : other.len_);
+    return cmp < 0 || (cmp == 0 && len_ < other.len_);
+  }
 
   /// Convert the slice into a full-fledged std::string, copying the
   /// data into a new string.
@@ -64,6 +68,10 @@ struct StringPiece {
     return len_;
   }
 
+  bool empty() const {
+    return len_ == 0;
+  }
+
   const char* str_;
   size_t len_;
 };
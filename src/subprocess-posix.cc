@@ -12,6 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+// For POSIX_SPAWN_USEVFORK, where the C library only declares it then.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "subprocess.h"
 
 #include <sys/select.h>
@@ -22,38 +27,167 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <spawn.h>
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#elif defined(USE_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include <sys/socket.h>
+
+#include <algorithm>
 
 extern char** environ;
 
+#include "affinity.h"
+#include "metrics.h"
 #include "util.h"
+#include "worker.h"
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+/// How much of a command's output to read at once.
+const int kReadSize = 64 << 10;
+/// The size we ask its pipe to be, above Linux's default of 64 KB.  Kept
+/// modest, as past a per-user total the kernel gives new pipes less.
+const int kPipeSize = 256 << 10;
+
+/// A timeout of DoWork() as a timespec.
+timespec MillisToTimespec(int timeout_millis) {
+  timespec ts;
+  ts.tv_sec = timeout_millis / 1000;
+  ts.tv_nsec = (timeout_millis % 1000) * 1000000L;
+  return ts;
+}
 
-Subprocess::Subprocess(bool use_console) : fd_(-1), pid_(-1),
+#if defined(USE_EPOLL)
+/// Set in the data of the epoll event of a Subprocess's pidfd, to tell it
+/// from that of its pipe.  The signalfd's event has no data.
+const uint64_t kPidfdEvent = 1;
+
+/// A pidfd for |pid|, or -1 if the kernel has none (before Linux 5.3).
+int PidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+#endif  // USE_EPOLL
+
+}  // anonymous namespace
+
+const size_t Subprocess::kMaxOutputInMemory;
+
+Subprocess::Subprocess(bool use_console) : spill_(NULL), fd_(-1), pid_(-1),
+                                           queue_fd_(-1), pid_fd_(-1),
+                                           is_work_request_(false),
+                                           worker_(NULL), exit_code_(0),
                                            use_console_(use_console) {
 }
 
 Subprocess::~Subprocess() {
   if (fd_ >= 0)
-    close(fd_);
+    CloseFd();
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
+  if (spill_)
+    fclose(spill_);
+}
+
+bool SplitSimpleCommand(const string& command, vector<string>* words) {
+  words->clear();
+  string word;
+  bool in_word = false;
+  for (size_t i = 0; i < command.size(); ++i) {
+    char c = command[i];
+    if (c == ' ' || c == '\t') {
+      if (in_word)
+        words->push_back(word);
+      word.clear();
+      in_word = false;
+      continue;
+    }
+    in_word = true;
+    if (c == '\'') {
+      size_t end = command.find('\'', i + 1);
+      if (end == string::npos)
+        return false;
+      word.append(command, i + 1, end - i - 1);
+      i = end;
+    } else if (c == '"') {
+      size_t end = command.find_first_of("\"$`\\", i + 1);
+      if (end == string::npos || command[end] != '"')
+        return false;
+      word.append(command, i + 1, end - i - 1);
+      i = end;
+    } else if (c == '\0' || strchr("|&;<>()$`\\*?[]{}~#^\n\r", c)) {
+      return false;
+    } else {
+      if (c == '=' && words->empty())
+        return false;  // An assignment.
+      word += c;
+    }
+  }
+  if (in_word)
+    words->push_back(word);
+  if (words->empty())
+    return false;
+
+  // Keywords, and builtins that might not do what the program of the same
+  // name does.
+  static const char* const kShellWords[] = {
+    "!", ".", ":", "[", "alias", "bg", "break", "case", "cd", "command",
+    "continue", "do", "done", "echo", "elif", "else", "esac", "eval", "exec",
+    "exit", "export", "false", "fc", "fg", "fi", "for", "function",
+    "getopts", "hash", "if", "in", "jobs", "kill", "local", "printf", "pwd",
+    "read", "readonly", "return", "select", "set", "shift", "source", "test",
+    "then", "time", "times", "trap", "true", "type", "ulimit", "umask",
+    "unalias", "unset", "until", "wait", "while",
+  };
+  for (size_t i = 0; i < sizeof(kShellWords) / sizeof(kShellWords[0]); ++i) {
+    if ((*words)[0] == kShellWords[i])
+      return false;
+  }
+  return true;
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool use_shell, const AffinitySlot* slot) {
   int output_pipe[2];
   if (pipe(output_pipe) < 0)
     Fatal("pipe: %s", strerror(errno));
   fd_ = output_pipe[0];
+#ifdef F_SETPIPE_SZ
+  // A bigger pipe lets a chatty command write more before it has to wait
+  // for us, and us read more at once.  Best effort: the kernel limits how
+  // much pipe memory a user may have.
+  fcntl(fd_, F_SETPIPE_SZ, kPipeSize);
+#endif
 #if !defined(USE_PPOLL)
   // If available, we use ppoll in DoWork(); otherwise we use pselect
   // and so must avoid overly-large FDs.
-  if (fd_ >= static_cast<int>(FD_SETSIZE))
+  if (set->queue_fd_ < 0 && fd_ >= static_cast<int>(FD_SETSIZE))
     Fatal("pipe: %s", strerror(EMFILE));
 #endif  // !USE_PPOLL
   SetCloseOnExec(fd_);
 
+  Register(set);
+
   posix_spawn_file_actions_t action;
   int err = posix_spawn_file_actions_init(&action);
   if (err != 0)
@@ -102,6 +236,9 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     // In the console case, output_pipe is still inherited by the child and
     // closed when the subprocess finishes, which then notifies ninja.
   }
+  // Spawn without copying our page tables, which for a large graph can
+  // take longer than the command does.  glibc from 2.24 and musl always do
+  // (with clone(CLONE_VM | CLONE_VFORK)); older glibc only when asked.
 #ifdef POSIX_SPAWN_USEVFORK
   flags |= POSIX_SPAWN_USEVFORK;
 #endif
@@ -110,11 +247,41 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (err != 0)
     Fatal("posix_spawnattr_setflags: %s", strerror(err));
 
-  const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
-  err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
-        const_cast<char**>(spawned_args), environ);
-  if (err != 0)
-    Fatal("posix_spawn: %s", strerror(err));
+  // A command given a slot sees its number, and starts out pinned to its
+  // CPUs, which it keeps, as we are pinned to them while spawning it.
+  char** env = environ;
+  vector<char*> slot_env;
+  char slot_var[32];
+  if (slot) {
+    snprintf(slot_var, sizeof(slot_var), "NINJA_SLOT=%d", slot->number);
+    for (char** var = environ; *var; ++var) {
+      if (strncmp(*var, "NINJA_SLOT=", 11) != 0)
+        slot_env.push_back(*var);
+    }
+    slot_env.push_back(slot_var);
+    slot_env.push_back(NULL);
+    env = &slot_env[0];
+  }
+  ScopedAffinity affinity(slot);
+
+  // Run simple commands directly, which saves starting a shell.  If that
+  // fails, let the shell try, so that errors are reported as before.
+  vector<string> words;
+  err = -1;
+  if (!use_shell && SplitSimpleCommand(command, &words)) {
+    vector<char*> argv;
+    for (vector<string>::iterator i = words.begin(); i != words.end(); ++i)
+      argv.push_back(&(*i)[0]);
+    argv.push_back(NULL);
+    err = posix_spawnp(&pid_, argv[0], &action, &attr, &argv[0], env);
+  }
+  if (err != 0) {
+    const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
+    err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
+          const_cast<char**>(spawned_args), env);
+    if (err != 0)
+      Fatal("posix_spawn: %s", strerror(err));
+  }
 
   err = posix_spawnattr_destroy(&attr);
   if (err != 0)
@@ -124,29 +291,155 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     Fatal("posix_spawn_file_actions_destroy: %s", strerror(err));
 
   close(output_pipe[1]);
+
+#if defined(USE_EPOLL)
+  if (queue_fd_ >= 0 && (pid_fd_ = PidfdOpen(pid_)) >= 0) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = (uintptr_t)this | kPidfdEvent;
+    if (epoll_ctl(queue_fd_, EPOLL_CTL_ADD, pid_fd_, &event) < 0)
+      Fatal("epoll_ctl: %s", strerror(errno));
+  }
+#endif
   return true;
 }
 
 void Subprocess::OnPipeReady() {
-  char buf[4 << 10];
+  if (is_work_request_) {
+    OnWorkerReady();
+    return;
+  }
+  char buf[kReadSize];
   ssize_t len = read(fd_, buf, sizeof(buf));
+  METRIC_COUNT("subprocess pipe reads", 1);
   if (len > 0) {
-    buf_.append(buf, len);
+    AppendOutput(buf, len);
   } else {
     if (len < 0)
       Fatal("read: %s", strerror(errno));
+    CloseFd();
+  }
+}
+
+void Subprocess::Register(SubprocessSet* set) {
+  if (set->queue_fd_ < 0)
+    return;
+  queue_fd_ = set->queue_fd_;
+#if defined(USE_EPOLL)
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLPRI;
+  event.data.u64 = (uintptr_t)this;
+  if (epoll_ctl(queue_fd_, EPOLL_CTL_ADD, fd_, &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#elif defined(USE_KQUEUE)
+  struct kevent event;
+  EV_SET(&event, fd_, EVFILT_READ, EV_ADD, 0, 0, this);
+  if (kevent(queue_fd_, &event, 1, NULL, 0, NULL) < 0)
+    Fatal("kevent: %s", strerror(errno));
+#endif
+}
+
+void Subprocess::CloseFd() {
+#if defined(USE_EPOLL)
+  // Closing fd_ only unregisters it once no process has it open any more,
+  // and a child started just before may not have got to closing its copy.
+  if (queue_fd_ >= 0 && epoll_ctl(queue_fd_, EPOLL_CTL_DEL, fd_, NULL) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#elif defined(USE_KQUEUE)
+  // Closing fd_ unregisters it, but a worker's fd stays open.
+  if (queue_fd_ >= 0 && is_work_request_) {
+    struct kevent event;
+    EV_SET(&event, fd_, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    if (kevent(queue_fd_, &event, 1, NULL, 0, NULL) < 0)
+      Fatal("kevent: %s", strerror(errno));
+  }
+#endif
+  if (!is_work_request_)
     close(fd_);
-    fd_ = -1;
+  fd_ = -1;
+}
+
+void Subprocess::OnWorkerReady() {
+  char buf[4 << 10];
+  ssize_t len = read(fd_, buf, sizeof(buf));
+  METRIC_COUNT("subprocess pipe reads", 1);
+  if (len > 0) {
+    worker_->buf_.append(buf, len);
+    string err;
+    int size = ParseWorkResponse(worker_->buf_, &exit_code_, &buf_, &err);
+    if (size == 0)
+      return;
+    if (size > 0) {
+      worker_->buf_.erase(0, size);
+    } else {
+      buf_ = "ninja: " + err + "\n";
+      exit_code_ = 1;
+      worker_->broken_ = true;
+    }
+  } else {
+    if (len < 0 && errno != ECONNRESET)
+      Fatal("read: %s", strerror(errno));
+    buf_ = "ninja: worker '" + worker_->command_ + "' exited\n";
+    exit_code_ = 1;
+    worker_->broken_ = true;
+  }
+  CloseFd();
+}
+
+void Subprocess::OnExited() {
+  // Take the output the process left, without waiting for the end of it:
+  // what it left running in the background may keep the pipe open.
+  if (fd_ >= 0) {
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    char buf[kReadSize];
+    ssize_t len;
+    while ((len = read(fd_, buf, sizeof(buf))) > 0)
+      AppendOutput(buf, len);
+    if (len < 0 && errno != EAGAIN)
+      Fatal("read: %s", strerror(errno));
+    CloseFd();
   }
+  ClosePidfd();
+}
+
+void Subprocess::ClosePidfd() {
+#if defined(USE_EPOLL)
+  if (epoll_ctl(queue_fd_, EPOLL_CTL_DEL, pid_fd_, NULL) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#endif
+  close(pid_fd_);
+  pid_fd_ = -1;
 }
 
 ExitStatus Subprocess::Finish() {
+  if (is_work_request_)
+    return exit_code_ == 0 ? ExitSuccess : ExitFailure;
+
+  if (pid_fd_ >= 0)
+    ClosePidfd();
   assert(pid_ != -1);
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage usage;
+  if (wait4(pid_, &status, 0, &usage) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
 
+  // The usage covers the process and the children it waited for, like
+  // those of /bin/sh.
+  usage_.user_time = usage.ru_utime.tv_sec * 1000 +
+      usage.ru_utime.tv_usec / 1000;
+  usage_.system_time = usage.ru_stime.tv_sec * 1000 +
+      usage.ru_stime.tv_usec / 1000;
+#ifdef __APPLE__
+  usage_.max_rss = usage.ru_maxrss / 1024;  // In bytes here.
+#else
+  usage_.max_rss = usage.ru_maxrss;
+#endif
+  usage_.read_blocks = usage.ru_inblock;
+  usage_.write_blocks = usage.ru_oublock;
+
   if (WIFEXITED(status)) {
     int exit = WEXITSTATUS(status);
     if (exit == 0)
@@ -160,13 +453,30 @@ ExitStatus Subprocess::Finish() {
 }
 
 bool Subprocess::Done() const {
-  return fd_ == -1;
+  return fd_ == -1 && pid_fd_ == -1;
 }
 
 const string& Subprocess::GetOutput() const {
   return buf_;
 }
 
+void Subprocess::AppendOutput(const char* data, size_t len) {
+  if (!spill_ && buf_.size() + len > kMaxOutputInMemory)
+    spill_ = tmpfile();  // Keep it all in memory if that fails.
+  if (spill_)
+    fwrite(data, 1, len, spill_);
+  else
+    buf_.append(data, len);
+}
+
+FILE* Subprocess::TakeOutputSpill() {
+  FILE* spill = spill_;
+  spill_ = NULL;
+  if (spill)
+    rewind(spill);
+  return spill;
+}
+
 int SubprocessSet::interrupted_;
 
 void SubprocessSet::SetInterruptedFlag(int signum) {
@@ -188,7 +498,8 @@ void SubprocessSet::HandlePendingInterruption() {
     interrupted_ = SIGHUP;
 }
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet(bool force_poll)
+    : queue_fd_(-1), signal_fd_(-1) {
   sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGINT);
@@ -206,6 +517,40 @@ SubprocessSet::SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigaction(SIGHUP, &act, &old_hup_act_) < 0)
     Fatal("sigaction: %s", strerror(errno));
+
+  // If the queue can't be created, fall back to polling.
+  if (force_poll)
+    return;
+#if defined(USE_EPOLL)
+  queue_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  // Read the signals from a signalfd, so that waiting needn't unblock
+  // them; if there's none, epoll_pwait() does.
+  if (queue_fd_ >= 0 &&
+      (signal_fd_ = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) >= 0) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (epoll_ctl(queue_fd_, EPOLL_CTL_ADD, signal_fd_, &event) < 0) {
+      close(signal_fd_);
+      signal_fd_ = -1;
+    }
+  }
+#elif defined(USE_KQUEUE)
+  queue_fd_ = kqueue();
+  if (queue_fd_ >= 0) {
+    SetCloseOnExec(queue_fd_);
+    // Wake up for the signals that interrupt the build.  They stay blocked
+    // outside of DoWork(), so this is how kevent() notices them.
+    struct kevent events[3];
+    EV_SET(&events[0], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    EV_SET(&events[1], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    EV_SET(&events[2], SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(queue_fd_, events, 3, NULL, 0, NULL) < 0) {
+      close(queue_fd_);
+      queue_fd_ = -1;
+    }
+  }
+#endif
 }
 
 SubprocessSet::~SubprocessSet() {
@@ -219,11 +564,17 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigprocmask(SIG_SETMASK, &old_mask_, 0) < 0)
     Fatal("sigprocmask: %s", strerror(errno));
+
+  if (signal_fd_ >= 0)
+    close(signal_fd_);
+  if (queue_fd_ >= 0)
+    close(queue_fd_);
 }
 
-Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
+Subprocess *SubprocessSet::Add(const string& command, bool use_console,
+                               bool use_shell, const AffinitySlot* slot) {
   Subprocess *subprocess = new Subprocess(use_console);
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, use_shell, slot)) {
     delete subprocess;
     return 0;
   }
@@ -231,8 +582,122 @@ Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
   return subprocess;
 }
 
+bool SubprocessSet::DoWork(int timeout_millis) {
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+  if (queue_fd_ >= 0)
+    return DoWorkEventQueue(timeout_millis);
+#endif
+  return DoWorkPoll(timeout_millis);
+}
+
+void SubprocessSet::OnFinished(Subprocess* subproc) {
+  finished_.push(subproc);
+
+  Worker* worker = subproc->worker_;
+  subproc->worker_ = NULL;
+  if (!worker)
+    return;
+  if (worker->broken_)
+    StopWorker(worker);
+  else
+    idle_workers_[worker->command_].push_back(worker);
+}
+
+#if defined(USE_EPOLL)
+bool SubprocessSet::DoWorkEventQueue(int timeout_millis) {
+  epoll_event events[64];
+  interrupted_ = 0;
+  int ret;
+  if (signal_fd_ >= 0) {
+    ret = epoll_wait(queue_fd_, events, sizeof(events) / sizeof(events[0]),
+                     timeout_millis < 0 ? -1 : timeout_millis);
+  } else {
+    ret = epoll_pwait(queue_fd_, events, sizeof(events) / sizeof(events[0]),
+                      timeout_millis < 0 ? -1 : timeout_millis, &old_mask_);
+  }
+  if (ret == -1) {
+    if (errno != EINTR) {
+      perror("ninja: epoll_pwait");
+      return false;
+    }
+    return IsInterrupted();
+  }
+
+  if (signal_fd_ >= 0) {
+    for (int i = 0; i < ret; ++i) {
+      if (events[i].data.u64 != 0)
+        continue;
+      signalfd_siginfo info;
+      while (read(signal_fd_, &info, sizeof(info)) == sizeof(info))
+        interrupted_ = info.ssi_signo;
+    }
+  } else {
+    HandlePendingInterruption();
+  }
+  if (IsInterrupted())
+    return true;
+
+  for (int i = 0; i < ret; ++i) {
+    uint64_t data = events[i].data.u64;
+    if (data == 0)
+      continue;
+    Subprocess* subproc = (Subprocess*)(uintptr_t)(data & ~kPidfdEvent);
+    // An exit earlier in |events| closes the pipe too.
+    if (data & kPidfdEvent) {
+      if (subproc->pid_fd_ < 0)
+        continue;
+      subproc->OnExited();
+    } else {
+      if (subproc->fd_ < 0)
+        continue;
+      subproc->OnPipeReady();
+    }
+    if (subproc->Done()) {
+      running_.erase(find(running_.begin(), running_.end(), subproc));
+      OnFinished(subproc);
+    }
+  }
+
+  return IsInterrupted();
+}
+
+#elif defined(USE_KQUEUE)
+bool SubprocessSet::DoWorkEventQueue(int timeout_millis) {
+  struct kevent events[64];
+  interrupted_ = 0;
+  timespec timeout = MillisToTimespec(timeout_millis);
+  int ret = kevent(queue_fd_, NULL, 0, events,
+                   sizeof(events) / sizeof(events[0]),
+                   timeout_millis < 0 ? NULL : &timeout);
+  if (ret == -1 && errno != EINTR) {
+    perror("ninja: kevent");
+    return false;
+  }
+
+  // Let the handler see the signals that arrived, as ppoll() would.
+  sigset_t mask;
+  sigprocmask(SIG_SETMASK, &old_mask_, &mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  if (ret == -1 || IsInterrupted())
+    return IsInterrupted();
+
+  for (int i = 0; i < ret; ++i) {
+    if (events[i].filter != EVFILT_READ)
+      continue;
+    Subprocess* subproc = static_cast<Subprocess*>(events[i].udata);
+    subproc->OnPipeReady();
+    if (subproc->Done()) {
+      running_.erase(find(running_.begin(), running_.end(), subproc));
+      OnFinished(subproc);
+    }
+  }
+
+  return IsInterrupted();
+}
+#endif  // USE_KQUEUE
+
 #ifdef USE_PPOLL
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::DoWorkPoll(int timeout_millis) {
   vector<pollfd> fds;
   nfds_t nfds = 0;
 
@@ -247,7 +712,9 @@ bool SubprocessSet::DoWork() {
   }
 
   interrupted_ = 0;
-  int ret = ppoll(&fds.front(), nfds, NULL, &old_mask_);
+  timespec timeout = MillisToTimespec(timeout_millis);
+  int ret = ppoll(&fds.front(), nfds, timeout_millis < 0 ? NULL : &timeout,
+                  &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: ppoll");
@@ -270,7 +737,7 @@ bool SubprocessSet::DoWork() {
     if (fds[cur_nfd++].revents) {
       (*i)->OnPipeReady();
       if ((*i)->Done()) {
-        finished_.push(*i);
+        OnFinished(*i);
         i = running_.erase(i);
         continue;
       }
@@ -282,7 +749,7 @@ bool SubprocessSet::DoWork() {
 }
 
 #else  // !defined(USE_PPOLL)
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::DoWorkPoll(int timeout_millis) {
   fd_set set;
   int nfds = 0;
   FD_ZERO(&set);
@@ -298,7 +765,9 @@ bool SubprocessSet::DoWork() {
   }
 
   interrupted_ = 0;
-  int ret = pselect(nfds, &set, 0, 0, 0, &old_mask_);
+  timespec timeout = MillisToTimespec(timeout_millis);
+  int ret = pselect(nfds, &set, 0, 0, timeout_millis < 0 ? NULL : &timeout,
+                    &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: pselect");
@@ -317,7 +786,7 @@ bool SubprocessSet::DoWork() {
     if (fd >= 0 && FD_ISSET(fd, &set)) {
       (*i)->OnPipeReady();
       if ((*i)->Done()) {
-        finished_.push(*i);
+        OnFinished(*i);
         i = running_.erase(i);
         continue;
       }
@@ -342,10 +811,154 @@ void SubprocessSet::Clear() {
        i != running_.end(); ++i)
     // Since the foreground process is in our process group, it will receive
     // the interruption signal (i.e. SIGINT or SIGTERM) at the same time as us.
-    if (!(*i)->use_console_)
+    if (!(*i)->use_console_ && !(*i)->is_work_request_)
       kill(-(*i)->pid_, interrupted_);
   for (vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ++i)
     delete *i;
   running_.clear();
+
+  while (!workers_.empty())
+    StopWorker(workers_.back());
+  idle_workers_.clear();
+}
+
+Subprocess* SubprocessSet::AddWorkRequest(const string& worker,
+                                          const string& command) {
+  vector<string> worker_words, words;
+  if (!SplitSimpleCommand(worker, &worker_words) ||
+      !SplitSimpleCommand(command, &words))
+    return Add(command);
+
+  // The request has the words of the command after those it shares with
+  // the worker's command.
+  size_t common = 0;
+  while (common < worker_words.size() && common < words.size() &&
+         worker_words[common] == words[common])
+    ++common;
+  string request = EncodeWorkRequest(
+      vector<string>(words.begin() + common, words.end()));
+
+  vector<Worker*>& idle = idle_workers_[worker];
+  for (;;) {
+    // An idle worker may have exited since; then try the next one.
+    bool fresh = idle.empty();
+    Worker* w = fresh ? StartWorker(worker, worker_words) : idle.back();
+    if (!fresh)
+      idle.pop_back();
+    if (!w)
+      return Add(command);
+
+    size_t written = 0;
+    while (written < request.size()) {
+      ssize_t len = send(w->in_fd_, request.data() + written,
+                         request.size() - written, kSendFlags);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        break;
+      written += len;
+    }
+    if (written < request.size()) {
+      StopWorker(w);
+      if (fresh)
+        return Add(command);
+      continue;
+    }
+
+    Subprocess* subproc = new Subprocess(false);
+    subproc->is_work_request_ = true;
+    subproc->worker_ = w;
+    subproc->fd_ = w->out_fd_;
+    subproc->Register(this);
+    running_.push_back(subproc);
+    return subproc;
+  }
+}
+
+Worker* SubprocessSet::StartWorker(const string& command,
+                                   const vector<string>& words) {
+  // Requests go over a socket, which can't SIGPIPE us if the worker exits.
+  int input[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, input) < 0)
+    return NULL;
+  int output[2];
+  if (pipe(output) < 0) {
+    close(input[0]);
+    close(input[1]);
+    return NULL;
+  }
+  SetCloseOnExec(input[0]);
+  SetCloseOnExec(output[0]);
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(input[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  posix_spawn_file_actions_t action;
+  int err = posix_spawn_file_actions_init(&action);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions_init: %s", strerror(err));
+  // Workers talk over stdin and stdout, and their stderr would garble the
+  // status line.
+  if ((err = posix_spawn_file_actions_adddup2(&action, input[1], 0)) != 0 ||
+      (err = posix_spawn_file_actions_adddup2(&action, output[1], 1)) != 0 ||
+      (err = posix_spawn_file_actions_addopen(&action, 2, "/dev/null",
+                                              O_WRONLY, 0)) != 0 ||
+      (err = posix_spawn_file_actions_addclose(&action, input[1])) != 0 ||
+      (err = posix_spawn_file_actions_addclose(&action, output[1])) != 0)
+    Fatal("posix_spawn_file_actions: %s", strerror(err));
+
+  posix_spawnattr_t attr;
+  err = posix_spawnattr_init(&attr);
+  if (err != 0)
+    Fatal("posix_spawnattr_init: %s", strerror(err));
+  // Like other commands, workers run in their own process group, so that
+  // ctrl-c doesn't reach them; Clear() stops them.
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_USEVFORK
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  if ((err = posix_spawnattr_setsigmask(&attr, &old_mask_)) != 0 ||
+      (err = posix_spawnattr_setflags(&attr, flags)) != 0)
+    Fatal("posix_spawnattr: %s", strerror(err));
+
+  vector<string> args = words;
+  vector<char*> argv;
+  for (vector<string>::iterator i = args.begin(); i != args.end(); ++i)
+    argv.push_back(&(*i)[0]);
+  argv.push_back(NULL);
+  pid_t pid;
+  err = posix_spawnp(&pid, argv[0], &action, &attr, &argv[0], environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&action);
+
+  close(input[1]);
+  close(output[1]);
+  if (err != 0) {
+    close(input[0]);
+    close(output[0]);
+    return NULL;
+  }
+
+  Worker* worker = new Worker;
+  worker->command_ = command;
+  worker->pid_ = pid;
+  worker->in_fd_ = input[0];
+  worker->out_fd_ = output[0];
+  worker->broken_ = false;
+  workers_.push_back(worker);
+  return worker;
+}
+
+void SubprocessSet::StopWorker(Worker* worker) {
+  // Workers exit once their stdin closes.
+  close(worker->in_fd_);
+  close(worker->out_fd_);
+  kill(-worker->pid_, SIGTERM);
+  int status;
+  while (waitpid(worker->pid_, &status, 0) < 0 && errno == EINTR) {
+  }
+  workers_.erase(find(workers_.begin(), workers_.end(), worker));
+  delete worker;
 }
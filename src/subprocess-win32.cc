@@ -14,14 +14,23 @@
 
 #include "subprocess.h"
 
+// Have psapi.h declare the functions kernel32 exports, so that there's no
+// psapi.lib to link.
+#define PSAPI_VERSION 2
+#include <psapi.h>
+
 #include <assert.h>
 #include <stdio.h>
 
 #include <algorithm>
 
+#include "metrics.h"
 #include "util.h"
 
-Subprocess::Subprocess(bool use_console) : child_(NULL) , overlapped_(),
+const size_t Subprocess::kMaxOutputInMemory;
+
+Subprocess::Subprocess(bool use_console) : spill_(NULL), child_(NULL),
+                                           overlapped_(),
                                            is_reading_(false),
                                            use_console_(use_console) {
 }
@@ -31,6 +40,8 @@ Subprocess::~Subprocess() {
     if (!CloseHandle(pipe_))
       Win32Fatal("CloseHandle");
   }
+  if (spill_)
+    fclose(spill_);
   // Reap child if forgotten.
   if (child_)
     Finish();
@@ -45,7 +56,7 @@ HANDLE Subprocess::SetupPipe(HANDLE ioport) {
                              PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
                              PIPE_TYPE_BYTE,
                              PIPE_UNLIMITED_INSTANCES,
-                             0, 0, INFINITE, NULL);
+                             0, sizeof(overlapped_buf_), INFINITE, NULL);
   if (pipe_ == INVALID_HANDLE_VALUE)
     Win32Fatal("CreateNamedPipe");
 
@@ -72,7 +83,8 @@ HANDLE Subprocess::SetupPipe(HANDLE ioport) {
   return output_write_child;
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool /*use_shell*/, const AffinitySlot* /*slot*/) {
   HANDLE child_pipe = SetupPipe(set->ioport_);
 
   SECURITY_ATTRIBUTES security_attributes;
@@ -163,8 +175,10 @@ void Subprocess::OnPipeReady() {
     Win32Fatal("GetOverlappedResult");
   }
 
-  if (is_reading_ && bytes)
-    buf_.append(overlapped_buf_, bytes);
+  if (is_reading_ && bytes) {
+    METRIC_COUNT("subprocess pipe reads", 1);
+    AppendOutput(overlapped_buf_, bytes);
+  }
 
   memset(&overlapped_, 0, sizeof(overlapped_));
   is_reading_ = true;
@@ -193,6 +207,26 @@ ExitStatus Subprocess::Finish() {
   DWORD exit_code = 0;
   GetExitCodeProcess(child_, &exit_code);
 
+  // Unlike on POSIX, this only covers the process itself, not the ones it
+  // started.
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (GetProcessTimes(child_, &creation_time, &exit_time, &kernel_time,
+                      &user_time)) {
+    // In units of 100ns.
+    usage_.user_time = (((ULONGLONG)user_time.dwHighDateTime << 32) |
+                        user_time.dwLowDateTime) / 10000;
+    usage_.system_time = (((ULONGLONG)kernel_time.dwHighDateTime << 32) |
+                          kernel_time.dwLowDateTime) / 10000;
+  }
+  PROCESS_MEMORY_COUNTERS memory;
+  if (GetProcessMemoryInfo(child_, &memory, sizeof(memory)))
+    usage_.max_rss = memory.PeakWorkingSetSize / 1024;
+  IO_COUNTERS io;
+  if (GetProcessIoCounters(child_, &io)) {
+    usage_.read_blocks = io.ReadTransferCount / 512;
+    usage_.write_blocks = io.WriteTransferCount / 512;
+  }
+
   CloseHandle(child_);
   child_ = NULL;
 
@@ -209,9 +243,26 @@ const string& Subprocess::GetOutput() const {
   return buf_;
 }
 
+void Subprocess::AppendOutput(const char* data, size_t len) {
+  if (!spill_ && buf_.size() + len > kMaxOutputInMemory)
+    spill_ = tmpfile();  // Keep it all in memory if that fails.
+  if (spill_)
+    fwrite(data, 1, len, spill_);
+  else
+    buf_.append(data, len);
+}
+
+FILE* Subprocess::TakeOutputSpill() {
+  FILE* spill = spill_;
+  spill_ = NULL;
+  if (spill)
+    rewind(spill);
+  return spill;
+}
+
 HANDLE SubprocessSet::ioport_;
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet(bool /*force_poll*/) {
   ioport_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
   if (!ioport_)
     Win32Fatal("CreateIoCompletionPort");
@@ -236,9 +287,16 @@ BOOL WINAPI SubprocessSet::NotifyInterrupted(DWORD dwCtrlType) {
   return FALSE;
 }
 
-Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
+Subprocess* SubprocessSet::AddWorkRequest(const string& /*worker*/,
+                                          const string& command) {
+  // Workers are POSIX only.
+  return Add(command);
+}
+
+Subprocess *SubprocessSet::Add(const string& command, bool use_console,
+                               bool use_shell, const AffinitySlot* slot) {
   Subprocess *subprocess = new Subprocess(use_console);
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, use_shell, slot)) {
     delete subprocess;
     return 0;
   }
@@ -249,33 +307,47 @@ Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
   return subprocess;
 }
 
-bool SubprocessSet::DoWork() {
-  DWORD bytes_read;
-  Subprocess* subproc;
-  OVERLAPPED* overlapped;
-
-  if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&subproc,
-                                 &overlapped, INFINITE)) {
-    if (GetLastError() != ERROR_BROKEN_PIPE)
-      Win32Fatal("GetQueuedCompletionStatus");
+bool SubprocessSet::DoWork(int timeout_millis) {
+  // Take all the completions that are waiting at once; with many commands
+  // running there is usually more than one.
+  OVERLAPPED_ENTRY entries[64];
+  ULONG count;
+  if (!GetQueuedCompletionStatusEx(ioport_, entries,
+                                   sizeof(entries) / sizeof(entries[0]),
+                                   &count,
+                                   timeout_millis < 0 ? INFINITE
+                                                      : timeout_millis,
+                                   FALSE)) {
+    if (GetLastError() == WAIT_TIMEOUT)
+      return false;
+    Win32Fatal("GetQueuedCompletionStatusEx");
   }
 
-  if (!subproc) // A NULL subproc indicates that we were interrupted and is
-                // delivered by NotifyInterrupted above.
-    return true;
+  bool interrupted = false;
+  for (ULONG i = 0; i < count; ++i) {
+    Subprocess* subproc = (Subprocess*)entries[i].lpCompletionKey;
+    if (!subproc) {
+      // A NULL subproc indicates that we were interrupted and is
+      // delivered by NotifyInterrupted above.
+      interrupted = true;
+      continue;
+    }
 
-  subproc->OnPipeReady();
+    // A failed read, such as of a pipe the child closed, shows up when
+    // OnPipeReady() asks for its result.
+    subproc->OnPipeReady();
 
-  if (subproc->Done()) {
-    vector<Subprocess*>::iterator end =
-        remove(running_.begin(), running_.end(), subproc);
-    if (running_.end() != end) {
-      finished_.push(subproc);
-      running_.resize(end - running_.begin());
+    if (subproc->Done()) {
+      vector<Subprocess*>::iterator end =
+          remove(running_.begin(), running_.end(), subproc);
+      if (running_.end() != end) {
+        finished_.push(subproc);
+        running_.resize(end - running_.begin());
+      }
     }
   }
 
-  return false;
+  return interrupted;
 }
 
 Subprocess* SubprocessSet::NextFinished() {
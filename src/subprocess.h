@@ -15,6 +15,9 @@
 #ifndef NINJA_SUBPROCESS_H_
 #define NINJA_SUBPROCESS_H_
 
+#include <stdio.h>
+
+#include <map>
 #include <string>
 #include <vector>
 #include <queue>
@@ -34,7 +37,19 @@ using namespace std;
 #  endif
 #endif
 
+// Where available, DoWork() waits with epoll or kqueue, which keep the
+// subprocesses' fds registered between calls.
+#if defined(__linux__)
+#  define USE_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__DragonFly__)
+#  define USE_KQUEUE
+#endif
+
 #include "exit_status.h"
+#include "resource_usage.h"
+
+struct AffinitySlot;
 
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
@@ -49,14 +64,35 @@ struct Subprocess {
 
   bool Done() const;
 
+  /// The output, or its first kMaxOutputInMemory bytes if there was more;
+  /// the rest is then in the file TakeOutputSpill() returns.
   const string& GetOutput() const;
 
+  /// Take the file holding the output past GetOutput(), rewound to its
+  /// start, or NULL if it all fit in memory.  The caller closes it.
+  FILE* TakeOutputSpill();
+
+  /// How much output to keep in memory before spilling the rest to a
+  /// temporary file, so that commands printing hundreds of megabytes
+  /// don't make ninja as big.
+  static const size_t kMaxOutputInMemory = 1 << 20;
+
+  /// What the process used, once Finish() reaped it.  A work request
+  /// runs in a worker that keeps running, so it reports nothing.
+  const ResourceUsage& GetUsage() const { return usage_; }
+
  private:
   Subprocess(bool use_console);
-  bool Start(struct SubprocessSet* set, const string& command);
+  bool Start(struct SubprocessSet* set, const string& command, bool use_shell,
+             const AffinitySlot* slot);
   void OnPipeReady();
+  /// Add |len| bytes of output, spilling them if there is too much.
+  void AppendOutput(const char* data, size_t len);
 
   string buf_;
+  /// Where output past kMaxOutputInMemory goes, once there is some.
+  FILE* spill_;
+  ResourceUsage usage_;
 
 #ifdef _WIN32
   /// Set up pipe_ as the parent-side pipe of the subprocess; return the
@@ -66,26 +102,80 @@ struct Subprocess {
   HANDLE child_;
   HANDLE pipe_;
   OVERLAPPED overlapped_;
-  char overlapped_buf_[4 << 10];
+  char overlapped_buf_[64 << 10];
   bool is_reading_;
 #else
+  /// Register fd_ with |set|'s epoll or kqueue fd, if it has one.
+  void Register(struct SubprocessSet* set);
+  /// Close fd_, after unregistering it.  A work request's fd_ belongs to
+  /// the worker, and is only unregistered.
+  void CloseFd();
+  /// Read from the worker of a work request.
+  void OnWorkerReady();
+  /// Take what's left in the pipe once pid_fd_ says the process exited.
+  void OnExited();
+  /// Close pid_fd_, after unregistering it.
+  void ClosePidfd();
+
   int fd_;
   pid_t pid_;
+  /// The epoll or kqueue fd that fd_ is registered with, or -1.
+  int queue_fd_;
+  /// On Linux with an epoll fd, a pidfd for pid_ registered with it until
+  /// the process exits, so that the exit is what finishes the command
+  /// rather than the end of its output; or -1.
+  int pid_fd_;
+
+  /// For a work request, the worker running it until it is done; and the
+  /// exit code the worker reported.
+  bool is_work_request_;
+  struct Worker* worker_;
+  int exit_code_;
 #endif
   bool use_console_;
 
   friend struct SubprocessSet;
 };
 
-/// SubprocessSet runs a ppoll/pselect() loop around a set of Subprocesses.
+#ifndef _WIN32
+/// A persistent worker process (see worker.h), which SubprocessSet keeps
+/// around to run one work request after another.
+struct Worker {
+  /// The command that started it.
+  string command_;
+  pid_t pid_;
+  /// Our ends of its stdin and stdout.
+  int in_fd_;
+  int out_fd_;
+  /// What it wrote that isn't part of a whole response yet.
+  string buf_;
+  /// Set once it misbehaved or went away, so it won't be reused.
+  bool broken_;
+};
+#endif
+
+/// SubprocessSet runs an epoll/kqueue loop, or a ppoll/pselect() one where
+/// those aren't available, around a set of Subprocesses.
 /// DoWork() waits for any state change in subprocesses; finished_
 /// is a queue of subprocesses as they finish.
 struct SubprocessSet {
-  SubprocessSet();
+  /// Use the ppoll/pselect() loop even where epoll or kqueue is available
+  /// if |force_poll|.
+  explicit SubprocessSet(bool force_poll = false);
   ~SubprocessSet();
 
-  Subprocess* Add(const string& command, bool use_console = false);
-  bool DoWork();
+  /// Start running |command|.  On POSIX, a command that needs no shell
+  /// features runs without /bin/sh, unless |use_shell|.  Given a |slot|,
+  /// the command runs pinned to its CPUs, with its number in $NINJA_SLOT.
+  Subprocess* Add(const string& command, bool use_console = false,
+                  bool use_shell = false, const AffinitySlot* slot = NULL);
+  /// Run |command| as a request to a persistent worker started with
+  /// |worker|, keeping the worker for later requests.  Runs it like Add()
+  /// if that isn't possible.
+  Subprocess* AddWorkRequest(const string& worker, const string& command);
+  /// Wait for a state change in the subprocesses, for at most
+  /// |timeout_millis| if that isn't negative.  Returns true if interrupted.
+  bool DoWork(int timeout_millis = -1);
   Subprocess* NextFinished();
   void Clear();
 
@@ -104,6 +194,29 @@ struct SubprocessSet {
 
   static bool IsInterrupted() { return interrupted_ != 0; }
 
+  bool DoWorkPoll(int timeout_millis);
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+  bool DoWorkEventQueue(int timeout_millis);
+#endif
+  /// Queue |subproc|, which is no longer running_, as finished, and make
+  /// its worker available again.
+  void OnFinished(Subprocess* subproc);
+
+  /// Start a worker running |words|.  Returns NULL on failure.
+  Worker* StartWorker(const string& command, const vector<string>& words);
+  void StopWorker(Worker* worker);
+
+  /// All workers, and those of them that aren't running a request.
+  vector<Worker*> workers_;
+  map<string, vector<Worker*> > idle_workers_;
+
+  /// The epoll or kqueue fd that running subprocesses are registered with,
+  /// or -1 when DoWork() polls.
+  int queue_fd_;
+  /// On Linux, a signalfd for the signals that interrupt the build,
+  /// registered with queue_fd_, so that they can stay blocked; or -1.
+  int signal_fd_;
+
   struct sigaction old_int_act_;
   struct sigaction old_term_act_;
   struct sigaction old_hup_act_;
@@ -111,4 +224,12 @@ struct SubprocessSet {
 #endif
 };
 
+#ifndef _WIN32
+/// Split |command| into its words if the shell would do nothing else with
+/// it: no expansions, redirections, operators, assignments or builtins, and
+/// quotes only around text without any of those.  Returns false, and the
+/// command must go through the shell, otherwise.
+bool SplitSimpleCommand(const string& command, vector<string>* words);
+#endif
+
 #endif // NINJA_SUBPROCESS_H_
@@ -0,0 +1,128 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures how many trivial commands SubprocessSet can start and reap per
+// second, keeping a given number of them running at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "subprocess.h"
+#include "util.h"
+
+namespace {
+
+/// Run |count| copies of |command|, with up to |parallelism| at a time.
+/// @return the commands per second, or -1 if one failed.
+double TimeCommands(const string& command, bool use_shell, int count,
+                    int parallelism) {
+  SubprocessSet subprocs;
+  int started = 0;
+  int finished = 0;
+  int64_t start = GetTimeMillis();
+  while (finished < count) {
+    while (started < count && (int)subprocs.running_.size() < parallelism) {
+      if (!subprocs.Add(command, false, use_shell))
+        return -1;
+      ++started;
+    }
+    subprocs.DoWork();
+    while (Subprocess* subproc = subprocs.NextFinished()) {
+      ExitStatus status = subproc->Finish();
+      delete subproc;
+      if (status != ExitSuccess)
+        return -1;
+      ++finished;
+    }
+  }
+  int64_t end = GetTimeMillis();
+  return count * 1000.0 / max(end - start, (int64_t)1);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  int count = 1000;
+  int memory_mb = 0;
+  bool use_shell = false;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("n:m:sh"))) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'm':
+      memory_mb = atoi(optarg);
+      break;
+    case 's':
+      use_shell = true;
+      break;
+    case 'h':
+    default:
+      printf("usage: subprocess_perftest [options]\n"
+"\n"
+"options:\n"
+"  -n N   run N commands at each parallelism [default=1000]\n"
+"  -m MB  first fill MB megabytes of memory, as a ninja holding a large\n"
+"         graph would have; starting commands shouldn't get slower\n"
+"  -s     run the commands through /bin/sh\n"
+             );
+      return 1;
+    }
+  }
+
+  // Touch every page, so that they are all mapped when we spawn.
+  char* ballast = NULL;
+  if (memory_mb > 0) {
+    size_t size = (size_t)memory_mb << 20;
+    ballast = static_cast<char*>(malloc(size));
+    if (!ballast)
+      Fatal("can't allocate %d MB", memory_mb);
+    memset(ballast, 1, size);
+  }
+
+  // A path, as "true" alone is a shell builtin and would go through the
+  // shell.
+#ifdef _WIN32
+  const char* command = "cmd /c exit 0";
+#else
+  const char* command =
+      access("/bin/true", X_OK) == 0 ? "/bin/true" : "/usr/bin/true";
+#endif
+
+  const int kParallelism[] = { 1, 4, 16, 64 };
+  for (size_t i = 0; i < sizeof(kParallelism) / sizeof(kParallelism[0]);
+       ++i) {
+    double rate = TimeCommands(command, use_shell, count, kParallelism[i]);
+    if (rate < 0) {
+      printf("'%s' failed\n", command);
+      return 1;
+    }
+    printf("-j%-3d %8.0f commands/s\n", kParallelism[i], rate);
+  }
+
+  free(ballast);
+  return 0;
+}
@@ -14,6 +14,8 @@
 
 #include "subprocess.h"
 
+#include "affinity.h"
+#include "metrics.h"
 #include "test.h"
 
 #ifndef _WIN32
@@ -36,6 +38,13 @@ struct SubprocessTest : public testing::Test {
   SubprocessSet subprocs_;
 };
 
+/// Runs subprocesses with the ppoll/pselect() loop, even where epoll or
+/// kqueue, which SubprocessTest uses, is available.
+struct SubprocessPollTest : public testing::Test {
+  SubprocessPollTest() : subprocs_(/*force_poll=*/true) {}
+  SubprocessSet subprocs_;
+};
+
 }  // anonymous namespace
 
 // Run a command that fails and emits to stderr.
@@ -174,6 +183,70 @@ TEST_F(SubprocessTest, SetWithSingle) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 
+TEST_F(SubprocessTest, Usage) {
+  Subprocess* subproc = subprocs_.Add(kSimpleCommand);
+  ASSERT_NE((Subprocess *) 0, subproc);
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  // Any process takes some memory.
+  EXPECT_GT(subproc->GetUsage().max_rss, 0u);
+}
+
+#ifndef _WIN32
+TEST_F(SubprocessTest, Slot) {
+  AffinitySlot slot;
+  slot.number = 5;
+  Subprocess* subproc = subprocs_.Add("echo $NINJA_SLOT", false, true, &slot);
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("5\n", subproc->GetOutput());
+}
+
+#ifdef __linux__
+TEST_F(SubprocessTest, SlotPinned) {
+  AffinitySlots slots;
+  string err;
+  ASSERT_TRUE(slots.Init(AffinitySlots::CPU, &err));
+  AffinitySlot* slot = slots.Acquire(NULL);
+  ASSERT_TRUE(slot);
+  Subprocess* subproc =
+      subprocs_.Add("grep Cpus_allowed_list /proc/self/status", false, false,
+                    slot);
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  char expected[64];
+  snprintf(expected, sizeof(expected), "Cpus_allowed_list:\t%d\n",
+           slot->cpus[0]);
+  EXPECT_EQ(expected, subproc->GetOutput());
+}
+#endif
+
+TEST_F(SubprocessTest, Timeout) {
+  Subprocess* subproc = subprocs_.Add("sleep 1");
+  ASSERT_NE((Subprocess *) 0, subproc);
+
+  // Nothing happens within the timeout.
+  int64_t start = GetTimeMillis();
+  EXPECT_FALSE(subprocs_.DoWork(10));
+  EXPECT_LT(GetTimeMillis() - start, 900);
+  EXPECT_FALSE(subproc->Done());
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+}
+#endif
+
 TEST_F(SubprocessTest, SetWithMulti) {
   Subprocess* processes[3];
   const char* kCommands[3] = {
@@ -214,7 +287,7 @@ TEST_F(SubprocessTest, SetWithMulti) {
   }
 }
 
-#if defined(USE_PPOLL)
+#if defined(USE_PPOLL) || defined(USE_EPOLL) || defined(USE_KQUEUE)
 TEST_F(SubprocessTest, SetWithLots) {
   // Arbitrary big number; needs to be over 1024 to confirm we're no longer
   // hostage to pselect.
@@ -243,7 +316,7 @@ TEST_F(SubprocessTest, SetWithLots) {
   }
   ASSERT_EQ(kNumProcs, subprocs_.finished_.size());
 }
-#endif  // !__APPLE__ && !_WIN32
+#endif  // USE_PPOLL || USE_EPOLL || USE_KQUEUE
 
 // TODO: this test could work on Windows, just not sure how to simply
 // read stdin.
@@ -259,3 +332,221 @@ TEST_F(SubprocessTest, ReadStdin) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 #endif  // _WIN32
+
+#ifndef _WIN32
+TEST_F(SubprocessPollTest, SetWithMulti) {
+  const char* kCommands[3] = { kSimpleCommand, "id -u", "pwd" };
+  Subprocess* processes[3];
+  for (int i = 0; i < 3; ++i) {
+    processes[i] = subprocs_.Add(kCommands[i]);
+    ASSERT_NE((Subprocess *) 0, processes[i]);
+  }
+
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+  ASSERT_EQ(3u, subprocs_.finished_.size());
+
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(processes[i]->Done());
+    ASSERT_EQ(ExitSuccess, processes[i]->Finish());
+    ASSERT_NE("", processes[i]->GetOutput());
+    delete processes[i];
+  }
+}
+
+TEST_F(SubprocessPollTest, InterruptParent) {
+  Subprocess* subproc = subprocs_.Add("kill -INT $PPID ; sleep 1");
+  ASSERT_NE((Subprocess *) 0, subproc);
+
+  while (!subproc->Done()) {
+    bool interrupted = subprocs_.DoWork();
+    if (interrupted)
+      return;
+  }
+
+  ASSERT_FALSE("We should have been interrupted");
+}
+
+// Output that arrives in several reads, while other subprocesses finish.
+#ifdef USE_EPOLL
+TEST_F(SubprocessTest, BackgroundChild) {
+  // The command is done once its process exits, even though what it left
+  // in the background holds on to its output.
+  Subprocess* subproc = subprocs_.Add("echo started; sleep 10 & :");
+  ASSERT_NE((Subprocess *) 0, subproc);
+
+  int64_t start = GetTimeMillis();
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("started\n", subproc->GetOutput());
+  EXPECT_LT(GetTimeMillis() - start, 5000);
+}
+#endif  // USE_EPOLL
+
+TEST_F(SubprocessTest, InterleavedOutput) {
+  Subprocess* slow = subprocs_.Add("echo a; sleep 0.1; echo b");
+  Subprocess* fast = subprocs_.Add("echo c");
+  ASSERT_NE((Subprocess *) 0, slow);
+  ASSERT_NE((Subprocess *) 0, fast);
+
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+  ASSERT_EQ(fast, subprocs_.NextFinished());
+  ASSERT_EQ(slow, subprocs_.NextFinished());
+  EXPECT_EQ(ExitSuccess, slow->Finish());
+  EXPECT_EQ(ExitSuccess, fast->Finish());
+  EXPECT_EQ("a\nb\n", slow->GetOutput());
+  EXPECT_EQ("c\n", fast->GetOutput());
+}
+#endif  // _WIN32
+
+#ifndef _WIN32
+TEST(SplitSimpleCommand, Words) {
+  vector<string> words;
+  EXPECT_TRUE(SplitSimpleCommand("  cc -c  foo.c\t-o foo.o ", &words));
+  ASSERT_EQ(5u, words.size());
+  EXPECT_EQ("cc", words[0]);
+  EXPECT_EQ("foo.c", words[2]);
+  EXPECT_EQ("foo.o", words[4]);
+
+  EXPECT_TRUE(SplitSimpleCommand("cc -DA='x y' -DB=\"1\"2 '' -std=c++11",
+                                 &words));
+  ASSERT_EQ(5u, words.size());
+  EXPECT_EQ("-DA=x y", words[1]);
+  EXPECT_EQ("-DB=12", words[2]);
+  EXPECT_EQ("", words[3]);
+  EXPECT_EQ("-std=c++11", words[4]);
+}
+
+TEST(SplitSimpleCommand, NeedsShell) {
+  const char* kCommands[] = {
+    "", "  ", "a && b", "a; b", "a | b", "a > b", "a < b", "a $b", "a `b`",
+    "a \\b", "a *.c", "a ~/b", "a # b", "a\nb", "(a)", "a 'b", "a \"b",
+    "a \"$b\"", "a \"\\\"\"", "A=b a", "cd b", "exit 1", "echo a",
+  };
+  for (size_t i = 0; i < sizeof(kCommands) / sizeof(kCommands[0]); ++i) {
+    vector<string> words;
+    EXPECT_FALSE(SplitSimpleCommand(kCommands[i], &words));
+  }
+}
+
+TEST_F(SubprocessTest, DirectExec) {
+  Subprocess* direct = subprocs_.Add("/bin/echo 'a  b' \"c\"");
+  // Builtins, and programs that can't be run directly, go to the shell.
+  Subprocess* builtin = subprocs_.Add("cd /");
+  Subprocess* forced = subprocs_.Add("/bin/echo a", false, /*use_shell=*/true);
+  ASSERT_NE((Subprocess *) 0, direct);
+  ASSERT_NE((Subprocess *) 0, builtin);
+  ASSERT_NE((Subprocess *) 0, forced);
+
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, direct->Finish());
+  EXPECT_EQ("a  b c\n", direct->GetOutput());
+  EXPECT_EQ(ExitSuccess, builtin->Finish());
+  EXPECT_EQ("", builtin->GetOutput());
+  EXPECT_EQ(ExitSuccess, forced->Finish());
+  EXPECT_EQ("a\n", forced->GetOutput());
+}
+// A worker that answers every request with the number of requests it got,
+// and fails the ones starting with "fail".
+const char kWorker[] =
+    "/bin/sh -c 'n=0; while read -r l; do n=$((n + 1)); c=0; "
+    "case $l in *fail*) c=3;; esac; "
+    "echo \"{\\\"exitCode\\\": $c, \\\"output\\\": \\\"$n $$\\\"}\"; done'";
+
+TEST_F(SubprocessTest, WorkRequests) {
+  Subprocess* first = subprocs_.AddWorkRequest(kWorker, "/bin/sh -c ok");
+  ASSERT_NE((Subprocess *) 0, first);
+  while (!first->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, first->Finish());
+  string output = first->GetOutput();
+  ASSERT_EQ("1 ", output.substr(0, 2));
+  string pid = output.substr(2);
+
+  // The worker is reused, and another one started while it's busy.
+  Subprocess* second = subprocs_.AddWorkRequest(kWorker, "/bin/sh fail");
+  Subprocess* third = subprocs_.AddWorkRequest(kWorker, "/bin/sh ok");
+  ASSERT_NE((Subprocess *) 0, second);
+  ASSERT_NE((Subprocess *) 0, third);
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitFailure, second->Finish());
+  EXPECT_EQ("2 " + pid, second->GetOutput());
+  EXPECT_EQ(ExitSuccess, third->Finish());
+  EXPECT_EQ("1 ", third->GetOutput().substr(0, 2));
+  EXPECT_NE(pid, third->GetOutput().substr(2));
+  EXPECT_EQ(3u, subprocs_.finished_.size());
+}
+
+TEST_F(SubprocessPollTest, WorkRequests) {
+  for (int i = 1; i <= 2; ++i) {
+    Subprocess* subproc = subprocs_.AddWorkRequest(kWorker, "/bin/sh ok");
+    ASSERT_NE((Subprocess *) 0, subproc);
+    while (!subproc->Done())
+      subprocs_.DoWork();
+    EXPECT_EQ(ExitSuccess, subproc->Finish());
+    EXPECT_EQ('0' + i, subproc->GetOutput()[0]);
+    delete subproc;
+  }
+}
+
+TEST_F(SubprocessTest, BrokenWorker) {
+  // A worker that exits reports an error.
+  Subprocess* subproc = subprocs_.AddWorkRequest("/bin/sh -c 'read -r l'",
+                                                 "/bin/sh a");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitFailure, subproc->Finish());
+  EXPECT_EQ("ninja: worker '/bin/sh -c 'read -r l'' exited\n",
+            subproc->GetOutput());
+
+  // Without a worker, the command runs as usual.
+  subproc = subprocs_.AddWorkRequest("ninja_no_such_worker", "/bin/echo a");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("a\n", subproc->GetOutput());
+}
+
+TEST_F(SubprocessTest, SpillsLargeOutput) {
+  // Output past what is kept in memory goes to a file.
+  Subprocess* subproc = subprocs_.Add("head -c 3000000 /dev/zero");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+
+  size_t in_memory = subproc->GetOutput().size();
+  EXPECT_GT(in_memory, 0u);
+  EXPECT_LE(in_memory, Subprocess::kMaxOutputInMemory);
+  FILE* spill = subproc->TakeOutputSpill();
+  ASSERT_TRUE(spill != NULL);
+  EXPECT_TRUE(subproc->TakeOutputSpill() == NULL);
+  size_t spilled = 0;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), spill)) > 0)
+    spilled += len;
+  fclose(spill);
+  EXPECT_EQ(3000000u, in_memory + spilled);
+  delete subproc;
+
+  // Small output stays in memory.
+  subproc = subprocs_.Add("/bin/echo a");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("a\n", subproc->GetOutput());
+  EXPECT_TRUE(subproc->TakeOutputSpill() == NULL);
+  delete subproc;
+}
+#endif  // _WIN32
+
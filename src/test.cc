@@ -123,14 +123,14 @@ void VerifyGraph(const State& state) {
     // All edges need at least one output.
     EXPECT_FALSE((*e)->outputs_.empty());
     // Check that the edge's inputs have the edge as out-edge.
-    for (vector<Node*>::const_iterator in_node = (*e)->inputs_.begin();
+    for (Node* const* in_node = (*e)->inputs_.begin();
          in_node != (*e)->inputs_.end(); ++in_node) {
-      const vector<Edge*>& out_edges = (*in_node)->out_edges();
+      const SmallVector<Edge*, 2>& out_edges = (*in_node)->out_edges();
       EXPECT_NE(find(out_edges.begin(), out_edges.end(), *e),
                 out_edges.end());
     }
     // Check that the edge's outputs have the edge as in-edge.
-    for (vector<Node*>::const_iterator out_node = (*e)->outputs_.begin();
+    for (Node* const* out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
       EXPECT_EQ((*out_node)->in_edge(), *e);
     }
@@ -151,12 +151,14 @@ void VerifyGraph(const State& state) {
 
 void VirtualFileSystem::Create(const string& path,
                                const string& contents) {
+  std::lock_guard<std::mutex> lock(mutex_);
   files_[path].mtime = now_;
   files_[path].contents = contents;
   files_created_.insert(path);
 }
 
 TimeStamp VirtualFileSystem::Stat(const string& path, string* err) const {
+  std::lock_guard<std::mutex> lock(mutex_);
   FileMap::const_iterator i = files_.find(path);
   if (i != files_.end()) {
     *err = i->second.stat_error;
@@ -170,7 +172,18 @@ bool VirtualFileSystem::WriteFile(const string& path, const string& contents) {
   return true;
 }
 
+bool VirtualFileSystem::LinkFile(const string& from, const string& to) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FileMap::iterator i = files_.find(from);
+  if (i == files_.end() || files_.count(to))
+    return false;
+  files_[to] = i->second;
+  files_linked_.insert(to);
+  return true;
+}
+
 bool VirtualFileSystem::MakeDir(const string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
   directories_made_.push_back(path);
   return true;  // success
 }
@@ -178,6 +191,7 @@ bool VirtualFileSystem::MakeDir(const string& path) {
 FileReader::Status VirtualFileSystem::ReadFile(const string& path,
                                                string* contents,
                                                string* err) {
+  std::lock_guard<std::mutex> lock(mutex_);
   files_read_.push_back(path);
   FileMap::iterator i = files_.find(path);
   if (i != files_.end()) {
@@ -188,7 +202,18 @@ FileReader::Status VirtualFileSystem::ReadFile(const string& path,
   return NotFound;
 }
 
+int64_t VirtualFileSystem::Prefetch(const string& path, int64_t max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FileMap::iterator i = files_.find(path);
+  if (i == files_.end() || i->second.contents.empty() ||
+      (int64_t)i->second.contents.size() > max_bytes)
+    return 0;
+  files_prefetched_.push_back(path);
+  return i->second.contents.size();
+}
+
 int VirtualFileSystem::RemoveFile(const string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
   if (find(directories_made_.begin(), directories_made_.end(), path)
       != directories_made_.end())
     return -1;
@@ -15,6 +15,8 @@
 #ifndef NINJA_TEST_H_
 #define NINJA_TEST_H_
 
+#include <mutex>
+
 #include "disk_interface.h"
 #include "manifest_parser.h"
 #include "state.h"
@@ -131,6 +133,8 @@ void VerifyGraph(const State& state);
 /// An implementation of DiskInterface that uses an in-memory representation
 /// of disk state.  It also logs file accesses and directory creations
 /// so it can be used by tests to verify disk access patterns.
+/// The DiskInterface methods may be called from the builder's deps
+/// threads, so they take |mutex_|.
 struct VirtualFileSystem : public DiskInterface {
   VirtualFileSystem() : now_(1) {}
 
@@ -139,33 +143,41 @@ struct VirtualFileSystem : public DiskInterface {
 
   /// Tick "time" forwards; subsequent file operations will be newer than
   /// previous ones.
-  int Tick() {
+  TimeStamp Tick() {
     return ++now_;
   }
 
   // DiskInterface
   virtual TimeStamp Stat(const string& path, string* err) const;
   virtual bool WriteFile(const string& path, const string& contents);
+  virtual bool LinkFile(const string& from, const string& to);
   virtual bool MakeDir(const string& path);
   virtual Status ReadFile(const string& path, string* contents, string* err);
   virtual int RemoveFile(const string& path);
+  virtual int64_t Prefetch(const string& path, int64_t max_bytes);
+  virtual TimeStamp Now() const { return now_; }
 
   /// An entry for a single in-memory file.
   struct Entry {
-    int mtime;
+    TimeStamp mtime;
     string stat_error;  // If mtime is -1.
     string contents;
   };
 
   vector<string> directories_made_;
   vector<string> files_read_;
+  vector<string> files_prefetched_;
   typedef map<string, Entry> FileMap;
   FileMap files_;
   set<string> files_removed_;
   set<string> files_created_;
+  /// The files created by LinkFile(), which copies them.
+  set<string> files_linked_;
 
   /// A simple fake timestamp for file operations.
-  int now_;
+  TimeStamp now_;
+
+  mutable std::mutex mutex_;
 };
 
 struct ScopedTempDir {
@@ -35,11 +35,18 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #endif
 
 #include <vector>
 
+#if defined(NINJA_HAVE_SSE2)
+#include <emmintrin.h>
+#elif defined(NINJA_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(__APPLE__) || defined(__FreeBSD__)
 #include <sys/sysctl.h>
 #elif defined(__SVR4) && defined(__sun)
@@ -110,6 +117,46 @@ static bool IsPathSeparator(char c) {
 #endif
 }
 
+/// Return the first path separator in [p, end), or |end| if there is none.
+/// Path components are mostly longer than a few bytes, so where the target
+/// has SSE2 or NEON this looks at 16 bytes at a time.
+static inline const char* FindPathSeparator(const char* p, const char* end) {
+#if defined(NINJA_HAVE_SSE2)
+  const __m128i slash = _mm_set1_epi8('/');
+#ifdef _WIN32
+  const __m128i backslash = _mm_set1_epi8('\\');
+#endif
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hits = _mm_cmpeq_epi8(chunk, slash);
+#ifdef _WIN32
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, backslash));
+#endif
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+    if (mask)
+      return p + CountTrailingZeros(mask);
+  }
+#elif defined(NINJA_HAVE_NEON)
+  const uint8x16_t slash = vdupq_n_u8('/');
+#ifdef _WIN32
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+#endif
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t hits = vceqq_u8(chunk, slash);
+#ifdef _WIN32
+    hits = vorrq_u8(hits, vceqq_u8(chunk, backslash));
+#endif
+    // NEON has no movemask; finish the chunk with the scalar loop below.
+    if (vmaxvq_u8(hits))
+      break;
+  }
+#endif
+  while (p < end && !IsPathSeparator(*p))
+    ++p;
+  return p;
+}
+
 bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
                       string* err) {
   // WARNING: this function is performance-critical; please benchmark
@@ -177,8 +224,13 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
     components[component_count] = dst;
     ++component_count;
 
-    while (src != end && !IsPathSeparator(*src))
-      *dst++ = *src++;
+    // Until a component has been dropped the path is rewritten in place, so
+    // the component only needs to be skipped over, not copied.
+    const char* sep = FindPathSeparator(src, end);
+    if (dst != src)
+      memmove(dst, src, sep - src);
+    dst += sep - src;
+    src = sep;
     *dst++ = *src++;  // Copy '/' or final \0 character as well.
   }
 
@@ -192,15 +244,16 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
   uint64_t bits = 0;
   uint64_t bits_mask = 1;
 
-  for (char* c = start; c < start + *len; ++c) {
-    switch (*c) {
-      case '\\':
-        bits |= bits_mask;
-        *c = '/';
-        NINJA_FALLTHROUGH;
-      case '/':
-        bits_mask <<= 1;
+  const char* path_end = start + *len;
+  for (char* c = start; ; ++c) {
+    c = const_cast<char*>(FindPathSeparator(c, path_end));
+    if (c == path_end)
+      break;
+    if (*c == '\\') {
+      bits |= bits_mask;
+      *c = '/';
     }
+    bits_mask <<= 1;
   }
 
   *slash_bits = bits;
@@ -237,14 +290,14 @@ static inline bool IsKnownWin32SafeCharacter(char ch) {
   }
 }
 
-static inline bool StringNeedsShellEscaping(const string& input) {
+bool StringNeedsShellEscaping(const string& input) {
   for (size_t i = 0; i < input.size(); ++i) {
     if (!IsKnownShellSafeCharacter(input[i])) return true;
   }
   return false;
 }
 
-static inline bool StringNeedsWin32Escaping(const string& input) {
+bool StringNeedsWin32Escaping(const string& input) {
   for (size_t i = 0; i < input.size(); ++i) {
     if (!IsKnownWin32SafeCharacter(input[i])) return true;
   }
@@ -372,6 +425,75 @@ int ReadFile(const string& path, string* contents, string* err) {
 #endif
 }
 
+int MappedFile::Map(const string& path, string* err, bool nul_terminated) {
+  Unmap();
+#ifdef _WIN32
+  // Windows can't delete or rename a mapped file, which the logs' recompaction
+  // needs; read it instead.
+  string contents;
+  int ret = ReadFile(path, &contents, err);
+  if (ret < 0)
+    return ret;
+  Take(&contents);
+  return 0;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int ret = errno;
+    err->assign(strerror(ret));
+    close(fd);
+    return -ret;
+  }
+  // The rest of the last page of a mapping reads as zeros, which gives a
+  // nul after the contents unless they fill the page; read those instead.
+  if (nul_terminated && st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+    close(fd);
+    string contents;
+    int ret = ReadFile(path, &contents, err);
+    if (ret < 0)
+      return ret;
+    Take(&contents);
+    return 0;
+  }
+  // mmap() refuses empty mappings.
+  if (st.st_size > 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      int ret = errno;
+      err->assign(strerror(ret));
+      close(fd);
+      return -ret;
+    }
+    data_ = static_cast<const char*>(data);
+    size_ = st.st_size;
+  }
+  close(fd);
+  return 0;
+#endif
+}
+
+void MappedFile::Unmap() {
+#ifndef _WIN32
+  if (data_ && data_ != contents_.c_str())
+    munmap(const_cast<char*>(data_), size_);
+#endif
+  contents_.clear();
+  data_ = NULL;
+  size_ = 0;
+}
+
+void MappedFile::Take(string* contents) {
+  Unmap();
+  contents_.swap(*contents);
+  data_ = contents_.c_str();
+  size_ = contents_.size();
+}
+
 void SetCloseOnExec(int fd) {
 #ifndef _WIN32
   int flags = fcntl(fd, F_GETFD);
@@ -613,6 +735,46 @@ string ElideMiddle(const string& str, size_t width) {
   return result;
 }
 
+bool ParseMemorySize(const string& value, int64_t* kilobytes) {
+  const char* str = value.c_str();
+  char* end;
+  errno = 0;
+  double amount = strtod(str, &end);
+  if (end == str || errno != 0 || !(amount >= 0))
+    return false;
+  double scale = 1.0 / 1024;
+  switch (*end) {
+  case 'k': case 'K': scale = 1; ++end; break;
+  case 'm': case 'M': scale = 1024; ++end; break;
+  case 'g': case 'G': scale = 1024.0 * 1024; ++end; break;
+  case 't': case 'T': scale = 1024.0 * 1024 * 1024; ++end; break;
+  }
+  if (*end != '\0')
+    return false;
+  amount *= scale;
+  if (amount >= 9e18)
+    return false;
+  // Round bytes up to a kilobyte.
+  *kilobytes = (int64_t)amount;
+  if (*kilobytes < amount)
+    ++*kilobytes;
+  return true;
+}
+
+string RemapPath(const string& path, const PathRemaps& remaps) {
+  for (PathRemaps::const_iterator r = remaps.begin(); r != remaps.end();
+       ++r) {
+    const string& from = r->first;
+    if (from.empty() || path.compare(0, from.size(), from) != 0)
+      continue;
+    if (path.size() != from.size() && from[from.size() - 1] != '/' &&
+        path[from.size()] != '/')
+      continue;
+    return r->second + path.substr(from.size());
+  }
+  return path;
+}
+
 bool Truncate(const string& path, size_t size, string* err) {
 #ifdef _WIN32
   int fh = _sopen(path.c_str(), _O_RDWR | _O_CREAT, _SH_DENYNO,
@@ -48,6 +48,30 @@ NORETURN void Fatal(const char* msg, ...);
 #define NINJA_FALLTHROUGH
 #endif
 
+// The vector instructions that the byte-scanning fast paths (in
+// CanonicalizePath and the lexer) can use without a runtime check.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NINJA_HAVE_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define NINJA_HAVE_NEON
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/// Return the index of the lowest set bit in |mask|, which mustn't be 0.
+inline int CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
 /// Log a warning message.
 void Warning(const char* msg, ...);
 
@@ -68,11 +92,45 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
 void GetShellEscapedString(const string& input, string* result);
 void GetWin32EscapedString(const string& input, string* result);
 
+/// Whether the functions above would change |input| rather than append it
+/// as it is.
+bool StringNeedsShellEscaping(const string& input);
+bool StringNeedsWin32Escaping(const string& input);
+
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
 int ReadFile(const string& path, string* contents, string* err);
 
+/// A read-only view of a whole file's contents: mmap()ed where that's
+/// available, read into memory elsewhere.
+struct MappedFile {
+  MappedFile() : data_(NULL), size_(0) {}
+  ~MappedFile() { Unmap(); }
+
+  /// Map the file at |path|, replacing any previous mapping.  With
+  /// |nul_terminated|, a nul byte follows the contents (outside size()),
+  /// as the lexer needs.
+  /// Returns -errno and fills in \a err on error.
+  int Map(const string& path, string* err, bool nul_terminated = false);
+  void Unmap();
+
+  /// Hold |*contents|, which is left empty, in place of a mapping.
+  void Take(string* contents);
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+  /// The contents, when they were read rather than mapped.
+  string contents_;
+
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+};
+
 /// Mark a file descriptor to not be inherited on exec()s.
 void SetCloseOnExec(int fd);
 
@@ -101,6 +159,18 @@ double GetLoadAverage();
 /// exceeds @a width.
 string ElideMiddle(const string& str, size_t width);
 
+/// Parse an amount of memory like "512M" or "64G" into @a kilobytes.
+/// The suffixes K, M, G and T stand for powers of 1024; a number without
+/// one is in bytes.  @return false if @a value isn't such an amount.
+bool ParseMemorySize(const string& value, int64_t* kilobytes);
+
+/// Prefixes of paths to replace, each with the one to put in its place.
+typedef vector<pair<string, string> > PathRemaps;
+
+/// Replace the prefix of |path| by the first of |remaps| whose first
+/// member is a leading part of it, ending at a path separator.
+string RemapPath(const string& path, const PathRemaps& remaps);
+
 /// Truncates a file to the given size.
 bool Truncate(const string& path, size_t size, string* err);
 
@@ -258,6 +258,11 @@ TEST(CanonicalizePath, SlashTracking) {
   EXPECT_TRUE(CanonicalizePath(&path, &slash_bits, &err));
   EXPECT_EQ("a/foo.h", path);
   EXPECT_EQ(1, slash_bits);
+  path = "third_party\\WebKit\\Source/WebCore\\platform_leveldb_dir\\x.cpp";
+  EXPECT_TRUE(CanonicalizePath(&path, &slash_bits, &err));
+  EXPECT_EQ("third_party/WebKit/Source/WebCore/platform_leveldb_dir/x.cpp",
+            path);
+  EXPECT_EQ(27, slash_bits);
 }
 
 TEST(CanonicalizePath, CanonicalizeNotExceedingLen) {
@@ -349,6 +354,27 @@ TEST(CanonicalizePath, AbsolutePath) {
   EXPECT_EQ("/usr/include/stdio.h", path);
 }
 
+TEST(CanonicalizePath, LongComponents) {
+  // Components longer than the 16-byte chunks the separator scan works on,
+  // both left in place and moved back over a removed component.
+  string path, err;
+  path = "third_party/WebKit/Source/WebCore/LevelDBWriteBatch.cpp";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("third_party/WebKit/Source/WebCore/LevelDBWriteBatch.cpp", path);
+
+  path = "./third_party//WebKit/./Source/WebCore/../LevelDBWriteBatch.cpp";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("third_party/WebKit/Source/LevelDBWriteBatch.cpp", path);
+
+  path = "out/gen/../../a_very_long_directory_name_indeed/another_one/x.h";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("a_very_long_directory_name_indeed/another_one/x.h", path);
+
+  path = "a_very_long_directory_name_indeed/";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("a_very_long_directory_name_indeed", path);
+}
+
 TEST(CanonicalizePath, NotNullTerminated) {
   string path;
   string err;
@@ -426,6 +452,46 @@ TEST(ElideMiddle, NothingToElide) {
   EXPECT_EQ("...", ElideMiddle(input, 3));
 }
 
+TEST(ParseMemorySize, Suffixes) {
+  int64_t kilobytes;
+  EXPECT_TRUE(ParseMemorySize("2048", &kilobytes));
+  EXPECT_EQ(2, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("1", &kilobytes));
+  EXPECT_EQ(1, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("0", &kilobytes));
+  EXPECT_EQ(0, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("100K", &kilobytes));
+  EXPECT_EQ(100, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("512m", &kilobytes));
+  EXPECT_EQ(512 * 1024, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("1.5G", &kilobytes));
+  EXPECT_EQ(3 * 512 * 1024, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("64G", &kilobytes));
+  EXPECT_EQ(64LL * 1024 * 1024, kilobytes);
+  EXPECT_TRUE(ParseMemorySize("2T", &kilobytes));
+  EXPECT_EQ(2LL * 1024 * 1024 * 1024, kilobytes);
+}
+
+TEST(ParseMemorySize, Invalid) {
+  int64_t kilobytes;
+  EXPECT_FALSE(ParseMemorySize("", &kilobytes));
+  EXPECT_FALSE(ParseMemorySize("G", &kilobytes));
+  EXPECT_FALSE(ParseMemorySize("-1G", &kilobytes));
+  EXPECT_FALSE(ParseMemorySize("64GB", &kilobytes));
+  EXPECT_FALSE(ParseMemorySize("64 G", &kilobytes));
+}
+
+TEST(RemapPath, Prefixes) {
+  PathRemaps remaps;
+  remaps.push_back(make_pair("/ci/shard1", "/home/me/src"));
+  remaps.push_back(make_pair("/ci/", "/tmp/"));
+  EXPECT_EQ("/home/me/src/foo.h", RemapPath("/ci/shard1/foo.h", remaps));
+  EXPECT_EQ("/home/me/src", RemapPath("/ci/shard1", remaps));
+  // Only whole path components match.
+  EXPECT_EQ("/tmp/shard10/foo.h", RemapPath("/ci/shard10/foo.h", remaps));
+  EXPECT_EQ("foo.h", RemapPath("foo.h", remaps));
+}
+
 TEST(ElideMiddle, ElideInTheMiddle) {
   string input = "01234567890123456789";
   string elided = ElideMiddle(input, 10);
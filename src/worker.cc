@@ -0,0 +1,266 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+void EncodeString(const string& str, string* out) {
+  *out += '"';
+  for (size_t i = 0; i < str.size(); ++i) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      *out += '\\';
+      *out += c;
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      *out += escape;
+    } else {
+      *out += c;
+    }
+  }
+  *out += '"';
+}
+
+void AppendUtf8(unsigned code_point, string* out) {
+  if (code_point < 0x80) {
+    *out += (char)code_point;
+  } else if (code_point < 0x800) {
+    *out += (char)(0xc0 | code_point >> 6);
+    *out += (char)(0x80 | (code_point & 0x3f));
+  } else if (code_point < 0x10000) {
+    *out += (char)(0xe0 | code_point >> 12);
+    *out += (char)(0x80 | (code_point >> 6 & 0x3f));
+    *out += (char)(0x80 | (code_point & 0x3f));
+  } else {
+    *out += (char)(0xf0 | code_point >> 18);
+    *out += (char)(0x80 | (code_point >> 12 & 0x3f));
+    *out += (char)(0x80 | (code_point >> 6 & 0x3f));
+    *out += (char)(0x80 | (code_point & 0x3f));
+  }
+}
+
+/// Reads the JSON of a response, which may not have arrived completely.
+struct ResponseReader {
+  enum Status { kOk, kIncomplete, kMalformed };
+
+  explicit ResponseReader(const string& data) : data_(data), pos_(0) {}
+
+  void SkipSpace() {
+    while (pos_ < data_.size() && data_[pos_] && strchr(" \t\r\n", data_[pos_]))
+      ++pos_;
+  }
+
+  /// Skip whitespace and then |c|.
+  Status Expect(char c) {
+    bool found;
+    Status status = Accept(c, &found);
+    if (status == kOk && !found)
+      return kMalformed;
+    return status;
+  }
+
+  /// Skip whitespace, and then |c| if it's next.
+  Status Accept(char c, bool* found) {
+    SkipSpace();
+    if (pos_ == data_.size())
+      return kIncomplete;
+    *found = data_[pos_] == c;
+    if (*found)
+      ++pos_;
+    return kOk;
+  }
+
+  /// Read the 4 hex digits of a \u escape.
+  Status ReadHex(unsigned* value) {
+    if (pos_ + 4 > data_.size())
+      return kIncomplete;
+    char digits[5] = { 0 };
+    memcpy(digits, data_.data() + pos_, 4);
+    char* end;
+    *value = strtoul(digits, &end, 16);
+    if (end != digits + 4)
+      return kMalformed;
+    pos_ += 4;
+    return kOk;
+  }
+
+  Status ReadString(string* str) {
+    Status status = Expect('"');
+    if (status != kOk)
+      return status;
+    for (;;) {
+      if (pos_ == data_.size())
+        return kIncomplete;
+      char c = data_[pos_++];
+      if (c == '"')
+        return kOk;
+      if (c != '\\') {
+        *str += c;
+        continue;
+      }
+      if (pos_ == data_.size())
+        return kIncomplete;
+      const char* kEscapes = "\"\"\\\\//b\bf\fn\nr\rt\t";
+      c = data_[pos_++];
+      const char* escape = c ? strchr(kEscapes, c) : NULL;
+      if (c != 'u') {
+        if (!escape || (escape - kEscapes) % 2)
+          return kMalformed;
+        *str += escape[1];
+        continue;
+      }
+      unsigned code_point;
+      if ((status = ReadHex(&code_point)) != kOk)
+        return status;
+      if (code_point >= 0xd800 && code_point < 0xdc00) {
+        // The first half of a surrogate pair.
+        if (pos_ + 2 > data_.size())
+          return kIncomplete;
+        if (data_.compare(pos_, 2, "\\u") != 0)
+          return kMalformed;
+        pos_ += 2;
+        unsigned low;
+        if ((status = ReadHex(&low)) != kOk)
+          return status;
+        if (low < 0xdc00 || low >= 0xe000)
+          return kMalformed;
+        code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+      }
+      AppendUtf8(code_point, str);
+    }
+  }
+
+  /// Read a number, true, false or null.
+  Status ReadLiteral(string* literal) {
+    SkipSpace();
+    size_t start = pos_;
+    while (pos_ < data_.size() && data_[pos_] &&
+           strchr("+-.0123456789Eeaflnrstu", data_[pos_]))
+      ++pos_;
+    // A literal can only end in the middle of a value, or at the end of
+    // the data if it isn't complete yet.
+    if (pos_ == data_.size())
+      return kIncomplete;
+    if (pos_ == start)
+      return kMalformed;
+    literal->assign(data_, start, pos_ - start);
+    return kOk;
+  }
+
+  /// Read the members of an object, after its '{'.  Those that make up a
+  /// response go to |exit_code| and |output| if they aren't NULL.
+  Status ReadObject(int* exit_code, string* output) {
+    bool end;
+    Status status = Accept('}', &end);
+    if (status != kOk || end)
+      return status;
+    for (;;) {
+      string key;
+      if ((status = ReadString(&key)) != kOk || (status = Expect(':')) != kOk)
+        return status;
+      if (exit_code && key == "exitCode") {
+        string literal;
+        if ((status = ReadLiteral(&literal)) != kOk)
+          return status;
+        char* end;
+        *exit_code = strtol(literal.c_str(), &end, 10);
+        if (*end)
+          return kMalformed;
+      } else if (output && key == "output") {
+        output->clear();
+        if ((status = ReadString(output)) != kOk)
+          return status;
+      } else if ((status = SkipValue()) != kOk) {
+        return status;
+      }
+      if ((status = Accept('}', &end)) != kOk || end)
+        return status;
+      if ((status = Expect(',')) != kOk)
+        return status;
+    }
+  }
+
+  /// Skip the elements of an array, after its '['.
+  Status SkipArray() {
+    bool end;
+    Status status = Accept(']', &end);
+    if (status != kOk || end)
+      return status;
+    for (;;) {
+      if ((status = SkipValue()) != kOk)
+        return status;
+      if ((status = Accept(']', &end)) != kOk || end)
+        return status;
+      if ((status = Expect(',')) != kOk)
+        return status;
+    }
+  }
+
+  /// Skip any value.
+  Status SkipValue() {
+    SkipSpace();
+    if (pos_ == data_.size())
+      return kIncomplete;
+    char c = data_[pos_];
+    if (c == '"') {
+      string str;
+      return ReadString(&str);
+    }
+    if (c == '{' || c == '[') {
+      ++pos_;
+      return c == '{' ? ReadObject(NULL, NULL) : SkipArray();
+    }
+    string literal;
+    return ReadLiteral(&literal);
+  }
+
+  const string& data_;
+  size_t pos_;
+};
+
+}  // anonymous namespace
+
+string EncodeWorkRequest(const vector<string>& args) {
+  string request = "{\"arguments\":[";
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (i)
+      request += ',';
+    EncodeString(args[i], &request);
+  }
+  request += "],\"requestId\":0}\n";
+  return request;
+}
+
+int ParseWorkResponse(const string& data, int* exit_code, string* output,
+                      string* err) {
+  ResponseReader reader(data);
+  *exit_code = 0;
+  output->clear();
+  ResponseReader::Status status = reader.Expect('{');
+  if (status == ResponseReader::kOk)
+    status = reader.ReadObject(exit_code, output);
+
+  if (status == ResponseReader::kOk)
+    return reader.pos_;
+  if (status == ResponseReader::kIncomplete)
+    return 0;
+  *err = "malformed response from worker";
+  return -1;
+}
@@ -0,0 +1,40 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_WORKER_H_
+#define NINJA_WORKER_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+// Persistent workers are long-lived processes that run the commands of a
+// rule one at a time, which saves starting a compiler for each of them.
+// They speak Bazel's JSON worker protocol: ninja writes a request like
+//   {"arguments":["-c","foo.c"],"requestId":0}
+// followed by a newline to a worker's stdin, and the worker answers on
+// its stdout with a response like
+//   {"exitCode":0,"output":"warning: ...\n","requestId":0}
+// before it gets the next request.  Workers exit when their stdin closes.
+
+/// The request to run a command with |args|, as it goes to the worker.
+string EncodeWorkRequest(const vector<string>& args);
+
+/// Parse the response at the start of |data|.  Returns the number of bytes
+/// it took, 0 if |data| doesn't hold all of it yet, or -1 if it's malformed,
+/// and sets |err|.
+int ParseWorkResponse(const string& data, int* exit_code, string* output,
+                      string* err);
+
+#endif  // NINJA_WORKER_H_
@@ -0,0 +1,72 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker.h"
+
+#include "test.h"
+
+namespace {
+
+TEST(WorkerTest, EncodeRequest) {
+  vector<string> args;
+  EXPECT_EQ("{\"arguments\":[],\"requestId\":0}\n", EncodeWorkRequest(args));
+  args.push_back("-c");
+  args.push_back("a \"b\"\\c\n");
+  EXPECT_EQ("{\"arguments\":[\"-c\",\"a \\\"b\\\"\\\\c\\u000a\"],"
+            "\"requestId\":0}\n",
+            EncodeWorkRequest(args));
+}
+
+TEST(WorkerTest, ParseResponse) {
+  string response =
+      " {\"exitCode\": 2, \"output\": \"error\\n\\u00e9\\ud83d\\ude00\\\"\","
+      " \"requestId\": 0, \"other\": [1, {\"a\": null}, true]}\n{";
+  int exit_code;
+  string output, err;
+  EXPECT_EQ((int)response.size() - 2,
+            ParseWorkResponse(response, &exit_code, &output, &err));
+  EXPECT_EQ(2, exit_code);
+  EXPECT_EQ("error\n\xc3\xa9\xf0\x9f\x98\x80\"", output);
+
+  EXPECT_EQ(2, ParseWorkResponse("{}", &exit_code, &output, &err));
+  EXPECT_EQ(0, exit_code);
+  EXPECT_EQ("", output);
+  EXPECT_EQ("", err);
+}
+
+TEST(WorkerTest, ParseIncompleteResponse) {
+  string response = "{\"exitCode\":1,\"output\":\"ab\\u0063\",\"x\":[{}]}";
+  for (size_t size = 0; size < response.size(); ++size) {
+    int exit_code;
+    string output, err;
+    EXPECT_EQ(0, ParseWorkResponse(response.substr(0, size), &exit_code,
+                                   &output, &err));
+    EXPECT_EQ("", err);
+  }
+}
+
+TEST(WorkerTest, ParseMalformedResponse) {
+  const char* kResponses[] = {
+    "[]", "x", "{\"exitCode\":\"1\"}", "{\"output\":1}", "{\"a\":1 \"b\":2}",
+    "{\"a\":1,}", "{\"a\":\"\\q\"}", "{\"a\":\"\\u00zz\"}", "{1:2}",
+  };
+  for (size_t i = 0; i < sizeof(kResponses) / sizeof(kResponses[0]); ++i) {
+    int exit_code;
+    string output, err;
+    EXPECT_EQ(-1, ParseWorkResponse(kResponses[i], &exit_code, &output, &err));
+    EXPECT_EQ("malformed response from worker", err);
+  }
+}
+
+}  // anonymous namespace